@@ -234,9 +234,17 @@ typedef struct hfsmount {
 	 */
 	
 	/* Normal Allocation Tree */
-	extent_tree_offset_t offset_tree;
+	extent_tree_t		extent_tree;
 	u_int32_t 			offset_free_extents;  /* number of free extents managed by tree */
 	u_int32_t			offset_block_end;
+
+	/*
+	 * Extents freed by transactions that the journal has since committed,
+	 * waiting to be merged into extent_tree by the next allocator call.
+	 * Protected by vcbFreeExtLock rather than the bitmap lock, because the
+	 * journal reports them from its trim callback.
+	 */
+	extent_node_t		*offset_pending_frees;
 #endif
 	
 	/* 
@@ -420,6 +428,24 @@ enum privdirtype {FILE_HARDLINKS, DIR_HARDLINKS};
 #define HFS_ALLOC_TREEBUILD_INFLIGHT	0x000010
 #define HFS_ALLOC_TEARDOWN_INFLIGHT		0x000020
 
+/*
+ * Allocator statistics, summed over all HFS volumes and exported read-only
+ * as vfs.generic.hfs.alloc_stats.  Times are in nanoseconds.  Comparing
+ * the bitmap and tree pairs shows what the red-black tree allocator saves.
+ */
+struct hfs_alloc_stats {
+	int64_t		has_bitmap_allocs;		/* allocations that scanned the bitmap */
+	int64_t		has_bitmap_time;		/* total time spent in those scans */
+	int64_t		has_tree_allocs;		/* allocations served by the extent tree */
+	int64_t		has_tree_time;			/* total time spent in tree lookups */
+	int64_t		has_tree_bestfit;		/* contiguous requests placed by best fit */
+	int64_t		has_tree_builds;		/* extent trees fully built */
+	int64_t		has_tree_build_time;	/* total time spent building them */
+	int64_t		has_deferred_frees;		/* extents added to a tree after journal commit */
+	int64_t		has_dropped_frees;		/* committed frees that could not be queued */
+	int64_t		has_tree_errors;		/* trees torn down after an inconsistency */
+};
+
 /* HFS mount point flags */
 #define HFS_READ_ONLY             0x00001
 #define HFS_UNKNOWN_PERMS         0x00002
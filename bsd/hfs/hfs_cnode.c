@@ -783,7 +783,7 @@ hfs_filedone(struct vnode *vp, vfs_context_t context)
 	 * Explicitly zero out the areas of file
 	 * that are currently marked invalid.
 	 */
-	while ((invalid_range = TAILQ_FIRST(&fp->ff_invalidranges))) {
+	while ((invalid_range = rl_first(&fp->ff_invalidranges))) {
 		off_t start = invalid_range->rl_start;
 		off_t end = invalid_range->rl_end;
 	
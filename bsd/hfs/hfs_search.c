@@ -49,6 +49,7 @@
 #include <sys/kauth.h>
 #include <sys/vnode_internal.h>
 #include <sys/mount_internal.h>
+#include <sys/sysctl.h>
 
 #if CONFIG_MACF
 #include <security/mac_framework.h>
@@ -68,6 +69,14 @@
 
 #if CONFIG_SEARCHFS
 
+/*
+ * Number of catalog read-ahead runs (of kCatSearchRunSize bytes each) kept
+ * in flight by searchfs.  Zero scans the catalog sequentially.
+ */
+static u_int32_t hfs_search_runs = 4;
+SYSCTL_DECL(_vfs_generic_hfs);
+SYSCTL_UINT(_vfs_generic_hfs, OID_AUTO, search_runs, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_search_runs, 0, "Catalog read-ahead runs in flight during searchfs");
+
 /* Search criterea. */
 struct directoryInfoSpec
 {
@@ -345,6 +354,14 @@ hfs_vnop_search(ap)
 
 	if (throttle_get_io_policy(&ut) == IOPOL_THROTTLE)
 		needThrottle = TRUE;
+
+	/*
+	 * Read the catalog ahead on several threads, unless this search is
+	 * being throttled: the read-ahead threads would not be.
+	 */
+	if (needThrottle == FALSE && hfs_search_runs > 0)
+		(void) BTScanStartReadAhead(&myBTScanState, hfs_search_runs);
+
 	/*
 	 * Check all the catalog btree records...
 	 *   return the attributes for matching items
@@ -1176,6 +1176,11 @@ hfs_initialize_allocator (struct hfsmount *hfsmp) {
 	 */
 	err = GenerateTree(hfsmp, hfsmp->totalBlocks, &flags, 1);
 	if (err) {
+		/* 
+		 * Either an unmount is waiting for us or the scan failed.  Throw away the 
+		 * partial tree; the volume carries on with the bitmap allocator.
+		 */
+		DestroyTrees(hfsmp);
 		goto bailout;
 	}
 	/* Mark offset tree as built */
@@ -1188,10 +1193,12 @@ bailout:
 	 * we don't need to re-grab the lock in order to update the TREEBUILD_INFLIGHT bit.
 	 */
 	hfsmp->extent_tree_flags &= ~HFS_ALLOC_TREEBUILD_INFLIGHT;
-	if (err != 0) {
-		/* Wakeup any waiters on the allocation bitmap lock */
-		wakeup((caddr_t)&hfsmp->extent_tree_flags);
-	}
+	
+	/* 
+	 * Wakeup any waiters on the allocation bitmap lock.  hfs_teardown_allocator may be
+	 * waiting even if the build finished, since it can arrive after our last check.
+	 */
+	wakeup((caddr_t)&hfsmp->extent_tree_flags);
 	
 	hfs_systemfile_unlock(hfsmp, flags);
 #else
@@ -1251,11 +1258,13 @@ hfs_teardown_allocator (struct hfsmount *hfsmp) {
 	
 	if (hfs_isrbtree_active (hfsmp)) {
 		rb_used = 1;
+	}
 	
-		/* Tear down the RB Trees while we have the bitmap locked */
-		DestroyTrees(hfsmp);
+	/* Tear down the RB Trees (complete or not) while we have the bitmap locked */
+	DestroyTrees(hfsmp);
 
-	}
+	/* The builder is gone; let a later upgrade mount start a new one */
+	hfsmp->extent_tree_flags &= ~HFS_ALLOC_TEARDOWN_INFLIGHT;
 
 	hfs_systemfile_unlock(hfsmp, flags);
 #else
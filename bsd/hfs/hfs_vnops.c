@@ -2196,7 +2196,7 @@ static int hfs_move_fork (struct filefork *srcfork, struct cnode *src_cp,
 	size = size * kHFSPlusExtentDensity;
 	
 	/* If the dstfork has any invalid ranges, bail out */
-	invalid_range = TAILQ_FIRST(&dstfork->ff_invalidranges);
+	invalid_range = rl_first(&dstfork->ff_invalidranges);
 	if (invalid_range != NULL) {
 		return EFBIG;
 	}
@@ -2206,7 +2206,7 @@ static int hfs_move_fork (struct filefork *srcfork, struct cnode *src_cp,
 	}
 	
 	/* First copy the invalid ranges */
-	while ((invalid_range = TAILQ_FIRST(&srcfork->ff_invalidranges))) {
+	while ((invalid_range = rl_first(&srcfork->ff_invalidranges))) {
 		off_t start = invalid_range->rl_start;
 		off_t end = invalid_range->rl_end;
 		
@@ -2316,7 +2316,7 @@ hfs_fsync(struct vnode *vp, int waitfor, int fullsync, struct proc *p)
 	 *
 	 * Files with NODUMP can bypass zero filling here.
 	 */
-	if (fp && (((cp->c_flag & C_ALWAYS_ZEROFILL) && !TAILQ_EMPTY(&fp->ff_invalidranges)) ||
+	if (fp && (((cp->c_flag & C_ALWAYS_ZEROFILL) && !rl_empty(&fp->ff_invalidranges)) ||
 	    ((wait || (cp->c_flag & C_ZFWANTSYNC)) &&
 		((cp->c_bsdflags & UF_NODUMP) == 0) &&
 		UBCINFOEXISTS(vp) && (vnode_issystem(vp) ==0) &&
@@ -2328,7 +2328,7 @@ hfs_fsync(struct vnode *vp, int waitfor, int fullsync, struct proc *p)
 			cp->c_flag |= C_ZFWANTSYNC;
 			goto datasync;
 		}
-		if (!TAILQ_EMPTY(&fp->ff_invalidranges)) {
+		if (!rl_empty(&fp->ff_invalidranges)) {
 			if (!took_trunc_lock || (cp->c_truncatelockowner == HFS_SHARED_OWNER)) {
 				hfs_unlock(cp);
 				if (took_trunc_lock) {
@@ -2338,7 +2338,7 @@ hfs_fsync(struct vnode *vp, int waitfor, int fullsync, struct proc *p)
 				hfs_lock(cp, HFS_FORCE_LOCK);
 				took_trunc_lock = 1;
 			}
-			while ((invalid_range = TAILQ_FIRST(&fp->ff_invalidranges))) {
+			while ((invalid_range = rl_first(&fp->ff_invalidranges))) {
 				off_t start = invalid_range->rl_start;
 				off_t end = invalid_range->rl_end;
     		
@@ -5022,8 +5022,8 @@ hfs_update(struct vnode *vp, __unused int waitfor)
          * invalid range, because it may have already been reduced
          * to zero by the borrowed blocks check above.
          */
-        if (!TAILQ_EMPTY(&cp->c_datafork->ff_invalidranges))  {
-            numbytes = TAILQ_FIRST(&cp->c_datafork->ff_invalidranges)->rl_start;
+        if (!rl_empty(&cp->c_datafork->ff_invalidranges))  {
+            numbytes = rl_first(&cp->c_datafork->ff_invalidranges)->rl_start;
             datafork.cf_size = MIN((numbytes), (datafork.cf_size));
         }
     }
@@ -28,12 +28,31 @@
  *	@(#)BTreeScanner.c
  */
 #include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/sysctl.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
+#include <libkern/OSAtomic.h>
 #include "../../hfs_endian.h"
 
 #include "../headers/BTreeScanner.h"
 
+extern lck_attr_t *  hfs_lock_attr;
+extern lck_grp_t *  hfs_mutex_group;
+
+static struct hfs_scan_stats hfs_scan_stats;
+SYSCTL_DECL(_vfs_generic_hfs);
+SYSCTL_STRUCT(_vfs_generic_hfs, OID_AUTO, scan_stats, CTLFLAG_RD|CTLFLAG_LOCKED, &hfs_scan_stats, hfs_scan_stats, "HFS B-tree scanner statistics");
+
 static int FindNextLeafNode(	BTScanState *scanState, Boolean avoidIO );
+static int FindNextLeafNodeParallel(	BTScanState *scanState, Boolean avoidIO );
 static int ReadMultipleNodes( 	BTScanState *scanState );
+static int BTScanIssueRuns(	BTScanState *scanState );
+static int BTScanWaitRun(	struct BTScanRuns *runs, struct BTScanRun *run, Boolean avoidIO );
+static void BTScanRetireRun(	struct BTScanRuns *runs );
+static void BTScanReadRun(	thread_call_param_t param0, thread_call_param_t param1 );
+static void BTScanStopReadAhead(	BTScanState *scanState );
+static void BTScanAccount(	int64_t *count, int64_t *total_time, u_int64_t start );
 
 
 //_________________________________________________________________________________
@@ -150,6 +169,9 @@ static int FindNextLeafNode(	BTScanState *scanState, Boolean avoidIO )
 	BlockDescriptor block;
 	FileReference fref;
 	
+	if ( scanState->runs != NULL )
+		return FindNextLeafNodeParallel( scanState, avoidIO );
+
 	err = noErr;		// Assume everything will be OK
 	
 	while ( 1 ) 
@@ -210,7 +232,10 @@ static int FindNextLeafNode(	BTScanState *scanState, Boolean avoidIO )
 		}
 
 		if ( scanState->currentNodePtr->kind == kBTLeafNode )
+		{
+			OSAddAtomic64( 1, &hfs_scan_stats.hss_leaf_nodes );
 			break;
+		}
 	}
 	
 	return err;
@@ -218,6 +243,91 @@ static int FindNextLeafNode(	BTScanState *scanState, Boolean avoidIO )
 } /* FindNextLeafNode */
 
 
+//_________________________________________________________________________________
+//
+//	Routine:	FindNextLeafNodeParallel
+//
+//	Purpose:	Point to the next leaf node when the scan uses parallel read-ahead.
+//				Runs are consumed in node order; each one finished with is
+//				released and replaced by a read further ahead.
+//
+//	Inputs:
+//		scanState		Scanner's current state
+//		avoidIO			If true, don't start or wait for any reads
+//
+//	Result:
+//		noErr			Found a valid record
+//		fsEndOfIterationErr	No more nodes in file
+//		fsBTTimeOutErr	Needed to wait for a read, but avoidIO set
+//
+//	Notes:
+//		nodesLeftInBuffer is only used as a flag here: it is non-zero while
+//		currentNodePtr points at nodeNum.
+//_________________________________________________________________________________
+
+static int FindNextLeafNodeParallel(	BTScanState *scanState, Boolean avoidIO )
+{
+	struct BTScanRuns *	runs;
+	struct BTScanRun *	run;
+	u_int32_t			index;
+	int					err;
+
+	runs = scanState->runs;
+
+	//	Step past the node we were positioned on (if any)
+	if ( scanState->nodesLeftInBuffer != 0 )
+	{
+		++scanState->nodeNum;
+		scanState->nodesLeftInBuffer = 0;
+	}
+
+	while ( 1 )
+	{
+		if ( scanState->nodeNum >= runs->btcb->totalNodes )
+			return fsEndOfIterationErr;
+
+		if ( runs->issued == 0 )
+		{
+			if ( avoidIO )
+				return fsBTTimeOutErr;
+			runs->nextNode = scanState->nodeNum;
+			err = BTScanIssueRuns( scanState );
+			if ( runs->issued == 0 )
+				return err;
+			continue;
+		}
+
+		run = &runs->run[runs->head];
+		err = BTScanWaitRun( runs, run, avoidIO );
+		if ( err != noErr )
+			return err;
+		if ( run->error != noErr )
+			return run->error;
+
+		if ( scanState->nodeNum >= run->firstNode + run->nodeCount )
+		{
+			//	Done with this run; keep the pipeline full
+			BTScanRetireRun( runs );
+			if ( !avoidIO )
+				(void) BTScanIssueRuns( scanState );
+			continue;
+		}
+
+		index = scanState->nodeNum - run->firstNode;
+		if ( run->leafMap[index / 8] & (1 << (index % 8)) )
+		{
+			scanState->currentNodePtr = (BTNodeDescriptor *)((u_int8_t *)buf_dataptr(run->bufferPtr)
+										+ index * runs->btcb->nodeSize);
+			scanState->nodesLeftInBuffer = 1;
+			return noErr;
+		}
+
+		++scanState->nodeNum;
+	}
+
+} /* FindNextLeafNodeParallel */
+
+
 //_________________________________________________________________________________
 //
 //	Routine:	ReadMultipleNodes
@@ -241,6 +351,7 @@ static int ReadMultipleNodes( BTScanState *theScanStatePtr )
 	struct vnode *			myDevPtr;
 	unsigned int			myBlockRun;
 	u_int32_t				myBlocksInBufferCount;
+	u_int64_t				myStartTime;
 
 	// release old buffer if we have one
 	if ( theScanStatePtr->bufferPtr != NULL )
@@ -272,6 +383,7 @@ static int ReadMultipleNodes( BTScanState *theScanStatePtr )
 	}
 	
 	// now read blocks from the device 
+	myStartTime = mach_absolute_time();
 	myErr = (int)buf_meta_bread(myDevPtr, 
 	                       myPhyBlockNum, 
 	                       myBufferSize,  
@@ -281,6 +393,8 @@ static int ReadMultipleNodes( BTScanState *theScanStatePtr )
 	{
 		goto ExitThisRoutine;
 	}
+	BTScanAccount( &hfs_scan_stats.hss_reads, &hfs_scan_stats.hss_read_time, myStartTime );
+	OSAddAtomic64( buf_count(theScanStatePtr->bufferPtr), &hfs_scan_stats.hss_read_bytes );
 
 	theScanStatePtr->nodesLeftInBuffer = buf_count(theScanStatePtr->bufferPtr) / theScanStatePtr->btcb->nodeSize;
 	theScanStatePtr->currentNodePtr = (BTNodeDescriptor *) buf_dataptr(theScanStatePtr->bufferPtr);
@@ -291,6 +405,253 @@ ExitThisRoutine:
 } /* ReadMultipleNodes */
 
 
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanIssueRuns
+//
+//	Purpose:	Start reads for as many runs as are free, beginning at
+//				runs->nextNode.  Each run is one physically contiguous piece
+//				of the B-tree file, at most runNodes long.
+//
+//	Inputs:
+//		scanState		Scanner's current state
+//
+//	Result:
+//		noErr			All free runs were started (or the file is exhausted)
+//		???				Error mapping the next run; earlier runs are unaffected
+//_________________________________________________________________________________
+
+static int BTScanIssueRuns(	BTScanState *scanState )
+{
+	struct BTScanRuns *		runs;
+	struct BTScanRun *		run;
+	BTreeControlBlockPtr	btcb;
+	unsigned int			blockRun;
+	int						err = noErr;
+
+	runs = scanState->runs;
+	btcb = runs->btcb;
+
+	while ( runs->issued < runs->runCount && runs->nextNode < btcb->totalNodes )
+	{
+		run = &runs->run[(runs->head + runs->issued) % runs->runCount];
+
+		// bmap block run is the number of valid blocks after the first, as above
+		err = hfs_bmap( btcb->fileRefNum, runs->nextNode, &run->devPtr, &run->blockNum, &blockRun );
+		if ( err != E_NONE )
+			break;
+
+		run->firstNode = runs->nextNode;
+		run->nodeCount = runs->runNodes;
+		if ( (blockRun + 1) < run->nodeCount )
+			run->nodeCount = blockRun + 1;
+		if ( (btcb->totalNodes - run->firstNode) < run->nodeCount )
+			run->nodeCount = btcb->totalNodes - run->firstNode;
+		run->error = noErr;
+		run->state = kBTScanRunReading;
+
+		runs->nextNode += run->nodeCount;
+		++runs->issued;
+		thread_call_enter( run->call );
+	}
+
+	return err;
+
+} /* BTScanIssueRuns */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanReadRun
+//
+//	Purpose:	Thread call that reads one run and swaps its nodes to host
+//				byte order, noting which of them are leaf nodes.
+//
+//	Inputs:
+//		param0			The BTScanRun to fill
+//_________________________________________________________________________________
+
+static void BTScanReadRun(	thread_call_param_t param0, __unused thread_call_param_t param1 )
+{
+	struct BTScanRun *	run;
+	struct BTScanRuns *	runs;
+	struct buf *		bp = NULL;
+	BlockDescriptor		block;
+	u_int32_t			nodeSize;
+	u_int32_t			i;
+	u_int64_t			startTime;
+	int64_t				leafNodes = 0;
+	int					err;
+
+	run = (struct BTScanRun *)param0;
+	runs = run->runs;
+	nodeSize = runs->btcb->nodeSize;
+
+	startTime = mach_absolute_time();
+	bzero( run->leafMap, sizeof(run->leafMap) );
+
+	err = (int)buf_meta_bread( run->devPtr, run->blockNum, run->nodeCount * nodeSize, NOCRED, &bp );
+	if ( err == E_NONE && buf_count(bp) < run->nodeCount * nodeSize )
+		err = EIO;
+
+	if ( err == E_NONE )
+	{
+		/* Same rules as FindNextLeafNode: unused nodes may be swapped too. */
+		block.blockHeader = NULL;
+		block.blockSize = nodeSize;
+		block.blockReadFromDisk = 1;
+		block.isModified = 0;
+
+		for ( i = 0; i < run->nodeCount; ++i )
+		{
+			block.buffer = (u_int8_t *)buf_dataptr(bp) + i * nodeSize;
+			block.blockNum = run->firstNode + i;
+
+			if ( hfs_swap_BTNode(&block, runs->btcb->fileRefNum, kSwapBTNodeBigToHost, true) != noErr ) {
+				printf("hfs: BTScanReadRun: Error from hfs_swap_BTNode (node %u)\n", run->firstNode + i);
+				continue;
+			}
+			if ( ((BTNodeDescriptor *)block.buffer)->kind == kBTLeafNode )
+			{
+				run->leafMap[i / 8] |= (1 << (i % 8));
+				++leafNodes;
+			}
+		}
+
+		BTScanAccount( &hfs_scan_stats.hss_reads, &hfs_scan_stats.hss_read_time, startTime );
+		OSAddAtomic64( buf_count(bp), &hfs_scan_stats.hss_read_bytes );
+		OSAddAtomic64( leafNodes, &hfs_scan_stats.hss_leaf_nodes );
+	}
+	else if ( bp != NULL )
+	{
+		buf_markinvalid( bp );
+		buf_brelse( bp );
+		bp = NULL;
+	}
+
+	lck_mtx_lock( &runs->lock );
+	run->bufferPtr = bp;
+	run->error = err;
+	run->state = kBTScanRunReady;
+	wakeup( run );
+	lck_mtx_unlock( &runs->lock );
+
+} /* BTScanReadRun */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanWaitRun
+//
+//	Purpose:	Wait for a run's read to complete.
+//
+//	Result:
+//		noErr			The run is ready (its own error is in run->error)
+//		fsBTTimeOutErr	The read is still in progress, and avoidIO set
+//_________________________________________________________________________________
+
+static int BTScanWaitRun(	struct BTScanRuns *runs, struct BTScanRun *run, Boolean avoidIO )
+{
+	u_int64_t	startTime;
+	int			err = noErr;
+
+	lck_mtx_lock( &runs->lock );
+	if ( run->state == kBTScanRunReading )
+	{
+		if ( avoidIO )
+		{
+			err = fsBTTimeOutErr;
+		}
+		else
+		{
+			startTime = mach_absolute_time();
+			while ( run->state == kBTScanRunReading )
+				(void) msleep( run, &runs->lock, PINOD, "BTScanWaitRun", 0 );
+			BTScanAccount( &hfs_scan_stats.hss_stalls, &hfs_scan_stats.hss_stall_time, startTime );
+		}
+	}
+	lck_mtx_unlock( &runs->lock );
+
+	return err;
+
+} /* BTScanWaitRun */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanRetireRun
+//
+//	Purpose:	Release the run at the head of the ring, waiting for its read
+//				if it is still in progress.
+//_________________________________________________________________________________
+
+static void BTScanRetireRun(	struct BTScanRuns *runs )
+{
+	struct BTScanRun *	run;
+
+	run = &runs->run[runs->head];
+	(void) BTScanWaitRun( runs, run, false );
+
+	if ( run->bufferPtr != NULL )
+	{
+		buf_markinvalid( run->bufferPtr );
+		buf_brelse( run->bufferPtr );
+		run->bufferPtr = NULL;
+	}
+	run->state = kBTScanRunIdle;
+
+	runs->head = (runs->head + 1) % runs->runCount;
+	--runs->issued;
+
+} /* BTScanRetireRun */
+
+
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanStopReadAhead
+//
+//	Purpose:	Wait for outstanding reads, release all runs and free the
+//				read-ahead state.  The scan position is not changed.
+//_________________________________________________________________________________
+
+static void BTScanStopReadAhead(	BTScanState *scanState )
+{
+	struct BTScanRuns *	runs;
+	u_int32_t			i;
+
+	runs = scanState->runs;
+
+	while ( runs->issued > 0 )
+	{
+		if ( runs->run[runs->head].firstNode > scanState->nodeNum )
+			OSAddAtomic64( 1, &hfs_scan_stats.hss_discarded );
+		BTScanRetireRun( runs );
+	}
+
+	for ( i = 0; i < runs->runCount; ++i )
+		thread_call_free( runs->run[i].call );
+	lck_mtx_destroy( &runs->lock, hfs_mutex_group );
+	FREE( runs, M_TEMP );
+
+	scanState->runs = NULL;
+	scanState->currentNodePtr = NULL;
+	scanState->nodesLeftInBuffer = 0;
+	OSAddAtomic64( 1, &hfs_scan_stats.hss_parallel_scans );
+
+} /* BTScanStopReadAhead */
+
+
+static void BTScanAccount(	int64_t *count, int64_t *total_time, u_int64_t start )
+{
+	u_int64_t	elapsed;
+
+	absolutetime_to_nanoseconds( mach_absolute_time() - start, &elapsed );
+	OSAddAtomic64( 1, count );
+	OSAddAtomic64( elapsed, total_time );
+
+} /* BTScanAccount */
+
+
 
 //_________________________________________________________________________________
 //
@@ -363,6 +724,7 @@ int		BTScanInitialize(	const FCB *		btreeFile,
 	scanState->currentNodePtr		= NULL;
 	scanState->nodesLeftInBuffer	= 0;		// no nodes currently in buffer
 	scanState->recordsFound			= recordsFound;
+	scanState->runs					= NULL;		// sequential until BTScanStartReadAhead
 	microuptime(&scanState->startTime);			// initialize our throttle
 		
 	return noErr;
@@ -370,6 +732,63 @@ int		BTScanInitialize(	const FCB *		btreeFile,
 } /* BTScanInitialize */
 
 
+//_________________________________________________________________________________
+//
+//	Routine:	BTScanStartReadAhead
+//
+//	Purpose:	Switch a scan to parallel read-ahead: up to runCount runs of
+//				consecutive nodes are read and swapped on thread calls ahead
+//				of the scan, which consumes them in node order.
+//
+//	Inputs:
+//		scanState		Scanner's state, from BTScanInitialize
+//		runCount		Number of runs to keep in flight (clipped to kBTScanMaxRuns)
+//
+//	Result:
+//		noErr			Read-ahead is enabled
+//		paramErr		runCount is zero, or nodes are larger than a run
+//
+//	Notes:
+//		Call before the first BTScanNextRecord.  On error the scan stays
+//		sequential, so the result may be ignored.
+//
+//		The reads are issued from thread calls and so are not subject to
+//		the caller's I/O throttling policy; throttled callers should not
+//		use read-ahead.
+//_________________________________________________________________________________
+
+int	BTScanStartReadAhead(	BTScanState *	scanState,
+							u_int32_t		runCount	)
+{
+	struct BTScanRuns *	runs;
+	u_int32_t			i;
+
+	if ( runCount == 0 || scanState->btcb->nodeSize > kCatSearchRunSize )
+		return paramErr;
+	if ( runCount > kBTScanMaxRuns )
+		runCount = kBTScanMaxRuns;
+
+	MALLOC( runs, struct BTScanRuns *, sizeof(*runs), M_TEMP, M_WAITOK );
+	bzero( runs, sizeof(*runs) );
+
+	lck_mtx_init( &runs->lock, hfs_mutex_group, hfs_lock_attr );
+	runs->btcb		= scanState->btcb;
+	runs->runCount	= runCount;
+	runs->runNodes	= kCatSearchRunSize / scanState->btcb->nodeSize;
+	runs->nextNode	= scanState->nodeNum;
+	for ( i = 0; i < runCount; ++i )
+	{
+		runs->run[i].runs = runs;
+		runs->run[i].call = thread_call_allocate( BTScanReadRun, &runs->run[i] );
+	}
+
+	scanState->runs = runs;
+
+	return noErr;
+
+} /* BTScanStartReadAhead */
+
+
 //_________________________________________________________________________________
 //
 //	Routine:	BTScanTerminate
@@ -395,6 +814,10 @@ int	 BTScanTerminate(	BTScanState *		scanState,
 	*startingRecord	= scanState->recordNum;
 	*recordsFound	= scanState->recordsFound;
 
+	if ( scanState->runs != NULL )
+		BTScanStopReadAhead( scanState );
+	OSAddAtomic64( 1, &hfs_scan_stats.hss_scans );
+
 	if ( scanState->bufferPtr != NULL )
 	{
 		buf_markinvalid(scanState->bufferPtr);
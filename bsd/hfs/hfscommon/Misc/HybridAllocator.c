@@ -80,14 +80,30 @@
  * Remove the specified node from the tree. 
  * static void				extent_tree_offset_remove(extent_tree_offset_t * tree, extent_node_t * node)
  * 
+ * Length-Tree Functions:
+ *
+ * The same set is generated with the extent_tree_length_ prefix, operating on the
+ * length_link field and sorted by cmp_length_node.  Every node lives in both trees,
+ * so any change to a node's offset or length must go through extent_tree_node_resize.
+ * 
  */
 
 
 /* Static Functions only used in this file */
 static int32_t
-extent_tree_internal_alloc_space(extent_tree_offset_t *offset_tree, 
+extent_tree_internal_alloc_space(extent_tree_t *tree, 
 								 u_int32_t size, u_int32_t offset, extent_node_t *node);
 
+static void
+extent_tree_node_insert(extent_tree_t *tree, extent_node_t *node);
+
+static void
+extent_tree_node_unlink(extent_tree_t *tree, extent_node_t *node);
+
+static void
+extent_tree_node_resize(extent_tree_t *tree, extent_node_t *node, 
+						u_int32_t offset, u_int32_t length);
+
 /*
  * cmp_offset_node
  * 
@@ -106,6 +122,25 @@ cmp_offset_node(extent_node_t *node_1, extent_node_t *node_2) {
 	return ((addr_1 > addr_2) - (addr_1 < addr_2));
 }
 
+/*
+ * cmp_length_node
+ * 
+ * Compare the extents in two nodes by length.  Ties are broken by offset so
+ * that every node has a unique key and best-fit searches prefer the lowest
+ * suitable extent on the disk.
+ */
+
+__private_extern__ int
+cmp_length_node(extent_node_t *node_1, extent_node_t *node_2) {
+	u_int32_t len_1 = node_1->length;
+	u_int32_t len_2 = node_2->length;
+	
+	if (len_1 != len_2) {
+		return ((len_1 > len_2) - (len_1 < len_2));
+	}
+	return cmp_offset_node(node_1, node_2);
+}
+
 /*
  * Allocate a new red-black tree node.
  * 
@@ -125,6 +160,23 @@ alloc_node(u_int32_t length, u_int32_t offset) {
 	return node;
 }
 
+/*
+ * Same as alloc_node, but never blocks.  Used from the journal's trim callback,
+ * which runs with the journal trim lock held and so must not wait for memory.
+ */
+__private_extern__ extent_node_t *
+alloc_node_nowait(u_int32_t length, u_int32_t offset) {
+	extent_node_t *node;
+	MALLOC(node, extent_node_t *, sizeof(extent_node_t), M_TEMP, M_NOWAIT);
+	
+	if (node) {
+		node->offset = offset;
+		node->length = length;
+		node->offset_next = NULL;
+	}
+	return node;
+}
+
 /*
  * De-allocate a red-black tree node.  
  * 
@@ -145,43 +197,93 @@ free_node(extent_node_t *node) {
  */
 
 rb_wrap(__attribute__ ((unused)) static, extent_tree_offset_, extent_tree_offset_t, extent_node_t, offset_link, cmp_offset_node)
+rb_wrap(__attribute__ ((unused)) static, extent_tree_length_, extent_tree_length_t, extent_node_t, length_link, cmp_length_node)
 
 
 /*
- * Create a new extent tree, composed of links sorted by offset.
+ * Link a new node into both trees and splice it into the offset-ordered list.
+ * The caller guarantees that the node does not overlap any existing extent.
  */
-__private_extern__ void
-extent_tree_init(extent_tree_offset_t *offset_tree)
+static void
+extent_tree_node_insert(extent_tree_t *tree, extent_node_t *node)
 {
-	extent_node_t *node = NULL;
-	extent_tree_offset_new(offset_tree);
+	extent_node_t *prev;
 	
-	node = extent_tree_off_first (offset_tree);
-	if (node) {
-		node->offset_next = NULL;
+	extent_tree_offset_insert(&tree->offset_tree, node);
+	extent_tree_length_insert(&tree->length_tree, node);
+	
+	node->offset_next = extent_tree_offset_next(&tree->offset_tree, node);
+	prev = extent_tree_offset_prev(&tree->offset_tree, node);
+	if (prev) {
+		prev->offset_next = node;
 	}
 }
 
+/*
+ * Unlink a node from both trees and from the offset-ordered list.  The node
+ * itself is not freed.
+ */
+static void
+extent_tree_node_unlink(extent_tree_t *tree, extent_node_t *node)
+{
+	extent_node_t *prev;
+	
+	prev = extent_tree_offset_prev(&tree->offset_tree, node);
+	if (prev) {
+		prev->offset_next = node->offset_next;
+	}
+	extent_tree_offset_remove(&tree->offset_tree, node);
+	extent_tree_length_remove(&tree->length_tree, node);
+	node->offset_next = NULL;
+}
+
+/*
+ * Change the extent described by an existing node.  The new extent must not 
+ * overlap any other node, so the node keeps its place in the offset tree and 
+ * only needs to be re-sorted in the length tree.
+ */
+static void
+extent_tree_node_resize(extent_tree_t *tree, extent_node_t *node, 
+						u_int32_t offset, u_int32_t length)
+{
+	extent_tree_length_remove(&tree->length_tree, node);
+	node->offset = offset;
+	node->length = length;
+	extent_tree_length_insert(&tree->length_tree, node);
+}
+
+
+/*
+ * Create a new extent tree, composed of links sorted by offset and by length.
+ */
+__private_extern__ void
+extent_tree_init(extent_tree_t *tree)
+{
+	extent_tree_offset_new(&tree->offset_tree);
+	extent_tree_length_new(&tree->length_tree);
+}
+
 /*
  * Destroy an extent tree
  * 
  * This function finds the first node in the specified red-black tree, then 
- * uses the embedded linked list to walk through the tree in O(n) time and destroy
- * all of its nodes.
+ * uses the embedded linked list to walk through the tree in O(n) time and free
+ * all of its nodes.  There is no point in rebalancing trees that are about to
+ * be discarded, so both are simply reset to empty once every node is gone.
  */
 __private_extern__ void
-extent_tree_destroy(extent_tree_offset_t *off_tree) {
+extent_tree_destroy(extent_tree_t *tree) {
 	extent_node_t *node = NULL;
 	extent_node_t *next = NULL;
 	
-	node = extent_tree_offset_first (off_tree);
+	node = extent_tree_offset_first (&tree->offset_tree);
 	
 	while (node) {
 		next = node->offset_next;
-		extent_tree_offset_remove (off_tree, node);
 		free_node (node);
 		node = next;
 	}
+	extent_tree_init (tree);
 }
 
 /* 
@@ -190,8 +292,8 @@ extent_tree_destroy(extent_tree_offset_t *off_tree) {
  * tree code.
  */
 __private_extern__ extent_node_t *
-extent_tree_off_search(extent_tree_offset_t *tree, extent_node_t *key) {
-	return extent_tree_offset_search(tree, key);
+extent_tree_off_search(extent_tree_t *tree, extent_node_t *key) {
+	return extent_tree_offset_search(&tree->offset_tree, key);
 }
 
 /*
@@ -201,9 +303,9 @@ extent_tree_off_search(extent_tree_offset_t *tree, extent_node_t *key) {
  * tree code.
  */
 __private_extern__ extent_node_t *
-extent_tree_off_search_next(extent_tree_offset_t *offset_tree, extent_node_t *key) {
+extent_tree_off_search_next(extent_tree_t *tree, extent_node_t *key) {
 	
-	return extent_tree_offset_nsearch (offset_tree, key);
+	return extent_tree_offset_nsearch (&tree->offset_tree, key);
 }
 
 /*
@@ -212,15 +314,19 @@ extent_tree_off_search_next(extent_tree_offset_t *offset_tree, extent_node_t *ke
  * greater than or equal to the specified size.  The "key" argument is only used to extract
  * the offset and length information.  Its link fields are not used in the underlying
  * tree code.
+ *
+ * This is a first-fit search and is O(n) in the number of free extents after the
+ * starting offset.  Callers that do not care about locality should use 
+ * extent_tree_len_search_bestfit instead.
  */
 __private_extern__ extent_node_t *
-extent_tree_off_search_nextWithSize (extent_tree_offset_t *offset_tree, extent_node_t *key) {
+extent_tree_off_search_nextWithSize (extent_tree_t *tree, extent_node_t *key) {
 	
 	extent_node_t *current;
 	
 	u_int32_t min_size = key->length;
 	
-	current = extent_tree_offset_nsearch (offset_tree, key);
+	current = extent_tree_offset_nsearch (&tree->offset_tree, key);
 	
 	while (current) {
 		if (current->length >= min_size) {
@@ -241,9 +347,9 @@ extent_tree_off_search_nextWithSize (extent_tree_offset_t *offset_tree, extent_n
  * tree code.
  */
 __private_extern__ extent_node_t *
-extent_tree_off_search_prev(extent_tree_offset_t *offset_tree, extent_node_t *key) {
+extent_tree_off_search_prev(extent_tree_t *tree, extent_node_t *key) {
 	
-	return extent_tree_offset_psearch (offset_tree, key);
+	return extent_tree_offset_psearch (&tree->offset_tree, key);
 }
 
 
@@ -252,84 +358,114 @@ extent_tree_off_search_prev(extent_tree_offset_t *offset_tree, extent_node_t *ke
  * free space region relative to the start of the disk. 
  */
 __private_extern__ extent_node_t *
-extent_tree_off_first (extent_tree_offset_t *offset_tree) {
-	return extent_tree_offset_first(offset_tree);
+extent_tree_off_first (extent_tree_t *tree) {
+	return extent_tree_offset_first(&tree->offset_tree);
 }
 
 /*
  * From a given tree node (sorted by offset), get the next node in the tree. 
  */
 __private_extern__ extent_node_t *
-extent_tree_off_next(extent_tree_offset_t * tree, extent_node_t *node)
+extent_tree_off_next(extent_tree_t * tree, extent_node_t *node)
 {
-	return extent_tree_offset_next(tree, node);
+	return extent_tree_offset_next(&tree->offset_tree, node);
 }
 
 /*
  * From a given tree node (sorted by offset), get the previous node in the tree. 
  */
 __private_extern__ extent_node_t *
-extent_tree_off_prev(extent_tree_offset_t * tree, extent_node_t *node)
+extent_tree_off_prev(extent_tree_t * tree, extent_node_t *node)
 {
-	return extent_tree_offset_prev(tree, node);
+	return extent_tree_offset_prev(&tree->offset_tree, node);
 }
 
 
 /*
- * For a node of a given offset and size, remove it from the extent tree and
- * insert a new node that:
+ * Best-fit search using the length tree.
+ *
+ * Returns the smallest free extent that can hold max_length blocks and starts 
+ * at or after min_offset.  If no extent is that large, return the largest 
+ * extent at or after min_offset that still holds at least min_length blocks, 
+ * so that the caller gets as much contiguous space as the volume can offer.
+ * Returns NULL if nothing suitable exists.
+ *
+ * Extents below min_offset (i.e. in the metadata zone) are skipped by walking 
+ * the length tree.  The metadata zone is a small, fixed-size part of the 
+ * volume, so the number of nodes skipped this way is bounded.
+ */
+__private_extern__ extent_node_t *
+extent_tree_len_search_bestfit(extent_tree_t *tree, u_int32_t min_length, 
+							   u_int32_t max_length, u_int32_t min_offset)
+{
+	extent_node_t search_sentinel = { .length = max_length, .offset = 0 };
+	extent_node_t *node;
+	
+	if (max_length < min_length) {
+		max_length = min_length;
+		search_sentinel.length = max_length;
+	}
+	
+	node = extent_tree_length_nsearch(&tree->length_tree, &search_sentinel);
+	while (node && (node->offset < min_offset)) {
+		node = extent_tree_length_next(&tree->length_tree, node);
+	}
+	if (node) {
+		return node;
+	}
+	
+	/* Nothing holds max_length; settle for the largest extent above min_length. */
+	node = extent_tree_length_last(&tree->length_tree);
+	while (node && (node->length >= min_length) && (node->offset < min_offset)) {
+		node = extent_tree_length_prev(&tree->length_tree, node);
+	}
+	if (node && (node->length >= min_length)) {
+		return node;
+	}
+	
+	return NULL;
+}
+
+
+/*
+ * For a node of a given offset and size, remove 'size' blocks from its front:
  * 
- *	A) increase its offset by that of the node we just removed
- *  B) decreases its size by that of the node we just removed.
+ *	A) increase its offset by 'size'
+ *  B) decrease its length by 'size'.
  *
  * NOTE: Callers must ensure that the 'size' specified is less than or equal to the
  * length of the extent represented by node.  The node pointer must point to an 
- * extant node in the tree, as it will be removed from the tree.
+ * extant node in the tree, and is freed if it becomes empty.
  */
 static int32_t
-extent_tree_internal_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t size, 
+extent_tree_internal_alloc_space(extent_tree_t *tree, u_int32_t size, 
 								 u_int32_t offset, extent_node_t *node)
 {
 	if (node) {
-		extent_node_t *prev = NULL;
-		extent_node_t *next = NULL;
-		
 		if( ALLOC_DEBUG ) {
 			assert ((size <= node->length));
 			assert ((offset == node->offset));
 		}
 		
-		prev = extent_tree_offset_prev(offset_tree, node);
-		
 		/*
-		 * Note that, unless the node is exactly the size of the amount of space
-		 * requested, we do not need to remove it from the offset tree, now matter
-		 * how much space we remove from the node.  Remember that the offset tree is
-		 * sorting the extents based on their offsets, and that each node is a discrete 
-		 * chunk of free space.
+		 * Unless the node is exactly the size of the amount of space requested, it
+		 * keeps its position in the offset tree no matter how much space we remove 
+		 * from it.  Remember that the offset tree is sorting the extents based on 
+		 * their offsets, and that each node is a discrete chunk of free space.
 		 * 
 		 * If node A has offset B, with length C, in the offset tree, by definition, there 
 		 * can be no other node in the extent tree within the range {B, B+C}.  If there were,
-		 * we'd have overlapped extents. 
-		 * 
-		 * So in the normal case, we'll just update the offset node in place with the new offset
-		 * and size.
+		 * we'd have overlapped extents.  The length tree does need re-sorting, which 
+		 * extent_tree_node_resize takes care of.
 		 * 
-		 * Otherwise, if we have an exact match, then just remove the node altogether.  Don't forget 
-		 * to update the next pointer for the linked list if applicable.
+		 * Otherwise, if we have an exact match, then just remove the node altogether.
 		 */
 		if (node->length == size) {
-			next = node->offset_next;
-			extent_tree_offset_remove(offset_tree, node);
+			extent_tree_node_unlink(tree, node);
 			free_node(node);
-			if (prev) {
-				prev->offset_next = next;
-			}
 		}
 		else {
-			node->offset = node->offset + size;
-			node->length -= size;
-			/* The next pointer does not change since we keep the node in place */
+			extent_tree_node_resize(tree, node, node->offset + size, node->length - size);
 		}
 		return 0;
 	}	
@@ -349,9 +485,9 @@ extent_tree_internal_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t si
  */
 
 __private_extern__ int32_t
-extent_tree_offset_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t size, u_int32_t offset) {
+extent_tree_offset_alloc_space(extent_tree_t *tree, u_int32_t size, u_int32_t offset) {
 	extent_node_t search_sentinel = { .offset = offset };
-	extent_node_t *node = extent_tree_offset_search(offset_tree, &search_sentinel);
+	extent_node_t *node = extent_tree_offset_search(&tree->offset_tree, &search_sentinel);
 	if (node && (node->length < size)) {
 		/* It's too small. Fail the allocation */
 		if ( ALLOC_DEBUG ) { 
@@ -360,7 +496,7 @@ extent_tree_offset_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t size
 		}
 		return -1;		
 	}
-	return extent_tree_internal_alloc_space(offset_tree, size, offset, node);
+	return extent_tree_internal_alloc_space(tree, size, offset, node);
 }
 
 
@@ -375,18 +511,18 @@ extent_tree_offset_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t size
 
 
 __private_extern__ int32_t
-extent_tree_offset_alloc_unaligned(extent_tree_offset_t *offset_tree, u_int32_t size, u_int32_t offset) {
+extent_tree_offset_alloc_unaligned(extent_tree_t *tree, u_int32_t size, u_int32_t offset) {
 	extent_node_t search_sentinel = { .offset = offset };
 	extent_node_t *node= NULL;
 	
-	node = extent_tree_off_search_prev(offset_tree, &search_sentinel);
+	node = extent_tree_off_search_prev(tree, &search_sentinel);
 	
 	if (node == NULL) {
 		return -1;
 	}
 	
-	if (node && (node->length < size)) {
-		/* It's too small. Fail the allocation */
+	if ((offset + size) > (node->offset + node->length)) {
+		/* The range is not wholly contained in this extent. Fail the allocation */
 		if ( ALLOC_DEBUG ) { 
 			printf("HFS Allocator: internal_alloc_space, ptr (%p) node->length (%d), node->offset (%d), off(%d), size (%d) \n", 
 				   node, node->length, node->offset, offset, size);
@@ -397,15 +533,8 @@ extent_tree_offset_alloc_unaligned(extent_tree_offset_t *offset_tree, u_int32_t
 	/* Now see if we need to split this node because we're not allocating from the beginning */
 	if (offset != node->offset) {
 		
-		if (ALLOC_DEBUG) {
-			assert ((offset + size) <= (node->offset + node->length));
-			if (node->offset_next) {
-				assert ((offset > node->offset) && (offset < node->offset_next->offset));
-			}
-		}
-		
 		u_int32_t end = node->offset + node->length;
-		node->length = offset - node->offset;
+		extent_tree_node_resize(tree, node, node->offset, offset - node->offset);
 		
 		/* 
 		 * Do we need to create a new node?  If our extent we're carving away ends earlier than 
@@ -416,21 +545,84 @@ extent_tree_offset_alloc_unaligned(extent_tree_offset_t *offset_tree, u_int32_t
 			u_int32_t newlen = end - newoff;
 
 			extent_node_t* newnode = alloc_node(newlen, newoff);
-			extent_tree_offset_insert(offset_tree, newnode);
-			
-			extent_node_t *next = extent_tree_offset_next(offset_tree, newnode);
-			newnode->offset_next = next;
-			node->offset_next = newnode;
+			assert(newnode);
+			extent_tree_node_insert(tree, newnode);
 		}
 		
 		return 0;
 	}
 	else {
-		return extent_tree_internal_alloc_space(offset_tree, size, offset, node);
+		return extent_tree_internal_alloc_space(tree, size, offset, node);
 	}
 }
 
 
+/*
+ * Remove every free block in [offset, offset + size) from the tree, whether the
+ * range is covered by one node, several nodes, or not at all.  Nodes that straddle
+ * either edge of the range are trimmed (or split) rather than removed.
+ * 
+ * Unlike extent_tree_offset_alloc_space, this never fails; it returns the number 
+ * of blocks that were actually removed so that callers can tell whether the tree 
+ * agreed with them.  A size that would run past the end of the address space is 
+ * clamped, so (0xFFFFFFFF, N) removes everything from N onwards.
+ */
+__private_extern__ u_int32_t
+extent_tree_remove_range(extent_tree_t *tree, u_int32_t size, u_int32_t offset)
+{
+	extent_node_t search_sentinel = { .offset = offset };
+	extent_node_t *node;
+	extent_node_t *next;
+	u_int32_t end;
+	u_int32_t removed = 0;
+	
+	if (size > (0xFFFFFFFF - offset)) {
+		size = 0xFFFFFFFF - offset;
+	}
+	end = offset + size;
+	
+	node = extent_tree_offset_psearch(&tree->offset_tree, &search_sentinel);
+	if (node == NULL) {
+		node = extent_tree_offset_nsearch(&tree->offset_tree, &search_sentinel);
+	}
+	else if ((node->offset + node->length) <= offset) {
+		node = node->offset_next;
+	}
+	
+	while (node && (node->offset < end)) {
+		u_int32_t node_start = node->offset;
+		u_int32_t node_end = node->offset + node->length;
+		
+		next = node->offset_next;
+		
+		if (node_start < offset) {
+			if (node_end > end) {
+				/* The range is in the middle of this node; split it in two. */
+				extent_node_t *newnode = alloc_node(node_end - end, end);
+				assert(newnode);
+				extent_tree_node_resize(tree, node, node_start, offset - node_start);
+				extent_tree_node_insert(tree, newnode);
+				removed += size;
+				break;
+			}
+			extent_tree_node_resize(tree, node, node_start, offset - node_start);
+			removed += node_end - offset;
+		}
+		else if (node_end > end) {
+			extent_tree_node_resize(tree, node, end, node_end - end);
+			removed += end - node_start;
+		}
+		else {
+			extent_tree_node_unlink(tree, node);
+			free_node(node);
+			removed += node_end - node_start;
+		}
+		node = next;
+	}
+	
+	return removed;
+}
+
 
 /*
  * Mark an extent of space as being free.  This means we need to insert 
@@ -448,64 +640,92 @@ extent_tree_offset_alloc_unaligned(extent_tree_offset_t *offset_tree, u_int32_t
  * If possible, coalesce the previous node into our new one.  
  *
  * We return the node which we are modifying in this function.  
+ *
+ * The caller guarantees that no part of the extent is already in the tree; 
+ * use extent_tree_free_range when that is not known.
  */
 
 __private_extern__ extent_node_t *
-extent_tree_free_space(extent_tree_offset_t *offset_tree, u_int32_t size, u_int32_t offset)
+extent_tree_free_space(extent_tree_t *tree, u_int32_t size, u_int32_t offset)
 {
 	extent_node_t *prev = NULL;
 	extent_node_t *node = NULL;	
-	extent_node_t *next = NULL;
 	extent_node_t search_sentinel = { .offset = size + offset };
 	
-	node = extent_tree_offset_nsearch(offset_tree, &search_sentinel);
+	node = extent_tree_offset_nsearch(&tree->offset_tree, &search_sentinel);
 	/* Insert our node into the tree, and coalesce with the next one if necessary */
 	
 	if ((node) && (node->offset == search_sentinel.offset)) {
-        node->offset = offset;
-        node->length += size;
-		next = node->offset_next;
-    }
+		extent_tree_node_resize(tree, node, offset, node->length + size);
+	}
 	else {
 		node = alloc_node(size, offset);
-        assert(node);
-        extent_tree_offset_insert(offset_tree, node);
-		
-		/* Find the next entry in the tree, if applicable. */
-		next = extent_tree_offset_next(offset_tree, node);
-		node->offset_next = next;
+		assert(node);
+		extent_tree_node_insert(tree, node);
 	}
 	
 	/* Coalesce with the previous if necessary */
-	prev = extent_tree_offset_prev(offset_tree, node);
+	prev = extent_tree_offset_prev(&tree->offset_tree, node);
 	if (prev && (prev->offset + prev->length) == offset) {
-        extent_tree_offset_remove(offset_tree, prev);
-        node->offset = prev->offset;
-        node->length += prev->length;		
-        free_node(prev);
-		prev = extent_tree_offset_prev(offset_tree, node);
-    }
-	
-	/* Update the next pointer for the previous entry (if necessary) */
-	if (prev) {
-		prev->offset_next = node;
+		extent_tree_node_unlink(tree, prev);
+		extent_tree_node_resize(tree, node, prev->offset, node->length + prev->length);
+		free_node(prev);
 	}
 	
 	return node;
 }
 
 /*
- * Remove the specified node from the offset_tree.  Note that the parameter node
- * must be an extant node in the tree.  This function is used by the allocator when
- * we are resizing a volume and need to directly manipulate the contents of the red-black
- * tree without going through the normal allocation and deallocation routines.
+ * Mark every block in [offset, offset + size) as free in the tree, skipping the 
+ * parts of the range that the tree already considers free.  This lets callers 
+ * that cannot know exactly what the tree holds (for example, frees reported 
+ * back by the journal after the tree was rebuilt from the bitmap) insert extents 
+ * without creating overlapping nodes.
+ *
+ * Returns the number of blocks that were newly added.
+ */
+__private_extern__ u_int32_t
+extent_tree_free_range(extent_tree_t *tree, u_int32_t size, u_int32_t offset)
+{
+	extent_node_t search_sentinel;
+	extent_node_t *node;
+	u_int32_t cur = offset;
+	u_int32_t end = offset + size;
+	u_int32_t added = 0;
+	
+	while (cur < end) {
+		u_int32_t gap_end = end;
+		
+		search_sentinel.offset = cur;
+		node = extent_tree_offset_psearch(&tree->offset_tree, &search_sentinel);
+		if (node && ((node->offset + node->length) > cur)) {
+			/* Already free; skip to the end of this extent. */
+			cur = node->offset + node->length;
+			continue;
+		}
+		
+		node = node ? node->offset_next : extent_tree_offset_nsearch(&tree->offset_tree, &search_sentinel);
+		if (node && (node->offset < gap_end)) {
+			gap_end = node->offset;
+		}
+		
+		extent_tree_free_space(tree, gap_end - cur, cur);
+		added += gap_end - cur;
+		cur = gap_end;
+	}
+	
+	return added;
+}
+
+/*
+ * Remove the specified node from the tree.  Note that the parameter node
+ * must be an extant node in the tree.  The node is not freed.
  */
 __private_extern__ void 
-extent_tree_remove_node (extent_tree_offset_t *offset_tree, extent_node_t * node) {
+extent_tree_remove_node (extent_tree_t *tree, extent_node_t * node) {
 	
 	if (node) {
-		/* Just remove the entry from the tree */
-		extent_tree_offset_remove(offset_tree, node);
+		extent_tree_node_unlink(tree, node);
 	}
 	return;
 	
@@ -518,11 +738,11 @@ extent_tree_remove_node (extent_tree_offset_t *offset_tree, extent_node_t * node
  * For each node in the tree, print out its length and block offset.
  */
 __private_extern__ void
-extent_tree_offset_print(extent_tree_offset_t *offset_tree)
+extent_tree_offset_print(extent_tree_t *tree)
 {
 	extent_node_t *node = NULL;
 	
-	node = extent_tree_offset_first(offset_tree);
+	node = extent_tree_offset_first(&tree->offset_tree);
 	while (node) {
 		printf("length: %u, offset: %u\n", node->length, node->offset);
 		node = node->offset_next;
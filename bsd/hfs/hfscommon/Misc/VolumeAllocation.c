@@ -218,8 +218,11 @@ Red Black Tree Specific Routines
 #include <sys/ubc.h>
 #include <sys/uio.h>
 #include <kern/kalloc.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
 /* For VM Page size */
 #include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
 
 #include "../../hfs.h"
 #include "../../hfs_dbg.h"
@@ -250,6 +253,17 @@ SYSCTL_DECL(_vfs_generic);
 SYSCTL_NODE(_vfs_generic, OID_AUTO, hfs, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "HFS file system");
 SYSCTL_NODE(_vfs_generic_hfs, OID_AUTO, kdebug, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "HFS kdebug");
 SYSCTL_INT(_vfs_generic_hfs_kdebug, OID_AUTO, allocation, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_kdebug_allocation, 0, "Enable kdebug logging for HFS allocations");
+
+static struct hfs_alloc_stats hfs_alloc_stats;
+SYSCTL_STRUCT(_vfs_generic_hfs, OID_AUTO, alloc_stats, CTLFLAG_RD|CTLFLAG_LOCKED, &hfs_alloc_stats, hfs_alloc_stats, "HFS allocator statistics");
+
+/*
+ * Number of bitmap blocks the background tree build scans before it drops
+ * the bitmap lock to let allocations (and unmount) through.
+ */
+static u_int32_t hfs_treebuild_batch = 16;
+SYSCTL_UINT(_vfs_generic_hfs, OID_AUTO, treebuild_batch, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_treebuild_batch, 0, "Bitmap blocks scanned per bitmap lock hold while building the allocation tree");
+
 enum {
 	/*
 	 * HFSDBG_ALLOC_ENABLED: Log calls to BlockAllocate and
@@ -419,6 +433,14 @@ hfs_validate_rbtree (struct hfsmount *hfsmp,
 
 static void hfs_checktreelinks (struct hfsmount *hfsmp);
 
+static void hfs_rbtree_drain_frees(struct hfsmount *hfsmp);
+
+static void hfs_rbtree_track_alloc(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks);
+
+static void hfs_rbtree_track_free(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks);
+
+static void hfs_rbtree_defer_free(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks);
+
 
 void check_rbtree_extents (struct hfsmount *hfsmp,
 	u_int32_t start,
@@ -430,6 +452,8 @@ void check_rbtree_extents (struct hfsmount *hfsmp,
 								
 #endif /* CONFIG_HFS_ALLOC_RBTREE */
 
+static void hfs_alloc_account(int64_t *count, int64_t *total_time, u_int64_t start);
+
 /* Functions for manipulating free extent cache */
 static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
 static Boolean add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
@@ -675,6 +699,9 @@ static void hfs_unmap_alloc_extent(struct hfsmount *hfsmp, u_int32_t startingBlo
 ;				(via hfs_unmap_free_extent/journal_trim_add_extent) has been
 ;				written to the on-disk journal.  This routine will add those
 ;				extents to the free extent cache so that they can be reused.
+;				If the red-black tree allocator is in use, the extents are
+;				also queued for insertion into the tree; nothing is handed out
+;				from the tree until the transaction that freed it is on disk.
 ;
 ;				CAUTION: This routine is called while the journal's trim lock
 ;				is held shared, so that no other thread can reuse any portion
@@ -709,6 +736,9 @@ hfs_trim_callback(void *arg, uint32_t extent_count, const dk_extent_t *extents)
 		startBlock = (extents[i].offset - hfsmp->hfsPlusIOPosOffset) / hfsmp->blockSize;
 		numBlocks = extents[i].length / hfsmp->blockSize;
 		(void) add_free_extent_cache(hfsmp, startBlock, numBlocks);
+#if CONFIG_HFS_ALLOC_RBTREE
+		hfs_rbtree_defer_free(hfsmp, startBlock, numBlocks);
+#endif
 	}
 
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED)
@@ -968,17 +998,14 @@ OSErr BlockAllocate (
 				goto Exit; 
 			}
 			else {
-				//TODO: only tear down tree if the tree is finished building.
-				//Make sure to handle the ENOSPC condition properly.  We shouldn't error out in that case.
-				/* Tear down tree if we encounter an error */
-				if (hfsmp->extent_tree_flags & HFS_ALLOC_RB_ACTIVE) {
-					hfsmp->extent_tree_flags |= HFS_ALLOC_RB_ERRORED;
-					DestroyTrees(hfsmp);
-					ResetVCBFreeExtCache(hfsmp);				
-				}
-				else {
-					goto Exit;
-				}
+				/* 
+				 * Tear down tree if we encounter an error.  The tree is only used once it 
+				 * has finished building, so there is no partial tree to worry about here.
+				 */
+				hfsmp->extent_tree_flags |= HFS_ALLOC_RB_ERRORED;
+				DestroyTrees(hfsmp);
+				ResetVCBFreeExtCache(hfsmp);				
+				OSAddAtomic64(1, &hfs_alloc_stats.has_tree_errors);
 				// fall through to the normal allocation since the rb-tree allocation failed.
 			}
 		}
@@ -1160,18 +1187,16 @@ OSErr BlockDeallocate (
 	 * function. 
 	 *
 	 * Remember that we can get into this function if the tree isn't finished
-	 * building.  In that case, check to see if the block we're de-allocating is
-	 * past the high watermark
+	 * building.  In that case BlockMarkFreeInternal still updates the part of the
+	 * tree below the scanner's high watermark.
 	 */
 #if CONFIG_HFS_ALLOC_RBTREE
 	if (hfs_isrbtree_active(VCBTOHFS(vcb))) {
 		/*
-		 * BlockMarkFreeRBTree deals with the case where we are resizing the
+		 * BlockMarkFreeInternal deals with the case where we are resizing the
 		 * filesystem (shrinking), and we need to manipulate the bitmap beyond the portion
 		 * that is currenly controlled by the r/b tree.
 		 */
-		
-		//TODO: Update multiplexing code for the half-finished case.
 		err = BlockMarkFreeRBTree(vcb, firstBlock, numBlocks);
 		adjustFreeExtCache = 0;
 	}
@@ -1494,15 +1519,22 @@ static OSErr BlockAllocateContig(
 	u_int32_t		*actualStartBlock,
 	u_int32_t		*actualNumBlocks)
 {
+	OSErr err;
+	u_int64_t start = mach_absolute_time();
 
 #if CONFIG_HFS_ALLOC_RBTREE
 	if (hfs_isrbtree_active(VCBTOHFS(vcb))) {
-		return BlockAllocateContigRBTree(vcb, startingBlock, minBlocks, maxBlocks, useMetaZone, 
+		hfs_rbtree_drain_frees(VCBTOHFS(vcb));
+		err = BlockAllocateContigRBTree(vcb, startingBlock, minBlocks, maxBlocks, useMetaZone, 
 				actualStartBlock, actualNumBlocks, 1);
+		hfs_alloc_account(&hfs_alloc_stats.has_tree_allocs, &hfs_alloc_stats.has_tree_time, start);
+		return err;
 	}
 #endif
-	return BlockAllocateContigBitmap(vcb, startingBlock, minBlocks, 
+	err = BlockAllocateContigBitmap(vcb, startingBlock, minBlocks, 
 			maxBlocks, useMetaZone, actualStartBlock, actualNumBlocks);	
+	hfs_alloc_account(&hfs_alloc_stats.has_bitmap_allocs, &hfs_alloc_stats.has_bitmap_time, start);
+	return err;
 }
 
 /*
@@ -1599,7 +1631,7 @@ static OSErr BlockAllocateContigRBTree(
 	 * Find the first available extent that satifies the allocation by searching
 	 * from the starting point and moving forward
 	 */
-	node = extent_tree_off_search_next(&hfsmp->offset_tree, &search_sentinel);
+	node = extent_tree_off_search_next(&hfsmp->extent_tree, &search_sentinel);
 	
 	if (node) {
 		*actualStartBlock = node->offset;
@@ -1647,6 +1679,8 @@ static OSErr BlockAllocateContigRBTree(
 	/*
 	 * We may have failed to grow at the end of the file.  We'll try to find 
 	 * appropriate free extents, searching by size in the normal allocation zone.
+	 * Contiguous requests use the length tree to find the best fit, which costs
+	 * O(log n) and leaves the large free extents intact for later requests.
 	 * 
 	 * However, if we're allocating on behalf of a sparse device that hasn't explicitly
 	 * requested a contiguous chunk, then we try to search by offset, even if it 
@@ -1661,14 +1695,25 @@ static OSErr BlockAllocateContigRBTree(
 	
 	if ((vcb->hfs_flags & HFS_HAS_SPARSE_DEVICE) && (forceContig == 0)) {
 		/* just start with the first offset node */
-		node = extent_tree_off_search_next(&hfsmp->offset_tree, &search_sentinel);		
+		node = extent_tree_off_search_next(&hfsmp->extent_tree, &search_sentinel);		
 	}
 	else {
 		/* 
 		 * Otherwise, start from the end of the metadata zone or our next allocation pointer, 
-		 * and try to find the first chunk of size >= min.
+		 * and try to find the best chunk of size >= min.  BlockAllocateAny (which asks for a
+		 * single block) keeps the first fit so that it does not scatter files across the 
+		 * smallest holes on the volume.
 		 */
-		node = extent_tree_off_search_nextWithSize (&hfsmp->offset_tree, &search_sentinel);
+		if (forceContig) {
+			node = extent_tree_len_search_bestfit (&hfsmp->extent_tree, minBlocks, maxBlocks, 
+												   hfsmp->hfs_metazone_end);
+			if (node) {
+				OSAddAtomic64(1, &hfs_alloc_stats.has_tree_bestfit);
+			}
+		}
+		else {
+			node = extent_tree_off_search_nextWithSize (&hfsmp->extent_tree, &search_sentinel);
+		}
 		
 		if (node == NULL) {
 			extent_node_t *metaend_node;
@@ -1683,7 +1728,7 @@ static OSErr BlockAllocateContigRBTree(
 			 * cross the metazone boundary, then it is of no importance and we'd have to 
 			 * report ENOSPC.
 			 */
-			metaend_node = extent_tree_off_search_prev(&hfsmp->offset_tree, &search_sentinel);
+			metaend_node = extent_tree_off_search_prev(&hfsmp->extent_tree, &search_sentinel);
 			
 			if ((metaend_node) && (metaend_node->offset < hfsmp->hfs_metazone_end)) {
 				u_int32_t node_end = metaend_node->offset + metaend_node->length;
@@ -1708,7 +1753,12 @@ static OSErr BlockAllocateContigRBTree(
 	if ((!node) && useMetaZone) {
 		search_sentinel.offset = 0;
 		search_sentinel.length = minBlocks;
-		node = extent_tree_off_search_nextWithSize (&hfsmp->offset_tree, &search_sentinel);
+		if (forceContig) {
+			node = extent_tree_len_search_bestfit (&hfsmp->extent_tree, minBlocks, maxBlocks, 0);
+		}
+		else {
+			node = extent_tree_off_search_nextWithSize (&hfsmp->extent_tree, &search_sentinel);
+		}
 	}
 	
 	/* If we found something useful, then go ahead and update the bitmap */
@@ -1751,7 +1801,7 @@ static OSErr BlockAllocateContigRBTree(
 				   hfsmp->vcbVN, node, startingBlock, minBlocks, maxBlocks);
 			
 			/* Dump the list ? */
-			extent_tree_offset_print(&hfsmp->offset_tree);
+			extent_tree_offset_print(&hfsmp->extent_tree);
 			
 			printf("HFS allocator: Done printing list on FS (%s). Min %d, Max %d, Tree still alive.\n", 
 				   hfsmp->vcbVN, minBlocks, maxBlocks);
@@ -1817,13 +1867,20 @@ static OSErr BlockAllocateAny(
 	u_int32_t		*actualStartBlock,
 	u_int32_t		*actualNumBlocks)
 {
+	OSErr err;
+	u_int64_t start = mach_absolute_time();
 	
 #if CONFIG_HFS_ALLOC_RBTREE
 	if (hfs_isrbtree_active(VCBTOHFS(vcb))) {
-		return BlockAllocateAnyRBTree(vcb, startingBlock, maxBlocks, useMetaZone, actualStartBlock, actualNumBlocks);
+		hfs_rbtree_drain_frees(VCBTOHFS(vcb));
+		err = BlockAllocateAnyRBTree(vcb, startingBlock, maxBlocks, useMetaZone, actualStartBlock, actualNumBlocks);
+		hfs_alloc_account(&hfs_alloc_stats.has_tree_allocs, &hfs_alloc_stats.has_tree_time, start);
+		return err;
 	}
 #endif
-	return BlockAllocateAnyBitmap(vcb, startingBlock, endingBlock, maxBlocks, useMetaZone, actualStartBlock, actualNumBlocks);
+	err = BlockAllocateAnyBitmap(vcb, startingBlock, endingBlock, maxBlocks, useMetaZone, actualStartBlock, actualNumBlocks);
+	hfs_alloc_account(&hfs_alloc_stats.has_bitmap_allocs, &hfs_alloc_stats.has_bitmap_time, start);
+	return err;
 
 }
 
@@ -2077,6 +2134,10 @@ Exit:
 		 * these bitmap blocks before the TRIM happens.
 		 */
 		hfs_unmap_alloc_extent (vcb, *actualStartBlock, *actualNumBlocks);
+#if CONFIG_HFS_ALLOC_RBTREE
+		/* For the same reason, keep a tree that is still being built in sync. */
+		hfs_rbtree_track_alloc(hfsmp, *actualStartBlock, *actualNumBlocks);
+#endif
 	}
 	else {
 		*actualStartBlock = 0;
@@ -2269,6 +2330,10 @@ OSErr BlockMarkAllocatedInternal (
 	u_int32_t  wordsPerBlock;
 	// XXXdbg
 	struct hfsmount *hfsmp = VCBTOHFS(vcb);
+#if CONFIG_HFS_ALLOC_RBTREE
+	u_int32_t  startingBlock_in = startingBlock;	//	startingBlock/numBlocks are consumed below
+	u_int32_t  numBlocks_in = numBlocks;
+#endif
 
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_ALLOC_BITMAP | DBG_FUNC_START, startingBlock, numBlocks, 0, 0, 0);
@@ -2405,6 +2470,14 @@ Exit:
 	if (buffer)
 		(void)ReleaseBitmapBlock(vcb, blockRef, true);
 
+#if CONFIG_HFS_ALLOC_RBTREE
+	/*
+	 * Even on error: some of the bits may have been set, and it is always 
+	 * safe for the tree to think fewer blocks are free than really are.
+	 */
+	hfs_rbtree_track_alloc(hfsmp, startingBlock_in, numBlocks_in);
+#endif
+
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_ALLOC_BITMAP | DBG_FUNC_END, err, 0, 0, 0, 0);
 
@@ -2415,10 +2488,9 @@ Exit:
 /*
  * This is a wrapper function around BlockMarkAllocated.  This function is
  * called when the RB Tree-based allocator needs to mark a block as in-use.
- * This function should take the locks that would not normally be 
- * necessary for the normal bitmap allocator, and then call the function.  Once 
- * the on-disk data structures are updated properly, then this will remove the 
- * appropriate node from the tree.
+ * BlockMarkAllocatedInternal removes the blocks from the tree once the 
+ * on-disk bitmap has been updated; this wrapper only adds the consistency 
+ * checks that are enabled with ALLOC_DEBUG.
  */
 
 static OSErr BlockMarkAllocatedRBTree(
@@ -2428,7 +2500,6 @@ static OSErr BlockMarkAllocatedRBTree(
 {
 	OSErr err;
 	struct hfsmount *hfsmp  = VCBTOHFS(vcb);
-	int rb_err = 0;
 
 	
 	if (ALLOC_DEBUG) {
@@ -2449,59 +2520,10 @@ static OSErr BlockMarkAllocatedRBTree(
 				panic ("HFS RBTree Allocator: Blocks starting @ %x for %x blocks not in use yet!\n",
 					   startingBlock, numBlocks);
 			}
-		}
-		
-		/*
-		 * Mark the blocks in the offset tree.
-		 */
-		rb_err = extent_tree_offset_alloc_space(&hfsmp->offset_tree, numBlocks, startingBlock);
-		if (rb_err) {
-			if (ALLOC_DEBUG) {
-				printf("HFS RBTree Allocator: Could not mark blocks as in-use! %d \n", rb_err);
-			}
-			
-			/* 
-			 * We may be called from the BlockMarkAllocated interface, in which case, they would
-			 * not be picking extents from their start. Do a check here, find if the specified
-			 * extent is free, and if it is, then find the containing node.
-			 */
-			extent_node_t *node = NULL;
-			extent_node_t search_sentinel;
-			search_sentinel.offset = startingBlock;
-			
-			node = extent_tree_off_search_prev(&hfsmp->offset_tree, &search_sentinel);
-			
-			if (node) {
-				rb_err = extent_tree_offset_alloc_unaligned (&hfsmp->offset_tree, numBlocks, startingBlock);
-			}
-			
-			if (ALLOC_DEBUG) {
-				if (rb_err) {
-					printf ("HFS RBTree Allocator: Still Couldn't mark blocks as in-use! %d\n", rb_err);
-				}
-			}
-		}
-		if (ALLOC_DEBUG) {
 			check_rbtree_extents (VCBTOHFS(vcb), startingBlock, numBlocks, ASSERT_ALLOC);		
 		}
 	}
 	
-	/* 
-	 * If we encountered a red-black tree error, for now, we immediately back off and force
-	 * destruction of rb-tree.  Set the persistent error-detected bit in the mount point.
-	 * That will ensure that even if we reach a low-water-mark in the future we will still
-	 * not allow the rb-tree to be used.  On next mount, we will force a re-construction from
-	 * on-disk state.  As a fallback, we will now resort to the bitmap-scanning behavior.
-	 */
-	if (rb_err) {
-		/* Mark RB-Trees with error */
-		hfsmp->extent_tree_flags |= HFS_ALLOC_RB_ERRORED;
-		DestroyTrees(hfsmp);
-		/* Reset the Free Ext Cache since we'll be using it now. */
-		ResetVCBFreeExtCache(hfsmp);
-		printf("HFS: Red-Black Allocator Tree BlockMarkAllocated error\n");
-	}
-	
 	return err;
 }
 #endif
@@ -2545,7 +2567,9 @@ OSErr BlockMarkFree(
 					panic ("HFS RBTree Allocator: Blocks starting @ %x for %x blocks in use!\n",
 						   startingBlock, numBlocks);
 				}
-				check_rbtree_extents (hfsmp, startingBlock, numBlocks, ASSERT_FREE);		
+				if (hfsmp->jnl == NULL) {
+					check_rbtree_extents (hfsmp, startingBlock, numBlocks, ASSERT_FREE);
+				}
 			}
 		}
 		return err;
@@ -2878,6 +2902,9 @@ Exit:
 	
 	if (err == noErr) {
 		hfs_unmap_free_extent(vcb, unmapStart, unmapCount);
+#if CONFIG_HFS_ALLOC_RBTREE
+		hfs_rbtree_track_free(hfsmp, startingBlock_in, numBlocks_in);
+#endif
 	}
 
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
@@ -2901,10 +2928,10 @@ Corruption:
 /*
  * This is a wrapper function around BlockMarkFree.  This function is
  * called when the RB Tree-based allocator needs to mark a block as no longer
- * in use. This function should take the locks that would not normally be 
- * necessary for the normal bitmap deallocator, and then call the function.  Once 
- * the on-disk data structures are updated properly, then this will update an
- * existing rb-tree node if possible, or else create a new one. 
+ * in use.  BlockMarkFreeInternal hands the blocks to the tree once the on-disk
+ * bitmap has been updated (or, on a journaled volume, arranges for them to be 
+ * added once the transaction commits); this wrapper only adds the consistency 
+ * checks that are enabled with ALLOC_DEBUG.
  */
 
 OSErr BlockMarkFreeRBTree(
@@ -2914,7 +2941,6 @@ OSErr BlockMarkFreeRBTree(
 {
 	OSErr err;
 	struct hfsmount *hfsmp  = VCBTOHFS(vcb);
-	int rb_err = 0;
 	
 	if (ALLOC_DEBUG) {
 		REQUIRE_FILE_LOCK(vcb->hfs_allocation_vp, false);
@@ -2928,73 +2954,21 @@ OSErr BlockMarkFreeRBTree(
 	err = BlockMarkFreeInternal(vcb, startingBlock, numBlocks, true);
 	
 	if (err == noErr) {
-		
-		/*
-		 * During a filesystem truncation, we may need to relocate files out of the
-		 * portion of the bitmap that is no longer controlled by the r/b tree. 
-		 * In this case, just update the bitmap and do not attempt to manipulate the tree.
-		 */
-		if ((startingBlock >= hfsmp->offset_block_end) && 
-			(hfsmp->hfs_flags & HFS_RESIZE_IN_PROGRESS)) {
-			goto free_error;
-		}
-		
-		extent_node_t *newnode;
-		
 		if (ALLOC_DEBUG) {
 			/* 
-			 * Validate that the blocks in question are not allocated in the bitmap, and that they're
-			 * not in the offset tree, since it should be tracking free extents, rather than allocated 
-			 * extents
+			 * Validate that the blocks in question are not allocated in the bitmap.  On 
+			 * a journaled volume they only reach the tree after the transaction commits.
 			 */
 			if (hfs_isallocated(hfsmp, startingBlock, numBlocks)) {
 				panic ("HFS RBTree Allocator: Blocks starting @ %x for %x blocks still marked in-use!\n",
 					   startingBlock, numBlocks);
 			}
-		}		
-		
-		if ((hfsmp->extent_tree_flags & HFS_ALLOC_RB_ACTIVE) == 0) {
-			if (startingBlock >= hfsmp->offset_block_end) {
-				/*
-				 * If the tree generation code has not yet finished scanning the
-				 * bitmap region containing this extent, do nothing.  If the start 
-				 * of the range to be deallocated is greater than the current high 
-				 * watermark on the offset tree, just bail out and let the scanner catch up with us. 
-				 */							
-				rb_err = 0;
-				goto free_error;
+			if ((hfsmp->jnl == NULL) && (startingBlock < hfsmp->offset_block_end)) {
+				check_rbtree_extents (VCBTOHFS(vcb), startingBlock, numBlocks, ASSERT_FREE);
 			}
 		}
-		
-		newnode = extent_tree_free_space(&hfsmp->offset_tree, numBlocks, startingBlock);
-		if (newnode == NULL) {
-			rb_err = 1;
-			goto free_error;
-		}
-		
-		if (ALLOC_DEBUG) {
-			check_rbtree_extents (VCBTOHFS(vcb), startingBlock, numBlocks, ASSERT_FREE);
-		}
-		
-	}
-	
-free_error:
-	/* 
-	 * We follow the same principle as in BlockMarkAllocatedRB. 
-	 * If we encounter an error in adding the extents to the rb-tree, then immediately
-	 * back off, destroy the trees, and persistently set a bit in the runtime hfsmp flags
-	 * to indicate we should not use the rb-tree until next mount, when we can force a rebuild.
-	 */
-	if (rb_err) {
-		/* Mark RB-Trees with error */
-		hfsmp->extent_tree_flags |= HFS_ALLOC_RB_ERRORED;
-		DestroyTrees(hfsmp);
-		/* Reset the Free Ext Cache since we'll be using it now. */
-		ResetVCBFreeExtCache(hfsmp);
-		printf("HFS: Red-Black Allocator Tree BlockMarkFree error\n");
 	}
 	
-	
 	return err;
 	
 }
@@ -3447,7 +3421,7 @@ hfs_validate_rbtree (struct hfsmount *hfsmp, u_int32_t start, u_int32_t end){
 
 void 
 hfs_checktreelinks (struct hfsmount *hfsmp) {
-	extent_tree_offset_t *tree = &hfsmp->offset_tree;
+	extent_tree_t *tree = &hfsmp->extent_tree;
 	
 	extent_node_t *current = NULL;
 	extent_node_t *next = NULL;
@@ -3498,11 +3472,11 @@ hfs_isrbtree_allocated (struct hfsmount *hfsmp, u_int32_t startBlock,
 	search_sentinel.offset = startBlock;
 	search_sentinel.length = numBlocks;
 	
-	node = extent_tree_off_search_prev(&hfsmp->offset_tree, &search_sentinel);
+	node = extent_tree_off_search_prev(&hfsmp->extent_tree, &search_sentinel);
 	if (node) {
 
 		*ret_node = node;
-		nextnode = extent_tree_off_next (&hfsmp->offset_tree, node);
+		nextnode = extent_tree_off_next (&hfsmp->extent_tree, node);
 		if (nextnode != node->offset_next) {
 			panic ("hfs_rbtree_isallocated: Next pointers out of sync!\n");
 		}
@@ -3774,21 +3748,23 @@ hfs_isallocated(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t numBl
  * Check to see if the red-black tree is live.  Allocation file lock must be held
  * shared or exclusive to call this function. Note that we may call this even if
  * HFS is built without activating the red-black tree code.
+ *
+ * The tree only counts as live once the background scan has covered the whole 
+ * bitmap.  Until then allocations go through the bitmap scanner, and the partially 
+ * built tree is kept up to date by hfs_rbtree_track_alloc/hfs_rbtree_track_free.
  */
 __private_extern__
 int 
 hfs_isrbtree_active(struct hfsmount *hfsmp){
 	
-	//TODO: Update this function to deal with a truncate/resize coming in when the tree
-	//isn't fully finished.  maybe we need to check the flags for something other than ENABLED?
-	
 #if CONFIG_HFS_ALLOC_RBTREE
 	if (ALLOC_DEBUG) {
 		REQUIRE_FILE_LOCK(hfsmp->hfs_allocation_vp, false);
 	}
 	if (hfsmp){
 		
-		if (hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) {
+		if ((hfsmp->extent_tree_flags & (HFS_ALLOC_RB_ENABLED | HFS_ALLOC_RB_ACTIVE)) ==
+				(HFS_ALLOC_RB_ENABLED | HFS_ALLOC_RB_ACTIVE)) {
 			return 1;
 		}
 	}
@@ -3799,6 +3775,148 @@ hfs_isrbtree_active(struct hfsmount *hfsmp){
 	return 0;
 }
 
+/*
+ * Add one allocator call to the statistics exported via vfs.generic.hfs.alloc_stats.
+ */
+static void
+hfs_alloc_account(int64_t *count, int64_t *total_time, u_int64_t start)
+{
+	u_int64_t elapsed;
+	
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &elapsed);
+	OSAddAtomic64(1, count);
+	OSAddAtomic64(elapsed, total_time);
+}
+
+#if CONFIG_HFS_ALLOC_RBTREE
+/*
+ * Keeping the tree in sync with the bitmap
+ *
+ * Every change to the on-disk bitmap goes through BlockMarkAllocatedInternal or
+ * BlockMarkFreeInternal, and both report the change here so that the tree never 
+ * disagrees with the bitmap, whether the tree is live or still being built.  Only 
+ * the part of a range below offset_block_end is applied: the rest has not been 
+ * scanned yet (or lies beyond a shrinking volume), and the scanner will pick up 
+ * whatever is free there when it gets to it.
+ *
+ * Frees on a journaled volume are not applied immediately.  The blocks must not be 
+ * handed out again until the transaction that freed them is on disk, or a crash 
+ * could leave two files pointing at the same blocks.  The journal reports committed 
+ * frees through hfs_trim_callback, which queues them on offset_pending_frees; the 
+ * queue is merged into the tree under the bitmap lock before the tree is searched 
+ * or modified.  Allocating a queued extent before it is merged is fine, because 
+ * hfs_rbtree_track_alloc merges the queue before removing the allocated range.
+ */
+
+/*
+ * Called from the journal's trim callback with the trim lock held; must not block.
+ * If we cannot get memory the extent is simply not queued.  That only hides free 
+ * space from the tree until the next mount; it can never cause a double allocation.
+ */
+static void
+hfs_rbtree_defer_free(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks)
+{
+	extent_node_t *node;
+	
+	if ((hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) == 0) {
+		return;
+	}
+	
+	node = alloc_node_nowait(numBlocks, startBlock);
+	if (node == NULL) {
+		OSAddAtomic64(1, &hfs_alloc_stats.has_dropped_frees);
+		return;
+	}
+	
+	/* Re-check under the lock so that DestroyTrees cannot miss the node. */
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	if (hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) {
+		node->offset_next = hfsmp->offset_pending_frees;
+		hfsmp->offset_pending_frees = node;
+		node = NULL;
+	}
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+	
+	if (node) {
+		free_node(node);
+	}
+}
+
+/*
+ * Merge committed frees into the tree.  Bitmap lock must be held exclusive.
+ */
+static void
+hfs_rbtree_drain_frees(struct hfsmount *hfsmp)
+{
+	extent_node_t *node;
+	extent_node_t *next;
+	
+	lck_spin_lock(&hfsmp->vcbFreeExtLock);
+	node = hfsmp->offset_pending_frees;
+	hfsmp->offset_pending_frees = NULL;
+	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
+	
+	for (; node; node = next) {
+		next = node->offset_next;
+		
+		if ((hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) &&
+			(node->offset < hfsmp->offset_block_end)) {
+			u_int32_t count = MIN(node->length, hfsmp->offset_block_end - node->offset);
+			
+			/* 
+			 * The freed range may have been widened to include neighbouring free 
+			 * blocks for the benefit of TRIM, so parts of it can already be in the tree.
+			 */
+			(void) extent_tree_free_range(&hfsmp->extent_tree, count, node->offset);
+			OSAddAtomic64(1, &hfs_alloc_stats.has_deferred_frees);
+		}
+		free_node(node);
+	}
+}
+
+/*
+ * Blocks were just marked allocated in the bitmap; remove them from the tree.
+ */
+static void
+hfs_rbtree_track_alloc(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks)
+{
+	if ((hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) == 0) {
+		return;
+	}
+	
+	hfs_rbtree_drain_frees(hfsmp);
+	
+	if (startBlock >= hfsmp->offset_block_end) {
+		return;
+	}
+	numBlocks = MIN(numBlocks, hfsmp->offset_block_end - startBlock);
+	
+	(void) extent_tree_remove_range(&hfsmp->extent_tree, numBlocks, startBlock);
+}
+
+/*
+ * Blocks were just marked free in the bitmap; add them to the tree, unless the 
+ * journal will report them back once the free is committed.
+ */
+static void
+hfs_rbtree_track_free(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t numBlocks)
+{
+	if ((hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) == 0) {
+		return;
+	}
+	if (hfsmp->jnl != NULL) {
+		return;
+	}
+	
+	if (startBlock >= hfsmp->offset_block_end) {
+		return;
+	}
+	numBlocks = MIN(numBlocks, hfsmp->offset_block_end - startBlock);
+	
+	(void) extent_tree_free_range(&hfsmp->extent_tree, numBlocks, startBlock);
+}
+#endif /* CONFIG_HFS_ALLOC_RBTREE */
+
 
 /* 
  * This function scans the specified bitmap block and acts on it as necessary.
@@ -3814,6 +3932,9 @@ hfs_isrbtree_active(struct hfsmount *hfsmp){
  *				in the middle of an existing allocation block.
  * endBit		- the allocation block where we should end this search (inclusive).
  * bitToScan	- output argument for this function to specify the next bit to scan.
+ * list			- the trim list to record free extents in, or NULL when building the 
+ *				red-black tree, in which case free extents are inserted into the tree.
+ *				The two scans run separately, so each free extent goes to exactly one place.
  *
  * Returns:
  *		0 on success
@@ -3882,10 +4003,14 @@ static int hfs_alloc_scan_block(struct hfsmount *hfsmp, u_int32_t startbit,
 				 * we saw, and reset our tally counter.
 				 */
 				if (size != 0) {
+					if (list) {
+						hfs_track_unmap_blocks (hfsmp, offset, size, list);
+					}
 #if CONFIG_HFS_ALLOC_RBTREE
-					extent_tree_free_space(&hfsmp->offset_tree, size, offset);	
+					else {
+						extent_tree_free_space(&hfsmp->extent_tree, size, offset);
+					}
 #endif
-                    hfs_track_unmap_blocks (hfsmp, offset, size, list);                    
                     size = 0;
                     offset = 0;
 				}
@@ -3905,10 +4030,14 @@ DoneScanning:
 	
 	/* We may have been tracking a range of free blocks that hasn't been inserted yet. */
 	if (size != 0) {
+		if (list) {
+			hfs_track_unmap_blocks (hfsmp, offset, size, list);
+		}
 #if CONFIG_HFS_ALLOC_RBTREE
-		extent_tree_free_space(&hfsmp->offset_tree, size, offset);
+		else {
+			extent_tree_free_space(&hfsmp->extent_tree, size, offset);
+		}
 #endif
-        hfs_track_unmap_blocks (hfsmp, offset, size, list);
 	}
 	/* 
 	 * curAllocBlock represents the next block we need to scan while we're in this 
@@ -4008,7 +4137,7 @@ Exit:
 
 __private_extern__
 u_int32_t InitTree(struct hfsmount *hfsmp) {
-	extent_tree_init (&(hfsmp->offset_tree));
+	extent_tree_init (&(hfsmp->extent_tree));
 	return 0;
 }
 
@@ -4038,9 +4167,16 @@ u_int32_t GenerateTree(struct hfsmount *hfsmp, u_int32_t endBlock, int *flags, i
 	REQUIRE_FILE_LOCK(hfsmp->hfs_allocation_vp, false);
 	
 	u_int32_t *cur_block_eof;
+	u_int32_t batch = 0;
+	u_int64_t start = mach_absolute_time();
 	int error = 0;
 	
-	int USE_FINE_GRAINED_LOCKING = 0;
+	/* 
+	 * Only the initial scan at mount runs in its own thread and owns its lock.  Tree 
+	 * growth during a resize is called with the lock held by the caller (and flags == 0), 
+	 * so it must not drop it.
+	 */
+	int USE_FINE_GRAINED_LOCKING = (initialscan && (*flags != 0));
 		
 	/* Initialize the block counter while we hold the bitmap lock */
 	cur_block_eof = &hfsmp->offset_block_end;
@@ -4050,14 +4186,10 @@ u_int32_t GenerateTree(struct hfsmount *hfsmp, u_int32_t endBlock, int *flags, i
 	 * to scan them and add the results into the red-black tree.  We use the mount point
 	 * variable offset_block_end as our loop counter.  This gives us flexibility
 	 * because we can release the allocation bitmap lock and allow a thread that wants 
-	 * to make an allocation to grab the lock and do some scanning on our behalf while we're 
-	 * waiting to re-acquire the lock.  Then, the allocating thread will only do as much bitmap 
-	 * scanning as needed to fulfill its allocation.
-	 * 
-	 * If the other thread does IO for us, then it will update the offset_block_end 
-	 * variable as well, since it will use the same hfs_alloc_scan_block function to do its bit
-	 * scanning.  So when we re-grab the lock, our current EOF/loop will immediately skip us to the next 
-	 * block that needs scanning.
+	 * to make an allocation to grab the lock while we're waiting to re-acquire it.
+	 * Allocations made in the meantime go through the bitmap scanner, and 
+	 * BlockMarkAllocatedInternal/BlockMarkFreeInternal update the part of the tree 
+	 * below offset_block_end, so the tree and bitmap agree whenever we get the lock back.
 	 */
 	
 	while (*cur_block_eof < endBlock) {
@@ -4077,32 +4209,29 @@ u_int32_t GenerateTree(struct hfsmount *hfsmp, u_int32_t endBlock, int *flags, i
 			endBlock = hfsmp->allocLimit;
 		}
 		
-		/* 
-		 * TODO: fix unmount stuff!
-		 * See rdar://7391404
-		 *
-		 * Once the RB allocator is checked in, we'll want to augment it to not hold the 
-		 * allocation bitmap lock for the entire duration of the tree scan.  For a first check-in
-		 * it's ok to do that but we can't leave it like that forever.
-		 * 
-		 * The gist of the new algorithm will work as follows:
-		 * if an unmount is in flight and has been detected:
-		 *		abort tree-build.
-		 *		unset tree-in-progress bit.
-		 *		wakeup unmount thread
-		 *		unlock allocation bitmap lock, fail out.
-		 *
-		 * The corresponding code in the unmount side should already be in place. 
-		 */
+		error = hfs_alloc_scan_block (hfsmp, *cur_block_eof, endBlock, cur_block_eof, NULL);
+		if (error) {
+			break;
+		}
 		
-		error = hfs_alloc_scan_block (hfsmp, *cur_block_eof, endBlock, cur_block_eof);
-				
-		//TODO: Fix this below!
-		if (USE_FINE_GRAINED_LOCKING){
+		if (USE_FINE_GRAINED_LOCKING && (++batch >= hfs_treebuild_batch)) {
+			batch = 0;
 			hfs_systemfile_unlock(hfsmp, *flags);
 			*flags = hfs_systemfile_lock(hfsmp, SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+			
+			/*
+			 * If an unmount or a downgrade to read-only came in while we weren't 
+			 * holding the lock, give up; hfs_teardown_allocator is waiting for us.
+			 */
+			if (hfsmp->extent_tree_flags & HFS_ALLOC_TEARDOWN_INFLIGHT) {
+				error = EINTR;
+				break;
+			}
 		}
-		//TODO: Infer that if *flags == 0, we don't actually need to lock/unlock. 
+	}
+	
+	if (initialscan && (error == 0)) {
+		hfs_alloc_account(&hfs_alloc_stats.has_tree_builds, &hfs_alloc_stats.has_tree_build_time, start);
 	}
 	
 	return error;
@@ -4127,10 +4256,16 @@ void DestroyTrees(struct hfsmount *hfsmp) {
 	 */
 	
 	if (hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED) {
-		extent_tree_destroy(&hfsmp->offset_tree);
+		extent_tree_destroy(&hfsmp->extent_tree);
 		
-		/* Mark Trees as disabled */
-		hfsmp->extent_tree_flags &= ~HFS_ALLOC_RB_ENABLED;		
+		/* 
+		 * Mark Trees as disabled.  Clearing ACTIVE as well lets an upgrade mount 
+		 * rebuild the tree after a downgrade; HFS_ALLOC_RB_ERRORED stays set.
+		 */
+		hfsmp->extent_tree_flags &= ~(HFS_ALLOC_RB_ENABLED | HFS_ALLOC_RB_ACTIVE);
+		
+		/* With the tree disabled, this just discards any queued frees. */
+		hfs_rbtree_drain_frees(hfsmp);
 	}
 	
 	return;
@@ -4212,104 +4347,32 @@ u_int32_t UpdateAllocLimit (struct hfsmount *hfsmp, u_int32_t new_end_block) {
 	ResetVCBFreeExtCache(hfsmp);
 
 #if CONFIG_HFS_ALLOC_RBTREE
-	/* Shrinking the existing filesystem */
+	/* 
+	 * Shrinking the existing filesystem.  This applies to a tree that is still being 
+	 * built, too: the scanner stops at the new allocLimit, but may already be past it.
+	 */
 	if ((new_end_block < hfsmp->offset_block_end) &&
-		(hfsmp->extent_tree_flags & HFS_ALLOC_RB_ACTIVE)) {	
-		extent_node_t search_sentinel;
-		extent_node_t *node = NULL;
-		/* Remover points to the current item to free/remove from the tree */
-		extent_node_t *remover = NULL;
+		(hfsmp->extent_tree_flags & HFS_ALLOC_RB_ENABLED)) {	
 		
-		/* Begin search at the specified offset */
-		memset (&search_sentinel, 0, sizeof(extent_node_t));
-		search_sentinel.offset = new_end_block;
-				
-		/* 
-		 * Find the first available extent that satifies the allocation by searching
-		 * from the starting point or 1 earlier.  We may need to split apart an existing node
-		 * if it straddles the new alloc limit.
-		 */
-		node = extent_tree_off_search_prev(&hfsmp->offset_tree, &search_sentinel);
-		if (node) {
-			/* If it's an exact match, then just remove them all from this point forward */
-			if (node->offset == new_end_block) {
-				/* 
-				 * Find the previous entry and update its next pointer to NULL
-				 * since this entry is biting the dust.  Update remover to node.
-				 */
-				extent_node_t *prev = NULL;
-				prev = extent_tree_off_prev (&hfsmp->offset_tree, node);
-				if (prev) {
-					prev->offset_next = NULL;
-				}
-				remover = node;
-			}
-			else {
-				/* See if we need to split this node */
-				if ((node->offset + node->length) > new_end_block) {
-					/* 
-					 * Update node to reflect its new size up until new_end_block.
-					 */
-					remover = node->offset_next;
-					node->length = new_end_block - node->offset;
-					/* node is becoming the last free extent in the volume.  */
-					node->offset_next = NULL;
-				}
-				else {
-					if (node->offset_next == NULL) {
-						/*
-						 * 'node' points to the last free extent in the volume. 
-						 * Coincidentally, it is also before the new cut-off point at which 
-						 * we will stop representing bitmap values in the tree.  Just bail out now.
-						 */
-						return 0;
-					}
-					/* 
-					 * Otherwise, point our temp variable 'remover' to the node where
-					 * we'll need to start yanking things out of the tree, and make 'node' 
-					 * the last element in the tree in the linked list.
-					 */
-					remover = node->offset_next;
-					if (remover->offset <= new_end_block) {
-						panic ("UpdateAllocLimit: Invalid RBTree node next ptr!");
-					}
-					node->offset_next = NULL;
-				}
-			}
-			
-			/* 
-			 * Remover is our "temp" pointer that points to the current node to remove from 
-			 * the offset tree.  We'll simply iterate through the tree linked list, removing the current
-			 * element from the tree, freeing them as we come across them.
-			 */
-			while (remover) {
-				extent_node_t *next = remover->offset_next;
-				extent_tree_remove_node (&hfsmp->offset_tree, remover);
-				free_node (remover);
-				remover = next;
-			}
-			
-			if (ALLOC_DEBUG) {
-				printf ("UpdateAllocLimit: Validating rbtree after truncation\n");
-				hfs_validate_rbtree (hfsmp, 0, new_end_block-1);
-			}
-			
-			/* 
-			 * Don't forget to shrink offset_block_end after a successful truncation 
-			 * new_end_block should represent the number of blocks available on the 
-			 * truncated volume.
-			 */
-			
-			hfsmp->offset_block_end = new_end_block;
+		hfs_rbtree_drain_frees(hfsmp);
+		
+		/* Drop every free extent (or part of one) at or beyond the new end. */
+		(void) extent_tree_remove_range(&hfsmp->extent_tree, 0xFFFFFFFF, new_end_block);
 			
-			return 0;
-		}
-		else {
-			if (ALLOC_DEBUG) {
-				panic ("UpdateAllocLimit: no prev!");
-			}
-			return ENOSPC;
+		if (ALLOC_DEBUG) {
+			printf ("UpdateAllocLimit: Validating rbtree after truncation\n");
+			hfs_validate_rbtree (hfsmp, 0, new_end_block-1);
 		}
+		
+		/* 
+		 * Don't forget to shrink offset_block_end after a successful truncation 
+		 * new_end_block should represent the number of blocks available on the 
+		 * truncated volume.
+		 */
+		
+		hfsmp->offset_block_end = new_end_block;
+		
+		return 0;
 	}
 	/* Growing the existing filesystem */
 	else if ((new_end_block > hfsmp->offset_block_end) &&
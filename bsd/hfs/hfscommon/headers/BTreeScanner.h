@@ -36,6 +36,8 @@
 #ifdef KERNEL
 #ifdef __APPLE_API_PRIVATE
 #include <sys/time.h>
+#include <kern/locks.h>
+#include <kern/thread_call.h>
 
 #include "FileMgrInternal.h"
 #include "BTreesPrivate.h"
@@ -48,6 +50,14 @@ enum { kMaxMicroSecsInKernel = (1000 * 100) };	// 1 tenth of a second
 // in Mac OS 9
 enum { kCatSearchBufferSize = (32 * 1024) };
 
+// parallel read-ahead: each run is one physically contiguous read of up to
+// kCatSearchRunSize bytes of consecutive nodes, and at most kBTScanMaxRuns
+// of them are in flight ahead of the scan.  kBTScanMaxNodesPerRun assumes
+// the smallest (512 byte) node size.
+enum { kCatSearchRunSize = (128 * 1024) };
+enum { kBTScanMaxRuns = 8 };
+enum { kBTScanMaxNodesPerRun = (kCatSearchRunSize / 512) };
+
 
 /*
  * ============ W A R N I N G ! ============
@@ -93,9 +103,65 @@ struct BTScanState
 	u_int32_t			nodesLeftInBuffer;	// number of valid nodes still in the buffer
 	u_int32_t			recordsFound;		// number of leaf records seen so far
 	struct timeval		startTime;			// time we started catalog search
+	struct BTScanRuns *	runs;				// parallel read-ahead, or NULL
 };
 typedef struct BTScanState BTScanState;
 
+/*
+	BTScanRun - One read-ahead run of consecutive nodes.  The read and the
+	byte swapping of its nodes are done on a thread call; the scan consumes
+	runs strictly in node order, so records are still returned in the same
+	order as a sequential scan.  leafMap has a bit set for every node in the
+	run that swapped cleanly and is a leaf node.
+*/
+enum {
+	kBTScanRunIdle		= 0,
+	kBTScanRunReading	= 1,
+	kBTScanRunReady		= 2
+};
+
+struct BTScanRun
+{
+	struct BTScanRuns *	runs;
+	thread_call_t		call;
+	struct buf *		bufferPtr;
+	struct vnode *		devPtr;
+	daddr64_t			blockNum;			// physical block of firstNode
+	u_int32_t			firstNode;
+	u_int32_t			nodeCount;
+	int					state;
+	int					error;
+	u_int8_t			leafMap[kBTScanMaxNodesPerRun / 8];
+};
+
+struct BTScanRuns
+{
+	lck_mtx_t			lock;				// protects state, error and bufferPtr of each run
+	BTreeControlBlock *	btcb;
+	u_int32_t			runCount;
+	u_int32_t			runNodes;			// nodes per run
+	u_int32_t			head;				// run holding (or next to hold) nodeNum
+	u_int32_t			issued;				// runs in flight or ready, starting at head
+	u_int32_t			nextNode;			// first node not yet assigned to a run
+	struct BTScanRun	run[kBTScanMaxRuns];
+};
+
+/*
+ * Scanner throughput counters, exported as vfs.generic.hfs.scan_stats.
+ * Times are in nanoseconds; read time is summed across reader threads.
+ */
+struct hfs_scan_stats {
+	int64_t		hss_scans;			/* scans terminated */
+	int64_t		hss_parallel_scans;	/* of those, scans with parallel read-ahead */
+	int64_t		hss_reads;			/* node buffers read */
+	int64_t		hss_read_bytes;		/* bytes read into them */
+	int64_t		hss_read_time;		/* time spent reading and swapping them */
+	int64_t		hss_leaf_nodes;		/* leaf nodes found */
+	int64_t		hss_stalls;			/* times a scan waited for a read-ahead run */
+	int64_t		hss_stall_time;		/* time spent waiting */
+	int64_t		hss_discarded;		/* read-ahead runs released unused */
+};
+
 
 /* *********************** PROTOTYPES *********************** */
 
@@ -106,6 +172,9 @@ int	BTScanInitialize(	const FCB *		btreeFile,
 						u_int32_t		bufferSize,
 						BTScanState	*	scanState     );
 							
+int	BTScanStartReadAhead(	BTScanState *	scanState,
+							u_int32_t		runCount	);
+
 int BTScanNextRecord(	BTScanState *	scanState,
 						Boolean			avoidIO,
 						void * *		key,
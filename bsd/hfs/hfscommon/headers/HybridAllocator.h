@@ -41,61 +41,89 @@ struct extent_node
 	u_int32_t offset;
 	struct extent_node *offset_next;
 	rb_node(extent_node_t) offset_link;
+	rb_node(extent_node_t) length_link;
 };
 
 typedef rb_tree(extent_node_t) extent_tree_offset_t;
+typedef rb_tree(extent_node_t) extent_tree_length_t;
+
+/*
+ * Every free extent is linked into both trees.  The offset tree answers
+ * locality questions ("what is free at or after block N?"); the length tree
+ * is sorted by (length, offset) and answers best-fit questions ("what is the
+ * smallest free extent of at least N blocks?").
+ */
+typedef struct extent_tree {
+	extent_tree_offset_t offset_tree;
+	extent_tree_length_t length_tree;
+} extent_tree_t;
 
 extern extent_node_t *
 alloc_node(u_int32_t length, u_int32_t offset);
 
+extern extent_node_t *
+alloc_node_nowait(u_int32_t length, u_int32_t offset);
+
 extern void
 free_node(extent_node_t *node); 
 
 extern extent_node_t *
-extent_tree_free_space( extent_tree_offset_t *offset_tree, u_int32_t size, u_int32_t offset);
+extent_tree_free_space( extent_tree_t *tree, u_int32_t size, u_int32_t offset);
+
+extern u_int32_t
+extent_tree_free_range(extent_tree_t *tree, u_int32_t size, u_int32_t offset);
 
 extern void
-extent_tree_offset_print(extent_tree_offset_t *offset_tree);
+extent_tree_offset_print(extent_tree_t *tree);
 
 extern int32_t
-extent_tree_offset_alloc_space(extent_tree_offset_t *offset_tree, u_int32_t size, u_int32_t offset);
+extent_tree_offset_alloc_space(extent_tree_t *tree, u_int32_t size, u_int32_t offset);
 
 extern int32_t
-extent_tree_offset_alloc_unaligned(extent_tree_offset_t *tree, u_int32_t size, u_int32_t offset);
+extent_tree_offset_alloc_unaligned(extent_tree_t *tree, u_int32_t size, u_int32_t offset);
 
+extern u_int32_t
+extent_tree_remove_range(extent_tree_t *tree, u_int32_t size, u_int32_t offset);
 
 extern void
-extent_tree_remove_node (extent_tree_offset_t *offset_tree, extent_node_t * node);
+extent_tree_remove_node (extent_tree_t *tree, extent_node_t * node);
 
 extern extent_node_t *
-extent_tree_off_first (extent_tree_offset_t *offset_tree);
+extent_tree_off_first (extent_tree_t *tree);
 
 extern extent_node_t *
-extent_tree_off_search(extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_off_search(extent_tree_t *tree, extent_node_t *node);
 
 extern extent_node_t *
-extent_tree_off_search_next(extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_off_search_next(extent_tree_t *tree, extent_node_t *node);
 
 extern extent_node_t*
-extent_tree_off_search_nextWithSize (extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_off_search_nextWithSize (extent_tree_t *tree, extent_node_t *node);
+
+extern extent_node_t *
+extent_tree_off_search_prev(extent_tree_t *tree, extent_node_t *node);
 
 extern extent_node_t *
-extent_tree_off_search_prev(extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_off_next(extent_tree_t *tree, extent_node_t *node);
 
 extern extent_node_t *
-extent_tree_off_next(extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_off_prev(extent_tree_t *tree, extent_node_t *node);
 
 extern extent_node_t *
-extent_tree_off_prev(extent_tree_offset_t *offset_tree, extent_node_t *node);
+extent_tree_len_search_bestfit(extent_tree_t *tree, u_int32_t min_length, 
+							   u_int32_t max_length, u_int32_t min_offset);
 
 extern void
-extent_tree_init(extent_tree_offset_t *offset_tree);
+extent_tree_init(extent_tree_t *tree);
 
 extern void
-extent_tree_destroy(extent_tree_offset_t *offset_tree);
+extent_tree_destroy(extent_tree_t *tree);
 
 extern int
 cmp_offset_node(extent_node_t *node_1, extent_node_t *node_2);
 
+extern int
+cmp_length_node(extent_node_t *node_1, extent_node_t *node_2);
+
 
 #endif
@@ -28,10 +28,27 @@
 
 #if HFS
 
+#ifdef KERNEL
 #include <sys/param.h>
 #include <mach/boolean.h>
 #include <sys/time.h>
 #include <sys/malloc.h>
+#include <kern/assert.h>
+#else
+/*
+ * Built in user space by tools/tests/rangelist_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <sys/types.h>
+
+#define MALLOC(p, t, s, type, flags)	((p) = (t)malloc(s))
+#define FREE(p, type)			free(p)
+#define panic(...)			do { fprintf(stderr, __VA_ARGS__); abort(); } while (0)
+#endif
 
 #include "rangelist.h"
 
@@ -41,14 +58,44 @@ static void rl_collapse_backwards(struct rl_head *rangelist, struct rl_entry *ra
 static void rl_collapse_neighbors(struct rl_head *rangelist, struct rl_entry *range);
 
 
+/*
+ * Ranges never overlap, so rl_start alone is a unique key
+ */
+static int
+rl_cmp(struct rl_entry *a, struct rl_entry *b)
+{
+	if (a->rl_start < b->rl_start)
+		return (-1);
+	if (a->rl_start > b->rl_start)
+		return (1);
+	return (0);
+}
+
+rb_wrap(__attribute__ ((unused)) static, rl_tree_, rl_tree_t, struct rl_entry, rl_link, rl_cmp)
+
+
+/*
+ * A range list head that was bzero'ed rather than rl_init'ed
+ * is treated as empty, and set up on the first rl_add.
+ */
+static __inline__ int
+rl_isempty(struct rl_head *rangelist)
+{
+	return (rangelist->rl_tree.rbt_root == NULL ||
+	        rangelist->rl_tree.rbt_root == &rangelist->rl_tree.rbt_nil);
+}
+
+
 #ifdef RL_DIAGNOSTIC
 static void
 rl_verify(struct rl_head *rangelist) {
 	struct rl_entry *entry;
-	struct rl_entry *next;
 	off_t limit = 0;
 	
-	TAILQ_FOREACH_SAFE(rangelist, entry, rl_link, next) {
+	if (rl_isempty(rangelist))
+		return;
+
+	for (entry = rl_tree_first(&rangelist->rl_tree); entry; entry = rl_tree_next(&rangelist->rl_tree, entry)) {
 		if ((limit > 0) && (entry->rl_start <= limit)) panic("hfs: rl_verify: bad entry start?!");
 		if (entry->rl_end < entry->rl_start) panic("hfs: rl_verify: bad entry end?!");
 		limit = entry->rl_end;
@@ -64,7 +111,33 @@ rl_verify(struct rl_head *rangelist) {
 void
 rl_init(struct rl_head *rangelist)
 {
-    TAILQ_INIT(rangelist);
+	rl_tree_new(&rangelist->rl_tree);
+}
+
+
+
+/*
+ * Range list iteration, in ascending order of rl_start
+ */
+int
+rl_empty(struct rl_head *rangelist)
+{
+	return (rl_isempty(rangelist));
+}
+
+struct rl_entry *
+rl_first(struct rl_head *rangelist)
+{
+	if (rl_isempty(rangelist))
+		return (NULL);
+
+	return (rl_tree_first(&rangelist->rl_tree));
+}
+
+struct rl_entry *
+rl_next(struct rl_head *rangelist, struct rl_entry *range)
+{
+	return (rl_tree_next(&rangelist->rl_tree, range));
 }
 
 
@@ -83,6 +156,9 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 	if (end < start) panic("hfs: rl_add: end < start?!");
 #endif
 
+	if (rangelist->rl_tree.rbt_root == NULL)
+		rl_init(rangelist);
+
 	ovcase = rl_scan(rangelist, start, end, &overlap);
 			
 	/*
@@ -96,22 +172,12 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 	 */
 	switch (ovcase) {
 		case RL_NOOVERLAP: /* 0: no overlap */
-			/*
-				* If the list was empty 'prev' is undisturbed and 'overlap' == NULL;
-				* if the search hit a non-overlapping entry PAST the start of the
-				* new range, 'prev' points to ITS predecessor, and 'overlap' points
-				* to that entry:
-				*/
 			MALLOC(range, struct rl_entry *, sizeof(*range), M_TEMP, M_WAITOK);
 			range->rl_start = start;
 			range->rl_end = end;
 			
 			/* Link in the new range: */
-			if (overlap) {
-				TAILQ_INSERT_AFTER(rangelist, overlap, range, rl_link);
-			} else {
-				TAILQ_INSERT_HEAD(rangelist, range, rl_link);
-			}
+			rl_tree_insert(&rangelist->rl_tree, range);
 			
 			/* Check to see if any ranges can be combined (possibly including the immediately
 			   preceding range entry)
@@ -126,7 +192,9 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 
 		case RL_OVERLAPISCONTAINED: /* 3: range contains overlap */
 			/*
-			 * Replace the overlap with the new, larger range:
+			 * Replace the overlap with the new, larger range... 'overlap'
+			 * is the first range touching [start, end], so moving its
+			 * start down doesn't change its position in the tree:
 			 */
 			overlap->rl_start = start;
 			overlap->rl_end = end;
@@ -169,23 +237,27 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 void
 rl_remove(off_t start, off_t end, struct rl_head *rangelist)
 {
-	struct rl_entry *range, *next_range, *overlap, *splitrange;
+	struct rl_entry *overlap, *splitrange;
 	int ovcase;
 
 #ifdef RL_DIAGNOSTIC
 	if (end < start) panic("hfs: rl_remove: end < start?!");
 #endif
 
-	if (TAILQ_EMPTY(rangelist)) {
+	if (rl_isempty(rangelist)) {
 		return;
 	};
         
-	range = TAILQ_FIRST(rangelist);
-	while ((ovcase = rl_scan_from(rangelist, start, end, &overlap, range))) {
+	/*
+	 * every pass either finishes or takes the first overlapping
+	 * entry out of [start, end], so the next lookup finds the
+	 * following one
+	 */
+	while ((ovcase = rl_scan(rangelist, start, end, &overlap))) {
 		switch (ovcase) {
 
 		case RL_MATCHINGOVERLAP: /* 1: overlap == range */
-			TAILQ_REMOVE(rangelist, overlap, rl_link);
+			rl_tree_remove(&rangelist->rl_tree, overlap);
 			FREE(overlap, M_TEMP);
 			break;
 
@@ -211,27 +283,17 @@ rl_remove(off_t start, off_t end, struct rl_head *rangelist)
 			/*
 			* Now link the new entry into the range list after the range from which it was split:
 			*/
-			TAILQ_INSERT_AFTER(rangelist, overlap, splitrange, rl_link);
+			rl_tree_insert(&rangelist->rl_tree, splitrange);
 			break;
 
 		case RL_OVERLAPISCONTAINED: /* 3: range contains overlap */
-			/* Check before discarding overlap entry */
-			next_range = TAILQ_NEXT(overlap, rl_link);
-			TAILQ_REMOVE(rangelist, overlap, rl_link);
+			rl_tree_remove(&rangelist->rl_tree, overlap);
 			FREE(overlap, M_TEMP);
-			if (next_range) {
-				range = next_range;
-				continue;
-			};
-			break;
+			continue;
 
 		case RL_OVERLAPSTARTSBEFORE: /* 4: overlap starts before range */
 			overlap->rl_end = start - 1;
-			range = TAILQ_NEXT(overlap, rl_link);
-			if (range) {
-				continue;
-			}
-			break;
+			continue;
 
 		case RL_OVERLAPENDSAFTER: /* 5: overlap ends after range */
 			overlap->rl_start = (end == RL_INFINITY ? RL_INFINITY : end + 1);
@@ -259,13 +321,32 @@ rl_scan(struct rl_head *rangelist,
 		off_t start,
 		off_t end,
 		struct rl_entry **overlap) {
+	struct rl_entry key, *range, *next;
 		
-	if (TAILQ_EMPTY(rangelist)) {
+	if (rl_isempty(rangelist)) {
 		*overlap = NULL;
 		return RL_NOOVERLAP;
 	};
+
+	/*
+	 * The only range that starts before 'start' and can still overlap
+	 * is the last one to do so; if it ends before 'start', the first
+	 * candidate is its successor.
+	 */
+	key.rl_start = start;
+	range = rl_tree_psearch(&rangelist->rl_tree, &key);
+
+	if (range == NULL) {
+		range = rl_tree_first(&rangelist->rl_tree);
+	} else if ((range->rl_end != RL_INFINITY) && (range->rl_end < start)) {
+		if ((next = rl_tree_next(&rangelist->rl_tree, range)) == NULL) {
+			*overlap = NULL;
+			return RL_NOOVERLAP;
+		}
+		range = next;
+	}
         
-	return rl_scan_from(rangelist, start, end, overlap, TAILQ_FIRST(rangelist));	
+	return rl_scan_from(rangelist, start, end, overlap, range);	
 }
 
 
@@ -284,11 +365,6 @@ rl_scan_from(struct rl_head *rangelist,
 			 struct rl_entry **overlap,
 			struct rl_entry *range)
 {
-	if (TAILQ_EMPTY(rangelist)) {
-		*overlap = NULL;
-		return RL_NOOVERLAP;
-	};
-        
 #ifdef RL_DIAGNOSTIC
 		rl_verify(rangelist);
 #endif
@@ -311,12 +387,14 @@ rl_scan_from(struct rl_head *rangelist,
 			((end != RL_INFINITY) && (range->rl_start > end))) {
 			/* Case 0 (RL_NOOVERLAP), at least with the current entry: */
 			if ((end != RL_INFINITY) && (range->rl_start > end)) {
+				*overlap = NULL;
 				return RL_NOOVERLAP;
 			};
 			
-			range = TAILQ_NEXT(range, rl_link);
+			range = rl_tree_next(&rangelist->rl_tree, range);
 			/* Check the other entries in the list: */
 			if (range == NULL) {
+				*overlap = NULL;
 				return RL_NOOVERLAP;
 			}
 			
@@ -370,19 +448,20 @@ static void
 rl_collapse_forwards(struct rl_head *rangelist, struct rl_entry *range) {
 	struct rl_entry *next_range;
 	
-	while ((next_range = TAILQ_NEXT(range, rl_link))) { 
+	while ((next_range = rl_tree_next(&rangelist->rl_tree, range))) { 
 		if ((range->rl_end != RL_INFINITY) && (range->rl_end < next_range->rl_start - 1)) return;
 
-		/* Expand this range to include the next range: */
-		range->rl_end = next_range->rl_end;
+		/*
+		 * Expand this range to include the next range (which may
+		 * lie entirely within it after an rl_add of a larger range):
+		 */
+		if ((next_range->rl_end == RL_INFINITY) ||
+		    ((range->rl_end != RL_INFINITY) && (next_range->rl_end > range->rl_end)))
+			range->rl_end = next_range->rl_end;
 
 		/* Remove the now covered range from the list: */
-		TAILQ_REMOVE(rangelist, next_range, rl_link);
+		rl_tree_remove(&rangelist->rl_tree, next_range);
 		FREE(next_range, M_TEMP);
-
-#ifdef RL_DIAGNOSTIC
-		rl_verify(rangelist);
-#endif
 	};
 }
 
@@ -392,21 +471,24 @@ static void
 rl_collapse_backwards(struct rl_head *rangelist, struct rl_entry *range) {
     struct rl_entry *prev_range;
     
-		while ((prev_range = TAILQ_PREV(range, rl_head, rl_link))) {
-			if (prev_range->rl_end < range->rl_start -1) {
+	while ((prev_range = rl_tree_prev(&rangelist->rl_tree, range))) {
+		if (prev_range->rl_end < range->rl_start -1) {
 #ifdef RL_DIAGNOSTIC
 			rl_verify(rangelist);
 #endif
-        	return;
-        };
+			return;
+		};
         
-        /* Expand this range to include the previous range: */
-        range->rl_start = prev_range->rl_start;
-    
-        /* Remove the now covered range from the list: */
-        TAILQ_REMOVE(rangelist, prev_range, rl_link);
-        FREE(prev_range, M_TEMP);
-    };
+		/*
+		 * Remove the previous range before taking over its start,
+		 * so that no two entries in the tree share a key:
+		 */
+		rl_tree_remove(&rangelist->rl_tree, prev_range);
+
+		/* Expand this range to include the previous range: */
+		range->rl_start = prev_range->rl_start;
+		FREE(prev_range, M_TEMP);
+	};
 }
 
 
@@ -427,6 +509,9 @@ void rl_add(off_t start, off_t end, void *rangelist);
 void rl_init(void *rangelist);
 void rl_remove(off_t start, off_t end, void *rangelist);
 int rl_scan(void *rangelist, off_t start, off_t end, void **overlap);
+int rl_empty(void *rangelist);
+void *rl_first(void *rangelist);
+void *rl_next(void *rangelist, void *range);
 
 void rl_add(__unused off_t start, __unused off_t end, __unused void *rangelist)
 {
@@ -448,4 +533,19 @@ int rl_scan(__unused void *rangelist, __unused off_t start, __unused off_t end,
 	return(0);
 }
 
+int rl_empty(__unused void *rangelist)
+{
+	return(1);
+}
+
+void *rl_first(__unused void *rangelist)
+{
+	return(NULL);
+}
+
+void *rl_next(__unused void *rangelist, __unused void *range)
+{
+	return(NULL);
+}
+
 #endif /* HFS */
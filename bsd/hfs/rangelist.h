@@ -30,10 +30,10 @@
 
 #include <sys/appleapiopts.h>
 
-#ifdef KERNEL
+#if defined(KERNEL) || defined(RL_USERSPACE)
 #ifdef __APPLE_API_PRIVATE
 #include <sys/types.h>
-#include <sys/queue.h>
+#include <hfs/hfscommon/headers/RedBlackTree.h>
 
 enum rl_overlaptype {
     RL_NOOVERLAP = 0,		/* 0 */
@@ -46,14 +46,25 @@ enum rl_overlaptype {
 
 #define RL_INFINITY ((off_t)-1)
 
-TAILQ_HEAD(rl_head, rl_entry);
-
+/*
+ * The ranges in a list never overlap or abut (adjacent ranges are
+ * collapsed), so ordering them by rl_start also orders them by rl_end.
+ * That lets a plain red-black tree keyed on rl_start serve as the
+ * interval tree: the first range overlapping [start, end] is either the
+ * last range starting at or before 'start' or its successor.
+ */
 struct rl_entry {
-    TAILQ_ENTRY(rl_entry) rl_link;
+    rb_node(struct rl_entry) rl_link;
     off_t rl_start;
     off_t rl_end;
 };
 
+typedef rb_tree(struct rl_entry) rl_tree_t;
+
+struct rl_head {
+    rl_tree_t rl_tree;
+};
+
 __BEGIN_DECLS
 void rl_init(struct rl_head *rangelist);
 void rl_add(off_t start, off_t end, struct rl_head *rangelist);
@@ -62,8 +73,11 @@ enum rl_overlaptype rl_scan(struct rl_head *rangelist,
 							off_t start,
 							off_t end,
 							struct rl_entry **overlap);
+int rl_empty(struct rl_head *rangelist);
+struct rl_entry *rl_first(struct rl_head *rangelist);
+struct rl_entry *rl_next(struct rl_head *rangelist, struct rl_entry *range);
 __END_DECLS
 
 #endif /* __APPLE_API_PRIVATE */
-#endif /* KERNEL */
+#endif /* KERNEL || RL_USERSPACE */
 #endif /* ! _HFS_RANGELIST_H_ */
@@ -42,7 +42,14 @@ char unregister_decmpfs_decompressor;
 #include <sys/ubc.h>
 #include <sys/decmpfs.h>
 #include <sys/uio_internal.h>
+#include <sys/sysctl.h>
 #include <libkern/OSByteOrder.h>
+#include <libkern/OSAtomic.h>
+#include <kern/thread.h>
+#include <machine/machine_routines.h>
+#if ZLIB
+#include <libkern/zlib.h>
+#endif
 
 #pragma mark --- debugging ---
 
@@ -157,6 +164,7 @@ _free(char *ret, __unused int type, const char *file, int line)
 static lck_grp_t *decmpfs_lockgrp;
 
 static decmpfs_registration * decompressors[CMP_MAX]; /* the registered compressors */
+static decmpfs_registration * builtin_decompressors[CMP_MAX]; /* in-kernel compressors, which a kext may replace */
 static lck_rw_t * decompressorsLock;
 static int decompress_channel; /* channel used by decompress_file to wake up waiters */
 static lck_mtx_t *decompress_channel_mtx;
@@ -922,8 +930,9 @@ register_decmpfs_decompressor(uint32_t compression_type, decmpfs_registration *r
     
     lck_rw_lock_exclusive(decompressorsLock); locked = 1;
 	
-    /* make sure the registration for this type is zero */
-	if (decompressors[compression_type] != NULL) {
+    /* make sure the registration for this type is zero, or is our own built-in one */
+	if (decompressors[compression_type] != NULL &&
+	    decompressors[compression_type] != builtin_decompressors[compression_type]) {
 		ret = EEXIST;
 		goto out;
 	}
@@ -955,9 +964,12 @@ unregister_decmpfs_decompressor(uint32_t compression_type, decmpfs_registration
         ret = EEXIST;
         goto out;
     }
-    decompressors[compression_type] = NULL;
-    snprintf(resourceName, sizeof(resourceName), "com.apple.AppleFSCompression.Type%u", compression_type);
-    IOServicePublishResource(resourceName, FALSE);
+    /* fall back to the built-in decompressor for this type, if there is one */
+    decompressors[compression_type] = builtin_decompressors[compression_type];
+    if (decompressors[compression_type] == NULL) {
+        snprintf(resourceName, sizeof(resourceName), "com.apple.AppleFSCompression.Type%u", compression_type);
+        IOServicePublishResource(resourceName, FALSE);
+    }
     
 out:
     if (locked) lck_rw_unlock_exclusive(decompressorsLock);
@@ -1764,6 +1776,747 @@ static decmpfs_registration Type1Reg =
     .get_flags         = NULL  /* no flags */
 };
 
+#if ZLIB
+#pragma mark --- zlib compressors ---
+
+/*
+ The zlib compressors store the data fork deflated with zlib.  "Type3" keeps the compressed
+ bytes in the compression xattr, after the header.  "Type4" keeps them in the resource fork,
+ split into 64k chunks that are compressed independently.  In both, a payload or chunk whose
+ first byte has its low nibble set to 0xF is stored uncompressed after that byte.
+ 
+ The Type4 resource fork starts with a big-endian resource fork header whose first field is the
+ offset of the resource data.  The data begins with a 4 byte resource length, followed by the
+ little-endian chunk table: a chunk count and then an { offset, size } pair per chunk, with
+ offsets relative to the start of the table.
+ 
+ Decompressed Type4 chunks are kept in a small cache shared by all files, so that page-ins which
+ cover only part of a chunk do not inflate it again.  Sequential readers have the next chunks
+ inflated ahead of them by a pool of worker threads, and a fetch which spans several uncached
+ chunks hands them to the same workers so that they are inflated in parallel.
+ */
+
+#define ZCHUNK_SIZE           (64 * 1024)
+#define ZCHUNK_HASH_SIZE      256             /* must be a power of 2 */
+#define ZCHUNK_MAX_THREADS    8
+#define ZCHUNK_MAX_PREFETCH   16              /* bounds the zlib_prefetch sysctl */
+#define ZCHUNK_UNCOMPRESSED(b) (((b) & 0x0F) == 0x0F)
+
+typedef struct zchunk {
+    LIST_ENTRY(zchunk) zc_hash;
+    TAILQ_ENTRY(zchunk) zc_list;      /* lru list when idle, work queue while queued */
+    vnode_t  zc_vp;
+    uint32_t zc_vid;
+    uint32_t zc_index;
+    uint64_t zc_fsize;                /* uncompressed size of the file, in case it is recompressed */
+    off_t    zc_cstart;               /* location of the compressed bytes in the resource fork */
+    uint32_t zc_csize;
+    uint32_t zc_len;                  /* uncompressed length of this chunk */
+    int32_t  zc_refs;
+    int      zc_flags;
+    int      zc_error;
+    char    *zc_data;
+} zchunk;
+
+/* zc_flags */
+#define ZC_BUSY       0x01            /* being inflated */
+#define ZC_WANTED     0x02            /* someone is waiting for ZC_BUSY to clear */
+#define ZC_QUEUED     0x04            /* on the work queue */
+#define ZC_SYNC       0x08            /* the reader that queued it holds an iocount on zc_vp */
+#define ZC_STALE      0x10            /* no longer in the hash */
+#define ZC_PREFETCHED 0x20            /* inflated ahead of the reader and not yet used */
+
+struct decmpfs_zstats {
+    int64_t hits;                     /* chunks found in the cache */
+    int64_t misses;                   /* chunks inflated on behalf of a reader */
+    int64_t prefetched;               /* chunks queued for read-ahead */
+    int64_t prefetch_hits;            /* read-ahead chunks that were later used */
+    int64_t parallel;                 /* reader chunks inflated by a worker thread */
+    int64_t waits;                    /* times a reader waited for a busy chunk */
+    int64_t inflated_bytes;
+    int64_t errors;
+};
+
+static lck_mtx_t *zcache_mtx;
+static LIST_HEAD(zchunk_head, zchunk) zcache_hash[ZCHUNK_HASH_SIZE];
+static TAILQ_HEAD(, zchunk) zcache_lru = TAILQ_HEAD_INITIALIZER(zcache_lru);
+static TAILQ_HEAD(, zchunk) zwork_queue = TAILQ_HEAD_INITIALIZER(zwork_queue);
+static uint32_t zcache_count;
+
+static uint32_t decmpfs_zcache_chunks = 128;
+static uint32_t decmpfs_zprefetch = 4;
+static uint32_t decmpfs_zthreads = ZCHUNK_MAX_THREADS;
+static struct decmpfs_zstats decmpfs_zstats;
+
+static int
+sysctl_zprefetch SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+    int i, err;
+    
+    i = decmpfs_zprefetch;
+    
+    err = sysctl_handle_int(oidp, &i, 0, req);
+    if (err != 0 || req->newptr == USER_ADDR_NULL)
+        return err;
+    
+    /* keeps last + decmpfs_zprefetch from wrapping, and the table read small */
+    if (i < 0)
+        i = 0;
+    else if (i > ZCHUNK_MAX_PREFETCH)
+        i = ZCHUNK_MAX_PREFETCH;
+    
+    decmpfs_zprefetch = i;
+    return err;
+}
+
+SYSCTL_DECL(_vfs_generic);
+SYSCTL_NODE(_vfs_generic, OID_AUTO, decmpfs, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "decmpfs");
+SYSCTL_UINT(_vfs_generic_decmpfs, OID_AUTO, zlib_cache_chunks, CTLFLAG_RW|CTLFLAG_LOCKED, &decmpfs_zcache_chunks, 0, "decompressed 64k chunks kept in the cache");
+SYSCTL_PROC(_vfs_generic_decmpfs, OID_AUTO, zlib_prefetch, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED, 0, 0, sysctl_zprefetch, "IU", "chunks inflated ahead of sequential readers");
+SYSCTL_UINT(_vfs_generic_decmpfs, OID_AUTO, zlib_threads, CTLFLAG_RW|CTLFLAG_LOCKED, &decmpfs_zthreads, 0, "worker threads used to inflate the chunks of one read (0 inflates inline)");
+SYSCTL_STRUCT(_vfs_generic_decmpfs, OID_AUTO, zlib_stats, CTLFLAG_RD|CTLFLAG_LOCKED, &decmpfs_zstats, decmpfs_zstats, "zlib decompressor statistics");
+
+static void *
+zlib_alloc(__unused void *opaque, u_int items, u_int size)
+{
+    void *ptr;
+    MALLOC(ptr, void *, items * size, M_TEMP, M_WAITOK);
+    return ptr;
+}
+
+static void
+zlib_free(__unused void *opaque, void *ptr)
+{
+    FREE(ptr, M_TEMP);
+}
+
+static void
+zlib_copy_to_vec(int nvec, decmpfs_vector *vec, off_t pos, const char *src, user_ssize_t len)
+{
+    /* copy len bytes to logical position pos of the concatenated vectors */
+    int i;
+    
+    for (i = 0; (i < nvec) && (len > 0); i++) {
+        if (pos >= vec[i].size) {
+            pos -= vec[i].size;
+            continue;
+        }
+        user_ssize_t curCopy = vec[i].size - pos;
+        if (curCopy > len)
+            curCopy = len;
+        memcpy((char*)vec[i].buf + pos, src, curCopy);
+        src += curCopy;
+        len -= curCopy;
+        pos = 0;
+    }
+}
+
+static int
+zlib_inflate_buf(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+    /* inflate an entire zlib stream, which must produce exactly dstlen bytes */
+    z_stream zs;
+    int zr;
+    
+    bzero(&zs, sizeof(zs));
+    zs.zalloc = zlib_alloc;
+    zs.zfree  = zlib_free;
+    if (inflateInit(&zs) != Z_OK)
+        return ENOMEM;
+    
+    zs.next_in   = (Bytef *)(uintptr_t)src;
+    zs.avail_in  = srclen;
+    zs.next_out  = dst;
+    zs.avail_out = dstlen;
+    zr = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    
+    if ((zr != Z_STREAM_END) || (zs.total_out != dstlen)) {
+        ErrorLog("inflate returned %d with %lu of %lu bytes\n", zr, (unsigned long)zs.total_out, (unsigned long)dstlen);
+        return EIO;
+    }
+    return 0;
+}
+
+#pragma mark --- Type3 compressor ---
+
+static int
+decmpfs_validate_compressed_file_Type3(__unused vnode_t vp, __unused vfs_context_t ctx, decmpfs_header *hdr)
+{
+    if (hdr->attr_size <= sizeof(decmpfs_disk_header) && hdr->uncompressed_size != 0)
+        return EINVAL;
+    return 0;
+}
+
+static int
+decmpfs_fetch_uncompressed_data_Type3(__unused vnode_t vp, __unused vfs_context_t ctx, decmpfs_header *hdr, off_t offset, user_ssize_t size, int nvec, decmpfs_vector *vec, uint64_t *bytes_read)
+{
+    /* the payload is small, so inflate it as a stream, discarding everything before offset */
+    int err          = 0;
+    unsigned char *payload = hdr->attr_bytes;
+    size_t payload_size = hdr->attr_size - sizeof(decmpfs_disk_header);
+    char *scratch    = NULL;
+    user_ssize_t remaining = size;
+    z_stream zs;
+    int zinit        = 0;
+    int zr           = Z_OK;
+    int i;
+    
+    if (hdr->attr_size <= sizeof(decmpfs_disk_header)) {
+        err = EINVAL;
+        goto out;
+    }
+    
+    if (ZCHUNK_UNCOMPRESSED(payload[0])) {
+        if (hdr->uncompressed_size != payload_size - 1) {
+            err = EINVAL;
+            goto out;
+        }
+        zlib_copy_to_vec(nvec, vec, 0, (char*)payload + 1 + offset, size);
+        remaining = 0;
+        goto out;
+    }
+    
+    bzero(&zs, sizeof(zs));
+    zs.zalloc = zlib_alloc;
+    zs.zfree  = zlib_free;
+    if (inflateInit(&zs) != Z_OK) {
+        err = ENOMEM;
+        goto out;
+    }
+    zinit = 1;
+    zs.next_in  = payload;
+    zs.avail_in = payload_size;
+    
+    if (offset > 0) {
+        MALLOC(scratch, char *, PAGE_SIZE, M_TEMP, M_WAITOK);
+        if (!scratch) {
+            err = ENOMEM;
+            goto out;
+        }
+        while ((off_t)zs.total_out < offset) {
+            zs.next_out  = (Bytef *)scratch;
+            zs.avail_out = MIN(PAGE_SIZE, offset - zs.total_out);
+            zr = inflate(&zs, Z_NO_FLUSH);
+            if (zr != Z_OK)
+                break;
+        }
+    }
+    
+    for (i = 0; (i < nvec) && (remaining > 0) && (zr == Z_OK); i++) {
+        zs.next_out  = vec[i].buf;
+        zs.avail_out = MIN(vec[i].size, remaining);
+        remaining -= zs.avail_out;
+        while ((zs.avail_out > 0) && (zr == Z_OK))
+            zr = inflate(&zs, Z_NO_FLUSH);
+        remaining += zs.avail_out;
+    }
+    
+    if ((remaining > 0) || ((zr != Z_OK) && (zr != Z_STREAM_END))) {
+        ErrorLog("inflate returned %d with %lld bytes left\n", zr, (int64_t)remaining);
+        err = EIO;
+    }
+    
+out:
+    if (zinit) inflateEnd(&zs);
+    if (scratch) FREE(scratch, M_TEMP);
+    if ((bytes_read) && (err == 0))
+        *bytes_read = (size - remaining);
+    return err;
+}
+
+static decmpfs_registration Type3Reg =
+{
+    .decmpfs_registration = DECMPFS_REGISTRATION_VERSION,
+    .validate          = decmpfs_validate_compressed_file_Type3,
+    .adjust_fetch      = NULL, /* no adjust necessary */
+    .fetch             = decmpfs_fetch_uncompressed_data_Type3,
+    .free_data         = NULL, /* the data lives in the xattr */
+    .get_flags         = NULL  /* no flags */
+};
+
+#pragma mark --- Type4 compressor ---
+
+static int
+zlib_rsrc_read(vnode_t vp, vfs_context_t ctx, off_t offset, void *buf, size_t len)
+{
+    /* read exactly len bytes at offset in vp's resource fork */
+    char uio_buf[ UIO_SIZEOF(1) ];
+    size_t read_size = 0;
+    uio_t uio;
+    int err;
+    
+    uio = uio_createwithbuffer(1, offset, UIO_SYSSPACE, UIO_READ, &uio_buf[0], sizeof(uio_buf));
+    uio_addiov(uio, CAST_USER_ADDR_T(buf), len);
+    err = vn_getxattr(vp, XATTR_RESOURCEFORK_NAME, uio, &read_size, XATTR_NOSECURITY, ctx);
+    if ((err == 0) && (uio_resid(uio) != 0))
+        err = EINVAL;
+    return err;
+}
+
+static int
+zlib_chunk_table(vnode_t vp, vfs_context_t ctx, off_t *table, uint32_t *count)
+{
+    /* find the chunk table in the resource fork and return its offset and the number of chunks */
+    uint32_t dataOffset, n;
+    int err;
+    
+    err = zlib_rsrc_read(vp, ctx, 0, &dataOffset, sizeof(dataOffset));
+    if (err != 0)
+        return err;
+    *table = (off_t)OSSwapBigToHostInt32(dataOffset) + sizeof(uint32_t);
+    
+    err = zlib_rsrc_read(vp, ctx, *table, &n, sizeof(n));
+    if (err != 0)
+        return err;
+    *count = OSSwapLittleToHostInt32(n);
+    return 0;
+}
+
+static inline struct zchunk_head *
+zchunk_bucket(vnode_t vp, uint32_t index)
+{
+    return &zcache_hash[(((uintptr_t)vp >> 8) ^ index) & (ZCHUNK_HASH_SIZE - 1)];
+}
+
+static zchunk *
+zchunk_lookup(vnode_t vp, uint32_t vid, uint64_t fsize, uint32_t index)
+{
+    /* zcache_mtx must be held */
+    zchunk *zc;
+    
+    LIST_FOREACH(zc, zchunk_bucket(vp, index), zc_hash) {
+        if (zc->zc_vp == vp && zc->zc_vid == vid && zc->zc_fsize == fsize && zc->zc_index == index)
+            return zc;
+    }
+    return NULL;
+}
+
+static void
+zchunk_unhash(zchunk *zc)
+{
+    if (!(zc->zc_flags & ZC_STALE)) {
+        LIST_REMOVE(zc, zc_hash);
+        zc->zc_flags |= ZC_STALE;
+    }
+}
+
+static void
+zchunk_destroy(zchunk *zc)
+{
+    zchunk_unhash(zc);
+    zcache_count--;
+    if (zc->zc_data) FREE(zc->zc_data, M_TEMP);
+    FREE(zc, M_TEMP);
+}
+
+static void
+zchunk_idle(zchunk *zc)
+{
+    /*
+     the chunk has no references and is not busy; keep it on the lru if it is still valid,
+     then trim the cache back to its limit.  zcache_mtx must be held
+     */
+    if (zc->zc_flags & ZC_STALE) {
+        zchunk_destroy(zc);
+    } else {
+        TAILQ_INSERT_TAIL(&zcache_lru, zc, zc_list);
+    }
+    while ((zcache_count > decmpfs_zcache_chunks) && ((zc = TAILQ_FIRST(&zcache_lru)) != NULL)) {
+        TAILQ_REMOVE(&zcache_lru, zc, zc_list);
+        zchunk_destroy(zc);
+    }
+}
+
+static void
+zchunk_release(zchunk *zc)
+{
+    /* zcache_mtx must be held */
+    if ((--zc->zc_refs == 0) && !(zc->zc_flags & ZC_BUSY))
+        zchunk_idle(zc);
+}
+
+static zchunk *
+zchunk_get(vnode_t vp, uint32_t vid, uint64_t fsize, uint32_t index, int ref, int *created)
+{
+    /*
+     find the chunk in the cache, or add a busy entry for it which the caller must fill in
+     and queue or inflate.  zcache_mtx must be held, and may be dropped to allocate
+     */
+    zchunk *zc, *nzc = NULL;
+    
+    *created = 0;
+    for (;;) {
+        zc = zchunk_lookup(vp, vid, fsize, index);
+        if (zc != NULL || nzc != NULL)
+            break;
+        lck_mtx_unlock(zcache_mtx);
+        MALLOC(nzc, zchunk *, sizeof(zchunk), M_TEMP, M_WAITOK | M_ZERO);
+        lck_mtx_lock(zcache_mtx);
+        if (nzc == NULL)
+            return NULL;
+    }
+    
+    if (zc != NULL) {
+        if (nzc) FREE(nzc, M_TEMP);
+        if (ref) {
+            if (zc->zc_refs++ == 0 && !(zc->zc_flags & ZC_BUSY))
+                TAILQ_REMOVE(&zcache_lru, zc, zc_list);
+            if (zc->zc_flags & ZC_PREFETCHED) {
+                zc->zc_flags &= ~ZC_PREFETCHED;
+                OSAddAtomic64(1, &decmpfs_zstats.prefetch_hits);
+            }
+        }
+        return zc;
+    }
+    
+    zc = nzc;
+    zc->zc_vp = vp;
+    zc->zc_vid = vid;
+    zc->zc_fsize = fsize;
+    zc->zc_index = index;
+    zc->zc_refs = ref ? 1 : 0;
+    zc->zc_flags = ZC_BUSY;
+    LIST_INSERT_HEAD(zchunk_bucket(vp, index), zc, zc_hash);
+    zcache_count++;
+    *created = 1;
+    return zc;
+}
+
+static void
+zchunk_done(zchunk *zc, int err)
+{
+    /* the chunk has been inflated, or failed to; zcache_mtx must be held */
+    zc->zc_flags &= ~ZC_BUSY;
+    if (err) {
+        zc->zc_error = err;
+        zchunk_unhash(zc);
+        OSAddAtomic64(1, &decmpfs_zstats.errors);
+    }
+    if (zc->zc_flags & ZC_WANTED) {
+        zc->zc_flags &= ~ZC_WANTED;
+        wakeup(zc);
+    }
+    if (zc->zc_refs == 0)
+        zchunk_idle(zc);
+}
+
+static int
+zchunk_fill(zchunk *zc)
+{
+    /* read and inflate one chunk; called without zcache_mtx, with an iocount on zc_vp */
+    char *cdata = NULL;
+    int err = 0;
+    
+    if ((zc->zc_csize == 0) || (zc->zc_csize > 2 * ZCHUNK_SIZE)) {
+        err = EINVAL;
+        goto out;
+    }
+    MALLOC(zc->zc_data, char *, ZCHUNK_SIZE, M_TEMP, M_WAITOK);
+    MALLOC(cdata, char *, zc->zc_csize, M_TEMP, M_WAITOK);
+    if (!zc->zc_data || !cdata) {
+        err = ENOMEM;
+        goto out;
+    }
+    err = zlib_rsrc_read(zc->zc_vp, decmpfs_ctx, zc->zc_cstart, cdata, zc->zc_csize);
+    if (err != 0)
+        goto out;
+    
+    if (ZCHUNK_UNCOMPRESSED(cdata[0])) {
+        if (zc->zc_csize - 1 != zc->zc_len) {
+            err = EINVAL;
+            goto out;
+        }
+        memcpy(zc->zc_data, cdata + 1, zc->zc_len);
+    } else {
+        err = zlib_inflate_buf(cdata, zc->zc_csize, zc->zc_data, zc->zc_len);
+    }
+    if (err == 0)
+        OSAddAtomic64(zc->zc_len, &decmpfs_zstats.inflated_bytes);
+    
+out:
+    if (cdata) FREE(cdata, M_TEMP);
+    return err;
+}
+
+static void
+zchunk_worker_thread(void *arg, __unused wait_result_t wr)
+{
+    int id = (int)(uintptr_t)arg;
+    zchunk *zc;
+    int sync, err;
+    
+    lck_mtx_lock(zcache_mtx);
+    for (;;) {
+        /* worker 0 always runs, so that queued read-ahead is never stranded */
+        while ((zc = TAILQ_FIRST(&zwork_queue)) == NULL || (id != 0 && (uint32_t)id >= decmpfs_zthreads))
+            msleep(&zwork_queue, zcache_mtx, PRIBIO, "decmpfs_zworker", NULL);
+        TAILQ_REMOVE(&zwork_queue, zc, zc_list);
+        zc->zc_flags &= ~ZC_QUEUED;
+        sync = zc->zc_flags & ZC_SYNC;
+        lck_mtx_unlock(zcache_mtx);
+        
+        if (sync) {
+            /* the reader waiting for it holds an iocount */
+            err = zchunk_fill(zc);
+            OSAddAtomic64(1, &decmpfs_zstats.parallel);
+        } else if (vnode_getwithvid(zc->zc_vp, zc->zc_vid) == 0) {
+            err = zchunk_fill(zc);
+            vnode_put(zc->zc_vp);
+        } else {
+            err = ENOENT;
+        }
+        
+        lck_mtx_lock(zcache_mtx);
+        zchunk_done(zc, err);
+    }
+}
+
+static void
+zchunk_purge(vnode_t vp)
+{
+    /* forget every cached chunk of vp; chunks still in use are freed when released */
+    zchunk *zc, *next;
+    int i;
+    
+    lck_mtx_lock(zcache_mtx);
+    for (i = 0; i < ZCHUNK_HASH_SIZE; i++) {
+        LIST_FOREACH_SAFE(zc, &zcache_hash[i], zc_hash, next) {
+            if (zc->zc_vp != vp)
+                continue;
+            zchunk_unhash(zc);
+            if (zc->zc_refs == 0 && !(zc->zc_flags & ZC_BUSY)) {
+                TAILQ_REMOVE(&zcache_lru, zc, zc_list);
+                zchunk_destroy(zc);
+            }
+        }
+    }
+    lck_mtx_unlock(zcache_mtx);
+}
+
+static int
+decmpfs_validate_compressed_file_Type4(vnode_t vp, vfs_context_t ctx, decmpfs_header *hdr)
+{
+    off_t table;
+    uint32_t count;
+    int err;
+    
+    err = zlib_chunk_table(vp, ctx, &table, &count);
+    if (err != 0)
+        return err;
+    if ((uint64_t)count != (hdr->uncompressed_size + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE)
+        return EINVAL;
+    return 0;
+}
+
+static void
+decmpfs_adjust_fetch_region_Type4(__unused vnode_t vp, __unused vfs_context_t ctx, __unused decmpfs_header *hdr, off_t *offset, user_ssize_t *size)
+{
+    /* read whole chunks, so that each chunk is inflated into the ubc once */
+    off_t end = *offset + *size;
+    
+    *offset &= ~((off_t)ZCHUNK_SIZE - 1);
+    end = (end + ZCHUNK_SIZE - 1) & ~((off_t)ZCHUNK_SIZE - 1);
+    *size = end - *offset;
+}
+
+static int
+decmpfs_fetch_uncompressed_data_Type4(vnode_t vp, vfs_context_t ctx, decmpfs_header *hdr, off_t offset, user_ssize_t size, int nvec, decmpfs_vector *vec, uint64_t *bytes_read)
+{
+    int err          = 0;
+    uint32_t first, last, end, count, i, n = 0;
+    uint32_t prefetch;
+    uint32_t *entries = NULL;
+    zchunk **chunks  = NULL;
+    char *own        = NULL;
+    off_t table;
+    uint32_t vid     = vnode_vid(vp);
+    uint64_t fsize   = hdr->uncompressed_size;
+    user_ssize_t copied = 0;
+    int sequential, created, queued = 0;
+    
+    first = offset / ZCHUNK_SIZE;
+    last = (offset + size - 1) / ZCHUNK_SIZE;
+    
+    err = zlib_chunk_table(vp, ctx, &table, &count);
+    if (err != 0)
+        goto out;
+    if (((uint64_t)count != (fsize + ZCHUNK_SIZE - 1) / ZCHUNK_SIZE) || (last >= count)) {
+        err = EINVAL;
+        goto out;
+    }
+    end = last;
+    if ((prefetch = decmpfs_zprefetch) != 0)
+        end = (count - 1 - last > prefetch) ? last + prefetch : count - 1;
+    
+    /* read the table entries for the chunks we need and those we might read ahead */
+    MALLOC(entries, uint32_t *, (end - first + 1) * 2 * sizeof(uint32_t), M_TEMP, M_WAITOK);
+    MALLOC(chunks, zchunk **, (last - first + 1) * sizeof(zchunk *), M_TEMP, M_WAITOK | M_ZERO);
+    MALLOC(own, char *, last - first + 1, M_TEMP, M_WAITOK | M_ZERO);
+    if (!entries || !chunks || !own) {
+        err = ENOMEM;
+        goto out;
+    }
+    err = zlib_rsrc_read(vp, ctx, table + sizeof(uint32_t) + (off_t)first * 2 * sizeof(uint32_t), entries, (end - first + 1) * 2 * sizeof(uint32_t));
+    if (err != 0)
+        goto out;
+    
+    lck_mtx_lock(zcache_mtx);
+    sequential = (first == 0) || (zchunk_lookup(vp, vid, fsize, first - 1) != NULL);
+    for (i = first; i <= end; i++) {
+        if (i > last && !sequential)
+            break;
+        zchunk *zc = zchunk_get(vp, vid, fsize, i, i <= last, &created);
+        if (zc == NULL) {
+            err = ENOMEM;
+            break;
+        }
+        if (i <= last) {
+            chunks[n++] = zc;
+            if (!created) {
+                OSAddAtomic64(1, &decmpfs_zstats.hits);
+                continue;
+            }
+            OSAddAtomic64(1, &decmpfs_zstats.misses);
+        } else if (!created) {
+            continue;
+        }
+        
+        zc->zc_cstart = table + OSSwapLittleToHostInt32(entries[2 * (i - first)]);
+        zc->zc_csize = OSSwapLittleToHostInt32(entries[2 * (i - first) + 1]);
+        zc->zc_len = MIN(ZCHUNK_SIZE, fsize - (uint64_t)i * ZCHUNK_SIZE);
+        
+        if (i > last) {
+            /* read-ahead: always left to the workers */
+            zc->zc_flags |= ZC_QUEUED | ZC_PREFETCHED;
+            TAILQ_INSERT_TAIL(&zwork_queue, zc, zc_list);
+            OSAddAtomic64(1, &decmpfs_zstats.prefetched);
+            queued = 1;
+        } else if ((decmpfs_zthreads > 1) && (last > first)) {
+            /* one of several chunks; let idle workers help, we'll take back what they don't */
+            zc->zc_flags |= ZC_QUEUED | ZC_SYNC;
+            TAILQ_INSERT_TAIL(&zwork_queue, zc, zc_list);
+            queued = 1;
+        } else {
+            own[n - 1] = 1;
+        }
+    }
+    lck_mtx_unlock(zcache_mtx);
+    if (queued)
+        wakeup(&zwork_queue);
+    
+    /* inflate the chunks that are ours, and any that are still waiting on the queue */
+    for (i = 0; i < n; i++) {
+        zchunk *zc = chunks[i];
+        
+        lck_mtx_lock(zcache_mtx);
+        if (zc->zc_flags & ZC_QUEUED) {
+            TAILQ_REMOVE(&zwork_queue, zc, zc_list);
+            zc->zc_flags &= ~ZC_QUEUED;
+            own[i] = 1;
+        }
+        lck_mtx_unlock(zcache_mtx);
+        
+        if (own[i]) {
+            int fill_err = zchunk_fill(zc);
+            lck_mtx_lock(zcache_mtx);
+            zchunk_done(zc, fill_err);
+            lck_mtx_unlock(zcache_mtx);
+        }
+    }
+    
+    /*
+     wait for the chunks inflated elsewhere and copy out the part of each that was asked for;
+     we must wait for all of them even after an error, as the workers rely on our iocount
+     */
+    for (i = 0; i < n; i++) {
+        zchunk *zc = chunks[i];
+        off_t cpos = (off_t)zc->zc_index * ZCHUNK_SIZE;
+        off_t from = MAX(cpos, offset);
+        off_t to = MIN(cpos + zc->zc_len, offset + size);
+        
+        lck_mtx_lock(zcache_mtx);
+        if (zc->zc_flags & ZC_BUSY)
+            OSAddAtomic64(1, &decmpfs_zstats.waits);
+        while (zc->zc_flags & ZC_BUSY) {
+            zc->zc_flags |= ZC_WANTED;
+            msleep(zc, zcache_mtx, PRIBIO, "decmpfs_zchunk", NULL);
+        }
+        if (err == 0)
+            err = zc->zc_error;
+        lck_mtx_unlock(zcache_mtx);
+        
+        if ((err == 0) && (to > from)) {
+            zlib_copy_to_vec(nvec, vec, from - offset, zc->zc_data + (from - cpos), to - from);
+            copied += to - from;
+        }
+    }
+    
+out:
+    if (n) {
+        lck_mtx_lock(zcache_mtx);
+        for (i = 0; i < n; i++)
+            zchunk_release(chunks[i]);
+        lck_mtx_unlock(zcache_mtx);
+    }
+    if (own) FREE(own, M_TEMP);
+    if (chunks) FREE(chunks, M_TEMP);
+    if (entries) FREE(entries, M_TEMP);
+    if ((bytes_read) && (err == 0))
+        *bytes_read = copied;
+    return err;
+}
+
+static int
+decmpfs_free_compressed_data_Type4(vnode_t vp, vfs_context_t ctx, __unused decmpfs_header *hdr)
+{
+    zchunk_purge(vp);
+    
+    /* the compressed data lives in the resource fork */
+    int err = vn_removexattr(vp, XATTR_RESOURCEFORK_NAME, XATTR_NOSECURITY, ctx);
+    if (err == ENOATTR)
+        err = 0;
+    return err;
+}
+
+static decmpfs_registration Type4Reg =
+{
+    .decmpfs_registration = DECMPFS_REGISTRATION_VERSION,
+    .validate          = decmpfs_validate_compressed_file_Type4,
+    .adjust_fetch      = decmpfs_adjust_fetch_region_Type4,
+    .fetch             = decmpfs_fetch_uncompressed_data_Type4,
+    .free_data         = decmpfs_free_compressed_data_Type4,
+    .get_flags         = NULL  /* no flags */
+};
+
+static void
+decmpfs_zlib_init(void)
+{
+    thread_t thread;
+    int nthreads, i;
+    
+    zcache_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
+    for (i = 0; i < ZCHUNK_HASH_SIZE; i++)
+        LIST_INIT(&zcache_hash[i]);
+    
+    nthreads = MIN(ml_get_max_cpus(), ZCHUNK_MAX_THREADS);
+    if (nthreads < 1)
+        nthreads = 1;
+    decmpfs_zthreads = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        if (kernel_thread_start(zchunk_worker_thread, (void *)(uintptr_t)i, &thread) != KERN_SUCCESS)
+            panic("decmpfs_zlib_init: can't start worker thread %d", i);
+        thread_deallocate(thread);
+    }
+    
+    builtin_decompressors[CMP_Type3] = &Type3Reg;
+    builtin_decompressors[CMP_Type4] = &Type4Reg;
+    register_decmpfs_decompressor(CMP_Type3, &Type3Reg);
+    register_decmpfs_decompressor(CMP_Type4, &Type4Reg);
+}
+#endif /* ZLIB */
+
 #pragma mark --- decmpfs initialization ---
 
 void decmpfs_init()
@@ -1779,6 +2532,9 @@ void decmpfs_init()
     decompress_channel_mtx = lck_mtx_alloc_init(decmpfs_lockgrp, NULL);
     
     register_decmpfs_decompressor(CMP_Type1, &Type1Reg);
+#if ZLIB
+    decmpfs_zlib_init();
+#endif
     
     done = 1;
 }
@@ -4075,6 +4075,11 @@ fg_free(struct fileglob *fg)
 	}
 	lck_mtx_destroy(&fg->fg_lock, file_lck_grp);
 
+	if (fg->fg_vn_data) {
+		fg_vn_data_free(fg->fg_vn_data);
+		fg->fg_vn_data = NULL;
+	}
+
 #if CONFIG_MACF
 	mac_file_label_destroy(fg);
 #endif
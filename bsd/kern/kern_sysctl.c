@@ -92,7 +92,7 @@
 #include <sys/file_internal.h>
 #include <sys/vnode_internal.h>
 #include <sys/unistd.h>
-#include <sys/buf.h>
+#include <sys/buf_internal.h>
 #include <sys/ioctl.h>
 #include <sys/namei.h>
 #include <sys/tty.h>
@@ -116,6 +116,7 @@
 #include <kern/lock.h>
 #include <kern/processor.h>
 #include <kern/debug.h>
+#include <kern/thread_call.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_map.h>
 #include <mach/host_info.h>
@@ -790,6 +791,15 @@ sysctl_sched_stats_enable(__unused struct sysctl_oid *oidp, __unused void *arg1,
 
 SYSCTL_PROC(_kern, OID_AUTO, sched_stats_enable, CTLFLAG_LOCKED | CTLFLAG_WR, 0, 0, sysctl_sched_stats_enable, "-", "");
 
+/*
+ * Tickless scheduling.  Compare the quantum_timer_expirations in
+ * kern.sched_stats with the mode on and off to see its effect.
+ */
+SYSCTL_INT(_kern, OID_AUTO, sched_tickless, CTLFLAG_RW | CTLFLAG_LOCKED, &sched_tickless, 0, "");
+SYSCTL_UINT(_kern, OID_AUTO, sched_tickless_stretched, CTLFLAG_RD | CTLFLAG_LOCKED, &sched_tickless_stretched, 0, "");
+SYSCTL_UINT(_kern, OID_AUTO, sched_tickless_unstretched, CTLFLAG_RD | CTLFLAG_LOCKED, &sched_tickless_unstretched, 0, "");
+SYSCTL_UINT(_kern, OID_AUTO, sched_tickless_ticks_skipped, CTLFLAG_RD | CTLFLAG_LOCKED, &sched_tickless_ticks_skipped, 0, "");
+
 extern int get_kernel_symfile(proc_t, char **);
 
 #if COUNT_SYSCALLS
@@ -3150,6 +3160,50 @@ SYSCTL_PROC(_kern, OID_AUTO, slide,
 		CTLTYPE_INT | CTLFLAG_RD | CTLFLAG_LOCKED,
 		0, 0, sysctl_slide, "I", "");
 
+/*
+ * Per-priority thread call dispatch statistics; an array of
+ * struct thread_call_group_stats indexed by thread_call_priority_t.
+ */
+STATIC int
+sysctl_thread_call_stats
+(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	struct thread_call_group_stats	stats[THREAD_CALL_GROUP_STATS_COUNT];
+	int				count;
+
+	count = thread_call_get_stats(stats, THREAD_CALL_GROUP_STATS_COUNT);
+
+	return (SYSCTL_OUT(req, stats, count * sizeof(stats[0])));
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, thread_call_stats,
+		CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_thread_call_stats, "S", "");
+
+/*
+ * Buffer cache shard lock statistics; an array of
+ * struct bufshard_stats indexed by shard.
+ */
+STATIC int
+sysctl_bufcache_shard_stats
+(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	struct bufshard_stats	stats[BUF_NSHARDS];
+	int			count;
+
+	count = buf_shard_get_stats(stats, BUF_NSHARDS);
+
+	return (SYSCTL_OUT(req, stats, count * sizeof(stats[0])));
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, bufcache_shard_stats,
+		CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_bufcache_shard_stats, "S", "");
+
+SYSCTL_INT(_kern, OID_AUTO, bufcache_shard_stats_enable,
+		CTLFLAG_RW | CTLFLAG_LOCKED,
+		&bufshard_stats_enable, 0, "");
+
 /*
  * Limit on total memory users can wire.
  *
@@ -3233,3 +3287,95 @@ SYSCTL_INT(_kern, OID_AUTO, precise_user_kernel_time,
 		&precise_user_kernel_time, 0, "Precise accounting of kernel vs. user time");
 #endif
 #endif
+
+#if DEVELOPMENT || DEBUG
+/*
+ * Mutex contention microbenchmark hooks; see osfmk/kern/locks.c.
+ * Writing N to debug.lck_mtx_test_hold takes the shared test mutex
+ * and holds it for N microseconds.  debug.lck_mtx_test_stats returns
+ * the adaptive spin statistics, and clears them when written.
+ */
+STATIC int
+sysctl_lck_mtx_test_hold(__unused struct sysctl_oid *oidp, __unused void *arg1,
+	      __unused int arg2, struct sysctl_req *req)
+{
+	int hold_usecs = 0, changed = 0, error;
+
+	error = sysctl_io_number(req, 0, sizeof(int), &hold_usecs, &changed);
+	if (error || !changed)
+		return (error);
+	if (hold_usecs < 0 || hold_usecs > 1000)
+		return (EINVAL);
+
+	lck_mtx_test_lock_hold((uint32_t)hold_usecs);
+	return (0);
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, lck_mtx_test_hold,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		0, 0, sysctl_lck_mtx_test_hold, "I", "");
+
+STATIC int
+sysctl_lck_mtx_test_stats(__unused struct sysctl_oid *oidp, __unused void *arg1,
+	      __unused int arg2, struct sysctl_req *req)
+{
+	lck_mtx_test_stats_t stats;
+
+	lck_mtx_test_spin_stats(&stats, req->newptr != USER_ADDR_NULL);
+	return (SYSCTL_OUT(req, &stats, sizeof(stats)));
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, lck_mtx_test_stats,
+		CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED,
+		0, 0, sysctl_lck_mtx_test_stats, "S", "");
+
+/*
+ * Reader scaling hooks for lck_rw_t versus lck_brw_t.  Writing N to
+ * debug.lck_rw_test_read or debug.lck_brw_test_read takes the
+ * corresponding test lock shared N times; writing any value to the
+ * *_test_write variants takes it exclusive once.  arg1 selects the
+ * big-reader lock.
+ */
+STATIC int
+sysctl_lck_rw_test_read(__unused struct sysctl_oid *oidp, void *arg1,
+	      __unused int arg2, struct sysctl_req *req)
+{
+	int iterations = 0, changed = 0, error;
+
+	error = sysctl_io_number(req, 0, sizeof(int), &iterations, &changed);
+	if (error || !changed)
+		return (error);
+	if (iterations < 0 || iterations > 10000000)
+		return (EINVAL);
+
+	lck_rw_test_read(arg1 != NULL, (uint32_t)iterations);
+	return (0);
+}
+
+STATIC int
+sysctl_lck_rw_test_write(__unused struct sysctl_oid *oidp, void *arg1,
+	      __unused int arg2, struct sysctl_req *req)
+{
+	int value = 0, changed = 0, error;
+
+	error = sysctl_io_number(req, 0, sizeof(int), &value, &changed);
+	if (error || !changed)
+		return (error);
+
+	lck_rw_test_write(arg1 != NULL);
+	return (0);
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, lck_rw_test_read,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		NULL, 0, sysctl_lck_rw_test_read, "I", "");
+SYSCTL_PROC(_debug, OID_AUTO, lck_brw_test_read,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		(void *)1, 0, sysctl_lck_rw_test_read, "I", "");
+SYSCTL_PROC(_debug, OID_AUTO, lck_rw_test_write,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		NULL, 0, sysctl_lck_rw_test_write, "I", "");
+SYSCTL_PROC(_debug, OID_AUTO, lck_brw_test_write,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		(void *)1, 0, sysctl_lck_rw_test_write, "I", "");
+#endif /* DEVELOPMENT || DEBUG */
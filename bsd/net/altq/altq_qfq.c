@@ -86,7 +86,7 @@ altq_qfq_add(struct pf_altq *a)
 	if (!ALTQ_IS_READY(IFCQ_ALTQ(&ifp->if_snd)))
 		return (ENODEV);
 
-	qif = qfq_alloc(ifp, M_WAITOK, TRUE);
+	qif = qfq_alloc(&ifp->if_snd, M_WAITOK, TRUE);
 	if (qif == NULL)
 		return (ENOMEM);
 
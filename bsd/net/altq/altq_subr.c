@@ -188,7 +188,7 @@ altq_disable(struct ifaltq *altq)
 	if (!ALTQ_IS_ENABLED(altq))
 		return (0);
 
-	if_qflush(ifq->ifcq_ifp, 1);
+	if_qflush_ifq(ifq, 1);
 
 	altq->altq_flags &= ~ALTQF_ENABLED;
 
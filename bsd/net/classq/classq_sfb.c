@@ -280,7 +280,7 @@ sfb_init(void)
 static u_int32_t
 sfb_random(struct sfb *sp)
 {
-	IFCQ_CONVERT_LOCK(&sp->sfb_ifp->if_snd);
+	IFCQ_CONVERT_LOCK(sp->sfb_ifq);
 	return (random());
 }
 
@@ -359,8 +359,9 @@ sfb_calc_hinterval(struct sfb *sp, u_int64_t *t)
  * sfb support routines
  */
 struct sfb *
-sfb_alloc(struct ifnet *ifp, u_int32_t qid, u_int32_t qlim, u_int32_t flags)
+sfb_alloc(struct ifclassq *ifq, u_int32_t qid, u_int32_t qlim, u_int32_t flags)
 {
+	struct ifnet *ifp = ifq->ifcq_ifp;
 	struct sfb *sp;
 
 	VERIFY(ifp != NULL && qlim > 0);
@@ -389,6 +390,7 @@ sfb_alloc(struct ifnet *ifp, u_int32_t qid, u_int32_t qlim, u_int32_t flags)
 
 	sp->sfb_flags = (flags & SFBF_USERFLAGS);
 	sp->sfb_ifp = ifp;
+	sp->sfb_ifq = ifq;
 	sp->sfb_qlim = qlim;
 	sp->sfb_qid = qid;
 
@@ -400,7 +402,7 @@ sfb_alloc(struct ifnet *ifp, u_int32_t qid, u_int32_t qlim, u_int32_t flags)
 static void
 sfb_fclist_append(struct sfb *sp, struct sfb_fc_list *fcl)
 {
-	IFCQ_CONVERT_LOCK(&sp->sfb_ifp->if_snd);
+	IFCQ_CONVERT_LOCK(sp->sfb_ifq);
 	ifnet_fclist_append(sp, fcl);
 }
 
@@ -820,7 +822,7 @@ sfb_bin_addfcentry(struct sfb *sp, struct pf_mtag *t)
 		}
 	}
 
-	IFCQ_CONVERT_LOCK(&sp->sfb_ifp->if_snd);
+	IFCQ_CONVERT_LOCK(sp->sfb_ifq);
 	fce = ifnet_fce_alloc(M_WAITOK);
 	if (fce != NULL) {
 		fce->fce_flowhash = flowhash;
@@ -994,7 +996,7 @@ sfb_addq(struct sfb *sp, class_queue_t *q, struct mbuf *m, struct pf_mtag *t)
 	if (droptype == DTYPE_NODROP) {
 		_addq(q, m);
 	} else {
-		IFCQ_CONVERT_LOCK(&sp->sfb_ifp->if_snd);
+		IFCQ_CONVERT_LOCK(sp->sfb_ifq);
 		m_freem(m);
 		return ((ret != CLASSQEQ_SUCCESS) ? ret : CLASSQEQ_DROPPED);
 	}
@@ -1094,7 +1096,7 @@ sfb_purgeq(struct sfb *sp, class_queue_t *q, u_int32_t flow, u_int32_t *packets,
 	u_int32_t cnt = 0, len = 0;
 	struct mbuf *m;
 
-	IFCQ_CONVERT_LOCK(&sp->sfb_ifp->if_snd);
+	IFCQ_CONVERT_LOCK(sp->sfb_ifq);
 
 	while ((m = sfb_getq_flow(sp, q, flow, TRUE)) != NULL) {
 		cnt++;
@@ -113,6 +113,7 @@ typedef struct sfb {
 	struct timespec	sfb_getqtime;	/* last dequeue timestamp */
 	struct timespec	sfb_holdtime;	/* random holdtime in nsec */
 	struct ifnet	*sfb_ifp;	/* back pointer to ifnet */
+	struct ifclassq	*sfb_ifq;	/* back pointer to ifclassq */
 
 	/* moving hash function */
 	struct timespec	sfb_hinterval;	/* random reset interval in sec */
@@ -134,7 +135,8 @@ typedef struct sfb {
 } sfb_t;
 
 extern void sfb_init(void);
-extern struct sfb *sfb_alloc(struct ifnet *, u_int32_t, u_int32_t, u_int32_t);
+extern struct sfb *sfb_alloc(struct ifclassq *, u_int32_t, u_int32_t,
+    u_int32_t);
 extern void sfb_destroy(struct sfb *);
 extern int sfb_addq(struct sfb *, class_queue_t *, struct mbuf *,
     struct pf_mtag *);
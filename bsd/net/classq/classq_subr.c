@@ -57,6 +57,9 @@
 #include <net/altq/altq.h>
 #endif /* PF_ALTQ */
 
+static int ifclassq_setup_common(struct ifnet *, struct ifclassq *,
+    u_int32_t);
+static void ifclassq_teardown_common(struct ifclassq *);
 static errno_t ifclassq_dequeue_common(struct ifclassq *, mbuf_svc_class_t,
     u_int32_t, struct mbuf **, struct mbuf **, u_int32_t *, u_int32_t *,
     boolean_t);
@@ -88,7 +91,29 @@ int
 ifclassq_setup(struct ifnet *ifp, u_int32_t sflags, boolean_t reuse)
 {
 #pragma unused(reuse)
-	struct ifclassq *ifq = &ifp->if_snd;
+	u_int32_t i;
+	int err;
+
+	err = ifclassq_setup_common(ifp, &ifp->if_snd, sflags);
+
+	/*
+	 * Additional transmit queues inherit the maximum length of the
+	 * primary queue; each one gets its own scheduler instance.
+	 */
+	for (i = 1; err == 0 && i < ifp->if_txq_cnt; i++) {
+		struct ifclassq *ifq = &ifp->if_txq[i]->txq_snd;
+
+		IFCQ_SET_MAXLEN(ifq, IFCQ_MAXLEN(&ifp->if_snd));
+		err = ifclassq_setup_common(ifp, ifq, sflags);
+	}
+
+	return (err);
+}
+
+static int
+ifclassq_setup_common(struct ifnet *ifp, struct ifclassq *ifq,
+    u_int32_t sflags)
+{
 	int err = 0;
 
 	IFCQ_LOCK(ifq);
@@ -132,7 +157,8 @@ ifclassq_setup(struct ifnet *ifp, u_int32_t sflags, boolean_t reuse)
 	VERIFY(IFCQ_ALTQ(ifq)->altq_dequeue_sc == NULL);
 	VERIFY(IFCQ_ALTQ(ifq)->altq_request == NULL);
 
-	if ((ifp->if_eflags & IFEF_TXSTART) &&
+	/* ALTQ is only supported on the primary transmit queue */
+	if ((ifp->if_eflags & IFEF_TXSTART) && ifq == &ifp->if_snd &&
 	    ifp->if_output_sched_model != IFNET_SCHED_MODEL_DRIVER_MANAGED)
 		ALTQ_SET_READY(IFCQ_ALTQ(ifq));
 	else
@@ -146,8 +172,16 @@ ifclassq_setup(struct ifnet *ifp, u_int32_t sflags, boolean_t reuse)
 void
 ifclassq_teardown(struct ifnet *ifp)
 {
-	struct ifclassq *ifq = &ifp->if_snd;
+	u_int32_t i;
 
+	for (i = 1; i < ifp->if_txq_cnt; i++)
+		ifclassq_teardown_common(&ifp->if_txq[i]->txq_snd);
+	ifclassq_teardown_common(&ifp->if_snd);
+}
+
+static void
+ifclassq_teardown_common(struct ifclassq *ifq)
+{
 	IFCQ_LOCK(ifq);
 #if PF_ALTQ
 	if (ALTQ_IS_READY(IFCQ_ALTQ(ifq))) {
@@ -305,7 +339,6 @@ ifclassq_dequeue_common(struct ifclassq *ifq, mbuf_svc_class_t sc,
 	first = &(*head);
 	last = NULL;
 
-	ifq = &ifp->if_snd;
 	IFCQ_LOCK_SPIN(ifq);
 
 	while (i < limit) {
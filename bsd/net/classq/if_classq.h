@@ -168,10 +168,12 @@ struct ifclassq {
 #define	IFCQF_READY	 0x01		/* ifclassq supports discipline */
 #define	IFCQF_ENABLED	 0x02		/* ifclassq is in use */
 #define	IFCQF_TBR	 0x04		/* Token Bucket Regulator is in use */
+#define	IFCQF_THROTTLE	 0x08		/* throttling is in effect */
 
 #define	IFCQ_IS_READY(_ifcq)		((_ifcq)->ifcq_flags & IFCQF_READY)
 #define	IFCQ_IS_ENABLED(_ifcq)		((_ifcq)->ifcq_flags & IFCQF_ENABLED)
 #define	IFCQ_TBR_IS_ENABLED(_ifcq)	((_ifcq)->ifcq_flags & IFCQF_TBR)
+#define	IFCQ_THROTTLE_IS_ENABLED(_ifcq)	((_ifcq)->ifcq_flags & IFCQF_THROTTLE)
 
 /* classq enqueue return value */
 #define CLASSQEQ_DROPPED	(-1)	/* packet dropped (freed)  */
@@ -54,6 +54,7 @@
 #include <sys/mcache.h>
 
 #include <kern/assert.h>
+#include <kern/cpu_number.h>
 #include <kern/task.h>
 #include <kern/thread.h>
 #include <kern/sched_prim.h>
@@ -66,9 +67,12 @@
 #include <net/kpi_interfacefilter.h>
 #include <net/classq/classq.h>
 #include <net/classq/classq_sfb.h>
+#include <net/flowhash.h>
 
 #if INET
 #include <netinet/in_var.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
 #include <netinet/igmp_var.h>
 #include <netinet/ip_var.h>
 #include <netinet/tcp.h>
@@ -80,6 +84,7 @@
 #endif /* INET */
 
 #if INET6
+#include <netinet/ip6.h>
 #include <netinet6/in6_var.h>
 #include <netinet6/nd6.h>
 #include <netinet6/mld6_var.h>
@@ -197,6 +202,10 @@ struct dlil_ifnet {
 	} dl_if_lladdr;
 	u_int8_t dl_if_descstorage[IF_DESCSIZE]; /* desc storage */
 	struct dlil_threading_info dl_if_inpstorage; /* input thread storage */
+	/* additional (RSS) input thread storage, allocated on demand */
+	struct dlil_threading_info *dl_if_rxqstorage[IFNET_RXQ_MAX - 1];
+	/* additional transmit queue storage, allocated on demand */
+	struct ifnet_txq *dl_if_txqstorage[IFNET_TXQ_MAX - 1];
 	ctrace_t	dl_if_attach;		/* attach PC stacktrace */
 	ctrace_t	dl_if_detach;		/* detach PC stacktrace */
 };
@@ -248,7 +257,7 @@ static lck_grp_t *ifnet_head_lock_group;
 static lck_grp_t *ifnet_snd_lock_group;
 static lck_grp_t *ifnet_rcv_lock_group;
 lck_attr_t *ifnet_lock_attr;
-decl_lck_rw_data(static, ifnet_head_lock);
+static lck_brw_t *ifnet_head_lock;	/* read-mostly, see lck_brw_* */
 decl_lck_mtx_data(static, dlil_ifnet_lock);
 u_int32_t dlil_filter_count = 0;
 extern u_int32_t	ipv4_ll_arp_aware;
@@ -359,6 +368,7 @@ static errno_t ifproto_media_send_arp(struct ifnet *, u_short,
 
 static errno_t ifp_if_output(struct ifnet *, struct mbuf *);
 static void ifp_if_start(struct ifnet *);
+static void ifp_if_start_txq(struct ifnet *, u_int32_t);
 static void ifp_if_input_poll(struct ifnet *, u_int32_t, u_int32_t,
     struct mbuf **, struct mbuf **, u_int32_t *, u_int32_t *);
 static errno_t ifp_if_ctl(struct ifnet *, ifnet_ctl_cmd_t, u_int32_t, void *);
@@ -394,6 +404,14 @@ static void dlil_input_packet_list_common(struct ifnet *, struct mbuf *,
     u_int32_t, ifnet_model_t, boolean_t);
 static errno_t ifnet_input_common(struct ifnet *, struct mbuf *, struct mbuf *,
     const struct ifnet_stat_increment_param *, boolean_t, boolean_t);
+static void dlil_input_enqueue(struct ifnet *, struct dlil_threading_info *,
+    struct mbuf *, struct mbuf *, u_int32_t, u_int32_t,
+    const struct ifnet_stat_increment_param *, boolean_t);
+static u_int32_t dlil_flowhash_l3(struct mbuf *, u_int32_t, u_int16_t);
+static u_int32_t dlil_rxq_flowhash(struct ifnet *, struct mbuf *);
+static u_int32_t dlil_txq_flowhash(struct ifnet *, struct mbuf *);
+static void dlil_rxq_input(struct ifnet *, struct mbuf *,
+    const struct ifnet_stat_increment_param *, boolean_t);
 
 static void ifnet_detacher_thread_func(void *, wait_result_t);
 static int ifnet_detacher_thread_cont(int);
@@ -401,7 +419,12 @@ static void ifnet_detach_final(struct ifnet *);
 static void ifnet_detaching_enqueue(struct ifnet *);
 static struct ifnet *ifnet_detaching_dequeue(void);
 
+static void ifnet_start_common(struct ifnet *);
 static void ifnet_start_thread_fn(void *, wait_result_t);
+static void ifnet_txq_start(struct ifnet_txq *);
+static void ifnet_txq_start_thread_fn(void *, wait_result_t);
+static u_int32_t ifnet_txq_select(struct ifnet *, struct mbuf *);
+static struct ifclassq *ifnet_txq_ifcq(struct ifnet *, u_int32_t);
 static void ifnet_poll_thread_fn(void *, wait_result_t);
 static void ifnet_poll(struct ifnet *);
 
@@ -415,6 +438,8 @@ static void ifp_src_route6_copyin(struct ifnet *, struct route_in6 *);
 static int sysctl_rxpoll SYSCTL_HANDLER_ARGS;
 static int sysctl_sndq_maxlen SYSCTL_HANDLER_ARGS;
 static int sysctl_rcvq_maxlen SYSCTL_HANDLER_ARGS;
+static int sysctl_rxq_threads SYSCTL_HANDLER_ARGS;
+static int sysctl_txq_max SYSCTL_HANDLER_ARGS;
 
 /* The following are protected by dlil_ifnet_lock */
 static TAILQ_HEAD(, ifnet) ifnet_detaching_head;
@@ -513,6 +538,37 @@ SYSCTL_PROC(_net_link_generic_system, OID_AUTO, rxpoll,
     CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_rxpoll, 0,
     sysctl_rxpoll, "I", "enable opportunistic input polling");
 
+/*
+ * Receive-side scaling: number of DLIL input threads given to each
+ * interface that gets a dedicated one, taken at attach time.  Inbound
+ * packets are spread across them by flow hash, so that the packets of
+ * any given flow are always processed in order by the same thread.
+ */
+static u_int32_t if_rxq_threads = 1;
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, rxq_threads,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_rxq_threads, 1,
+    sysctl_rxq_threads, "I", "number of input threads per interface");
+
+static u_int32_t dlil_rxq_seed;		/* flow hash seed for RSS */
+
+/*
+ * Multi-queue transmit: upper bound on the number of transmit queues
+ * used by an interface which advertises more than one, taken at attach
+ * time, and the policy used to pick the queue of an outbound packet.
+ */
+static u_int32_t if_txq_limit = IFNET_TXQ_MAX;
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, txq_max,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_txq_limit, IFNET_TXQ_MAX,
+    sysctl_txq_max, "I", "max number of transmit queues per interface");
+
+#define	DLIL_TXQ_SELECT_FLOW	0	/* by flow hash */
+#define	DLIL_TXQ_SELECT_CPU	1	/* by CPU */
+
+static u_int32_t if_txq_select = DLIL_TXQ_SELECT_FLOW;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, txq_select,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_txq_select, DLIL_TXQ_SELECT_FLOW,
+    "transmit queue selection (0: flow hash, 1: CPU)");
+
 u_int32_t if_bw_smoothing_val = 3;
 SYSCTL_UINT(_net_link_generic_system, OID_AUTO, if_bw_smoothing_val,
     CTLFLAG_RW | CTLFLAG_LOCKED, &if_bw_smoothing_val, 0, "");
@@ -537,6 +593,46 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, flow_advisory,
     CTLFLAG_RW | CTLFLAG_LOCKED, &if_flowadv, 1,
     "enable flow-advisory mechanism");
 
+/*
+ * Generic segmentation offload: let TCP build TSO-sized IPv4 segments
+ * for interfaces without TSO and split them up in dlil_output().
+ */
+u_int32_t if_gso = 1;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, gso,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_gso, 1,
+    "enable software TCP segmentation offload");
+
+static u_int64_t if_gso_pkts;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO, gso_packets,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gso_pkts,
+    "number of TSO packets segmented in software");
+
+static u_int64_t if_gso_segs;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO, gso_segments,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &if_gso_segs,
+    "number of segments produced by software TSO");
+
+/*
+ * Receive batching statistics, as log2 histograms: bucket i counts the
+ * batches of [2^i, 2^(i+1)) packets, and the last bucket every batch
+ * larger than that.  rx_batch_hist is the number of packets handed to
+ * dlil_input_packet_list() at a time, rx_free_hist the number of
+ * dropped packets released with a single m_freem_list() at the end of
+ * such a batch.
+ */
+#define	DLIL_BATCH_HIST_MAX	12
+static u_int64_t dlil_rx_batch_hist[DLIL_BATCH_HIST_MAX];
+SYSCTL_OPAQUE(_net_link_generic_system, OID_AUTO, rx_batch_hist,
+    CTLFLAG_RD | CTLFLAG_LOCKED, dlil_rx_batch_hist,
+    sizeof (dlil_rx_batch_hist), "Q",
+    "packets per input batch (log2 histogram)");
+
+static u_int64_t dlil_rx_free_hist[DLIL_BATCH_HIST_MAX];
+SYSCTL_OPAQUE(_net_link_generic_system, OID_AUTO, rx_free_hist,
+    CTLFLAG_RD | CTLFLAG_LOCKED, dlil_rx_free_hist,
+    sizeof (dlil_rx_free_hist), "Q",
+    "dropped input packets freed per batch (log2 histogram)");
+
 unsigned int net_rxpoll = 1;
 unsigned int net_affinity = 1;
 static kern_return_t dlil_affinity_set(struct thread *, u_int32_t);
@@ -743,19 +839,19 @@ ifnet_lock_done(struct ifnet *ifp)
 __private_extern__ void
 ifnet_head_lock_shared(void)
 {
-	lck_rw_lock_shared(&ifnet_head_lock);
+	lck_brw_lock_shared(ifnet_head_lock);
 }
 
 __private_extern__ void
 ifnet_head_lock_exclusive(void)
 {
-	lck_rw_lock_exclusive(&ifnet_head_lock);
+	lck_brw_lock_exclusive(ifnet_head_lock);
 }
 
 __private_extern__ void
 ifnet_head_done(void)
 {
-	lck_rw_done(&ifnet_head_lock);
+	(void) lck_brw_done(ifnet_head_lock);
 }
 
 /*
@@ -909,11 +1005,19 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 		VERIFY(inp == dlil_main_input_thread);
 		(void) strlcat(inp->input_name,
 		    "main_input", DLIL_THREADNAME_LEN);
-	} else if (net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL)) {
+	} else if (net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL) &&
+	    inp->rxq_index == 0) {
 		func = dlil_rxpoll_input_thread_func;
 		VERIFY(inp != dlil_main_input_thread);
 		(void) snprintf(inp->input_name, DLIL_THREADNAME_LEN,
 		    "%s%d_input_poll", ifp->if_name, ifp->if_unit);
+	} else if (inp->rxq_index != 0) {
+		/* additional RSS queue; follows the mode of queue 0 */
+		func = dlil_input_thread_func;
+		VERIFY(inp != dlil_main_input_thread);
+		(void) snprintf(inp->input_name, DLIL_THREADNAME_LEN,
+		    "%s%d_input%d", ifp->if_name, ifp->if_unit,
+		    inp->rxq_index);
 	} else {
 		func = dlil_input_thread_func;
 		VERIFY(inp != dlil_main_input_thread);
@@ -940,7 +1044,8 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 	 * Also define freeze times for transitioning between modes
 	 * and updating the average.
 	 */
-	if (ifp != NULL && net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL)) {
+	if (ifp != NULL && net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL) &&
+	    inp->rxq_index == 0) {
 		limit = MAX(if_rcvq_maxlen, IF_RCVQ_MINLEN);
 		dlil_rxpoll_calc_limits(inp);
 	} else {
@@ -974,6 +1079,7 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 			if (dlil_affinity_set(tp, tag) == KERN_SUCCESS) {
 				thread_reference(tp);
 				inp->tag = tag;
+				inp->rxqstats.ifi_rxq_tag = tag;
 				inp->net_affinity = TRUE;
 			}
 		}
@@ -1022,6 +1128,8 @@ dlil_terminate_input_thread(struct dlil_threading_info *inp)
 	bzero(&inp->tstats, sizeof (inp->tstats));
 	bzero(&inp->pstats, sizeof (inp->pstats));
 	bzero(&inp->sstats, sizeof (inp->sstats));
+	bzero(&inp->rxq_sstats, sizeof (inp->rxq_sstats));
+	bzero(&inp->rxqstats, sizeof (inp->rxqstats));
 
 	net_timerclear(&inp->mode_holdtime);
 	net_timerclear(&inp->mode_lasttime);
@@ -1116,6 +1224,21 @@ dlil_init(void)
 
 	PE_parse_boot_argn("net_rxpoll", &net_rxpoll, sizeof (net_rxpoll));
 
+	PE_parse_boot_argn("net_rxq_threads", &if_rxq_threads,
+	    sizeof (if_rxq_threads));
+	if (if_rxq_threads < 1)
+		if_rxq_threads = 1;
+	else if (if_rxq_threads > IFNET_RXQ_MAX)
+		if_rxq_threads = IFNET_RXQ_MAX;
+	read_random(&dlil_rxq_seed, sizeof (dlil_rxq_seed));
+
+	PE_parse_boot_argn("net_txq_max", &if_txq_limit,
+	    sizeof (if_txq_limit));
+	if (if_txq_limit < 1)
+		if_txq_limit = 1;
+	else if (if_txq_limit > IFNET_TXQ_MAX)
+		if_txq_limit = IFNET_TXQ_MAX;
+
 	PE_parse_boot_argn("net_rtref", &net_rtref, sizeof (net_rtref));
 
 	PE_parse_boot_argn("ifnet_debug", &ifnet_debug, sizeof (ifnet_debug));
@@ -1227,8 +1350,10 @@ dlil_init(void)
 
 	ifnet_lock_attr = lck_attr_alloc_init();
 
-	lck_rw_init(&ifnet_head_lock, ifnet_head_lock_group,
+	ifnet_head_lock = lck_brw_alloc_init(ifnet_head_lock_group,
 	    dlil_lck_attributes);
+	if (ifnet_head_lock == NULL)
+		panic("%s: failed allocating ifnet_head_lock", __func__);
 	lck_mtx_init(&dlil_ifnet_lock, dlil_lock_group, dlil_lck_attributes);
 
 	ifnet_fc_init();
@@ -1550,7 +1675,8 @@ dlil_input_thread_func(void *v, wait_result_t w)
 
 	VERIFY(inp != dlil_main_input_thread);
 	VERIFY(ifp != NULL);
-	VERIFY(!(ifp->if_eflags & IFEF_RXPOLL) || !net_rxpoll);
+	VERIFY(!(ifp->if_eflags & IFEF_RXPOLL) || !net_rxpoll ||
+	    inp->rxq_index != 0);
 	VERIFY(inp->mode == IFNET_MODEL_INPUT_POLL_OFF);
 
 	while (1) {
@@ -1596,6 +1722,8 @@ dlil_input_thread_func(void *v, wait_result_t w)
 		}
 
 		inp->wtot = 0;
+		if (m != NULL)
+			inp->rxqstats.ifi_rxq_batches++;
 
 		dlil_input_stats_sync(ifp, inp);
 
@@ -1632,6 +1760,7 @@ dlil_rxpoll_input_thread_func(void *v, wait_result_t w)
 	while (1) {
 		struct mbuf *m = NULL;
 		u_int32_t m_cnt, m_size, poll_req = 0;
+		u_int32_t s_cnt, s_size;
 		ifnet_model_t mode;
 		struct timespec now, delta;
 
@@ -1686,6 +1815,17 @@ dlil_rxpoll_input_thread_func(void *v, wait_result_t w)
 		/* Packets for this interface */
 		m = _getq_all(&inp->rcvq_pkts);
 		VERIFY(m != NULL || m_cnt == 0);
+		if (m != NULL)
+			inp->rxqstats.ifi_rxq_batches++;
+
+		/*
+		 * With receive-side scaling, this thread (queue 0) still
+		 * decides the polling mode for the whole interface; sample
+		 * the packets that were steered to the other queues too.
+		 */
+		s_cnt = m_cnt + (u_int32_t)inp->rxq_sstats.packets;
+		s_size = m_size + (u_int32_t)inp->rxq_sstats.bytes;
+		PKTCNTR_CLEAR(&inp->rxq_sstats);
 
 		nanouptime(&now);
 		if (!net_timerisset(&inp->sample_lasttime))
@@ -1696,7 +1836,7 @@ dlil_rxpoll_input_thread_func(void *v, wait_result_t w)
 			u_int32_t ptot, btot;
 
 			/* Accumulate statistics for current sampling */
-			PKTCNTR_ADD(&inp->sstats, m_cnt, m_size);
+			PKTCNTR_ADD(&inp->sstats, s_cnt, s_size);
 
 			if (net_timercmp(&delta, &inp->sample_holdtime, <))
 				goto skip;
@@ -1795,6 +1935,11 @@ skip:
 		if (poll_req != 0 && ifnet_is_attached(ifp, 1)) {
 			struct ifnet_model_params p = { mode, { 0 } };
 			errno_t err;
+			u_int32_t i;
+
+			/* The other RSS queues follow this one */
+			for (i = 1; i < ifp->if_rxq_cnt; i++)
+				ifp->if_rxq[i]->mode = mode;
 
 			if (dlil_verbose) {
 				printf("%s%d: polling is now %s, "
@@ -1922,7 +2067,6 @@ static errno_t
 ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
     const struct ifnet_stat_increment_param *s, boolean_t ext, boolean_t poll)
 {
-	struct thread *tp = current_thread();
 	struct mbuf *last;
 	struct dlil_threading_info *inp;
 	u_int32_t m_cnt = 0, m_size = 0;
@@ -2002,6 +2146,36 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 	if ((inp = ifp->if_inp) == NULL)
 		inp = dlil_main_input_thread;
 
+	/*
+	 * Spread the chain across the interface's input threads, if it
+	 * has more than one; otherwise hand it over as a whole.
+	 */
+	if (ifp->if_rxq_cnt > 1)
+		dlil_rxq_input(ifp, m_head, s, poll);
+	else
+		dlil_input_enqueue(ifp, inp, m_head, m_tail, m_cnt, m_size,
+		    s, poll);
+
+	if (ifp != lo_ifp) {
+		/* Release the IO refcnt */
+		ifnet_decr_iorefcnt(ifp);
+	}
+
+	return (0);
+}
+
+/*
+ * Hand a chain of inbound packets over to an input thread and wake it
+ * up; m_head may be NULL when only a wakeup is needed.
+ */
+static void
+dlil_input_enqueue(struct ifnet *ifp, struct dlil_threading_info *inp,
+    struct mbuf *m_head, struct mbuf *m_tail, u_int32_t m_cnt,
+    u_int32_t m_size, const struct ifnet_stat_increment_param *s,
+    boolean_t poll)
+{
+	struct thread *tp = current_thread();
+
 	/*
 	 * If there is a matching DLIL input thread associated with an
 	 * affinity set, associate this thread with the same set.  We
@@ -2009,6 +2183,7 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 	 */
 	lck_mtx_lock_spin(&inp->input_lck);
 	if (inp != dlil_main_input_thread && inp->net_affinity &&
+	    inp->rxq_index == 0 &&
 	    ((!poll && inp->wloop_thr == THREAD_NULL) ||
 	    (poll && inp->poll_thr == THREAD_NULL))) {
 		u_int32_t tag = inp->tag;
@@ -2045,8 +2220,12 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 		struct dlil_main_threading_info *inpm =
 		    (struct dlil_main_threading_info *)inp;
 		_addq_multi(&inpm->lo_rcvq_pkts, m_head, m_tail, m_cnt, m_size);
-	} else {
+	} else if (m_head != NULL) {
 		_addq_multi(&inp->rcvq_pkts, m_head, m_tail, m_cnt, m_size);
+		inp->rxqstats.ifi_rxq_packets += m_cnt;
+		inp->rxqstats.ifi_rxq_bytes += m_size;
+		if (qlen(&inp->rcvq_pkts) > inp->rxqstats.ifi_rxq_maxqlen)
+			inp->rxqstats.ifi_rxq_maxqlen = qlen(&inp->rcvq_pkts);
 	}
 
 #if IFNET_INPUT_SANITY_CHK
@@ -2083,20 +2262,203 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 	inp->input_waiting |= DLIL_INPUT_WAITING;
 	if (!(inp->input_waiting & DLIL_INPUT_RUNNING)) {
 		inp->wtot++;
+		inp->rxqstats.ifi_rxq_wakeups++;
 		wakeup_one((caddr_t)&inp->input_waiting);
 	}
 	lck_mtx_unlock(&inp->input_lck);
+}
 
-	if (ifp != lo_ifp) {
-		/* Release the IO refcnt */
-		ifnet_decr_iorefcnt(ifp);
+/*
+ * Flow key hashed to pick the receive or transmit queue of a packet.
+ */
+struct dlil_rxq_key {
+	u_int32_t	rk_src[4];	/* source address */
+	u_int32_t	rk_dst[4];	/* destination address */
+	u_int16_t	rk_ports[2];	/* source and destination ports */
+	u_int32_t	rk_proto;	/* transport protocol */
+};
+
+/*
+ * Hash the addresses, protocol and (for unfragmented TCP and UDP) the
+ * ports of the IPv4 or IPv6 packet of ethertype type found off bytes
+ * into m.  The headers are copied out, so they may be unaligned or span
+ * mbufs.  Anything else hashes to 0.
+ */
+static u_int32_t
+dlil_flowhash_l3(struct mbuf *m, u_int32_t off, u_int16_t type)
+{
+	struct dlil_rxq_key key;
+	u_int32_t len = m_pktlen(m), hlen = 0;
+
+	if (len < off)
+		return (0);
+	len -= off;
+
+	bzero(&key, sizeof (key));
+	switch (type) {
+#if INET
+	case ETHERTYPE_IP: {
+		struct ip ip;
+
+		if (len < sizeof (ip))
+			return (0);
+		m_copydata(m, off, sizeof (ip), (caddr_t)&ip);
+		if (ip.ip_v != IPVERSION)
+			return (0);
+		key.rk_src[0] = ip.ip_src.s_addr;
+		key.rk_dst[0] = ip.ip_dst.s_addr;
+		key.rk_proto = ip.ip_p;
+		if (!(ip.ip_off & htons(IP_MF | IP_OFFMASK)))
+			hlen = ip.ip_hl << 2;
+		break;
 	}
+#endif /* INET */
+#if INET6
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr ip6;
 
-	return (0);
+		if (len < sizeof (ip6))
+			return (0);
+		m_copydata(m, off, sizeof (ip6), (caddr_t)&ip6);
+		bcopy(&ip6.ip6_src, key.rk_src, sizeof (key.rk_src));
+		bcopy(&ip6.ip6_dst, key.rk_dst, sizeof (key.rk_dst));
+		key.rk_proto = ip6.ip6_nxt;
+		hlen = sizeof (ip6);
+		break;
+	}
+#endif /* INET6 */
+	default:
+		return (0);
+	}
+
+	if ((key.rk_proto == IPPROTO_TCP || key.rk_proto == IPPROTO_UDP) &&
+	    hlen != 0 && hlen + sizeof (key.rk_ports) <= len)
+		m_copydata(m, off + hlen, sizeof (key.rk_ports),
+		    (caddr_t)key.rk_ports);
+
+	return (net_flowhash(&key, sizeof (key), dlil_rxq_seed));
+}
+
+/*
+ * Compute the flow hash used for receive-side scaling.  Use the one the
+ * driver supplied, if any; otherwise hash the IPv4 and IPv6 headers of
+ * frames on Ethernet, whose link header has already been stripped.
+ * Everything else hashes to 0, i.e. goes to the first queue.
+ */
+static u_int32_t
+dlil_rxq_flowhash(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ether_header *eh;
+
+	if (m->m_pkthdr.m_fhflags & PF_TAG_FLOWHASH)
+		return (m->m_pkthdr.m_flowhash);
+
+	if (ifp->if_type != IFT_ETHER ||
+	    (eh = (struct ether_header *)m->m_pkthdr.header) == NULL)
+		return (0);
+
+	return (dlil_flowhash_l3(m, 0, ntohs(eh->ether_type)));
+}
+
+/*
+ * Same as dlil_rxq_flowhash(), for an outbound frame, which still
+ * carries its Ethernet header.
+ */
+static u_int32_t
+dlil_txq_flowhash(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ether_header eh;
+
+	if (m->m_pkthdr.m_fhflags & PF_TAG_FLOWHASH)
+		return (m->m_pkthdr.m_flowhash);
+
+	if (ifp->if_type != IFT_ETHER || m_pktlen(m) < ETHER_HDR_LEN)
+		return (0);
+	m_copydata(m, 0, ETHER_HDR_LEN, (caddr_t)&eh);
+
+	return (dlil_flowhash_l3(m, ETHER_HDR_LEN, ntohs(eh.ether_type)));
+}
+
+/*
+ * Receive-side scaling: split an inbound chain into one sub-chain per
+ * input thread of the interface, by flow hash, and hand each of them
+ * over to its thread.  Packets of the same flow keep their order.
+ */
+static void
+dlil_rxq_input(struct ifnet *ifp, struct mbuf *m_head,
+    const struct ifnet_stat_increment_param *s, boolean_t poll)
+{
+	struct mbuf *head[IFNET_RXQ_MAX], *tail[IFNET_RXQ_MAX];
+	u_int32_t cnt[IFNET_RXQ_MAX], size[IFNET_RXQ_MAX];
+	u_int32_t n = ifp->if_rxq_cnt, i, q, sq;
+	struct dlil_threading_info *inp0 = ifp->if_rxq[0];
+	boolean_t rxpoll;
+	struct mbuf *m;
+
+	VERIFY(n > 1 && n <= IFNET_RXQ_MAX);
+	bzero(head, sizeof (head));
+	bzero(tail, sizeof (tail));
+	bzero(cnt, sizeof (cnt));
+	bzero(size, sizeof (size));
+
+	while ((m = m_head) != NULL) {
+		m_head = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+
+		q = dlil_rxq_flowhash(ifp, m) % n;
+		if (head[q] == NULL)
+			head[q] = m;
+		else
+			mbuf_setnextpkt(tail[q], m);
+		tail[q] = m;
+		cnt[q]++;
+		size[q] += m_pktlen(m);
+	}
+
+	/*
+	 * For interfaces doing opportunistic polling, queue 0 drives the
+	 * polling mode; tell it about the load on the other queues and
+	 * always wake it up, so that its sampling sees every batch.  It
+	 * then also takes the driver-supplied statistics; otherwise they
+	 * go to the first queue that got any packet.
+	 */
+	rxpoll = (net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL));
+	if (rxpoll) {
+		lck_mtx_lock_spin(&inp0->input_lck);
+		for (i = 1; i < n; i++)
+			PKTCNTR_ADD(&inp0->rxq_sstats, cnt[i], size[i]);
+		lck_mtx_unlock(&inp0->input_lck);
+		sq = 0;
+	} else {
+		for (sq = 0; head[sq] == NULL; sq++)
+			;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (head[i] == NULL && !(rxpoll && i == 0))
+			continue;
+		dlil_input_enqueue(ifp, ifp->if_rxq[i], head[i], tail[i],
+		    cnt[i], size[i], (i == sq) ? s : NULL, poll);
+	}
 }
 
 void
 ifnet_start(struct ifnet *ifp)
+{
+	struct ifnet_txq *txq;
+	u_int32_t i;
+
+	ifnet_start_common(ifp);
+
+	/* Kick the additional transmit queues as well */
+	for (i = 1; i < ifp->if_txq_cnt; i++) {
+		if ((txq = ifp->if_txq[i]) != NULL)
+			ifnet_txq_start(txq);
+	}
+}
+
+static void
+ifnet_start_common(struct ifnet *ifp)
 {
 	/*
 	 * If the starter thread is inactive, signal it to do work.
@@ -2179,7 +2541,10 @@ ifnet_start_thread_fn(void *v, wait_result_t w)
 
 			lck_mtx_unlock(&ifp->if_start_lock);
 			/* invoke the driver's start routine */
-			((*ifp->if_start)(ifp));
+			if (ifp->if_start_txq != NULL)
+				((*ifp->if_start_txq)(ifp, 0));
+			else
+				((*ifp->if_start)(ifp));
 			lck_mtx_lock_spin(&ifp->if_start_lock);
 
 			/* if there's no pending request, we're done */
@@ -2206,6 +2571,130 @@ ifnet_start_thread_fn(void *v, wait_result_t w)
 	VERIFY(0);	/* we should never get here */
 }
 
+static void
+ifnet_txq_start(struct ifnet_txq *txq)
+{
+	/*
+	 * If the starter thread is inactive, signal it to do work.
+	 */
+	lck_mtx_lock_spin(&txq->txq_start_lock);
+	txq->txq_start_req++;
+	if (!txq->txq_start_active && txq->txq_start_thread != THREAD_NULL) {
+		wakeup_one((caddr_t)&txq->txq_start_thread);
+	}
+	lck_mtx_unlock(&txq->txq_start_lock);
+}
+
+/*
+ * Starter thread of an additional transmit queue; same as the one for
+ * the primary queue, minus the TBR restart interval, as the token bucket
+ * regulator applies to if_snd only.
+ */
+static void
+ifnet_txq_start_thread_fn(void *v, wait_result_t w)
+{
+#pragma unused(w)
+	struct ifnet_txq *txq = v;
+	struct ifnet *ifp = txq->txq_ifp;
+	char ifname[IFNAMSIZ + 1];
+
+	snprintf(ifname, sizeof (ifname), "%s%d_starter%d",
+	    ifp->if_name, ifp->if_unit, txq->txq_index);
+
+	lck_mtx_lock_spin(&txq->txq_start_lock);
+
+	for (;;) {
+		(void) msleep(&txq->txq_start_thread, &txq->txq_start_lock,
+		    (PZERO - 1) | PSPIN, ifname, NULL);
+
+		/* interface is detached? */
+		if (txq->txq_start_thread == THREAD_NULL) {
+			lck_mtx_unlock(&txq->txq_start_lock);
+			if_qflush_ifq(&txq->txq_snd, 0);
+
+			if (dlil_verbose) {
+				printf("%s%d: starter thread %d terminated\n",
+				    ifp->if_name, ifp->if_unit,
+				    txq->txq_index);
+			}
+
+			/* for the extra refcnt from kernel_thread_start() */
+			thread_deallocate(current_thread());
+			/* this is the end */
+			thread_terminate(current_thread());
+			/* NOTREACHED */
+			return;
+		}
+
+		txq->txq_start_active = 1;
+		for (;;) {
+			u_int32_t req = txq->txq_start_req;
+
+			lck_mtx_unlock(&txq->txq_start_lock);
+			/* invoke the driver's per-queue start routine */
+			((*ifp->if_start_txq)(ifp, txq->txq_index));
+			lck_mtx_lock_spin(&txq->txq_start_lock);
+
+			/* if there's no pending request, we're done */
+			if (req == txq->txq_start_req)
+				break;
+		}
+		txq->txq_start_req = 0;
+		txq->txq_start_active = 0;
+	}
+
+	/* NOTREACHED */
+	lck_mtx_unlock(&txq->txq_start_lock);
+	VERIFY(0);	/* we should never get here */
+}
+
+/*
+ * Pick the transmit queue of an outbound packet.  Packets are spread by
+ * flow hash, the one of their PCB if they carry it or else one computed
+ * from their headers, so that each flow stays in order on a single queue
+ * whether it is locally originated, forwarded or bridged.  Spreading by
+ * sending CPU instead has to be asked for via the txq_select sysctl.
+ *
+ * Token bucket regulation, ALTQ and throttling are configured on if_snd
+ * alone, so while any of them is in effect everything goes there.  The
+ * flags are tested without the queue lock; packets already on the other
+ * queues when one is turned on just drain.
+ */
+static u_int32_t
+ifnet_txq_select(struct ifnet *ifp, struct mbuf *m)
+{
+	struct ifclassq *ifq = &ifp->if_snd;
+	u_int32_t cnt = ifp->if_txq_cnt;
+
+	if (cnt <= 1)
+		return (0);
+
+	if (IFCQ_TBR_IS_ENABLED(ifq) || IFCQ_THROTTLE_IS_ENABLED(ifq))
+		return (0);
+#if PF_ALTQ
+	if (ALTQ_IS_ENABLED(IFCQ_ALTQ(ifq)))
+		return (0);
+#endif /* PF_ALTQ */
+
+	if (if_txq_select == DLIL_TXQ_SELECT_CPU)
+		return (cpu_number() % cnt);
+
+	return (dlil_txq_flowhash(ifp, m) % cnt);
+}
+
+static struct ifclassq *
+ifnet_txq_ifcq(struct ifnet *ifp, u_int32_t idx)
+{
+	struct ifnet_txq *txq;
+
+	if (idx == 0)
+		return (&ifp->if_snd);
+	else if (idx >= ifp->if_txq_cnt || (txq = ifp->if_txq[idx]) == NULL)
+		return (NULL);
+
+	return (&txq->txq_snd);
+}
+
 void
 ifnet_set_start_cycle(struct ifnet *ifp, struct timespec *ts)
 {
@@ -2418,7 +2907,7 @@ errno_t
 ifnet_set_output_sched_model(struct ifnet *ifp, u_int32_t model)
 {
 	struct ifclassq *ifq;
-	u_int32_t omodel;
+	u_int32_t omodel, i;
 	errno_t err;
 
 	if (ifp == NULL || (model != IFNET_SCHED_MODEL_DRIVER_MANAGED &&
@@ -2426,6 +2915,8 @@ ifnet_set_output_sched_model(struct ifnet *ifp, u_int32_t model)
 		return (EINVAL);
 	else if (!(ifp->if_eflags & IFEF_TXSTART))
 		return (ENXIO);
+	else if (model != IFNET_SCHED_MODEL_NORMAL && ifp->if_txq_cnt > 1)
+		return (ENOTSUP);	/* multi-queue requires NORMAL */
 
 	ifq = &ifp->if_snd;
 	IFCQ_LOCK(ifq);
@@ -2435,12 +2926,21 @@ ifnet_set_output_sched_model(struct ifnet *ifp, u_int32_t model)
 		ifp->if_output_sched_model = omodel;
 	IFCQ_UNLOCK(ifq);
 
+	for (i = 1; err == 0 && i < ifp->if_txq_cnt; i++) {
+		ifq = &ifp->if_txq[i]->txq_snd;
+		IFCQ_LOCK(ifq);
+		err = ifclassq_pktsched_setup(ifq);
+		IFCQ_UNLOCK(ifq);
+	}
+
 	return (err);
 }
 
 errno_t
 ifnet_set_sndq_maxlen(struct ifnet *ifp, u_int32_t maxqlen)
 {
+	u_int32_t i;
+
 	if (ifp == NULL)
 		return (EINVAL);
 	else if (!(ifp->if_eflags & IFEF_TXSTART))
@@ -2448,6 +2948,10 @@ ifnet_set_sndq_maxlen(struct ifnet *ifp, u_int32_t maxqlen)
 
 	ifclassq_set_maxlen(&ifp->if_snd, maxqlen);
 
+	/* Same limit for the other transmit queues */
+	for (i = 1; i < ifp->if_txq_cnt; i++)
+		ifclassq_set_maxlen(&ifp->if_txq[i]->txq_snd, maxqlen);
+
 	return (0);
 }
 
@@ -2467,12 +2971,17 @@ ifnet_get_sndq_maxlen(struct ifnet *ifp, u_int32_t *maxqlen)
 errno_t
 ifnet_get_sndq_len(struct ifnet *ifp, u_int32_t *qlen)
 {
+	u_int32_t i;
+
 	if (ifp == NULL || qlen == NULL)
 		return (EINVAL);
 	else if (!(ifp->if_eflags & IFEF_TXSTART))
 		return (ENXIO);
 
+	/* Total across all transmit queues */
 	*qlen = ifclassq_get_len(&ifp->if_snd);
+	for (i = 1; i < ifp->if_txq_cnt; i++)
+		*qlen += ifclassq_get_len(&ifp->if_txq[i]->txq_snd);
 
 	return (0);
 }
@@ -2481,6 +2990,7 @@ errno_t
 ifnet_set_rcvq_maxlen(struct ifnet *ifp, u_int32_t maxqlen)
 {
 	struct dlil_threading_info *inp;
+	u_int32_t i;
 
 	if (ifp == NULL)
 		return (EINVAL);
@@ -2497,6 +3007,14 @@ ifnet_set_rcvq_maxlen(struct ifnet *ifp, u_int32_t maxqlen)
 	qlimit(&inp->rcvq_pkts) = maxqlen;
 	lck_mtx_unlock(&inp->input_lck);
 
+	/* Same limit for the other RSS queues */
+	for (i = 1; i < ifp->if_rxq_cnt; i++) {
+		inp = ifp->if_rxq[i];
+		lck_mtx_lock(&inp->input_lck);
+		qlimit(&inp->rcvq_pkts) = maxqlen;
+		lck_mtx_unlock(&inp->input_lck);
+	}
+
 	return (0);
 }
 
@@ -2520,6 +3038,8 @@ ifnet_get_rcvq_maxlen(struct ifnet *ifp, u_int32_t *maxqlen)
 errno_t
 ifnet_enqueue(struct ifnet *ifp, struct mbuf *m)
 {
+	struct ifnet_txq *txq = NULL;
+	u_int32_t idx;
 	int error;
 
 	if (ifp == NULL || m == NULL || !(m->m_flags & M_PKTHDR) ||
@@ -2538,16 +3058,26 @@ ifnet_enqueue(struct ifnet *ifp, struct mbuf *m)
 		
 	}
 
-	/* enqueue the packet */
-	error = ifclassq_enqueue(&ifp->if_snd, m);
+	/* enqueue the packet on the transmit queue selected for it */
+	if ((idx = ifnet_txq_select(ifp, m)) != 0)
+		txq = ifp->if_txq[idx];
+	if (txq != NULL)
+		error = ifclassq_enqueue(&txq->txq_snd, m);
+	else
+		error = ifclassq_enqueue(&ifp->if_snd, m);
 
 	/*
 	 * Tell the driver to start dequeueing; do this even when the queue
 	 * for the packet is suspended (EQSUSPENDED), as the driver could still
-	 * be dequeueing from other unsuspended queues.
+	 * be dequeueing from other unsuspended queues.  Only the starter of
+	 * the queue being enqueued to needs to be signalled.
 	 */
-	if (error == 0 || error == EQFULL || error == EQSUSPENDED)
-		ifnet_start(ifp);
+	if (error == 0 || error == EQFULL || error == EQSUSPENDED) {
+		if (txq != NULL)
+			ifnet_txq_start(txq);
+		else
+			ifnet_start_common(ifp);
+	}
 
 	return (error);
 }
@@ -2606,6 +3136,39 @@ ifnet_dequeue_service_class_multi(struct ifnet *ifp, mbuf_svc_class_t sc,
 	    tail, cnt, len));
 }
 
+errno_t
+ifnet_dequeue_txq(struct ifnet *ifp, u_int32_t txq, struct mbuf **mp)
+{
+	struct ifclassq *ifq;
+
+	if (ifp == NULL || mp == NULL)
+		return (EINVAL);
+	else if (!(ifp->if_eflags & IFEF_TXSTART) ||
+	    (ifp->if_output_sched_model != IFNET_SCHED_MODEL_NORMAL))
+		return (ENXIO);
+	else if ((ifq = ifnet_txq_ifcq(ifp, txq)) == NULL)
+		return (EINVAL);
+
+	return (ifclassq_dequeue(ifq, 1, mp, NULL, NULL, NULL));
+}
+
+errno_t
+ifnet_dequeue_txq_multi(struct ifnet *ifp, u_int32_t txq, u_int32_t limit,
+    struct mbuf **head, struct mbuf **tail, u_int32_t *cnt, u_int32_t *len)
+{
+	struct ifclassq *ifq;
+
+	if (ifp == NULL || head == NULL || limit < 1)
+		return (EINVAL);
+	else if (!(ifp->if_eflags & IFEF_TXSTART) ||
+	    (ifp->if_output_sched_model != IFNET_SCHED_MODEL_NORMAL))
+		return (ENXIO);
+	else if ((ifq = ifnet_txq_ifcq(ifp, txq)) == NULL)
+		return (EINVAL);
+
+	return (ifclassq_dequeue(ifq, limit, head, tail, cnt, len));
+}
+
 static int
 dlil_interface_filters_input(struct ifnet *ifp, struct mbuf **m_p,
     char **frame_header_p, protocol_family_t protocol_family)
@@ -2809,6 +3372,14 @@ dlil_input_stats_sync(struct ifnet *ifp, struct dlil_threading_info *inp)
 	}
 }
 
+static inline void
+dlil_batch_hist_add(u_int64_t *hist, u_int32_t n)
+{
+	u_int32_t i = 31 - clz(n);
+
+	atomic_add_64(&hist[MIN(i, DLIL_BATCH_HIST_MAX - 1)], 1);
+}
+
 __private_extern__ void
 dlil_input_packet_list(struct ifnet *ifp, struct mbuf *m)
 {
@@ -2835,10 +3406,26 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, struct mbuf *m,
 	struct if_proto	*		last_ifproto = NULL;
 	mbuf_t				pkt_first = NULL;
 	mbuf_t *			pkt_next = NULL;
+	mbuf_t				free_first = NULL;
+	mbuf_t *			free_next = &free_first;
 	u_int32_t			poll_thresh = 0, poll_ival = 0;
+	u_int32_t			npkts = 0, nfree = 0;
 
 	KERNEL_DEBUG(DBG_FNC_DLIL_INPUT | DBG_FUNC_START,0,0,0,0,0);
 
+	/*
+	 * Packets dropped along the way are collected on free_first and
+	 * released together once the batch is done, so that their mbufs
+	 * and clusters go back to the caches in a single pass.
+	 */
+#define	DLIL_INPUT_DROP(_m) do {					\
+	if ((_m) != NULL) {						\
+		*free_next = (_m);					\
+		free_next = &(_m)->m_nextpkt;				\
+		nfree++;						\
+	}								\
+} while (0)
+
 	if (ext && mode == IFNET_MODEL_INPUT_POLL_ON && cnt > 1 &&
 	    (poll_ival = if_rxpoll_interval_pkts) > 0)
 		poll_thresh = cnt;
@@ -2859,6 +3446,7 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, struct mbuf *m,
 
 		next_packet = m->m_nextpkt;
 		m->m_nextpkt = NULL;
+		npkts++;
 		frame_header = m->m_pkthdr.header;
 		m->m_pkthdr.header = NULL;
 
@@ -2869,7 +3457,7 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, struct mbuf *m,
 		 */
 		if (ifp != lo_ifp) {
 			if (!ifnet_is_attached(ifp, 1)) {
-				m_freem(m);
+				DLIL_INPUT_DROP(m);
 				goto next;
 			}
 			iorefcnt = 1;
@@ -2901,12 +3489,12 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, struct mbuf *m,
 			    &frame_header, protocol_family);
 			if (error != 0) {
 				if (error != EJUSTRETURN)
-					m_freem(m);
+					DLIL_INPUT_DROP(m);
 				goto next;
 			}
 		}
 		if (error != 0 || ((m->m_flags & M_PROMISC) != 0) ) {
-			m_freem(m);
+			DLIL_INPUT_DROP(m);
 			goto next;
 		}
 
@@ -2927,7 +3515,7 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, struct mbuf *m,
 		}
 		if (ifproto == NULL) {
 			/* no protocol for this packet, discard */
-			m_freem(m);
+			DLIL_INPUT_DROP(m);
 			goto next;
 		}
 		if (ifproto != last_ifproto) {
@@ -2970,6 +3558,14 @@ next:
 			ifnet_decr_iorefcnt(ifp);
 	}
 
+	if (free_first != NULL) {
+		m_freem_list(free_first);
+		dlil_batch_hist_add(dlil_rx_free_hist, nfree);
+	}
+	if (npkts != 0)
+		dlil_batch_hist_add(dlil_rx_batch_hist, npkts);
+#undef DLIL_INPUT_DROP
+
 	KERNEL_DEBUG(DBG_FNC_DLIL_INPUT | DBG_FUNC_END,0,0,0,0,0);
 }
 
@@ -3199,6 +3795,153 @@ ifp_inc_traffic_class_out(struct ifnet *ifp, struct mbuf *m)
 	}
 }
 
+#if INET
+/*
+ * Split an IPv4 TCP packet marked CSUM_TSO_IPV4 into segments of at most
+ * tso_segsz payload bytes, for an interface that cannot do it itself.
+ *
+ * Every segment gets a private copy of the IP and TCP headers, fixed up
+ * the way the NIC would: IP length, ID and checksum, TCP sequence number,
+ * FIN/PSH only on the last segment and CWR only on the first.  The TCP
+ * checksum is left to the interface if it can compute it, in which case
+ * the payload is shared with the original packet by reference.  Else the
+ * payload is copied into the segment's cluster and summed in the same
+ * pass, so that it is read only once.  Returns the segments linked through
+ * m_nextpkt, with the last one in *lastp, or NULL if it ran out of mbufs;
+ * the original packet is consumed either way.
+ */
+static struct mbuf *
+dlil_gso_ipv4(struct ifnet *ifp, struct mbuf *m, struct mbuf **lastp)
+{
+	struct mbuf *head = NULL, **tail = &head, *n = NULL;
+	struct ip *ip, *nip;
+	struct tcphdr *th, *nth;
+	u_int32_t hlen, thlen, hdrlen, off, seglen, mss, seq, csum;
+	u_int16_t id;
+	int hwcsum, copy, nsegs = 0;
+
+	hwcsum = (apple_hwcksum_tx &&
+	    (IF_HWASSIST_CSUM_FLAGS(ifp->if_hwassist) & CSUM_TCP));
+
+	if (m->m_len < (int)(sizeof (*ip) + sizeof (*th)) &&
+	    (m = m_pullup(m, sizeof (*ip) + sizeof (*th))) == NULL)
+		return (NULL);
+	ip = mtod(m, struct ip *);
+	hlen = IP_VHL_HL(ip->ip_vhl) << 2;
+	if (ip->ip_p != IPPROTO_TCP || hlen < sizeof (*ip))
+		goto bad;
+	if (m->m_len < (int)(hlen + sizeof (*th)) &&
+	    (m = m_pullup(m, hlen + sizeof (*th))) == NULL)
+		return (NULL);
+	th = (struct tcphdr *)(void *)(mtod(m, caddr_t) + hlen);
+	thlen = th->th_off << 2;
+	hdrlen = hlen + thlen;
+	if (thlen < sizeof (*th) || hdrlen > MCLBYTES - max_linkhdr)
+		goto bad;
+	if (m->m_len < (int)hdrlen && (m = m_pullup(m, hdrlen)) == NULL)
+		return (NULL);
+	ip = mtod(m, struct ip *);
+	th = (struct tcphdr *)(void *)(mtod(m, caddr_t) + hlen);
+
+	mss = m->m_pkthdr.tso_segsz;
+	if (mss == 0)
+		mss = m->m_pkthdr.len - hdrlen;
+	seq = ntohl(th->th_seq);
+	id = ntohs(ip->ip_id);
+
+	off = hdrlen;
+	do {
+		seglen = MIN(mss, m->m_pkthdr.len - off);
+		copy = (!hwcsum && seglen > 0 &&
+		    hdrlen + seglen <= (u_int32_t)(MCLBYTES - max_linkhdr));
+
+		MGETHDR(n, M_DONTWAIT, MT_HEADER);
+		if (n == NULL)
+			goto bad;
+		if (copy || MHLEN < (int)(hdrlen + max_linkhdr)) {
+			MCLGET(n, M_DONTWAIT);
+			if (!(n->m_flags & M_EXT))
+				goto bad;
+		}
+		/* the packet header, including any tags */
+		n->m_flags |= (m->m_flags & M_COPYFLAGS);
+		n->m_pkthdr = m->m_pkthdr;
+		m_tag_init(n);
+		if (m_tag_copy_chain(n, m, M_DONTWAIT) == 0)
+			goto bad;
+		n->m_data += max_linkhdr;
+		n->m_len = hdrlen;
+		bcopy(ip, mtod(n, caddr_t), hdrlen);
+		csum = 0;
+		if (copy) {
+			csum = m_copydata_sum(m, off, seglen,
+			    mtod(n, caddr_t) + hdrlen, 0);
+			n->m_len += seglen;
+		} else if (seglen > 0 &&
+		    (n->m_next = m_copym(m, off, seglen, M_DONTWAIT)) == NULL) {
+			goto bad;
+		}
+		n->m_pkthdr.len = hdrlen + seglen;
+		n->m_pkthdr.tso_segsz = 0;
+		n->m_pkthdr.csum_flags &= ~CSUM_TSO_IPV4;
+
+		nip = mtod(n, struct ip *);
+		nth = (struct tcphdr *)(void *)(mtod(n, caddr_t) + hlen);
+		nip->ip_len = htons(hdrlen + seglen);
+		nip->ip_id = htons(id);
+		id++;
+		nth->th_seq = htonl(seq);
+		seq += seglen;
+		if (off != hdrlen)
+			nth->th_flags &= ~TH_CWR;
+		if (off + seglen < (u_int32_t)m->m_pkthdr.len)
+			nth->th_flags &= ~(TH_FIN|TH_PUSH);
+
+		nip->ip_sum = 0;
+		if (!(n->m_pkthdr.csum_flags & CSUM_IP))
+			nip->ip_sum = in_cksum(n, hlen);
+
+		nth->th_sum = in_pseudo(nip->ip_src.s_addr,
+		    nip->ip_dst.s_addr, htons(thlen + seglen + IPPROTO_TCP));
+		if (hwcsum) {
+			n->m_pkthdr.csum_flags |= CSUM_TCP;
+			n->m_pkthdr.csum_data = offsetof(struct tcphdr, th_sum);
+		} else if (copy) {
+			/*
+			 * The payload was summed on its way in; th_sum
+			 * holds the pseudo header sum, so summing the
+			 * header completes the checksum.
+			 */
+			csum = os_cpu_in_cksum(nth, thlen, csum);
+			nth->th_sum = ~csum & 0xffff;
+			n->m_pkthdr.csum_flags &= ~CSUM_DELAY_DATA;
+		} else {
+			nth->th_sum = in_cksum_skip(n, hdrlen + seglen, hlen);
+			n->m_pkthdr.csum_flags &= ~CSUM_DELAY_DATA;
+		}
+
+		*tail = n;
+		tail = &n->m_nextpkt;
+		*lastp = n;
+		n = NULL;
+		nsegs++;
+		off += seglen;
+	} while (off < (u_int32_t)m->m_pkthdr.len);
+	m_freem(m);
+	atomic_add_64(&if_gso_pkts, 1);
+	atomic_add_64(&if_gso_segs, nsegs);
+	return (head);
+
+bad:
+	if (n != NULL)
+		m_freem(n);
+	if (head != NULL)
+		mbuf_freem_list(head);
+	m_freem(m);
+	return (NULL);
+}
+#endif /* INET */
+
 /*
  * dlil_output
  *
@@ -3298,6 +4041,26 @@ preout_again:
 #endif
 
 	do {
+#if INET
+		/*
+		 * TSO packet for an interface that can't segment it?
+		 * Split it up here, so everything above got to handle it
+		 * as a single packet.
+		 */
+		if (!raw && proto_family == PF_INET &&
+		    (m->m_pkthdr.csum_flags & CSUM_TSO_IPV4) &&
+		    !(ifp->if_hwassist & IFNET_TSO_IPV4)) {
+			struct mbuf *last = NULL;
+
+			if ((m = dlil_gso_ipv4(ifp, m, &last)) == NULL) {
+				retval = ENOBUFS;
+				goto next;
+			}
+			last->m_nextpkt = packetlist;
+			packetlist = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+		}
+#endif /* INET */
 #if CONFIG_DTRACE
 		if (!raw && proto_family == PF_INET) {
 			struct ip *ip = mtod(m, struct ip*);
@@ -3832,7 +4595,7 @@ ifnet_lookup(struct ifnet *ifp)
 {
 	struct ifnet *_ifp;
 
-	lck_rw_assert(&ifnet_head_lock, LCK_RW_ASSERT_HELD);
+	lck_brw_assert(ifnet_head_lock, LCK_RW_ASSERT_HELD);
 	TAILQ_FOREACH(_ifp, &ifnet_head, if_link) {
 		if (_ifp == ifp)
 			break;
@@ -4252,7 +5015,7 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	struct if_data_internal if_data_saved;
 	struct dlil_ifnet *dl_if = (struct dlil_ifnet *)ifp;
 	struct dlil_threading_info *dl_inp;
-	u_int32_t sflags = 0;
+	u_int32_t sflags = 0, i;
 	int err;
 
 	if (ifp == NULL)
@@ -4412,6 +5175,43 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	if (if_flowadv)
 		sflags |= PKTSCHEDF_QALG_FLOWCTL;
 
+	/*
+	 * Multi-queue transmit: set up the additional transmit queues
+	 * advertised by the driver, reusing the storage of a previous
+	 * attach; queue 0 is if_snd.
+	 */
+	VERIFY(ifp->if_txq_cnt == 0);
+	if (ifp->if_eflags & IFEF_TXSTART) {
+		u_int32_t txqs = 1;
+
+		if (ifp->if_start_txq != NULL &&
+		    ifp->if_output_sched_model == IFNET_SCHED_MODEL_NORMAL)
+			txqs = MIN(ifp->if_txq_max, if_txq_limit);
+
+		ifp->if_txq_cnt = 1;
+		for (i = 1; i < txqs; i++) {
+			struct ifnet_txq *txq;
+
+			if ((txq = dl_if->dl_if_txqstorage[i - 1]) == NULL) {
+				txq = _MALLOC(sizeof (*txq), M_NKE,
+				    M_WAITOK | M_ZERO);
+				if (txq == NULL)
+					break;
+				lck_mtx_init(&txq->txq_start_lock,
+				    ifnet_snd_lock_group, ifnet_lock_attr);
+				lck_mtx_init(&txq->txq_snd.ifcq_lock,
+				    ifnet_snd_lock_group, ifnet_lock_attr);
+				dl_if->dl_if_txqstorage[i - 1] = txq;
+			}
+			VERIFY(txq->txq_start_thread == THREAD_NULL);
+			VERIFY(IFCQ_IS_EMPTY(&txq->txq_snd));
+			txq->txq_ifp = ifp;
+			txq->txq_index = i;
+			ifp->if_txq[i] = txq;
+			ifp->if_txq_cnt++;
+		}
+	}
+
 	/* Initialize transmit queue(s) */
 	err = ifclassq_setup(ifp, sflags, (dl_if->dl_if_flags & DLIF_REUSE));
 	if (err != 0) {
@@ -4448,15 +5248,49 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	 * input polling.  Pseudo interfaces or other types of interfaces
 	 * use the main input thread instead.
 	 */
+	VERIFY(ifp->if_rxq_cnt == 0);
 	if ((net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL)) ||
 	    ifp->if_type == IFT_ETHER || ifp->if_type == IFT_CELLULAR) {
 		ifp->if_inp = dl_inp;
+		dl_inp->rxq_index = 0;
 		err = dlil_create_input_thread(ifp, ifp->if_inp);
 		if (err != 0) {
 			panic_plain("%s: ifp=%p couldn't get an input thread; "
 			    "err=%d", __func__, ifp, err);
 			/* NOTREACHED */
 		}
+		ifp->if_rxq[0] = dl_inp;
+		ifp->if_rxq_cnt = 1;
+
+		/*
+		 * Receive-side scaling: create the additional input
+		 * threads, reusing the storage of a previous attach.
+		 */
+		for (i = 1; i < if_rxq_threads; i++) {
+			struct dlil_threading_info *rinp;
+
+			if ((rinp = dl_if->dl_if_rxqstorage[i - 1]) == NULL) {
+				rinp = _MALLOC(sizeof (*rinp), M_NKE,
+				    M_WAITOK | M_ZERO);
+				if (rinp == NULL)
+					break;
+				dl_if->dl_if_rxqstorage[i - 1] = rinp;
+			}
+			VERIFY(rinp->ifp == NULL);
+			VERIFY(rinp->input_thr == THREAD_NULL);
+			VERIFY(!rinp->net_affinity);
+			VERIFY(qempty(&rinp->rcvq_pkts));
+			bzero(&rinp->stats, sizeof (rinp->stats));
+			rinp->rxq_index = i;
+			err = dlil_create_input_thread(ifp, rinp);
+			if (err != 0) {
+				panic_plain("%s: ifp=%p couldn't get input "
+				    "thread %d; err=%d", __func__, ifp, i, err);
+				/* NOTREACHED */
+			}
+			ifp->if_rxq[i] = rinp;
+			ifp->if_rxq_cnt++;
+		}
 	}
 
 	/*
@@ -4479,6 +5313,22 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 		}
 		ml_thread_policy(ifp->if_start_thread, MACHINE_GROUP,
 		    (MACHINE_NETWORK_GROUP|MACHINE_NETWORK_WORKLOOP));
+
+		/* One more starter thread per additional transmit queue */
+		for (i = 1; i < ifp->if_txq_cnt; i++) {
+			struct ifnet_txq *txq = ifp->if_txq[i];
+
+			txq->txq_start_active = 0;
+			txq->txq_start_req = 0;
+			if ((err = kernel_thread_start(ifnet_txq_start_thread_fn,
+			    txq, &txq->txq_start_thread)) != KERN_SUCCESS) {
+				panic_plain("%s: ifp=%p couldn't get start "
+				    "thread %d; err=%d", __func__, ifp, i, err);
+				/* NOTREACHED */
+			}
+			ml_thread_policy(txq->txq_start_thread, MACHINE_GROUP,
+			    (MACHINE_NETWORK_GROUP|MACHINE_NETWORK_WORKLOOP));
+		}
 	}
 
 	/*
@@ -5030,6 +5880,23 @@ ifnet_detach_final(struct ifnet *ifp)
 		lck_mtx_unlock(&ifp->if_start_lock);
 	}
 
+	/*
+	 * Signal the starter threads of the additional transmit queues to
+	 * terminate themselves; their storage is kept for reuse.
+	 */
+	while (ifp->if_txq_cnt > 1) {
+		struct ifnet_txq *txq = ifp->if_txq[--ifp->if_txq_cnt];
+
+		ifp->if_txq[ifp->if_txq_cnt] = NULL;
+		VERIFY(txq != NULL && txq->txq_index != 0);
+
+		lck_mtx_lock_spin(&txq->txq_start_lock);
+		txq->txq_start_thread = THREAD_NULL;
+		wakeup_one((caddr_t)&txq->txq_start_thread);
+		lck_mtx_unlock(&txq->txq_start_lock);
+	}
+	ifp->if_txq_cnt = 0;
+
 	/*
 	 * Signal the poller thread to terminate itself.
 	 */
@@ -5040,6 +5907,38 @@ ifnet_detach_final(struct ifnet *ifp)
 		lck_mtx_unlock(&ifp->if_poll_lock);
 	}
 
+	/*
+	 * Terminate the additional (RSS) input threads, if any, after
+	 * tearing down their affinity; queue 0 is if_inp, handled below.
+	 */
+	while (ifp->if_rxq_cnt > 1) {
+		inp = ifp->if_rxq[--ifp->if_rxq_cnt];
+		ifp->if_rxq[ifp->if_rxq_cnt] = NULL;
+		VERIFY(inp != NULL && inp->rxq_index != 0);
+
+		if (inp->net_affinity) {
+			struct thread *tp;
+
+			lck_mtx_lock_spin(&inp->input_lck);
+			tp = inp->input_thr;	/* don't nullify now */
+			inp->tag = 0;
+			inp->net_affinity = FALSE;
+			lck_mtx_unlock(&inp->input_lck);
+
+			(void) dlil_affinity_set(tp, THREAD_AFFINITY_TAG_NULL);
+			thread_deallocate(tp);
+		}
+
+		lck_mtx_lock_spin(&inp->input_lck);
+		inp->input_waiting |= DLIL_INPUT_TERMINATE;
+		if (!(inp->input_waiting & DLIL_INPUT_RUNNING)) {
+			wakeup_one((caddr_t)&inp->input_waiting);
+		}
+		lck_mtx_unlock(&inp->input_lck);
+	}
+	ifp->if_rxq[0] = NULL;
+	ifp->if_rxq_cnt = 0;
+
 	/*
 	 * If thread affinity was set for the workloop thread, we will need
 	 * to tear down the affinity and release the extra reference count
@@ -5098,6 +5997,7 @@ ifnet_detach_final(struct ifnet *ifp)
 	ifp->if_output = ifp_if_output;
 	ifp->if_pre_enqueue = ifp_if_output;
 	ifp->if_start = ifp_if_start;
+	ifp->if_start_txq = ifp_if_start_txq;
 	ifp->if_output_ctl = ifp_if_ctl;
 	ifp->if_input_poll = ifp_if_input_poll;
 	ifp->if_input_ctl = ifp_if_ctl;
@@ -5190,6 +6090,13 @@ ifp_if_start(struct ifnet *ifp)
 	ifnet_purge(ifp);
 }
 
+static void
+ifp_if_start_txq(struct ifnet *ifp, u_int32_t txq)
+{
+#pragma unused(txq)
+	ifnet_purge(ifp);
+}
+
 static void
 ifp_if_input_poll(struct ifnet *ifp, u_int32_t flags, u_int32_t max_cnt,
     struct mbuf **m_head, struct mbuf **m_tail, u_int32_t *cnt, u_int32_t *len)
@@ -5707,6 +6614,48 @@ sysctl_sndq_maxlen SYSCTL_HANDLER_ARGS
 	return (err);
 }
 
+static int
+sysctl_rxq_threads SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int i, err;
+
+	i = if_rxq_threads;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL)
+		return (err);
+
+	if (i < 1)
+		i = 1;
+	else if (i > IFNET_RXQ_MAX)
+		i = IFNET_RXQ_MAX;
+
+	if_rxq_threads = i;
+	return (err);
+}
+
+static int
+sysctl_txq_max SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int i, err;
+
+	i = if_txq_limit;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL)
+		return (err);
+
+	if (i < 1)
+		i = 1;
+	else if (i > IFNET_TXQ_MAX)
+		i = IFNET_TXQ_MAX;
+
+	if_txq_limit = i;
+	return (err);
+}
+
 static int
 sysctl_rcvq_maxlen SYSCTL_HANDLER_ARGS
 {
@@ -5991,8 +6940,14 @@ ifnet_set_throttle(struct ifnet *ifp, u_int32_t level)
 
 	ifq = &ifp->if_snd;
 	IFCQ_LOCK(ifq);
-	if (IFCQ_IS_ENABLED(ifq))
+	if (IFCQ_IS_ENABLED(ifq)) {
 		IFCQ_SET_THROTTLE(ifq, level, err);
+		/* keeps ifnet_txq_select() from bypassing if_snd */
+		if (err == 0 && level == IFNET_THROTTLE_OFF)
+			ifq->ifcq_flags &= ~IFCQF_THROTTLE;
+		else if (err == 0)
+			ifq->ifcq_flags |= IFCQF_THROTTLE;
+	}
 	IFCQ_UNLOCK(ifq);
 
 	if (err == 0) {
@@ -170,6 +170,12 @@ struct dlil_threading_info {
 	struct timespec	sample_holdtime; /* sampling holdtime in nsec */
 	struct timespec	sample_lasttime; /* last sampling time in nsec */
 	struct timespec	dbg_lasttime;	/* last debug message time in nsec */
+	/*
+	 * Receive-side scaling.
+	 */
+	struct pktcntr	rxq_sstats;	/* load on other queues (queue 0) */
+	struct if_rxq_stats rxqstats;	/* per-queue statistics */
+#define	rxq_index	rxqstats.ifi_rxq_index
 #if IFNET_INPUT_SANITY_CHK
 	/*
 	 * For debugging.
@@ -217,6 +223,7 @@ extern errno_t dlil_send_arp_internal(ifnet_t, u_int16_t,
  */
 #define	NET_THREAD_HELD_PF	0x1	/* thread is holding PF lock */
 #define	NET_THREAD_HELD_DOMAIN	0x2     /* thread is holding domain_proto_mtx */
+#define	NET_THREAD_HELD_PF_PERIM 0x4	/* thread is holding pf_perim_lock */
 
 extern errno_t net_thread_check_lock(u_int32_t);
 extern void net_thread_set_lock(u_int32_t);
@@ -153,6 +153,8 @@ static int if_delmulti_common(struct ifmultiaddr *, struct ifnet *,
 
 static int if_rtmtu(struct radix_node *, void *);
 static void if_rtmtu_update(struct ifnet *);
+static void if_qflush_ifq_sc(struct ifclassq *, mbuf_svc_class_t, u_int32_t,
+    u_int32_t *, u_int32_t *, int);
 
 #if IF_CLONE_LIST
 static int	if_clone_list(int count, int * total, user_addr_t dst);
@@ -1276,6 +1278,13 @@ if_updown(
 	IFCQ_LOCK(ifq);
 	ifnet_update_sndq(ifq, up ? CLASSQ_EV_LINK_UP : CLASSQ_EV_LINK_DOWN);
 	IFCQ_UNLOCK(ifq);
+	for (i = 1; i < (int)ifp->if_txq_cnt; i++) {
+		ifq = &ifp->if_txq[i]->txq_snd;
+		IFCQ_LOCK(ifq);
+		ifnet_update_sndq(ifq,
+		    up ? CLASSQ_EV_LINK_UP : CLASSQ_EV_LINK_DOWN);
+		IFCQ_UNLOCK(ifq);
+	}
 
 	/* Aquire the lock to clear the changing flag */
 	ifnet_lock_exclusive(ifp);
@@ -1310,13 +1319,25 @@ if_up(
 }
 
 /*
- * Flush an interface queue.
+ * Flush all transmit queues of an interface; ifq_locked applies to
+ * the primary one (if_snd).
  */
 void
 if_qflush(struct ifnet *ifp, int ifq_locked)
 {
-	struct ifclassq *ifq = &ifp->if_snd;
+	u_int32_t i;
 
+	if_qflush_ifq(&ifp->if_snd, ifq_locked);
+	for (i = 1; i < ifp->if_txq_cnt; i++)
+		if_qflush_ifq(&ifp->if_txq[i]->txq_snd, 0);
+}
+
+/*
+ * Flush a single interface queue.
+ */
+void
+if_qflush_ifq(struct ifclassq *ifq, int ifq_locked)
+{
 	if (!ifq_locked)
 		IFCQ_LOCK(ifq);
 
@@ -1339,7 +1360,28 @@ void
 if_qflush_sc(struct ifnet *ifp, mbuf_svc_class_t sc, u_int32_t flow,
     u_int32_t *packets, u_int32_t *bytes, int ifq_locked)
 {
-	struct ifclassq *ifq = &ifp->if_snd;
+	u_int32_t cnt = 0, len = 0, t_cnt, t_len, i;
+
+	if_qflush_ifq_sc(&ifp->if_snd, sc, flow, &cnt, &len, ifq_locked);
+
+	/* The flow may have been spread across the other transmit queues */
+	for (i = 1; i < ifp->if_txq_cnt; i++) {
+		if_qflush_ifq_sc(&ifp->if_txq[i]->txq_snd, sc, flow,
+		    &t_cnt, &t_len, 0);
+		cnt += t_cnt;
+		len += t_len;
+	}
+
+	if (packets != NULL)
+		*packets = cnt;
+	if (bytes != NULL)
+		*bytes = len;
+}
+
+static void
+if_qflush_ifq_sc(struct ifclassq *ifq, mbuf_svc_class_t sc, u_int32_t flow,
+    u_int32_t *packets, u_int32_t *bytes, int ifq_locked)
+{
 	u_int32_t cnt = 0, len = 0;
 	u_int32_t a_cnt = 0, a_len = 0;
 
@@ -3552,6 +3594,31 @@ if_copy_rxpoll_stats(struct ifnet *ifp, struct if_rxpoll_stats *if_rs)
 	ifnet_decr_iorefcnt(ifp);
 }
 
+u_int32_t
+if_copy_rxq_stats(struct ifnet *ifp, struct if_rxq_stats *if_rq, u_int32_t cnt)
+{
+	struct dlil_threading_info *inp;
+	u_int32_t i;
+
+	if (!ifnet_is_attached(ifp, 1))
+		return (0);
+
+	/* by now, ifnet will stay attached so if_rxq[] must be valid */
+	for (i = 0; i < ifp->if_rxq_cnt && i < cnt; i++) {
+		inp = ifp->if_rxq[i];
+		VERIFY(inp != NULL);
+		lck_mtx_lock_spin(&inp->input_lck);
+		bcopy(&inp->rxqstats, &if_rq[i], sizeof (*if_rq));
+		if_rq[i].ifi_rxq_qlen = qlen(&inp->rcvq_pkts);
+		lck_mtx_unlock(&inp->input_lck);
+	}
+
+	/* Release the IO refcnt */
+	ifnet_decr_iorefcnt(ifp);
+
+	return (i);
+}
+
 struct ifaddr *
 ifa_remref(struct ifaddr *ifa, int locked)
 {
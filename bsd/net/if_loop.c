@@ -140,6 +140,7 @@ struct lo_statics_str {
 
 static struct lo_statics_str lo_statics[NLOOP];
 static int lo_txstart = 0;
+static u_int32_t lo_txqs = 1;	/* # of transmit queues, if lo_txstart */
 
 struct ifnet *lo_ifp = NULL;
 
@@ -166,6 +167,7 @@ static errno_t lo_del_proto(struct ifnet *, protocol_family_t);
 static int lo_output(struct ifnet *, struct mbuf *);
 static errno_t lo_pre_enqueue(struct ifnet *, struct mbuf *);
 static void lo_start(struct ifnet *);
+static void lo_start_txq(struct ifnet *, u_int32_t);
 static errno_t lo_pre_output(struct ifnet *, protocol_family_t, struct mbuf **,
     const struct sockaddr *, void *, char *, char *);
 static errno_t lo_input(struct ifnet *, protocol_family_t, struct mbuf *);
@@ -377,6 +379,17 @@ lo_pre_enqueue(struct ifnet *ifp, struct mbuf *m0)
  */
 static void
 lo_start(struct ifnet *ifp)
+{
+	lo_start_txq(ifp, 0);
+}
+
+/*
+ * Per-queue start output callback, used when lo_txqs is greater than 1;
+ * each transmit queue has its own worker thread, so this may run
+ * concurrently for different queues, but is single threaded for each.
+ */
+static void
+lo_start_txq(struct ifnet *ifp, u_int32_t txq)
 {
 	struct ifnet_stat_increment_param s;
 
@@ -389,8 +402,8 @@ lo_start(struct ifnet *ifp)
 		struct timespec ts;
 
 		if (lo_sched_model == IFNET_SCHED_MODEL_NORMAL) {
-			if (ifnet_dequeue_multi(ifp, lo_dequeue_max, &m,
-			    &m_tail, &cnt, &len) != 0)
+			if (ifnet_dequeue_txq_multi(ifp, txq, lo_dequeue_max,
+			    &m, &m_tail, &cnt, &len) != 0)
 				break;
 		} else {
 			if (ifnet_dequeue_service_class_multi(ifp,
@@ -627,6 +640,7 @@ loopattach(void)
 	errno_t	result = 0;
 
 	PE_parse_boot_argn("lo_txstart", &lo_txstart, sizeof (lo_txstart));
+	PE_parse_boot_argn("lo_txqs", &lo_txqs, sizeof (lo_txqs));
 
 	lo_reg_if_mods();
 
@@ -675,6 +689,14 @@ loopattach(void)
 	ifnet_set_hdrlen(lo_ifp, sizeof (struct loopback_header));
 	ifnet_set_eflags(lo_ifp, IFEF_SENDLIST, IFEF_SENDLIST);
 
+	if (lo_txstart && lo_txqs > 1 &&
+	    (result = ifnet_set_tx_queues(lo_ifp, lo_txqs,
+	    lo_start_txq)) != 0) {
+		printf("%s: couldn't set %u transmit queues (%d)\n",
+		    __func__, lo_txqs, result);
+		result = 0;
+	}
+
 #if CONFIG_MACF_NET
 	mac_ifnet_label_init(ifp);
 #endif
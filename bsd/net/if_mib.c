@@ -193,6 +193,23 @@ make_ifmibdata(struct ifnet *ifp, int *name, struct sysctl_req *req)
 		_FREE(ifmd_supp, M_TEMP);
 		break;
 	}
+
+	case IFDATA_RXQUEUES: {
+		struct if_rxq_stats *ifmd_rxq;
+		u_int32_t cnt;
+
+		if ((ifmd_rxq = _MALLOC(sizeof (*ifmd_rxq) * IFNET_RXQ_MAX,
+		    M_TEMP, M_NOWAIT | M_ZERO)) == NULL) {
+			error = ENOMEM;
+			break;
+		}
+
+		cnt = if_copy_rxq_stats(ifp, ifmd_rxq, IFNET_RXQ_MAX);
+
+		error = SYSCTL_OUT(req, ifmd_rxq, sizeof (*ifmd_rxq) * cnt);
+		_FREE(ifmd_rxq, M_TEMP);
+		break;
+	}
 	}
 
 	return error;
@@ -96,6 +96,7 @@ struct ifmibdata_supplemental {
 #define	IFDATA_MULTIADDRS	4	/* multicast addresses assigned to interface */
 #ifdef PRIVATE
 #define IFDATA_SUPPLEMENTAL	5	/* supplemental link specific stats */
+#define IFDATA_RXQUEUES		6	/* per receive queue (RSS) stats */
 #endif /* PRIVATE */
 
 /*
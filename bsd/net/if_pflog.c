@@ -190,12 +190,12 @@ pflog_clone_create(struct if_clone *ifc, u_int32_t unit, __unused void *params)
 	bpfattach(pflogif->sc_if, DLT_PFLOG, PFLOG_HDRLEN);
 #endif
 
-	lck_rw_lock_shared(pf_perim_lock);
+	lck_brw_lock_shared(pf_perim_lock);
 	lck_mtx_lock(pf_lock);
 	LIST_INSERT_HEAD(&pflogif_list, pflogif, sc_list);
 	pflogifs[unit] = pflogif->sc_if;
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_unlock_shared(pf_perim_lock);
 
 done:
 	return (error);
@@ -206,12 +206,12 @@ pflog_clone_destroy(struct ifnet *ifp)
 {
 	struct pflog_softc *pflogif = ifp->if_softc;
 
-	lck_rw_lock_shared(pf_perim_lock);
+	lck_brw_lock_shared(pf_perim_lock);
 	lck_mtx_lock(pf_lock);
 	pflogifs[pflogif->sc_unit] = NULL;
 	LIST_REMOVE(pflogif, sc_list);
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_unlock_shared(pf_perim_lock);
 
 	/* bpfdetach() is taken care of as part of interface detach */
 	(void) ifnet_detach(ifp);
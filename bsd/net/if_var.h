@@ -313,6 +313,21 @@ struct if_rxpoll_stats {
 	u_int32_t	ifi_poll_bytes_lowat;	/* bytes low watermark */
 	u_int32_t	ifi_poll_bytes_hiwat;	/* bytes high watermark */
 };
+
+/*
+ * Per receive queue statistics; one entry for each DLIL input thread
+ * an interface fans its inbound traffic out to (see IFDATA_RXQUEUES.)
+ */
+struct if_rxq_stats {
+	u_int32_t	ifi_rxq_index;		/* receive queue index */
+	u_int32_t	ifi_rxq_tag;		/* affinity tag of its thread */
+	u_int64_t	ifi_rxq_packets;	/* total # of enqueued packets */
+	u_int64_t	ifi_rxq_bytes;		/* total # of enqueued bytes */
+	u_int64_t	ifi_rxq_wakeups;	/* total # of thread wakeups */
+	u_int64_t	ifi_rxq_batches;	/* total # of dequeued batches */
+	u_int32_t	ifi_rxq_qlen;		/* current queue length */
+	u_int32_t	ifi_rxq_maxqlen;	/* largest queue length seen */
+};
 #endif /* PRIVATE */
 
 #pragma pack()
@@ -494,6 +509,23 @@ TAILQ_HEAD(ddesc_head_name, dlil_demux_desc);
 
 RB_HEAD(ll_reach_tree, if_llreach);	/* define struct ll_reach_tree */
 
+#define	IFNET_RXQ_MAX	8	/* max # of DLIL input threads per ifnet */
+#define	IFNET_TXQ_MAX	8	/* max # of transmit queues per ifnet */
+
+/*
+ * Additional transmit queue; the primary one (index 0) is if_snd and
+ * is serviced by the if_start_* state in the ifnet itself.
+ */
+struct ifnet_txq {
+	struct ifclassq		txq_snd;	/* transmit queue */
+	decl_lck_mtx_data(, txq_start_lock);
+	u_int32_t		txq_start_req;
+	u_int32_t		txq_start_active; /* output is active */
+	struct thread		*txq_start_thread;
+	struct ifnet		*txq_ifp;	/* back pointer to ifnet */
+	u_int32_t		txq_index;	/* index into if_txq[] */
+};
+
 /*
  * Structure defining a network interface.
  *
@@ -564,6 +596,12 @@ struct ifnet {
 	struct ifclassq		if_snd;		/* transmit queue */
 	u_int32_t		if_output_sched_model;	/* tx sched model */
 
+	/* multi-queue transmit; if_txq[0] is unused (if_snd) */
+	struct ifnet_txq	*if_txq[IFNET_TXQ_MAX];
+	u_int32_t		if_txq_cnt;	/* # of active transmit queues */
+	u_int32_t		if_txq_max;	/* # advertised by the driver */
+	ifnet_start_txq_func	if_start_txq;	/* per-queue start routine */
+
 	struct if_bandwidths	if_output_bw;
 	struct if_bandwidths	if_input_bw;
 
@@ -586,6 +624,9 @@ struct ifnet {
 	struct thread		*if_poll_thread;
 
 	struct dlil_threading_info *if_inp;
+	/* receive-side scaling; if_rxq[0] is if_inp when if_rxq_cnt > 0 */
+	struct dlil_threading_info *if_rxq[IFNET_RXQ_MAX];
+	u_int32_t		if_rxq_cnt;	/* # of DLIL input threads */
 
 	struct	ifprefixhead	if_prefixhead;	/* list of prefixes per if */
 	struct {
@@ -885,6 +926,7 @@ __private_extern__ struct ifnethead ifnet_head;
 __private_extern__ struct ifnet **ifindex2ifnet;
 __private_extern__ u_int32_t if_sndq_maxlen;
 __private_extern__ u_int32_t if_rcvq_maxlen;
+__private_extern__ u_int32_t if_gso;
 __private_extern__ int if_index;
 __private_extern__ struct ifaddr **ifnet_addrs;
 __private_extern__ lck_attr_t *ifa_mtx_attr;
@@ -895,6 +937,13 @@ extern ifnet_t lo_ifp;
 extern uint32_t if_bw_measure_size;
 extern u_int32_t if_bw_smoothing_val;
 
+/*
+ * IPv4 TSO packets can be handed to the interface: it either segments
+ * them itself or dlil_output() does it in software.
+ */
+#define	IF_TSO_IPV4_CAPABLE(ifp) \
+	(((ifp)->if_hwassist & IFNET_TSO_IPV4) || if_gso)
+
 extern int if_addmulti(struct ifnet *, const struct sockaddr *,
     struct ifmultiaddr **);
 extern int if_addmulti_anon(struct ifnet *, const struct sockaddr *,
@@ -912,6 +961,7 @@ extern int ifioctllocked(struct socket *, u_long, caddr_t, struct proc *);
 extern struct ifnet *ifunit(const char *);
 extern struct ifnet *if_withname(struct sockaddr *);
 extern void if_qflush(struct ifnet *, int);
+extern void if_qflush_ifq(struct ifclassq *, int);
 extern void if_qflush_sc(struct ifnet *, mbuf_svc_class_t, u_int32_t,
     u_int32_t *, u_int32_t *, int);
 
@@ -1012,6 +1062,8 @@ __private_extern__ void if_copy_packet_stats(struct ifnet *ifp,
     struct if_packet_stats *if_ps);
 __private_extern__ void if_copy_rxpoll_stats(struct ifnet *ifp,
     struct if_rxpoll_stats *if_rs);
+__private_extern__ u_int32_t if_copy_rxq_stats(struct ifnet *ifp,
+    struct if_rxq_stats *if_rq, u_int32_t cnt);
 
 __private_extern__ struct rtentry *ifnet_cached_rtlookup_inet(struct ifnet *,
     struct in_addr);
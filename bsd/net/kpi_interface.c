@@ -205,6 +205,8 @@ ifnet_allocate_extended(const struct ifnet_init_eparams *einit0,
 		ifp->if_output		= einit.output;
 		ifp->if_pre_enqueue	= einit.pre_enqueue;
 		ifp->if_start		= einit.start;
+		ifp->if_start_txq	= NULL;
+		ifp->if_txq_max		= 1;
 		ifp->if_output_ctl	= einit.output_ctl;
 		ifp->if_output_sched_model = einit.output_sched_model;
 		ifp->if_output_bw.eff_bw = einit.output_bw;
@@ -1043,8 +1045,18 @@ ifnet_set_output_bandwidths(struct ifnet *ifp, struct if_bandwidths *bw,
 
 	/* Adjust queue parameters if needed */
 	if (old_bw.eff_bw != ifp->if_output_bw.eff_bw ||
-	    old_bw.max_bw != ifp->if_output_bw.max_bw)
+	    old_bw.max_bw != ifp->if_output_bw.max_bw) {
+		u_int32_t i;
+
 		ifnet_update_sndq(ifq, CLASSQ_EV_LINK_SPEED);
+		for (i = 1; i < ifp->if_txq_cnt; i++) {
+			struct ifclassq *txq = &ifp->if_txq[i]->txq_snd;
+
+			IFCQ_LOCK(txq);
+			ifnet_update_sndq(txq, CLASSQ_EV_LINK_SPEED);
+			IFCQ_UNLOCK(txq);
+		}
+	}
 
 	if (!locked)
 		IFCQ_UNLOCK(ifq);
@@ -1052,6 +1064,38 @@ ifnet_set_output_bandwidths(struct ifnet *ifp, struct if_bandwidths *bw,
 	return (0);
 }
 
+errno_t
+ifnet_set_tx_queues(ifnet_t ifp, u_int32_t count, ifnet_start_txq_func start)
+{
+	if (ifp == NULL || count < 1 || count > IFNET_TXQ_MAX)
+		return (EINVAL);
+	else if (!(ifp->if_eflags & IFEF_TXSTART))
+		return (ENXIO);
+	else if (ifp->if_output_sched_model != IFNET_SCHED_MODEL_NORMAL)
+		return (ENOTSUP);
+	else if (ifnet_is_attached(ifp, 0))
+		return (EBUSY);
+
+	ifp->if_start_txq = start;
+	ifp->if_txq_max = (start != NULL) ? count : 1;
+
+	return (0);
+}
+
+errno_t
+ifnet_get_tx_queues(ifnet_t ifp, u_int32_t *count)
+{
+	if (ifp == NULL || count == NULL)
+		return (EINVAL);
+	else if (!(ifp->if_eflags & IFEF_TXSTART))
+		return (ENXIO);
+
+	/* before attach, report what the driver asked for */
+	*count = (ifp->if_txq_cnt != 0) ? ifp->if_txq_cnt : ifp->if_txq_max;
+
+	return (0);
+}
+
 errno_t
 ifnet_set_input_bandwidths(struct ifnet *ifp, struct if_bandwidths *bw)
 {
@@ -685,6 +685,22 @@ typedef errno_t (*ifnet_pre_enqueue_func)(ifnet_t interface, mbuf_t data);
  */
 typedef void (*ifnet_start_func)(ifnet_t interface);
 
+/*
+	@typedef ifnet_start_txq_func
+	@discussion ifnet_start_txq_func is the per-queue counterpart of
+		ifnet_start_func, used by drivers which advertise more than
+		one transmit queue via ifnet_set_tx_queues().  Each transmit
+		queue is serviced by its own dedicated kernel thread, hence
+		the callback is single threaded with respect to a given
+		queue, but may run concurrently for different queues.  The
+		driver should call ifnet_dequeue_txq() or
+		ifnet_dequeue_txq_multi() to retrieve the packets of the
+		queue being serviced.
+	@param interface The interface being sent on.
+	@param txq The index of the transmit queue to be serviced.
+ */
+typedef void (*ifnet_start_txq_func)(ifnet_t interface, u_int32_t txq);
+
 /*
 	@typedef ifnet_input_poll_func
 	@discussion ifnet_input_poll_func is called by the network stack to
@@ -1137,6 +1153,86 @@ extern errno_t ifnet_dequeue_service_class_multi(ifnet_t interface,
     mbuf_svc_class_t tc, u_int32_t max, mbuf_t *first_packet,
     mbuf_t *last_packet, u_int32_t *cnt, u_int32_t *len);
 
+/*
+	@function ifnet_set_tx_queues
+	@discussion Advertise the number of hardware transmit queues of an
+		interface which implements the new driver output model, along
+		with the routine used to service each of them.  Outgoing
+		packets are spread across the queues by flow hash (or by CPU,
+		depending on the system policy), and each queue gets its own
+		instance of the output scheduler.  Queue 0 is the interface's
+		primary output queue, and is the only one subject to the
+		token bucket regulator.  This call must be issued after
+		ifnet_allocate_extended and before ifnet_attach; the actual
+		number of queues used may be smaller than requested.
+	@param interface The interface to set the transmit queues on.
+	@param count The number of transmit queues, between 1 and
+		IFNET_TXQ_MAX (8).
+	@param start The per-queue start routine; if NULL, a single queue
+		serviced by the ifnet_start_func callback is used.
+	@result May return EINVAL if the parameters are invalid, ENXIO if
+		the interface doesn't implement the new driver output model,
+		ENOTSUP if the output scheduling model isn't
+		IFNET_SCHED_MODEL_NORMAL, or EBUSY if the interface is
+		already attached.
+ */
+extern errno_t ifnet_set_tx_queues(ifnet_t interface, u_int32_t count,
+    ifnet_start_txq_func start);
+
+/*
+	@function ifnet_get_tx_queues
+	@discussion Get the number of transmit queues in use by an
+		interface which implements the new driver output model.
+	@param interface The interface to get the transmit queues of.
+	@param count Pointer to a storage for the number of queues.
+	@result May return EINVAL if the parameters are invalid or ENXIO if
+		the interface doesn't implement the new driver output model.
+ */
+extern errno_t ifnet_get_tx_queues(ifnet_t interface, u_int32_t *count);
+
+/*
+	@function ifnet_dequeue_txq
+	@discussion Dequeue a packet from a given transmit queue of an
+		interface which advertised multiple transmit queues via
+		ifnet_set_tx_queues().
+	@param interface The interface to dequeue the packet from.
+	@param txq The index of the transmit queue.
+	@param packet Pointer to the packet being dequeued.
+	@result May return EINVAL if the parameters are invalid, ENXIO if
+		the interface doesn't implement the new driver output model
+		or the output scheduling model isn't IFNET_SCHED_MODEL_NORMAL,
+		or EAGAIN if there is currently no packet available to
+		be dequeued.
+ */
+extern errno_t ifnet_dequeue_txq(ifnet_t interface, u_int32_t txq,
+    mbuf_t *packet);
+
+/*
+	@function ifnet_dequeue_txq_multi
+	@discussion Dequeue one or more packets from a given transmit queue
+		of an interface which advertised multiple transmit queues via
+		ifnet_set_tx_queues().  The returned packet chain is
+		traversable with mbuf_nextpkt().
+	@param interface The interface to dequeue the packets from.
+	@param txq The index of the transmit queue.
+	@param first_packet Pointer to the first packet being dequeued.
+	@param last_packet Pointer to the last packet being dequeued.  Caller
+		may supply NULL if not interested in value.
+	@param cnt Pointer to a storage for the number of packets dequeued.
+		Caller may supply NULL if not interested in value.
+	@param len Pointer to a storage for the total length (in bytes)
+		of the dequeued packets.  Caller may supply NULL if not
+		interested in value.
+	@result May return EINVAL if the parameters are invalid, ENXIO if
+		the interface doesn't implement the new driver output model
+		or the output scheduling model isn't IFNET_SCHED_MODEL_NORMAL,
+		or EAGAIN if there is currently no packet available to
+		be dequeued.
+ */
+extern errno_t ifnet_dequeue_txq_multi(ifnet_t interface, u_int32_t txq,
+    u_int32_t max, mbuf_t *first_packet, mbuf_t *last_packet,
+    u_int32_t *cnt, u_int32_t *len);
+
 /*
 	@function ifnet_set_output_sched_model
 	@discussion Set the output scheduling model of an interface which
@@ -76,12 +76,17 @@
 #include <sys/proc.h>
 #include <sys/random.h>
 #include <sys/mcache.h>
+#include <sys/sysctl.h>
 
 #include <libkern/crypto/md5.h>
 #include <libkern/libkern.h>
+#include <libkern/OSAtomic.h>
 
 #include <mach/thread_act.h>
 
+#include <kern/cpu_number.h>
+#include <machine/machine_routines.h>
+
 #include <net/if.h>
 #include <net/if_types.h>
 #include <net/bpf.h>
@@ -142,13 +147,166 @@
  * Global variables
  */
 decl_lck_mtx_data(,pf_lock_data);
-decl_lck_rw_data(,pf_perim_lock_data);
 lck_mtx_t *pf_lock = &pf_lock_data;
-lck_rw_t *pf_perim_lock = &pf_perim_lock_data;
+lck_brw_t *pf_perim_lock;
+
+/*
+ * State tables.
+ *
+ * The lan_ext and ext_gwy trees are split into shards, each with its own
+ * lock.  A key is hashed on the parts of its external end that the tree
+ * comparators always look at; that is the only part known to both an
+ * outbound (lan_ext) and an inbound (ext_gwy) lookup, so a state key sits
+ * in the same shard in both trees.  Endpoint-independent UDP keys ignore
+ * the external address altogether and share a shard of their own.
+ *
+ * Inserting or removing keys takes pf_lock and then the shard lock, so
+ * code running under pf_lock may search the trees without the latter.
+ * pf_test_fast() handles packets of established TCP and UDP states under
+ * the shard lock alone; pf_test_state_tcp() and pf_test_state_udp() hold
+ * it as well while they update a state.  The shard owner is recorded so
+ * that pf re-entered from the output path (pf_send_tcp, pf_route) does
+ * not deadlock against itself on the shard of the state being processed.
+ */
+#define	PF_STATE_SHARD_SHIFT	6
+#define	PF_STATE_SHARDS		(1 << PF_STATE_SHARD_SHIFT)
+#define	PF_STATE_SHARD_EI	PF_STATE_SHARDS
+
+struct pf_state_shard {
+	decl_lck_mtx_data(, pss_lock);
+	thread_t			 pss_owner;
+	struct pf_state_tree_lan_ext	 pss_lan_ext;
+	struct pf_state_tree_ext_gwy	 pss_ext_gwy;
+} __attribute__((aligned(CPU_CACHE_SIZE)));
+
+static struct pf_state_shard	 pf_state_shards[PF_STATE_SHARDS + 1];
+
+/*
+ * Fast path switch and statistics; see pf_test_fast().  The statistics
+ * are kept per processor, without atomics, so they are approximate.
+ */
+struct pf_fastpath_stats {
+	u_int64_t	hits;		/* packets handled without pf_lock */
+	u_int64_t	misses;		/* no state; went through the rules */
+	u_int64_t	ineligible;	/* state needs the slow path */
+	u_int64_t	bypass;		/* scrub/dummynet/fragment/options */
+};
+
+static struct pf_fastpath_pcpu {
+	struct pf_fastpath_stats	 stats;
+} __attribute__((aligned(CPU_CACHE_SIZE))) *pf_fastpath_pcpu;
+static unsigned int		 pf_fastpath_ncpu;
+static int			 pf_fastpath = 1;
+
+#define	PF_FASTPATH_STAT(f)	\
+	(pf_fastpath_pcpu[cpu_number() % pf_fastpath_ncpu].stats.f++)
 
-/* state tables */
-struct pf_state_tree_lan_ext	 pf_statetbl_lan_ext;
-struct pf_state_tree_ext_gwy	 pf_statetbl_ext_gwy;
+static int sysctl_pf_fastpath_stats SYSCTL_HANDLER_ARGS;
+
+SYSCTL_NODE(_net, OID_AUTO, pf, CTLFLAG_RW|CTLFLAG_LOCKED, 0, "pf");
+SYSCTL_INT(_net_pf, OID_AUTO, fastpath, CTLFLAG_RW|CTLFLAG_LOCKED,
+    &pf_fastpath, 0, "Handle established flows without pf_lock");
+SYSCTL_PROC(_net_pf, OID_AUTO, fastpath_stats, CTLTYPE_STRUCT|CTLFLAG_RD|
+    CTLFLAG_LOCKED, 0, 0, sysctl_pf_fastpath_stats, "S,pf_fastpath_stats",
+    "Fast path statistics");
+
+#define	PF_COUNTER_ADD(c, n)	\
+	OSAddAtomic64((SInt64)(n), (volatile SInt64 *)&(c))
+
+static __inline struct pf_state_shard *
+pf_state_key_shard(struct pf_state_key_cmp *key)
+{
+	u_int32_t h;
+
+	if (key->proto == IPPROTO_UDP &&
+	    key->proto_variant >= PF_EXTFILTER_EI)
+		return (&pf_state_shards[PF_STATE_SHARD_EI]);
+
+	h = key->ext.addr.addr32[0];
+#if INET6
+	if (key->af == AF_INET6)
+		h ^= key->ext.addr.addr32[1] ^ key->ext.addr.addr32[2] ^
+		    key->ext.addr.addr32[3];
+#endif /* INET6 */
+	if (key->proto == IPPROTO_TCP || (key->proto == IPPROTO_UDP &&
+	    key->proto_variant < PF_EXTFILTER_AD))
+		h ^= (u_int32_t)key->ext.xport.port << 16;
+	h ^= key->proto;
+	h *= 0x9e3779b1;	/* golden ratio; the top bits are well mixed */
+
+	return (&pf_state_shards[h >> (32 - PF_STATE_SHARD_SHIFT)]);
+}
+
+/*
+ * Returns nonzero if the lock was taken here, zero if the calling thread
+ * already held it; only in the former case must it be unlocked.
+ */
+static __inline int
+pf_state_shard_lock(struct pf_state_shard *pss)
+{
+	if (pss->pss_owner == current_thread())
+		return (0);
+
+	lck_mtx_lock(&pss->pss_lock);
+	pss->pss_owner = current_thread();
+	return (1);
+}
+
+static __inline void
+pf_state_shard_unlock(struct pf_state_shard *pss)
+{
+	VERIFY(pss->pss_owner == current_thread());
+	pss->pss_owner = NULL;
+	lck_mtx_unlock(&pss->pss_lock);
+}
+
+/*
+ * Drop the shard lock taken by pf_find_state_locked() on behalf of pd.
+ */
+static __inline void
+pf_state_shard_release(struct pf_pdesc *pd)
+{
+	if (pd->pss != NULL) {
+		pf_state_shard_unlock(pd->pss);
+		pd->pss = NULL;
+	}
+}
+
+static int
+sysctl_pf_fastpath_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct pf_fastpath_stats st;
+	unsigned int i;
+
+	bzero(&st, sizeof (st));
+	for (i = 0; i < pf_fastpath_ncpu; i++) {
+		st.hits += pf_fastpath_pcpu[i].stats.hits;
+		st.misses += pf_fastpath_pcpu[i].stats.misses;
+		st.ineligible += pf_fastpath_pcpu[i].stats.ineligible;
+		st.bypass += pf_fastpath_pcpu[i].stats.bypass;
+	}
+
+	return (SYSCTL_OUT(req, &st, sizeof (st)));
+}
+
+void
+pf_state_shard_init(lck_grp_t *grp, lck_attr_t *attr)
+{
+	int i;
+
+	for (i = 0; i <= PF_STATE_SHARDS; i++) {
+		lck_mtx_init(&pf_state_shards[i].pss_lock, grp, attr);
+		RB_INIT(&pf_state_shards[i].pss_lan_ext);
+		RB_INIT(&pf_state_shards[i].pss_ext_gwy);
+	}
+
+	pf_fastpath_ncpu = ml_get_max_cpus();
+	pf_fastpath_pcpu = _MALLOC(pf_fastpath_ncpu *
+	    sizeof (*pf_fastpath_pcpu), M_TEMP, M_WAITOK | M_ZERO);
+	if (pf_fastpath_pcpu == NULL)
+		panic("%s: no memory for fast path statistics", __func__);
+}
 
 struct pf_palist	 pf_pabuf;
 struct pf_status	 pf_status;
@@ -301,6 +459,12 @@ static int		 pf_addr_wrap_neq(struct pf_addr_wrap *,
 			    struct pf_addr_wrap *);
 static struct pf_state	*pf_find_state(struct pfi_kif *,
 			    struct pf_state_key_cmp *, u_int);
+static struct pf_state	*pf_find_state_locked(struct pfi_kif *,
+			    struct pf_state_key_cmp *, u_int,
+			    struct pf_pdesc *);
+static int		 pf_state_fastpath_ok(struct pf_state *,
+			    struct pf_pdesc *);
+static int		 pf_unlink_expired_state(struct pf_state *);
 static int		 pf_src_connlimit(struct pf_state **);
 static void		 pf_stateins_err(const char *, struct pf_state *,
 			    struct pfi_kif *);
@@ -406,6 +570,34 @@ pf_state_lookup_aux(struct pf_state **state, struct pfi_kif *kif,
 			return (action);				 \
 	} while (0)
 
+/*
+ * Hand a state pf_test_fast() cannot update under its shard lock alone
+ * back to the slow path, before anything has been changed.
+ */
+#define	STATE_FASTPATH_CHECK()						 \
+	do {								 \
+		if (*state != NULL && (pd->flags & PFDESC_FASTPATH) &&	 \
+		    !pf_state_fastpath_ok(*state, pd)) {		 \
+			pd->flags |= PFDESC_SLOWPATH;			 \
+			return (PF_DROP);				 \
+		}							 \
+	} while (0)
+
+/*
+ * STATE_LOOKUP() for TCP and UDP, whose states are updated with their
+ * shard held (see pf_find_state_locked()).
+ */
+#define STATE_LOOKUP_LOCKED()						 \
+	do {								 \
+		int action;						 \
+		*state = pf_find_state_locked(kif, &key, direction, pd); \
+		STATE_FASTPATH_CHECK();					 \
+		if (*state != NULL && pd->flowhash == 0)		 \
+			pd->flowhash = (*state)->state_key->flowhash;	 \
+		if (pf_state_lookup_aux(state, kif, direction, &action)) \
+			return (action);				 \
+	} while (0)
+
 #define	STATE_ADDR_TRANSLATE(sk)					\
 	(sk)->lan.addr.addr32[0] != (sk)->gwy.addr.addr32[0] ||		\
 	((sk)->af == AF_INET6 &&					\
@@ -1106,21 +1298,25 @@ pf_find_state_byid(struct pf_state_cmp *key)
 	    (struct pf_state *)(void *)key));
 }
 
+/*
+ * The caller holds either pf_lock or the shard lock for key.
+ */
 static struct pf_state *
 pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 {
+	struct pf_state_shard	*pss = pf_state_key_shard(key);
 	struct pf_state_key	*sk = NULL;
 	struct pf_state		*s;
 
-	pf_status.fcounters[FCNT_STATE_SEARCH]++;
+	PF_COUNTER_ADD(pf_status.fcounters[FCNT_STATE_SEARCH], 1);
 
 	switch (dir) {
 	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
+		sk = RB_FIND(pf_state_tree_lan_ext, &pss->pss_lan_ext,
 		    (struct pf_state_key *)key);
 		break;
 	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy,
+		sk = RB_FIND(pf_state_tree_ext_gwy, &pss->pss_ext_gwy,
 		    (struct pf_state_key *)key);
 		break;
 	default:
@@ -1136,22 +1332,79 @@ pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 	return (NULL);
 }
 
+/*
+ * Look up a TCP or UDP state with the shard for key locked.  The lock is
+ * recorded in pd and stays held, found or not, until the caller drops it
+ * with pf_state_shard_release(); a further lookup in another shard (UDP
+ * tries several) releases it first.  Only pd->pss is ever unlocked, so a
+ * shard already held by this thread further up the stack is left alone.
+ */
+static struct pf_state *
+pf_find_state_locked(struct pfi_kif *kif, struct pf_state_key_cmp *key,
+    u_int dir, struct pf_pdesc *pd)
+{
+	struct pf_state_shard	*pss = pf_state_key_shard(key);
+
+	if (pd->pss != pss) {
+		pf_state_shard_release(pd);
+		if (pf_state_shard_lock(pss))
+			pd->pss = pss;
+	}
+
+	return (pf_find_state(kif, key, dir));
+}
+
+/*
+ * Whether pf_test_fast() may handle a packet for s: the state must not be
+ * logged, scrubbed, routed, counted in tables, watched by an application
+ * level gateway or about to be purged, and TCP must be past its handshake
+ * (no syn proxy, no connection limits) and not see a SYN (state reuse).
+ * Every other path through pf_test_state_tcp() and pf_test_state_udp()
+ * then only touches the state, its key's external end and the packet.
+ */
+static int
+pf_state_fastpath_ok(struct pf_state *s, struct pf_pdesc *pd)
+{
+	struct pf_rule	*r = s->rule.ptr, *nr = s->nat_rule.ptr;
+
+	if (s->log || s->timeout >= PFTM_MAX ||
+	    s->state_key->app_state != NULL ||
+	    s->src.scrub != NULL || s->dst.scrub != NULL)
+		return (0);
+	if (r->rt || r->log || r->src.addr.type == PF_ADDR_TABLE ||
+	    r->dst.addr.type == PF_ADDR_TABLE)
+		return (0);
+	if (nr != NULL && (nr->log || nr->src.addr.type == PF_ADDR_TABLE ||
+	    nr->dst.addr.type == PF_ADDR_TABLE))
+		return (0);
+	if (pd->proto == IPPROTO_TCP &&
+	    (s->src.state < TCPS_ESTABLISHED ||
+	    s->dst.state < TCPS_ESTABLISHED ||
+	    s->src.state >= PF_TCPS_PROXY_SRC ||
+	    s->dst.state >= PF_TCPS_PROXY_SRC ||
+	    (pd->hdr.tcp->th_flags & TH_SYN)))
+		return (0);
+
+	return (1);
+}
+
 struct pf_state *
 pf_find_state_all(struct pf_state_key_cmp *key, u_int dir, int *more)
 {
+	struct pf_state_shard	*pss = pf_state_key_shard(key);
 	struct pf_state_key	*sk = NULL;
 	struct pf_state		*s, *ret = NULL;
 
-	pf_status.fcounters[FCNT_STATE_SEARCH]++;
+	PF_COUNTER_ADD(pf_status.fcounters[FCNT_STATE_SEARCH], 1);
 
 	switch (dir) {
 	case PF_OUT:
 		sk = RB_FIND(pf_state_tree_lan_ext,
-		    &pf_statetbl_lan_ext, (struct pf_state_key *)key);
+		    &pss->pss_lan_ext, (struct pf_state_key *)key);
 		break;
 	case PF_IN:
 		sk = RB_FIND(pf_state_tree_ext_gwy,
-		    &pf_statetbl_ext_gwy, (struct pf_state_key *)key);
+		    &pss->pss_ext_gwy, (struct pf_state_key *)key);
 		break;
 	default:
 		panic("pf_find_state_all");
@@ -1202,7 +1455,8 @@ pf_check_threshold(struct pf_threshold *threshold)
 static int
 pf_src_connlimit(struct pf_state **state)
 {
-	int bad = 0;
+	struct pf_state_shard *pss;
+	int bad = 0, locked;
 
 	(*state)->src_node->conn++;
 	VERIFY((*state)->src_node->conn != 0);
@@ -1281,9 +1535,15 @@ pf_src_connlimit(struct pf_state **state)
 				    ((*state)->rule.ptr->flush &
 				    PF_FLUSH_GLOBAL ||
 				    (*state)->rule.ptr == st->rule.ptr)) {
+					/* pf_test_fast() updates these */
+					pss = pf_state_key_shard(
+					    (struct pf_state_key_cmp *)sk);
+					locked = pf_state_shard_lock(pss);
 					st->timeout = PFTM_PURGE;
 					st->src.state = st->dst.state =
 					    TCPS_CLOSED;
+					if (locked)
+						pf_state_shard_unlock(pss);
 					killed++;
 				}
 			}
@@ -1295,8 +1555,13 @@ pf_src_connlimit(struct pf_state **state)
 	}
 
 	/* kill this state */
+	pss = pf_state_key_shard(
+	    (struct pf_state_key_cmp *)(*state)->state_key);
+	locked = pf_state_shard_lock(pss);
 	(*state)->timeout = PFTM_PURGE;
 	(*state)->src.state = (*state)->dst.state = TCPS_CLOSED;
+	if (locked)
+		pf_state_shard_unlock(pss);
 	return (1);
 }
 
@@ -1406,13 +1671,20 @@ pf_stateins_err(const char *tree, struct pf_state *s, struct pfi_kif *kif)
 int
 pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 {
+	struct pf_state_shard	*pss;
 	struct pf_state_key	*cur;
 	struct pf_state		*sp;
+	int			 locked;
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
 
 	VERIFY(s->state_key != NULL);
 	s->kif = kif;
 
-	if ((cur = RB_INSERT(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
+	pss = pf_state_key_shard((struct pf_state_key_cmp *)s->state_key);
+	locked = pf_state_shard_lock(pss);
+
+	if ((cur = RB_INSERT(pf_state_tree_lan_ext, &pss->pss_lan_ext,
 	    s->state_key)) != NULL) {
 		/* key exists. check for same kif, if none, add to key */
 		TAILQ_FOREACH(sp, &cur->states, next)
@@ -1420,7 +1692,7 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 				pf_stateins_err("tree_lan_ext", s, kif);
 				pf_detach_state(s,
 				    PF_DT_SKIP_LANEXT|PF_DT_SKIP_EXTGWY);
-				return (-1);
+				goto fail;
 			}
 		pf_detach_state(s, PF_DT_SKIP_LANEXT|PF_DT_SKIP_EXTGWY);
 		pf_attach_state(cur, s, kif == pfi_all ? 1 : 0);
@@ -1428,11 +1700,11 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 
 	/* if cur != NULL, we already found a state key and attached to it */
 	if (cur == NULL && (cur = RB_INSERT(pf_state_tree_ext_gwy,
-	    &pf_statetbl_ext_gwy, s->state_key)) != NULL) {
+	    &pss->pss_ext_gwy, s->state_key)) != NULL) {
 		/* must not happen. we must have found the sk above! */
 		pf_stateins_err("tree_ext_gwy", s, kif);
 		pf_detach_state(s, PF_DT_SKIP_EXTGWY);
-		return (-1);
+		goto fail;
 	}
 
 	if (s->id == 0 && s->creatorid == 0) {
@@ -1449,8 +1721,11 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 			printf("\n");
 		}
 		pf_detach_state(s, 0);
-		return (-1);
+		goto fail;
 	}
+	if (locked)
+		pf_state_shard_unlock(pss);
+
 	TAILQ_INSERT_TAIL(&state_list, s, entry_list);
 	pf_status.fcounters[FCNT_STATE_INSERT]++;
 	pf_status.states++;
@@ -1460,6 +1735,11 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	pfsync_insert_state(s);
 #endif
 	return (0);
+
+fail:
+	if (locked)
+		pf_state_shard_unlock(pss);
+	return (-1);
 }
 
 static int
@@ -1469,7 +1749,7 @@ pf_purge_thread_cont(int err)
 	static u_int32_t nloops = 0;
 	int t = 1;	/* 1 second */
 
-	lck_rw_lock_shared(pf_perim_lock);
+	lck_brw_lock_shared(pf_perim_lock);
 	lck_mtx_lock(pf_lock);
 
 	/* purge everything if not running */
@@ -1481,7 +1761,7 @@ pf_purge_thread_cont(int err)
 		/* terminate thread (we don't currently do this) */
 		if (pf_purge_thread == NULL) {
 			lck_mtx_unlock(pf_lock);
-			lck_rw_done(pf_perim_lock);
+			lck_brw_unlock_shared(pf_perim_lock);
 
 			thread_deallocate(current_thread());
 			thread_terminate(current_thread());
@@ -1511,7 +1791,7 @@ pf_purge_thread_cont(int err)
 	}
 done:
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_unlock_shared(pf_perim_lock);
 
 	(void) tsleep0(pf_purge_thread_fn, PWAIT, "pf_purge_cont",
 	    t * hz, pf_purge_thread_cont);
@@ -1633,6 +1913,9 @@ pf_src_tree_remove_state(struct pf_state *s)
 void
 pf_unlink_state(struct pf_state *cur)
 {
+	struct pf_state_shard	*pss;
+	int			 locked;
+
 	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
 
 	if (cur->src.state == PF_TCPS_PROXY_DST) {
@@ -1650,9 +1933,34 @@ pf_unlink_state(struct pf_state *cur)
 	if (cur->creatorid == pf_status.hostid)
 		pfsync_delete_state(cur);
 #endif
+	pss = pf_state_key_shard((struct pf_state_key_cmp *)cur->state_key);
+	locked = pf_state_shard_lock(pss);
 	cur->timeout = PFTM_UNLINKED;
 	pf_src_tree_remove_state(cur);
 	pf_detach_state(cur, 0);
+	if (locked)
+		pf_state_shard_unlock(pss);
+}
+
+/*
+ * Unlink cur if it is still expired once its shard is locked; it may have
+ * been refreshed by pf_test_fast() since the caller looked.
+ */
+static int
+pf_unlink_expired_state(struct pf_state *cur)
+{
+	struct pf_state_shard	*pss;
+	int			 locked, expired;
+
+	pss = pf_state_key_shard((struct pf_state_key_cmp *)cur->state_key);
+	locked = pf_state_shard_lock(pss);
+	expired = (pf_state_expires(cur) <= pf_time_second());
+	if (expired)
+		pf_unlink_state(cur);
+	if (locked)
+		pf_state_shard_unlock(pss);
+
+	return (expired);
 }
 
 /* callers should be at splpf and hold the
@@ -1715,9 +2023,9 @@ pf_purge_expired_states(u_int32_t maxcheck)
 
 		if (cur->timeout == PFTM_UNLINKED) {
 			pf_free_state(cur);
-		} else if (pf_state_expires(cur) <= pf_time_second()) {
+		} else if (pf_state_expires(cur) <= pf_time_second() &&
+		    pf_unlink_expired_state(cur)) {
 			/* unlink and free expired state */
-			pf_unlink_state(cur);
 			pf_free_state(cur);
 		}
 		cur = next;
@@ -3919,10 +4227,14 @@ pf_attach_state(struct pf_state_key *sk, struct pf_state *s, int tail)
 		TAILQ_INSERT_HEAD(&sk->states, s, next);
 }
 
+/*
+ * The caller holds the shard lock if the state's key is in the trees.
+ */
 static void
 pf_detach_state(struct pf_state *s, int flags)
 {
 	struct pf_state_key	*sk = s->state_key;
+	struct pf_state_shard	*pss;
 
 	if (sk == NULL)
 		return;
@@ -3930,12 +4242,13 @@ pf_detach_state(struct pf_state *s, int flags)
 	s->state_key = NULL;
 	TAILQ_REMOVE(&sk->states, s, next);
 	if (--sk->refcnt == 0) {
+		pss = pf_state_key_shard((struct pf_state_key_cmp *)sk);
 		if (!(flags & PF_DT_SKIP_EXTGWY))
 			RB_REMOVE(pf_state_tree_ext_gwy,
-			    &pf_statetbl_ext_gwy, sk);
+			    &pss->pss_ext_gwy, sk);
 		if (!(flags & PF_DT_SKIP_LANEXT))
 			RB_REMOVE(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext, sk);
+			    &pss->pss_lan_ext, sk);
 		if (sk->app_state)
 			pool_put(&pf_app_state_pl, sk->app_state);
 		pool_put(&pf_state_key_pl, sk);
@@ -4026,6 +4339,8 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	struct pf_grev1_hdr	*grev1 = pd->hdr.grev1;
 	union pf_state_xport bxport, nxport, sxport, dxport;
 	struct pf_state_key	 psk;
+	struct pf_rule_class	*rc;
+	struct pf_rclass_match	 rcm;
 
 	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
 
@@ -4297,6 +4612,14 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	if (nr && nr->tag > 0)
 		tag = nr->tag;
 
+	/*
+	 * With a compiled ruleset, only the rules the classifier could not
+	 * rule out are evaluated at the top level; see pf_compile.c.
+	 */
+	rc = pf_rule_class_lookup(&rcm, direction, pd, saddr, daddr, th);
+	if (rc != NULL && r != NULL)
+		r = pf_rule_class_next(rc, &rcm, r);
+
 	while (r != NULL) {
 		r->evaluations++;
 		if (pfi_kif_match(r->kif, kif) == r->ifnot)
@@ -4390,6 +4713,8 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 		if (r == NULL && pf_step_out_of_anchor(&asd, &ruleset,
 		    PF_RULESET_FILTER, &r, &a, &match))
 			break;
+		if (rc != NULL && r != NULL && asd == 0)
+			r = pf_rule_class_next(rc, &rcm, r);
 	}
 	r = *rm;
 	a = *am;
@@ -4988,20 +5313,23 @@ cleanup:
 			}
 		}
 
+		/* the state is visible to pf_test_fast() once inserted */
+		if (tag > 0) {
+			pf_tag_ref(tag);
+			s->tag = tag;
+		}
 		if (pf_insert_state(BOUND_IFACE(r, kif), s)) {
 			if (pd->proto == IPPROTO_TCP)
 				pf_normalize_tcp_cleanup(s);
 			REASON_SET(&reason, PFRES_STATEINS);
 			pf_src_tree_remove_state(s);
 			STATE_DEC_COUNTERS(s);
+			if (s->tag)
+				pf_tag_unref(s->tag);
 			pool_put(&pf_state_pl, s);
 			return (PF_DROP);
 		} else
 			*sm = s;
-		if (tag > 0) {
-			pf_tag_ref(tag);
-			s->tag = tag;
-		}
 		if (pd->proto == IPPROTO_TCP &&
 		    (th->th_flags & (TH_SYN|TH_ACK)) == TH_SYN &&
 		    r->keep_state == PF_STATE_SYNPROXY) {
@@ -5816,7 +6144,7 @@ pf_test_state_tcp(struct pf_state **state, int direction, struct pfi_kif *kif,
 		key.ext.xport.port = th->th_dport;
 	}
 
-	STATE_LOOKUP();
+	STATE_LOOKUP_LOCKED();
 
 	if (direction == (*state)->state_key->direction) {
 		src = &(*state)->src;
@@ -6371,18 +6699,20 @@ pf_test_state_udp(struct pf_state **state, int direction, struct pfi_kif *kif,
 		}
 	}
 
-	*state = pf_find_state(kif, &key, dx);
+	*state = pf_find_state_locked(kif, &key, dx, pd);
 
 	if (!key.app_state && *state == 0) {
 		key.proto_variant = PF_EXTFILTER_AD;
-		*state = pf_find_state(kif, &key, dx);
+		*state = pf_find_state_locked(kif, &key, dx, pd);
 	}
 
 	if (!key.app_state && *state == 0) {
 		key.proto_variant = PF_EXTFILTER_EI;
-		*state = pf_find_state(kif, &key, dx);
+		*state = pf_find_state_locked(kif, &key, dx, pd);
 	}
 
+	STATE_FASTPATH_CHECK();
+
 	if ((*state) != NULL && pd != NULL &&
 		pd->flowhash == 0)
 		pd->flowhash = (*state)->state_key->flowhash;
@@ -7263,17 +7593,24 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			s = pf_find_state(kif, &key, direction);
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
+				struct pf_state_shard *pss;
+				int locked;
 
+				/* the SPI does not select the shard */
+				pss = pf_state_key_shard(&key);
+				locked = pf_state_shard_lock(pss);
 				RB_REMOVE(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk);
+				    &pss->pss_ext_gwy, sk);
 				sk->lan.xport.spi = sk->gwy.xport.spi =
 				    esp->spi;
 
 				if (RB_INSERT(pf_state_tree_ext_gwy,
-				    &pf_statetbl_ext_gwy, sk))
+				    &pss->pss_ext_gwy, sk))
 					pf_detach_state(s, PF_DT_SKIP_EXTGWY);
 				else
 					*state = s;
+				if (locked)
+					pf_state_shard_unlock(pss);
 			}
 		} else {
 			key.ext.xport.spi = 0;
@@ -7281,16 +7618,22 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			s = pf_find_state(kif, &key, direction);
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
+				struct pf_state_shard *pss;
+				int locked;
 
+				pss = pf_state_key_shard(&key);
+				locked = pf_state_shard_lock(pss);
 				RB_REMOVE(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk);
+				    &pss->pss_lan_ext, sk);
 				sk->ext.xport.spi = esp->spi;
 
 				if (RB_INSERT(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk))
+				    &pss->pss_lan_ext, sk))
 					pf_detach_state(s, PF_DT_SKIP_LANEXT);
 				else
 					*state = s;
+				if (locked)
+					pf_state_shard_unlock(pss);
 			}
 		}
 
@@ -8032,6 +8375,279 @@ pf_check_proto_cksum(struct mbuf *m, int off, int len, u_int8_t p,
 	return (0);
 }
 
+/*
+ * Account a packet to its interface and, if it passed or was blocked by
+ * a rule, to that rule, its anchor and the state.  pf_test_fast() does
+ * this without pf_lock, hence the atomics.
+ */
+static void
+pf_count_packet(struct pfi_kif *kif, int v6, int dir, int action,
+    struct pf_rule *r, struct pf_rule *a, struct pf_state *s, u_int64_t len)
+{
+	int dirndx = (dir == PF_OUT);
+
+	PF_COUNTER_ADD(kif->pfik_bytes[v6][dirndx][action != PF_PASS], len);
+	PF_COUNTER_ADD(kif->pfik_packets[v6][dirndx][action != PF_PASS], 1);
+
+	if (action != PF_PASS && r->action != PF_DROP)
+		return;
+
+	PF_COUNTER_ADD(r->packets[dirndx], 1);
+	PF_COUNTER_ADD(r->bytes[dirndx], len);
+	if (a != NULL) {
+		PF_COUNTER_ADD(a->packets[dirndx], 1);
+		PF_COUNTER_ADD(a->bytes[dirndx], len);
+	}
+	if (s == NULL)
+		return;
+
+	if (s->nat_rule.ptr != NULL) {
+		PF_COUNTER_ADD(s->nat_rule.ptr->packets[dirndx], 1);
+		PF_COUNTER_ADD(s->nat_rule.ptr->bytes[dirndx], len);
+	}
+	if (s->src_node != NULL) {
+		PF_COUNTER_ADD(s->src_node->packets[dirndx], 1);
+		PF_COUNTER_ADD(s->src_node->bytes[dirndx], len);
+	}
+	if (s->nat_src_node != NULL) {
+		PF_COUNTER_ADD(s->nat_src_node->packets[dirndx], 1);
+		PF_COUNTER_ADD(s->nat_src_node->bytes[dirndx], len);
+	}
+	dirndx = (dir == s->state_key->direction) ? 0 : 1;
+	PF_COUNTER_ADD(s->packets[dirndx], 1);
+	PF_COUNTER_ADD(s->bytes[dirndx], len);
+}
+
+/*
+ * Filter a packet of an established TCP or UDP flow without pf_lock.
+ *
+ * Called by pf_af_hook() before it falls back to pf_test()/pf_test6()
+ * under pf_lock.  The caller holds pf_perim_lock shared, and every change
+ * to the rulesets is made with it held exclusive, so the rules are an
+ * immutable snapshot for the duration; the state is looked up, checked
+ * and updated with only its shard locked, which lets packets of flows in
+ * different shards be filtered in parallel.
+ *
+ * Returns 0, with the packet untouched, if the packet needs anything the
+ * slow path provides: rule evaluation for a new flow, normalization,
+ * dummynet, fragment handling, IP options or IPv6 extension headers, or
+ * a state refused by pf_state_fastpath_ok().  Otherwise the packet has
+ * been handled exactly as pf_test() would have, *actionp holds the verdict
+ * and a dropped packet has been freed.
+ */
+int
+pf_test_fast(int dir, struct ifnet *ifp, struct mbuf **m0, int af,
+    int *actionp)
+{
+	struct mbuf		*m = *m0;
+	struct pfi_kif		*kif;
+	struct pf_rule		*a = NULL, *r = &pf_default_rule;
+	struct pf_state		*s = NULL;
+	struct pf_pdesc		 pd;
+	union {
+		struct tcphdr	th;
+		struct udphdr	uh;
+	} hdr;
+	u_short			 action, reason = 0;
+	int			 off, hlen, pqid = 0;
+	void			*h;
+
+	if (!pf_fastpath || !pf_status.running)
+		return (0);
+
+	kif = (struct pfi_kif *)ifp->if_pf_kif;
+	if (kif == NULL || (kif->pfik_flags & PFI_IFLAG_SKIP))
+		return (0);
+
+	memset(&pd, 0, sizeof (pd));
+	if ((pd.pf_mtag = pf_get_mtag(m)) == NULL ||
+	    (pd.pf_mtag->pftag_flags & PF_TAG_GENERATED))
+		return (0);
+
+	if (!TAILQ_EMPTY(pf_main_ruleset.rules[PF_RULESET_SCRUB].active.ptr)
+#if DUMMYNET
+	    || (DUMMYNET_LOADED && !TAILQ_EMPTY(
+	    pf_main_ruleset.rules[PF_RULESET_DUMMYNET].active.ptr))
+#endif /* DUMMYNET */
+	    )
+		goto bypass;
+
+	switch (af) {
+#if INET
+	case AF_INET: {
+		struct ip *ip;
+
+		if (m->m_len < (int)sizeof (*ip))
+			goto bypass;
+		ip = mtod(m, struct ip *);
+		if (ip->ip_hl != (sizeof (*ip) >> 2) ||
+		    (ip->ip_off & htons(IP_MF | IP_OFFMASK)))
+			goto bypass;
+		h = ip;
+		off = sizeof (*ip);
+		pd.src = (struct pf_addr *)&ip->ip_src;
+		pd.dst = (struct pf_addr *)&ip->ip_dst;
+		pd.ip_sum = &ip->ip_sum;
+		pd.proto = ip->ip_p;
+		pd.tos = ip->ip_tos;
+		pd.tot_len = ntohs(ip->ip_len);
+		break;
+	}
+#endif /* INET */
+#if INET6
+	case AF_INET6: {
+		struct ip6_hdr *ip6;
+
+		if (m->m_len < (int)sizeof (*ip6))
+			goto bypass;
+		ip6 = mtod(m, struct ip6_hdr *);
+		if (ip6->ip6_plen == 0)
+			goto bypass;
+		h = ip6;
+		off = sizeof (*ip6);
+		pd.src = (struct pf_addr *)&ip6->ip6_src;
+		pd.dst = (struct pf_addr *)&ip6->ip6_dst;
+		pd.ip_sum = NULL;
+		pd.proto = ip6->ip6_nxt;
+		pd.tos = 0;
+		pd.tot_len = ntohs(ip6->ip6_plen) + sizeof (*ip6);
+		break;
+	}
+#endif /* INET6 */
+	default:
+		return (0);
+	}
+
+	switch (pd.proto) {
+	case IPPROTO_TCP:
+		hlen = sizeof (hdr.th);
+		break;
+	case IPPROTO_UDP:
+		hlen = sizeof (hdr.uh);
+		break;
+	default:
+		goto bypass;
+	}
+	/* leave short packets to the slow path to drop and account */
+	if (pd.tot_len < (u_int64_t)(off + hlen) ||
+	    m->m_pkthdr.len < off + hlen)
+		return (0);
+
+	PF_ACPY(&pd.baddr, dir == PF_OUT ? pd.src : pd.dst, af);
+	pd.proto_variant = 0;
+	pd.mp = m;
+	pd.lmw = 0;
+	pd.af = af;
+	pd.sc = MBUF_SCIDX(mbuf_get_service_class(m));
+	if (pd.pf_mtag->pftag_flowhash != 0) {
+		pd.flowhash = pd.pf_mtag->pftag_flowhash;
+		pd.flags |= (m->m_pkthdr.m_fhflags & PF_TAG_FLOWADV) ?
+		    PFDESC_FLOW_ADV : 0;
+	}
+	pd.flags |= PFDESC_FASTPATH;
+
+	if (pd.proto == IPPROTO_TCP) {
+		pd.hdr.tcp = &hdr.th;
+		m_copydata(m, off, hlen, &hdr.th);
+		pd.p_len = pd.tot_len - off - (hdr.th.th_off << 2);
+		if ((hdr.th.th_flags & TH_ACK) && pd.p_len == 0)
+			pqid = 1;
+		action = pf_test_state_tcp(&s, dir, kif, m, off, h, &pd,
+		    &reason);
+	} else {
+		pd.hdr.udp = &hdr.uh;
+		m_copydata(m, off, hlen, &hdr.uh);
+		if (hdr.uh.uh_dport == 0 ||
+		    ntohs(hdr.uh.uh_ulen) > m->m_pkthdr.len - off ||
+		    ntohs(hdr.uh.uh_ulen) < sizeof (struct udphdr))
+			return (0);
+		action = pf_test_state_udp(&s, dir, kif, m, off, h, &pd,
+		    &reason);
+	}
+
+	if (s == NULL || (pd.flags & PFDESC_SLOWPATH)) {
+		/* nothing has been changed; start over under pf_lock */
+		pf_state_shard_release(&pd);
+		if (s == NULL)
+			PF_FASTPATH_STAT(misses);
+		else
+			PF_FASTPATH_STAT(ineligible);
+		return (0);
+	}
+
+	m = *m0 = pd.mp;
+	h = mtod(m, void *);
+
+	if (action == PF_PASS) {
+		r = s->rule.ptr;
+		a = s->anchor.ptr;
+	}
+
+	if (s->tag || PF_RTABLEID_IS_VALID(r->rtableid) || pd.flowhash != 0)
+		(void) pf_tag_packet(m, pd.pf_mtag, s->tag, r->rtableid, &pd);
+
+	if (action == PF_PASS) {
+#if PF_ALTQ
+		if (altq_allowed && r->qid) {
+			if (pqid || (pd.tos & IPTOS_LOWDELAY))
+				pd.pf_mtag->pftag_qid = r->pqid;
+			else
+				pd.pf_mtag->pftag_qid = r->qid;
+		}
+#endif /* PF_ALTQ */
+		/* add hints for ecn */
+		pd.pf_mtag->pftag_hdr = h;
+		/* record address family */
+		if (af == AF_INET) {
+			pd.pf_mtag->pftag_flags &= ~PF_TAG_HDR_INET6;
+			pd.pf_mtag->pftag_flags |= PF_TAG_HDR_INET;
+		} else {
+			pd.pf_mtag->pftag_flags &= ~PF_TAG_HDR_INET;
+			pd.pf_mtag->pftag_flags |= PF_TAG_HDR_INET6;
+		}
+		/* record TCP vs. non-TCP */
+		if (pd.proto == IPPROTO_TCP)
+			pd.pf_mtag->pftag_flags |= PF_TAG_TCP;
+		else
+			pd.pf_mtag->pftag_flags &= ~PF_TAG_TCP;
+
+		/* see pf_test() */
+		if (dir == PF_IN && s->nat_rule.ptr != NULL &&
+		    (s->nat_rule.ptr->action == PF_RDR ||
+		    s->nat_rule.ptr->action == PF_BINAT) &&
+		    ((af == AF_INET && (ntohl(pd.dst->v4.s_addr) >>
+		    IN_CLASSA_NSHIFT) == IN_LOOPBACKNET)
+#if INET6
+		    || (af == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&pd.dst->v6))
+#endif /* INET6 */
+		    ))
+			pd.pf_mtag->pftag_flags |= PF_TAG_TRANSLATE_LOCALHOST;
+	}
+
+	pf_count_packet(kif, af == AF_INET6, dir, action, r, a, s,
+	    pd.tot_len);
+	pf_state_shard_release(&pd);
+	PF_FASTPATH_STAT(hits);
+
+	if (*m0 != NULL) {
+		if (pd.lmw < 0) {
+			REASON_SET(&reason, PFRES_MEMORY);
+			action = PF_DROP;
+		}
+		if (action == PF_DROP) {
+			m_freem(*m0);
+			*m0 = NULL;
+		}
+	}
+	*actionp = action;
+
+	return (1);
+
+bypass:
+	PF_FASTPATH_STAT(bypass);
+	return (0);
+}
+
 #if INET
 #define PF_APPLE_UPDATE_PDESC_IPv4()				\
 	do {							\
@@ -8058,7 +8674,7 @@ pf_test(int dir, struct ifnet *ifp, struct mbuf **m0,
 	struct pf_state_key	*sk = NULL;
 	struct pf_ruleset	*ruleset = NULL;
 	struct pf_pdesc		 pd;
-	int			 off, dirndx, pqid = 0;
+	int			 off, pqid = 0;
 
 	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
 
@@ -8206,6 +8822,7 @@ nonormalize:
 			goto done;
 		action = pf_test_state_tcp(&s, dir, kif, m, off, h, &pd,
 		    &reason);
+		pf_state_shard_release(&pd);
 		if (pd.lmw < 0)
 			goto done;
 		PF_APPLE_UPDATE_PDESC_IPv4();
@@ -8248,6 +8865,7 @@ nonormalize:
 #endif /* DUMMYNET */
 		action = pf_test_state_udp(&s, dir, kif, m, off, h, &pd,
 		    &reason);
+		pf_state_shard_release(&pd);
 		if (pd.lmw < 0)
 			goto done;
 		PF_APPLE_UPDATE_PDESC_IPv4();
@@ -8470,35 +9088,11 @@ done:
 		    &pd);
 	}
 
-	kif->pfik_bytes[0][dir == PF_OUT][action != PF_PASS] += pd.tot_len;
-	kif->pfik_packets[0][dir == PF_OUT][action != PF_PASS]++;
+	pf_count_packet(kif, 0, dir, action, r, a, s, pd.tot_len);
 
 	if (action == PF_PASS || r->action == PF_DROP) {
-		dirndx = (dir == PF_OUT);
-		r->packets[dirndx]++;
-		r->bytes[dirndx] += pd.tot_len;
-		if (a != NULL) {
-			a->packets[dirndx]++;
-			a->bytes[dirndx] += pd.tot_len;
-		}
-		if (s != NULL) {
+		if (s != NULL)
 			sk = s->state_key;
-			if (s->nat_rule.ptr != NULL) {
-				s->nat_rule.ptr->packets[dirndx]++;
-				s->nat_rule.ptr->bytes[dirndx] += pd.tot_len;
-			}
-			if (s->src_node != NULL) {
-				s->src_node->packets[dirndx]++;
-				s->src_node->bytes[dirndx] += pd.tot_len;
-			}
-			if (s->nat_src_node != NULL) {
-				s->nat_src_node->packets[dirndx]++;
-				s->nat_src_node->bytes[dirndx] += pd.tot_len;
-			}
-			dirndx = (dir == sk->direction) ? 0 : 1;
-			s->packets[dirndx]++;
-			s->bytes[dirndx] += pd.tot_len;
-		}
 		tr = r;
 		nr = (s != NULL) ? s->nat_rule.ptr : pd.nat_rule;
 		if (nr != NULL) {
@@ -8592,7 +9186,7 @@ pf_test6(int dir, struct ifnet *ifp, struct mbuf **m0,
 	struct pf_state_key	*sk = NULL;
 	struct pf_ruleset	*ruleset = NULL;
 	struct pf_pdesc		 pd;
-	int			 off, terminal = 0, dirndx, rh_cnt = 0;
+	int			 off, terminal = 0, rh_cnt = 0;
 	u_int8_t		 nxt;
 
 	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
@@ -8800,6 +9394,7 @@ nonormalize:
 			goto done;
 		action = pf_test_state_tcp(&s, dir, kif, m, off, h, &pd,
 		    &reason);
+		pf_state_shard_release(&pd);
 		if (pd.lmw < 0)
 			goto done;
 		PF_APPLE_UPDATE_PDESC_IPv6();
@@ -8842,6 +9437,7 @@ nonormalize:
 #endif /* DUMMYNET */
 		action = pf_test_state_udp(&s, dir, kif, m, off, h, &pd,
 		    &reason);
+		pf_state_shard_release(&pd);
 		if (pd.lmw < 0)
 			goto done;
 		PF_APPLE_UPDATE_PDESC_IPv6();
@@ -9064,35 +9660,11 @@ done:
 		    &pd);
 	}
 
-	kif->pfik_bytes[1][dir == PF_OUT][action != PF_PASS] += pd.tot_len;
-	kif->pfik_packets[1][dir == PF_OUT][action != PF_PASS]++;
+	pf_count_packet(kif, 1, dir, action, r, a, s, pd.tot_len);
 
 	if (action == PF_PASS || r->action == PF_DROP) {
-		dirndx = (dir == PF_OUT);
-		r->packets[dirndx]++;
-		r->bytes[dirndx] += pd.tot_len;
-		if (a != NULL) {
-			a->packets[dirndx]++;
-			a->bytes[dirndx] += pd.tot_len;
-		}
-		if (s != NULL) {
+		if (s != NULL)
 			sk = s->state_key;
-			if (s->nat_rule.ptr != NULL) {
-				s->nat_rule.ptr->packets[dirndx]++;
-				s->nat_rule.ptr->bytes[dirndx] += pd.tot_len;
-			}
-			if (s->src_node != NULL) {
-				s->src_node->packets[dirndx]++;
-				s->src_node->bytes[dirndx] += pd.tot_len;
-			}
-			if (s->nat_src_node != NULL) {
-				s->nat_src_node->packets[dirndx]++;
-				s->nat_src_node->bytes[dirndx] += pd.tot_len;
-			}
-			dirndx = (dir == sk->direction) ? 0 : 1;
-			s->packets[dirndx]++;
-			s->bytes[dirndx] += pd.tot_len;
-		}
 		tr = r;
 		nr = (s != NULL) ? s->nat_rule.ptr : pd.nat_rule;
 		if (nr != NULL) {
@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Compiled filter rulesets.
+ *
+ * pf_test_rule() walks the filter rules in order, using the skip steps
+ * computed by pf_calc_skip_steps() to hop over runs of rules sharing a
+ * mismatching parameter.  With large rulesets whose neighbouring rules
+ * differ in most parameters the skip steps degenerate and every packet
+ * that creates state costs a walk of the whole list.
+ *
+ * When the main filter ruleset is committed and has at least
+ * pf_compile_min_rules rules it is compiled into a bit vector classifier:
+ * for each of direction, address family, protocol, source and destination
+ * port and IPv4 source and destination address, the value space is cut
+ * into the elementary intervals delimited by the rules' bounds, and each
+ * interval gets a bitmap, in rule order, of the rules that can match a
+ * packet whose value falls into it.  A packet looks up one interval per
+ * dimension; the AND of those bitmaps is a superset of the rules that
+ * match it, and pf_test_rule() only evaluates these, still in order and
+ * still through the full match checks.  Since no rule that could match is
+ * ever dropped, both first match ("quick") and last match semantics and
+ * the step into anchors are unchanged.
+ *
+ * Anything the classifier does not understand (interfaces, tables,
+ * dynamic addresses, IPv6 addresses, address ranges, tags, ...) is left
+ * to the match checks: such a rule's bit is simply set in every interval
+ * of that dimension.  A dimension whose bitmaps would not fit in
+ * PF_RCLASS_DIM_MAXMEM is dropped altogether.
+ */
+
+#include <machine/endian.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/sysctl.h>
+#include <sys/mbuf.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include <net/if.h>
+#include <net/pfvar.h>
+
+#define	PF_RCLASS_DIM_MAXMEM	(4 * 1024 * 1024)	/* bytes per dimension */
+
+struct pf_rclass_dim {
+	u_int32_t	 nint;		/* number of intervals; 0 if unused */
+	u_int32_t	*start;		/* sorted interval start values */
+	u_int64_t	*bits;		/* nint bitmaps of nwords each */
+};
+
+struct pf_rule_class {
+	u_int32_t		 nrules;
+	u_int32_t		 nwords;	/* 64-bit words per bitmap */
+	struct pf_rule		**rules;	/* rules in evaluation order */
+	u_int8_t		 protoidx[256];	/* protocol -> interval */
+	struct pf_rclass_dim	 dim[PF_RCLASS_MAX];
+};
+
+/* classifier of the active main filter ruleset; protected by pf_lock */
+static struct pf_rule_class *pf_filter_class;
+
+static int pf_compile_min_rules = 32;
+
+SYSCTL_DECL(_net_pf);
+SYSCTL_INT(_net_pf, OID_AUTO, compile_min_rules, CTLFLAG_RW|CTLFLAG_LOCKED,
+    &pf_compile_min_rules, 0,
+    "Compile filter rulesets with at least this many rules (0 disables)");
+
+__private_extern__ void qsort(void *, size_t, size_t,
+    int (*)(const void *, const void *));
+
+static int pf_rclass_dim_alloc(struct pf_rule_class *, int, u_int32_t);
+static int pf_rclass_bounds(struct pf_rule_class *, int,
+    u_int32_t *(*)(struct pf_rule *, u_int32_t *));
+static void pf_rclass_port_bounds(struct pf_rule_class *, int, u_int32_t *,
+    u_int32_t *);
+static void pf_rclass_free(struct pf_rule_class *);
+static u_int32_t pf_rclass_find(struct pf_rclass_dim *, u_int32_t);
+
+#define	PF_RCLASS_BITS(rc, d, i)	\
+	(&(rc)->dim[d].bits[(size_t)(i) * (rc)->nwords])
+#define	PF_RCLASS_SET(bm, n)		\
+	((bm)[(n) >> 6] |= (1ULL << ((n) & 63)))
+
+static int
+pf_rclass_dim_alloc(struct pf_rule_class *rc, int d, u_int32_t nint)
+{
+	struct pf_rclass_dim *dim = &rc->dim[d];
+	size_t size = (size_t)nint * rc->nwords * sizeof (u_int64_t);
+
+	if (nint == 0 || size / nint / sizeof (u_int64_t) != rc->nwords ||
+	    size > PF_RCLASS_DIM_MAXMEM)
+		return (ENOMEM);
+	dim->bits = _MALLOC(size, M_TEMP, M_WAITOK|M_ZERO);
+	if (dim->bits == NULL)
+		return (ENOMEM);
+	dim->nint = nint;
+	return (0);
+}
+
+static int
+pf_rclass_cmp32(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Port bounds of a rule, in host order, or NULL if the rule does not
+ * constrain the port.  Every port operator is decided by comparisons
+ * against port[0] and port[1] only, so within [b, b') for consecutive
+ * bounds b, b' of all rules every rule matches either all ports or none.
+ */
+static void
+pf_rclass_port_bounds(struct pf_rule_class *rc, int d, u_int32_t *b,
+    u_int32_t *n)
+{
+	struct pf_rule_addr *ra;
+	u_int32_t i, p;
+
+	for (i = 0; i < rc->nrules; i++) {
+		struct pf_rule *r = rc->rules[i];
+
+		if (r->proto != IPPROTO_TCP && r->proto != IPPROTO_UDP)
+			continue;
+		ra = (d == PF_RCLASS_SRC_PORT) ? &r->src : &r->dst;
+		if (!ra->xport.range.op)
+			continue;
+		p = ntohs(ra->xport.range.port[0]);
+		b[(*n)++] = p;
+		b[(*n)++] = p + 1;
+		p = ntohs(ra->xport.range.port[1]);
+		b[(*n)++] = p;
+		b[(*n)++] = p + 1;
+	}
+}
+
+/*
+ * Collect, sort and deduplicate the interval bounds of dimension d and
+ * allocate its bitmaps.  The first interval always starts at 0.
+ */
+static int
+pf_rclass_bounds(struct pf_rule_class *rc, int d,
+    u_int32_t *(*fn)(struct pf_rule *, u_int32_t *))
+{
+	struct pf_rclass_dim *dim = &rc->dim[d];
+	u_int32_t *b, n = 0, i, j;
+	int error;
+
+	b = _MALLOC((4 * rc->nrules + 1) * sizeof (u_int32_t), M_TEMP,
+	    M_WAITOK);
+	if (b == NULL)
+		return (ENOMEM);
+	b[n++] = 0;
+	if (fn == NULL) {
+		pf_rclass_port_bounds(rc, d, b, &n);
+	} else {
+		for (i = 0; i < rc->nrules; i++)
+			n = fn(rc->rules[i], b + n) - b;
+	}
+	qsort(b, n, sizeof (*b), pf_rclass_cmp32);
+	for (i = 1, j = 1; i < n; i++) {
+		/* a port bound of 65536 starts no interval */
+		if (b[i] == b[j - 1] ||
+		    (fn == NULL && b[i] > 0xffff))
+			continue;
+		b[j++] = b[i];
+	}
+	error = pf_rclass_dim_alloc(rc, d, j);
+	if (error != 0) {
+		_FREE(b, M_TEMP);
+		return (error);
+	}
+	dim->start = b;
+	return (0);
+}
+
+/*
+ * IPv4 address bounds of a rule, in host order: the first address of its
+ * network and the one past the last.  Only plain, non-empty address/mask
+ * pairs of IPv4 rules are classified; anything else may depend on more
+ * than the address and matches everywhere.
+ */
+static int
+pf_rclass_addr4(struct pf_rule *r, struct pf_rule_addr *ra,
+    u_int32_t *lo, u_int32_t *hi)
+{
+	u_int32_t m;
+
+	if (r->af != AF_INET || ra->addr.type != PF_ADDR_ADDRMASK)
+		return (0);
+	m = ntohl(ra->addr.v.a.mask.addr32[0]);
+	if (m == 0)
+		return (0);
+	*lo = ntohl(ra->addr.v.a.addr.addr32[0]) & m;
+	*hi = *lo | ~m;
+	return (1);
+}
+
+static u_int32_t *
+pf_rclass_src4_bounds(struct pf_rule *r, u_int32_t *b)
+{
+	u_int32_t lo, hi;
+
+	if (pf_rclass_addr4(r, &r->src, &lo, &hi)) {
+		*b++ = lo;
+		if (hi != 0xffffffff)
+			*b++ = hi + 1;
+	}
+	return (b);
+}
+
+static u_int32_t *
+pf_rclass_dst4_bounds(struct pf_rule *r, u_int32_t *b)
+{
+	u_int32_t lo, hi;
+
+	if (pf_rclass_addr4(r, &r->dst, &lo, &hi)) {
+		*b++ = lo;
+		if (hi != 0xffffffff)
+			*b++ = hi + 1;
+	}
+	return (b);
+}
+
+static void
+pf_rclass_free(struct pf_rule_class *rc)
+{
+	int d;
+
+	if (rc == NULL)
+		return;
+	for (d = 0; d < PF_RCLASS_MAX; d++) {
+		if (rc->dim[d].start != NULL)
+			_FREE(rc->dim[d].start, M_TEMP);
+		if (rc->dim[d].bits != NULL)
+			_FREE(rc->dim[d].bits, M_TEMP);
+	}
+	if (rc->rules != NULL)
+		_FREE(rc->rules, M_TEMP);
+	_FREE(rc, M_TEMP);
+}
+
+/*
+ * Rebuild the classifier after the active rules of rs_num in rs changed.
+ * Called with pf_lock held wherever the skip steps are recomputed; only
+ * the main filter ruleset is compiled.  Failure just leaves the ruleset
+ * to be evaluated linearly.
+ */
+void
+pf_compile_rules(struct pf_ruleset *rs, int rs_num)
+{
+	struct pf_rulequeue *rules;
+	struct pf_rule_class *rc;
+	struct pf_rule *r;
+	u_int32_t i, n, p;
+	int d, nproto;
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rs != &pf_main_ruleset || rs_num != PF_RULESET_FILTER)
+		return;
+
+	pf_rclass_free(pf_filter_class);
+	pf_filter_class = NULL;
+
+	rules = rs->rules[rs_num].active.ptr;
+	n = 0;
+	TAILQ_FOREACH(r, rules, entries)
+		n++;
+	if (pf_compile_min_rules <= 0 || n < (u_int32_t)pf_compile_min_rules)
+		return;
+
+	rc = _MALLOC(sizeof (*rc), M_TEMP, M_WAITOK|M_ZERO);
+	if (rc == NULL)
+		return;
+	rc->nrules = n;
+	rc->nwords = (n + 63) / 64;
+	rc->rules = _MALLOC(n * sizeof (*rc->rules), M_TEMP, M_WAITOK);
+	if (rc->rules == NULL)
+		goto fail;
+	i = 0;
+	TAILQ_FOREACH(r, rules, entries) {
+		/* pf_rule_class_next() indexes by rule number */
+		if (r->nr != i)
+			goto fail;
+		rc->rules[i++] = r;
+	}
+
+	/* direction: PF_IN, PF_OUT */
+	if (pf_rclass_dim_alloc(rc, PF_RCLASS_DIR, 2) != 0)
+		goto fail;
+	/* address family: AF_INET, AF_INET6 */
+	if (pf_rclass_dim_alloc(rc, PF_RCLASS_AF, 2) != 0)
+		goto fail;
+	/* protocol: interval 0 for the ones no rule names */
+	nproto = 1;
+	for (i = 0; i < n; i++) {
+		p = rc->rules[i]->proto;
+		if (p != 0 && rc->protoidx[p] == 0)
+			rc->protoidx[p] = nproto++;
+	}
+	if (pf_rclass_dim_alloc(rc, PF_RCLASS_PROTO, nproto) != 0)
+		goto fail;
+
+	/* the rest are optional */
+	(void) pf_rclass_bounds(rc, PF_RCLASS_SRC_PORT, NULL);
+	(void) pf_rclass_bounds(rc, PF_RCLASS_DST_PORT, NULL);
+	(void) pf_rclass_bounds(rc, PF_RCLASS_SRC_ADDR4, pf_rclass_src4_bounds);
+	(void) pf_rclass_bounds(rc, PF_RCLASS_DST_ADDR4, pf_rclass_dst4_bounds);
+
+	for (i = 0; i < n; i++) {
+		r = rc->rules[i];
+
+		if (r->direction != PF_OUT)
+			PF_RCLASS_SET(PF_RCLASS_BITS(rc, PF_RCLASS_DIR, 0), i);
+		if (r->direction != PF_IN)
+			PF_RCLASS_SET(PF_RCLASS_BITS(rc, PF_RCLASS_DIR, 1), i);
+
+		if (r->af != AF_INET6)
+			PF_RCLASS_SET(PF_RCLASS_BITS(rc, PF_RCLASS_AF, 0), i);
+		if (r->af != AF_INET)
+			PF_RCLASS_SET(PF_RCLASS_BITS(rc, PF_RCLASS_AF, 1), i);
+
+		if (r->proto == 0) {
+			for (d = 0; d < nproto; d++)
+				PF_RCLASS_SET(PF_RCLASS_BITS(rc,
+				    PF_RCLASS_PROTO, d), i);
+		} else {
+			PF_RCLASS_SET(PF_RCLASS_BITS(rc, PF_RCLASS_PROTO,
+			    rc->protoidx[r->proto]), i);
+		}
+
+		for (d = PF_RCLASS_SRC_PORT; d <= PF_RCLASS_DST_PORT; d++) {
+			struct pf_rclass_dim *dim = &rc->dim[d];
+			struct pf_rule_addr *ra;
+			u_int32_t k;
+
+			ra = (d == PF_RCLASS_SRC_PORT) ? &r->src : &r->dst;
+			for (k = 0; k < dim->nint; k++) {
+				if ((r->proto == IPPROTO_TCP ||
+				    r->proto == IPPROTO_UDP) &&
+				    ra->xport.range.op &&
+				    !pf_match_port(ra->xport.range.op,
+				    ra->xport.range.port[0],
+				    ra->xport.range.port[1],
+				    htons((u_int16_t)dim->start[k])))
+					continue;
+				PF_RCLASS_SET(PF_RCLASS_BITS(rc, d, k), i);
+			}
+		}
+
+		for (d = PF_RCLASS_SRC_ADDR4; d <= PF_RCLASS_DST_ADDR4; d++) {
+			struct pf_rclass_dim *dim = &rc->dim[d];
+			struct pf_rule_addr *ra;
+			u_int32_t k, lo, hi;
+			int c;
+
+			ra = (d == PF_RCLASS_SRC_ADDR4) ? &r->src : &r->dst;
+			c = pf_rclass_addr4(r, ra, &lo, &hi);
+			for (k = 0; k < dim->nint; k++) {
+				/* same test as PF_MISMATCHAW() */
+				if (c && ((dim->start[k] >= lo &&
+				    dim->start[k] <= hi) ? 0 : 1) != ra->neg)
+					continue;
+				PF_RCLASS_SET(PF_RCLASS_BITS(rc, d, k), i);
+			}
+		}
+	}
+
+	pf_filter_class = rc;
+	return;
+fail:
+	pf_rclass_free(rc);
+}
+
+/* index of the interval of dim containing v */
+static u_int32_t
+pf_rclass_find(struct pf_rclass_dim *dim, u_int32_t v)
+{
+	u_int32_t lo = 0, hi = dim->nint - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (dim->start[mid] <= v)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+/*
+ * Look up the bitmaps of the packet described by pd, with the (possibly
+ * translated) addresses and ports the filter rules will see.  Returns NULL
+ * if the main filter ruleset is not compiled.
+ */
+struct pf_rule_class *
+pf_rule_class_lookup(struct pf_rclass_match *rcm, int direction,
+    struct pf_pdesc *pd, struct pf_addr *saddr, struct pf_addr *daddr,
+    struct tcphdr *th)
+{
+	struct pf_rule_class *rc = pf_filter_class;
+	int n = 0;
+
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rc == NULL)
+		return (NULL);
+
+	rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_DIR,
+	    direction == PF_OUT);
+	rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_AF, pd->af == AF_INET6);
+	rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_PROTO,
+	    rc->protoidx[pd->proto]);
+	if (pd->proto == IPPROTO_TCP || pd->proto == IPPROTO_UDP) {
+		if (rc->dim[PF_RCLASS_SRC_PORT].nint != 0)
+			rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_SRC_PORT,
+			    pf_rclass_find(&rc->dim[PF_RCLASS_SRC_PORT],
+			    ntohs(th->th_sport)));
+		if (rc->dim[PF_RCLASS_DST_PORT].nint != 0)
+			rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_DST_PORT,
+			    pf_rclass_find(&rc->dim[PF_RCLASS_DST_PORT],
+			    ntohs(th->th_dport)));
+	}
+	if (pd->af == AF_INET) {
+		if (rc->dim[PF_RCLASS_SRC_ADDR4].nint != 0)
+			rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_SRC_ADDR4,
+			    pf_rclass_find(&rc->dim[PF_RCLASS_SRC_ADDR4],
+			    ntohl(saddr->v4.s_addr)));
+		if (rc->dim[PF_RCLASS_DST_ADDR4].nint != 0)
+			rcm->v[n++] = PF_RCLASS_BITS(rc, PF_RCLASS_DST_ADDR4,
+			    pf_rclass_find(&rc->dim[PF_RCLASS_DST_ADDR4],
+			    ntohl(daddr->v4.s_addr)));
+	}
+	rcm->n = n;
+	return (rc);
+}
+
+/*
+ * The first candidate rule at or after r in the main filter ruleset, or
+ * NULL if there is none.
+ */
+struct pf_rule *
+pf_rule_class_next(struct pf_rule_class *rc, struct pf_rclass_match *rcm,
+    struct pf_rule *r)
+{
+	u_int32_t w, i;
+	u_int64_t bits, mask;
+	int d;
+
+	i = r->nr;
+	if (i >= rc->nrules || rc->rules[i] != r)
+		return (r);	/* not ours; leave it to the caller */
+
+	mask = ~0ULL << (i & 63);
+	for (w = i >> 6; w < rc->nwords; w++, mask = ~0ULL) {
+		bits = mask;
+		for (d = 0; d < rcm->n && bits != 0; d++)
+			bits &= rcm->v[d][w];
+		if (bits != 0)
+			return (rc->rules[(w << 6) + __builtin_ctzll(bits)]);
+	}
+	return (NULL);
+}
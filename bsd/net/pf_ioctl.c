@@ -274,6 +274,8 @@ static int		 pf_rtlabel_add(struct pf_addr_wrap *);
 static void		 pf_rtlabel_remove(struct pf_addr_wrap *);
 static void		 pf_rtlabel_copyout(struct pf_addr_wrap *);
 
+static int pf_af_test(int, struct ifnet *, struct mbuf **, int,
+    struct ip_fw_args *);
 #if INET
 static int pf_inet_hook(struct ifnet *, struct mbuf **, int,
     struct ip_fw_args *);
@@ -441,12 +443,14 @@ pfinit(void)
 	pf_perim_lock_grp = lck_grp_alloc_init("pf_perim",
 	    pf_perim_lock_grp_attr);
 	pf_perim_lock_attr = lck_attr_alloc_init();
-	lck_rw_init(pf_perim_lock, pf_perim_lock_grp, pf_perim_lock_attr);
+	pf_perim_lock = lck_brw_alloc_init(pf_perim_lock_grp,
+	    pf_perim_lock_attr);
 
 	pf_lock_grp_attr = lck_grp_attr_alloc_init();
 	pf_lock_grp = lck_grp_alloc_init("pf", pf_lock_grp_attr);
 	pf_lock_attr = lck_attr_alloc_init();
 	lck_mtx_init(pf_lock, pf_lock_grp, pf_lock_attr);
+	pf_state_shard_init(pf_lock_grp, pf_lock_attr);
 
 	pool_init(&pf_rule_pl, sizeof (struct pf_rule), 0, 0, 0, "pfrulepl",
 	    NULL);
@@ -1331,6 +1335,7 @@ pf_commit_rules(u_int32_t ticket, int rs_num, char *anchor)
 	rs->rules[rs_num].active.ticket =
 	    rs->rules[rs_num].inactive.ticket;
 	pf_calc_skip_steps(rs->rules[rs_num].active.ptr);
+	pf_compile_rules(rs, rs_num);
 
 
 	/* Purge the old rule list. */
@@ -1736,9 +1741,9 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 #endif /* PF_ALTQ */
 
 	if (flags & FWRITE)
-		lck_rw_lock_exclusive(pf_perim_lock);
+		lck_brw_lock_exclusive(pf_perim_lock);
 	else
-		lck_rw_lock_shared(pf_perim_lock);
+		lck_brw_lock_shared(pf_perim_lock);
 
 	lck_mtx_lock(pf_lock);
 
@@ -2301,7 +2306,7 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 	}
 
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_done(pf_perim_lock);
 
 	return (error);
 }
@@ -2806,6 +2811,7 @@ static void
 pf_ruleset_cleanup(struct pf_ruleset *ruleset, int rs)
 {
 	pf_calc_skip_steps(ruleset->rules[rs].active.ptr);
+	pf_compile_rules(ruleset, rs);
 	ruleset->rules[rs].active.ticket =
 	    ++ruleset->rules[rs].inactive.ticket;
 }
@@ -3406,6 +3412,7 @@ pfioctl_ioc_rule(u_long cmd, int minordev, struct pfioc_rule *pr, struct proc *p
 		ruleset->rules[rs_num].active.ticket++;
 
 		pf_calc_skip_steps(ruleset->rules[rs_num].active.ptr);
+		pf_compile_rules(ruleset, rs_num);
 		pf_remove_if_empty_ruleset(ruleset);
 
 		break;
@@ -4730,14 +4737,18 @@ pf_af_hook(struct ifnet *ifp, struct mbuf **mppn, struct mbuf **mp,
 	int error = 0, reentry;
 	struct mbuf *nextpkt;
 
-	reentry = net_thread_check_lock(NET_THREAD_HELD_PF);
+	/*
+	 * Only pf_perim_lock is taken here; pf_af_test() decides whether
+	 * the packet can be filtered without pf_lock.  It is not recursive
+	 * for readers, hence the thread flag.
+	 */
+	reentry = net_thread_check_lock(NET_THREAD_HELD_PF_PERIM);
 	if (!reentry) {
-		lck_rw_lock_shared(pf_perim_lock);
+		lck_brw_lock_shared(pf_perim_lock);
 		if (!pf_is_enabled)
 			goto done;
 
-		lck_mtx_lock(pf_lock);
-		net_thread_set_lock(NET_THREAD_HELD_PF);
+		net_thread_set_lock(NET_THREAD_HELD_PF_PERIM);
 	}
 
 	if (mppn != NULL && *mppn != NULL)
@@ -4775,17 +4786,64 @@ pf_af_hook(struct ifnet *ifp, struct mbuf **mppn, struct mbuf **mp,
 		else
 			*mppn = nextpkt;
 	}
-	if (!reentry) {
-		net_thread_unset_lock(NET_THREAD_HELD_PF);
-		lck_mtx_unlock(pf_lock);
-	}
+	if (!reentry)
+		net_thread_unset_lock(NET_THREAD_HELD_PF_PERIM);
 done:
 	if (!reentry)
-		lck_rw_done(pf_perim_lock);
+		lck_brw_unlock_shared(pf_perim_lock);
 
 	return (error);
 }
 
+/*
+ * Run a packet through pf; called with pf_perim_lock held shared.
+ *
+ * Packets of established flows are handed to pf_test_fast() first, which
+ * filters them holding only a state shard lock.  Everything else, and
+ * anything pf_test_fast() declines, goes through pf_test()/pf_test6()
+ * under pf_lock.  A thread reentering pf from within pf_test() (e.g.
+ * pf_route() or pf_send_tcp()) already owns pf_lock and stays on the
+ * slow path.
+ */
+static int
+pf_af_test(int dir, struct ifnet *ifp, struct mbuf **mp, int af,
+    struct ip_fw_args *fwa)
+{
+	int action = PF_PASS, locked;
+
+	locked = net_thread_check_lock(NET_THREAD_HELD_PF);
+	if (!locked && fwa == NULL &&
+	    pf_test_fast(dir, ifp, mp, af, &action))
+		return (action);
+
+	if (!locked) {
+		lck_mtx_lock(pf_lock);
+		net_thread_set_lock(NET_THREAD_HELD_PF);
+	}
+
+	switch (af) {
+#if INET
+	case AF_INET:
+		action = pf_test(dir, ifp, mp, NULL, fwa);
+		break;
+#endif /* INET */
+#if INET6
+	case AF_INET6:
+		action = pf_test6(dir, ifp, mp, NULL, fwa);
+		break;
+#endif /* INET6 */
+	default:
+		VERIFY(0);
+		/* NOTREACHED */
+	}
+
+	if (!locked) {
+		net_thread_unset_lock(NET_THREAD_HELD_PF);
+		lck_mtx_unlock(pf_lock);
+	}
+	return (action);
+}
+
 
 #if INET
 static int
@@ -4820,7 +4878,8 @@ pf_inet_hook(struct ifnet *ifp, struct mbuf **mp, int input,
 	HTONS(ip->ip_len);
 	HTONS(ip->ip_off);
 #endif
-	if (pf_test(input ? PF_IN : PF_OUT, ifp, mp, NULL, fwa) != PF_PASS) {
+	if (pf_af_test(input ? PF_IN : PF_OUT, ifp, mp, AF_INET,
+	    fwa) != PF_PASS) {
 		if (*mp != NULL) {
 			m_freem(*mp);
 			*mp = NULL;
@@ -4867,7 +4926,8 @@ pf_inet6_hook(struct ifnet *ifp, struct mbuf **mp, int input,
 		}
 	}
 
-	if (pf_test6(input ? PF_IN : PF_OUT, ifp, mp, NULL, fwa) != PF_PASS) {
+	if (pf_af_test(input ? PF_IN : PF_OUT, ifp, mp, AF_INET6,
+	    fwa) != PF_PASS) {
 		if (*mp != NULL) {
 			m_freem(*mp);
 			*mp = NULL;
@@ -4883,7 +4943,7 @@ pf_inet6_hook(struct ifnet *ifp, struct mbuf **mp, int input,
 int
 pf_ifaddr_hook(struct ifnet *ifp, unsigned long cmd)
 {
-	lck_rw_lock_shared(pf_perim_lock);
+	lck_brw_lock_shared(pf_perim_lock);
 	lck_mtx_lock(pf_lock);
 
 	switch (cmd) {
@@ -4904,7 +4964,7 @@ pf_ifaddr_hook(struct ifnet *ifp, unsigned long cmd)
 	}
 
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_unlock_shared(pf_perim_lock);
 	return (0);
 }
 
@@ -4914,14 +4974,14 @@ pf_ifaddr_hook(struct ifnet *ifp, unsigned long cmd)
 void
 pf_ifnet_hook(struct ifnet *ifp, int attach)
 {
-	lck_rw_lock_shared(pf_perim_lock);
+	lck_brw_lock_shared(pf_perim_lock);
 	lck_mtx_lock(pf_lock);
 	if (attach)
 		pfi_attach_ifnet(ifp);
 	else
 		pfi_detach_ifnet(ifp);
 	lck_mtx_unlock(pf_lock);
-	lck_rw_done(pf_perim_lock);
+	lck_brw_unlock_shared(pf_perim_lock);
 }
 
 static void
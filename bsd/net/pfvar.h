@@ -87,6 +87,7 @@ extern "C" {
 #include <kern/kern_types.h>
 #include <kern/zalloc.h>
 #include <kern/lock.h>
+#include <libkern/OSAtomic.h>
 
 #include <machine/endian.h>
 #include <sys/systm.h>
@@ -99,7 +100,7 @@ extern "C" {
 
 #define	be64toh(x)	htobe64(x)
 
-__private_extern__ lck_rw_t *pf_perim_lock;
+__private_extern__ lck_brw_t *pf_perim_lock;
 __private_extern__ lck_mtx_t *pf_lock;
 
 struct pool {
@@ -940,6 +941,7 @@ struct pf_state_peer {
 TAILQ_HEAD(pf_state_queue, pf_state);
 
 struct pf_state;
+struct pf_state_shard;
 struct pf_pdesc;
 struct pf_app_state;
 
@@ -1345,10 +1347,6 @@ RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_ext_gwy, pf_state_key,
 
 RB_HEAD(pfi_ifhead, pfi_kif);
 
-/* state tables */
-__private_extern__ struct pf_state_tree_lan_ext	 pf_statetbl_lan_ext;
-__private_extern__ struct pf_state_tree_ext_gwy	 pf_statetbl_ext_gwy;
-
 /* keep synced with pfi_kif, used in RB_FIND */
 struct pfi_kif_cmp {
 	char				 pfik_name[IFNAMSIZ];
@@ -1430,12 +1428,15 @@ struct pf_pdesc {
 #define PFDESC_IP_REAS	0x0002		/* IP frags would've been reassembled */
 #define	PFDESC_FLOW_ADV	0x0004		/* sender can use flow advisory */
 #define PFDESC_IP_FRAG	0x0008		/* This is a fragment */
+#define	PFDESC_FASTPATH	0x0010		/* pf_test_fast(), no pf_lock */
+#define	PFDESC_SLOWPATH	0x0020		/* state needs pf_lock after all */
 	sa_family_t	 af;
 	u_int8_t	 proto;
 	u_int8_t	 tos;
 	u_int8_t	 proto_variant;
 	mbuf_svc_class_t sc;
 	u_int32_t	 flowhash;	/* flow hash to identify the sender */
+	struct pf_state_shard *pss;	/* state shard locked for this packet */
 };
 #endif /* KERNEL */
 
@@ -1575,7 +1576,8 @@ struct pf_pdesc {
 		if ((a) != NULL) \
 			*(a) = (x); \
 		if (x < PFRES_MAX) \
-			pf_status.counters[x]++; \
+			OSAddAtomic64(1, \
+			    (volatile SInt64 *)&pf_status.counters[x]); \
 	} while (0)
 #endif /* KERNEL */
 
@@ -2164,6 +2166,31 @@ __private_extern__ int pf_tbladdr_setup(struct pf_ruleset *,
 __private_extern__ void pf_tbladdr_remove(struct pf_addr_wrap *);
 __private_extern__ void pf_tbladdr_copyout(struct pf_addr_wrap *);
 __private_extern__ void pf_calc_skip_steps(struct pf_rulequeue *);
+
+/* dimensions of the compiled filter ruleset, see pf_compile.c */
+enum {
+	PF_RCLASS_DIR,
+	PF_RCLASS_AF,
+	PF_RCLASS_PROTO,
+	PF_RCLASS_SRC_PORT,
+	PF_RCLASS_DST_PORT,
+	PF_RCLASS_SRC_ADDR4,
+	PF_RCLASS_DST_ADDR4,
+	PF_RCLASS_MAX
+};
+
+struct pf_rule_class;
+struct pf_rclass_match {
+	u_int64_t	*v[PF_RCLASS_MAX];	/* bitmaps of the packet */
+	int		 n;
+};
+
+__private_extern__ void pf_compile_rules(struct pf_ruleset *, int);
+__private_extern__ struct pf_rule_class *pf_rule_class_lookup(
+    struct pf_rclass_match *, int, struct pf_pdesc *, struct pf_addr *,
+    struct pf_addr *, struct tcphdr *);
+__private_extern__ struct pf_rule *pf_rule_class_next(struct pf_rule_class *,
+    struct pf_rclass_match *, struct pf_rule *);
 __private_extern__ u_int32_t pf_calc_state_key_flowhash(struct pf_state_key *);
 
 __private_extern__ struct pool pf_src_tree_pl, pf_rule_pl;
@@ -2177,6 +2204,7 @@ __private_extern__ struct pool pf_app_state_pl;
 __private_extern__ struct thread *pf_purge_thread;
 
 __private_extern__ void pfinit(void);
+__private_extern__ void pf_state_shard_init(lck_grp_t *, lck_attr_t *);
 __private_extern__ void pf_purge_thread_fn(void *, wait_result_t);
 __private_extern__ void pf_purge_expired_src_nodes(void);
 __private_extern__ void pf_purge_expired_states(u_int32_t);
@@ -2201,6 +2229,8 @@ __private_extern__ void pf_addrcpy(struct pf_addr *, struct pf_addr *,
 __private_extern__ void pf_rm_rule(struct pf_rulequeue *, struct pf_rule *);
 
 struct ip_fw_args;
+__private_extern__ int pf_test_fast(int, struct ifnet *, struct mbuf **, int,
+    int *);
 #if INET
 __private_extern__ int pf_test(int, struct ifnet *, struct mbuf **,
     struct ether_header *, struct ip_fw_args *);
@@ -204,10 +204,11 @@ pktsched_teardown(struct ifclassq *ifq)
 
 	IFCQ_LOCK_ASSERT_HELD(ifq);
 
-	if_qflush(ifq->ifcq_ifp, 1);
+	if_qflush_ifq(ifq, 1);
 	VERIFY(IFCQ_IS_EMPTY(ifq));
 
-	ifq->ifcq_flags &= ~IFCQF_ENABLED;
+	/* a new discipline starts out unthrottled */
+	ifq->ifcq_flags &= ~(IFCQF_ENABLED | IFCQF_THROTTLE);
 
 	switch (ifq->ifcq_type) {
 	case PKTSCHEDT_NONE:
@@ -535,7 +535,7 @@ fairq_class_create(struct fairq_if *fif, int pri, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 		if (flags & FARF_SFB) {
 			if (!(cl->cl_flags & FARF_LAZY))
-				cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+				cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 				    cl->cl_qlimit, cl->cl_qflags);
 			if (cl->cl_sfb != NULL || (cl->cl_flags & FARF_LAZY))
 				cl->cl_qtype = Q_SFB;
@@ -878,7 +878,7 @@ fairq_addq(struct fairq_class *cl, struct mbuf *m, struct pf_mtag *t)
 			VERIFY(cl->cl_flags & FARF_LAZY);
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+			cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 			    cl->cl_qlimit, cl->cl_qflags);
 			if (cl->cl_sfb == NULL) {
 				/* fall back to droptail */
@@ -514,7 +514,7 @@ hfsc_class_create(struct hfsc_if *hif, struct service_curve *rsc,
 #endif /* CLASSQ_BLUE */
 		if (flags & HFCF_SFB) {
 			if (!(cl->cl_flags & HFCF_LAZY))
-				cl->cl_sfb = sfb_alloc(ifp, qid,
+				cl->cl_sfb = sfb_alloc(ifq, qid,
 				    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb != NULL || (cl->cl_flags & HFCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
@@ -948,7 +948,7 @@ hfsc_addq(struct hfsc_class *cl, struct mbuf *m, struct pf_mtag *t)
 			VERIFY(cl->cl_flags & HFCF_LAZY);
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+			cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 			    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb == NULL) {
 				/* fall back to droptail */
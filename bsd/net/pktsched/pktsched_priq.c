@@ -469,7 +469,7 @@ priq_class_create(struct priq_if *pif, int pri, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 		if (flags & PRCF_SFB) {
 			if (!(cl->cl_flags & PRCF_LAZY))
-				cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+				cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 				    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb != NULL || (cl->cl_flags & PRCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
@@ -694,7 +694,7 @@ priq_addq(struct priq_class *cl, struct mbuf *m, struct pf_mtag *t)
 			cl->cl_flags &= ~PRCF_LAZY;
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+			cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 			    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb == NULL) {
 				/* fall back to droptail */
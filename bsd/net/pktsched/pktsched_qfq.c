@@ -178,8 +178,9 @@ qfq_init(void)
 }
 
 struct qfq_if *
-qfq_alloc(struct ifnet *ifp, int how, boolean_t altq)
+qfq_alloc(struct ifclassq *ifq, int how, boolean_t altq)
 {
+	struct ifnet	*ifp = ifq->ifcq_ifp;
 	struct qfq_if	*qif;
 
 	qif = (how == M_WAITOK) ? zalloc(qfq_zone) : zalloc_noblock(qfq_zone);
@@ -187,7 +188,7 @@ qfq_alloc(struct ifnet *ifp, int how, boolean_t altq)
 		return (NULL);
 
 	bzero(qif, qfq_size);
-	qif->qif_ifq = &ifp->if_snd;
+	qif->qif_ifq = ifq;
 	if (altq) {
 		qif->qif_maxclasses = QFQ_MAX_CLASSES;
 		qif->qif_maxslots = QFQ_MAX_SLOTS;
@@ -625,7 +626,7 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 		if (flags & QFCF_SFB) {
 			if (!(cl->cl_flags & QFCF_LAZY))
-				cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+				cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 				    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb != NULL || (cl->cl_flags & QFCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
@@ -1328,7 +1329,7 @@ qfq_addq(struct qfq_class *cl, struct mbuf *m, struct pf_mtag *t)
 			cl->cl_flags &= ~QFCF_LAZY;
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+			cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 			    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb == NULL) {
 				/* fall back to droptail */
@@ -1756,7 +1757,6 @@ qfq_request_ifclassq(struct ifclassq *ifq, cqrq_t req, void *arg)
 int
 qfq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 {
-	struct ifnet *ifp = ifq->ifcq_ifp;
 	struct qfq_class *cl0, *cl1, *cl2, *cl3, *cl4;
 	struct qfq_class *cl5, *cl6, *cl7, *cl8, *cl9;
 	struct qfq_if *qif;
@@ -1780,7 +1780,7 @@ qfq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 	if (flags & PKTSCHEDF_QALG_FLOWCTL)
 		qflags |= QFCF_FLOWCTL;
 
-	qif = qfq_alloc(ifp, M_WAITOK, FALSE);
+	qif = qfq_alloc(ifq, M_WAITOK, FALSE);
 	if (qif == NULL)
 		return (ENOMEM);
 
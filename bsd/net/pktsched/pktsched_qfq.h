@@ -280,7 +280,7 @@ struct qfq_if {
 struct if_ifclassq_stats;
 
 extern void qfq_init(void);
-extern struct qfq_if *qfq_alloc(struct ifnet *, int, boolean_t);
+extern struct qfq_if *qfq_alloc(struct ifclassq *, int, boolean_t);
 extern int qfq_destroy(struct qfq_if *);
 extern void qfq_purge(struct qfq_if *);
 extern void qfq_event(struct qfq_if *, cqev_t);
@@ -391,7 +391,7 @@ rmc_newclass(int pri, struct rm_ifdat *ifd, u_int32_t nsecPerByte,
 #endif /* CLASSQ_BLUE */
 		if (flags & RMCF_SFB) {
 			if (!(cl->flags_ & RMCF_LAZY))
-				cl->sfb_ = sfb_alloc(ifp, qid,
+				cl->sfb_ = sfb_alloc(ifq, qid,
 				    qlimit(&cl->q_), cl->qflags_);
 			if (cl->sfb_ != NULL || (cl->flags_ & RMCF_LAZY))
 				qtype(&cl->q_) = Q_SFB;
@@ -1702,7 +1702,7 @@ _rmc_addq(rm_class_t *cl, struct mbuf *m, struct pf_mtag *t)
 			VERIFY(cl->flags_ & RMCF_LAZY);
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->sfb_ = sfb_alloc(ifp, cl->stats_.handle,
+			cl->sfb_ = sfb_alloc(ifq, cl->stats_.handle,
 			    qlimit(&cl->q_), cl->qflags_);
 			if (cl->sfb_ == NULL) {
 				/* fall back to droptail */
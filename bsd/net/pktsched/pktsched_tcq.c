@@ -112,8 +112,9 @@ tcq_init(void)
 }
 
 struct tcq_if *
-tcq_alloc(struct ifnet *ifp, int how, boolean_t altq)
+tcq_alloc(struct ifclassq *ifq, int how, boolean_t altq)
 {
+	struct ifnet	*ifp = ifq->ifcq_ifp;
 	struct tcq_if	*tif;
 
 	tif = (how == M_WAITOK) ? zalloc(tcq_zone) : zalloc_noblock(tcq_zone);
@@ -122,7 +123,7 @@ tcq_alloc(struct ifnet *ifp, int how, boolean_t altq)
 
 	bzero(tif, tcq_size);
 	tif->tif_maxpri = -1;
-	tif->tif_ifq = &ifp->if_snd;
+	tif->tif_ifq = ifq;
 	if (altq)
 		tif->tif_flags |= TCQIFF_ALTQ;
 
@@ -441,7 +442,7 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 		if (flags & TQCF_SFB) {
 			if (!(cl->cl_flags & TQCF_LAZY))
-				cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+				cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 				    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb != NULL || (cl->cl_flags & TQCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
@@ -655,7 +656,7 @@ tcq_addq(struct tcq_class *cl, struct mbuf *m, struct pf_mtag *t)
 			cl->cl_flags &= ~TQCF_LAZY;
 			IFCQ_CONVERT_LOCK(ifq);
 
-			cl->cl_sfb = sfb_alloc(ifp, cl->cl_handle,
+			cl->cl_sfb = sfb_alloc(ifq, cl->cl_handle,
 			    qlimit(&cl->cl_q), cl->cl_qflags);
 			if (cl->cl_sfb == NULL) {
 				/* fall back to droptail */
@@ -958,7 +959,6 @@ tcq_request_ifclassq(struct ifclassq *ifq, cqrq_t req, void *arg)
 int
 tcq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 {
-	struct ifnet *ifp = ifq->ifcq_ifp;
 	struct tcq_class *cl0, *cl1, *cl2, *cl3;
 	struct tcq_if *tif;
 	u_int32_t maxlen = 0, qflags = 0;
@@ -981,7 +981,7 @@ tcq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 	if (flags & PKTSCHEDF_QALG_FLOWCTL)
 		qflags |= TQCF_FLOWCTL;
 
-	tif = tcq_alloc(ifp, M_WAITOK, FALSE);
+	tif = tcq_alloc(ifq, M_WAITOK, FALSE);
 	if (tif == NULL)
 		return (ENOMEM);
 
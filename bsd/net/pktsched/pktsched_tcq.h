@@ -137,7 +137,7 @@ struct tcq_if {
 struct if_ifclassq_stats;
 
 extern void tcq_init(void);
-extern struct tcq_if *tcq_alloc(struct ifnet *, int, boolean_t);
+extern struct tcq_if *tcq_alloc(struct ifclassq *, int, boolean_t);
 extern int tcq_destroy(struct tcq_if *);
 extern void tcq_purge(struct tcq_if *);
 extern void tcq_event(struct tcq_if *, cqev_t);
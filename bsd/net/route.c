@@ -756,6 +756,7 @@ route_init(void)
 	rn_init();	/* initialize all zeroes, all ones, mask table */
 	lck_mtx_unlock(rnh_lock);
 	rtable_init((void **)rt_tables);
+	rtfib_init();
 
 	if (rte_debug & RTD_DEBUG)
 		size = sizeof (struct rtentry_dbg);
@@ -825,6 +826,12 @@ void
 rtalloc_ign(struct route *ro, uint32_t ignore)
 {
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (ro->ro_rt == NULL &&
+	    (ro->ro_rt = rtfib_lookup(&ro->ro_dst, ignore,
+	    IFSCOPE_NONE)) != NULL) {
+		ro->ro_rt->generation_id = route_generation;
+		return;
+	}
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, IFSCOPE_NONE);
 	lck_mtx_unlock(rnh_lock);
@@ -834,6 +841,12 @@ void
 rtalloc_scoped_ign(struct route *ro, uint32_t ignore, unsigned int ifscope)
 {
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	/* IPv4 lookups try the multibit trie first; see route_fib.c */
+	if (ro->ro_rt == NULL &&
+	    (ro->ro_rt = rtfib_lookup(&ro->ro_dst, ignore, ifscope)) != NULL) {
+		ro->ro_rt->generation_id = route_generation;
+		return;
+	}
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, ifscope);
 	lck_mtx_unlock(rnh_lock);
@@ -1681,6 +1694,8 @@ rtrequest_common_locked(int req, struct sockaddr *dst0,
 		if (rn->rn_flags & (RNF_ACTIVE | RNF_ROOT))
 			panic ("rtrequest delete");
 		rt = (struct rtentry *)rn;
+		if (af == AF_INET)
+			rtfib_delete(rt);
 
 		/*
 		 * Take an extra reference to handle the deletion of a route
@@ -1966,6 +1981,8 @@ makeroute:
 			rte_free(rt);
 			senderr(EEXIST);
 		}
+		if (af == AF_INET)
+			rtfib_insert(rt);
 
 		rt->rt_parent = NULL;
 
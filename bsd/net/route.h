@@ -542,6 +542,10 @@ extern u_int64_t rt_expiry(struct rtentry *, u_int64_t, u_int32_t);
 extern void rt_set_idleref(struct rtentry *);
 extern void rt_clear_idleref(struct rtentry *);
 extern void rt_aggdrain(int);
+extern void rtfib_init(void);
+extern void rtfib_insert(struct rtentry *);
+extern void rtfib_delete(struct rtentry *);
+extern struct rtentry *rtfib_lookup(struct sockaddr *, uint32_t, unsigned int);
 extern boolean_t rt_validate(struct rtentry *);
 extern void rt_set_proxy(struct rtentry *, boolean_t);
 extern void rt_set_gwroute(struct rtentry *, struct sockaddr *,
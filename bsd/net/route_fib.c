@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Read-optimized IPv4 forwarding table.
+ *
+ * A copy of the AF_INET routing table as a DIR-16-8-8 multibit trie: the
+ * top 16 bits of the destination index a 64k entry table, and the next
+ * two bytes index 256 entry tables hanging off it where routes longer
+ * than /16 (and /24) exist.  Prefixes are expanded ("leaf pushed") into
+ * every slot they cover that no more specific prefix owns, so a lookup is
+ * at most three dependent loads instead of a walk through radix nodes.
+ * Non-scoped routes live in one trie; with scoped routing enabled, each
+ * interface that has RTF_IFSCOPE routes gets its own.
+ *
+ * The tries are updated from rtrequest_common_locked() on every add and
+ * delete, under rnh_lock and rtfib_lock held exclusive.  rtfib_lookup(),
+ * called by rtalloc_ign() and rtalloc_scoped_ign() before they take
+ * rnh_lock, holds rtfib_lock shared, a big-reader lock whose read side
+ * touches only a per-CPU counter, so forwarding lookups from different
+ * CPUs don't contend on anything.  It repeats the decisions rt_lookup()
+ * makes between the scoped and non-scoped results, and returns NULL,
+ * sending the caller to the radix tree, for anything with side effects
+ * there: routes that would be cloned, expiring routes whose first
+ * reference revalidates them, condemned routes and a busy rt_lock.  The
+ * table is not used while any AF_INET route has a non-contiguous mask.
+ *
+ * IPv6 is not covered: a 128-bit key would need up to 15 levels, and the
+ * host routes created by neighbor discovery would each cost a chain of
+ * tables.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/sysctl.h>
+#include <sys/malloc.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <kern/locks.h>
+
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/route.h>
+#include <net/radix.h>
+
+#include <netinet/in.h>
+#include <netinet/in_var.h>
+#include <netinet/ip_var.h>
+
+#define	RTFIB_L0_BITS	16
+#define	RTFIB_L0_SIZE	(1 << RTFIB_L0_BITS)
+#define	RTFIB_LN_BITS	8
+#define	RTFIB_LN_SIZE	(1 << RTFIB_LN_BITS)
+#define	RTFIB_CHILD	0x80000000U	/* entry is a child table index */
+#define	RTFIB_HASH_SIZE	(1 << 16)	/* buckets of the prefix index */
+#define	RTPRF_OURS	RTF_PROTO3	/* as in in_rmx.c */
+
+/* a route in the table; entries refer to these by index, 0 is none */
+struct rtfib_route {
+	struct rtentry	*rf_rt;
+	u_int32_t	 rf_prefix;	/* host order */
+	unsigned int	 rf_scope;
+	u_int8_t	 rf_plen;
+	u_int32_t	 rf_next;	/* hash chain or free list */
+};
+
+struct rtfib {
+	SLIST_ENTRY(rtfib) fib_link;
+	unsigned int	 fib_scope;	/* IFSCOPE_NONE for non-scoped */
+	u_int32_t	 fib_nroutes;
+	u_int32_t	*fib_l0;
+};
+
+static SLIST_HEAD(, rtfib) rtfib_scoped;	/* per-interface tries */
+static struct rtfib *rtfib_main;		/* non-scoped trie */
+
+static struct rtfib_route *rtfib_routes;
+static u_int32_t rtfib_nroutes;		/* slots in rtfib_routes */
+static u_int32_t rtfib_route_free;
+static u_int32_t *rtfib_hash;
+
+static u_int32_t **rtfib_tbl;		/* second and third level tables */
+static u_int32_t rtfib_ntbl;		/* slots in rtfib_tbl */
+static u_int32_t rtfib_tbl_free;	/* free slot list, via slot 0 entry */
+
+static lck_brw_t *rtfib_lock;
+static lck_grp_t *rtfib_lock_grp;
+static lck_grp_attr_t *rtfib_lock_grp_attr;
+
+static int rtfib_enabled = 1;
+static int rtfib_broken;		/* out of memory; rebuild to reuse */
+static u_int32_t rtfib_noncontig;	/* routes with unusable masks */
+
+struct rtfib_stats {
+	u_int32_t	routes;
+	u_int32_t	tables;
+	u_int32_t	scopes;
+	u_int32_t	noncontig;
+	u_int32_t	broken;
+};
+
+static int sysctl_rtfib_enabled SYSCTL_HANDLER_ARGS;
+static int sysctl_rtfib_stats SYSCTL_HANDLER_ARGS;
+
+SYSCTL_PROC(_net_inet_ip, OID_AUTO, fib, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_LOCKED,
+    &rtfib_enabled, 0, sysctl_rtfib_enabled, "I",
+    "Use the multibit trie for IPv4 route lookups");
+SYSCTL_PROC(_net_inet_ip, OID_AUTO, fib_stats, CTLTYPE_STRUCT|CTLFLAG_RD|
+    CTLFLAG_LOCKED, 0, 0, sysctl_rtfib_stats, "S,rtfib_stats",
+    "IPv4 multibit trie statistics");
+
+static int rtfib_prefix(struct rtentry *, u_int32_t *, u_int8_t *);
+static struct rtfib *rtfib_get(unsigned int, int);
+static u_int32_t rtfib_hash_find(u_int32_t, u_int8_t, unsigned int);
+static int rtfib_tbl_alloc(u_int32_t);
+static void rtfib_tbl_collapse(u_int32_t *);
+static void rtfib_fill(u_int32_t *, u_int32_t, u_int8_t, u_int32_t);
+static void rtfib_replace(u_int32_t *, u_int32_t, u_int32_t, u_int32_t);
+static int rtfib_update(struct rtfib *, u_int32_t, u_int8_t, u_int32_t,
+    u_int32_t);
+static void rtfib_insert_locked(struct rtentry *);
+static void rtfib_flush_locked(void);
+static int rtfib_rebuild_walk(struct radix_node *, void *);
+
+#define	RTFIB_HASH(p, l, s)	\
+	((((p) * 0x9e3779b1U) ^ ((l) << 8) ^ (s)) & (RTFIB_HASH_SIZE - 1))
+#define	RTFIB_MASK(l)		((l) == 0 ? 0 : (0xffffffffU << (32 - (l))))
+
+void
+rtfib_init(void)
+{
+	rtfib_lock_grp_attr = lck_grp_attr_alloc_init();
+	rtfib_lock_grp = lck_grp_alloc_init("rtfib", rtfib_lock_grp_attr);
+	rtfib_lock = lck_brw_alloc_init(rtfib_lock_grp, LCK_ATTR_NULL);
+	SLIST_INIT(&rtfib_scoped);
+
+	rtfib_hash = _MALLOC(RTFIB_HASH_SIZE * sizeof (*rtfib_hash),
+	    M_RTABLE, M_WAITOK | M_ZERO);
+	rtfib_main = rtfib_get(IFSCOPE_NONE, 1);
+	if (rtfib_hash == NULL || rtfib_main == NULL)
+		rtfib_broken = 1;
+}
+
+/*
+ * Prefix and length of an AF_INET route, in host order.  Returns 0 if
+ * its mask is not contiguous and the route can't be put in the table.
+ */
+static int
+rtfib_prefix(struct rtentry *rt, u_int32_t *prefix, u_int8_t *plen)
+{
+	struct sockaddr *mask = rt_mask(rt);
+	u_int8_t *mp;
+	u_int32_t m = 0;
+	int i, avail;
+
+	if (mask == NULL || (rt->rt_flags & RTF_HOST)) {
+		m = 0xffffffffU;
+	} else {
+		/* radix masks may be truncated; missing bytes are zero */
+		mp = (u_int8_t *)&((struct sockaddr_in *)(void *)mask)->sin_addr;
+		avail = mask->sa_len -
+		    (int)offsetof(struct sockaddr_in, sin_addr);
+		for (i = 0; i < 4; i++)
+			m = (m << 8) | (i < avail ? mp[i] : 0);
+		if ((m | (m - 1)) != 0xffffffffU && m != 0)
+			return (0);
+	}
+	*plen = (m == 0) ? 0 : (u_int8_t)(33 - ffs(m));
+	*prefix = ntohl(((struct sockaddr_in *)(void *)rt_key(rt))->
+	    sin_addr.s_addr) & m;
+	return (1);
+}
+
+/* find, or with create set, allocate the trie of a scope */
+static struct rtfib *
+rtfib_get(unsigned int scope, int create)
+{
+	struct rtfib *fib;
+
+	if (scope == IFSCOPE_NONE && rtfib_main != NULL)
+		return (rtfib_main);
+	SLIST_FOREACH(fib, &rtfib_scoped, fib_link) {
+		if (fib->fib_scope == scope)
+			return (fib);
+	}
+	if (!create)
+		return (NULL);
+
+	fib = _MALLOC(sizeof (*fib), M_RTABLE, M_NOWAIT | M_ZERO);
+	if (fib == NULL)
+		return (NULL);
+	fib->fib_l0 = _MALLOC(RTFIB_L0_SIZE * sizeof (u_int32_t), M_RTABLE,
+	    M_NOWAIT | M_ZERO);
+	if (fib->fib_l0 == NULL) {
+		_FREE(fib, M_RTABLE);
+		return (NULL);
+	}
+	fib->fib_scope = scope;
+	if (scope != IFSCOPE_NONE)
+		SLIST_INSERT_HEAD(&rtfib_scoped, fib, fib_link);
+	return (fib);
+}
+
+static u_int32_t
+rtfib_hash_find(u_int32_t prefix, u_int8_t plen, unsigned int scope)
+{
+	u_int32_t i;
+
+	for (i = rtfib_hash[RTFIB_HASH(prefix, plen, scope)]; i != 0;
+	    i = rtfib_routes[i].rf_next) {
+		if (rtfib_routes[i].rf_prefix == prefix &&
+		    rtfib_routes[i].rf_plen == plen &&
+		    rtfib_routes[i].rf_scope == scope)
+			return (i);
+	}
+	return (0);
+}
+
+/* allocate a child table filled with leaf; returns its index or 0 */
+static int
+rtfib_tbl_alloc(u_int32_t leaf)
+{
+	u_int32_t i, n, **tbl;
+
+	if (rtfib_tbl_free == 0) {
+		n = (rtfib_ntbl == 0) ? 1024 : rtfib_ntbl * 2;
+		tbl = _MALLOC(n * sizeof (*tbl), M_RTABLE, M_NOWAIT | M_ZERO);
+		if (tbl == NULL)
+			return (0);
+		if (rtfib_tbl != NULL) {
+			bcopy(rtfib_tbl, tbl, rtfib_ntbl * sizeof (*tbl));
+			_FREE(rtfib_tbl, M_RTABLE);
+		}
+		/* slot 0 is never used, so that 0 can mean failure */
+		for (i = n - 1; i >= MAX(rtfib_ntbl, 1); i--) {
+			tbl[i] = (u_int32_t *)(uintptr_t)rtfib_tbl_free;
+			rtfib_tbl_free = i;
+		}
+		rtfib_tbl = tbl;
+		rtfib_ntbl = n;
+	}
+	i = rtfib_tbl_free;
+	tbl = &rtfib_tbl[i];
+	rtfib_tbl_free = (u_int32_t)(uintptr_t)*tbl;
+	*tbl = _MALLOC(RTFIB_LN_SIZE * sizeof (u_int32_t), M_RTABLE, M_NOWAIT);
+	if (*tbl == NULL) {
+		*tbl = (u_int32_t *)(uintptr_t)rtfib_tbl_free;
+		rtfib_tbl_free = i;
+		return (0);
+	}
+	for (n = 0; n < RTFIB_LN_SIZE; n++)
+		(*tbl)[n] = leaf;
+	return (i);
+}
+
+/* replace the child table *ent refers to by a leaf if it is uniform */
+static void
+rtfib_tbl_collapse(u_int32_t *ent)
+{
+	u_int32_t i, t = *ent & ~RTFIB_CHILD, *e = rtfib_tbl[t];
+
+	for (i = 0; i < RTFIB_LN_SIZE; i++) {
+		if ((e[i] & RTFIB_CHILD) || e[i] != e[0])
+			return;
+	}
+	*ent = e[0];
+	_FREE(e, M_RTABLE);
+	rtfib_tbl[t] = (u_int32_t *)(uintptr_t)rtfib_tbl_free;
+	rtfib_tbl_free = t;
+}
+
+/* point every slot below e[0..n) owned by a shorter prefix to idx */
+static void
+rtfib_fill(u_int32_t *e, u_int32_t n, u_int8_t plen, u_int32_t idx)
+{
+	u_int32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (e[i] & RTFIB_CHILD)
+			rtfib_fill(rtfib_tbl[e[i] & ~RTFIB_CHILD],
+			    RTFIB_LN_SIZE, plen, idx);
+		else if (e[i] == 0 || rtfib_routes[e[i]].rf_plen <= plen)
+			e[i] = idx;
+	}
+}
+
+/* point every slot below e[0..n) that refers to old to new */
+static void
+rtfib_replace(u_int32_t *e, u_int32_t n, u_int32_t old, u_int32_t new)
+{
+	u_int32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (e[i] & RTFIB_CHILD) {
+			rtfib_replace(rtfib_tbl[e[i] & ~RTFIB_CHILD],
+			    RTFIB_LN_SIZE, old, new);
+			rtfib_tbl_collapse(&e[i]);
+		} else if (e[i] == old) {
+			e[i] = new;
+		}
+	}
+}
+
+/*
+ * Install route index new for prefix/plen (old == 0), or hand the slots
+ * of the deleted route old over to its covering route new.
+ */
+static int
+rtfib_update(struct rtfib *fib, u_int32_t prefix, u_int8_t plen,
+    u_int32_t old, u_int32_t new)
+{
+	u_int32_t *e = fib->fib_l0, *path[2], n, start, t;
+	int level, shift = 32 - RTFIB_L0_BITS, bits = RTFIB_L0_BITS;
+
+	for (level = 0; ; level++) {
+		if (plen <= 32 - shift) {
+			n = 1U << (32 - shift - plen);
+			start = ((prefix >> shift) & ((1U << bits) - 1)) &
+			    ~(n - 1);
+			if (old == 0)
+				rtfib_fill(e + start, n, plen, new);
+			else
+				rtfib_replace(e + start, n, old, new);
+			break;
+		}
+		path[level] = &e[(prefix >> shift) & ((1U << bits) - 1)];
+		if (!(*path[level] & RTFIB_CHILD)) {
+			if (old != 0)
+				return (0);	/* nothing of ours below */
+			if ((t = rtfib_tbl_alloc(*path[level])) == 0)
+				return (ENOMEM);
+			*path[level] = RTFIB_CHILD | t;
+		}
+		e = rtfib_tbl[*path[level] & ~RTFIB_CHILD];
+		bits = RTFIB_LN_BITS;
+		shift -= RTFIB_LN_BITS;
+	}
+	if (old != 0) {
+		while (level-- > 0)
+			rtfib_tbl_collapse(path[level]);
+	}
+	return (0);
+}
+
+static void
+rtfib_insert_locked(struct rtentry *rt)
+{
+	struct rtfib_route *rf;
+	struct rtfib *fib;
+	u_int32_t prefix, idx, h, i, n;
+	unsigned int scope;
+	u_int8_t plen;
+
+	if (rtfib_broken)
+		return;
+	if (!rtfib_prefix(rt, &prefix, &plen)) {
+		rtfib_noncontig++;
+		return;
+	}
+	scope = (rt->rt_flags & RTF_IFSCOPE) ?
+	    sin_get_ifscope(rt_key(rt)) : IFSCOPE_NONE;
+	if ((fib = rtfib_get(scope, 1)) == NULL)
+		goto nomem;
+
+	if (rtfib_route_free == 0) {
+		n = (rtfib_nroutes == 0) ? 1024 : rtfib_nroutes * 2;
+		rf = _MALLOC(n * sizeof (*rf), M_RTABLE, M_NOWAIT | M_ZERO);
+		if (rf == NULL)
+			goto nomem;
+		if (rtfib_routes != NULL) {
+			bcopy(rtfib_routes, rf, rtfib_nroutes * sizeof (*rf));
+			_FREE(rtfib_routes, M_RTABLE);
+		}
+		for (i = n - 1; i >= MAX(rtfib_nroutes, 1); i--) {
+			rf[i].rf_next = rtfib_route_free;
+			rtfib_route_free = i;
+		}
+		rtfib_routes = rf;
+		rtfib_nroutes = n;
+	}
+	idx = rtfib_route_free;
+	rf = &rtfib_routes[idx];
+	rtfib_route_free = rf->rf_next;
+	rf->rf_rt = rt;
+	rf->rf_prefix = prefix;
+	rf->rf_plen = plen;
+	rf->rf_scope = scope;
+	h = RTFIB_HASH(prefix, plen, scope);
+	rf->rf_next = rtfib_hash[h];
+	rtfib_hash[h] = idx;
+	fib->fib_nroutes++;
+
+	if (rtfib_update(fib, prefix, plen, 0, idx) == 0)
+		return;
+nomem:
+	printf("%s: out of memory, IPv4 route lookups use the radix tree "
+	    "until net.inet.ip.fib is set again\n", __func__);
+	rtfib_broken = 1;
+}
+
+/*
+ * Called by rtrequest_common_locked() once an AF_INET route has been
+ * added to the radix tree.
+ */
+void
+rtfib_insert(struct rtentry *rt)
+{
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	lck_brw_lock_exclusive(rtfib_lock);
+	rtfib_insert_locked(rt);
+	lck_brw_unlock_exclusive(rtfib_lock);
+}
+
+/*
+ * Called by rtrequest_common_locked() once an AF_INET route has been
+ * removed from the radix tree, before it can be freed.
+ */
+void
+rtfib_delete(struct rtentry *rt)
+{
+	struct rtfib *fib;
+	u_int32_t prefix, idx, parent = 0, *pp;
+	unsigned int scope;
+	u_int8_t plen, l;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	lck_brw_lock_exclusive(rtfib_lock);
+	if (!rtfib_prefix(rt, &prefix, &plen)) {
+		VERIFY(rtfib_noncontig > 0);
+		rtfib_noncontig--;
+		goto done;
+	}
+	scope = (rt->rt_flags & RTF_IFSCOPE) ?
+	    sin_get_ifscope(rt_key(rt)) : IFSCOPE_NONE;
+	if (rtfib_broken || (idx = rtfib_hash_find(prefix, plen, scope)) == 0 ||
+	    rtfib_routes[idx].rf_rt != rt ||
+	    (fib = rtfib_get(scope, 0)) == NULL)
+		goto done;
+
+	/* the slots go to the longest prefix left that covers this one */
+	for (l = plen; l-- > 0 && parent == 0; )
+		parent = rtfib_hash_find(prefix & RTFIB_MASK(l), l, scope);
+	(void) rtfib_update(fib, prefix, plen, idx, parent);
+
+	for (pp = &rtfib_hash[RTFIB_HASH(prefix, plen, scope)]; *pp != idx;
+	    pp = &rtfib_routes[*pp].rf_next)
+		;
+	*pp = rtfib_routes[idx].rf_next;
+	rtfib_routes[idx].rf_rt = NULL;
+	rtfib_routes[idx].rf_next = rtfib_route_free;
+	rtfib_route_free = idx;
+
+	if (--fib->fib_nroutes == 0 && fib != rtfib_main) {
+		SLIST_REMOVE(&rtfib_scoped, fib, rtfib, fib_link);
+		_FREE(fib->fib_l0, M_RTABLE);
+		_FREE(fib, M_RTABLE);
+	}
+done:
+	lck_brw_unlock_exclusive(rtfib_lock);
+}
+
+static void
+rtfib_flush_locked(void)
+{
+	struct rtfib *fib;
+	u_int32_t i;
+
+	while ((fib = SLIST_FIRST(&rtfib_scoped)) != NULL) {
+		SLIST_REMOVE_HEAD(&rtfib_scoped, fib_link);
+		_FREE(fib->fib_l0, M_RTABLE);
+		_FREE(fib, M_RTABLE);
+	}
+	if (rtfib_main != NULL) {
+		bzero(rtfib_main->fib_l0, RTFIB_L0_SIZE * sizeof (u_int32_t));
+		rtfib_main->fib_nroutes = 0;
+	}
+	for (i = 1; i < rtfib_ntbl; i++) {
+		/* free slots hold small indices, tables real pointers */
+		if ((uintptr_t)rtfib_tbl[i] >= rtfib_ntbl)
+			_FREE(rtfib_tbl[i], M_RTABLE);
+	}
+	if (rtfib_tbl != NULL)
+		_FREE(rtfib_tbl, M_RTABLE);
+	rtfib_tbl = NULL;
+	rtfib_ntbl = rtfib_tbl_free = 0;
+	if (rtfib_routes != NULL)
+		_FREE(rtfib_routes, M_RTABLE);
+	rtfib_routes = NULL;
+	rtfib_nroutes = rtfib_route_free = 0;
+	bzero(rtfib_hash, RTFIB_HASH_SIZE * sizeof (*rtfib_hash));
+	rtfib_noncontig = 0;
+	rtfib_broken = 0;
+}
+
+static int
+rtfib_rebuild_walk(struct radix_node *rn, void *arg)
+{
+#pragma unused(arg)
+	rtfib_insert_locked((struct rtentry *)rn);
+	return (rtfib_broken ? ENOMEM : 0);
+}
+
+static int
+sysctl_rtfib_enabled SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	struct radix_node_head *rnh;
+	int error, val = rtfib_enabled;
+
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == USER_ADDR_NULL)
+		return (error);
+
+	/* turning it on rebuilds it from the radix tree */
+	lck_mtx_lock(rnh_lock);
+	if (val && rtfib_main != NULL && rtfib_hash != NULL) {
+		lck_brw_lock_exclusive(rtfib_lock);
+		rtfib_flush_locked();
+		if ((rnh = rt_tables[AF_INET]) != NULL)
+			(void) rnh->rnh_walktree(rnh, rtfib_rebuild_walk, NULL);
+		lck_brw_unlock_exclusive(rtfib_lock);
+	}
+	rtfib_enabled = val;
+	lck_mtx_unlock(rnh_lock);
+	return (0);
+}
+
+static int
+sysctl_rtfib_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct rtfib_stats st;
+	struct rtfib *fib;
+	u_int32_t i;
+
+	bzero(&st, sizeof (st));
+	lck_mtx_lock(rnh_lock);
+	for (i = 1; i < rtfib_nroutes; i++)
+		if (rtfib_routes[i].rf_rt != NULL)
+			st.routes++;
+	for (i = 1; i < rtfib_ntbl; i++)
+		if ((uintptr_t)rtfib_tbl[i] >= rtfib_ntbl)
+			st.tables++;
+	SLIST_FOREACH(fib, &rtfib_scoped, fib_link)
+		st.scopes++;
+	st.noncontig = rtfib_noncontig;
+	st.broken = rtfib_broken;
+	lck_mtx_unlock(rnh_lock);
+
+	return (SYSCTL_OUT(req, &st, MIN(sizeof (st), req->oldlen)));
+}
+
+static __inline__ struct rtentry *
+rtfib_match(struct rtfib *fib, u_int32_t a)
+{
+	u_int32_t e;
+
+	if (fib == NULL)
+		return (NULL);
+	e = fib->fib_l0[a >> (32 - RTFIB_L0_BITS)];
+	if (e & RTFIB_CHILD) {
+		e = rtfib_tbl[e & ~RTFIB_CHILD][(a >> RTFIB_LN_BITS) &
+		    (RTFIB_LN_SIZE - 1)];
+		if (e & RTFIB_CHILD)
+			e = rtfib_tbl[e & ~RTFIB_CHILD][a &
+			    (RTFIB_LN_SIZE - 1)];
+	}
+	return (rtfib_routes[e].rf_rt);
+}
+
+#define	RTFIB_DEFAULT(rt)	\
+	(((struct sockaddr_in *)(void *)rt_key(rt))->sin_addr.s_addr == \
+	INADDR_ANY)
+
+/*
+ * the non-scoped 0.0.0.0/0 route itself, as node_lookup_default() finds
+ * it; a match on INADDR_ANY would instead return 0.0.0.0/8 if present
+ */
+static __inline__ struct rtentry *
+rtfib_default(void)
+{
+	u_int32_t i;
+
+	i = rtfib_hash_find(INADDR_ANY, 0, IFSCOPE_NONE);
+	return ((i != 0) ? rtfib_routes[i].rf_rt : NULL);
+}
+
+/*
+ * Look up dst for rtalloc_ign()/rtalloc_scoped_ign() without rnh_lock.
+ * Returns the route rt_lookup() would, with a reference held, or NULL
+ * if the caller has to go through the radix tree (which includes the
+ * case of there being no route at all, so that the miss is reported).
+ *
+ * rt_ifp is read without rnh_lock; it only changes under rnh_lock for
+ * a route that stays in the table, and racing with that is the same as
+ * looking up just before the change.
+ */
+struct rtentry *
+rtfib_lookup(struct sockaddr *dst, uint32_t ignflags, unsigned int ifscope)
+{
+	struct rtentry *rt, *rt0, *rs;
+	u_int32_t a;
+	unsigned int scope;
+
+	if (dst->sa_family != AF_INET || !rtfib_enabled || rte_debug)
+		return (NULL);
+	a = ntohl(((struct sockaddr_in *)(void *)dst)->sin_addr.s_addr);
+
+	lck_brw_lock_shared(rtfib_lock);
+	if (rtfib_broken || rtfib_noncontig != 0) {
+		rt = NULL;
+		goto done;
+	}
+
+	rt0 = rt = rtfib_match(rtfib_main, a);
+	if (!ip_doscopedroute || (rt0 != NULL && rt0->rt_ifp == lo_ifp))
+		goto found;
+
+	/* same choices as the scoped part of rt_lookup() */
+	if (ifscope == IFSCOPE_NONE) {
+		scope = get_primary_ifscope(AF_INET);
+		if (rt0 != NULL && rt0->rt_ifp->if_index != scope)
+			scope = rt0->rt_ifp->if_index;
+	} else {
+		scope = ifscope;
+		if (rt0 != NULL && rt0->rt_ifp->if_index != scope)
+			rt0 = NULL;
+	}
+	rs = (scope == IFSCOPE_NONE) ? NULL :
+	    rtfib_match(rtfib_get(scope, 0), a);
+	rt = rs;
+	if (rs == NULL || (rt0 != NULL &&
+	    ((RTFIB_DEFAULT(rs) && !RTFIB_DEFAULT(rt0)) ||
+	    (!(rs->rt_flags & RTF_HOST) && (rt0->rt_flags & RTF_HOST)))))
+		rt = rt0;
+	if (rt == NULL && (rt = rtfib_default()) != NULL &&
+	    rt->rt_ifp->if_index != scope)
+		rt = NULL;
+
+found:
+	if (rt == NULL)
+		goto done;
+	if (!lck_mtx_try_lock_spin(&rt->rt_lock)) {
+		rt = NULL;
+		goto done;
+	}
+	/*
+	 * Leave the cloning, and the revalidation of an unreferenced
+	 * llinfo route done by rt_validate(), to rtalloc1_common_locked().
+	 */
+	if ((rt->rt_flags & (RTF_UP | RTF_CONDEMNED)) != RTF_UP ||
+	    ((rt->rt_flags & ~ignflags) & (RTF_CLONING | RTF_PRCLONING)) ||
+	    (rt->rt_refcnt == 0 && (rt->rt_flags & RTF_LLINFO))) {
+		RT_UNLOCK(rt);
+		rt = NULL;
+		goto done;
+	}
+	/* first reference to a route in_rtqkill() manages; as in_validate() */
+	if (rt->rt_refcnt == 0 && (rt->rt_flags & RTPRF_OURS)) {
+		rt->rt_flags &= ~RTPRF_OURS;
+		rt_setexpire(rt, 0);
+	}
+	RT_ADDREF_LOCKED(rt);
+	RT_UNLOCK(rt);
+done:
+	lck_brw_unlock_shared(rtfib_lock);
+	return (rt);
+}
@@ -786,6 +786,10 @@ extern u_int16_t inet_cksum(struct mbuf *m, unsigned int proto,
     unsigned int offset, unsigned int transport_len);
 extern u_short in_addword(u_short, u_short);
 extern u_short in_pseudo(u_int, u_int, u_int);
+extern uint32_t os_cpu_in_cksum(const void *, uint32_t, uint32_t);
+extern uint32_t os_cpu_copy_in_cksum(const void *, void *, uint32_t,
+    uint32_t);
+extern uint32_t m_copydata_sum(struct mbuf *, int, int, void *, uint32_t);
 
 extern int in_localaddr(struct in_addr);
 extern u_int32_t in_netof(struct in_addr);
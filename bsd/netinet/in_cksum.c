@@ -75,13 +75,9 @@
  *
  * This routine is very heavily used in the network
  * code and should be modified for each CPU to be as fast as possible.
+ * The mbuf chain itself is summed by cpu_in_cksum(); see cpu_in_cksum.c.
  */
 
-union s_util {
-        char    c[2];
-        u_short s;
-};
-
 union l_util {
         u_int16_t s[2];
         u_int32_t l;
@@ -141,8 +137,6 @@ in_pseudo(u_int a, u_int b, u_int c)
 
 }
 
-#if defined(__arm__)
-
 extern int cpu_in_cksum(struct mbuf *m, int len, int off, uint32_t initial_sum);
 
 u_int16_t
@@ -150,40 +144,7 @@ inet_cksum(struct mbuf *m, unsigned int nxt, unsigned int skip,
     unsigned int len)
 {
 	u_int32_t sum = 0;
-
-	/* sanity check */
-	if ((m->m_flags & M_PKTHDR) && m->m_pkthdr.len < skip + len) {
-		panic("inet_cksum: mbuf len (%d) < off+len (%d+%d)\n",
-		    m->m_pkthdr.len, skip, len);
-	}
-
-	/* include pseudo header checksum? */
-	if (nxt != 0) {
-		struct ip *iph;
-
-		if (m->m_len < sizeof (struct ip))
-			panic("inet_cksum: bad mbuf chain");
-
-		iph = mtod(m, struct ip *);
-		sum = in_pseudo(iph->ip_src.s_addr, iph->ip_dst.s_addr,
-		    htonl(len + nxt));
-	}
-
-	return (cpu_in_cksum(m, len, skip, sum));
-}
-
-#else
-
-u_int16_t
-inet_cksum(struct mbuf *m, unsigned int nxt, unsigned int skip,
-    unsigned int len)
-{
-	u_short *w;
-	u_int32_t sum = 0;
-	int mlen = 0;
-	int byte_swapped = 0;
-	union s_util s_util;
-	union l_util l_util;
+	u_int16_t csum;
 
 	KERNEL_DEBUG(DBG_FNC_IN_CKSUM | DBG_FUNC_START, len,0,0,0,0);
 
@@ -205,103 +166,7 @@ inet_cksum(struct mbuf *m, unsigned int nxt, unsigned int skip,
 		    htonl(len + nxt));
 	}
 
-	if (skip != 0) {
-		for (; skip && m; m = m->m_next) {
-			if (m->m_len > skip) {
-				mlen = m->m_len - skip;
-				w = (u_short *)(void *)(m->m_data+skip);
-				goto skip_start;
-			} else {
-				skip -= m->m_len;
-			}
-		}
-	}
-	for (;m && len; m = m->m_next) {
-		if (m->m_len == 0)
-			continue;
-		w = mtod(m, u_short *);
-
-		if (mlen == -1) {
-			/*
-			 * The first byte of this mbuf is the continuation
-			 * of a word spanning between this mbuf and the
-			 * last mbuf.
-			 *
-			 * s_util.c[0] is already saved when scanning previous
-			 * mbuf.
-			 */
-			s_util.c[1] = *(char *)w;
-			sum += s_util.s;
-			w = (u_short *)(void *)((char *)w + 1);
-			mlen = m->m_len - 1;
-			len--;
-		} else {
-			mlen = m->m_len;
-		}
-skip_start:
-		if (len < mlen)
-			mlen = len;
-
-		len -= mlen;
-		/*
-		 * Force to even boundary.
-		 */
-		if ((1 & (uintptr_t) w) && (mlen > 0)) {
-			REDUCE;
-			sum <<= 8;
-			s_util.c[0] = *(u_char *)w;
-			w = (u_short *)(void *)((char *)w + 1);
-			mlen--;
-			byte_swapped = 1;
-		}
-		/*
-		 * Unroll the loop to make overhead from
-		 * branches &c small.
-		 */
-		while ((mlen -= 32) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-			sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-			w += 16;
-		}
-		mlen += 32;
-		while ((mlen -= 8) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			w += 4;
-		}
-		mlen += 8;
-		if (mlen == 0 && byte_swapped == 0)
-			continue;
-		REDUCE;
-		while ((mlen -= 2) >= 0) {
-			sum += *w++;
-		}
-		if (byte_swapped) {
-			REDUCE;
-			sum <<= 8;
-			byte_swapped = 0;
-			if (mlen == -1) {
-				s_util.c[1] = *(char *)w;
-				sum += s_util.s;
-				mlen = 0;
-			} else
-				mlen = -1;
-		} else if (mlen == -1)
-			s_util.c[0] = *(char *)w;
-	}
-	if (len)
-		printf("cksum: out of data by %d\n", len);
-	if (mlen == -1) {
-		/* The last mbuf has odd # of bytes. Follow the
-		   standard (the odd byte may be shifted left by 8 bits
-		   or not as determined by endian-ness of the machine) */
-		s_util.c[1] = 0;
-		sum += s_util.s;
-	}
-	REDUCE;
+	csum = cpu_in_cksum(m, len, skip, sum);
 	KERNEL_DEBUG(DBG_FNC_IN_CKSUM | DBG_FUNC_END, 0,0,0,0,0);
-	return (~sum & 0xffff);
+	return (csum);
 }
-
-#endif
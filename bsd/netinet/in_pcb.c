@@ -174,6 +174,15 @@ SYSCTL_PROC(_net_inet_ip_portrange, OID_AUTO, hifirst, CTLTYPE_INT|CTLFLAG_RW |
 SYSCTL_PROC(_net_inet_ip_portrange, OID_AUTO, hilast, CTLTYPE_INT|CTLFLAG_RW | CTLFLAG_LOCKED,
 	   &ipport_hilastauto, 0, &sysctl_net_ipport_check, "I", "");
 
+/*
+ * Spread connections and datagrams for a local address and port across
+ * all sockets bound to it with SO_REUSEPORT, instead of always handing
+ * them to the most recently bound one.
+ */
+static int inp_reuseport_lb = 1;
+SYSCTL_INT(_net_inet_ip, OID_AUTO, reuseport_lb, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&inp_reuseport_lb, 0, "Load balance across SO_REUSEPORT sockets");
+
 extern int	udp_use_randomport;
 extern int	tcp_use_randomport;
 
@@ -660,6 +669,11 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		}
 	}
 	socket_lock(so, 0);
+	/*
+	 * inp isn't on a hash chain yet (inp_lport was 0), so lookups can't
+	 * see laddr and lport change; in_pcbinshash() links it in under the
+	 * bucket lock.
+	 */
 	inp->inp_lport = lport;
 	if (in_pcbinshash(inp, 1) != 0) {
 		inp->inp_laddr.s_addr = INADDR_ANY;
@@ -899,6 +913,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 	struct sockaddr_in ifaddr;
 	struct sockaddr_in *sin = (struct sockaddr_in *)(void *)nam;
 	struct inpcb *pcb;
+	lck_rw_t *lcks[2];
 	int error;
 
 	/*
@@ -931,27 +946,23 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 			if (error)
 			    return (error);
 		}
-		if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->mtx)) {
-			/*lock inversion issue, mostly with udp multicast packets */
-			socket_unlock(inp->inp_socket, 0);
-			lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
-			socket_lock(inp->inp_socket, 0);
-		}
+	}
+	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->mtx)) {
+		/*lock inversion issue, mostly with udp multicast packets */
+		socket_unlock(inp->inp_socket, 0);
+		lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
+		socket_lock(inp->inp_socket, 0);
+	}
+	in_pcbrehash_lock(inp, sin->sin_addr.s_addr, sin->sin_port, lcks);
+	if (inp->inp_laddr.s_addr == INADDR_ANY) {
 		inp->inp_laddr = ifaddr.sin_addr;
 		inp->inp_last_outifp = (outif != NULL) ? *outif : NULL;
 		inp->inp_flags |= INP_INADDR_ANY;
-	}
-	 else {
-		if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->mtx)) {
-			/*lock inversion issue, mostly with udp multicast packets */
-			socket_unlock(inp->inp_socket, 0);
-			lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
-			socket_lock(inp->inp_socket, 0);
-		}
 	}
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 	return (0);
 }
@@ -959,9 +970,7 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 void
 in_pcbdisconnect(struct inpcb *inp)
 {
-
-	inp->inp_faddr.s_addr = INADDR_ANY;
-	inp->inp_fport = 0;
+	lck_rw_t *lcks[2];
 
 	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->mtx)) {
 		/*lock inversion issue, mostly with udp multicast packets */
@@ -970,7 +979,11 @@ in_pcbdisconnect(struct inpcb *inp)
 		socket_lock(inp->inp_socket, 0);
 	}
 
+	in_pcbrehash_lock(inp, INADDR_ANY, 0, lcks);
+	inp->inp_faddr.s_addr = INADDR_ANY;
+	inp->inp_fport = 0;
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 
 	if (inp->inp_socket->so_state & SS_NOFDREF) 
@@ -1014,6 +1027,7 @@ in_pcbdetach(struct inpcb *inp)
 			inp->inp_route.ro_rt = NULL;
 			rtfree(rt);
 		}
+		inp_rtcache_flush(inp, 1);
 		imo = inp->inp_moptions;
 		inp->inp_moptions = NULL;
 		if (imo != NULL)
@@ -1489,6 +1503,136 @@ in_pcblookup_hash_exists(
 	return (0);
 }
 
+/*
+ * Per-bucket locks for the connection hash.
+ *
+ * in_pcblookup_hash() is called for every inbound TCP segment and UDP
+ * datagram; taking pcbinfo->mtx there makes all receive threads share a
+ * single lock cache line.  Instead, each hash chain is covered by one of
+ * a set of striped reader-writer locks, and the lookup takes just that
+ * one shared.  Everything that links or unlinks inp_hash, or changes
+ * the addresses and ports of a PCB that is on a chain, still holds
+ * pcbinfo->mtx exclusive as well, so code walking the chains under the
+ * global lock is unaffected.  Lock order is pcbinfo->mtx, then a bucket
+ * lock; at most one bucket lock is held at a time except between
+ * in_pcbrehash_lock() and in_pcbrehash_unlock(), which hold the old and
+ * new buckets, taken in address order.
+ */
+#define	INP_HASHLOCKS_MAX	512	/* power of 2 */
+
+void
+in_pcbinfo_hashlocks_init(struct inpcbinfo *pcbinfo)
+{
+	u_long n = pcbinfo->hashmask + 1, i;
+	lck_rw_t *locks;
+
+	if (n > INP_HASHLOCKS_MAX)
+		n = INP_HASHLOCKS_MAX;
+	locks = _MALLOC(n * sizeof (*locks), M_PCB, M_WAITOK | M_ZERO);
+	if (locks == NULL)
+		return;		/* lookups keep using pcbinfo->mtx */
+	for (i = 0; i < n; i++)
+		lck_rw_init(&locks[i], pcbinfo->mtx_grp, pcbinfo->mtx_attr);
+	pcbinfo->ipi_hashlockmask = n - 1;
+	pcbinfo->ipi_hashlocks = locks;
+}
+
+static __inline lck_rw_t *
+in_pcbhash_lock(struct inpcbinfo *pcbinfo, u_long bucket)
+{
+	if (pcbinfo->ipi_hashlocks == NULL)
+		return (NULL);
+	return (&pcbinfo->ipi_hashlocks[bucket & pcbinfo->ipi_hashlockmask]);
+}
+
+/*
+ * Used by the lookup: the bucket lock if there is one, else the
+ * global lock.
+ */
+static __inline lck_rw_t *
+in_pcbhash_lock_shared(struct inpcbinfo *pcbinfo, u_long bucket)
+{
+	lck_rw_t *lck = in_pcbhash_lock(pcbinfo, bucket);
+
+	if (lck == NULL)
+		lck = pcbinfo->mtx;
+	lck_rw_lock_shared(lck);
+	return (lck);
+}
+
+/*
+ * Whether inp is a member of the SO_REUSEPORT group that first, the
+ * wildcard PCB found by in_pcblookup_hash(), belongs to: bound to the same
+ * local address and port by the same user, of the same address family, and
+ * for stream sockets listening.
+ */
+static __inline int
+in_pcb_lbmember(struct inpcb *inp, struct inpcb *first, struct ifnet *ifp)
+{
+	struct socket *so = inp->inp_socket, *fso = first->inp_socket;
+
+#if INET6
+	if ((inp->inp_vflag & INP_IPV4) == 0 ||
+	    INP_CHECK_SOCKAF(so, AF_INET6) != INP_CHECK_SOCKAF(fso, AF_INET6))
+		return (0);
+#endif
+	if (ip_restrictrecvif && ifp != NULL &&
+	    (ifp->if_eflags & IFEF_RESTRICTED_RECV) &&
+	    !(inp->inp_flags & INP_RECV_ANYIF))
+		return (0);
+	return (inp->inp_faddr.s_addr == INADDR_ANY &&
+	    inp->inp_lport == first->inp_lport &&
+	    inp->inp_laddr.s_addr == first->inp_laddr.s_addr &&
+	    (so->so_options & SO_REUSEPORT) &&
+	    (so->so_type != SOCK_STREAM || (so->so_options & SO_ACCEPTCONN)) &&
+	    kauth_cred_getuid(so->so_cred) == kauth_cred_getuid(fso->so_cred));
+}
+
+/*
+ * Pick the member of first's SO_REUSEPORT group that should receive this
+ * flow.  The choice depends only on the flow hash and the group, so all
+ * segments of a connection go to the same listener.
+ */
+static struct inpcb *
+in_pcb_lbselect(struct inpcbhead *head, struct inpcb *first,
+    struct in_addr faddr, u_short fport, struct in_addr laddr, u_short lport,
+    struct ifnet *ifp)
+{
+	struct {
+		struct in_addr	faddr;
+		struct in_addr	laddr;
+		u_short		fport;
+		u_short		lport;
+	} key;
+	struct inpcb *inp;
+	u_int32_t n = 0, i;
+
+	if (!inp_reuseport_lb || !in_pcb_lbmember(first, first, ifp))
+		return (first);
+
+	LIST_FOREACH(inp, head, inp_hash) {
+		if (in_pcb_lbmember(inp, first, ifp))
+			n++;
+	}
+	if (n < 2)
+		return (first);
+
+	bzero(&key, sizeof (key));
+	key.faddr = faddr;
+	key.laddr = laddr;
+	key.fport = fport;
+	key.lport = lport;
+	if (inp_hash_seed == 0)
+		inp_hash_seed = RandomULong();
+	i = net_flowhash(&key, sizeof (key), inp_hash_seed) % n;
+
+	LIST_FOREACH(inp, head, inp_hash) {
+		if (in_pcb_lbmember(inp, first, ifp) && i-- == 0)
+			return (inp);
+	}
+	return (first);
+}
+
 /*
  * Lookup PCB in hash list.
  */
@@ -1505,17 +1649,15 @@ in_pcblookup_hash(
 	struct inpcbhead *head;
 	struct inpcb *inp;
 	u_short fport = fport_arg, lport = lport_arg;
-
-	/*
-	 * We may have found the pcb in the last lookup - check this first.
-	 */
-
-	lck_rw_lock_shared(pcbinfo->mtx);
+	u_long bucket;
+	lck_rw_t *lck;
 
 	/*
 	 * First look for an exact match.
 	 */
-	head = &pcbinfo->hashbase[INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->hashmask)];
+	bucket = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->hashmask);
+	head = &pcbinfo->hashbase[bucket];
+	lck = in_pcbhash_lock_shared(pcbinfo, bucket);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if ((inp->inp_vflag & INP_IPV4) == 0)
@@ -1534,22 +1676,26 @@ in_pcblookup_hash(
 			 * Found.
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->mtx);
+				lck_rw_done(lck);
 				return (inp);
 			}
 			else {	/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->mtx);
+				lck_rw_done(lck);
 				return (NULL);
 			}
 		}
 	}
+	lck_rw_done(lck);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 #if INET6
 		struct inpcb *local_wild_mapped = NULL;
 #endif
 
-		head = &pcbinfo->hashbase[INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->hashmask)];
+		bucket = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->hashmask);
+		head = &pcbinfo->hashbase[bucket];
+		lck = in_pcbhash_lock_shared(pcbinfo, bucket);
 		LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 			if ((inp->inp_vflag & INP_IPV4) == 0)
@@ -1563,12 +1709,14 @@ in_pcblookup_hash(
 			if (inp->inp_faddr.s_addr == INADDR_ANY &&
 			    inp->inp_lport == lport) {
 				if (inp->inp_laddr.s_addr == laddr.s_addr) {
+					inp = in_pcb_lbselect(head, inp, faddr,
+					    fport, laddr, lport, ifp);
 					if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-						lck_rw_done(pcbinfo->mtx);
+						lck_rw_done(lck);
 						return (inp);
 					}
 					else {	/* it's there but dead, say it isn't found */
-						lck_rw_done(pcbinfo->mtx);
+						lck_rw_done(lck);
 						return (NULL);
 					}
 				}
@@ -1586,25 +1734,30 @@ in_pcblookup_hash(
 		if (local_wild == NULL) {
 #if INET6
 			if (local_wild_mapped != NULL) {
+				local_wild_mapped = in_pcb_lbselect(head,
+				    local_wild_mapped, faddr, fport, laddr,
+				    lport, ifp);
 				if (in_pcb_checkstate(local_wild_mapped, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-					lck_rw_done(pcbinfo->mtx);
+					lck_rw_done(lck);
 					return (local_wild_mapped);
 				}
 				else {	/* it's there but dead, say it isn't found */
-					lck_rw_done(pcbinfo->mtx);
+					lck_rw_done(lck);
 					return (NULL);
 				}
 			}
 #endif /* INET6 */
-			lck_rw_done(pcbinfo->mtx);
+			lck_rw_done(lck);
 			return (NULL);
 		}
+		local_wild = in_pcb_lbselect(head, local_wild, faddr, fport,
+		    laddr, lport, ifp);
 		if (in_pcb_checkstate(local_wild, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-			lck_rw_done(pcbinfo->mtx);
+			lck_rw_done(lck);
 			return (local_wild);
 		}
 		else {	/* it's there but dead, say it isn't found */
-			lck_rw_done(pcbinfo->mtx);
+			lck_rw_done(lck);
 			return (NULL);
 		}
 	}
@@ -1612,7 +1765,6 @@ in_pcblookup_hash(
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(pcbinfo->mtx);
 	return (NULL);
 }
 
@@ -1627,6 +1779,7 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbport *phd;
 	u_int32_t hashkey_faddr;
+	lck_rw_t *lck;
 
         if (!locked) {
                 if (!lck_rw_try_lock_exclusive(pcbinfo->mtx)) {
@@ -1682,23 +1835,75 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	}
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
+	if ((lck = in_pcbhash_lock(pcbinfo, inp->hash_element)) != NULL)
+		lck_rw_lock_exclusive(lck);
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	if (lck != NULL)
+		lck_rw_done(lck);
 	if (!locked)
 		lck_rw_done(pcbinfo->mtx);
 	return (0);
 }
 
+/*
+ * Take the bucket locks for moving inp from its current hash chain to the
+ * one for { hashkey_faddr, fport }, the values it is about to be given.
+ * Callers hold pcbinfo->mtx exclusive and take these before changing any
+ * address or port a lookup compares, then call in_pcbrehash() and
+ * in_pcbrehash_unlock(); a lookup holding either bucket then sees the
+ * PCB entirely before or entirely after the change.
+ */
+void
+in_pcbrehash_lock(struct inpcb *inp, u_int32_t hashkey_faddr, u_short fport,
+    lck_rw_t *lcks[2])
+{
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	lck_rw_t *olck, *nlck;
+
+	lck_rw_assert(pcbinfo->mtx, LCK_RW_ASSERT_EXCLUSIVE);
+
+	olck = in_pcbhash_lock(pcbinfo, inp->hash_element);
+	nlck = in_pcbhash_lock(pcbinfo, INP_PCBHASH(hashkey_faddr,
+	    inp->inp_lport, fport, pcbinfo->hashmask));
+	if (nlck == olck) {
+		nlck = NULL;
+	} else if (nlck < olck) {
+		lcks[0] = nlck;
+		nlck = olck;
+		olck = lcks[0];
+	}
+	if (olck != NULL)
+		lck_rw_lock_exclusive(olck);
+	if (nlck != NULL)
+		lck_rw_lock_exclusive(nlck);
+	lcks[0] = olck;
+	lcks[1] = nlck;
+}
+
+void
+in_pcbrehash_unlock(lck_rw_t *lcks[2])
+{
+	if (lcks[1] != NULL)
+		lck_rw_done(lcks[1]);
+	if (lcks[0] != NULL)
+		lck_rw_done(lcks[0]);
+}
+
 /*
  * Move PCB to the proper hash bucket when { faddr, fport } have  been
  * changed. NOTE: This does not handle the case of the lport changing (the
  * hashed port list would have to be updated as well), so the lport must
  * not change after in_pcbinshash() has been called.
+ *
+ * Called between in_pcbrehash_lock() and in_pcbrehash_unlock().
  */
 void
 in_pcbrehash(struct inpcb *inp)
 {
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbhead *head;
 	u_int32_t hashkey_faddr;
+	lck_rw_t *olck, *nlck;
 
 #if INET6
 	if (inp->inp_vflag & INP_IPV6)
@@ -1706,10 +1911,16 @@ in_pcbrehash(struct inpcb *inp)
 	else
 #endif /* INET6 */
 	hashkey_faddr = inp->inp_faddr.s_addr;
+	olck = in_pcbhash_lock(pcbinfo, inp->hash_element);
 	inp->hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport, 
-				inp->inp_fport, inp->inp_pcbinfo->hashmask);
-	head = &inp->inp_pcbinfo->hashbase[inp->hash_element];
+				inp->inp_fport, pcbinfo->hashmask);
+	head = &pcbinfo->hashbase[inp->hash_element];
+	nlck = in_pcbhash_lock(pcbinfo, inp->hash_element);
 
+	if (olck != NULL) {
+		lck_rw_assert(olck, LCK_RW_ASSERT_EXCLUSIVE);
+		lck_rw_assert(nlck, LCK_RW_ASSERT_EXCLUSIVE);
+	}
 	LIST_REMOVE(inp, inp_hash);
 	LIST_INSERT_HEAD(head, inp, inp_hash);
 }
@@ -1726,8 +1937,14 @@ in_pcbremlists(struct inpcb *inp)
 
 	if (inp->inp_lport) {
 		struct inpcbport *phd = inp->inp_phd;
+		lck_rw_t *lck;
 
+		lck = in_pcbhash_lock(inp->inp_pcbinfo, inp->hash_element);
+		if (lck != NULL)
+			lck_rw_lock_exclusive(lck);
 		LIST_REMOVE(inp, inp_hash);
+		if (lck != NULL)
+			lck_rw_done(lck);
 		LIST_REMOVE(inp, inp_portlist);
 		if (phd != NULL && (LIST_FIRST(&phd->phd_pcblist) == NULL)) {
 			LIST_REMOVE(phd, phd_hash);
@@ -1957,6 +2174,112 @@ inp_route_copyin(struct inpcb *inp, struct route *src)
 	route_copyin(src, dst, sizeof(*src));
 }
 
+/*
+ * Per-destination route cache for unconnected sockets.
+ *
+ * A socket that sends to many peers with sendto(2) has no single route
+ * worth keeping in inp_route, so every datagram would otherwise pay for
+ * a routing table lookup.  inp_rtcache is a small direct-mapped table of
+ * routes indexed by the flow hash of the destination address.  The
+ * caller swaps the selected slot into inp_route for the duration of the
+ * send, so in_pcbladdr() and ip_output() use and refresh it exactly as
+ * they would the route of a connected socket, and swaps it back out
+ * afterwards.  Entries are invalidated lazily against route_generation.
+ */
+#define	INP_RTCACHE_SIZE	16	/* must be a power of 2 */
+
+static void
+inp_rtcache_release(struct route *ro)
+{
+	if (ro->ro_rt != NULL) {
+		rtfree(ro->ro_rt);
+		ro->ro_rt = NULL;
+	}
+	ro->ro_flags = 0;
+}
+
+static void
+inp_rtcache_swap(struct inpcb *inp, struct route *slot)
+{
+	struct route tmp;
+
+	bcopy(&inp->inp_route, &tmp, sizeof (tmp));
+	bcopy(slot, &inp->inp_route, sizeof (tmp));
+	bcopy(&tmp, slot, sizeof (tmp));
+}
+
+/*
+ * Make the cached route for faddr the PCB's current route.  Returns the
+ * slot, which now holds the PCB's previous route and must be handed back
+ * to inp_rtcache_swapout() once the send is done, or NULL if there is no
+ * cache.  *res is set to one of the INP_RTCACHE_* results.
+ */
+struct route *
+inp_rtcache_swapin(struct inpcb *inp, struct in_addr faddr, int *res)
+{
+	struct route *slot;
+	u_int32_t hash;
+
+	lck_mtx_assert(&inp->inpcb_mtx, LCK_MTX_ASSERT_OWNED);
+
+	if (inp->inp_rtcache == NULL) {
+		/* the socket lock is held; don't block */
+		inp->inp_rtcache = _MALLOC(INP_RTCACHE_SIZE * sizeof (*slot),
+		    M_PCB, M_NOWAIT | M_ZERO);
+		if (inp->inp_rtcache == NULL)
+			return (NULL);
+	}
+	if (inp_hash_seed == 0)
+		inp_hash_seed = RandomULong();
+	hash = net_flowhash(&faddr, sizeof (faddr), inp_hash_seed);
+	slot = &inp->inp_rtcache[hash & (INP_RTCACHE_SIZE - 1)];
+
+	*res = INP_RTCACHE_HIT;
+	if (slot->ro_rt == NULL) {
+		*res = INP_RTCACHE_MISS;
+	} else if (satosin(&slot->ro_dst)->sin_addr.s_addr != faddr.s_addr) {
+		*res = INP_RTCACHE_MISS;
+		inp_rtcache_release(slot);
+	} else if (slot->ro_rt->generation_id != route_generation ||
+	    !(slot->ro_rt->rt_flags & RTF_UP)) {
+		*res = INP_RTCACHE_STALE;
+		inp_rtcache_release(slot);
+	}
+	inp_rtcache_swap(inp, slot);
+	return (slot);
+}
+
+void
+inp_rtcache_swapout(struct inpcb *inp, struct route *slot)
+{
+	lck_mtx_assert(&inp->inpcb_mtx, LCK_MTX_ASSERT_OWNED);
+
+	inp_rtcache_swap(inp, slot);
+	/* only unicast IPv4 routes are worth keeping */
+	if (slot->ro_rt != NULL && (slot->ro_dst.sa_family != AF_INET ||
+	    (slot->ro_rt->rt_flags & (RTF_MULTICAST|RTF_BROADCAST))))
+		inp_rtcache_release(slot);
+}
+
+/*
+ * Drop the cached routes, e.g. when the socket's interface constraints
+ * change; if destroy is set the cache itself is freed as well.
+ */
+void
+inp_rtcache_flush(struct inpcb *inp, int destroy)
+{
+	int i;
+
+	if (inp->inp_rtcache == NULL)
+		return;
+	for (i = 0; i < INP_RTCACHE_SIZE; i++)
+		inp_rtcache_release(&inp->inp_rtcache[i]);
+	if (destroy) {
+		FREE(inp->inp_rtcache, M_PCB);
+		inp->inp_rtcache = NULL;
+	}
+}
+
 /*
  * Handler for setting IP_FORCE_OUT_IFP/IP_BOUND_IF/IPV6_BOUND_IF socket option.
  */
@@ -1995,6 +2318,7 @@ inp_bindif(struct inpcb *inp, unsigned int ifscope)
 		rtfree(inp->inp_route.ro_rt);
 		inp->inp_route.ro_rt = NULL;
 	}
+	inp_rtcache_flush(inp, 0);
 
 	return (0);
 }
@@ -2017,6 +2341,7 @@ inp_nocellular(struct inpcb *inp, unsigned int val)
 		rtfree(inp->inp_route.ro_rt);
 		inp->inp_route.ro_rt = NULL;
 	}
+	inp_rtcache_flush(inp, 0);
 
 	return (0);
 }
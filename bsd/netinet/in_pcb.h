@@ -213,6 +213,7 @@ struct inpcb {
 	struct ifnet *inp_last_outifp;	/* last known outgoing interface */
 	u_int32_t inp_reserved[2];	/* reserved for future use */
 	u_int32_t inp_flowhash;		/* flow hash */
+	struct route *inp_rtcache;	/* per-destination routes (unconnected) */
 
 #if CONFIG_MACF_NET
 	struct label *inp_label;	/* MAC label */
@@ -520,12 +521,15 @@ struct inpcbinfo {		/* XXX documentation, prefixes */
 	lck_grp_t	*mtx_grp;	/* mutex group definition */
 	lck_grp_attr_t	*mtx_grp_attr;	/* mutex group attributes */
 	lck_rw_t	*mtx;		/* global mutex for the pcblist*/
+	lck_rw_t	*ipi_hashlocks;	/* per-bucket locks for hashbase */
 #else
 	void	*mtx_attr;	/* mutex attributes */
 	void	*mtx_grp;	/* mutex group definition */
 	void	*mtx_grp_attr;	/* mutex group attributes */
 	void	*mtx;		/* global mutex for the pcblist*/
+	void	*ipi_hashlocks;	/* per-bucket locks for hashbase */
 #endif	
+	u_long	ipi_hashlockmask;	/* bucket to ipi_hashlocks index */
 #endif
 };
 
@@ -659,6 +663,7 @@ struct sysctl_req;
 extern void	in_losing(struct inpcb *);
 extern void	in_rtchange(struct inpcb *, int);
 extern int	in_pcballoc(struct socket *, struct inpcbinfo *, struct proc *);
+extern void	in_pcbinfo_hashlocks_init(struct inpcbinfo *);
 extern int	in_pcbbind(struct inpcb *, struct sockaddr *, struct proc *);
 extern int	in_pcbconnect(struct inpcb *, struct sockaddr *, struct proc *,
 		    struct ifnet **);
@@ -679,6 +684,8 @@ extern int	in_pcblookup_hash_exists(struct inpcbinfo *, struct in_addr,
 extern void	in_pcbnotifyall(struct inpcbinfo *, struct in_addr, int,
 		    void (*)(struct inpcb *, int));
 extern void	in_pcbrehash(struct inpcb *);
+extern void	in_pcbrehash_lock(struct inpcb *, u_int32_t, u_short, lck_rw_t *[2]);
+extern void	in_pcbrehash_unlock(lck_rw_t *[2]);
 extern int	in_setpeeraddr(struct socket *so, struct sockaddr **nam);
 extern int	in_setsockaddr(struct socket *so, struct sockaddr **nam);
 extern int	in_pcb_checkstate(struct inpcb *pcb, int mode, int locked);
@@ -693,12 +700,20 @@ extern void	inpcb_to_xinpcb64(struct inpcb *inp,
 extern int get_pcblist_n(short , struct sysctl_req *, struct inpcbinfo *);
 extern void inpcb_get_ports_used(unsigned int , uint8_t *, struct inpcbinfo *);
 
+/* inp_rtcache_swapin() results */
+#define	INP_RTCACHE_HIT		0	/* cached route to the destination */
+#define	INP_RTCACHE_MISS	1	/* empty slot, or held another destination */
+#define	INP_RTCACHE_STALE	2	/* routing table changed since cached */
+
 #define INPCB_OPPORTUNISTIC_THROTTLEON 0x0001
 #define INPCB_OPPORTUNISTIC_SETCMD     0x0002
 extern uint32_t inpcb_count_opportunistic(unsigned int , struct inpcbinfo *, u_int32_t);
 extern void	inp_route_copyout(struct inpcb *, struct route *);
 extern void	inp_route_copyin(struct inpcb *, struct route *);
 extern int	inp_bindif(struct inpcb *, unsigned int);
+extern struct route *inp_rtcache_swapin(struct inpcb *, struct in_addr, int *);
+extern void	inp_rtcache_swapout(struct inpcb *, struct route *);
+extern void	inp_rtcache_flush(struct inpcb *, int);
 extern int	inp_nocellular(struct inpcb *, unsigned int);
 extern u_int32_t inp_calc_flowhash(struct inpcb *);
 extern void	socket_flowadv_init(void);
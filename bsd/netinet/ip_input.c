@@ -358,6 +358,27 @@ void	ipintr(void);
 void	in_dinit(void);
 static inline u_short ip_cksum(struct mbuf *, int);
 
+/*
+ * State carried across a chain of packets by ip_proto_input().  Drops
+ * are collected and freed with one m_freem_list() once the chain is
+ * done, the ips_total counter is bumped once per chain instead of once
+ * per packet, and the per-route receive statistics are accumulated
+ * over each run of packets from the same source and charged with a
+ * single route lookup.
+ */
+struct ip_input_batch {
+	struct mbuf	*ib_free;	/* dropped packets */
+	struct mbuf	**ib_freetail;
+	u_int32_t	ib_total;	/* packets seen, for ips_total */
+	struct rtentry	*ib_rt;		/* route charged for the run */
+	struct ifnet	*ib_rcvif;	/* ... of packets from ib_src */
+	struct in_addr	ib_src;		/* ... arriving on ib_rcvif */
+	u_int32_t	ib_pkts;	/* packets in the run */
+	u_int32_t	ib_bytes;	/* bytes in the run */
+};
+
+static void ip_input_common(struct mbuf *, struct ip_input_batch *);
+
 #if RANDOM_IP_ID
 extern u_short ip_id;
 
@@ -536,22 +557,71 @@ inaddr_hashval(u_int32_t key)
 		return (0);
 }
 
+static void
+ip_input_nstat_flush(struct ip_input_batch *ib)
+{
+	if (ib->ib_rt != NULL) {
+		nstat_route_rx(ib->ib_rt, ib->ib_pkts, ib->ib_bytes, 0);
+		rtfree(ib->ib_rt);
+		ib->ib_rt = NULL;
+	}
+	ib->ib_pkts = 0;
+	ib->ib_bytes = 0;
+}
+
+static void
+ip_input_nstat(struct ip_input_batch *ib, struct ifnet *ifp,
+    struct in_addr src, u_int32_t len)
+{
+	if (ib->ib_rt != NULL &&
+	    (ib->ib_rcvif != ifp || ib->ib_src.s_addr != src.s_addr))
+		ip_input_nstat_flush(ib);
+	if (ib->ib_rt == NULL) {
+		if ((ib->ib_rt = ifnet_cached_rtlookup_inet(ifp, src)) == NULL)
+			return;
+		ib->ib_rcvif = ifp;
+		ib->ib_src = src;
+	}
+	ib->ib_pkts++;
+	ib->ib_bytes += len;
+}
+
+static inline void
+ip_input_drop(struct mbuf *m, struct ip_input_batch *ib)
+{
+	if (ib == NULL) {
+		m_freem(m);
+	} else if (m != NULL) {
+		*ib->ib_freetail = m;
+		ib->ib_freetail = &m->m_nextpkt;
+	}
+}
+
 static void
 ip_proto_input(
 	protocol_family_t	__unused protocol,
 	mbuf_t				packet_list)
 {
+	struct ip_input_batch ib;
 	mbuf_t	packet;
-	int how_many = 0 ;
-	
-	/* ip_input should handle a list of packets but does not yet */
-	
+
+	bzero(&ib, sizeof (ib));
+	ib.ib_freetail = &ib.ib_free;
+
 	for (packet = packet_list; packet; packet = packet_list) {
-		how_many++;
 		packet_list = mbuf_nextpkt(packet);
 		mbuf_setnextpkt(packet, NULL);
-		ip_input(packet);
+		/* pull in the next header while this packet is handled */
+		if (packet_list != NULL)
+			__builtin_prefetch(packet_list->m_data);
+		ip_input_common(packet, &ib);
 	}
+
+	ip_input_nstat_flush(&ib);
+	if (ib.ib_total != 0)
+		OSAddAtomic(ib.ib_total, &ipstat.ips_total);
+	if (ib.ib_free != NULL)
+		m_freem_list(ib.ib_free);
 }
 
 /* Initialize the PF_INET domain, and add in the pre-defined protos */
@@ -670,6 +740,16 @@ ip_proto_dispatch_in(struct mbuf *m, int hlen, u_int8_t proto,
  */
 void
 ip_input(struct mbuf *m)
+{
+	ip_input_common(m, NULL);
+}
+
+/*
+ * The work behind ip_input(); ib is the chain state when called from
+ * ip_proto_input() for a list of packets, NULL for a single packet.
+ */
+static void
+ip_input_common(struct mbuf *m, struct ip_input_batch *ib)
 {
 	struct ip *ip;
 	struct ipq *fp;
@@ -778,7 +858,10 @@ ipfw_tags_done:
 		return;
 	}
 
-	OSAddAtomic(1, &ipstat.ips_total);
+	if (ib != NULL)
+		ib->ib_total++;
+	else
+		OSAddAtomic(1, &ipstat.ips_total);
 	if (m->m_pkthdr.len < sizeof(struct ip))
 		goto tooshort;
 
@@ -851,7 +934,10 @@ ipfw_tags_done:
 	 * we can use to attribute the data to. That does mean we would not
 	 * account for forwarded tcp traffic.
 	 */
-	if (nstat_collect) {
+	if (nstat_collect && ib != NULL) {
+		ip_input_nstat(ib, m->m_pkthdr.rcvif, ip->ip_src,
+		    m->m_pkthdr.len);
+	} else if (nstat_collect) {
 		struct rtentry *rt =
 		    ifnet_cached_rtlookup_inet(m->m_pkthdr.rcvif, ip->ip_src);
 		if (rt != NULL) {
@@ -954,7 +1040,7 @@ iphack:
 
 		if ( (i & IP_FW_PORT_DENY_FLAG) || m == NULL) { /* drop */
 			if (m)
-				m_freem(m);
+				ip_input_drop(m, ib);
 			return;
 		}
 		ip = mtod(m, struct ip *); /* just in case m changed */
@@ -984,7 +1070,7 @@ iphack:
 		/*
 		 * if we get here, the packet must be dropped
 		 */
-		m_freem(m);
+		ip_input_drop(m, ib);
 		return;
 	}
 #endif /* IPFIREWALL */
@@ -1125,7 +1211,7 @@ pass:
 			lck_mtx_lock(ip_mutex);
 			if (ip_mforward && ip_mforward(ip, ifp, m, 0) != 0) {
 				OSAddAtomic(1, &ipstat.ips_cantforward);
-				m_freem(m);
+				ip_input_drop(m, ib);
 				lck_mtx_unlock(ip_mutex);
 				return;
 			}
@@ -1149,7 +1235,7 @@ pass:
 		in_multihead_lock_done();
 		if (inm == NULL) {
 			OSAddAtomic(1, &ipstat.ips_notmember);
-			m_freem(m);
+			ip_input_drop(m, ib);
 			return;
 		}
 		INM_REMREF(inm);
@@ -1183,7 +1269,7 @@ pass:
 	 */
 	if (ipforwarding == 0) {
 		OSAddAtomic(1, &ipstat.ips_cantforward);
-		m_freem(m);
+		ip_input_drop(m, ib);
 	} else {
 #if IPFIREWALL
 		ip_forward(m, 0, args.fwa_next_hop);
@@ -1438,7 +1524,7 @@ found:
 	}
 bad:
 	KERNEL_DEBUG(DBG_LAYER_END, 0,0,0,0,0);
-	m_freem(m);
+	ip_input_drop(m, ib);
 }
 
 /*
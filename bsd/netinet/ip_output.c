@@ -1625,7 +1625,8 @@ pass:
 	}
 #endif
 	m->m_pkthdr.csum_flags |= CSUM_IP;
-	tso =  (ifp->if_hwassist & IFNET_TSO_IPV4) && (m->m_pkthdr.csum_flags & CSUM_TSO_IPV4);
+	tso = IF_TSO_IPV4_CAPABLE(ifp) &&
+	    (m->m_pkthdr.csum_flags & CSUM_TSO_IPV4);
 
 	sw_csum = m->m_pkthdr.csum_flags 
 		& ~IF_HWASSIST_CSUM_FLAGS(ifp->if_hwassist);
@@ -808,19 +808,14 @@ lro_tcp_xsum_validate(struct mbuf *m,  struct ipovly *ipov, struct tcphdr * th)
 		}
 		th->th_sum ^= 0xffff;
 	} else {
-		char b[9];
 		/*
-		 * Checksum extended TCP header and data.
+		 * Checksum the pseudo header, TCP header and data in
+		 * one pass, without rewriting the IP header into an
+		 * overlay first.
 		 */
-		bcopy(ipov->ih_x1, b, sizeof (ipov->ih_x1));
-		bzero(ipov->ih_x1, sizeof (ipov->ih_x1));
-		ipov->ih_len = (u_short)tlen;
-#if BYTE_ORDER != BIG_ENDIAN
-		HTONS(ipov->ih_len);
-#endif
 		len = sizeof (struct ip) + tlen;
-		th->th_sum = in_cksum(m, len);
-		bcopy(b, ipov->ih_x1, sizeof (ipov->ih_x1));
+		th->th_sum = inet_cksum(m, IPPROTO_TCP, sizeof (struct ip),
+		    tlen);
 
 		tcp_in_cksum_stats(len);
 	}
@@ -433,6 +433,7 @@ tcp_init()
 		printf("tcp_init: mutex not alloced!\n");
 		return;	/* pretty much dead if this fails... */
 	}
+	in_pcbinfo_hashlocks_init(pcbinfo);
 
 	for (i=0; i < N_TIME_WAIT_SLOTS; i++) {
 	     LIST_INIT(&time_wait_slots[i]);
@@ -2536,9 +2537,11 @@ tcp_set_tso(tp, ifp)
 #endif /* INET6 */
 
 	{
-		if (ifp && ifp->if_hwassist & IFNET_TSO_IPV4) {
+		/* without hardware TSO, dlil_output() segments in software */
+		if (ifp && IF_TSO_IPV4_CAPABLE(ifp)) {
 			tp->t_flags |= TF_TSO;
-			if (ifp->if_tso_v4_mtu != 0) 
+			if ((ifp->if_hwassist & IFNET_TSO_IPV4) &&
+			    ifp->if_tso_v4_mtu != 0) 
 				tp->tso_max_segment_size = ifp->if_tso_v4_mtu;
 			else
 				tp->tso_max_segment_size = TCP_MAXWIN;
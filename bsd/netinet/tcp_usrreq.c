@@ -898,6 +898,7 @@ tcp_connect(tp, nam, p)
 	struct rmxp_tao tao_noncached;
 	int error;
 	struct ifnet *outif = NULL;
+	lck_rw_t *lcks[2];
 
 	if (inp->inp_lport == 0) {
 		error = in_pcbbind(inp, (struct sockaddr *)0, p);
@@ -956,6 +957,7 @@ skip_oinp:
 		lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
 		socket_lock(inp->inp_socket, 0);
 	}
+	in_pcbrehash_lock(inp, sin->sin_addr.s_addr, sin->sin_port, lcks);
 	if (inp->inp_laddr.s_addr == INADDR_ANY) {
 		inp->inp_laddr = ifaddr.sin_addr;
 		inp->inp_last_outifp = outif;
@@ -963,6 +965,7 @@ skip_oinp:
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 
 	if (inp->inp_flowhash == 0)
@@ -1017,6 +1020,7 @@ tcp6_connect(tp, nam, p)
 	struct rmxp_tao tao_noncached;
 	int error = 0;
 	struct ifnet *outif = NULL;
+	lck_rw_t *lcks[2];
 
 	if (inp->inp_lport == 0) {
 		error = in6_pcbbind(inp, (struct sockaddr *)0, p);
@@ -1061,6 +1065,8 @@ tcp6_connect(tp, nam, p)
 		lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
 		socket_lock(inp->inp_socket, 0);
 	}
+	in_pcbrehash_lock(inp, sin6->sin6_addr.s6_addr32[3], sin6->sin6_port,
+	    lcks);
 	if (IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_laddr)) {
 		inp->in6p_laddr = addr6;
 		inp->in6p_last_outifp = outif;	/* no reference needed */
@@ -1070,6 +1076,7 @@ tcp6_connect(tp, nam, p)
 	if ((sin6->sin6_flowinfo & IPV6_FLOWINFO_MASK) != 0)
 		inp->in6p_flowinfo = sin6->sin6_flowinfo;
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 
 	if (inp->inp_flowhash == 0)
@@ -146,6 +146,28 @@ SYSCTL_QUAD(_net_inet_udp, OID_AUTO, out_sw_cksum_bytes, CTLFLAG_RD | CTLFLAG_LO
     &udps_out_sw_cksum_bytes,
     "Amount of transmitted data checksummed in software");
 
+/*
+ * Route cache for unconnected senders; see inp_rtcache_swapin().
+ */
+static int udp_rtcache = 1;
+SYSCTL_INT(_net_inet_udp, OID_AUTO, rtcache, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &udp_rtcache, 0, "Cache routes per destination for unconnected sockets");
+
+static u_int64_t udps_rtcache_hits;
+SYSCTL_QUAD(_net_inet_udp, OID_AUTO, rtcache_hits, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &udps_rtcache_hits,
+    "Number of unconnected sends that used a cached route");
+
+static u_int64_t udps_rtcache_misses;
+SYSCTL_QUAD(_net_inet_udp, OID_AUTO, rtcache_misses, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &udps_rtcache_misses,
+    "Number of unconnected sends with no cached route to the destination");
+
+static u_int64_t udps_rtcache_stale;
+SYSCTL_QUAD(_net_inet_udp, OID_AUTO, rtcache_stale, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &udps_rtcache_stale,
+    "Number of cached routes discarded after a routing change");
+
 int	log_in_vain = 0;
 SYSCTL_INT(_net_inet_udp, OID_AUTO, log_in_vain, CTLFLAG_RW | CTLFLAG_LOCKED,
     &log_in_vain, 0, "Log all incoming UDP packets");
@@ -241,6 +263,7 @@ udp_init()
 
 	if ((pcbinfo->mtx = lck_rw_alloc_init(pcbinfo->mtx_grp, pcbinfo->mtx_attr)) == NULL)
 		return;	/* pretty much dead if this fails... */
+	in_pcbinfo_hashlocks_init(pcbinfo);
 #else
 	udbinfo.ipi_zone = zinit("udpcb", sizeof(struct inpcb), maxsockets,
 				 ZONE_INTERRUPT, 0);
@@ -1317,6 +1340,8 @@ udp_output(inp, m, addr, control, p)
 	mbuf_svc_class_t msc = MBUF_SC_UNSPEC;
 	struct ifnet *origoutifp;
 	int flowadv = 0;
+	struct route *rtc = NULL;
+	int rtc_res;
 
 	/* Enable flow advisory only when connected */
 	flowadv = (so->so_state & SS_ISCONNECTED) ? 1 : 0;
@@ -1461,7 +1486,22 @@ udp_output(inp, m, addr, control, p)
 			 * and interfering with the input path. See 3851370
 			 * Note: if we may have a scope from IP_PKTINFO but the
 			 * priority is always given to the scope provided by INP_BOUND_IF.
+			 *
+			 * Unless this datagram has its own IP_PKTINFO, swap in
+			 * the route cached for this destination, so neither
+			 * in_pcbladdr() nor ip_output() needs to look it up.
 			 */
+			if (udp_rtcache && !udp_dodisconnect &&
+			    !(inp->inp_vflag & INP_IPV6) &&
+			    (rtc = inp_rtcache_swapin(inp, sin->sin_addr,
+			    &rtc_res)) != NULL) {
+				if (rtc_res == INP_RTCACHE_HIT)
+					udps_rtcache_hits++;
+				else if (rtc_res == INP_RTCACHE_STALE)
+					udps_rtcache_stale++;
+				else
+					udps_rtcache_misses++;
+			}
 			if (laddr.s_addr == INADDR_ANY) {
 				if ((error = in_pcbladdr(inp, addr, &ifaddr, &outif)) != 0)
 					goto release;
@@ -1627,6 +1667,8 @@ abort:
 	}
 
 release:
+	if (rtc != NULL)
+		inp_rtcache_swapout(inp, rtc);
 	if (m != NULL)
 		m_freem(m);
 	KERNEL_DEBUG(DBG_FNC_UDP_OUTPUT | DBG_FUNC_END, error, 0,0,0,0);
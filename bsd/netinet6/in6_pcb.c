@@ -495,6 +495,7 @@ in6_pcbconnect(
 	struct inpcb *pcb;
 	int error = 0;
 	struct ifnet *outif = NULL;
+	lck_rw_t *lcks[2];
 
 	/*
 	 * Call inner routine, to assign local interface address.
@@ -539,6 +540,8 @@ in6_pcbconnect(
 		lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
 		socket_lock(inp->inp_socket, 0);
 	}
+	in_pcbrehash_lock(inp, sin6->sin6_addr.s6_addr32[3], sin6->sin6_port,
+	    lcks);
 	inp->in6p_faddr = sin6->sin6_addr;
 	inp->inp_fport = sin6->sin6_port;
 	/* update flowinfo - draft-itojun-ipv6-flowlabel-api-00 */
@@ -548,6 +551,7 @@ in6_pcbconnect(
 		    (htonl(ip6_flow_seq++) & IPV6_FLOWLABEL_MASK);
 
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 
 done:
@@ -561,17 +565,21 @@ void
 in6_pcbdisconnect(
 	struct inpcb *inp)
 {
+	lck_rw_t *lcks[2];
+
 	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->mtx)) {
 		/*lock inversion issue, mostly with udp multicast packets */
 		socket_unlock(inp->inp_socket, 0);
 		lck_rw_lock_exclusive(inp->inp_pcbinfo->mtx);
 		socket_lock(inp->inp_socket, 0);
 	}
+	in_pcbrehash_lock(inp, 0, 0, lcks);
 	bzero((caddr_t)&inp->in6p_faddr, sizeof(inp->in6p_faddr));
 	inp->inp_fport = 0;
 	/* clear flowinfo - draft-itojun-ipv6-flowlabel-api-00 */
 	inp->in6p_flowinfo &= ~IPV6_FLOWLABEL_MASK;
 	in_pcbrehash(inp);
+	in_pcbrehash_unlock(lcks);
 	lck_rw_done(inp->inp_pcbinfo->mtx);
 	if (inp->inp_socket->so_state & SS_NOFDREF)
 		in6_pcbdetach(inp);
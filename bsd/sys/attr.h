@@ -497,5 +497,11 @@ struct searchstate {
 
 #define FST_EOF (-1)				/* end-of-file offset */
 
+#ifndef KERNEL
+__BEGIN_DECLS
+int	getattrlistbulk(int, struct attrlist *, void *, size_t, uint64_t);
+__END_DECLS
+#endif /* !KERNEL */
+
 #endif /* __APPLE_API_UNSTABLE */
 #endif /* !_SYS_ATTR_H_ */
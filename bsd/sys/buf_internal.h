@@ -101,8 +101,9 @@ struct buf {
 	TAILQ_ENTRY(buf) b_freelist;	/* Free list position if not active. */
 	int	b_timestamp;		/* timestamp for queuing operation */
 	int	b_whichq;		/* the free list the buffer belongs to */
+	struct bufshard *b_shard;	/* buffer cache shard the buffer belongs to */
 	volatile uint32_t	b_flags;	/* B_* flags. */
-	volatile uint32_t	b_lflags;	/* BL_BUSY | BL_WANTED flags... protected by buf_mtx */
+	volatile uint32_t	b_lflags;	/* BL_BUSY | BL_WANTED flags... protected by the shard lock */
 	int	b_error;		/* errno value. */
 	int	b_bufsize;		/* Allocated buffer size. */
 	int	b_bcount;		/* Valid bytes in buffer. */
@@ -161,7 +162,7 @@ struct buf {
 
 /*
  * These flags are kept in b_lflags...
- * buf_mtxp must be held before examining/updating
+ * the buffer's shard lock must be held before examining/updating
  */
 #define	BL_BUSY		0x00000001	/* I/O in progress. */
 #define	BL_WANTED	0x00000002	/* Process wants this buffer. */
@@ -256,6 +257,11 @@ extern struct buf *buf_headers;		/* The buffer headers. */
 #define BQ_META		4		/* buffer containing metadata */
 #define BQ_LAUNDRY	5		/* buffers that need cleaning */
 
+/*
+ * Number of independently locked buffer cache shards (power of 2)
+ */
+#define	BUF_NSHARDS	16
+
 
 __BEGIN_DECLS
 
@@ -285,6 +291,9 @@ errno_t	buf_acquire(buf_t, int, int, int);
 int	count_busy_buffers(void);
 int	count_lock_queue(void);
 
+struct bufshard_stats;
+int	buf_shard_get_stats(struct bufshard_stats *, int);
+
 int buf_flushdirtyblks_skipinfo (vnode_t, int, int, const char *);
 void buf_wait_for_shadow_io (vnode_t, daddr64_t);
 
@@ -315,5 +324,18 @@ struct bufstats {
 	long	bufs_iobufsleeps;	/* IO buffer starvation */
 };
 
+/*
+ *	Per-shard lock statistics, as returned by kern.bufcache_shard_stats...
+ *	the hold times are only collected while kern.bufcache_shard_stats_enable is set
+ */
+struct bufshard_stats {
+	uint64_t	bss_acquired;		/* shard lock acquisitions */
+	uint64_t	bss_contended;		/* acquisitions that had to wait */
+	uint64_t	bss_hold_total;		/* total lock hold time in ns */
+	uint64_t	bss_hold_max;		/* longest lock hold time in ns */
+};
+
+extern int bufshard_stats_enable;
+
 #endif /* KERNEL */
 #endif /* !_SYS_BUF_H_ */
@@ -60,6 +60,8 @@ typedef struct __attribute__((packed)) {
 /* compression_type values */
 enum {
     CMP_Type1       = 1, /* uncompressed data in xattr */
+    CMP_Type3       = 3, /* zlib-compressed data in xattr */
+    CMP_Type4       = 4, /* 64k chunked zlib-compressed data in resource fork */
     
     /* additional types defined in AppleFSCompression project */
     
@@ -168,6 +168,7 @@ struct fileglob {
 #if CONFIG_MACF
 	struct label *fg_label;  /* JMM - use the one in the cred? */
 #endif
+	void	*fg_vn_data;		/* per fd directory enumeration state */
 };
 
 #ifdef __APPLE_API_PRIVATE
@@ -204,6 +205,7 @@ struct atalk;
 int fp_getfatalk(struct proc *p, int fd, struct fileproc **resultfp, struct atalk  **resultatalk);
 struct vnode;
 int fp_getfvp(struct proc *p, int fd, struct fileproc **resultfp, struct vnode  **resultvp);
+void fg_vn_data_free(void *fgvndata);
 int fp_getfvpandvid(struct proc *p, int fd, struct fileproc **resultfp, struct vnode  **resultvp, uint32_t * vidp);
 struct socket;
 int fp_getfsock(struct proc *p, int fd, struct fileproc **resultfp, struct socket  **results);
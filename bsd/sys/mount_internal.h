@@ -96,6 +96,27 @@ typedef uint32_t  pending_io_t;
 #endif
 
 
+/*
+ * Cluster read-ahead counters, kept per mount and exported along with
+ * the mount's fsid as vfs.generic.readahead_stats (struct vfs_rastats).
+ */
+struct mount_rastats {
+	int64_t		mrs_streams;		/* read-ahead streams started */
+	int64_t		mrs_recycled;		/* streams recycled for a new stream */
+	int64_t		mrs_prefetch_pages;	/* pages read ahead */
+	int64_t		mrs_wasted_pages;	/* read ahead pages never reached by a recycled stream */
+	int64_t		mrs_hits;		/* reads satisfied from read-ahead */
+	int64_t		mrs_stalls;		/* reads that outran their stream's read-ahead */
+	int64_t		mrs_evictions;		/* reads that found read-ahead pages already evicted */
+	int64_t		mrs_grows;		/* read-ahead windows grown */
+	int64_t		mrs_shrinks;		/* read-ahead windows shrunk */
+};
+
+struct vfs_rastats {
+	fsid_t			vr_fsid;
+	struct mount_rastats	vr_stats;
+};
+
 /*
  * Structure per mounted file system.  Each mounted file system has an
  * array of operations and an instance record.  The file systems are
@@ -134,6 +155,7 @@ struct mount {
 	uint32_t	mnt_ioflags;		/* flags for  underlying device */
 	pending_io_t	mnt_pending_write_size __attribute__((aligned(sizeof(pending_io_t))));	/* byte count of pending writes */
 	pending_io_t	mnt_pending_read_size  __attribute__((aligned(sizeof(pending_io_t))));	/* byte count of pending reads */
+	struct mount_rastats mnt_rastats;	/* cluster read-ahead counters */
 
 	lck_rw_t	mnt_rwlock;		/* mutex readwrite lock */
 	lck_mtx_t	mnt_renamelock;		/* mutex that serializes renames that change shape of tree */
@@ -77,11 +77,26 @@ struct cl_wextent {
         int		io_flags;
 };
 
-struct cl_readahead {
-	lck_mtx_t	cl_lockr;
+/*
+ * read-ahead state is kept per sequential stream, so that several
+ * readers streaming different parts of the same file each keep
+ * their own read-ahead going
+ */
+#define CL_MAX_RASTREAMS	4
+
+struct cl_rastream {
 	daddr64_t	cl_lastr;			/* last block read by client */
 	daddr64_t	cl_maxra;			/* last block prefetched by the read ahead */
 	int		cl_ralen;			/* length of last prefetch */
+	int		cl_rawin;			/* current cap on cl_ralen, in pages (0 == not yet sized) */
+	int		cl_busy;			/* a reader currently owns this stream */
+	uint32_t	cl_lastuse;			/* cl_clock when last released */
+};
+
+struct cl_readahead {
+	lck_mtx_t	cl_lockr;			/* protects stream ownership */
+	uint32_t	cl_clock;			/* bumped on each release, orders cl_lastuse */
+	struct cl_rastream cl_streams[CL_MAX_RASTREAMS];
 };
 
 struct cl_writebehind {
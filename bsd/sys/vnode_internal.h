@@ -130,6 +130,7 @@ typedef struct vnode_resolve *vnode_resolve_t;
  * v_mntvnodes is locked by the mount_lock
  * v_nclinks and v_ncchildren are protected by the global name_cache_lock
  * v_cleanblkhd and v_dirtyblkhd and v_iterblkflags are locked via the global buf_mtxp
+ * (which is taken before any of the buffer cache shard locks, see vfs_bio.c)
  * the rest of the structure is protected by the vnode_lock
  */
 struct vnode {
@@ -505,6 +506,7 @@ errno_t	vnode_suspend(vnode_t);
 errno_t	vnode_size(vnode_t, off_t *, vfs_context_t);
 errno_t	vnode_setsize(vnode_t, off_t, int ioflag, vfs_context_t);
 int	vnode_setattr_fallback(vnode_t vp, struct vnode_attr *vap, vfs_context_t ctx);
+errno_t	vnode_readdir64(vnode_t vp, struct uio *uio, int flags, int *eofflag, int *numdirent, vfs_context_t ctx);
 int	vnode_isspec(vnode_t vp);
 
 
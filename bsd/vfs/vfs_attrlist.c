@@ -40,6 +40,8 @@
 #include <sys/vnode_internal.h>
 #include <sys/mount_internal.h>
 #include <sys/proc_internal.h>
+#include <sys/file_internal.h>
+#include <sys/dirent.h>
 #include <sys/kauth.h>
 #include <sys/uio_internal.h>
 #include <sys/malloc.h>
@@ -50,6 +52,7 @@
 #include <kern/kalloc.h>
 #include <miscfs/specfs/specdev.h>
 #include <hfs/hfs.h>
+#include <security/audit/audit.h>
 
 #if CONFIG_MACF
 #include <security/mac_framework.h>
@@ -1189,11 +1192,15 @@ out:
 }
 
 /*
- * Obtain attribute information about a filesystem object.
+ * Gather and pack the (non-volume) attributes in (alp) for (vp) into a
+ * freshly allocated buffer described by (abp); the first word of the
+ * buffer is the packed length as getattrlist(2) reports it.  If (name)
+ * is not NULL it is returned for ATTR_CMN_NAME instead of asking the
+ * filesystem.  On success the caller owns abp->base.
  */
-
 static int
-getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_context_t ctx)
+getattrlist_packvp(vnode_t vp, struct attrlist *alp, uint64_t options, const char *name,
+    int proc_is64, vfs_context_t ctx, struct _attrlist_buf *abp)
 {
 	struct attrlist	al;
 	struct vnode_attr va;
@@ -1205,14 +1212,13 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 	char 	*fullpathptr;
 	ssize_t		fullpathlen;
 	ssize_t		cnl;
-	int		proc_is64;
 	int		error;
 	int		return_valid;
 	int		pack_invalid;
 	int		vtype = 0;
 	uint32_t	perms = 0;
 
-	proc_is64 = proc_is64bit(p);
+	al = *alp;
 	VATTR_INIT(&va);
 	va.va_name = NULL;
 	ab.base = NULL;
@@ -1220,45 +1226,11 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 	cnl = 0;
 	fullpathptr = NULL;
 	fullpathlen = 0;
-
-	/*
-	 * Fetch the attribute request.
-	 */
-	if ((error = copyin(uap->alist, &al, sizeof(al))) != 0)
-		goto out;
-	if (al.bitmapcount != ATTR_BIT_MAP_COUNT) {
-		error = EINVAL;
-		goto out;
-	}
-
-	VFS_DEBUG(ctx, vp, "%p  ATTRLIST - %s request common %08x vol %08x file %08x dir %08x fork %08x %sfollow on '%s'",
-	    vp, p->p_comm, al.commonattr, al.volattr, al.fileattr, al.dirattr, al.forkattr,
-	    (uap->options & FSOPT_NOFOLLOW) ? "no":"", vp->v_name);
-
-#if CONFIG_MACF
-	error = mac_vnode_check_getattrlist(ctx, vp, &al);
-	if (error)
-		goto out;
-#endif /* MAC */
-
-	/*
-	 * It is legal to request volume or file attributes,
-	 * but not both.
-	 */
-	if (al.volattr) {
-		if (al.fileattr || al.dirattr || al.forkattr) {
-			error = EINVAL;
-			VFS_DEBUG(ctx, vp, "ATTRLIST - ERROR: mixed volume/file/directory/fork attributes");
-			goto out;
-		}
-		/* handle volume attribute request */
-		error = getvolattrlist(vp, uap, &al, ctx, proc_is64);
-		goto out;
-	}
+	error = 0;
 
 	/* Check for special packing semantics */
 	return_valid = (al.commonattr & ATTR_CMN_RETURNED_ATTRS);
-	pack_invalid = (uap->options & FSOPT_PACK_INVAL_ATTRS);
+	pack_invalid = (options & FSOPT_PACK_INVAL_ATTRS);
 	if (pack_invalid) {
 		/* FSOPT_PACK_INVAL_ATTRS requires ATTR_CMN_RETURNED_ATTRS */
 		if (!return_valid || al.forkattr) {
@@ -1284,6 +1256,8 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 		VFS_DEBUG(ctx, vp, "ATTRLIST - ERROR: setup for request failed");
 		goto out;
 	}
+	if (name != NULL)
+		VATTR_CLEAR_ACTIVE(&va, va_name);
 	if ((error = vnode_authorize(vp, NULL, action, ctx)) != 0) {
 		VFS_DEBUG(ctx, vp, "ATTRLIST - ERROR: authorisation failed/denied");
 		goto out;
@@ -1409,7 +1383,11 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 
 	/* We may need to fix up the name attribute if requested */
 	if (al.commonattr & ATTR_CMN_NAME) {
-		if (VATTR_IS_SUPPORTED(&va, va_name)) {
+		if (name != NULL) {
+			/* the caller already knows the name it found this object by */
+			cnp = name;
+			cnl = strlen(cnp);
+		} else if (VATTR_IS_SUPPORTED(&va, va_name)) {
 			va.va_name[MAXPATHLEN-1] = '\0';	/* Ensure nul-termination */
 			cnp = va.va_name;
 			cnl = strlen(cnp);
@@ -1950,7 +1928,7 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 	 * of the result buffer, even if we copied less out.  The caller knows how big a buffer
 	 * they gave us, so they can always check for truncation themselves.
 	 */
-	*(uint32_t *)ab.base = (uap->options & FSOPT_REPORT_FULLSIZE) ? ab.needed : imin(ab.allocated, ab.needed);
+	*(uint32_t *)ab.base = (options & FSOPT_REPORT_FULLSIZE) ? ab.needed : imin(ab.allocated, ab.needed);
 
 	/* Return attribute set output if requested. */
 	if (return_valid) {
@@ -1964,9 +1942,10 @@ getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_con
 		bcopy(&ab.actual, ab.base + sizeof(uint32_t), sizeof (ab.actual));
 	}
 	
-	/* Only actually copyout as much out as the user buffer can hold */
-	error = copyout(ab.base, uap->attributeBuffer, imin(uap->bufferSize, ab.allocated));
-	
+	/* Hand the packed buffer to the caller */
+	*abp = ab;
+	ab.base = NULL;
+
 out:
 	if (va.va_name)
 		kfree(va.va_name, MAXPATHLEN);
@@ -1979,6 +1958,70 @@ out:
 	if (VATTR_IS_SUPPORTED(&va, va_acl) && (va.va_acl != NULL))
 		kauth_acl_free(va.va_acl);
 
+	return(error);
+}
+
+
+/*
+ * Obtain attribute information about a filesystem object.
+ */
+
+static int
+getattrlist_internal(vnode_t vp, struct getattrlist_args *uap, proc_t p, vfs_context_t ctx)
+{
+	struct attrlist	al;
+	struct _attrlist_buf ab;
+	int		proc_is64;
+	int		error;
+
+	proc_is64 = proc_is64bit(p);
+	ab.base = NULL;
+
+	/*
+	 * Fetch the attribute request.
+	 */
+	if ((error = copyin(uap->alist, &al, sizeof(al))) != 0)
+		goto out;
+	if (al.bitmapcount != ATTR_BIT_MAP_COUNT) {
+		error = EINVAL;
+		goto out;
+	}
+
+	VFS_DEBUG(ctx, vp, "%p  ATTRLIST - %s request common %08x vol %08x file %08x dir %08x fork %08x %sfollow on '%s'",
+	    vp, p->p_comm, al.commonattr, al.volattr, al.fileattr, al.dirattr, al.forkattr,
+	    (uap->options & FSOPT_NOFOLLOW) ? "no":"", vp->v_name);
+
+#if CONFIG_MACF
+	error = mac_vnode_check_getattrlist(ctx, vp, &al);
+	if (error)
+		goto out;
+#endif /* MAC */
+
+	/*
+	 * It is legal to request volume or file attributes,
+	 * but not both.
+	 */
+	if (al.volattr) {
+		if (al.fileattr || al.dirattr || al.forkattr) {
+			error = EINVAL;
+			VFS_DEBUG(ctx, vp, "ATTRLIST - ERROR: mixed volume/file/directory/fork attributes");
+			goto out;
+		}
+		/* handle volume attribute request */
+		error = getvolattrlist(vp, uap, &al, ctx, proc_is64);
+		goto out;
+	}
+
+	if ((error = getattrlist_packvp(vp, &al, uap->options, NULL, proc_is64, ctx, &ab)) != 0)
+		goto out;
+
+	/* Only actually copyout as much out as the user buffer can hold */
+	error = copyout(ab.base, uap->attributeBuffer, imin(uap->bufferSize, ab.allocated));
+	
+out:
+	if (ab.base != NULL)
+		FREE(ab.base, M_TEMP);
+
 	VFS_DEBUG(ctx, vp, "ATTRLIST - returning %d", error);
 	return(error);
 }
@@ -2049,6 +2092,348 @@ out:
 	return error;
 }
 
+/*
+ * Per file descriptor state for getattrlistbulk().  The generic path
+ * can't seek back to an individual directory entry, so the entries read
+ * from the directory but not yet returned (because the caller's buffer
+ * filled up) are kept here and handed out by the next call.
+ */
+struct fd_vn_data {
+	lck_mtx_t	fv_lock;
+	off_t		fv_offset;	/* directory offset past the buffered entries */
+	int		fv_mode;	/* how this enumeration is being done */
+	int		fv_eof;		/* directory has been read to the end */
+	char		*fv_buf;	/* struct direntry's from VNOP_READDIR */
+	size_t		fv_buflen;	/* bytes of entries in fv_buf */
+	size_t		fv_bufdone;	/* bytes of entries already returned */
+};
+
+#define FV_UNDECIDED	0
+#define FV_READDIRATTR	1	/* the filesystem's own VNOP_READDIRATTR */
+#define FV_GENERIC	2	/* VNOP_READDIR, then lookup and getattr each entry */
+
+#define FV_DIRBUF_SIZE	(32 * 1024)
+
+extern lck_grp_t *vnode_lck_grp;
+extern lck_attr_t *vnode_lck_attr;
+
+void
+fg_vn_data_free(void *fgvndata)
+{
+	struct fd_vn_data *fvd = (struct fd_vn_data *)fgvndata;
+
+	if (fvd->fv_buf != NULL)
+		FREE(fvd->fv_buf, M_TEMP);
+	lck_mtx_destroy(&fvd->fv_lock, vnode_lck_grp);
+	FREE(fvd, M_TEMP);
+}
+
+static struct fd_vn_data *
+fg_vn_data_get(struct fileglob *fg)
+{
+	struct fd_vn_data *fvd, *nfvd;
+
+	lck_mtx_lock(&fg->fg_lock);
+	fvd = fg->fg_vn_data;
+	lck_mtx_unlock(&fg->fg_lock);
+
+	if (fvd != NULL)
+		return (fvd);
+
+	MALLOC(nfvd, struct fd_vn_data *, sizeof(struct fd_vn_data), M_TEMP, M_WAITOK | M_ZERO);
+	if (nfvd == NULL)
+		return (NULL);
+	lck_mtx_init(&nfvd->fv_lock, vnode_lck_grp, vnode_lck_attr);
+	nfvd->fv_offset = -1;		/* forces a reset on first use */
+
+	lck_mtx_lock(&fg->fg_lock);
+	if ((fvd = fg->fg_vn_data) == NULL) {
+		fg->fg_vn_data = fvd = nfvd;
+		nfvd = NULL;
+	}
+	lck_mtx_unlock(&fg->fg_lock);
+
+	if (nfvd != NULL)
+		fg_vn_data_free(nfvd);
+	return (fvd);
+}
+
+/*
+ * Resolve a directory entry against the directory we already hold,
+ * without going through namei().
+ */
+static int
+getattrlistbulk_lookup(vnode_t dvp, struct direntry *dp, vnode_t *vpp, vfs_context_t ctx)
+{
+	struct componentname cn;
+
+	bzero(&cn, sizeof(cn));
+	cn.cn_nameiop = LOOKUP;
+	cn.cn_flags = ISLASTCN | MAKEENTRY;
+	cn.cn_context = ctx;
+	cn.cn_pnbuf = dp->d_name;
+	cn.cn_pnlen = dp->d_namlen + 1;
+	cn.cn_nameptr = cn.cn_pnbuf;
+	cn.cn_namelen = dp->d_namlen;
+
+	*vpp = NULLVP;
+	switch (cache_lookup(dvp, vpp, &cn)) {
+	case -1:
+		/* name cache hit, we hold an iocount */
+		return (0);
+	case ENOENT:
+		return (ENOENT);
+	}
+	return (VNOP_LOOKUP(dvp, vpp, &cn, ctx));
+}
+
+/*
+ * Generic implementation: walk the directory with VNOP_READDIR and pack
+ * each entry the same way getattrlist(2) would.  Entries that disappear
+ * underneath us, or whose attributes we aren't allowed to see, are
+ * skipped.
+ */
+static int
+getattrlistbulk_generic(vnode_t dvp, struct fd_vn_data *fvd, struct attrlist *alp,
+    uint64_t options, user_addr_t buf, user_size_t bufsize, int proc_is64,
+    vfs_context_t ctx, int *countp)
+{
+	struct _attrlist_buf ab;
+	struct direntry *dp;
+	vnode_t		vp;
+	uio_t		auio;
+	uint32_t	reclen;
+	int		count, eofflag, numdirent;
+	int		error = 0;
+
+	*countp = count = 0;
+
+	if (fvd->fv_buf == NULL) {
+		MALLOC(fvd->fv_buf, char *, FV_DIRBUF_SIZE, M_TEMP, M_WAITOK);
+		if (fvd->fv_buf == NULL)
+			return (ENOMEM);
+	}
+
+	for (;;) {
+		if (fvd->fv_bufdone >= fvd->fv_buflen) {
+			if (fvd->fv_eof)
+				break;
+
+			auio = uio_create(1, fvd->fv_offset, UIO_SYSSPACE, UIO_READ);
+			uio_addiov(auio, CAST_USER_ADDR_T(fvd->fv_buf), FV_DIRBUF_SIZE);
+			eofflag = 0;
+
+			error = vnode_readdir64(dvp, auio, VNODE_READDIR_EXTENDED, &eofflag, &numdirent, ctx);
+
+			fvd->fv_buflen = FV_DIRBUF_SIZE - uio_resid(auio);
+			fvd->fv_bufdone = 0;
+			if (error == 0)
+				fvd->fv_offset = uio_offset(auio);
+			uio_free(auio);
+
+			if (error) {
+				fvd->fv_buflen = 0;
+				break;
+			}
+			if (eofflag || fvd->fv_buflen == 0)
+				fvd->fv_eof = 1;
+			continue;
+		}
+		dp = (struct direntry *)(fvd->fv_buf + fvd->fv_bufdone);
+
+		if (dp->d_reclen == 0 || fvd->fv_bufdone + dp->d_reclen > fvd->fv_buflen) {
+			/* a broken entry ends this buffer */
+			fvd->fv_bufdone = fvd->fv_buflen;
+			continue;
+		}
+		if (dp->d_ino == 0 || dp->d_type == DT_WHT ||
+		    (dp->d_namlen == 1 && dp->d_name[0] == '.') ||
+		    (dp->d_namlen == 2 && dp->d_name[0] == '.' && dp->d_name[1] == '.')) {
+			fvd->fv_bufdone += dp->d_reclen;
+			continue;
+		}
+
+		if (getattrlistbulk_lookup(dvp, dp, &vp, ctx) != 0) {
+			fvd->fv_bufdone += dp->d_reclen;
+			continue;
+		}
+#if CONFIG_MACF
+		if (mac_vnode_check_getattrlist(ctx, vp, alp) != 0) {
+			vnode_put(vp);
+			fvd->fv_bufdone += dp->d_reclen;
+			continue;
+		}
+#endif /* MAC */
+		ab.base = NULL;
+		error = getattrlist_packvp(vp, alp, options, dp->d_name, proc_is64, ctx, &ab);
+		vnode_put(vp);
+
+		if (error) {
+			error = 0;
+			fvd->fv_bufdone += dp->d_reclen;
+			continue;
+		}
+		/*
+		 * each record starts with its own length; one that doesn't
+		 * fit stays buffered for the next call.
+		 */
+		reclen = *(uint32_t *)ab.base;
+
+		if (reclen > bufsize) {
+			FREE(ab.base, M_TEMP);
+			if (count == 0)
+				error = ERANGE;
+			break;
+		}
+		error = copyout(ab.base, buf, reclen);
+		FREE(ab.base, M_TEMP);
+		if (error)
+			break;
+
+		buf += reclen;
+		bufsize -= reclen;
+		fvd->fv_bufdone += dp->d_reclen;
+		count++;
+	}
+	*countp = count;
+
+	/* hand back what we packed even if a later entry failed */
+	return (count ? 0 : error);
+}
+
+/*
+ * Obtain attribute information on many objects in a directory at once.
+ * Unlike getdirentriesattr(2) this works on every filesystem and with
+ * any set of common, directory and file attributes; filesystems that
+ * implement VNOP_READDIRATTR get to do the work themselves when they
+ * can handle the request.  Returns the number of records packed into
+ * the buffer, 0 once the directory has been exhausted.
+ */
+int
+getattrlistbulk(proc_t p, struct getattrlistbulk_args *uap, int32_t *retval)
+{
+	struct attrlist	al;
+	struct fileproc	*fp;
+	struct fd_vn_data *fvd;
+	vnode_t		dvp;
+	vfs_context_t	ctx = vfs_context_current();
+	kauth_action_t	action;
+	uio_t		auio;
+	char		uio_buf[ UIO_SIZEOF(1) ];
+	u_long		count, newstate;
+	int		proc_is64 = proc_is64bit(p);
+	int		eofflag, nentries, needs_generic;
+	int		error;
+
+	*retval = 0;
+
+	if ((error = copyin(uap->alist, &al, sizeof(al))) != 0)
+		return (error);
+	if (al.bitmapcount != ATTR_BIT_MAP_COUNT)
+		return (EINVAL);
+	/*
+	 * no volume or fork attributes, and every record has to be
+	 * complete so the caller can walk them.
+	 */
+	if (al.volattr || al.forkattr)
+		return (EINVAL);
+	if (uap->options & ~(FSOPT_NOFOLLOW | FSOPT_PACK_INVAL_ATTRS))
+		return (EINVAL);
+
+	AUDIT_ARG(fd, uap->dirfd);
+
+	if ((error = fp_getfvp(p, uap->dirfd, &fp, &dvp)) != 0)
+		return (error);
+	if ((fp->f_fglob->fg_flag & FREAD) == 0) {
+		AUDIT_ARG(vnpath_withref, dvp, ARG_VNODE1);
+		error = EBADF;
+		goto out;
+	}
+	if ((error = vnode_getwithref(dvp)) != 0)
+		goto out;
+
+	AUDIT_ARG(vnpath, dvp, ARG_VNODE1);
+
+	if (dvp->v_type != VDIR) {
+		error = ENOTDIR;
+		goto out_put;
+	}
+#if CONFIG_MACF
+	if ((error = mac_vnode_check_readdir(ctx, dvp)) != 0)
+		goto out_put;
+#endif /* MAC */
+
+	action = KAUTH_VNODE_LIST_DIRECTORY;
+	if ((al.commonattr & ~ATTR_CMN_NAME) || al.fileattr || al.dirattr)
+		action |= KAUTH_VNODE_SEARCH;
+	if ((error = vnode_authorize(dvp, NULL, action, ctx)) != 0)
+		goto out_put;
+
+	if ((fvd = fg_vn_data_get(fp->f_fglob)) == NULL) {
+		error = ENOMEM;
+		goto out_put;
+	}
+	lck_mtx_lock(&fvd->fv_lock);
+
+	/*
+	 * somebody moved the descriptor (rewinddir, lseek) since we
+	 * last left it... start over from wherever it is now.
+	 */
+	if (fvd->fv_offset != fp->f_fglob->fg_offset) {
+		fvd->fv_offset = fp->f_fglob->fg_offset;
+		fvd->fv_mode = FV_UNDECIDED;
+		fvd->fv_eof = 0;
+		fvd->fv_buflen = fvd->fv_bufdone = 0;
+	}
+
+	/*
+	 * the filesystem's own bulk path can't report which attributes
+	 * it returned, so only offer it requests it can answer as is.
+	 * once an enumeration has picked a path it sticks with it, since
+	 * the two don't share a notion of directory offset... a request
+	 * the chosen path can't answer is refused rather than handed to
+	 * the other one part way through.  rewinding the descriptor
+	 * starts a new enumeration that is free to choose again.
+	 */
+	needs_generic = (al.commonattr & ATTR_CMN_RETURNED_ATTRS) ||
+	    (uap->options & FSOPT_PACK_INVAL_ATTRS);
+
+	if (fvd->fv_mode == FV_READDIRATTR && needs_generic) {
+		error = EINVAL;
+		goto done;
+	}
+	if (fvd->fv_mode != FV_GENERIC && !needs_generic) {
+		auio = uio_createwithbuffer(1, fvd->fv_offset, proc_is64 ? UIO_USERSPACE64 : UIO_USERSPACE32,
+		    UIO_READ, &uio_buf[0], sizeof(uio_buf));
+		uio_addiov(auio, uap->attributeBuffer, uap->bufferSize);
+
+		error = VNOP_READDIRATTR(dvp, &al, auio, (u_long)(uap->bufferSize / sizeof(uint32_t)),
+		    0, &newstate, &eofflag, &count, ctx);
+
+		if (error == 0) {
+			fvd->fv_mode = FV_READDIRATTR;
+			fvd->fv_offset = uio_offset(auio);
+			*retval = (int32_t)count;
+			goto done;
+		}
+		if (fvd->fv_mode == FV_READDIRATTR || (error != ENOTSUP && error != EINVAL))
+			goto done;
+	}
+	fvd->fv_mode = FV_GENERIC;
+
+	error = getattrlistbulk_generic(dvp, fvd, &al, uap->options, uap->attributeBuffer,
+	    uap->bufferSize, proc_is64, ctx, &nentries);
+	*retval = nentries;
+done:
+	fp->f_fglob->fg_offset = fvd->fv_offset;
+	lck_mtx_unlock(&fvd->fv_lock);
+out_put:
+	(void)vnode_put(dvp);
+out:
+	file_drop(uap->dirfd);
+	return (error);
+}
+
 static int
 attrlist_unpack_fixed(char **cursor, char *end, void *buf, ssize_t size)
 {
@@ -97,7 +97,9 @@
 
 #include <mach/mach_types.h>
 #include <mach/memory_object_types.h>
+#include <mach/mach_time.h>
 #include <kern/sched_prim.h>	/* thread_block() */
+#include <kern/clock.h>
 
 #include <vm/vm_kern.h>
 #include <vm/vm_pageout.h>
@@ -110,6 +112,7 @@
 
 #include <sys/sdt.h>
 #include <sys/cprotect.h>
+#include <sys/mcache.h>		/* CPU_CACHE_SIZE */
 
 
 #if BALANCE_QUEUES
@@ -117,14 +120,17 @@ static __inline__ void bufqinc(int q);
 static __inline__ void bufqdec(int q);
 #endif
 
+struct bufshard;
+
 int	bcleanbuf(buf_t bp, boolean_t discard);
 static int	brecover_data(buf_t bp);
 static boolean_t incore(vnode_t vp, daddr64_t blkno);
 /* timeout is in msecs */
-static buf_t	getnewbuf(int slpflag, int slptimeo, int *queue);
+static buf_t	getnewbuf(int slpflag, int slptimeo, int *queue, struct bufshard *pref);
 static void	bremfree_locked(buf_t bp);
 static void	buf_reassign(buf_t bp, vnode_t newvp);
 static errno_t	buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo);
+static errno_t	buf_acquire_shard_locked(buf_t bp, struct bufshard *bs, int flags, int slpflag, int slptimeo);
 static int	buf_iterprepare(vnode_t vp, struct buflists *, int flags);
 static void	buf_itercomplete(vnode_t vp, struct buflists *, int flags);
 static boolean_t buffer_cache_gc(int);
@@ -151,7 +157,7 @@ static int	buf_hdr_count;
  */
 #define	BUFHASH(dvp, lbn)	\
 	(&bufhashtbl[((long)(dvp) / sizeof(*(dvp)) + (int)(lbn)) & bufhash])
-LIST_HEAD(bufhashhdr, buf) *bufhashtbl, invalhash;
+LIST_HEAD(bufhashhdr, buf) *bufhashtbl;
 u_long	bufhash;
 
 static buf_t	incore_locked(vnode_t vp, daddr64_t blkno, struct bufhashhdr *dp);
@@ -167,17 +173,190 @@ static int boot_nbuf_headers = 0;
 static TAILQ_HEAD(delayqueue, buf) delaybufqueue;
 
 static TAILQ_HEAD(ioqueue, buf) iobufqueue;
-static TAILQ_HEAD(bqueues, buf) bufqueues[BQUEUES];
+TAILQ_HEAD(bqueues, buf);
 static int needbuffer;
 static int need_iobuffer;
 
+/*
+ * The buffer cache is split into BUF_NSHARDS shards.  Hash bucket
+ * 'i' belongs to shard (i % BUF_NSHARDS), and a buffer belongs to
+ * the shard of the bucket it is hashed on (b_shard)... buffers on
+ * the invalid hash stay with whichever shard they were last in.
+ *
+ * Each shard has its own mutex, free lists (including the laundry)
+ * and invalid hash.  The shard lock protects the hash chains of its
+ * buckets, the free lists, b_lflags/b_whichq and the shadow state
+ * of its buffers, and the B_DONE handshake in buf_biowait/buf_biodone.
+ *
+ * buf_mtxp is kept as the outer lock and protects the vnode buffer
+ * lists (v_cleanblkhd, v_dirtyblkhd, v_iterblkflags), needbuffer and
+ * the header counts... it is also what serializes the operations
+ * that need to look at more than one shard (getnewbuf, the gc and
+ * the laundry thread).  Lock ordering is buf_mtxp -> shard lock;
+ * a thread holding buf_mtxp may hold several shard locks, a thread
+ * that doesn't may hold at most one, and no thread may take buf_mtxp
+ * while holding a shard lock.
+ *
+ * b_shard only changes while a buffer is BL_BUSY and unhashed, and
+ * only under the old shard's lock, so buf_shard_lock() can find
+ * the right lock by reading it, locking, and checking it again.
+ */
+struct bufshard {
+	lck_mtx_t		bs_mtx;
+	struct bqueues		bs_queues[BQUEUES];	/* free lists */
+	struct bufhashhdr	bs_invalhash;
+	int			bs_busycount;		/* only the sum over all shards is meaningful */
+
+	/* lock statistics, see kern.bufcache_shard_stats */
+	uint64_t		bs_acquired;
+	uint64_t		bs_contended;
+	uint64_t		bs_hold_start;
+	uint64_t		bs_hold_total;
+	uint64_t		bs_hold_max;
+} __attribute__((aligned(CPU_CACHE_SIZE)));
+
+static struct bufshard	bufshards[BUF_NSHARDS];
+static u_int		bufshard_rotor;		/* protected by buf_mtxp */
+int bufshard_stats_enable = 0;
+
+#define	BUFSHARD(dp)	(&bufshards[((dp) - bufhashtbl) % BUF_NSHARDS])
+
+/* private to buf_acquire_locked... the caller holds buf_mtxp */
+#define	BAC_LISTED	0x80000000
+
 static lck_grp_t	*buf_mtx_grp;
 static lck_attr_t	*buf_mtx_attr;
 static lck_grp_attr_t   *buf_mtx_grp_attr;
 static lck_mtx_t	*iobuffer_mtxp;
 static lck_mtx_t	*buf_mtxp;
 
-static int buf_busycount;
+static __inline__ void
+buf_shard_lock_spin(struct bufshard *bs)
+{
+	if (!lck_mtx_try_lock_spin(&bs->bs_mtx)) {
+		lck_mtx_lock_spin(&bs->bs_mtx);
+		bs->bs_contended++;
+	}
+	bs->bs_acquired++;
+
+	if (bufshard_stats_enable)
+		bs->bs_hold_start = mach_absolute_time();
+}
+
+/*
+ * account for the hold time of a shard lock that's about
+ * to be released, either directly or by msleep
+ */
+static __inline__ void
+buf_shard_hold_done(struct bufshard *bs)
+{
+	uint64_t hold;
+
+	if (bs->bs_hold_start) {
+		hold = mach_absolute_time() - bs->bs_hold_start;
+		bs->bs_hold_start = 0;
+
+		bs->bs_hold_total += hold;
+		if (hold > bs->bs_hold_max)
+			bs->bs_hold_max = hold;
+	}
+}
+
+static __inline__ void
+buf_shard_unlock(struct bufshard *bs)
+{
+	buf_shard_hold_done(bs);
+	lck_mtx_unlock(&bs->bs_mtx);
+}
+
+/*
+ * msleep on a shard lock... if PDROP isn't specified,
+ * the lock is held again on return
+ */
+static __inline__ int
+buf_shard_msleep(struct bufshard *bs, void *chan, int pri, const char *wmesg, struct timespec *ts)
+{
+	int error;
+
+	buf_shard_hold_done(bs);
+
+	error = msleep(chan, &bs->bs_mtx, pri, wmesg, ts);
+
+	if ( !(pri & PDROP) && bufshard_stats_enable)
+		bs->bs_hold_start = mach_absolute_time();
+	return (error);
+}
+
+/*
+ * lock the shard 'bp' currently belongs to
+ */
+static __inline__ struct bufshard *
+buf_shard_lock(buf_t bp)
+{
+	struct bufshard *bs;
+
+	for (;;) {
+		bs = bp->b_shard;
+
+		buf_shard_lock_spin(bs);
+
+		if (bs == bp->b_shard)
+			return (bs);
+		buf_shard_unlock(bs);
+	}
+}
+
+/*
+ * move a BL_BUSY, unhashed buffer to another shard
+ */
+static __inline__ void
+buf_shard_move(buf_t bp, struct bufshard *to)
+{
+	struct bufshard *bs;
+
+	if ((bs = bp->b_shard) == to)
+		return;
+	buf_shard_lock_spin(bs);
+	bp->b_shard = to;
+	buf_shard_unlock(bs);
+}
+
+static int
+buf_busycount(void)
+{
+	int i, count = 0;
+
+	for (i = 0; i < BUF_NSHARDS; i++)
+		count += bufshards[i].bs_busycount;
+	return (count);
+}
+
+/*
+ * called with no buffer cache locks held after a buffer
+ * has been put back on one of the free lists...
+ * getnewbuf sets needbuffer before it takes its final
+ * look at the shards, so a buffer freed after that look
+ * is guaranteed to see it set
+ */
+static void
+buf_needbuffer_wakeup(void)
+{
+	int need_wakeup = 0;
+
+	if (needbuffer == 0)
+		return;
+
+	lck_mtx_lock_spin(buf_mtxp);
+
+	if (needbuffer) {
+		needbuffer = 0;
+		need_wakeup = 1;
+	}
+	lck_mtx_unlock(buf_mtxp);
+
+	if (need_wakeup)
+		wakeup(&needbuffer);
+}
 
 static __inline__ int
 buf_timestamp(void)
@@ -288,15 +467,15 @@ bremhash(buf_t	bp)
 }
 
 /*
- * buf_mtxp held.
+ * buf_mtxp and the buffer's shard lock held.
  */
 static __inline__ void
 bmovelaundry(buf_t bp)
 {
 	bp->b_whichq = BQ_LAUNDRY;
 	bp->b_timestamp = buf_timestamp();
-	binstailfree(bp, &bufqueues[BQ_LAUNDRY], BQ_LAUNDRY);
-	blaundrycnt++;
+	binstailfree(bp, &bp->b_shard->bs_queues[BQ_LAUNDRY], BQ_LAUNDRY);
+	OSAddAtomic(1, &blaundrycnt);
 }
 
 static __inline__ void
@@ -743,6 +922,7 @@ static buf_t
 buf_create_shadow_internal(buf_t bp, boolean_t force_copy, uintptr_t external_storage, void (*iodone)(buf_t, void *), void *arg, int priv)
 {
         buf_t	io_bp;
+	struct bufshard *bs;
 
 	KERNEL_DEBUG(0xbbbbc000 | DBG_FUNC_START, bp, 0, 0, 0, 0);
 
@@ -783,7 +963,7 @@ buf_create_shadow_internal(buf_t bp, boolean_t force_copy, uintptr_t external_st
 		}
 		*(buf_t *)(&io_bp->b_orig) = bp;
 
-		lck_mtx_lock_spin(buf_mtxp);
+		bs = buf_shard_lock(bp);
 
 		io_bp->b_lflags |= BL_SHADOW;
 		io_bp->b_shadow = bp->b_shadow;
@@ -796,7 +976,7 @@ buf_create_shadow_internal(buf_t bp, boolean_t force_copy, uintptr_t external_st
 		else
 			bp->b_data_ref++;
 #endif
-		lck_mtx_unlock(buf_mtxp);
+		buf_shard_unlock(bs);
 	} else {
 		if (external_storage) {
 #ifdef BUF_MAKE_PRIVATE
@@ -829,6 +1009,7 @@ buf_make_private(buf_t bp)
 	buf_t	ds_bp;
 	buf_t	t_bp;
 	struct buf my_buf;
+	struct bufshard *bs;
 
 	KERNEL_DEBUG(0xbbbbc004 | DBG_FUNC_START, bp, bp->b_shadow_ref, 0, 0, 0);
 
@@ -843,7 +1024,7 @@ buf_make_private(buf_t bp)
 
 	bcopy((caddr_t)bp->b_datap, (caddr_t)my_buf.b_datap, bp->b_bcount);
 
-	lck_mtx_lock_spin(buf_mtxp);
+	bs = buf_shard_lock(bp);
 
 	for (t_bp = bp->b_shadow; t_bp; t_bp = t_bp->b_shadow) {
 		if ( !ISSET(bp->b_lflags, BL_EXTERNAL))
@@ -858,7 +1039,7 @@ buf_make_private(buf_t bp)
 		panic("buf_make_private: ref_count == 0 && ds_bp != NULL");
 
 	if (ds_bp == NULL) {
-		lck_mtx_unlock(buf_mtxp);
+		buf_shard_unlock(bs);
 
 		buf_free_meta_store(&my_buf);
 
@@ -874,7 +1055,7 @@ buf_make_private(buf_t bp)
 	bp->b_data_ref = 0;
 	bp->b_datap = my_buf.b_datap;
 
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 
 	KERNEL_DEBUG(0xbbbbc004 | DBG_FUNC_END, bp, bp->b_shadow_ref, 0, 0, 0);
 	return (0);
@@ -1794,7 +1975,7 @@ bremfree_locked(buf_t bp)
 	 * NB: This makes an assumption about how tailq's are implemented.
 	 */
 	if (bp->b_freelist.tqe_next == NULL) {
-	        dp = &bufqueues[whichq];
+	        dp = &bp->b_shard->bs_queues[whichq];
 
 		if (dp->tqh_last != &bp->b_freelist.tqe_next)
 			panic("bremfree: lost tail");
@@ -1805,7 +1986,7 @@ bremfree_locked(buf_t bp)
 	bufqdec(whichq);
 #endif
 	if (whichq == BQ_LAUNDRY)
-	        blaundrycnt--;
+	        OSAddAtomic(-1, &blaundrycnt);
 
 	bp->b_whichq = -1;
 	bp->b_timestamp = 0; 
@@ -1903,29 +2084,47 @@ __private_extern__ void
 bufinit(void)
 {
 	buf_t	bp;
+	struct bufshard *bs;
 	struct bqueues *dp;
 	int	i;
 
+	/*
+	 * allocate lock group attribute and group
+	 */
+	buf_mtx_grp_attr = lck_grp_attr_alloc_init();
+	buf_mtx_grp = lck_grp_alloc_init("buffer cache", buf_mtx_grp_attr);
+		
+	/*
+	 * allocate the lock attribute
+	 */
+	buf_mtx_attr = lck_attr_alloc_init();
+
 	nbuf_headers = 0;
-	/* Initialize the buffer queues ('freelists') and the hash table */
-	for (dp = bufqueues; dp < &bufqueues[BQUEUES]; dp++)
-		TAILQ_INIT(dp);
+	/* Initialize the shards' buffer queues ('freelists') and the hash table */
+	for (i = 0; i < BUF_NSHARDS; i++) {
+		bs = &bufshards[i];
+
+		lck_mtx_init(&bs->bs_mtx, buf_mtx_grp, buf_mtx_attr);
+		for (dp = bs->bs_queues; dp < &bs->bs_queues[BQUEUES]; dp++)
+			TAILQ_INIT(dp);
+		LIST_INIT(&bs->bs_invalhash);
+		bs->bs_busycount = 0;
+	}
 	bufhashtbl = hashinit(nbuf_hashelements, M_CACHE, &bufhash);
 
-	buf_busycount = 0;
-
-	/* Initialize the buffer headers */
+	/* Initialize the buffer headers, spreading them over the shards */
 	for (i = 0; i < max_nbuf_headers; i++) {
 		nbuf_headers++;
 		bp = &buf_headers[i];
 		bufhdrinit(bp);
 
 		BLISTNONE(bp);
-		dp = &bufqueues[BQ_EMPTY];
+		bs = &bufshards[i % BUF_NSHARDS];
+		bp->b_shard = bs;
 		bp->b_whichq = BQ_EMPTY;
 		bp->b_timestamp = buf_timestamp();
-		binsheadfree(bp, dp, BQ_EMPTY);
-		binshash(bp, &invalhash);
+		binsheadfree(bp, &bs->bs_queues[BQ_EMPTY], BQ_EMPTY);
+		binshash(bp, &bs->bs_invalhash);
 	}
 	boot_nbuf_headers = nbuf_headers;
 
@@ -1935,21 +2134,15 @@ bufinit(void)
 	for (; i < nbuf_headers + niobuf_headers; i++) {
 		bp = &buf_headers[i];
 		bufhdrinit(bp);
+		/*
+		 * io bufs never move... the shard is only
+		 * used for buf_biowait/buf_biodone
+		 */
+		bp->b_shard = &bufshards[i % BUF_NSHARDS];
 		bp->b_whichq = -1;
 		binsheadfree(bp, &iobufqueue, -1);
 	}
 
-	/*
-	 * allocate lock group attribute and group
-	 */
-	buf_mtx_grp_attr = lck_grp_attr_alloc_init();
-	buf_mtx_grp = lck_grp_alloc_init("buffer cache", buf_mtx_grp_attr);
-		
-	/*
-	 * allocate the lock attribute
-	 */
-	buf_mtx_attr = lck_attr_alloc_init();
-
 	/*
 	 * allocate and initialize mutex's for the buffer and iobuffer pools
 	 */
@@ -2417,11 +2610,12 @@ buf_brelse_shadow(buf_t bp)
 	int	data_ref = 0;
 #endif
 	int need_wakeup = 0;
-
-	lck_mtx_lock_spin(buf_mtxp);
+	struct bufshard *bs;
 
 	bp_head = (buf_t)bp->b_orig;
 
+	bs = buf_shard_lock(bp_head);
+
 	if (bp_head->b_whichq != -1)
 		panic("buf_brelse_shadow: bp_head on freelist %d\n", bp_head->b_whichq);
 
@@ -2475,10 +2669,10 @@ buf_brelse_shadow(buf_t bp)
 
 			if (ISSET(bp_head->b_flags, B_LOCKED)) {
 				bp_head->b_whichq = BQ_LOCKED;
-				binstailfree(bp_head, &bufqueues[BQ_LOCKED], BQ_LOCKED);
+				binstailfree(bp_head, &bs->bs_queues[BQ_LOCKED], BQ_LOCKED);
 			} else {
 				bp_head->b_whichq = BQ_META;
-				binstailfree(bp_head, &bufqueues[BQ_META], BQ_META);
+				binstailfree(bp_head, &bs->bs_queues[BQ_META], BQ_META);
 			}
 		} else if (ISSET(bp_head->b_lflags, BL_WAITSHADOW)) {
 			CLR(bp_head->b_lflags, BL_WAITSHADOW);
@@ -2490,7 +2684,7 @@ buf_brelse_shadow(buf_t bp)
 			need_wakeup = 1;
 		}
 	}
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 	
 	if (need_wakeup) {
 		wakeup(bp_head);
@@ -2515,10 +2709,10 @@ buf_brelse_shadow(buf_t bp)
 void
 buf_brelse(buf_t bp)
 {
-	struct bqueues *bufq;
+	struct bufshard *bs;
 	long	whichq;
 	upl_t	upl;
-	int need_wakeup = 0;
+	int need_list_lock = 0;
 	int need_bp_wakeup = 0;
 
 
@@ -2668,22 +2862,30 @@ buf_brelse(buf_t bp)
 		 */
 		buf_release_credentials(bp);
 
+		/*
+		 * dissociating from the vnode requires buf_mtxp,
+		 * which has to be taken before the shard lock
+		 */
 		lck_mtx_lock_spin(buf_mtxp);
+		bs = buf_shard_lock(bp);
 
 		if (bp->b_shadow_ref) {
 			SET(bp->b_lflags, BL_WAITSHADOW);
 			
+			buf_shard_unlock(bs);
 			lck_mtx_unlock(buf_mtxp);
 			
 			return;
 		}
 		if (delayed_buf_free_meta_store == TRUE) {
 
+			buf_shard_unlock(bs);
 			lck_mtx_unlock(buf_mtxp);
 finish_shadow_master:
 			buf_free_meta_store(bp);
 
 			lck_mtx_lock_spin(buf_mtxp);
+			bs = buf_shard_lock(bp);
 		}
 		CLR(bp->b_flags, (B_META | B_ZALLOC | B_DELWRI | B_LOCKED | B_AGE | B_ASYNC | B_NOCACHE | B_FUA));
 
@@ -2692,10 +2894,12 @@ finish_shadow_master:
 
 		bremhash(bp);
 		BLISTNONE(bp);
-		binshash(bp, &invalhash);
+		binshash(bp, &bs->bs_invalhash);
 
 		bp->b_whichq = BQ_EMPTY;
-		binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
+		binsheadfree(bp, &bs->bs_queues[BQ_EMPTY], BQ_EMPTY);
+
+		need_list_lock = 1;
 	} else {
 
 		/*
@@ -2710,16 +2914,15 @@ finish_shadow_master:
 			whichq = BQ_AGE;		/* stale but valid data */
 		else
 			whichq = BQ_LRU;		/* valid data */
-		bufq = &bufqueues[whichq];
 
 		bp->b_timestamp = buf_timestamp();
 
-		lck_mtx_lock_spin(buf_mtxp);
+		bs = buf_shard_lock(bp);
 		
 		/*
 		 * the buf_brelse_shadow routine doesn't take 'ownership'
 		 * of the parent buf_t... it updates state that is protected by
-		 * the buf_mtxp, and checks for BL_BUSY to determine whether to
+		 * the shard lock, and checks for BL_BUSY to determine whether to
 		 * put the buf_t back on a free list.  b_shadow_ref is protected
 		 * by the lock, and since we have not yet cleared B_BUSY, we need
 		 * to check it while holding the lock to insure that one of us
@@ -2728,7 +2931,7 @@ finish_shadow_master:
 		if (bp->b_shadow_ref == 0) {
 			CLR(bp->b_flags, (B_AGE | B_ASYNC | B_NOCACHE));
 			bp->b_whichq = whichq;
-			binstailfree(bp, bufq, whichq);
+			binstailfree(bp, &bs->bs_queues[whichq], whichq);
 		} else {
 			/*
 			 * there are still cloned buf_t's pointing
@@ -2739,20 +2942,10 @@ finish_shadow_master:
 			CLR(bp->b_flags, (B_ASYNC | B_NOCACHE));
 		}
 	}
-	if (needbuffer) {
-	        /*
-		 * needbuffer is a global
-		 * we're currently using buf_mtxp to protect it
-		 * delay doing the actual wakeup until after
-		 * we drop buf_mtxp
-		 */
-		needbuffer = 0;
-		need_wakeup = 1;
-	}
 	if (ISSET(bp->b_lflags, BL_WANTED)) {
 	        /*	
 		 * delay the actual wakeup until after we
-		 * clear BL_BUSY and we've dropped buf_mtxp
+		 * clear BL_BUSY and we've dropped the shard lock
 		 */
 		need_bp_wakeup = 1;
 	}
@@ -2760,16 +2953,18 @@ finish_shadow_master:
 	 * Unlock the buffer.
 	 */
 	CLR(bp->b_lflags, (BL_BUSY | BL_WANTED));
-	buf_busycount--;
+	bs->bs_busycount--;
 
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
+
+	if (need_list_lock)
+		lck_mtx_unlock(buf_mtxp);
+
+	/*
+	 * Wake up any processes waiting for any buffer to become free.
+	 */
+	buf_needbuffer_wakeup();
 
-	if (need_wakeup) {
-	        /*
-		 * Wake up any processes waiting for any buffer to become free.
-		 */
-	        wakeup(&needbuffer);
-	}
 	if (need_bp_wakeup) {
 	        /*
 		 * Wake up any proceeses waiting for _this_ buffer to become free.
@@ -2792,16 +2987,18 @@ incore(vnode_t vp, daddr64_t blkno)
 {
         boolean_t retval;
 	struct	bufhashhdr *dp;
+	struct	bufshard *bs;
 
 	dp = BUFHASH(vp, blkno);
+	bs = BUFSHARD(dp);
 
-	lck_mtx_lock_spin(buf_mtxp);
+	buf_shard_lock_spin(bs);
 
 	if (incore_locked(vp, blkno, dp))
 	        retval = TRUE;
 	else
 	        retval = FALSE;
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 
 	return (retval);
 }
@@ -2827,10 +3024,12 @@ buf_wait_for_shadow_io(vnode_t vp, daddr64_t blkno)
 {
 	buf_t bp;
 	struct	bufhashhdr *dp;
+	struct	bufshard *bs;
 
 	dp = BUFHASH(vp, blkno);
+	bs = BUFSHARD(dp);
 
-	lck_mtx_lock_spin(buf_mtxp);
+	buf_shard_lock_spin(bs);
 
 	for (;;) {
 		if ((bp = incore_locked(vp, blkno, dp)) == NULL)
@@ -2841,9 +3040,9 @@ buf_wait_for_shadow_io(vnode_t vp, daddr64_t blkno)
 
 		SET(bp->b_lflags, BL_WANTED_REF);
 
-		(void) msleep(bp, buf_mtxp, PSPIN | (PRIBIO+1), "buf_wait_for_shadow", NULL);
+		(void) buf_shard_msleep(bs, bp, PSPIN | (PRIBIO+1), "buf_wait_for_shadow", NULL);
 	}
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 }
 	
 /* XXX FIXME -- Update the comment to reflect the UBC changes (please) -- */
@@ -2867,6 +3066,7 @@ buf_getblk(vnode_t vp, daddr64_t blkno, int size, int slpflag, int slptimeo, int
 	struct timespec ts;
 	int upl_flags;
 	struct	bufhashhdr *dp;
+	struct	bufshard *bs;
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 386)) | DBG_FUNC_START,
 		     (uintptr_t)(blkno * PAGE_SIZE), size, operation, 0, 0);
@@ -2874,8 +3074,9 @@ buf_getblk(vnode_t vp, daddr64_t blkno, int size, int slpflag, int slptimeo, int
 	ret_only_valid = operation & BLK_ONLYVALID;
 	operation &= ~BLK_ONLYVALID;
 	dp = BUFHASH(vp, blkno);
+	bs = BUFSHARD(dp);
 start:
-	lck_mtx_lock_spin(buf_mtxp);
+	buf_shard_lock_spin(bs);
 
 	if ((bp = incore_locked(vp, blkno, dp))) {
 		/*
@@ -2890,7 +3091,7 @@ start:
 			case BLK_WRITE:
 			case BLK_META:
 				SET(bp->b_lflags, BL_WANTED);
-				bufstats.bufs_busyincore++;
+				OSAddAtomicLong(1, &bufstats.bufs_busyincore);
 
 				/*
 				 * don't retake the mutex after being awakened...
@@ -2902,7 +3103,7 @@ start:
 				KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 396)) | DBG_FUNC_NONE,
 					     (uintptr_t)blkno, size, operation, 0, 0);
 
-				err = msleep(bp, buf_mtxp, slpflag | PDROP | (PRIBIO + 1), "buf_getblk", &ts);
+				err = buf_shard_msleep(bs, bp, slpflag | PDROP | (PRIBIO + 1), "buf_getblk", &ts);
 
 				/*
 				 * Callers who call with PCATCH or timeout are
@@ -2928,12 +3129,13 @@ start:
 			 */
 			SET(bp->b_lflags, BL_BUSY);
 			SET(bp->b_flags, B_CACHE);
-			buf_busycount++;
+			bs->bs_busycount++;
 
 			bremfree_locked(bp);
-			bufstats.bufs_incore++;
 			
-			lck_mtx_unlock(buf_mtxp);
+			buf_shard_unlock(bs);
+
+			OSAddAtomicLong(1, &bufstats.bufs_incore);
 #ifdef JOE_DEBUG
 			bp->b_owner = current_thread();
 			bp->b_tag   = 1;
@@ -2998,27 +3200,41 @@ start:
 	} else { /* not incore() */
 		int queue = BQ_EMPTY; /* Start with no preference */
 		
-		if (ret_only_valid) {
-			lck_mtx_unlock(buf_mtxp);
+		buf_shard_unlock(bs);
+
+		if (ret_only_valid)
 			return (NULL);
-		}
+
 		if ((vnode_isreg(vp) == 0) || (UBCINFOEXISTS(vp) == 0) /*|| (vnode_issystem(vp) == 1)*/)
 			operation = BLK_META;
 
-		if ((bp = getnewbuf(slpflag, slptimeo, &queue)) == NULL)
+		/*
+		 * a miss has to associate the new buffer with the vnode,
+		 * and getnewbuf may have to look at every shard... both
+		 * need buf_mtxp, which has to be taken before the shard lock
+		 */
+		lck_mtx_lock_spin(buf_mtxp);
+
+		if ((bp = getnewbuf(slpflag, slptimeo, &queue, bs)) == NULL)
 			goto start;
 
+		buf_shard_move(bp, bs);
+
+		buf_shard_lock_spin(bs);
+
 		/*
+		 * we dropped the shard lock to take buf_mtxp and
 		 * getnewbuf may block for a number of different reasons...
-		 * if it does, it's then possible for someone else to
+		 * it's then possible for someone else to
 		 * create a buffer for the same block and insert it into
 		 * the hash... if we see it incore at this point we dump
 		 * the buffer we were working on and start over
 		 */
 		if (incore_locked(vp, blkno, dp)) {
 			SET(bp->b_flags, B_INVAL);
-			binshash(bp, &invalhash);
+			binshash(bp, &bs->bs_invalhash);
 
+			buf_shard_unlock(bs);
 			lck_mtx_unlock(buf_mtxp);
 
 			buf_brelse(bp);
@@ -3042,7 +3258,9 @@ start:
 		/*
 		 * Insert in the hash so that incore() can find it 
 		 */
-		binshash(bp, BUFHASH(vp, blkno)); 
+		binshash(bp, dp); 
+
+		buf_shard_unlock(bs);
 
 		bgetvp_locked(vp, bp);
 
@@ -3058,9 +3276,10 @@ start:
 			 *
 			 * I don't want to have to retake buf_mtxp,
 			 * so the miss and vmhits counters are done
-			 * with Atomic updates... all other counters
-			 * in bufstats are protected with either
-			 * buf_mtxp or iobuffer_mtxp
+			 * with Atomic updates... as are the incore
+			 * counters, which are only covered by a shard
+			 * lock... all other counters in bufstats are
+			 * protected with either buf_mtxp or iobuffer_mtxp
 			 */
 		        OSAddAtomicLong(1, &bufstats.bufs_miss);
 			break;
@@ -3167,12 +3386,17 @@ buf_t
 buf_geteblk(int size)
 {
 	buf_t	bp = NULL;
+	struct bufshard *bs;
 	int queue = BQ_EMPTY;
 
 	do {
 		lck_mtx_lock_spin(buf_mtxp);
 
-		bp = getnewbuf(0, 0, &queue);
+		/*
+		 * there's no hash bucket to pick a shard for us...
+		 * spread these over the shards, buf_mtxp protects the rotor
+		 */
+		bp = getnewbuf(0, 0, &queue, &bufshards[bufshard_rotor++ % BUF_NSHARDS]);
 	} while (bp == NULL);
 
 	SET(bp->b_flags, (B_META|B_INVAL));
@@ -3182,7 +3406,10 @@ buf_geteblk(int size)
 #endif /* DIAGNOSTIC */
 	/* XXX need to implement logic to deal with other queues */
 
-	binshash(bp, &invalhash);
+	bs = buf_shard_lock(bp);
+	binshash(bp, &bs->bs_invalhash);
+	buf_shard_unlock(bs);
+
 	bufstats.bufs_eblk++;
 
 	lck_mtx_unlock(buf_mtxp);
@@ -3295,124 +3522,39 @@ allocbuf(buf_t bp, int size)
 }
 
 /*
- *	Get a new buffer from one of the free lists.
- *
- *	Request for a queue is passes in. The queue from which the buffer was taken
- *	from is returned. Out of range queue requests get BQ_EMPTY. Request for
- *	BQUEUE means no preference. Use heuristics in that case.
- *	Heuristics is as follows:
- *	Try BQ_AGE, BQ_LRU, BQ_EMPTY, BQ_META in that order.
- *	If none available block till one is made available.
- *	If buffers available on both BQ_AGE and BQ_LRU, check the timestamps.
- *	Pick the most stale buffer.
- *	If found buffer was marked delayed write, start the async. write
- *	and restart the search.
- *	Initialize the fields and disassociate the buffer from the vnode.
- *	Remove the buffer from the hash. Return the buffer and the queue
- *	on which it was found.
+ *	Pick a buffer from the free lists of one shard, following
+ *	the heuristics described for getnewbuf below.
  *
- *	buf_mtxp is held upon entry
- *	returns with buf_mtxp locked if new buf available
- *	returns with buf_mtxp UNlocked if new buf NOT available
+ *	the shard lock is held
  */
-
 static buf_t
-getnewbuf(int slpflag, int slptimeo, int * queue)
+getnewbuf_pick(struct bufshard *bs, int *queue)
 {
 	buf_t	bp;
 	buf_t	lru_bp;
 	buf_t	age_bp;
 	buf_t	meta_bp;
 	int	age_time, lru_time, bp_time, meta_time;
-	int	req = *queue;	/* save it for restarts */
-	struct timespec ts;
-
-start:
-	/*
-	 * invalid request gets empty queue
-	 */
-	if ((*queue >= BQUEUES) || (*queue < 0)
-		|| (*queue == BQ_LAUNDRY) || (*queue == BQ_LOCKED))
-		*queue = BQ_EMPTY;
 
-
-	if (*queue == BQ_EMPTY && (bp = bufqueues[*queue].tqh_first))
-	        goto found;
-
-	/*
-	 * need to grow number of bufs, add another one rather than recycling
-	 */
-	if (nbuf_headers < max_nbuf_headers) {
-		/*
-		 * Increment  count now as lock 
-		 * is dropped for allocation.
-		 * That avoids over commits
-		 */
-		nbuf_headers++;
-		goto add_newbufs;
-	}
 	/* Try for the requested queue first */
-	bp = bufqueues[*queue].tqh_first;
+	bp = bs->bs_queues[*queue].tqh_first;
 	if (bp)
-	        goto found;
+	        return (bp);
 
 	/* Unable to use requested queue */
-	age_bp = bufqueues[BQ_AGE].tqh_first;
-	lru_bp = bufqueues[BQ_LRU].tqh_first;
-	meta_bp = bufqueues[BQ_META].tqh_first;
+	age_bp = bs->bs_queues[BQ_AGE].tqh_first;
+	lru_bp = bs->bs_queues[BQ_LRU].tqh_first;
+	meta_bp = bs->bs_queues[BQ_META].tqh_first;
 
 	if (!age_bp && !lru_bp && !meta_bp) {
 		/*
 		 * Unavailble on AGE or LRU or META queues
-		 * Try the empty list first
+		 * Try the empty list
 		 */
-		bp = bufqueues[BQ_EMPTY].tqh_first;
-		if (bp) {
-			*queue = BQ_EMPTY;
-			goto found;
-		}
-		/*
-		 * We have seen is this is hard to trigger.
-		 * This is an overcommit of nbufs but needed 
-		 * in some scenarios with diskiamges
-		 */
-
-add_newbufs:
-		lck_mtx_unlock(buf_mtxp);
-
-		/* Create a new temporary buffer header */
-		bp = (struct buf *)zalloc(buf_hdr_zone);
-		
-		if (bp) {
-			bufhdrinit(bp);
-			bp->b_whichq = BQ_EMPTY;
-			bp->b_timestamp = buf_timestamp();
-			BLISTNONE(bp);
-			SET(bp->b_flags, B_HDRALLOC);
+		bp = bs->bs_queues[BQ_EMPTY].tqh_first;
+		if (bp)
 			*queue = BQ_EMPTY;
-		}
-		lck_mtx_lock_spin(buf_mtxp);
-
-		if (bp) {
-			binshash(bp, &invalhash);
-			binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
-			buf_hdr_count++;
-			goto found;
-		}
-		/* subtract already accounted bufcount */
-		nbuf_headers--;
-
-		bufstats.bufs_sleeps++;
-
-		/* wait for a free buffer of any kind */
-		needbuffer = 1;
-		/* hz value is 100 */
-		ts.tv_sec = (slptimeo/1000);
-		/* the hz value is 100; which leads to 10ms */
-		ts.tv_nsec = (slptimeo % 1000) * NSEC_PER_USEC * 1000 * 10;
-
-		msleep(&needbuffer, buf_mtxp, slpflag | PDROP | (PRIBIO+1), "getnewbuf", &ts);
-		return (NULL);
+		return (bp);
 	}
 
 	/* Buffer available either on AGE or LRU or META */
@@ -3471,7 +3613,157 @@ add_newbufs:
 			}
 		}
 	}
+	return (bp);
+}
+
+/*
+ *	Get a new buffer from one of the free lists.
+ *
+ *	Request for a queue is passes in. The queue from which the buffer was taken
+ *	from is returned. Out of range queue requests get BQ_EMPTY. Request for
+ *	BQUEUE means no preference. Use heuristics in that case.
+ *	Heuristics is as follows:
+ *	Try BQ_AGE, BQ_LRU, BQ_EMPTY, BQ_META in that order.
+ *	If none available block till one is made available.
+ *	If buffers available on both BQ_AGE and BQ_LRU, check the timestamps.
+ *	Pick the most stale buffer.
+ *	If found buffer was marked delayed write, start the async. write
+ *	and restart the search.
+ *	Initialize the fields and disassociate the buffer from the vnode.
+ *	Remove the buffer from the hash. Return the buffer and the queue
+ *	on which it was found.
+ *
+ *	The shards are searched starting with 'pref', the shard the
+ *	caller is going to hash the buffer into, so that buffers only
+ *	migrate between shards when the preferred one has nothing to give.
+ *	The returned buffer still belongs to the shard it was found in.
+ *
+ *	buf_mtxp is held upon entry, no shard locks are
+ *	returns with buf_mtxp locked if new buf available
+ *	returns with buf_mtxp UNlocked if new buf NOT available
+ */
+
+static buf_t
+getnewbuf(int slpflag, int slptimeo, int * queue, struct bufshard *pref)
+{
+	buf_t	bp;
+	struct bufshard *bs;
+	int	req = *queue;	/* save it for restarts */
+	int	first = pref - bufshards;
+	int	waiting = 0;
+	int	i;
+	struct timespec ts;
+
+start:
+	/*
+	 * invalid request gets empty queue
+	 */
+	if ((*queue >= BQUEUES) || (*queue < 0)
+		|| (*queue == BQ_LAUNDRY) || (*queue == BQ_LOCKED))
+		*queue = BQ_EMPTY;
+
+
+	if (*queue == BQ_EMPTY) {
+		for (i = 0; i < BUF_NSHARDS; i++) {
+			bs = &bufshards[(first + i) % BUF_NSHARDS];
+
+			buf_shard_lock_spin(bs);
+
+			if ((bp = bs->bs_queues[BQ_EMPTY].tqh_first))
+				goto found;
+			buf_shard_unlock(bs);
+		}
+	}
+	/*
+	 * need to grow number of bufs, add another one rather than recycling
+	 */
+	if (nbuf_headers < max_nbuf_headers) {
+		/*
+		 * Increment  count now as lock 
+		 * is dropped for allocation.
+		 * That avoids over commits
+		 */
+		nbuf_headers++;
+		goto add_newbufs;
+	}
+	for (i = 0; i < BUF_NSHARDS; i++) {
+		bs = &bufshards[(first + i) % BUF_NSHARDS];
+
+		buf_shard_lock_spin(bs);
+
+		if ((bp = getnewbuf_pick(bs, queue)))
+			goto found;
+		buf_shard_unlock(bs);
+	}
+	/*
+	 * We have seen is this is hard to trigger.
+	 * This is an overcommit of nbufs but needed 
+	 * in some scenarios with diskiamges
+	 */
+
+add_newbufs:
+	lck_mtx_unlock(buf_mtxp);
+
+	/* Create a new temporary buffer header */
+	bp = (struct buf *)zalloc(buf_hdr_zone);
+		
+	if (bp) {
+		bufhdrinit(bp);
+		bp->b_whichq = BQ_EMPTY;
+		bp->b_timestamp = buf_timestamp();
+		BLISTNONE(bp);
+		SET(bp->b_flags, B_HDRALLOC);
+		*queue = BQ_EMPTY;
+	}
+	lck_mtx_lock_spin(buf_mtxp);
+
+	if (bp) {
+		bs = pref;
+		bp->b_shard = bs;
+
+		buf_shard_lock_spin(bs);
+
+		binshash(bp, &bs->bs_invalhash);
+		binsheadfree(bp, &bs->bs_queues[BQ_EMPTY], BQ_EMPTY);
+		buf_hdr_count++;
+		goto found;
+	}
+	/* subtract already accounted bufcount */
+	nbuf_headers--;
+
+	if (waiting == 0 || needbuffer == 0) {
+		/*
+		 * the free lists are protected by the shard locks,
+		 * so a buffer can be released into a shard we've
+		 * already looked at... advertise that we're about
+		 * to wait before taking one last look, so that
+		 * anyone freeing a buffer from here on will wake us.
+		 * if needbuffer was cleared while we had dropped
+		 * buf_mtxp for the zalloc, a buffer has been freed
+		 * since we last looked, so look again
+		 */
+		needbuffer = 1;
+		waiting = 1;
+
+		*queue = req;
+		goto start;
+	}
+	bufstats.bufs_sleeps++;
+
+	/* wait for a free buffer of any kind */
+	needbuffer = 1;
+	/* hz value is 100 */
+	ts.tv_sec = (slptimeo/1000);
+	/* the hz value is 100; which leads to 10ms */
+	ts.tv_nsec = (slptimeo % 1000) * NSEC_PER_USEC * 1000 * 10;
+
+	msleep(&needbuffer, buf_mtxp, slpflag | PDROP | (PRIBIO+1), "getnewbuf", &ts);
+	return (NULL);
+
 found:
+	/*
+	 * bs is locked
+	 */
 	if (ISSET(bp->b_flags, B_LOCKED) || ISSET(bp->b_lflags, BL_BUSY))
 	        panic("getnewbuf: bp @ %p is LOCKED or BUSY! (flags 0x%x)\n", bp, bp->b_flags);
 
@@ -3493,12 +3785,14 @@ found:
  * Returns 1 if issued a buf_bawrite() to indicate 
  * that the buffer is not ready.
  * 
- * buf_mtxp is held upon entry
- * returns with buf_mtxp locked
+ * buf_mtxp and the buffer's shard lock are held upon entry
+ * returns with buf_mtxp locked and the shard lock dropped
  */
 int
 bcleanbuf(buf_t bp, boolean_t discard)
 {
+	struct bufshard *bs = bp->b_shard;
+
 	/* Remove from the queue */
 	bremfree_locked(bp);
 
@@ -3517,9 +3811,10 @@ bcleanbuf(buf_t bp, boolean_t discard)
 
 		bmovelaundry(bp);
 
+		buf_shard_unlock(bs);
 		lck_mtx_unlock(buf_mtxp);
 
-		wakeup(&bufqueues[BQ_LAUNDRY]);
+		wakeup(&blaundrycnt);
 		/*
 		 * and give it a chance to run
 		 */
@@ -3537,10 +3832,12 @@ bcleanbuf(buf_t bp, boolean_t discard)
 	 * Buffer is no longer on any free list... we own it
 	 */
 	SET(bp->b_lflags, BL_BUSY);
-	buf_busycount++;
+	bs->bs_busycount++;
 	
 	bremhash(bp);
 
+	buf_shard_unlock(bs);
+
 	/*
 	 * disassociate us from our vnode, if we had one...
 	 */
@@ -3561,12 +3858,16 @@ bcleanbuf(buf_t bp, boolean_t discard)
 	/* If discarding, just move to the empty queue */
 	if (discard) {
 		lck_mtx_lock_spin(buf_mtxp);
+		buf_shard_lock_spin(bs);
+
 		CLR(bp->b_flags, (B_META | B_ZALLOC | B_DELWRI | B_LOCKED | B_AGE | B_ASYNC | B_NOCACHE | B_FUA));
 		bp->b_whichq = BQ_EMPTY;
-		binshash(bp, &invalhash);
-		binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
+		binshash(bp, &bs->bs_invalhash);
+		binsheadfree(bp, &bs->bs_queues[BQ_EMPTY], BQ_EMPTY);
 		CLR(bp->b_lflags, BL_BUSY);
-		buf_busycount--;
+		bs->bs_busycount--;
+
+		buf_shard_unlock(bs);
 	} else {
 		/* Not discarding: clean up and prepare for reuse */
 		bp->b_bufsize = 0;
@@ -3607,24 +3908,26 @@ buf_invalblkno(vnode_t vp, daddr64_t lblkno, int flags)
         buf_t	bp;
 	errno_t	error;
 	struct bufhashhdr *dp;
+	struct bufshard *bs;
 
 	dp = BUFHASH(vp, lblkno);
+	bs = BUFSHARD(dp);
 
 relook:	
-	lck_mtx_lock_spin(buf_mtxp);
+	buf_shard_lock_spin(bs);
 
 	if ((bp = incore_locked(vp, lblkno, dp)) == (struct buf *)0) {
-	        lck_mtx_unlock(buf_mtxp);
+	        buf_shard_unlock(bs);
 		return (0);
 	}
 	if (ISSET(bp->b_lflags, BL_BUSY)) {
 	        if ( !ISSET(flags, BUF_WAIT)) {
-		        lck_mtx_unlock(buf_mtxp);
+		        buf_shard_unlock(bs);
 			return (EBUSY);
 		}
 	        SET(bp->b_lflags, BL_WANTED);
 
-		error = msleep((caddr_t)bp, buf_mtxp, PDROP | (PRIBIO + 1), "buf_invalblkno", NULL);
+		error = buf_shard_msleep(bs, (caddr_t)bp, PDROP | (PRIBIO + 1), "buf_invalblkno", NULL);
 
 		if (error) {
 			return (error);
@@ -3634,12 +3937,12 @@ relook:
 	bremfree_locked(bp);
 	SET(bp->b_lflags, BL_BUSY);
 	SET(bp->b_flags, B_INVAL);
-	buf_busycount++;
+	bs->bs_busycount++;
 #ifdef JOE_DEBUG
 	bp->b_owner = current_thread();
 	bp->b_tag   = 4;
 #endif
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 	buf_brelse(bp);
 
 	return (0);
@@ -3650,13 +3953,14 @@ void
 buf_drop(buf_t bp)
 {
         int need_wakeup = 0;
+	struct bufshard *bs;
 
-	lck_mtx_lock_spin(buf_mtxp);
+	bs = buf_shard_lock(bp);
 
 	if (ISSET(bp->b_lflags, BL_WANTED)) {
 	        /*	
 		 * delay the actual wakeup until after we
-		 * clear BL_BUSY and we've dropped buf_mtxp
+		 * clear BL_BUSY and we've dropped the shard lock
 		 */
 		need_wakeup = 1;
 	}
@@ -3668,9 +3972,9 @@ buf_drop(buf_t bp)
 	 * Unlock the buffer.
 	 */
 	CLR(bp->b_lflags, (BL_BUSY | BL_WANTED));
-	buf_busycount--;
+	bs->bs_busycount--;
 
-	lck_mtx_unlock(buf_mtxp);
+	buf_shard_unlock(bs);
 
 	if (need_wakeup) {
 	        /*
@@ -3684,19 +3988,56 @@ buf_drop(buf_t bp)
 errno_t
 buf_acquire(buf_t bp, int flags, int slpflag, int slptimeo) {
         errno_t error;
+	struct bufshard *bs;
 
-        lck_mtx_lock_spin(buf_mtxp);
+	bs = buf_shard_lock(bp);
 
-	error = buf_acquire_locked(bp, flags, slpflag, slptimeo);
+	error = buf_acquire_shard_locked(bp, bs, flags, slpflag, slptimeo);
 
-       	lck_mtx_unlock(buf_mtxp);
+	/*
+	 * if we had to sleep, the shard lock has already been dropped
+	 */
+	if (error == 0 || error == EBUSY || error == EDEADLK)
+		buf_shard_unlock(bs);
 
 	return (error);
 }
 
 
+/*
+ * called with buf_mtxp held by the vnode list walkers...
+ * returns with buf_mtxp held, but if the buffer is busy
+ * and we have to wait for it, buf_mtxp is dropped while
+ * we sleep (EAGAIN or an msleep error is returned)
+ */
 static errno_t
 buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
+{
+	errno_t error;
+	struct bufshard *bs;
+
+	bs = buf_shard_lock(bp);
+
+	error = buf_acquire_shard_locked(bp, bs, flags | BAC_LISTED, slpflag, slptimeo);
+
+	if (error == 0 || error == EBUSY || error == EDEADLK)
+		buf_shard_unlock(bs);
+	else
+		lck_mtx_lock(buf_mtxp);
+
+	return (error);
+}
+
+
+/*
+ * called with the buffer's shard lock held...
+ * if the buffer is busy and we have to wait for it, the shard
+ * lock (and buf_mtxp, if BAC_LISTED) is dropped and either EAGAIN
+ * or the msleep error is returned... otherwise the shard lock is
+ * still held on return
+ */
+static errno_t
+buf_acquire_shard_locked(buf_t bp, struct bufshard *bs, int flags, int slpflag, int slptimeo)
 {
 	errno_t error;
 	struct timespec ts;
@@ -3718,10 +4059,18 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 			return (EBUSY);
 	        SET(bp->b_lflags, BL_WANTED);
 
+		/*
+		 * buf_mtxp can't be held across the sleep... it
+		 * comes before the shard lock, and whoever clears
+		 * BL_BUSY only needs the shard lock
+		 */
+		if (flags & BAC_LISTED)
+			lck_mtx_unlock(buf_mtxp);
+
 		/* the hz value is 100; which leads to 10ms */
 		ts.tv_sec = (slptimeo/100);
 		ts.tv_nsec = (slptimeo % 100) * 10  * NSEC_PER_USEC * 1000;
-		error = msleep((caddr_t)bp, buf_mtxp, slpflag | (PRIBIO + 1), "buf_acquire", &ts);
+		error = buf_shard_msleep(bs, (caddr_t)bp, slpflag | PDROP | (PRIBIO + 1), "buf_acquire", &ts);
 
 		if (error)
 			return (error);
@@ -3730,7 +4079,7 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 	if (flags & BAC_REMOVE)
 	        bremfree_locked(bp);
 	SET(bp->b_lflags, BL_BUSY);
-	buf_busycount++;
+	bs->bs_busycount++;
 
 #ifdef JOE_DEBUG
 	bp->b_owner = current_thread();
@@ -3747,16 +4096,18 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 errno_t
 buf_biowait(buf_t bp)
 {
+	struct bufshard *bs;
+
 	while (!ISSET(bp->b_flags, B_DONE)) {
 
-		lck_mtx_lock_spin(buf_mtxp);
+		bs = buf_shard_lock(bp);
 
 		if (!ISSET(bp->b_flags, B_DONE)) {
 			DTRACE_IO1(wait__start, buf_t, bp);
-			(void) msleep(bp, buf_mtxp, PDROP | (PRIBIO+1), "buf_biowait", NULL);
+			(void) buf_shard_msleep(bs, bp, PDROP | (PRIBIO+1), "buf_biowait", NULL);
 			DTRACE_IO1(wait__done, buf_t, bp);
 		} else
-			lck_mtx_unlock(buf_mtxp);
+			buf_shard_unlock(bs);
 	}
 	/* check for interruption of I/O (e.g. via NFS), then errors. */
 	if (ISSET(bp->b_flags, B_EINTR)) {
@@ -3792,6 +4143,7 @@ void
 buf_biodone(buf_t bp)
 {
 	mount_t mp;
+	struct bufshard *bs;
 	
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 387)) | DBG_FUNC_START,
 		     bp, bp->b_datap, bp->b_flags, 0, 0);
@@ -3922,12 +4274,12 @@ buf_biodone(buf_t bp)
 		 * they do get to run, their going to re-set
 		 * BL_WANTED and go back to sleep
 		 */
-	        lck_mtx_lock_spin(buf_mtxp);
+	        bs = buf_shard_lock(bp);
 
 		CLR(bp->b_lflags, BL_WANTED);
 		SET(bp->b_flags, B_DONE);		/* note that it's done */
 
-	        lck_mtx_unlock(buf_mtxp);
+	        buf_shard_unlock(bs);
 
 		wakeup(bp);
 	}
@@ -3943,15 +4295,17 @@ int
 count_lock_queue(void)
 {
 	buf_t	bp;
+	struct bufshard *bs;
 	int	n = 0;
 
-	lck_mtx_lock_spin(buf_mtxp);
-
-	for (bp = bufqueues[BQ_LOCKED].tqh_first; bp;
-	    bp = bp->b_freelist.tqe_next)
-		n++;
-	lck_mtx_unlock(buf_mtxp);
+	for (bs = bufshards; bs < &bufshards[BUF_NSHARDS]; bs++) {
+		buf_shard_lock_spin(bs);
 
+		for (bp = bs->bs_queues[BQ_LOCKED].tqh_first; bp;
+		    bp = bp->b_freelist.tqe_next)
+			n++;
+		buf_shard_unlock(bs);
+	}
 	return (n);
 }
 
@@ -3962,7 +4316,44 @@ count_lock_queue(void)
 int
 count_busy_buffers(void)
 {
-	return buf_busycount + bufstats.bufs_iobufinuse;
+	return buf_busycount() + bufstats.bufs_iobufinuse;
+}
+
+/*
+ * Snapshot the per-shard lock statistics for the
+ * kern.bufcache_shard_stats sysctl... returns the
+ * number of entries filled in
+ */
+int
+buf_shard_get_stats(struct bufshard_stats *stats, int count)
+{
+	struct bufshard *bs;
+	uint64_t hold_total, hold_max;
+	int i;
+
+	if (count > BUF_NSHARDS)
+		count = BUF_NSHARDS;
+
+	for (i = 0; i < count; i++) {
+		bs = &bufshards[i];
+
+		/*
+		 * don't go through buf_shard_lock_spin...
+		 * we don't want to count ourselves
+		 */
+		lck_mtx_lock_spin(&bs->bs_mtx);
+
+		stats[i].bss_acquired = bs->bs_acquired;
+		stats[i].bss_contended = bs->bs_contended;
+		hold_total = bs->bs_hold_total;
+		hold_max = bs->bs_hold_max;
+
+		lck_mtx_unlock(&bs->bs_mtx);
+
+		absolutetime_to_nanoseconds(hold_total, &stats[i].bss_hold_total);
+		absolutetime_to_nanoseconds(hold_max, &stats[i].bss_hold_max);
+	}
+	return (count);
 }
 
 #if DIAGNOSTIC
@@ -3976,23 +4367,25 @@ vfs_bufstats()
 {
 	int i, j, count;
 	struct buf *bp;
-	struct bqueues *dp;
+	struct bufshard *bs;
 	int counts[MAXBSIZE/CLBYTES+1];
 	static char *bname[BQUEUES] =
 		{ "LOCKED", "LRU", "AGE", "EMPTY", "META", "LAUNDRY" };
 
-	for (dp = bufqueues, i = 0; dp < &bufqueues[BQUEUES]; dp++, i++) {
+	for (i = 0; i < BQUEUES; i++) {
 		count = 0;
 		for (j = 0; j <= MAXBSIZE/CLBYTES; j++)
 			counts[j] = 0;
 
-		lck_mtx_lock(buf_mtxp);
+		for (bs = bufshards; bs < &bufshards[BUF_NSHARDS]; bs++) {
+			buf_shard_lock_spin(bs);
 
-		for (bp = dp->tqh_first; bp; bp = bp->b_freelist.tqe_next) {
-			counts[bp->b_bufsize/CLBYTES]++;
-			count++;
+			for (bp = bs->bs_queues[i].tqh_first; bp; bp = bp->b_freelist.tqe_next) {
+				counts[bp->b_bufsize/CLBYTES]++;
+				count++;
+			}
+			buf_shard_unlock(bs);
 		}
-		lck_mtx_unlock(buf_mtxp);
 
 		printf("%s: total-%d", bname[i], count);
 		for (j = 0; j <= MAXBSIZE/CLBYTES; j++)
@@ -4135,19 +4528,42 @@ bcleanbuf_thread_init(void)
 
 typedef int (*bcleanbufcontinuation)(int);
 
+static int blaundry_next;	/* next shard to launder, private to bcleanbuf_thread */
+
 static void
 bcleanbuf_thread(void)
 {
 	struct buf *bp;
+	struct bufshard *bs;
 	int error = 0;
 	int loopcnt = 0;
+	int i;
 
 	for (;;) {
 	        lck_mtx_lock_spin(buf_mtxp);
 
-		while ( (bp = TAILQ_FIRST(&bufqueues[BQ_LAUNDRY])) == NULL) {
-			(void)msleep0(&bufqueues[BQ_LAUNDRY], buf_mtxp, PRIBIO|PDROP, "blaundry", 0, (bcleanbufcontinuation)bcleanbuf_thread);
+		/*
+		 * buffers are only moved to a laundry queue with
+		 * buf_mtxp held, so holding it across the scan
+		 * of the shards means we can't miss a wakeup
+		 */
+		for (;;) {
+			bp = NULL;
+
+			for (i = 0; i < BUF_NSHARDS; i++) {
+				bs = &bufshards[(blaundry_next + i) % BUF_NSHARDS];
+
+				buf_shard_lock_spin(bs);
+
+				if ((bp = TAILQ_FIRST(&bs->bs_queues[BQ_LAUNDRY])) != NULL)
+					break;
+				buf_shard_unlock(bs);
+			}
+			if (bp != NULL)
+				break;
+			(void)msleep0(&blaundrycnt, buf_mtxp, PRIBIO|PDROP, "blaundry", 0, (bcleanbufcontinuation)bcleanbuf_thread);
 		}
+		blaundry_next = (bs - bufshards) + 1;
 		
 		/*
 		 * Remove from the queue
@@ -4158,13 +4574,14 @@ bcleanbuf_thread(void)
 		 * Buffer is no longer on any free list
 		 */
 		SET(bp->b_lflags, BL_BUSY);
-		buf_busycount++;
+		bs->bs_busycount++;
 
 #ifdef JOE_DEBUG
 		bp->b_owner = current_thread();
 		bp->b_tag   = 10;
 #endif
 
+		buf_shard_unlock(bs);
 		lck_mtx_unlock(buf_mtxp);
 		/*
 		 * do the IO
@@ -4175,20 +4592,20 @@ bcleanbuf_thread(void)
 		        bp->b_whichq = BQ_LAUNDRY;
 			bp->b_timestamp = buf_timestamp();
 
-		        lck_mtx_lock_spin(buf_mtxp);
+		        bs = buf_shard_lock(bp);
 
-			binstailfree(bp, &bufqueues[BQ_LAUNDRY], BQ_LAUNDRY);
-			blaundrycnt++;
+			binstailfree(bp, &bs->bs_queues[BQ_LAUNDRY], BQ_LAUNDRY);
+			OSAddAtomic(1, &blaundrycnt);
 
 			/* we never leave a busy page on the laundry queue */
 			CLR(bp->b_lflags, BL_BUSY);
-			buf_busycount--;
+			bs->bs_busycount--;
 #ifdef JOE_DEBUG
 			bp->b_owner = current_thread();
 			bp->b_tag   = 11;
 #endif
 
-			lck_mtx_unlock(buf_mtxp);
+			buf_shard_unlock(bs);
 			
 			if (loopcnt > MAXLAUNDRY) {
 				/*
@@ -4196,7 +4613,7 @@ bcleanbuf_thread(void)
 				 * done several I/Os and failed, give the system some time to unthrottle
 				 * the vnode
 				 */
-				(void)tsleep((void *)&bufqueues[BQ_LAUNDRY], PRIBIO, "blaundry", 1);
+				(void)tsleep((void *)&blaundrycnt, PRIBIO, "blaundry", 1);
 				loopcnt = 0;
 			} else {
 				/* give other threads a chance to run */
@@ -4268,6 +4685,7 @@ boolean_t
 buffer_cache_gc(int all)
 {
 	buf_t bp;
+	struct bufshard *bs;
 	boolean_t did_large_zfree = FALSE;
 	boolean_t need_wakeup = FALSE;
 	int now = buf_timestamp();
@@ -4292,46 +4710,52 @@ buffer_cache_gc(int all)
 		TAILQ_INIT(&privq);
 		need_wakeup = FALSE;
 
-		while (((bp = TAILQ_FIRST(&bufqueues[BQ_META]))) && 
-				(now > bp->b_timestamp) &&
-				(now - bp->b_timestamp > thresh_hold) && 
-				(found < BUF_MAX_GC_BATCH_SIZE)) {
+		for (bs = bufshards; bs < &bufshards[BUF_NSHARDS] && found < BUF_MAX_GC_BATCH_SIZE; bs++) {
 
-			/* Remove from free list */
-			bremfree_locked(bp);
-			found++;
+			buf_shard_lock_spin(bs);
+
+			while (((bp = TAILQ_FIRST(&bs->bs_queues[BQ_META]))) && 
+					(now > bp->b_timestamp) &&
+					(now - bp->b_timestamp > thresh_hold) && 
+					(found < BUF_MAX_GC_BATCH_SIZE)) {
+
+				/* Remove from free list */
+				bremfree_locked(bp);
+				found++;
 
 #ifdef JOE_DEBUG
-			bp->b_owner = current_thread();
-			bp->b_tag   = 12;
+				bp->b_owner = current_thread();
+				bp->b_tag   = 12;
 #endif
 
-			/* If dirty, move to laundry queue and remember to do wakeup */
-			if (ISSET(bp->b_flags, B_DELWRI)) {
-				SET(bp->b_lflags, BL_WANTDEALLOC);
+				/* If dirty, move to laundry queue and remember to do wakeup */
+				if (ISSET(bp->b_flags, B_DELWRI)) {
+					SET(bp->b_lflags, BL_WANTDEALLOC);
 
-				bmovelaundry(bp);
-				need_wakeup = TRUE;
+					bmovelaundry(bp);
+					need_wakeup = TRUE;
 
-				continue;
-			}
+					continue;
+				}
 
-			/* 
-			 * Mark busy and put on private list.  We could technically get 
-			 * away without setting BL_BUSY here.
-			 */
-			SET(bp->b_lflags, BL_BUSY);
-			buf_busycount++;
+				/* 
+				 * Mark busy and put on private list.  We could technically get 
+				 * away without setting BL_BUSY here.
+				 */
+				SET(bp->b_lflags, BL_BUSY);
+				bs->bs_busycount++;
 
-			/* 
-			 * Remove from hash and dissociate from vp.
-			 */
-			bremhash(bp);
-			if (bp->b_vp) {
-				brelvp_locked(bp);
-			}
+				/* 
+				 * Remove from hash and dissociate from vp.
+				 */
+				bremhash(bp);
+				if (bp->b_vp) {
+					brelvp_locked(bp);
+				}
 
-			TAILQ_INSERT_TAIL(&privq, bp, b_freelist);
+				TAILQ_INSERT_TAIL(&privq, bp, b_freelist);
+			}
+			buf_shard_unlock(bs);
 		}
 
 		if (found == 0) {
@@ -4343,7 +4767,7 @@ buffer_cache_gc(int all)
 
 		/* Wakeup and yield for laundry if need be */
 		if (need_wakeup) {
-			wakeup(&bufqueues[BQ_LAUNDRY]);
+			wakeup(&blaundrycnt);
 			(void)thread_block(THREAD_CONTINUE_NULL);
 		}
 
@@ -4370,11 +4794,19 @@ buffer_cache_gc(int all)
 		}
 		lck_mtx_lock(buf_mtxp);
 
-		/* Back under lock, move them all to invalid hash and clear busy */
-		TAILQ_FOREACH(bp, &privq, b_freelist) {
-			binshash(bp, &invalhash);
+		/*
+		 * Back under lock, move them all to the invalid hash
+		 * and empty queue of their shard and clear busy
+		 */
+		while ((bp = TAILQ_FIRST(&privq))) {
+			TAILQ_REMOVE(&privq, bp, b_freelist);
+
+			bs = buf_shard_lock(bp);
+
+			binshash(bp, &bs->bs_invalhash);
+			binsheadfree(bp, &bs->bs_queues[BQ_EMPTY], BQ_EMPTY);
 			CLR(bp->b_lflags, BL_BUSY);
-			buf_busycount--;
+			bs->bs_busycount--;
 
 #ifdef JOE_DEBUG
 			if (bp->b_owner != current_thread()) {
@@ -4383,11 +4815,9 @@ buffer_cache_gc(int all)
 			bp->b_owner = current_thread();
 			bp->b_tag   = 13;
 #endif
+			buf_shard_unlock(bs);
 		}
 
-		/* And do a big bulk move to the empty queue */
-		TAILQ_CONCAT(&bufqueues[BQ_EMPTY], &privq, b_freelist);
-
 	} while (all && (found == BUF_MAX_GC_BATCH_SIZE));
 
 	lck_mtx_unlock(buf_mtxp);
@@ -4424,7 +4854,9 @@ int
 bflushq(int whichq, mount_t mp)
 {
 	buf_t	bp, next;
+	struct bufshard *bs;
 	int	i, buf_count;
+	int	shard = 0;
 	int	total_writes = 0;
 	static buf_t flush_table[NFLUSH];
 
@@ -4433,11 +4865,14 @@ bflushq(int whichq, mount_t mp)
 	}
 
   restart:
-	lck_mtx_lock(buf_mtxp);
+	for (buf_count = 0; shard < BUF_NSHARDS; shard++) {
+	  bs = &bufshards[shard];
+
+	  buf_shard_lock_spin(bs);
 
-	bp = TAILQ_FIRST(&bufqueues[whichq]);
+	  bp = TAILQ_FIRST(&bs->bs_queues[whichq]);
 
-	for (buf_count = 0; bp; bp = next) {
+	  for (; bp; bp = next) {
 	    next = bp->b_freelist.tqe_next;
 			
 	    if (bp->b_vp == NULL || bp->b_vp->v_mount != mp) {
@@ -4452,14 +4887,14 @@ bflushq(int whichq, mount_t mp)
 		bp->b_tag   = 7;
 #endif
 		SET(bp->b_lflags, BL_BUSY);
-		buf_busycount++;
+		bs->bs_busycount++;
 
 		flush_table[buf_count] = bp;
 		buf_count++;
 		total_writes++;
 
 		if (buf_count >= NFLUSH) {
-		    lck_mtx_unlock(buf_mtxp);
+		    buf_shard_unlock(bs);
 
 		    qsort(flush_table, buf_count, sizeof(struct buf *), bp_cmp);
 
@@ -4469,8 +4904,9 @@ bflushq(int whichq, mount_t mp)
 		    goto restart;
 		}
 	    }
+	  }
+	  buf_shard_unlock(bs);
 	}
-	lck_mtx_unlock(buf_mtxp);
 
 	if (buf_count > 0) {
 	    qsort(flush_table, buf_count, sizeof(struct buf *), bp_cmp);
@@ -73,6 +73,7 @@
 #include <sys/resourcevar.h>
 #include <miscfs/specfs/specdev.h>
 #include <sys/uio_internal.h>
+#include <sys/tree.h>
 #include <libkern/libkern.h>
 #include <machine/machine_routines.h>
 
@@ -84,6 +85,9 @@
 #include <mach/vm_map.h>
 #include <mach/upl.h>
 #include <kern/task.h>
+#include <kern/thread.h>
+#include <kern/kalloc.h>
+#include <kern/zalloc.h>
 
 #include <vm/vm_kern.h>
 #include <vm/vm_map.h>
@@ -189,18 +193,20 @@ static int cluster_write_contig(vnode_t vp, struct uio *uio, off_t newEOF,
 static int cluster_align_phys_io(vnode_t vp, struct uio *uio, addr64_t usr_paddr, u_int32_t xsize, int flags, int (*)(buf_t, void *), void *callback_arg);
 
 static int 	cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
-static void	cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *ra, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
+static void	cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *ra, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
+static void	cluster_ra_resize(vnode_t vp, struct cl_rastream *rap, int grow);
 
 static int	cluster_push_now(vnode_t vp, struct cl_extent *, off_t EOF, int flags, int (*)(buf_t, void *), void *callback_arg);
 
 static int	cluster_try_push(struct cl_writebehind *, vnode_t vp, off_t EOF, int push_flag, int flags, int (*)(buf_t, void *), void *callback_arg);
 
 static void	sparse_cluster_switch(struct cl_writebehind *, vnode_t vp, off_t EOF, int (*)(buf_t, void *), void *callback_arg);
-static void	sparse_cluster_push(void **cmapp, vnode_t vp, off_t EOF, int push_flag, int io_flags, int (*)(buf_t, void *), void *callback_arg);
-static void	sparse_cluster_add(void **cmapp, vnode_t vp, struct cl_extent *, off_t EOF, int (*)(buf_t, void *), void *callback_arg);
+static u_int	sparse_cluster_push(void **cmapp, vnode_t vp, off_t EOF, int push_flag, int io_flags, int (*)(buf_t, void *), void *callback_arg);
+static void	sparse_cluster_add(struct cl_writebehind *, vnode_t vp, struct cl_extent *, off_t EOF, int (*)(buf_t, void *), void *callback_arg);
 
+static void	vfs_drt_init(void);
 static kern_return_t vfs_drt_mark_pages(void **cmapp, off_t offset, u_int length, u_int *setcountp);
-static kern_return_t vfs_drt_get_cluster(void **cmapp, off_t *offsetp, u_int *lengthp);
+static kern_return_t vfs_drt_get_cluster(void **cmapp, off_t *offsetp, u_int *lengthp, u_int maxlen);
 static kern_return_t vfs_drt_control(void **cmapp, int op_type);
 
 
@@ -288,6 +294,90 @@ SYSCTL_INT(_debug, OID_AUTO, lowpri_throttle_max_iosize, CTLFLAG_RW | CTLFLAG_LO
 SYSCTL_INT(_debug, OID_AUTO, lowpri_legacy_throttle_max_iosize, CTLFLAG_RW | CTLFLAG_LOCKED, &legacy_hard_throttle_max_iosize, 0, "");
 
 
+/*
+ * vfs.generic.readahead_stats returns a struct vfs_rastats
+ * for each mounted file system
+ */
+struct cl_rastats_args {
+	struct sysctl_req	*req;
+	size_t			count;
+	int			error;
+};
+
+static int
+cluster_rastats_callout(mount_t mp, void *arg)
+{
+	struct cl_rastats_args	*args = (struct cl_rastats_args *)arg;
+	struct vfs_rastats	vr;
+
+	args->count++;
+
+	if (args->req->oldptr == USER_ADDR_NULL)
+		return (VFS_RETURNED);
+
+	bzero(&vr, sizeof(vr));
+	vr.vr_fsid = mp->mnt_vfsstat.f_fsid;
+	vr.vr_stats = mp->mnt_rastats;
+
+	if ((args->error = SYSCTL_OUT(args->req, &vr, sizeof(vr))))
+		return (VFS_RETURNED_DONE);
+
+	return (VFS_RETURNED);
+}
+
+static int
+sysctl_cluster_rastats(__unused struct sysctl_oid *oidp, __unused void *arg1,
+		       __unused int arg2, struct sysctl_req *req)
+{
+	struct cl_rastats_args	args;
+
+	if (req->newptr != USER_ADDR_NULL)
+		return (EPERM);
+
+	args.req = req;
+	args.count = 0;
+	args.error = 0;
+
+	vfs_iterate(0, cluster_rastats_callout, &args);
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		/*
+		 * leave some slack for file systems mounted
+		 * before the caller comes back for the data
+		 */
+		req->oldidx = (args.count + 4) * sizeof(struct vfs_rastats);
+	}
+	return (args.error);
+}
+
+SYSCTL_DECL(_vfs_generic);
+SYSCTL_PROC(_vfs_generic, OID_AUTO, readahead_stats, CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
+	    NULL, 0, sysctl_cluster_rastats, "S,vfs_rastats", "Per-mount cluster read-ahead statistics");
+
+
+/*
+ * vfs.generic.sparse counts the work done on behalf of files that
+ * have fallen into the sparse cluster write-back mechanism, and how
+ * well their dirty pages merged on the way out
+ */
+struct cl_sparse_stats {
+	int64_t		ss_clusters;		/* clusters pushed from sparse maps */
+	int64_t		ss_pages;		/* pages spanned by those clusters */
+	int64_t		ss_sync_pushes;		/* pushes forced on a writing thread by a full map */
+	int64_t		ss_direct_pushes;	/* extents pushed because no map entry could be had */
+};
+
+static struct cl_sparse_stats sparse_stats;
+static u_int32_t drt_max_entries;		/* per-map entry limit, sized by vfs_drt_init */
+
+SYSCTL_NODE(_vfs_generic, OID_AUTO, sparse, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "sparse cluster write-back");
+SYSCTL_UINT(_vfs_generic_sparse, OID_AUTO, max_entries, CTLFLAG_RD | CTLFLAG_LOCKED, &drt_max_entries, 0, "");
+SYSCTL_QUAD(_vfs_generic_sparse, OID_AUTO, clusters, CTLFLAG_RD | CTLFLAG_LOCKED, &sparse_stats.ss_clusters, "");
+SYSCTL_QUAD(_vfs_generic_sparse, OID_AUTO, pages, CTLFLAG_RD | CTLFLAG_LOCKED, &sparse_stats.ss_pages, "");
+SYSCTL_QUAD(_vfs_generic_sparse, OID_AUTO, sync_pushes, CTLFLAG_RD | CTLFLAG_LOCKED, &sparse_stats.ss_sync_pushes, "");
+SYSCTL_QUAD(_vfs_generic_sparse, OID_AUTO, direct_pushes, CTLFLAG_RD | CTLFLAG_LOCKED, &sparse_stats.ss_direct_pushes, "");
+
+
 void
 cluster_init(void) {
         /*
@@ -305,6 +395,8 @@ cluster_init(void) {
 
 	if (cl_transaction_mtxp == NULL)
 	        panic("cluster_init: failed to allocate cl_transaction_mtxp");
+
+	vfs_drt_init();
 }
 
 
@@ -360,6 +452,47 @@ cluster_max_io_size(mount_t mp, int type)
 #define CLW_IONOCACHE		0x04
 #define CLW_IOPASSIVE	0x08
 
+/*
+ * minimum read-ahead window for a stream, in pages... windows
+ * start at a quarter of the maximum read-ahead and move between
+ * these bounds as cluster_ra_resize sees stalls and evictions
+ */
+#define CL_RA_MINWIN	8
+
+#define CL_RASTAT(vp, field, n)	OSAddAtomic64((int64_t)(n), &(vp)->v_mount->mnt_rastats.field)
+
+/*
+ * the largest read-ahead we'll issue for a stream on this vnode, in pages
+ */
+static int
+cluster_ra_maxwin(vnode_t vp)
+{
+	u_int	max_prefetch;
+
+	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
+
+	if ((max_prefetch / PAGE_SIZE) > speculative_prefetch_max)
+		max_prefetch = (speculative_prefetch_max * PAGE_SIZE);
+
+	return (max_prefetch / PAGE_SIZE);
+}
+
+
+/*
+ * is stream 'a' a better candidate for recycling than stream 'b'...
+ * streams that never got read-ahead going (random readers) go first,
+ * then the least recently used
+ */
+static int
+cluster_ra_older(struct cl_rastream *a, struct cl_rastream *b)
+{
+	if ((a->cl_ralen == 0) != (b->cl_ralen == 0))
+		return (a->cl_ralen == 0);
+
+	return ((int32_t)(a->cl_lastuse - b->cl_lastuse) < 0);
+}
+
+
 /*
  * if the read ahead context doesn't yet exist,
  * allocate and initialize it...
@@ -368,20 +501,27 @@ cluster_max_io_size(mount_t mp, int type)
  * to grab the lock wins... the other callers
  * will release the now unnecessary storage
  * 
- * once the context is present, try to grab (but don't block on)
- * the lock associated with it... if someone
- * else currently owns it, than the read
- * will run without read-ahead.  this allows
- * multiple readers to run in parallel and
- * since there's only 1 read ahead context,
- * there's no real loss in only allowing 1
- * reader to have read-ahead enabled.
+ * once the context is present, find the stream
+ * this read continues (it starts where the stream's
+ * last read left off)... if there isn't one, start
+ * a new stream, recycling an idle one if all the
+ * slots are in use.  the stream is marked busy until
+ * cluster_release_rap... if another reader already
+ * owns the stream this read continues, or every
+ * stream is busy, the read runs without read-ahead.
+ *
+ * a busy stream's state belongs to its reader and is
+ * updated without cl_lockr held... other callers only
+ * peek at cl_lastr to match a stream, and a stale
+ * value just costs them a new stream.
  */
-static struct cl_readahead *
-cluster_get_rap(vnode_t vp)
+static struct cl_rastream *
+cluster_get_rap(vnode_t vp, struct cl_extent *extent)
 {
         struct ubc_info		*ubc;
 	struct cl_readahead	*rap;
+	struct cl_rastream	*rasp, *victim;
+	int			i;
 
 	ubc = vp->v_ubcinfo;
 
@@ -389,7 +529,8 @@ cluster_get_rap(vnode_t vp)
 	        MALLOC_ZONE(rap, struct cl_readahead *, sizeof *rap, M_CLRDAHEAD, M_WAITOK);
 
 		bzero(rap, sizeof *rap);
-		rap->cl_lastr = -1;
+		for (i = 0; i < CL_MAX_RASTREAMS; i++)
+			rap->cl_streams[i].cl_lastr = -1;
 		lck_mtx_init(&rap->cl_lockr, cl_mtx_grp, cl_mtx_attr);
 
 		vnode_lock(vp);
@@ -403,10 +544,108 @@ cluster_get_rap(vnode_t vp)
 		}
 		vnode_unlock(vp);
 	}
-	if (lck_mtx_try_lock(&rap->cl_lockr) == TRUE)
-	        return(rap);
-	
-	return ((struct cl_readahead *)NULL);
+	lck_mtx_lock(&rap->cl_lockr);
+
+	for (i = 0; i < CL_MAX_RASTREAMS; i++) {
+		rasp = &rap->cl_streams[i];
+
+		if (rasp->cl_lastr != -1 && (extent->b_addr == rasp->cl_lastr || extent->b_addr == (rasp->cl_lastr + 1))) {
+			if (rasp->cl_busy)
+				rasp = NULL;
+			goto out;
+		}
+	}
+	victim = NULL;
+
+	for (i = 0; i < CL_MAX_RASTREAMS; i++) {
+		rasp = &rap->cl_streams[i];
+
+		if (rasp->cl_busy)
+			continue;
+		if (rasp->cl_lastr == -1) {
+			victim = rasp;
+			break;
+		}
+		if (victim == NULL || cluster_ra_older(rasp, victim))
+			victim = rasp;
+	}
+	if ((rasp = victim) == NULL)
+		goto out;
+
+	if (rasp->cl_lastr != -1) {
+		CL_RASTAT(vp, mrs_recycled, 1);
+
+		if (rasp->cl_maxra > rasp->cl_lastr)
+			CL_RASTAT(vp, mrs_wasted_pages, rasp->cl_maxra - rasp->cl_lastr);
+	}
+	KERNEL_DEBUG_CONSTANT((FSDBG_CODE(DBG_FSRW, 36)) | DBG_FUNC_NONE,
+			      vp, (int)extent->b_addr, (int)rasp->cl_lastr, (int)rasp->cl_maxra, (int)(rasp - &rap->cl_streams[0]));
+
+	rasp->cl_lastr = -1;
+	rasp->cl_maxra = 0;
+	rasp->cl_ralen = 0;
+	rasp->cl_rawin = 0;
+
+	CL_RASTAT(vp, mrs_streams, 1);
+out:
+	if (rasp != NULL)
+		rasp->cl_busy = 1;
+	lck_mtx_unlock(&rap->cl_lockr);
+
+	return (rasp);
+}
+
+
+static void
+cluster_release_rap(vnode_t vp, struct cl_rastream *rasp)
+{
+	struct cl_readahead	*rap;
+
+	rap = vp->v_ubcinfo->cl_rahead;
+
+	lck_mtx_lock(&rap->cl_lockr);
+	rasp->cl_busy = 0;
+	rasp->cl_lastuse = ++rap->cl_clock;
+	lck_mtx_unlock(&rap->cl_lockr);
+}
+
+
+/*
+ * a stream's window caps how far cluster_read_ahead ramps cl_ralen.
+ * a read that has to issue its own I/O beyond the end of a fully
+ * opened window means the read-ahead doesn't cover the device's
+ * latency at the rate the stream is being consumed, so double it...
+ * a read that finds the pages we read ahead already evicted means
+ * we're reading further ahead than the page cache will hold on to
+ * (typically with many streams in flight), so halve it.
+ */
+static void
+cluster_ra_resize(vnode_t vp, struct cl_rastream *rap, int grow)
+{
+	int	old_win;
+	int	max_win;
+
+	max_win = cluster_ra_maxwin(vp);
+
+	if (rap->cl_rawin == 0)
+		rap->cl_rawin = max(max_win / 4, min(CL_RA_MINWIN, max_win));
+	old_win = rap->cl_rawin;
+
+	if (grow) {
+		rap->cl_rawin = min(max_win, old_win * 2);
+
+		if (rap->cl_rawin != old_win)
+			CL_RASTAT(vp, mrs_grows, 1);
+	} else {
+		rap->cl_rawin = max(min(CL_RA_MINWIN, max_win), old_win / 2);
+
+		if (rap->cl_rawin != old_win)
+			CL_RASTAT(vp, mrs_shrinks, 1);
+		if (rap->cl_ralen > rap->cl_rawin)
+			rap->cl_ralen = rap->cl_rawin;
+	}
+	KERNEL_DEBUG_CONSTANT((FSDBG_CODE(DBG_FSRW, 38)) | DBG_FUNC_NONE,
+			      vp, (int)rap->cl_lastr, old_win, rap->cl_rawin, grow);
 }
 
 
@@ -1713,13 +1952,13 @@ cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, in
 
 
 static void
-cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, int (*callback)(buf_t, void *), void *callback_arg,
+cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *rap, int (*callback)(buf_t, void *), void *callback_arg,
 		   int bflag)
 {
 	daddr64_t	r_addr;
 	off_t		f_offset;
 	int		size_of_prefetch;
-	u_int		max_prefetch;
+	int		max_win;
 
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_START,
@@ -1739,18 +1978,24 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 
 		return;
 	}
-	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
-
-	if ((max_prefetch / PAGE_SIZE) > speculative_prefetch_max)
-		max_prefetch = (speculative_prefetch_max * PAGE_SIZE);
+	max_win = cluster_ra_maxwin(vp);
 
-	if (max_prefetch <= PAGE_SIZE) {
+	if (max_win <= 1) {
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
 			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 6, 0);
 		return;
 	}
+	/*
+	 * size the stream's window the first time through, and pick up
+	 * any reduction in the maximum since (e.g. via sysctl)
+	 */
+	if (rap->cl_rawin == 0)
+		rap->cl_rawin = max(max_win / 4, min(CL_RA_MINWIN, max_win));
+	else if (rap->cl_rawin > max_win)
+		rap->cl_rawin = max_win;
+
 	if (extent->e_addr < rap->cl_maxra) {
-	        if ((rap->cl_maxra - extent->e_addr) > ((max_prefetch / PAGE_SIZE) / 4)) {
+	        if ((rap->cl_maxra - extent->e_addr) > (rap->cl_rawin / 4)) {
 
 		        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
 				     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 2, 0);
@@ -1772,20 +2017,23 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 	if (f_offset < filesize) {
 	        daddr64_t read_size;
 
-	        rap->cl_ralen = rap->cl_ralen ? min(max_prefetch / PAGE_SIZE, rap->cl_ralen << 1) : 1;
+	        rap->cl_ralen = rap->cl_ralen ? min(rap->cl_rawin, rap->cl_ralen << 1) : 1;
 
 		read_size = (extent->e_addr + 1) - extent->b_addr;
 
 		if (read_size > rap->cl_ralen) {
-		        if (read_size > max_prefetch / PAGE_SIZE)
-			        rap->cl_ralen = max_prefetch / PAGE_SIZE;
+		        if (read_size > rap->cl_rawin)
+			        rap->cl_ralen = rap->cl_rawin;
 			else
 			        rap->cl_ralen = read_size;
 		}
 		size_of_prefetch = cluster_read_prefetch(vp, f_offset, rap->cl_ralen * PAGE_SIZE, filesize, callback, callback_arg, bflag);
 
-		if (size_of_prefetch)
+		if (size_of_prefetch) {
 		        rap->cl_maxra = (r_addr + size_of_prefetch) - 1;
+
+			CL_RASTAT(vp, mrs_prefetch_pages, size_of_prefetch);
+		}
 	}
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
 		     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 4, 0);
@@ -3136,7 +3384,7 @@ check_cluster:
 					 * we've fallen into the sparse
 					 * cluster method of delaying dirty pages
 					 */
-					sparse_cluster_add(&(wbp->cl_scmap), vp, &cl, newEOF, callback, callback_arg);
+					sparse_cluster_add(wbp, vp, &cl, newEOF, callback, callback_arg);
 
 					lck_mtx_unlock(&wbp->cl_lockw);
 
@@ -3336,7 +3584,7 @@ check_cluster:
 				 * sparse mechanism....
 				 */
 			        sparse_cluster_switch(wbp, vp, newEOF, callback, callback_arg);
-				sparse_cluster_add(&(wbp->cl_scmap), vp, &cl, newEOF, callback, callback_arg);
+				sparse_cluster_add(wbp, vp, &cl, newEOF, callback, callback_arg);
 
 				lck_mtx_unlock(&wbp->cl_lockw);
 
@@ -3508,7 +3756,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 	u_int32_t        max_prefetch;
 	u_int            rd_ahead_enabled = 1;
 	u_int            prefetch_enabled = 1;
-	struct cl_readahead *	rap;
+	struct cl_rastream *	rap;
 	struct clios		iostate;
 	struct cl_extent	extent;
 	int              bflag;
@@ -3560,12 +3808,11 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 
 			max_rd_size = THROTTLE_MAX_IOSIZE;
 		}
-	        if ((rap = cluster_get_rap(vp)) == NULL)
+		extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
+		extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
+
+	        if ((rap = cluster_get_rap(vp, &extent)) == NULL)
 		        rd_ahead_enabled = 0;
-		else {
-			extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
-			extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
-		}
 	}
 	if (rap != NULL && rap->cl_ralen && (rap->cl_lastr == extent.b_addr || (rap->cl_lastr + 1) == extent.b_addr)) {
 	        /*
@@ -3665,6 +3912,8 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			        break;
 			if (io_size == 0) {
 				if (rap != NULL) {
+					if (rap->cl_ralen && extent.e_addr <= rap->cl_maxra)
+						CL_RASTAT(vp, mrs_hits, 1);
 				        if (extent.e_addr < rap->cl_lastr)
 					        rap->cl_maxra = 0;
 					rap->cl_lastr = extent.e_addr;
@@ -3794,10 +4043,24 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
                                         * we've just issued a read for a block that should have been
                                         * in the cache courtesy of the read-ahead engine... something
                                         * has gone wrong with the pipeline, so reset the read-ahead
-                                        * logic which will cause us to restart from scratch
+                                        * logic which will cause us to restart from scratch... the
+                                        * pages were evicted before we got to them, so read less
+                                        * far ahead on this stream from now on
                                         */
                                         rap->cl_maxra = 0;
-                               }
+
+					CL_RASTAT(vp, mrs_evictions, 1);
+					cluster_ra_resize(vp, rap, 0);
+                               } else if (rap->cl_ralen && rap->cl_ralen >= rap->cl_rawin && rd_ahead_enabled) {
+					/*
+					 * the stream is sequential and its read-ahead
+					 * is already running at full window, yet we
+					 * still got ahead of it and had to wait for
+					 * the device... read further ahead
+					 */
+					CL_RASTAT(vp, mrs_stalls, 1);
+					cluster_ra_resize(vp, rap, 1);
+			       }
                         }
 		}
 		if (error == 0) {
@@ -3996,7 +4259,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 32)) | DBG_FUNC_END,
 			     (int)uio->uio_offset, io_req_size, rap->cl_lastr, retval, 0);
 
-	        lck_mtx_unlock(&rap->cl_lockr);
+	        cluster_release_rap(vp, rap);
 	} else {
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 32)) | DBG_FUNC_END,
 			     (int)uio->uio_offset, io_req_size, 0, retval, 0);
@@ -5520,7 +5783,7 @@ sparse_cluster_switch(struct cl_writebehind *wbp, vnode_t vp, off_t EOF, int (*c
 			        if (flags & UPL_POP_DIRTY) {
 				        cl.e_addr = cl.b_addr + 1;
 
-				        sparse_cluster_add(&(wbp->cl_scmap), vp, &cl, EOF, callback, callback_arg);
+				        sparse_cluster_add(wbp, vp, &cl, EOF, callback, callback_arg);
 				}
 			}
 		}
@@ -5535,21 +5798,27 @@ sparse_cluster_switch(struct cl_writebehind *wbp, vnode_t vp, off_t EOF, int (*c
  * sparse_cluster_push must be called with the write-behind lock held if the scmap is
  * still associated with the write-behind context... however, if the scmap has been disassociated
  * from the write-behind context (the cluster_push case), the wb lock is not held
+ *
+ * returns the number of pages covered by the cluster(s) pushed
  */
-static void
+static u_int
 sparse_cluster_push(void **scmap, vnode_t vp, off_t EOF, int push_flag, int io_flags, int (*callback)(buf_t, void *), void *callback_arg)
 {
         struct cl_extent cl;
         off_t		offset;
 	u_int		length;
+	u_int		max_length;
+	u_int		pushed = 0;
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 79)) | DBG_FUNC_START, vp, (*scmap), 0, push_flag, 0);
 
 	if (push_flag & PUSH_ALL)
 	        vfs_drt_control(scmap, 1);
 
+	max_length = min(MAX_CLUSTER_SIZE(vp), MAX_IO_CONTIG_SIZE);
+
 	for (;;) {
-	        if (vfs_drt_get_cluster(scmap, &offset, &length) != KERN_SUCCESS)
+	        if (vfs_drt_get_cluster(scmap, &offset, &length, max_length) != KERN_SUCCESS)
 			break;
 
 		cl.b_addr = (daddr64_t)(offset / PAGE_SIZE_64);
@@ -5557,10 +5826,17 @@ sparse_cluster_push(void **scmap, vnode_t vp, off_t EOF, int push_flag, int io_f
 
 		cluster_push_now(vp, &cl, EOF, io_flags & (IO_PASSIVE|IO_CLOSE), callback, callback_arg);
 
+		pushed += length / PAGE_SIZE;
+
+		OSAddAtomic64(1, &sparse_stats.ss_clusters);
+		OSAddAtomic64(length / PAGE_SIZE, &sparse_stats.ss_pages);
+
 		if ( !(push_flag & PUSH_ALL) )
 		        break;
 	}
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 79)) | DBG_FUNC_END, vp, (*scmap), 0, 0, 0);
+
+	return (pushed);
 }
 
 
@@ -5568,29 +5844,45 @@ sparse_cluster_push(void **scmap, vnode_t vp, off_t EOF, int push_flag, int io_f
  * sparse_cluster_add is called with the write behind lock held
  */
 static void
-sparse_cluster_add(void **scmap, vnode_t vp, struct cl_extent *cl, off_t EOF, int (*callback)(buf_t, void *), void *callback_arg)
+sparse_cluster_add(struct cl_writebehind *wbp, vnode_t vp, struct cl_extent *cl, off_t EOF, int (*callback)(buf_t, void *), void *callback_arg)
 {
+        struct cl_extent cl_now;
         u_int	new_dirty;
 	u_int	length;
 	off_t	offset;
 
-	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 80)) | DBG_FUNC_START, (*scmap), 0, cl->b_addr, (int)cl->e_addr, 0);
+	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 80)) | DBG_FUNC_START, wbp->cl_scmap, 0, cl->b_addr, (int)cl->e_addr, 0);
 
 	offset = (off_t)(cl->b_addr * PAGE_SIZE_64);
 	length = ((u_int)(cl->e_addr - cl->b_addr)) * PAGE_SIZE;
 
-	while (vfs_drt_mark_pages(scmap, offset, length, &new_dirty) != KERN_SUCCESS) {
+	while (vfs_drt_mark_pages(&(wbp->cl_scmap), offset, length, &new_dirty) != KERN_SUCCESS) {
 	        /*
 		 * no room left in the map
 		 * only a partial update was done
 		 * push out some pages and try again
 		 */
-	        sparse_cluster_push(scmap, vp, EOF, 0, 0, callback, callback_arg);
-
 		offset += (new_dirty * PAGE_SIZE_64);
 		length -= (new_dirty * PAGE_SIZE);
+
+		OSAddAtomic64(1, &sparse_stats.ss_sync_pushes);
+
+	        if (sparse_cluster_push(&(wbp->cl_scmap), vp, EOF, 0, 0, callback, callback_arg) == 0) {
+		        /*
+			 * the map was already empty, so we're out of
+			 * entries system wide... push the rest of
+			 * this extent directly rather than spin
+			 */
+		        cl_now.b_addr = (daddr64_t)(offset / PAGE_SIZE_64);
+			cl_now.e_addr = cl_now.b_addr + (length / PAGE_SIZE);
+
+			cluster_push_now(vp, &cl_now, EOF, 0, callback, callback_arg);
+
+			OSAddAtomic64(1, &sparse_stats.ss_direct_pushes);
+			break;
+		}
 	}
-	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 80)) | DBG_FUNC_END, vp, (*scmap), 0, 0, 0);
+	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 80)) | DBG_FUNC_END, vp, wbp->cl_scmap, 0, 0, 0);
 }
 
 
@@ -5866,14 +6158,18 @@ is_file_clean(vnode_t vp, off_t filesize)
  *
  * The implementation assumes that the dirty regions are pages.
  *
- * To represent dirty pages within the file, we store bit vectors in a
- * variable-size circular hash.
+ * To represent dirty pages within the file, we store bit vectors in
+ * entries kept in a red-black tree sorted by file offset.  Because the
+ * entries are kept in file order, vfs_drt_get_cluster can hand back
+ * dirty runs in ascending order, resuming each time where the last one
+ * left off, and can merge runs that straddle neighbouring entries...
+ * a file that took lots of small random writes is cleaned by a sweep
+ * of large ascending I/Os rather than one small I/O per entry.
  */
 
 /*
  * Bitvector size.  This determines the number of pages we group in a
- * single hashtable entry.  Each hashtable entry is aligned to this
- * size within the file.
+ * single entry.  Each entry is aligned to this size within the file.
  */
 #define DRT_BITVECTOR_PAGES		256
 
@@ -5883,138 +6179,112 @@ is_file_clean(vnode_t vp, off_t filesize)
  * DRT_ADDRESS_MASK is dependent on DRT_BITVECTOR_PAGES;
  * the correct formula is  (~(DRT_BITVECTOR_PAGES * PAGE_SIZE) - 1)
  */
+#define DRT_ENTRY_SIZE			(1 << 20)
 #define DRT_ADDRESS_MASK		(~((1 << 20) - 1))
 #define DRT_ALIGN_ADDRESS(addr)		((addr) & DRT_ADDRESS_MASK)
 
 /*
- * Hashtable address field handling.
- *
- * The low-order bits of the hashtable address are used to conserve
- * space.
- *
- * DRT_HASH_COUNT_MASK must be large enough to store the range
- * 0-DRT_BITVECTOR_PAGES inclusive, as well as have one value
- * to indicate that the bucket is actually unoccupied.
- */
-#define DRT_HASH_GET_ADDRESS(scm, i)	((scm)->scm_hashtable[(i)].dhe_control & DRT_ADDRESS_MASK)
-#define DRT_HASH_SET_ADDRESS(scm, i, a)									\
-	do {												\
-		(scm)->scm_hashtable[(i)].dhe_control =							\
-		    ((scm)->scm_hashtable[(i)].dhe_control & ~DRT_ADDRESS_MASK) | DRT_ALIGN_ADDRESS(a);	\
-	} while (0)
-#define DRT_HASH_COUNT_MASK		0x1ff
-#define DRT_HASH_GET_COUNT(scm, i)	((scm)->scm_hashtable[(i)].dhe_control & DRT_HASH_COUNT_MASK)
-#define DRT_HASH_SET_COUNT(scm, i, c)											\
-	do {														\
-		(scm)->scm_hashtable[(i)].dhe_control =									\
-		    ((scm)->scm_hashtable[(i)].dhe_control & ~DRT_HASH_COUNT_MASK) | ((c) & DRT_HASH_COUNT_MASK);	\
-	} while (0)
-#define DRT_HASH_CLEAR(scm, i)                                                                                          \
-	do {														\
-		(scm)->scm_hashtable[(i)].dhe_control =	0;								\
-	} while (0)
-#define DRT_HASH_VACATE(scm, i)		DRT_HASH_SET_COUNT((scm), (i), DRT_HASH_COUNT_MASK)
-#define DRT_HASH_VACANT(scm, i)		(DRT_HASH_GET_COUNT((scm), (i)) == DRT_HASH_COUNT_MASK)
-#define DRT_HASH_COPY(oscm, oi, scm, i)									\
-	do {												\
-		(scm)->scm_hashtable[(i)].dhe_control = (oscm)->scm_hashtable[(oi)].dhe_control;	\
-		DRT_BITVECTOR_COPY(oscm, oi, scm, i);							\
-	} while(0);
-
-
-/*
- * Hash table moduli.
+ * Map size limits.
  *
- * Since the hashtable entry's size is dependent on the size of
- * the bitvector, and since the hashtable size is constrained to
- * both being prime and fitting within the desired allocation
- * size, these values need to be manually determined.
+ * A map may hold at most drt_max_entries entries, after which
+ * vfs_drt_mark_pages only does a partial update and the caller
+ * must clean something before it can continue.  The limits are the
+ * sizes of the old hashed map: DRT_MIN_ENTRIES, or DRT_MAX_ENTRIES
+ * (about 400MiB worth of file) once there's DRT_LARGE_MEMORY_REQUIRED
+ * of physical memory.  Maps are only cleaned by the threads writing
+ * to them and by fsync, so a larger map just means a larger burst of
+ * synchronous I/O when it finally fills.
  *
- * For DRT_BITVECTOR_SIZE = 256, the entry size is 40 bytes.
- *
- * The small hashtable allocation is 1024 bytes, so the modulus is 23.
- * The large hashtable allocation is 16384 bytes, so the modulus is 401.
+ * The entries for all maps come from drt_entry_zone, which is capped
+ * at 1/DRT_ZONE_MEMORY_RATIO of physical memory; running it dry is
+ * treated just like a full map.
  */
-#define DRT_HASH_SMALL_MODULUS	23
-#define DRT_HASH_LARGE_MODULUS	401
+#define DRT_MIN_ENTRIES			23
+#define DRT_MAX_ENTRIES			401
+#define DRT_LARGE_MEMORY_REQUIRED	(1024LL * 1024LL * 1024LL)	/* 1GiB */
+#define DRT_ZONE_MEMORY_RATIO		256
 
 /*
- * Physical memory required before the large hash modulus is permitted.
+ * Run merging.
  *
- * On small memory systems, the large hash modulus can lead to phsyical
- * memory starvation, so we avoid using it there.
+ * vfs_drt_get_cluster keeps growing a cluster across clean gaps of up
+ * to DRT_MERGE_GAP pages... cluster_push_now skips over the clean pages
+ * when it builds the I/Os, so absorbing a short gap costs nothing and
+ * lets a single UPL carry several neighbouring dirty runs.
  */
-#define DRT_HASH_LARGE_MEMORY_REQUIRED	(1024LL * 1024LL * 1024LL)	/* 1GiB */
-
-#define DRT_SMALL_ALLOCATION	1024	/* 104 bytes spare */
-#define DRT_LARGE_ALLOCATION	16384	/* 344 bytes spare */
+#define DRT_MERGE_GAP			16
 
 /* *** nothing below here has secret dependencies on DRT_BITVECTOR_PAGES *** */
 
 /*
- * Hashtable bitvector handling.
+ * Bitvector handling.
  *
  * Bitvector fields are 32 bits long.
  */
 
-#define DRT_HASH_SET_BIT(scm, i, bit)				\
-	(scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] |= (1 << ((bit) % 32))
+#define DRT_SET_BIT(ep, bit)					\
+	(ep)->dre_bitvector[(bit) / 32] |= (1 << ((bit) % 32))
 
-#define DRT_HASH_CLEAR_BIT(scm, i, bit)				\
-	(scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] &= ~(1 << ((bit) % 32))
+#define DRT_CLEAR_BIT(ep, bit)					\
+	(ep)->dre_bitvector[(bit) / 32] &= ~(1 << ((bit) % 32))
     
-#define DRT_HASH_TEST_BIT(scm, i, bit) 				\
-	((scm)->scm_hashtable[(i)].dhe_bitvector[(bit) / 32] & (1 << ((bit) % 32)))
+#define DRT_TEST_BIT(ep, bit)					\
+	((ep)->dre_bitvector[(bit) / 32] & (1 << ((bit) % 32)))
     
-#define DRT_BITVECTOR_CLEAR(scm, i) 				\
-	bzero(&(scm)->scm_hashtable[(i)].dhe_bitvector[0], (DRT_BITVECTOR_PAGES / 32) * sizeof(u_int32_t))
-
-#define DRT_BITVECTOR_COPY(oscm, oi, scm, i)			\
-	bcopy(&(oscm)->scm_hashtable[(oi)].dhe_bitvector[0],	\
-	    &(scm)->scm_hashtable[(i)].dhe_bitvector[0],	\
-	    (DRT_BITVECTOR_PAGES / 32) * sizeof(u_int32_t))
-
 
  
 /*
- * Hashtable entry.
+ * Tree entry.
  */
-struct vfs_drt_hashentry {
-	u_int64_t	dhe_control;
-	u_int32_t	dhe_bitvector[DRT_BITVECTOR_PAGES / 32];
+struct vfs_drt_entry {
+	RB_ENTRY(vfs_drt_entry)	dre_link;	/* tree linkage, sorted by dre_address */
+	u_int64_t		dre_address;	/* file offset of the first page covered */
+	u_int32_t		dre_count;	/* number of bits set in dre_bitvector */
+	u_int32_t		dre_bitvector[DRT_BITVECTOR_PAGES / 32];
 };
 
+RB_HEAD(vfs_drt_tree, vfs_drt_entry);
+
 /*
  * Dirty Region Tracking structure.
  *
- * The hashtable is allocated entirely inside the DRT structure.
- *
- * The hash is a simple circular prime modulus arrangement, the structure
- * is resized from small to large if it overflows.
+ * Entries are allocated individually as pages in their range are
+ * dirtied, and released as soon as the last of those pages is cleaned,
+ * so the map only ever holds entries with something left to push.
  */
 
 struct vfs_drt_clustermap {
 	u_int32_t		scm_magic;	/* sanity/detection */
-#define DRT_SCM_MAGIC		0x12020003
-	u_int32_t		scm_modulus;	/* current ring size */
-	u_int32_t		scm_buckets;	/* number of occupied buckets */
-	u_int32_t		scm_lastclean;	/* last entry we cleaned */
-	u_int32_t		scm_iskips;	/* number of slot skips */
-
-	struct vfs_drt_hashentry scm_hashtable[0];
+#define DRT_SCM_MAGIC		0x12020004
+	u_int32_t		scm_entries;	/* number of entries in scm_tree */
+	u_int32_t		scm_maxentries;	/* high water mark of scm_entries */
+	u_int32_t		scm_dirty;	/* number of dirty pages in the map */
+	u_int64_t		scm_lastclean;	/* offset the next cluster search starts at */
+	struct vfs_drt_tree	scm_tree;
 };
 
+static int
+vfs_drt_cmp(const struct vfs_drt_entry *a, const struct vfs_drt_entry *b)
+{
+	if (a->dre_address < b->dre_address)
+		return (-1);
+	if (a->dre_address > b->dre_address)
+		return (1);
+	return (0);
+}
+
+RB_PROTOTYPE_SC(static, vfs_drt_tree, vfs_drt_entry, dre_link, vfs_drt_cmp);
+RB_GENERATE(vfs_drt_tree, vfs_drt_entry, dre_link, vfs_drt_cmp);
 
-#define DRT_HASH(scm, addr)		((addr) % (scm)->scm_modulus)
-#define DRT_HASH_NEXT(scm, addr)	(((addr) + 1) % (scm)->scm_modulus)
+static zone_t		drt_entry_zone;
 
 /*
  * Debugging codes and arguments.
  */
 #define DRT_DEBUG_EMPTYFREE	(FSDBG_CODE(DBG_FSRW, 82)) /* nil */
 #define DRT_DEBUG_RETCLUSTER	(FSDBG_CODE(DBG_FSRW, 83)) /* offset, length */
-#define DRT_DEBUG_ALLOC		(FSDBG_CODE(DBG_FSRW, 84)) /* copycount */
-#define DRT_DEBUG_INSERT	(FSDBG_CODE(DBG_FSRW, 85)) /* offset, iskip */
+#define DRT_DEBUG_ALLOC		(FSDBG_CODE(DBG_FSRW, 84)) /* max entries */
+#define DRT_DEBUG_INSERT	(FSDBG_CODE(DBG_FSRW, 85)) /* offset, entries */
 #define DRT_DEBUG_MARK		(FSDBG_CODE(DBG_FSRW, 86)) /* offset, length,
 							    * dirty */
 							   /* 0, setcount */
@@ -6022,18 +6292,23 @@ struct vfs_drt_clustermap {
 							   /* 2 (map alloc fail) */
 							   /* 3, resid (partial) */
 #define DRT_DEBUG_6		(FSDBG_CODE(DBG_FSRW, 87))
-#define DRT_DEBUG_SCMDATA	(FSDBG_CODE(DBG_FSRW, 88)) /* modulus, buckets,
-							    * lastclean, iskips */
+#define DRT_DEBUG_SCMDATA	(FSDBG_CODE(DBG_FSRW, 88)) /* entries, dirty,
+							    * lastclean, maxentries */
 
 
 static kern_return_t	vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp);
 static kern_return_t	vfs_drt_free_map(struct vfs_drt_clustermap *cmap);
-static kern_return_t	vfs_drt_search_index(struct vfs_drt_clustermap *cmap,
-	u_int64_t offset, int *indexp);
-static kern_return_t	vfs_drt_get_index(struct vfs_drt_clustermap **cmapp,
+static struct vfs_drt_entry *vfs_drt_search_entry(struct vfs_drt_clustermap *cmap,
+	u_int64_t offset);
+static kern_return_t	vfs_drt_get_entry(struct vfs_drt_clustermap *cmap,
 	u_int64_t offset,
-	int *indexp,
-	int recursed);
+	struct vfs_drt_entry **epp);
+static void		vfs_drt_free_entry(struct vfs_drt_clustermap *cmap,
+	struct vfs_drt_entry *ep);
+static int		vfs_drt_next_dirty(struct vfs_drt_clustermap *cmap,
+	u_int64_t offset,
+	struct vfs_drt_entry **epp,
+	int *bitp);
 static kern_return_t	vfs_drt_do_mark_pages(
 	void		**cmapp,
 	u_int64_t	offset,
@@ -6050,247 +6325,193 @@ static void		vfs_drt_trace(
 
 
 /*
- * Allocate and initialise a sparse cluster map.
- *
- * Will allocate a new map, resize or compact an existing map.
+ * Size the per-map entry limit and set up the entry zone.
  *
- * XXX we should probably have at least one intermediate map size,
- * as the 1:16 ratio seems a bit drastic.
+ * Called once from cluster_init.
+ */
+static void
+vfs_drt_init(void)
+{
+	vm_size_t	zone_max;
+
+	if (max_mem >= DRT_LARGE_MEMORY_REQUIRED)
+		drt_max_entries = DRT_MAX_ENTRIES;
+	else
+		drt_max_entries = DRT_MIN_ENTRIES;
+
+	zone_max = (vm_size_t)(max_mem / DRT_ZONE_MEMORY_RATIO);
+
+	if (zone_max < DRT_MAX_ENTRIES * sizeof(struct vfs_drt_entry))
+		zone_max = DRT_MAX_ENTRIES * sizeof(struct vfs_drt_entry);
+
+	drt_entry_zone = zinit(sizeof(struct vfs_drt_entry), zone_max, PAGE_SIZE, "vfs_drt entries");
+
+	if (drt_entry_zone == NULL)
+		panic("vfs_drt_init: failed to allocate drt_entry_zone");
+
+	zone_change(drt_entry_zone, Z_EXHAUST, TRUE);
+	zone_change(drt_entry_zone, Z_CALLERACCT, FALSE);
+}
+
+
+/*
+ * Allocate and initialise a sparse cluster map.
  */
 static kern_return_t
 vfs_drt_alloc_map(struct vfs_drt_clustermap **cmapp)
 {
-	struct vfs_drt_clustermap *cmap, *ocmap;
-	kern_return_t	kret;
-	u_int64_t	offset;
-	u_int32_t	i;
-	int		nsize, active_buckets, index, copycount;
+	struct vfs_drt_clustermap *cmap;
 
-	ocmap = NULL;
-	if (cmapp != NULL)
-		ocmap = *cmapp;
-	
-	/*
-	 * Decide on the size of the new map.
-	 */
-	if (ocmap == NULL) {
-		nsize = DRT_HASH_SMALL_MODULUS;
-	} else {
-		/* count the number of active buckets in the old map */
-		active_buckets = 0;
-		for (i = 0; i < ocmap->scm_modulus; i++) {
-			if (!DRT_HASH_VACANT(ocmap, i) &&
-			    (DRT_HASH_GET_COUNT(ocmap, i) != 0))
-				active_buckets++;
-		}
-		/*
-		 * If we're currently using the small allocation, check to
-		 * see whether we should grow to the large one.
-		 */
-		if (ocmap->scm_modulus == DRT_HASH_SMALL_MODULUS) {
-			/* 
-			 * If the ring is nearly full and we are allowed to
-			 * use the large modulus, upgrade.
-			 */
-			if ((active_buckets > (DRT_HASH_SMALL_MODULUS - 5)) &&
-			    (max_mem >= DRT_HASH_LARGE_MEMORY_REQUIRED)) {
-				nsize = DRT_HASH_LARGE_MODULUS;
-			} else {
-				nsize = DRT_HASH_SMALL_MODULUS;
-			}
-		} else {
-			/* already using the large modulus */
-			nsize = DRT_HASH_LARGE_MODULUS;
-			/*
-			 * If the ring is completely full, there's
-			 * nothing useful for us to do.  Behave as
-			 * though we had compacted into the new
-			 * array and return.
-			 */
-			if (active_buckets >= DRT_HASH_LARGE_MODULUS)
-				return(KERN_SUCCESS);
-		}
-	}
+	cmap = (struct vfs_drt_clustermap *)kalloc(sizeof(*cmap));
 
-	/*
-	 * Allocate and initialise the new map.
-	 */
+	if (cmap == NULL)
+		return(KERN_RESOURCE_SHORTAGE);
 
-	kret = kmem_alloc(kernel_map, (vm_offset_t *)&cmap,
-	    (nsize == DRT_HASH_SMALL_MODULUS) ? DRT_SMALL_ALLOCATION : DRT_LARGE_ALLOCATION);
-	if (kret != KERN_SUCCESS)
-		return(kret);
+	bzero(cmap, sizeof(*cmap));
 	cmap->scm_magic = DRT_SCM_MAGIC;
-	cmap->scm_modulus = nsize;
-	cmap->scm_buckets = 0;
-	cmap->scm_lastclean = 0;
-	cmap->scm_iskips = 0;
-	for (i = 0; i < cmap->scm_modulus; i++) {
-	        DRT_HASH_CLEAR(cmap, i);
-		DRT_HASH_VACATE(cmap, i);
-		DRT_BITVECTOR_CLEAR(cmap, i);
-	}
+	RB_INIT(&cmap->scm_tree);
 
-	/*
-	 * If there's an old map, re-hash entries from it into the new map.
-	 */
-	copycount = 0;
-	if (ocmap != NULL) {
-		for (i = 0; i < ocmap->scm_modulus; i++) {
-			/* skip empty buckets */
-			if (DRT_HASH_VACANT(ocmap, i) ||
-			    (DRT_HASH_GET_COUNT(ocmap, i) == 0))
-				continue;
-			/* get new index */
-			offset = DRT_HASH_GET_ADDRESS(ocmap, i);
-			kret = vfs_drt_get_index(&cmap, offset, &index, 1);
-			if (kret != KERN_SUCCESS) {
-				/* XXX need to bail out gracefully here */
-				panic("vfs_drt: new cluster map mysteriously too small");
-				index = 0;
-			}
-			/* copy */
-			DRT_HASH_COPY(ocmap, i, cmap, index);
-			copycount++;
-		}
-	}
+	vfs_drt_trace(cmap, DRT_DEBUG_ALLOC, drt_max_entries, 0, 0, 0);
 
-	/* log what we've done */
-	vfs_drt_trace(cmap, DRT_DEBUG_ALLOC, copycount, 0, 0, 0);
-	
-	/*
-	 * It's important to ensure that *cmapp always points to 
-	 * a valid map, so we must overwrite it before freeing
-	 * the old map.
-	 */
 	*cmapp = cmap;
-	if (ocmap != NULL) {
-		/* emit stats into trace buffer */
-		vfs_drt_trace(ocmap, DRT_DEBUG_SCMDATA,
-			      ocmap->scm_modulus,
-			      ocmap->scm_buckets,
-			      ocmap->scm_lastclean,
-			      ocmap->scm_iskips);
 
-		vfs_drt_free_map(ocmap);
-	}
 	return(KERN_SUCCESS);
 }
 
 
 /*
- * Free a sparse cluster map.
+ * Free a sparse cluster map, along with any entries still in it.
  */
 static kern_return_t
 vfs_drt_free_map(struct vfs_drt_clustermap *cmap)
 {
-	kmem_free(kernel_map, (vm_offset_t)cmap, 
-		  (cmap->scm_modulus == DRT_HASH_SMALL_MODULUS) ? DRT_SMALL_ALLOCATION : DRT_LARGE_ALLOCATION);
+	struct vfs_drt_entry *ep;
+
+	while ((ep = RB_MIN(vfs_drt_tree, &cmap->scm_tree)) != NULL)
+		vfs_drt_free_entry(cmap, ep);
+
+	kfree(cmap, sizeof(*cmap));
+
 	return(KERN_SUCCESS);
 }
 
 
 /*
- * Find the hashtable slot currently occupied by an entry for the supplied offset.
+ * Find the entry covering offset or, failing that, the first one
+ * beyond it.
  */
-static kern_return_t
-vfs_drt_search_index(struct vfs_drt_clustermap *cmap, u_int64_t offset, int *indexp)
+static struct vfs_drt_entry *
+vfs_drt_search_entry(struct vfs_drt_clustermap *cmap, u_int64_t offset)
 {
-	int		index;
-	u_int32_t	i;
+	struct vfs_drt_entry *ep, *next;
 
 	offset = DRT_ALIGN_ADDRESS(offset);
-	index = DRT_HASH(cmap, offset);
+	next = NULL;
 
-	/* traverse the hashtable */
-	for (i = 0; i < cmap->scm_modulus; i++) {
+	for (ep = RB_ROOT(&cmap->scm_tree); ep != NULL; ) {
+		if (ep->dre_address == offset)
+			return(ep);
 
-		/*
-		 * If the slot is vacant, we can stop.
-		 */
-		if (DRT_HASH_VACANT(cmap, index))
-			break;
+		if (ep->dre_address > offset) {
+			next = ep;
+			ep = RB_LEFT(ep, dre_link);
+		} else
+			ep = RB_RIGHT(ep, dre_link);
+	}
+	return(next);
+}
 
-		/*
-		 * If the address matches our offset, we have success.
-		 */
-		if (DRT_HASH_GET_ADDRESS(cmap, index) == offset) {
-			*indexp = index;
-			return(KERN_SUCCESS);
-		}
 
-		/*
-		 * Move to the next slot, try again.
-		 */
-		index = DRT_HASH_NEXT(cmap, index);
+/*
+ * Return the entry covering offset, inserting an empty one if needed.
+ *
+ * Fails if the map is already at drt_max_entries or the entry zone has
+ * been exhausted.
+ */
+static kern_return_t
+vfs_drt_get_entry(struct vfs_drt_clustermap *cmap, u_int64_t offset, struct vfs_drt_entry **epp)
+{
+	struct vfs_drt_entry *ep, find;
+
+	find.dre_address = DRT_ALIGN_ADDRESS(offset);
+
+	if ((ep = RB_FIND(vfs_drt_tree, &cmap->scm_tree, &find)) != NULL) {
+		*epp = ep;
+		return(KERN_SUCCESS);
 	}
-	/*
-	 * It's not there.
-	 */
-	return(KERN_FAILURE);
+	if (cmap->scm_entries >= drt_max_entries)
+		return(KERN_FAILURE);
+
+	if ((ep = (struct vfs_drt_entry *)zalloc(drt_entry_zone)) == NULL)
+		return(KERN_RESOURCE_SHORTAGE);
+
+	bzero(ep, sizeof(*ep));
+	ep->dre_address = find.dre_address;
+
+	RB_INSERT(vfs_drt_tree, &cmap->scm_tree, ep);
+
+	if (++cmap->scm_entries > cmap->scm_maxentries)
+		cmap->scm_maxentries = cmap->scm_entries;
+
+	vfs_drt_trace(cmap, DRT_DEBUG_INSERT, (int)find.dre_address, cmap->scm_entries, 0, 0);
+
+	*epp = ep;
+
+	return(KERN_SUCCESS);
+}
+
+
+static void
+vfs_drt_free_entry(struct vfs_drt_clustermap *cmap, struct vfs_drt_entry *ep)
+{
+	RB_REMOVE(vfs_drt_tree, &cmap->scm_tree, ep);
+	cmap->scm_entries--;
+	cmap->scm_dirty -= ep->dre_count;
+
+	zfree(drt_entry_zone, ep);
 }
 
+
 /*
- * Find the hashtable slot for the supplied offset.  If we haven't allocated
- * one yet, allocate one and populate the address field.  Note that it will
- * not have a nonzero page count and thus will still technically be free, so
- * in the case where we are called to clean pages, the slot will remain free.
+ * Find the first dirty page at or beyond offset.
+ *
+ * Returns 1 and the entry and bit holding it if there is one.
  */
-static kern_return_t
-vfs_drt_get_index(struct vfs_drt_clustermap **cmapp, u_int64_t offset, int *indexp, int recursed)
+static int
+vfs_drt_next_dirty(struct vfs_drt_clustermap *cmap, u_int64_t offset, struct vfs_drt_entry **epp, int *bitp)
 {
-	struct vfs_drt_clustermap *cmap;
-	kern_return_t	kret;
-	u_int32_t	index;
-	u_int32_t	i;
+	struct vfs_drt_entry *ep;
+	int		i;
 
-	cmap = *cmapp;
+	for (ep = vfs_drt_search_entry(cmap, offset); ep != NULL; ep = RB_NEXT(vfs_drt_tree, &cmap->scm_tree, ep)) {
 
-	/* look for an existing entry */
-	kret = vfs_drt_search_index(cmap, offset, indexp);
-	if (kret == KERN_SUCCESS)
-		return(kret);
+		if (ep->dre_address < offset)
+			i = (int)((offset - ep->dre_address) / PAGE_SIZE);
+		else
+			i = 0;
 
-	/* need to allocate an entry */
-	offset = DRT_ALIGN_ADDRESS(offset);
-	index = DRT_HASH(cmap, offset);
-
-	/* scan from the index forwards looking for a vacant slot */
-	for (i = 0; i < cmap->scm_modulus; i++) {
-		/* slot vacant? */
-		if (DRT_HASH_VACANT(cmap, index) || DRT_HASH_GET_COUNT(cmap,index) == 0) {
-			cmap->scm_buckets++;
-			if (index < cmap->scm_lastclean)
-				cmap->scm_lastclean = index;
-			DRT_HASH_SET_ADDRESS(cmap, index, offset);
-			DRT_HASH_SET_COUNT(cmap, index, 0);
-			DRT_BITVECTOR_CLEAR(cmap, index);
-			*indexp = index;
-			vfs_drt_trace(cmap, DRT_DEBUG_INSERT, (int)offset, i, 0, 0);
-			return(KERN_SUCCESS);
+		while (i < DRT_BITVECTOR_PAGES) {
+			if ((i % 32) == 0 && ep->dre_bitvector[i / 32] == 0) {
+				i += 32;
+				continue;
+			}
+			if (DRT_TEST_BIT(ep, i)) {
+				*epp = ep;
+				*bitp = i;
+				return(1);
+			}
+			i++;
 		}
-		cmap->scm_iskips += i;
-		index = DRT_HASH_NEXT(cmap, index);
 	}
-
-	/*
-	 * We haven't found a vacant slot, so the map is full.  If we're not
-	 * already recursed, try reallocating/compacting it.
-	 */
-	if (recursed)
-		return(KERN_FAILURE);
-	kret = vfs_drt_alloc_map(cmapp);
-	if (kret == KERN_SUCCESS) {
-		/* now try to insert again */
-		kret = vfs_drt_get_index(cmapp, offset, indexp, 1);
-	}
-	return(kret);
+	return(0);
 }
 
+
 /*
  * Implementation of set dirty/clean.
  *
- * In the 'clean' case, not finding a map is OK.
+ * In the 'clean' case, not finding a map is OK, and entries
+ * that end up with nothing dirty are released.
  */
 static kern_return_t
 vfs_drt_do_mark_pages(
@@ -6301,8 +6522,9 @@ vfs_drt_do_mark_pages(
 	int		dirty)
 {
 	struct vfs_drt_clustermap *cmap, **cmapp;
+	struct vfs_drt_entry *ep;
 	kern_return_t	kret;
-	int		i, index, pgoff, pgcount, setcount, ecount;
+	int		i, pgoff, pgcount, setcount;
 
 	cmapp = (struct vfs_drt_clustermap **)private;
 	cmap = *cmapp;
@@ -6324,6 +6546,7 @@ vfs_drt_do_mark_pages(
 			vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 2, 0, 0, 0);
 			return(kret);
 		}
+		cmap = *cmapp;
 	}
 	setcount = 0;
 
@@ -6332,50 +6555,46 @@ vfs_drt_do_mark_pages(
 	 */
 	while (length > 0) {
 		/*
-		 * Get the hashtable index for this offset.
-		 *
-		 * XXX this will add blank entries if we are clearing a range
-		 * that hasn't been dirtied.
-		 */
-		kret = vfs_drt_get_index(cmapp, offset, &index, 0);
-		cmap = *cmapp;	/* may have changed! */
-		/* this may be a partial-success return */
-		if (kret != KERN_SUCCESS) {
-		        if (setcountp != NULL)
-			        *setcountp = setcount;
-			vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 3, (int)length, 0, 0);
-
-			return(kret);
-		}
-
-		/*
-		 * Work out how many pages we're modifying in this
-		 * hashtable entry.
+		 * Work out how many pages we're modifying in this entry.
 		 */
 		pgoff = (offset - DRT_ALIGN_ADDRESS(offset)) / PAGE_SIZE;
 		pgcount = min((length / PAGE_SIZE), (DRT_BITVECTOR_PAGES - pgoff));
 
-		/*
-		 * Iterate over pages, dirty/clearing as we go.
-		 */
-		ecount = DRT_HASH_GET_COUNT(cmap, index);
-		for (i = 0; i < pgcount; i++) {
-			if (dirty) {
-				if (!DRT_HASH_TEST_BIT(cmap, index, pgoff + i)) {
-					DRT_HASH_SET_BIT(cmap, index, pgoff + i);
-					ecount++;
+		if (dirty) {
+			kret = vfs_drt_get_entry(cmap, offset, &ep);
+
+			/* this may be a partial-success return */
+			if (kret != KERN_SUCCESS) {
+			        if (setcountp != NULL)
+				        *setcountp = setcount;
+				vfs_drt_trace(cmap, DRT_DEBUG_MARK | DBG_FUNC_END, 3, (int)length, 0, 0);
+
+				return(kret);
+			}
+			for (i = 0; i < pgcount; i++) {
+				if (!DRT_TEST_BIT(ep, pgoff + i)) {
+					DRT_SET_BIT(ep, pgoff + i);
+					ep->dre_count++;
+					cmap->scm_dirty++;
 					setcount++;
 				}
-			} else {
-				if (DRT_HASH_TEST_BIT(cmap, index, pgoff + i)) {
-					DRT_HASH_CLEAR_BIT(cmap, index, pgoff + i);
-					ecount--;
-					setcount++;
+			}
+		} else {
+			ep = vfs_drt_search_entry(cmap, offset);
+
+			if (ep != NULL && ep->dre_address == DRT_ALIGN_ADDRESS(offset)) {
+				for (i = 0; i < pgcount; i++) {
+					if (DRT_TEST_BIT(ep, pgoff + i)) {
+						DRT_CLEAR_BIT(ep, pgoff + i);
+						ep->dre_count--;
+						cmap->scm_dirty--;
+						setcount++;
+					}
 				}
+				if (ep->dre_count == 0)
+					vfs_drt_free_entry(cmap, ep);
 			}
 		}
-		DRT_HASH_SET_COUNT(cmap, index, ecount);
-
 		offset += pgcount * PAGE_SIZE;
 		length -= pgcount * PAGE_SIZE;
 	}
@@ -6396,9 +6615,6 @@ vfs_drt_do_mark_pages(
  *	Pointer to storage suitable for holding a pointer.  Note that
  *	this must either be NULL or a value set by this function.
  *
- * size
- *	Current file size in bytes.
- *
  * offset
  *	Offset of the first page to be marked as dirty, in bytes.  Must be
  *	page-aligned.
@@ -6414,7 +6630,6 @@ vfs_drt_do_mark_pages(
 static kern_return_t
 vfs_drt_mark_pages(void **cmapp, off_t offset, u_int length, u_int *setcountp)
 {
-	/* XXX size unused, drop from interface */
 	return(vfs_drt_do_mark_pages(cmapp, offset, length, setcountp, 1));
 }
 
@@ -6439,80 +6654,91 @@ vfs_drt_unmark_pages(void **cmapp, off_t offset, u_int length)
  *	Returns the byte offset into the file of the first page in the cluster.
  *
  * lengthp
- *	Returns the length in bytes of the cluster of dirty pages.
+ *	Returns the length in bytes of the cluster.  The cluster starts and
+ *	ends on a dirty page, but may contain short runs of clean pages.
  *
- * Returns success if a cluster was found.  If KERN_FAILURE is returned, there
- * are no dirty pages meeting the minmum size criteria.  Private storage will
- * be released if there are no more dirty pages left in the map
+ * maxlen
+ *	Upper bound on the length of the cluster, in bytes.
  *
+ * Clusters are returned in ascending file order, starting from where the
+ * previous call left off and wrapping back to the start of the file once
+ * the end is reached.  vfs_drt_control(..., 1) restarts from the beginning.
+ *
+ * Returns success if a cluster was found.  If KERN_FAILURE is returned, there
+ * are no dirty pages left in the map and its private storage has been released.
  */
 static kern_return_t
-vfs_drt_get_cluster(void **cmapp, off_t *offsetp, u_int *lengthp)
+vfs_drt_get_cluster(void **cmapp, off_t *offsetp, u_int *lengthp, u_int maxlen)
 {
 	struct vfs_drt_clustermap *cmap;
+	struct vfs_drt_entry *ep, *nep;
 	u_int64_t	offset;
 	u_int		length;
-	u_int32_t	j;
-	int		index, i, fs, ls;
+	u_int		pg, last, maxpages;
+	int		i, fs;
 
 	/* sanity */
 	if ((cmapp == NULL) || (*cmapp == NULL))
 		return(KERN_FAILURE);
 	cmap = *cmapp;
 
-	/* walk the hashtable */
-	for (offset = 0, j = 0; j < cmap->scm_modulus; offset += (DRT_BITVECTOR_PAGES * PAGE_SIZE), j++) {
-	        index = DRT_HASH(cmap, offset);
+	if (!vfs_drt_next_dirty(cmap, cmap->scm_lastclean, &ep, &fs) &&
+	    !vfs_drt_next_dirty(cmap, 0, &ep, &fs)) {
+		/*
+		 * We didn't find anything... map is empty
+		 * emit stats into trace buffer and
+		 * then free it
+		 */
+		vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
+			      cmap->scm_entries,
+			      cmap->scm_dirty,
+			      (int)cmap->scm_lastclean,
+			      cmap->scm_maxentries);
+	
+		vfs_drt_free_map(cmap);
+		*cmapp = NULL;
 
-	        if (DRT_HASH_VACANT(cmap, index) || (DRT_HASH_GET_COUNT(cmap, index) == 0))
-			continue;
+		return(KERN_FAILURE);
+	}
+	offset = ep->dre_address + (PAGE_SIZE * fs);
 
-		/* scan the bitfield for a string of bits */
-		fs = -1;
+	if ((maxpages = maxlen / PAGE_SIZE) == 0)
+	        maxpages = 1;
 
-		for (i = 0; i < DRT_BITVECTOR_PAGES; i++) {
-		        if (DRT_HASH_TEST_BIT(cmap, index, i)) {
-			        fs = i;
-				break;
-			}
-		}
-		if (fs == -1) {
-		        /*  didn't find any bits set */
-		        panic("vfs_drt: entry summary count > 0 but no bits set in map");
-		}
-		for (ls = 0; i < DRT_BITVECTOR_PAGES; i++, ls++) {
-			if (!DRT_HASH_TEST_BIT(cmap, index, i))
-			        break;
+	/*
+	 * grow the cluster through this entry and on into the ones that
+	 * immediately follow it in the file... stop at a clean gap longer
+	 * than DRT_MERGE_GAP, at a hole between entries, or at maxpages;
+	 * 'last' tracks the end of the last dirty page taken so the
+	 * cluster never ends on a clean one
+	 */
+	for (pg = 0, last = 0, i = fs; ; i = 0) {
+		for ( ; i < DRT_BITVECTOR_PAGES; i++, pg++) {
+			if (pg >= maxpages)
+				goto found;
+			if (DRT_TEST_BIT(ep, i))
+				last = pg + 1;
+			else if (pg - last >= DRT_MERGE_GAP)
+				goto found;
 		}
-		
-		/* compute offset and length, mark pages clean */
-		offset = DRT_HASH_GET_ADDRESS(cmap, index) + (PAGE_SIZE * fs);
-		length = ls * PAGE_SIZE;
-		vfs_drt_do_mark_pages(cmapp, offset, length, NULL, 0);
-		cmap->scm_lastclean = index;
+		nep = RB_NEXT(vfs_drt_tree, &cmap->scm_tree, ep);
 
-		/* return successful */
-		*offsetp = (off_t)offset;
-		*lengthp = length;
-
-		vfs_drt_trace(cmap, DRT_DEBUG_RETCLUSTER, (int)offset, (int)length, 0, 0);
-		return(KERN_SUCCESS);
+		if (nep == NULL || nep->dre_address != ep->dre_address + DRT_ENTRY_SIZE)
+			break;
+		ep = nep;
 	}
-	/*
-	 * We didn't find anything... hashtable is empty
-	 * emit stats into trace buffer and
-	 * then free it
-	 */
-	vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
-		      cmap->scm_modulus,
-		      cmap->scm_buckets,
-		      cmap->scm_lastclean,
-		      cmap->scm_iskips);
-	
-	vfs_drt_free_map(cmap);
-	*cmapp = NULL;
+found:
+	/* compute length, mark pages clean */
+	length = last * PAGE_SIZE;
+	vfs_drt_do_mark_pages(cmapp, offset, length, NULL, 0);
+	cmap->scm_lastclean = offset + length;
+
+	/* return successful */
+	*offsetp = (off_t)offset;
+	*lengthp = length;
 
-	return(KERN_FAILURE);
+	vfs_drt_trace(cmap, DRT_DEBUG_RETCLUSTER, (int)offset, (int)length, 0, 0);
+	return(KERN_SUCCESS);
 }
 
 
@@ -6530,10 +6756,10 @@ vfs_drt_control(void **cmapp, int op_type)
 	case 0:
 		/* emit stats into trace buffer */
 		vfs_drt_trace(cmap, DRT_DEBUG_SCMDATA,
-			      cmap->scm_modulus,
-			      cmap->scm_buckets,
-			      cmap->scm_lastclean,
-			      cmap->scm_iskips);
+			      cmap->scm_entries,
+			      cmap->scm_dirty,
+			      (int)cmap->scm_lastclean,
+			      cmap->scm_maxentries);
 
 		vfs_drt_free_map(cmap);
 		*cmapp = NULL;
@@ -6569,25 +6795,27 @@ vfs_drt_trace(__unused struct vfs_drt_clustermap *cmap, __unused int code,
 
 #if 0
 /*
- * Perform basic sanity check on the hash entry summary count
- * vs. the actual bits set in the entry.
+ * Perform basic sanity check on the entry summary counts
+ * vs. the actual bits set in the entries.
  */
 static void
 vfs_drt_sanity(struct vfs_drt_clustermap *cmap)
 {
-        int index, i;
+	struct vfs_drt_entry *ep;
+	u_int32_t total = 0;
+	int i;
 	int bits_on;
 	
-	for (index = 0; index < cmap->scm_modulus; index++) {
-	        if (DRT_HASH_VACANT(cmap, index))
-		        continue;
-
+	RB_FOREACH(ep, vfs_drt_tree, &cmap->scm_tree) {
 		for (bits_on = 0, i = 0; i < DRT_BITVECTOR_PAGES; i++) {
-			if (DRT_HASH_TEST_BIT(cmap, index, i))
+			if (DRT_TEST_BIT(ep, i))
 			        bits_on++;
 		}
-		if (bits_on != DRT_HASH_GET_COUNT(cmap, index))
-		        panic("bits_on = %d,  index = %d\n", bits_on, index);
+		if (bits_on == 0 || bits_on != (int)ep->dre_count)
+		        panic("bits_on = %d,  address = 0x%llx\n", bits_on, ep->dre_address);
+		total += bits_on;
 	}		
+	if (total != cmap->scm_dirty)
+	        panic("total = %d, scm_dirty = %d\n", total, cmap->scm_dirty);
 }
 #endif
@@ -58,6 +58,9 @@
 #include <sys/kdebug.h>
 #include <miscfs/specfs/specdev.h>
 #include <libkern/OSAtomic.h>	/* OSAddAtomic */
+#include <mach/mach_time.h>
+#include <kern/clock.h>
+#include <sys/tree.h>
 
 kern_return_t	thread_terminate(thread_t);
 
@@ -138,6 +141,28 @@ enum {
 unsigned int jnl_trim_flush_limit = JOURNAL_FLUSH_TRIM_EXTENTS;
 SYSCTL_UINT (_kern, OID_AUTO, jnl_trim_flush, CTLFLAG_RW, &jnl_trim_flush_limit, 0, "number of trimmed extents to cause a journal flush");
 
+//
+// While a previous transaction is still being written to the journal,
+// the current transaction is allowed to keep growing up to this many
+// tbuffers instead of stalling the journal lock behind the flush.
+//
+unsigned int jnl_commit_max_blhdrs = 6;
+SYSCTL_UINT(_vfs_generic_jnl, OID_AUTO, commit_max_blhdrs, CTLFLAG_RW|CTLFLAG_LOCKED, &jnl_commit_max_blhdrs, 0, "tbuffers a transaction may accumulate while a commit is in flight");
+
+static struct jnl_commit_stats jnl_commit_stats;
+SYSCTL_STRUCT(_vfs_generic_jnl, OID_AUTO, commit_stats, CTLFLAG_RD|CTLFLAG_LOCKED, &jnl_commit_stats, jnl_commit_stats, "Journal group commit statistics");
+
+//
+// Once the coalesced set of blocks to replay has been built, it is
+// written back to the file system by up to this many threads, each
+// taking a contiguous run of the (sorted) blocks.
+//
+#define JNL_REPLAY_MAX_THREADS		16
+#define JNL_REPLAY_MIN_PER_THREAD	64
+
+unsigned int jnl_replay_threads = 4;
+SYSCTL_UINT(_vfs_generic_jnl, OID_AUTO, replay_threads, CTLFLAG_RW|CTLFLAG_LOCKED, &jnl_replay_threads, 0, "threads used to write back coalesced blocks during journal replay");
+
 /* XXX next prototype should be from libsa/stdlib.h> but conflicts libkern */
 __private_extern__ void qsort(
 	void * array,
@@ -168,6 +193,8 @@ static __inline__ void  lock_oldstart(journal *jnl);
 static __inline__ void  unlock_oldstart(journal *jnl);
 static __inline__ void  lock_flush(journal *jnl);
 static __inline__ void  unlock_flush(journal *jnl);
+static void commit_done(journal *jnl, uint64_t commit_gen, uint64_t commit_start, uint32_t commit_batch);
+static int  wait_for_commit(journal *jnl, uint64_t commit_gen);
 
 
 //
@@ -175,6 +202,7 @@ static __inline__ void  unlock_flush(journal *jnl);
 //
 
 typedef struct bucket {
+	RB_ENTRY(bucket) link;     // replay tree linkage, sorted by block_num
 	off_t     block_num;
 	uint32_t  jnl_offset;
 	uint32_t  block_size;
@@ -183,11 +211,72 @@ typedef struct bucket {
 
 #define STARTING_BUCKETS 256
 
-static int add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int grow_table(struct bucket **buf_ptr, int num_buckets, int new_size);
-static int lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full);
-static int do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
-static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting);
+typedef struct bucket_chunk {
+	struct bucket_chunk *next;
+	struct bucket        buckets[STARTING_BUCKETS];
+} bucket_chunk;
+
+RB_HEAD(bucket_tree, bucket);
+
+//
+// the extents waiting to be replayed.  they never overlap each other
+// so block_num alone orders them.
+//
+typedef struct replay_map {
+	struct bucket_tree  tree;
+	int                 num_full;    // number of buckets in the tree
+	bucket             *free_list;
+	bucket_chunk       *chunks;
+} replay_map;
+
+static int
+bucket_cmp(bucket *a, bucket *b)
+{
+	if (a->block_num < b->block_num)
+		return -1;
+	if (a->block_num > b->block_num)
+		return 1;
+	return 0;
+}
+
+RB_PROTOTYPE_SC(static, bucket_tree, bucket, link, bucket_cmp);
+RB_GENERATE(bucket_tree, bucket, link, bucket_cmp);
+
+//
+// Per-transaction index of the buf_t's in a transaction, keyed by the
+// buf_t pointer, so that journal_modify_block_end(), _abort() and
+// journal_kill_block() don't have to walk every block_list_header to
+// find out whether a block is already part of the transaction.  only
+// the thread that owns the transaction touches it so it needs no lock.
+//
+struct tr_blkent {
+	struct tr_blkent   *next;
+	struct buf         *bp;
+	block_list_header  *blhdr;
+	int                 index;
+};
+
+#define TR_BLKCHUNK_ENTRIES	((PAGE_SIZE - sizeof(void *)) / sizeof(struct tr_blkent))
+
+struct tr_blkchunk {
+	struct tr_blkchunk *next;
+	struct tr_blkent    ent[TR_BLKCHUNK_ENTRIES];
+};
+
+#define TR_BLKHASH_MIN		256
+#define TR_BLKHASH(tr, bp)	((((uintptr_t)(bp) >> 4) ^ ((uintptr_t)(bp) >> 12)) & (tr)->blk_hashmask)
+
+static int add_block(journal *jnl, replay_map *map, off_t block_num, size_t size, size_t offset, int32_t cksum);
+static bucket *alloc_bucket(replay_map *map);
+static void free_bucket(replay_map *map, bucket *bkt);
+static void reset_replay_map(replay_map *map);
+static void destroy_replay_map(replay_map *map);
+static int replay_buckets(journal *jnl, bucket **buckets, int count, size_t max_bsize);
+
+static block_list_header *tr_blk_lookup(transaction *tr, struct buf *bp, int *index);
+static void tr_blk_insert(transaction *tr, struct buf *bp, block_list_header *blhdr, int index);
+static void tr_blk_remove(transaction *tr, struct buf *bp);
+static void tr_blk_free(transaction *tr);
 
 #define CHECK_JOURNAL(jnl) \
 	do {		   \
@@ -502,6 +591,131 @@ write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num)
 
 
 
+static block_list_header *
+tr_blk_lookup(transaction *tr, struct buf *bp, int *index)
+{
+	struct tr_blkent *ent;
+
+	if (tr->blk_hash == NULL)
+		return NULL;
+
+	for (ent = tr->blk_hash[TR_BLKHASH(tr, bp)]; ent; ent = ent->next) {
+		if (ent->bp == bp) {
+			*index = ent->index;
+			return ent->blhdr;
+		}
+	}
+	return NULL;
+}
+
+static void
+tr_blk_grow(transaction *tr)
+{
+	struct tr_blkent **nhash, **ohash, *ent, *next;
+	uint32_t	osize, nsize, i;
+
+	ohash = tr->blk_hash;
+	osize = ohash ? tr->blk_hashmask + 1 : 0;
+	nsize = osize ? osize * 2 : TR_BLKHASH_MIN;
+
+	if ((nhash = (struct tr_blkent **)kalloc(nsize * sizeof(struct tr_blkent *))) == NULL) {
+		if (ohash)
+			return;		// just live with longer chains
+		panic("jnl: tr_blk_grow: no space for block index tr %p\n", tr);
+	}
+	bzero(nhash, nsize * sizeof(struct tr_blkent *));
+
+	tr->blk_hash = nhash;
+	tr->blk_hashmask = nsize - 1;
+
+	for (i = 0; i < osize; i++) {
+		for (ent = ohash[i]; ent; ent = next) {
+			next = ent->next;
+
+			ent->next = nhash[TR_BLKHASH(tr, ent->bp)];
+			nhash[TR_BLKHASH(tr, ent->bp)] = ent;
+		}
+	}
+	if (ohash)
+		kfree(ohash, osize * sizeof(struct tr_blkent *));
+}
+
+static void
+tr_blk_insert(transaction *tr, struct buf *bp, block_list_header *blhdr, int index)
+{
+	struct tr_blkchunk *chunk;
+	struct tr_blkent   *ent;
+	uint32_t	i;
+
+	if (tr->blk_hash == NULL || tr->blk_count >= (tr->blk_hashmask + 1) * 2)
+		tr_blk_grow(tr);
+
+	if (tr->blk_free == NULL) {
+		if ((chunk = (struct tr_blkchunk *)kalloc(sizeof(struct tr_blkchunk))) == NULL) {
+			panic("jnl: tr_blk_insert: no space for block index tr %p (total bytes: %d)\n", tr, tr->total_bytes);
+		}
+		chunk->next = tr->blk_chunks;
+		tr->blk_chunks = chunk;
+
+		for (i = 0; i < TR_BLKCHUNK_ENTRIES; i++) {
+			chunk->ent[i].next = tr->blk_free;
+			tr->blk_free = &chunk->ent[i];
+		}
+	}
+	ent = tr->blk_free;
+	tr->blk_free = ent->next;
+
+	ent->bp = bp;
+	ent->blhdr = blhdr;
+	ent->index = index;
+	ent->next = tr->blk_hash[TR_BLKHASH(tr, bp)];
+	tr->blk_hash[TR_BLKHASH(tr, bp)] = ent;
+	tr->blk_count++;
+}
+
+static void
+tr_blk_remove(transaction *tr, struct buf *bp)
+{
+	struct tr_blkent **entp, *ent;
+
+	if (tr->blk_hash == NULL)
+		return;
+
+	for (entp = &tr->blk_hash[TR_BLKHASH(tr, bp)]; (ent = *entp); entp = &ent->next) {
+		if (ent->bp == bp) {
+			*entp = ent->next;
+			ent->next = tr->blk_free;
+			tr->blk_free = ent;
+			tr->blk_count--;
+			return;
+		}
+	}
+}
+
+//
+// the index is only needed while blocks are being added to the
+// transaction... once it's handed off to be written to the journal
+// the binfo[] entries get swapped for shadow bufs anyway.
+//
+static void
+tr_blk_free(transaction *tr)
+{
+	struct tr_blkchunk *chunk, *next;
+
+	if (tr->blk_hash) {
+		kfree(tr->blk_hash, (tr->blk_hashmask + 1) * sizeof(struct tr_blkent *));
+		tr->blk_hash = NULL;
+	}
+	for (chunk = tr->blk_chunks; chunk; chunk = next) {
+		next = chunk->next;
+		kfree(chunk, sizeof(struct tr_blkchunk));
+	}
+	tr->blk_chunks = NULL;
+	tr->blk_free = NULL;
+	tr->blk_hashmask = 0;
+	tr->blk_count = 0;
+}
+
 //
 // this is a work function used to free up transactions that
 // completed. they can't be free'd from buffer_flushed_callback
@@ -534,6 +748,7 @@ free_old_stuff(journal *jnl)
 			KERNEL_DEBUG(0xbbbbc01c, jnl, tr, tr->tbuffer_size, 0, 0);
 		}
 		next = tr->next;
+		tr_blk_free(tr);
 		FREE_ZONE(tr, sizeof(transaction), M_JNL_TR);
 	}
 }
@@ -809,283 +1024,319 @@ update_fs_block(journal *jnl, void *block_ptr, off_t fs_block, size_t bsize)
 	return 0;
 }
 
-static int
-grow_table(struct bucket **buf_ptr, int num_buckets, int new_size)
+//
+// buckets are carved out of chunks and recycled through a free list
+// (linked through the left tree pointer); the chunks themselves are
+// only released once replay is done.
+//
+static bucket *
+alloc_bucket(replay_map *map)
 {
-	struct bucket *newBuf;
-	int current_size = num_buckets, i;
-    
-	// return if newsize is less than the current size
-	if (new_size < num_buckets) {
-		return current_size;
-	}
-    
-	if ((MALLOC(newBuf, struct bucket *, new_size*sizeof(struct bucket), M_TEMP, M_WAITOK)) == NULL) {
-		printf("jnl: grow_table: no memory to expand coalesce buffer!\n");
-		return -1;
-	}
-    
-	//  printf("jnl: lookup_bucket: expanded co_buf to %d elems\n", new_size);
-    
-	// copy existing elements 
-	bcopy(*buf_ptr, newBuf, num_buckets*sizeof(struct bucket));
-    
-	// initialize the new ones
-	for(i = num_buckets; i < new_size; i++) {
-		newBuf[i].block_num = (off_t)-1;
+	bucket_chunk *chunk;
+	bucket       *bkt;
+	int           i;
+
+	if (map->free_list == NULL) {
+		if ((MALLOC(chunk, bucket_chunk *, sizeof(bucket_chunk), M_TEMP, M_WAITOK)) == NULL) {
+			printf("jnl: alloc_bucket: no memory to expand coalesce buffer!\n");
+			return NULL;
+		}
+		chunk->next = map->chunks;
+		map->chunks = chunk;
+
+		for (i = 0; i < STARTING_BUCKETS; i++) {
+			free_bucket(map, &chunk->buckets[i]);
+		}
 	}
-    
-	// free the old container
-	FREE(*buf_ptr, M_TEMP);
-    
-	// reset the buf_ptr
-	*buf_ptr = newBuf;
-    
-	return new_size;
+	bkt = map->free_list;
+	map->free_list = RB_LEFT(bkt, link);
+
+	return bkt;
 }
 
-static int
-lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full)
+static void
+free_bucket(replay_map *map, bucket *bkt)
 {
-	int lo, hi, index, matches, i;
-    
-	if (num_full == 0) {
-		return 0; // table is empty, so insert at index=0
-	}
-    
-	lo = 0;
-	hi = num_full - 1;
-	index = -1;
-    
-	// perform binary search for block_num
-	do {
-		int mid = (hi - lo)/2 + lo;
-		off_t this_num = (*buf_ptr)[mid].block_num;
-	
-		if (block_num == this_num) {
-			index = mid;
-			break;
-		}
-	
-		if (block_num < this_num) {
-			hi = mid;
-			continue;
-		}
-	
-		if (block_num > this_num) {
-			lo = mid + 1;
-			continue;
-		}
-	} while (lo < hi);
-    
-	// check if lo and hi converged on the match
-	if (block_num == (*buf_ptr)[hi].block_num) {
-		index = hi;
-	}
-    
-	// if no existing entry found, find index for new one
-	if (index == -1) {
-		index = (block_num < (*buf_ptr)[hi].block_num) ? hi : hi + 1;
-	} else {
-		// make sure that we return the right-most index in the case of multiple matches
-		matches = 0;
-		i = index + 1;
-		while (i < num_full && block_num == (*buf_ptr)[i].block_num) {
-			matches++;
-			i++;
-		}
+	RB_LEFT(bkt, link) = map->free_list;
+	map->free_list = bkt;
+}
 
-		index += matches;
+static void
+reset_replay_map(replay_map *map)
+{
+	bucket_chunk *chunk;
+	int           i;
+
+	RB_INIT(&map->tree);
+	map->num_full = 0;
+	map->free_list = NULL;
+
+	for (chunk = map->chunks; chunk; chunk = chunk->next) {
+		for (i = 0; i < STARTING_BUCKETS; i++) {
+			free_bucket(map, &chunk->buckets[i]);
+		}
 	}
-    
-	return index;
 }
 
-static int
-insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting)
+static void
+destroy_replay_map(replay_map *map)
 {
-	if (!overwriting) {
-		// grow the table if we're out of space
-		if (*num_full_ptr >= *num_buckets_ptr) {
-			int new_size = *num_buckets_ptr * 2;
-			int grow_size = grow_table(buf_ptr, *num_buckets_ptr, new_size);
-	    
-			if (grow_size < new_size) {
-				printf("jnl: %s: add_block: grow_table returned an error!\n", jnl->jdev_name);
-				return -1;
-			}
-	    
-			*num_buckets_ptr = grow_size; //update num_buckets to reflect the new size
-		}
-	
-		// if we're not inserting at the end, we need to bcopy
-		if (blk_index != *num_full_ptr) {
-			bcopy( (*buf_ptr)+(blk_index), (*buf_ptr)+(blk_index+1), (*num_full_ptr-blk_index)*sizeof(struct bucket) );
-		}
-	
-		(*num_full_ptr)++; // increment only if we're not overwriting
+	bucket_chunk *chunk, *next;
+
+	for (chunk = map->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		FREE(chunk, M_TEMP);
 	}
+	map->chunks = NULL;
+	map->free_list = NULL;
+	map->num_full = 0;
+	RB_INIT(&map->tree);
+}
 
-	// sanity check the values we're about to add
-	if ((off_t)offset >= jnl->jhdr->size) {
+static __inline__ uint32_t
+wrap_jnl_offset(journal *jnl, off_t offset)
+{
+	if (offset >= jnl->jhdr->size) {
 		offset = jnl->jhdr->jhdr_size + (offset - jnl->jhdr->size);
 	}
-	if (size <= 0) {
-		panic("jnl: insert_block: bad size in insert_block (%zd)\n", size);
-	}	 
-
-	(*buf_ptr)[blk_index].block_num = num;
-	(*buf_ptr)[blk_index].block_size = size;
-	(*buf_ptr)[blk_index].jnl_offset = offset;
-	(*buf_ptr)[blk_index].cksum = cksum;
-    
-	return blk_index;
+	return (uint32_t)offset;
 }
 
+// PR-3105942: Coalesce writes to the same block in journal replay
+// We coalesce writes by keeping a red-black tree of the physical disk
+// extents to be replayed, keyed by block number, along with the location
+// in the journal which contains the most recent data for each of them.
+// The tree is "played" once all the blocks in the journal have been
+// coalesced.  A block added later always wins: whatever part of an older
+// extent it overlaps is trimmed away (splitting the older extent in two
+// if need be) so that the extents in the tree never overlap each other.
 static int
-do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+add_block(journal *jnl, replay_map *map, off_t block_num, size_t size, size_t offset, int32_t cksum)
 {
-	int	num_to_remove, index, i, overwrite, err;
-	size_t	jhdr_size = jnl->jhdr->jhdr_size, new_offset;
-	off_t	overlap, block_start, block_end;
+	bucket	*bkt, *prev, *next, *split;
+	size_t	jhdr_size = jnl->jhdr->jhdr_size;
+	off_t	overlap, block_start, block_end, bkt_start, bkt_end;
+
+	if (size == 0) {
+		panic("jnl: add_block: bad size (%zd)\n", size);
+	}
 
 	block_start = block_num*jhdr_size;
 	block_end = block_start + size;
-	overwrite = (block_num == (*buf_ptr)[blk_index].block_num && size >= (*buf_ptr)[blk_index].block_size);
+
+	// find the last extent starting before this one and the first
+	// one starting at or after it
+	prev = next = NULL;
+	for (bkt = RB_ROOT(&map->tree); bkt != NULL; ) {
+		if (bkt->block_num < block_num) {
+			prev = bkt;
+			bkt = RB_RIGHT(bkt, link);
+		} else {
+			next = bkt;
+			bkt = RB_LEFT(bkt, link);
+		}
+	}
 
 	// first, eliminate any overlap with the previous entry
-	if (blk_index != 0 && !overwrite) {
-		off_t prev_block_start = (*buf_ptr)[blk_index-1].block_num*jhdr_size;
-		off_t prev_block_end = prev_block_start + (*buf_ptr)[blk_index-1].block_size;
-		overlap = prev_block_end - block_start;
+	if (prev) {
+		bkt_start = prev->block_num*jhdr_size;
+		bkt_end = bkt_start + prev->block_size;
+		overlap = bkt_end - block_start;
+
 		if (overlap > 0) {
 			if (overlap % jhdr_size != 0) {
-				panic("jnl: do_overlap: overlap with previous entry not a multiple of %zd\n", jhdr_size);
+				panic("jnl: add_block: overlap with previous entry not a multiple of %zd\n", jhdr_size);
 			}
 
 			// if the previous entry completely overlaps this one, we need to break it into two pieces.
-			if (prev_block_end > block_end) {
-				off_t new_num = block_end / jhdr_size;
-				size_t new_size = prev_block_end - block_end;
-
-				new_offset = (*buf_ptr)[blk_index-1].jnl_offset + (block_end - prev_block_start);
-		
-				err = insert_block(jnl, buf_ptr, blk_index, new_num, new_size, new_offset, cksum, num_buckets_ptr, num_full_ptr, 0);
-				if (err < 0) {
-					panic("jnl: do_overlap: error inserting during pre-overlap\n");
+			if (bkt_end > block_end) {
+				if ((split = alloc_bucket(map)) == NULL) {
+					return -1;
 				}
+				split->block_num = block_end / jhdr_size;
+				split->block_size = bkt_end - block_end;
+				split->jnl_offset = wrap_jnl_offset(jnl, (off_t)prev->jnl_offset + (block_end - bkt_start));
+				split->cksum = 0;
+
+				RB_INSERT(bucket_tree, &map->tree, split);
+				map->num_full++;
 			}
-	    
+
 			// Regardless, we need to truncate the previous entry to the beginning of the overlap
-			(*buf_ptr)[blk_index-1].block_size = block_start - prev_block_start;
-			(*buf_ptr)[blk_index-1].cksum = 0;   // have to blow it away because there's no way to check it
+			prev->block_size = block_start - bkt_start;
+			prev->cksum = 0;   // have to blow it away because there's no way to check it
 		}
 	}
 
-	// then, bail out fast if there's no overlap with the entries that follow
-	if (!overwrite && block_end <= (off_t)((*buf_ptr)[blk_index].block_num*jhdr_size)) {
-		return 0; // no overlap, no overwrite
-	} else if (overwrite && (blk_index + 1 >= *num_full_ptr || block_end <= (off_t)((*buf_ptr)[blk_index+1].block_num*jhdr_size))) {
+	// then drop the entries that follow which this one covers completely
+	// and trim the front off one it covers partially.  nothing else can
+	// start inside the new extent, so a trimmed entry keeps its place in
+	// the tree.
+	while (next != NULL) {
+		bkt = next;
+		bkt_start = bkt->block_num*jhdr_size;
+		bkt_end = bkt_start + bkt->block_size;
 
-		(*buf_ptr)[blk_index].cksum = cksum;   // update this
-		return 1; // simple overwrite
-	}
-    
-	// Otherwise, find all cases of total and partial overlap. We use the special
-	// block_num of -2 to designate entries that are completely overlapped and must
-	// be eliminated. The block_num, size, and jnl_offset of partially overlapped
-	// entries must be adjusted to keep the array consistent.
-	index = blk_index;
-	num_to_remove = 0;
-	while (index < *num_full_ptr && block_end > (off_t)((*buf_ptr)[index].block_num*jhdr_size)) {
-		if (block_end >= (off_t)(((*buf_ptr)[index].block_num*jhdr_size + (*buf_ptr)[index].block_size))) {
-			(*buf_ptr)[index].block_num = -2; // mark this for deletion
-			num_to_remove++;
-		} else {
-			overlap = block_end - (*buf_ptr)[index].block_num*jhdr_size;
-			if (overlap > 0) {
-				if (overlap % jhdr_size != 0) {
-					panic("jnl: do_overlap: overlap of %lld is not multiple of %zd\n", overlap, jhdr_size);
-				}
-				
-				// if we partially overlap this entry, adjust its block number, jnl offset, and size
-				(*buf_ptr)[index].block_num += (overlap / jhdr_size); // make sure overlap is multiple of jhdr_size, or round up
-				(*buf_ptr)[index].cksum = 0;
-		
-				new_offset = (*buf_ptr)[index].jnl_offset + overlap; // check for wrap-around
-				if ((off_t)new_offset >= jnl->jhdr->size) {
-					new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
-				}
-				(*buf_ptr)[index].jnl_offset = new_offset;
-		
-				(*buf_ptr)[index].block_size -= overlap; // sanity check for negative value
-				if ((*buf_ptr)[index].block_size <= 0) {
-					panic("jnl: do_overlap: after overlap, new block size is invalid (%u)\n", (*buf_ptr)[index].block_size);
-					// return -1; // if above panic is removed, return -1 for error
-				}
-			}
-			
+		if (block_end <= bkt_start) {
+			break;
 		}
+		next = RB_NEXT(bucket_tree, &map->tree, bkt);
 
-		index++;
-	}
+		if (block_end >= bkt_end) {
+			RB_REMOVE(bucket_tree, &map->tree, bkt);
+			map->num_full--;
+			free_bucket(map, bkt);
+			continue;
+		}
+		overlap = block_end - bkt_start;
 
-	// bcopy over any completely overlapped entries, starting at the right (where the above loop broke out)
-	index--; // start with the last index used within the above loop
-	while (index >= blk_index) {
-		if ((*buf_ptr)[index].block_num == -2) {
-			if (index == *num_full_ptr-1) {
-				(*buf_ptr)[index].block_num = -1; // it's the last item in the table... just mark as free
-			} else {
-				bcopy( (*buf_ptr)+(index+1), (*buf_ptr)+(index), (*num_full_ptr - (index + 1)) * sizeof(struct bucket) );
-			}
-			(*num_full_ptr)--;
+		if (overlap % jhdr_size != 0) {
+			panic("jnl: add_block: overlap of %lld is not multiple of %zd\n", overlap, jhdr_size);
 		}
-		index--;
+		bkt->block_num += (overlap / jhdr_size);
+		bkt->jnl_offset = wrap_jnl_offset(jnl, (off_t)bkt->jnl_offset + overlap);
+		bkt->block_size -= overlap;
+		bkt->cksum = 0;
+		break;
 	}
 
-	// eliminate any stale entries at the end of the table
-	for(i = *num_full_ptr; i < (*num_full_ptr + num_to_remove); i++) {
-		(*buf_ptr)[i].block_num = -1;
+	if ((bkt = alloc_bucket(map)) == NULL) {
+		return -1;
 	}
-    
-	return 0; // if we got this far, we need to insert the entry into the table (rather than overwrite) 
+	bkt->block_num = block_num;
+	bkt->block_size = size;
+	bkt->jnl_offset = wrap_jnl_offset(jnl, (off_t)offset);
+	bkt->cksum = cksum;
+
+	RB_INSERT(bucket_tree, &map->tree, bkt);
+	map->num_full++;
+
+	return 0;
 }
 
-// PR-3105942: Coalesce writes to the same block in journal replay
-// We coalesce writes by maintaining a dynamic sorted array of physical disk blocks
-// to be replayed and the corresponding location in the journal which contains
-// the most recent data for those blocks. The array is "played" once the all the
-// blocks in the journal have been coalesced. The code for the case of conflicting/
-// overlapping writes to a single block is the most dense. Because coalescing can
-// disrupt the existing time-ordering of blocks in the journal playback, care
-// is taken to catch any overlaps and keep the array consistent. 
+struct replay_worker {
+	journal	 *jnl;
+	bucket	**buckets;
+	int	  count;
+	size_t	  max_bsize;
+	int	  error;
+	int	 *pending;	// NULL if the run was not handed to a thread
+};
+
+//
+// write a run of coalesced extents back to their home location
+//
 static int
-add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr)
+replay_bucket_run(journal *jnl, bucket **buckets, int count, size_t max_bsize)
 {
-	int	blk_index, overwriting;
-    
-	// on return from lookup_bucket(), blk_index is the index into the table where block_num should be
-	// inserted (or the index of the elem to overwrite). 
-	blk_index = lookup_bucket( buf_ptr, block_num, *num_full_ptr);
-    
-	// check if the index is within bounds (if we're adding this block to the end of
-	// the table, blk_index will be equal to num_full)
-	if (blk_index < 0 || blk_index > *num_full_ptr) {
-		//printf("jnl: add_block: trouble adding block to co_buf\n");
+	char	*block_ptr;
+	int	i, error = 0;
+
+	if (kmem_alloc(kernel_map, (vm_offset_t *)&block_ptr, max_bsize)) {
 		return -1;
-	} // else printf("jnl: add_block: adding block 0x%llx at i=%d\n", block_num, blk_index);
-    
-	// Determine whether we're overwriting an existing entry by checking for overlap
-	overwriting = do_overlap(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr);
-	if (overwriting < 0) {
-		return -1; // if we got an error, pass it along
-	}
-        
-	// returns the index, or -1 on error
-	blk_index = insert_block(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr, overwriting);
-    
-	return blk_index;
+	}
+	for (i = 0; i < count; i++) {
+		size_t size = buckets[i]->block_size;
+		off_t jnl_offset = (off_t) buckets[i]->jnl_offset;
+		off_t number = buckets[i]->block_num;
+
+		// do journal read, and set the phys. block
+		if (read_journal_data(jnl, &jnl_offset, block_ptr, size) != size) {
+			printf("jnl: %s: replay_journal: Could not read journal entry data @ offset 0x%llx!\n",
+			       jnl->jdev_name, (off_t)buckets[i]->jnl_offset);
+			error = -1;
+			break;
+		}
+		if (update_fs_block(jnl, block_ptr, number, size) != 0) {
+			error = -1;
+			break;
+		}
+	}
+	kmem_free(kernel_map, (vm_offset_t)block_ptr, max_bsize);
+
+	return error;
+}
+
+static void
+replay_worker_thread(struct replay_worker *rw)
+{
+	journal *jnl = rw->jnl;
+
+	rw->error = replay_bucket_run(jnl, rw->buckets, rw->count, rw->max_bsize);
+
+	lock_oldstart(jnl);
+	if (--(*rw->pending) == 0)
+		wakeup((caddr_t)rw->pending);
+	unlock_oldstart(jnl);
+
+	thread_deallocate(current_thread());
+	thread_terminate(current_thread());
+}
+
+//
+// the coalesced extents never overlap, so they can be written back in
+// any order... split the sorted list into contiguous runs (so each
+// thread still walks the disk in ascending order), hand all but the
+// first to helper threads and do the first one ourselves.
+//
+static int
+replay_buckets(journal *jnl, bucket **buckets, int count, size_t max_bsize)
+{
+	struct replay_worker workers[JNL_REPLAY_MAX_THREADS];
+	thread_t	thread;
+	int		nthreads, per_thread, pending = 0, error, i;
+
+	nthreads = jnl_replay_threads;
+	if (nthreads > JNL_REPLAY_MAX_THREADS)
+		nthreads = JNL_REPLAY_MAX_THREADS;
+	if (nthreads > count / JNL_REPLAY_MIN_PER_THREAD)
+		nthreads = count / JNL_REPLAY_MIN_PER_THREAD;
+	if (nthreads < 1)
+		nthreads = 1;
+	per_thread = (count + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].jnl = jnl;
+		workers[i].buckets = &buckets[i * per_thread];
+		workers[i].count = count - (i * per_thread);
+		if (workers[i].count > per_thread)
+			workers[i].count = per_thread;
+		workers[i].max_bsize = max_bsize;
+		workers[i].error = 0;
+		workers[i].pending = NULL;
+	}
+
+	lock_oldstart(jnl);
+	for (i = 1; i < nthreads; i++) {
+		if (workers[i].count <= 0)
+			continue;
+		workers[i].pending = &pending;
+
+		if (kernel_thread_start((thread_continue_t)replay_worker_thread, &workers[i], &thread) != KERN_SUCCESS) {
+			workers[i].pending = NULL;
+			continue;
+		}
+		pending++;
+	}
+	unlock_oldstart(jnl);
+
+	error = replay_bucket_run(jnl, workers[0].buckets, workers[0].count, max_bsize);
+
+	for (i = 1; i < nthreads; i++) {
+		if (workers[i].pending == NULL && workers[i].count > 0)
+			workers[i].error = replay_bucket_run(jnl, workers[i].buckets, workers[i].count, max_bsize);
+	}
+
+	lock_oldstart(jnl);
+	while (pending)
+		msleep((caddr_t)&pending, &jnl->old_start_lock, PRIBIO, "jnl_replay", NULL);
+	unlock_oldstart(jnl);
+
+	for (i = 1; i < nthreads; i++) {
+		if (workers[i].error)
+			error = workers[i].error;
+	}
+	return error;
 }
 
 static int
@@ -1097,8 +1348,9 @@ replay_journal(journal *jnl)
 	block_list_header *blhdr;
 	off_t		offset, txn_start_offset=0, blhdr_offset, orig_jnl_start;
 	char		*buff, *block_ptr=NULL;
-	struct bucket	*co_buf;
-	int		num_buckets = STARTING_BUCKETS, num_full, check_past_jnl_end = 1, in_uncharted_territory=0;
+	replay_map	co_map;
+	bucket		*bkt, **co_list=NULL;
+	int		num_full, check_past_jnl_end = 1, in_uncharted_territory=0;
 	uint32_t	last_sequence_num = 0;
 	int 		replay_retry_count = 0;
     
@@ -1123,19 +1375,13 @@ replay_journal(journal *jnl)
 		return -1;
 	}
 
-	// allocate memory for the coalesce buffer
-	if ((MALLOC(co_buf, struct bucket *, num_buckets*sizeof(struct bucket), M_TEMP, M_WAITOK)) == NULL) {
-		printf("jnl: %s: replay_journal: no memory for coalesce buffer!\n", jnl->jdev_name);
-		return -1;
-	}
+	// the coalesce tree grows its buckets on demand
+	co_map.chunks = NULL;
 
 restart_replay:
 
-	// initialize entries
-	for(i = 0; i < num_buckets; i++) {
-		co_buf[i].block_num = -1;
-	}
-	num_full = 0; // empty at first
+	// empty at first
+	reset_replay_map(&co_map);
 
 
 	printf("jnl: %s: replay_journal: from: %lld to: %lld (joffset 0x%llx)\n",
@@ -1263,7 +1509,7 @@ restart_replay:
 			txn_start_offset = blhdr_offset;
 		}
 
-		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_buf\n", 
+		//printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_map\n", 
 		//       blhdr->num_blocks-1, jnl->jhdr->start);
 		bad_blocks = 0;
 		for (i = 1; i < blhdr->num_blocks; i++) {
@@ -1309,14 +1555,14 @@ restart_replay:
 				}
 
 
-				// add this bucket to co_buf, coalescing where possible
+				// add this bucket to co_map, coalescing where possible
 				// printf("jnl: replay_journal: adding block 0x%llx\n", number);
-				ret_val = add_block(jnl, &co_buf, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum, &num_buckets, &num_full);
+				ret_val = add_block(jnl, &co_map, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum);
 			    
 				if (ret_val == -1) {
-					printf("jnl: %s: replay_journal: trouble adding block to co_buf\n", jnl->jdev_name);
+					printf("jnl: %s: replay_journal: trouble adding block to co_map\n", jnl->jdev_name);
 					goto bad_replay;
-				} // else printf("jnl: replay_journal: added block 0x%llx at i=%d\n", number);
+				} // else printf("jnl: replay_journal: added block 0x%llx\n", number);
 			}
 			
 			// increment offset
@@ -1381,19 +1627,26 @@ bad_txn_handling:
 		jnl->jhdr->end = jnl->jhdr->start;
 	}
 
+	num_full = co_map.num_full;
 	//printf("jnl: replay_journal: replaying %d blocks\n", num_full);
+
+	if (num_full && (MALLOC(co_list, bucket **, num_full*sizeof(bucket *), M_TEMP, M_WAITOK)) == NULL) {
+		printf("jnl: %s: replay_journal: no memory for coalesce list!\n", jnl->jdev_name);
+		goto bad_replay;
+	}
     
 	/*
-	 * make sure it's at least one page in size, so
-	 * start max_bsize at PAGE_SIZE
+	 * flatten the tree into block order and size the block buffers;
+	 * make sure they're at least one page in size, so start max_bsize
+	 * at PAGE_SIZE
 	 */
-	for (i = 0, max_bsize = PAGE_SIZE; i < num_full; i++) {
+	i = 0;
+	max_bsize = PAGE_SIZE;
+	RB_FOREACH(bkt, bucket_tree, &co_map.tree) {
+		co_list[i++] = bkt;
 
-		if (co_buf[i].block_num == (off_t)-1)
-			continue;
-
-		if (co_buf[i].block_size > max_bsize)
-			max_bsize = co_buf[i].block_size;
+		if (bkt->block_size > max_bsize)
+			max_bsize = bkt->block_size;
 	}
 	/*
 	 * round max_bsize up to the nearest PAGE_SIZE multiple
@@ -1402,37 +1655,10 @@ bad_txn_handling:
 		max_bsize = (max_bsize + PAGE_SIZE) & ~(PAGE_SIZE - 1);
 	}
 
-	if (kmem_alloc(kernel_map, (vm_offset_t *)&block_ptr, max_bsize)) {
+	// Replay the coalesced entries
+	if (num_full && replay_buckets(jnl, co_list, num_full, max_bsize) != 0) {
 		goto bad_replay;
 	}
-    
-	// Replay the coalesced entries in the co-buf
-	for(i = 0; i < num_full; i++) {
-		size_t size = co_buf[i].block_size;
-		off_t jnl_offset = (off_t) co_buf[i].jnl_offset;
-		off_t number = co_buf[i].block_num;
-	
-	
-		// printf("replaying co_buf[%d]: block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", i, co_buf[i].block_num,
-		//      co_buf[i].block_size, co_buf[i].jnl_offset);
-	
-		if (number == (off_t)-1) {
-			// printf("jnl: replay_journal: skipping killed fs block\n");
-		} else {
-	    
-			// do journal read, and set the phys. block 
-			ret = read_journal_data(jnl, &jnl_offset, block_ptr, size);
-			if (ret != size) {
-				printf("jnl: %s: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", jnl->jdev_name, offset);
-				goto bad_replay;
-			}
-	    	    
-			if (update_fs_block(jnl, block_ptr, number, size) != 0) {
-				goto bad_replay;
-			}
-		}
-	}
-    
 	
 	// done replaying; update jnl header
 	if (write_journal_header(jnl, 1, jnl->jhdr->sequence_num) != 0) {
@@ -1441,15 +1667,12 @@ bad_txn_handling:
 
 	printf("jnl: %s: journal replay done.\n", jnl->jdev_name);
     
-	// free block_ptr
-	if (block_ptr) {
-		kmem_free(kernel_map, (vm_offset_t)block_ptr, max_bsize);
-		block_ptr = NULL;
+	// free the coalesce list and tree
+	if (co_list) {
+		FREE(co_list, M_TEMP);
+		co_list = NULL;
 	}
-    
-	// free the coalesce buffer
-	FREE(co_buf, M_TEMP);
-	co_buf = NULL;
+	destroy_replay_map(&co_map);
   
 	kmem_free(kernel_map, (vm_offset_t)buff, jnl->jhdr->blhdr_size);
 	return 0;
@@ -1458,9 +1681,10 @@ bad_replay:
 	if (block_ptr) {
 		kmem_free(kernel_map, (vm_offset_t)block_ptr, max_bsize);
 	}
-	if (co_buf) {
-		FREE(co_buf, M_TEMP);
+	if (co_list) {
+		FREE(co_list, M_TEMP);
 	}
+	destroy_replay_map(&co_map);
 	kmem_free(kernel_map, (vm_offset_t)buff, jnl->jhdr->blhdr_size);
 
 	return -1;
@@ -2702,17 +2926,7 @@ journal_modify_block_abort(journal *jnl, struct buf *bp)
 	// printf("jnl: modify_block_abort: tr 0x%x bp 0x%x\n", jnl->active_tr, bp);
 
 	// first check if it's already part of this transaction
-	for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
-		for (i = 1; i < blhdr->num_blocks; i++) {
-			if (bp == blhdr->binfo[i].u.bp) {
-				break;
-			}
-		}
-
-		if (i < blhdr->num_blocks) {
-			break;
-		}
-	}
+	blhdr = tr_blk_lookup(tr, bp, &i);
 
 	//
 	// if blhdr is null, then this block has only had modify_block_start
@@ -2734,7 +2948,6 @@ int
 journal_modify_block_end(journal *jnl, struct buf *bp, void (*func)(buf_t bp, void *arg), void *arg)
 {
 	int		i = 1;
-	int		tbuffer_offset=0;
 	block_list_header *blhdr, *prev=NULL;
 	transaction	*tr;
 
@@ -2763,24 +2976,12 @@ journal_modify_block_end(journal *jnl, struct buf *bp, void (*func)(buf_t bp, vo
 		panic("jnl: modify_block_end: bp %p not locked! jnl @ %p\n", bp, jnl);
 	}
 	 
-	// first check if it's already part of this transaction
-	for (blhdr = tr->blhdr; blhdr; prev = blhdr, blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
-		tbuffer_offset = jnl->jhdr->blhdr_size;
-
-		for (i = 1; i < blhdr->num_blocks; i++) {
-			if (bp == blhdr->binfo[i].u.bp) {
-				break;
-			}
-			if (blhdr->binfo[i].bnum != (off_t)-1) {
-				tbuffer_offset += buf_size(blhdr->binfo[i].u.bp);
-			} else {
-				tbuffer_offset += blhdr->binfo[i].u.bi.bsize;
-			}
-		}
-
-		if (i < blhdr->num_blocks) {
-			break;
-		}
+	// first check if it's already part of this transaction...
+	// if not, it gets appended to the last block_list_header
+	if ((blhdr = tr_blk_lookup(tr, bp, &i)) == NULL) {
+		for (prev = tr->blhdr; (long)prev->binfo[0].bnum; prev = (block_list_header *)((long)prev->binfo[0].bnum))
+			;
+		i = prev->num_blocks;
 	}
 
 	if (blhdr == NULL
@@ -2826,7 +3027,6 @@ journal_modify_block_end(journal *jnl, struct buf *bp, void (*func)(buf_t bp, vo
 
 		// and finally switch to using the new guy
 		blhdr          = nblhdr;
-		tbuffer_offset = jnl->jhdr->blhdr_size;
 		i              = 1;
 	}
 
@@ -2860,6 +3060,8 @@ journal_modify_block_end(journal *jnl, struct buf *bp, void (*func)(buf_t bp, vo
 		tr->total_bytes   += bsize;
 
 		blhdr->num_blocks++;
+
+		tr_blk_insert(tr, bp, blhdr, i);
 	}
 	buf_bdwrite(bp);
 
@@ -2899,42 +3101,33 @@ journal_kill_block(journal *jnl, struct buf *bp)
 	 * bp must be BL_BUSY and B_LOCKED
 	 * first check if it's already part of this transaction
 	 */
-	for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
-
-		for (i = 1; i < blhdr->num_blocks; i++) {
-			if (bp == blhdr->binfo[i].u.bp) {
-			        vnode_t vp;
-
-				buf_clearflags(bp, B_LOCKED);
+	if ((blhdr = tr_blk_lookup(tr, bp, &i)) != NULL) {
+		vnode_t vp;
 
-				// this undoes the vnode_ref() in journal_modify_block_end()
-				vp = buf_vnode(bp);
-				vnode_rele_ext(vp, 0, 1);
-
-				// if the block has the DELWRI and FILTER bits sets, then
-				// things are seriously weird.  if it was part of another
-				// transaction then journal_modify_block_start() should
-				// have force it to be written.
-				//
-				//if ((bflags & B_DELWRI) && (bflags & B_FILTER)) {
-				//	panic("jnl: kill block: this defies all logic! bp 0x%x\n", bp);
-				//} else {
-					tr->num_killed += buf_size(bp);
-				//}
-				blhdr->binfo[i].bnum = (off_t)-1;
-				blhdr->binfo[i].u.bp = NULL;
-				blhdr->binfo[i].u.bi.bsize = buf_size(bp);
-
-				buf_markinvalid(bp);
-				buf_brelse(bp);
+		buf_clearflags(bp, B_LOCKED);
 
-				break;
-			}
-		}
+		// this undoes the vnode_ref() in journal_modify_block_end()
+		vp = buf_vnode(bp);
+		vnode_rele_ext(vp, 0, 1);
 
-		if (i < blhdr->num_blocks) {
-			break;
-		}
+		// if the block has the DELWRI and FILTER bits sets, then
+		// things are seriously weird.  if it was part of another
+		// transaction then journal_modify_block_start() should
+		// have force it to be written.
+		//
+		//if ((bflags & B_DELWRI) && (bflags & B_FILTER)) {
+		//	panic("jnl: kill block: this defies all logic! bp 0x%x\n", bp);
+		//} else {
+			tr->num_killed += buf_size(bp);
+		//}
+		blhdr->binfo[i].bnum = (off_t)-1;
+		blhdr->binfo[i].u.bp = NULL;
+		blhdr->binfo[i].u.bi.bsize = buf_size(bp);
+
+		tr_blk_remove(tr, bp);
+
+		buf_markinvalid(bp);
+		buf_brelse(bp);
 	}
 
 	return 0;
@@ -3512,21 +3705,27 @@ journal_binfo_cmp(const void *a, const void *b)
 {
 	const block_info *bi_a = (const struct block_info *)a;
 	const block_info *bi_b = (const struct block_info *)b;
-	daddr64_t res;
+	daddr64_t blkno_a, blkno_b;
 
+	// killed blocks sort to the end
 	if (bi_a->bnum == (off_t)-1) {
-		return 1;
+		return (bi_b->bnum == (off_t)-1) ? 0 : 1;
 	}
 	if (bi_b->bnum == (off_t)-1) {
 		return -1;
 	}
 
-	// don't have to worry about negative block
-	// numbers so this is ok to do.
+	// the difference of two 64-bit block numbers doesn't fit
+	// in an int on big volumes, so compare them instead.
 	//
-	res = (buf_blkno(bi_a->u.bp) - buf_blkno(bi_b->u.bp));
+	blkno_a = buf_blkno(bi_a->u.bp);
+	blkno_b = buf_blkno(bi_b->u.bp);
 
-	return (int)res;
+	if (blkno_a < blkno_b)
+		return -1;
+	if (blkno_a > blkno_b)
+		return 1;
+	return 0;
 }
 
 
@@ -3596,9 +3795,17 @@ end_transaction(transaction *tr, int force_it, errno_t (*callback)(void*), void
     // trim error, then we stop issuing trims for this
     // volume, so we can also coalesce transactions.
 	//
+    // If the previous transaction is still being written to
+    // the journal, flushing this one now would just block us
+    // (holding the journal lock) behind that I/O.  Let it grow
+    // a bit more instead; it becomes the next commit group.
+	//
     if (   force_it == 0
 		   && (jnl->flags & JOURNAL_NO_GROUP_COMMIT) == 0 
-		   && tr->num_blhdrs < 3
+		   && (tr->num_blhdrs < 3
+		       || (jnl->flushing == TRUE
+			   && tr->num_blhdrs < (int)jnl_commit_max_blhdrs
+			   && tr->total_bytes < (jnl->jhdr->size / 8)))
 		   && (tr->total_bytes <= ((tr->tbuffer_size*tr->num_blhdrs) - tr->tbuffer_size/8))
 		   && (!(jnl->flags & JOURNAL_USE_UNMAP) || (tr->trim.extent_count < jnl_trim_flush_limit))) {
 
@@ -3652,6 +3859,17 @@ end_transaction(transaction *tr, int force_it, errno_t (*callback)(void*), void
 	 * of the journal flush, 'saved_sequence_num' remains stable
 	 */
 	jnl->saved_sequence_num = jnl->sequence_num;
+
+	/*
+	 * hand out the next commit generation... anyone waiting in
+	 * journal_flush for the contents of cur_tr is covered by this
+	 * commit, since cur_tr is what we're about to write.  we hold
+	 * the journal lock, so commit_gen and flush_waiters are stable
+	 */
+	tr->commit_gen = ++jnl->commit_gen;
+	tr->commit_start = mach_absolute_time();
+	tr->commit_batch = jnl->flush_waiters + (force_it ? 1 : 0);
+	jnl->flush_waiters = 0;
 	
 	/*
 	 * if we're here we're going to flush the transaction buffer to disk.
@@ -3875,9 +4093,24 @@ finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callba
 	size_t		tbuffer_offset;
 	int		bufs_written = 0;
 	int		ret_val = 0;
+	uint64_t	commit_gen, commit_start;
+	uint32_t	commit_batch;
 
 	KERNEL_DEBUG(0xbbbbc028|DBG_FUNC_START, jnl, tr, 0, 0, 0);
 
+	/*
+	 * tr can be freed out from under us once the last
+	 * buf_bawrite has been issued, so grab these now
+	 */
+	commit_gen   = tr->commit_gen;
+	commit_start = tr->commit_start;
+	commit_batch = tr->commit_batch;
+
+	/*
+	 * no more blocks can join this transaction
+	 */
+	tr_blk_free(tr);
+
 	end  = jnl->jhdr->end;
 
 	for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
@@ -4132,6 +4365,12 @@ bad_journal:
 	} else
 		unlock_condition(jnl, &jnl->flushing);
 
+	/*
+	 * on failure this is done after JOURNAL_INVALID has been
+	 * set so that anyone waiting on this commit notices it
+	 */
+	commit_done(jnl, commit_gen, commit_start, commit_batch);
+
 	KERNEL_DEBUG(0xbbbbc028|DBG_FUNC_END, jnl, tr, bufs_written, ret_val, 0);
 
 	return (ret_val);
@@ -4185,6 +4424,60 @@ unlock_condition(journal *jnl, boolean_t *condition)
 	unlock_flush(jnl);
 }
 
+/*
+ * Called once a transaction has been written to the journal (or has
+ * failed to be)... publishes its commit generation to anyone sleeping
+ * in wait_for_commit and accounts for the group commit statistics.
+ */
+static void
+commit_done(journal *jnl, uint64_t commit_gen, uint64_t commit_start, uint32_t commit_batch)
+{
+	uint64_t	latency, max;
+
+	if (commit_gen == 0)
+		return;
+
+	lock_flush(jnl);
+
+	if (commit_gen > jnl->committed_gen)
+		jnl->committed_gen = commit_gen;
+	wakeup((caddr_t)&jnl->committed_gen);
+
+	unlock_flush(jnl);
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - commit_start, &latency);
+
+	OSAddAtomic64(1, &jnl_commit_stats.jcs_commits);
+	OSAddAtomic64(latency, &jnl_commit_stats.jcs_latency_total);
+
+	while ((max = jnl_commit_stats.jcs_latency_max) < latency) {
+		if (OSCompareAndSwap64(max, latency, &jnl_commit_stats.jcs_latency_max))
+			break;
+	}
+	while ((max = jnl_commit_stats.jcs_batch_max) < commit_batch) {
+		if (OSCompareAndSwap64(max, commit_batch, &jnl_commit_stats.jcs_batch_max))
+			break;
+	}
+}
+
+/*
+ * Sleep until the transaction with generation 'commit_gen' has been
+ * written to the journal.  Transactions are committed in order, so
+ * this also covers every earlier generation.
+ */
+static int
+wait_for_commit(journal *jnl, uint64_t commit_gen)
+{
+	lock_flush(jnl);
+
+	while (jnl->committed_gen < commit_gen && (jnl->flags & JOURNAL_INVALID) == 0)
+		msleep((caddr_t)&jnl->committed_gen, &jnl->flock, PRIBIO, "jnl_commit", NULL);
+
+	unlock_flush(jnl);
+
+	return ((jnl->flags & JOURNAL_INVALID) ? -1 : 0);
+}
+
 static void
 abort_transaction(journal *jnl, transaction *tr)
 {
@@ -4286,6 +4579,7 @@ abort_transaction(journal *jnl, transaction *tr)
 	tr->trim.allocated_count = 0;
 	tr->trim.extent_count = 0;
 	tr->trim.extents = NULL;
+	tr_blk_free(tr);
 	tr->tbuffer     = NULL;
 	tr->blhdr       = NULL;
 	tr->total_bytes = 0xdbadc0de;
@@ -4383,6 +4677,9 @@ int
 journal_flush(journal *jnl, boolean_t wait_for_IO)
 {
 	boolean_t drop_lock = FALSE;
+	boolean_t waiting = FALSE;
+	uint64_t  target_gen;
+	int	  ret;
     
 	CHECK_JOURNAL(jnl);
     
@@ -4394,9 +4691,55 @@ journal_flush(journal *jnl, boolean_t wait_for_IO)
 
 	KERNEL_DEBUG(DBG_JOURNAL_FLUSH | DBG_FUNC_START, jnl, 0, 0, 0, 0);
 
+	OSAddAtomic64(1, &jnl_commit_stats.jcs_flush_requests);
+
 	if (jnl->owner != current_thread()) {
 		lock_journal(jnl);
 		drop_lock = TRUE;
+
+		/*
+		 * Group commit: if a previous transaction is still being
+		 * written to the journal, forcing cur_tr out now would
+		 * block us behind that I/O while holding the journal lock,
+		 * and every other fsync arriving meanwhile would then
+		 * commit its own tiny transaction.  Instead, drop the
+		 * journal lock so new modifications can keep going into
+		 * cur_tr, and wait for the flush in progress to finish.
+		 * Whoever writes cur_tr next (another journal_flush, or
+		 * journal_end_transaction) gets generation 'target_gen'
+		 * and covers everyone that queued up behind it.
+		 */
+		if (wait_for_IO == FALSE && (jnl->flags & JOURNAL_NO_GROUP_COMMIT) == 0) {
+			target_gen = jnl->commit_gen + 1;
+
+			while (jnl->cur_tr && jnl->flushing == TRUE && jnl->commit_gen < target_gen) {
+				if (waiting == FALSE) {
+					jnl->flush_waiters++;
+					waiting = TRUE;
+				}
+				unlock_journal(jnl);
+
+				wait_condition(jnl, &jnl->flushing, "journal_flush");
+
+				lock_journal(jnl);
+			}
+			if (jnl->commit_gen >= target_gen) {
+				unlock_journal(jnl);
+
+				OSAddAtomic64(1, &jnl_commit_stats.jcs_piggybacked);
+				ret = wait_for_commit(jnl, target_gen);
+
+				KERNEL_DEBUG(DBG_JOURNAL_FLUSH | DBG_FUNC_END, jnl, 0, 0, 0, 0);
+
+				return ret;
+			}
+			/*
+			 * we're the one who'll write cur_tr... the
+			 * forced end_transaction below counts us
+			 */
+			if (waiting == TRUE)
+				jnl->flush_waiters--;
+		}
 	}
 
 	// if we're not active, flush any buffered transactions
@@ -75,6 +75,8 @@ typedef struct block_list_header {
 
 
 struct journal;
+struct tr_blkent;
+struct tr_blkchunk;
 
 struct jnl_trim_list {
 	uint32_t	allocated_count;
@@ -99,6 +101,14 @@ typedef struct transaction {
     uint32_t            sequence_num;
 	struct jnl_trim_list trim;
     boolean_t		delayed_header_write;
+    uint64_t            commit_gen;    // commit generation assigned when written to the journal
+    uint64_t            commit_start;  // mach_absolute_time() when the commit started
+    uint32_t            commit_batch;  // number of journal_flush callers covered by this commit
+    struct tr_blkent  **blk_hash;      // buf_t -> binfo[] slot of the blocks in this transaction
+    uint32_t            blk_hashmask;
+    uint32_t            blk_count;     // number of blocks in blk_hash
+    struct tr_blkent   *blk_free;      // unused blk_hash entries
+    struct tr_blkchunk *blk_chunks;    // storage backing the blk_hash entries
 } transaction;
 
 
@@ -185,8 +195,24 @@ typedef struct journal {
     volatile off_t      old_start[16];     // this is how we do lazy start update
 
     int                 last_flush_err;    // last error from flushing the cache
+
+    uint64_t            commit_gen;        // last generation handed to the journal (protected by jlock)
+    volatile uint64_t   committed_gen;     // last generation whose commit finished (protected by flock)
+    uint32_t            flush_waiters;     // journal_flush callers waiting on cur_tr (protected by jlock)
 } journal;
 
+/*
+ * Group commit statistics, exported via vfs.generic.jnl.commit_stats
+ */
+struct jnl_commit_stats {
+    uint64_t            jcs_commits;       // transactions written to the journal
+    uint64_t            jcs_flush_requests;// calls to journal_flush
+    uint64_t            jcs_piggybacked;   // journal_flush calls satisfied by another thread's commit
+    uint64_t            jcs_batch_max;     // most journal_flush calls covered by a single commit
+    uint64_t            jcs_latency_total; // nanoseconds from commit start to journal header write
+    uint64_t            jcs_latency_max;
+};
+
 /* internal-only journal flags (top 16 bits) */
 #define JOURNAL_CLOSE_PENDING     0x00010000
 #define JOURNAL_INVALID           0x00020000
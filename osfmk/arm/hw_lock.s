@@ -434,6 +434,13 @@ mlckslow:
 #ifdef NO_EXCLUSIVES
     msr     cpsr_cf, r2
 #endif
+    stmfd   sp!,{r0,r1,r7,lr}
+    add     r7, sp, #8
+    /* Adaptive spin while the owner is running elsewhere. */
+    blx     _lck_mtx_lock_spinwait_arm
+    movs    r3, r0
+    ldmfd   sp!,{r0,r1,r7,lr}
+    bxeq    lr
     stmfd   sp!,{r0,r1,r7,lr}
     add     r7, sp, #8
     LoadLockHardwareRegister(r12)
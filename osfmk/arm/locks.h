@@ -100,6 +100,13 @@ typedef struct _lck_mtx_ {
 
 /* Adaptive spin before blocking */
 extern unsigned int MutexSpin;
+extern int lck_mtx_lock_spinwait_arm(lck_mtx_t * mutex);
+
+/*
+ * Direct mutexes keep no group pointer of their own; when the group has
+ * statistics enabled, lck_mtx_state carries it for the contention path.
+ */
+#define lck_mtx_stat_grp(m)	((struct _lck_grp_ *) (uintptr_t) (m)->lck_mtx_state)
 
 extern void lck_mtx_lock_mark_destroyed(lck_mtx_t * mutex);
 extern int lck_mtx_lock_mark_promoted(lck_mtx_t * mutex);
@@ -104,6 +104,8 @@ unsigned int lock_wait_time[2] = { (unsigned int) -1, 0 };
 
 uint32_t LcksOpts;
 
+#define	LCK_MTX_LCK_SPIN_CODE		0x22
+
 void lck_rw_ilk_lock(lck_rw_t * lck)
 {
     lck_spin_lock(lck);
@@ -154,6 +156,8 @@ void lck_mtx_init(lck_mtx_t * lck, lck_grp_t * grp, lck_attr_t * attr)
     lck->lck_mtx_data = 0;
     lck->lck_mtx_waiters = 0;
     lck->lck_mtx_state = 0;
+    if (grp->lck_grp_attr & LCK_GRP_ATTR_STAT)
+        lck->lck_mtx_state = (unsigned int) (uintptr_t) grp;
 
     lck_grp_reference(grp);
     lck_grp_lckcnt_incr(grp, LCK_TYPE_MTX);
@@ -191,6 +195,8 @@ void lck_mtx_init_ext(lck_mtx_t * lck, lck_mtx_ext_t * lck_ext, lck_grp_t * grp,
     lck->lck_mtx_data = 0;
     lck->lck_mtx_waiters = 0;
     lck->lck_mtx_state = 0;
+    if (grp->lck_grp_attr & LCK_GRP_ATTR_STAT)
+        lck->lck_mtx_state = (unsigned int) (uintptr_t) grp;
 
     lck_grp_reference(grp);
     lck_grp_lckcnt_incr(grp, LCK_TYPE_MTX);
@@ -516,6 +522,96 @@ void lck_mtx_lock_mark_destroyed(lck_mtx_t * mutex)
     return;
 }
 
+/**
+ * lck_mtx_lock_grab_mutex
+ *
+ * Take the mutex if it is completely free. A mutex with the waiter bit
+ * set is left alone so that the slow path can do the promotion bookkeeping
+ * in lck_mtx_lock_acquire().
+ */
+int lck_mtx_lock_grab_mutex(lck_mtx_t * mutex)
+{
+    return hw_compare_and_store(0, (uint32_t) current_thread(),
+                                (volatile uint32_t *) &mutex->lck_mtx_data);
+}
+
+/**
+ * lck_mtx_lock_spinwait_arm
+ *
+ * Called from the lck_mtx_lock() slow path before it takes the interlock.
+ * Spin while the owner is running on another processor, for at most
+ * MutexSpin (the "mtxspin" boot-arg), so that short critical sections
+ * do not cost the waiter a block and a wakeup.
+ *
+ * returns 0 if the mutex was acquired
+ * returns 1 if we spun and the caller should block
+ * returns 2 if we didn't spin because the holder was not running
+ */
+int lck_mtx_lock_spinwait_arm(lck_mtx_t * mutex)
+{
+    thread_t holder;
+    lck_grp_t *grp;
+    uint64_t start, deadline;
+    unsigned int data;
+    int retval = 1;
+    int loopcount = 0;
+
+    KERNEL_DEBUG(MACHDBG_CODE(DBG_MACH_LOCKS, LCK_MTX_LCK_SPIN_CODE) |
+                 DBG_FUNC_START, (int) mutex, mutex->lck_mtx_data,
+                 mutex->lck_mtx_waiters, 0, 0);
+
+    start = mach_absolute_time();
+    deadline = start + MutexSpin;
+
+    /*
+     * Spin while:
+     *   - mutex is locked, and
+     *   - owner is running on another processor, and
+     *   - we haven't spun for long enough.
+     */
+    do {
+        if (__probable(lck_mtx_lock_grab_mutex(mutex))) {
+            retval = 0;
+            break;
+        }
+
+        /*
+         * An indirect or destroyed mutex carries a tag, not an owner,
+         * in its data word; leave it to the slow path.
+         */
+        data = mutex->lck_mtx_data;
+        if (data == LCK_MTX_TAG_INDIRECT || data == LCK_MTX_TAG_DESTROYED) {
+            retval = 1;
+            break;
+        }
+
+        holder = (thread_t) (data & ~3);
+        if (holder == THREAD_NULL || !lck_mtx_holder_running(holder)) {
+            if (loopcount == 0)
+                retval = 2;
+            break;
+        }
+
+        cpu_pause();
+        loopcount++;
+    } while (mach_absolute_time() < deadline);
+
+    grp = lck_mtx_stat_grp(mutex);
+    if (grp != LCK_GRP_NULL) {
+        if (retval == 2)
+            grp->lck_grp_stat.lck_grp_mtx_stat.lck_grp_mtx_held_cnt++;
+        else
+            lck_grp_mtx_spin_record(grp, mach_absolute_time() - start,
+                                    retval == 0);
+    }
+
+    KERNEL_DEBUG(MACHDBG_CODE(DBG_MACH_LOCKS, LCK_MTX_LCK_SPIN_CODE) |
+                 DBG_FUNC_END, (int) mutex, mutex->lck_mtx_data,
+                 mutex->lck_mtx_waiters, retval, 0);
+
+    return retval;
+}
+
 boolean_t lck_rw_lock_shared_to_exclusive_gen(lck_rw_t * lck)
 {
     int i;
@@ -1973,6 +1973,18 @@ lck_mtx_lock_spinwait_x86(
 
 	} while (mach_absolute_time() < deadline);
 
+	/*
+	 * Only extended mutexes know their group; direct waits are
+	 * already counted by the assembly code.
+	 */
+	if (__improbable(mutex->lck_mtx_is_ext) && retval != 2) {
+		lck_mtx_ext_t	*lck_ext = (lck_mtx_ext_t *)mutex;
+
+		if (lck_ext->lck_mtx_attr & LCK_MTX_ATTR_STAT)
+			lck_grp_mtx_spin_record(lck_ext->lck_mtx_grp,
+			    mach_absolute_time() - (deadline - MutexSpin),
+			    retval == 0);
+	}
 
 #if	CONFIG_DTRACE
 	/*
@@ -230,6 +230,13 @@ ast_check(
 
 		ast_propagate(thread->ast);
 
+		/*
+		 *	Another processor may have queued work behind
+		 *	a stretched quantum.
+		 */
+		if (processor->quantum_stretch != 0)
+			sched_tickless_unstretch(processor);
+
 		/*
 		 *	Context switch check.
 		 */
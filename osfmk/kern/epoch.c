@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+ *	kern/epoch.c
+ *
+ *	Epoch based deferred reclamation.
+ *
+ *	There are three epochs, cycled by the reclaimer.  Each processor
+ *	publishes the epoch it observed when it entered a read-side section
+ *	(or nothing, outside of one).  The global epoch may only move from
+ *	E to E+1 once no processor is still inside a section entered in an
+ *	earlier epoch, so after two advances every reader that could have
+ *	seen an object retired in epoch E has left, and E's retire list can
+ *	be released.  Three epochs are therefore enough, with one retire
+ *	list per epoch.
+ *
+ *	Retired objects are released from a thread call, armed when the
+ *	first object is queued and re-armed for as long as work remains.
+ *
+ *	With the "epoch_debug" boot-arg (the default on DEBUG kernels), each
+ *	outermost section records where and when it was entered, and the
+ *	reclaimer panics if a processor stays in one section for longer than
+ *	epoch_stall_secs, which catches a missing epoch_exit().
+ */
+
+#include <mach/mach_types.h>
+
+#include <kern/epoch.h>
+#include <kern/kern_types.h>
+#include <kern/processor.h>
+#include <kern/cpu_number.h>
+#include <kern/thread_call.h>
+#include <kern/sched_prim.h>
+#include <kern/zalloc.h>
+#include <kern/locks.h>
+#include <kern/clock.h>
+#include <kern/debug.h>
+#include <kern/misc_protos.h>
+
+#include <libkern/OSAtomic.h>
+#include <machine/machine_routines.h>
+#include <pexpert/pexpert.h>
+
+#define	EPOCH_COUNT		3
+#define	EPOCH_ACTIVE		0x1
+#define	EPOCH_RECLAIM_MSECS	10
+
+struct epoch_list {
+	epoch_entry_t		el_head;
+	epoch_entry_t		*el_tailp;
+	uint32_t		el_count;
+};
+
+static volatile uint32_t	epoch_global;
+static struct epoch_list	epoch_pending[EPOCH_COUNT];
+static boolean_t		epoch_reclaim_armed;
+static thread_call_t		epoch_reclaim_call;
+
+static lck_grp_t		*epoch_lck_grp;
+decl_lck_spin_data(static, epoch_lock)
+
+static int			epoch_debug;
+static uint32_t			epoch_stall_secs = 1;
+static uint64_t			epoch_stall_abstime;
+
+static struct epoch_stats {
+	uint64_t	advances;	/* global epoch advanced */
+	uint64_t	blocked;	/* advance held up by a reader */
+	uint64_t	deferred;	/* objects queued */
+	uint64_t	reclaimed;	/* objects released */
+} epoch_stats;
+
+
+static void	epoch_reclaim(thread_call_param_t p0, thread_call_param_t p1);
+
+/*
+ * Routine:	epoch_init
+ */
+void
+epoch_init(void)
+{
+	int	i;
+
+#if DEBUG
+	epoch_debug = 1;
+#endif
+	(void) PE_parse_boot_argn("epoch_debug", &epoch_debug, sizeof (epoch_debug));
+	(void) PE_parse_boot_argn("epoch_stall_secs", &epoch_stall_secs, sizeof (epoch_stall_secs));
+	nanoseconds_to_absolutetime((uint64_t)epoch_stall_secs * NSEC_PER_SEC, &epoch_stall_abstime);
+
+	epoch_lck_grp = lck_grp_alloc_init("epoch", LCK_GRP_ATTR_NULL);
+	lck_spin_init(&epoch_lock, epoch_lck_grp, LCK_ATTR_NULL);
+
+	for (i = 0; i < EPOCH_COUNT; i++) {
+		epoch_pending[i].el_head = NULL;
+		epoch_pending[i].el_tailp = &epoch_pending[i].el_head;
+		epoch_pending[i].el_count = 0;
+	}
+
+	epoch_reclaim_call = thread_call_allocate_with_priority(epoch_reclaim,
+	    NULL, THREAD_CALL_PRIORITY_KERNEL);
+}
+
+/*
+ * Routine:	epoch_enter
+ *
+ * Begin a read-side section.  Preemption stays disabled until the
+ * matching epoch_exit().
+ *
+ * Sections entered from interrupt context nest inside whatever this
+ * processor was doing, and always exit before returning to it, so a
+ * nested enter or exit needs no more than the plain increment.  The
+ * outermost one publishes active with interrupts disabled: otherwise
+ * an interrupt taken between the two stores could find nesting already
+ * raised and go on to read with active still saying "quiescent".
+ */
+void
+epoch_enter(void)
+{
+	struct epoch_cpu	*ec;
+	boolean_t		istate;
+
+	disable_preemption();
+	ec = &PROCESSOR_DATA(current_processor(), epoch);
+	if (ec->nesting != 0) {
+		ec->nesting++;
+		return;
+	}
+
+	istate = ml_set_interrupts_enabled(FALSE);
+	ec->active = (epoch_global << 1) | EPOCH_ACTIVE;
+	OSMemoryBarrier();
+	ec->nesting = 1;
+
+	if (__improbable(epoch_debug)) {
+		ec->enter_time = mach_absolute_time();
+		ec->enter_pc = (uintptr_t)__builtin_return_address(0);
+	}
+	ml_set_interrupts_enabled(istate);
+}
+
+/*
+ * Routine:	epoch_exit
+ */
+void
+epoch_exit(void)
+{
+	struct epoch_cpu	*ec;
+	boolean_t		istate;
+
+	ec = &PROCESSOR_DATA(current_processor(), epoch);
+	if (__improbable(ec->nesting == 0))
+		panic("epoch_exit(): not in a read-side section\n");
+
+	if (ec->nesting > 1) {
+		ec->nesting--;
+	} else {
+		/* mirror of epoch_enter(): retire nesting and active together */
+		istate = ml_set_interrupts_enabled(FALSE);
+		OSMemoryBarrier();
+		ec->nesting = 0;
+		ec->active = 0;
+		ml_set_interrupts_enabled(istate);
+	}
+	enable_preemption();
+}
+
+/*
+ * Routine:	epoch_in_section
+ */
+boolean_t
+epoch_in_section(void)
+{
+	boolean_t	result;
+
+	disable_preemption();
+	result = (PROCESSOR_DATA(current_processor(), epoch).nesting != 0);
+	enable_preemption();
+
+	return (result);
+}
+
+/*
+ * Routine:	epoch_call
+ *
+ * Queue entry so that func(entry) runs once every read-side section
+ * that might still reference the enclosing object has exited.  The
+ * object must already be unreachable for new readers.  May be called
+ * from within a read-side section.
+ */
+void
+epoch_call(
+	epoch_entry_t		entry,
+	epoch_func_t		func)
+{
+	struct epoch_list	*el;
+	boolean_t		arm = FALSE;
+	uint64_t		deadline;
+	spl_t			s;
+
+	entry->ee_func = func;
+	entry->ee_next = NULL;
+
+	s = splsched();
+	lck_spin_lock(&epoch_lock);
+
+	el = &epoch_pending[epoch_global];
+	*el->el_tailp = entry;
+	el->el_tailp = &entry->ee_next;
+	el->el_count++;
+	epoch_stats.deferred++;
+
+	if (!epoch_reclaim_armed) {
+		epoch_reclaim_armed = TRUE;
+		arm = TRUE;
+	}
+
+	lck_spin_unlock(&epoch_lock);
+	splx(s);
+
+	if (arm) {
+		clock_interval_to_deadline(EPOCH_RECLAIM_MSECS, NSEC_PER_MSEC, &deadline);
+		thread_call_enter_delayed(epoch_reclaim_call, deadline);
+	}
+}
+
+static void
+epoch_zfree_func(
+	epoch_entry_t		entry)
+{
+	zfree(entry->ee_zone, entry->ee_elem);
+}
+
+/*
+ * Routine:	epoch_zfree
+ *
+ * Deferred zfree(zone, elem).  The entry is normally embedded in elem
+ * itself; zfree() is not called on elem until readers are done with it,
+ * so the element keeps its contents (and its zone poisoning does not
+ * apply) until then.
+ */
+void
+epoch_zfree(
+	epoch_entry_t		entry,
+	struct zone		*zone,
+	void			*elem)
+{
+	entry->ee_zone = zone;
+	entry->ee_elem = elem;
+	epoch_call(entry, epoch_zfree_func);
+}
+
+static void
+epoch_check_stall(
+	processor_t		processor,
+	struct epoch_cpu	*ec)
+{
+	uint64_t	enter_time = ec->enter_time;
+
+	if (enter_time != 0 && (ec->active & EPOCH_ACTIVE) &&
+	    mach_absolute_time() - enter_time > epoch_stall_abstime) {
+		panic("epoch: read-side section entered at %p on cpu %d "
+		    "has not exited after %u seconds\n",
+		    (void *)ec->enter_pc, processor->cpu_id, epoch_stall_secs);
+	}
+}
+
+/*
+ * Routine:	epoch_try_advance
+ *
+ * Move the global epoch forward if no processor is still inside a
+ * section entered in an older epoch.  On success, the retire list that
+ * has become safe is appended to *donep.
+ */
+static boolean_t
+epoch_try_advance(
+	epoch_entry_t		*donep)
+{
+	struct epoch_list	*el;
+	struct epoch_cpu	*ec;
+	processor_t		processor;
+	uint32_t		cur, active, next;
+	spl_t			s;
+
+	cur = epoch_global;
+	OSMemoryBarrier();
+
+	for (processor = processor_list; processor != PROCESSOR_NULL;
+	    processor = processor->processor_list) {
+		ec = &PROCESSOR_DATA(processor, epoch);
+		active = ec->active;
+		if ((active & EPOCH_ACTIVE) && (active >> 1) != cur) {
+			epoch_stats.blocked++;
+			if (epoch_debug)
+				epoch_check_stall(processor, ec);
+			return (FALSE);
+		}
+	}
+
+	s = splsched();
+	lck_spin_lock(&epoch_lock);
+
+	if (epoch_global != cur) {
+		/* someone else advanced while we scanned */
+		lck_spin_unlock(&epoch_lock);
+		splx(s);
+		return (FALSE);
+	}
+
+	next = (cur + 1) % EPOCH_COUNT;
+	epoch_global = next;
+	epoch_stats.advances++;
+
+	/* Objects retired two epochs ago, which is also next's successor */
+	el = &epoch_pending[(next + 1) % EPOCH_COUNT];
+	if (el->el_head != NULL) {
+		*el->el_tailp = *donep;
+		*donep = el->el_head;
+		el->el_head = NULL;
+		el->el_tailp = &el->el_head;
+		el->el_count = 0;
+	}
+
+	lck_spin_unlock(&epoch_lock);
+	splx(s);
+
+	return (TRUE);
+}
+
+static void
+epoch_run(
+	epoch_entry_t		entry)
+{
+	epoch_entry_t		next;
+
+	for (; entry != NULL; entry = next) {
+		next = entry->ee_next;
+		entry->ee_func(entry);
+		epoch_stats.reclaimed++;
+	}
+}
+
+/*
+ * Routine:	epoch_reclaim
+ *
+ * Thread call: advance as far as readers allow, release whatever has
+ * become safe, and re-arm while objects remain queued.
+ */
+static void
+epoch_reclaim(
+	__unused thread_call_param_t	p0,
+	__unused thread_call_param_t	p1)
+{
+	epoch_entry_t		done = NULL;
+	boolean_t		rearm;
+	uint64_t		deadline;
+	int			i;
+	spl_t			s;
+
+	for (i = 0; i < EPOCH_COUNT - 1; i++) {
+		if (!epoch_try_advance(&done))
+			break;
+	}
+
+	epoch_run(done);
+
+	s = splsched();
+	lck_spin_lock(&epoch_lock);
+	rearm = FALSE;
+	for (i = 0; i < EPOCH_COUNT; i++) {
+		if (epoch_pending[i].el_count != 0)
+			rearm = TRUE;
+	}
+	epoch_reclaim_armed = rearm;
+	lck_spin_unlock(&epoch_lock);
+	splx(s);
+
+	if (rearm) {
+		clock_interval_to_deadline(EPOCH_RECLAIM_MSECS, NSEC_PER_MSEC, &deadline);
+		thread_call_enter_delayed(epoch_reclaim_call, deadline);
+	}
+}
+
+/*
+ * Routine:	epoch_synchronize
+ *
+ * Wait until every read-side section that was in progress on entry has
+ * exited.  Blocks; must not be called from within a section.
+ */
+void
+epoch_synchronize(void)
+{
+	epoch_entry_t		done = NULL;
+	int			advanced = 0;
+
+	if (epoch_in_section())
+		panic("epoch_synchronize(): called from a read-side section\n");
+
+	while (advanced < EPOCH_COUNT - 1) {
+		if (epoch_try_advance(&done)) {
+			advanced++;
+			continue;
+		}
+		assert_wait_timeout((event_t)&epoch_global, THREAD_UNINT,
+		    1, NSEC_PER_MSEC);
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+
+	epoch_run(done);
+}
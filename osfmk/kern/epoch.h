@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+ *	kern/epoch.h
+ *
+ *	Epoch based deferred reclamation.
+ *
+ *	Readers bracket lock-free accesses to shared structures with
+ *	epoch_enter() and epoch_exit().  Updaters unlink an object and hand
+ *	it to epoch_call() or epoch_zfree(); the object is released only once
+ *	every read-side section that could still see it has exited.
+ *
+ *	Read-side sections run with preemption disabled and must not block.
+ *	They may nest, and may be entered from interrupt context.
+ */
+
+#ifndef	_KERN_EPOCH_H_
+#define	_KERN_EPOCH_H_
+
+#include <mach/mach_types.h>
+#include <sys/cdefs.h>
+
+#ifdef	XNU_KERNEL_PRIVATE
+
+struct zone;
+
+typedef struct epoch_entry	*epoch_entry_t;
+typedef void			(*epoch_func_t)(epoch_entry_t entry);
+
+/*
+ * Embedded in objects whose release is deferred.  The entry must remain
+ * valid, and untouched by the caller, until its callback runs.
+ */
+struct epoch_entry {
+	struct epoch_entry	*ee_next;
+	epoch_func_t		ee_func;
+	struct zone		*ee_zone;	/* epoch_zfree() only */
+	void			*ee_elem;	/* epoch_zfree() only */
+};
+
+__BEGIN_DECLS
+
+extern void	epoch_enter(void);
+
+extern void	epoch_exit(void);
+
+extern boolean_t	epoch_in_section(void);
+
+extern void	epoch_call(
+			epoch_entry_t		entry,
+			epoch_func_t		func);
+
+extern void	epoch_zfree(
+			epoch_entry_t		entry,
+			struct zone		*zone,
+			void			*elem);
+
+extern void	epoch_synchronize(void);
+
+__END_DECLS
+
+#ifdef	MACH_KERNEL_PRIVATE
+extern void	epoch_init(void);
+#endif
+
+#endif	/* XNU_KERNEL_PRIVATE */
+
+#endif	/* _KERN_EPOCH_H_ */
@@ -66,9 +66,14 @@
 #include <kern/thread.h>
 #include <kern/processor.h>
 #include <kern/sched_prim.h>
+#include <kern/clock.h>
+#include <kern/cpu_number.h>
 #include <kern/debug.h>
 #include <string.h>
 
+#include <machine/machine_routines.h>
+#include <libkern/OSAtomic.h>
+
 
 #include <sys/kdebug.h>
 
@@ -340,6 +345,41 @@ lck_grp_lckcnt_decr(
 	(void)hw_atomic_sub(lckcnt, 1);
 }
 
+/*
+ * Routine:	lck_grp_mtx_spin_record
+ *
+ * Account one adaptive spin on a contended mutex of the group.
+ * spin_time is in absolute time units.  Like the other group
+ * statistics these counters are updated without atomics and are
+ * only approximate under heavy contention.
+ */
+
+void
+lck_grp_mtx_spin_record(
+	lck_grp_t	*grp,
+	uint64_t	spin_time,
+	boolean_t	acquired)
+{
+	lck_grp_mtx_spin_stat_t	*stat = &grp->lck_grp_stat.lck_grp_mtx_spin_stat;
+	uint64_t		spin_us;
+	unsigned int		bucket = 0;
+
+	absolutetime_to_nanoseconds(spin_time, &spin_us);
+	spin_us /= NSEC_PER_USEC;
+
+	while (spin_us != 0 && bucket < LCK_GRP_MTX_SPIN_BUCKETS - 1) {
+		spin_us >>= 1;
+		bucket++;
+	}
+
+	stat->lck_grp_mtx_spin_cnt++;
+	if (acquired)
+		stat->lck_grp_mtx_spin_acquire_cnt++;
+	else
+		stat->lck_grp_mtx_spin_block_cnt++;
+	stat->lck_grp_mtx_spin_hist[bucket]++;
+}
+
 /*
  * Routine:	lck_attr_alloc_init
  */
@@ -564,6 +604,33 @@ lck_mtx_sleep_deadline(
 	return res;
 }
 
+/*
+ * Routine:	lck_mtx_holder_running
+ *
+ * Returns TRUE if the holder of a contended mutex is executing on
+ * another processor right now, in which case it is likely to drop
+ * the mutex shortly and spinning is cheaper than blocking.
+ *
+ * The holder's state is sampled without its thread lock, so the
+ * answer is only a hint; callers must bound the spin independently.
+ */
+boolean_t
+lck_mtx_holder_running(
+	thread_t		holder)
+{
+	processor_t		processor;
+
+	if (holder == THREAD_NULL)
+		return (FALSE);
+
+	processor = holder->last_processor;
+	if (processor == PROCESSOR_NULL || processor == current_processor())
+		return (FALSE);
+
+	return (processor->active_thread == holder &&
+		(holder->state & (TH_RUN | TH_IDLE)) == TH_RUN);
+}
+
 /*
  * Routine: 	lck_mtx_lock_wait
  *
@@ -923,6 +990,387 @@ lck_rw_sleep_deadline(
 	return res;
 }
 
+/*
+ * Big-reader locks.
+ *
+ * A reader/writer lock for data that is read far more often than it is
+ * written.  Readers only touch a counter private to the processor they
+ * run on, so concurrent readers on different processors never share a
+ * cache line.  Writers are serialized by a mutex, announce themselves
+ * with lck_brw_want_excl and then wait for the sum of all the per-cpu
+ * reader counts to drain to zero, which makes exclusive acquisition
+ * O(ncpus) and considerably more expensive than for lck_rw_t.
+ *
+ * A reader may migrate while it holds the lock, so it can increment one
+ * processor's counter and decrement another's; only the (modular) sum of
+ * the counters is meaningful.  Counters are updated atomically since a
+ * counter slot may be shared when there are more processors than slots.
+ *
+ * Readers must not re-acquire a lock they already hold shared: a writer
+ * draining in between would deadlock against them.  Readers may block
+ * while holding the lock.
+ */
+
+#define	LCK_BRW_CPU_SIZE(n)	\
+	((n) * sizeof(lck_brw_cpu_t) + LCK_BRW_CPU_ALIGN - 1)
+
+#define	LCK_BRW_READER_EVENT(lck)	((event_t)&(lck)->lck_brw_want_excl)
+#define	LCK_BRW_WRITER_EVENT(lck)	((event_t)&(lck)->lck_brw_owner)
+
+static inline lck_brw_cpu_t *
+lck_brw_cpu(
+	lck_brw_t	*lck)
+{
+	return (&lck->lck_brw_cpu[cpu_number() % lck->lck_brw_ncpus]);
+}
+
+static uint32_t
+lck_brw_readers(
+	lck_brw_t	*lck)
+{
+	uint32_t	readers = 0;
+	unsigned int	i;
+
+	for (i = 0; i < lck->lck_brw_ncpus; i++)
+		readers += lck->lck_brw_cpu[i].lck_brw_readers;
+
+	return (readers);
+}
+
+/*
+ * Routine:	lck_brw_alloc_init
+ */
+lck_brw_t *
+lck_brw_alloc_init(
+	lck_grp_t	*grp,
+	lck_attr_t	*attr)
+{
+	lck_brw_t	*lck;
+	int		ncpus;
+
+	ncpus = ml_get_max_cpus();
+	if (ncpus < 1)
+		ncpus = 1;
+
+	if ((lck = (lck_brw_t *)kalloc(sizeof(lck_brw_t))) == NULL)
+		return (NULL);
+	/*
+	 * kalloc() makes no alignment promise beyond the natural one; pad
+	 * the allocation so that each per-cpu slot gets a cache line of
+	 * its own, otherwise neighbouring readers would false-share.
+	 */
+	lck->lck_brw_cpu_base = kalloc(LCK_BRW_CPU_SIZE(ncpus));
+	if (lck->lck_brw_cpu_base == NULL) {
+		kfree(lck, sizeof(lck_brw_t));
+		return (NULL);
+	}
+	lck->lck_brw_cpu = (lck_brw_cpu_t *)
+	    (((uintptr_t)lck->lck_brw_cpu_base + LCK_BRW_CPU_ALIGN - 1) &
+	    ~((uintptr_t)LCK_BRW_CPU_ALIGN - 1));
+	bzero(lck->lck_brw_cpu, ncpus * sizeof(lck_brw_cpu_t));
+
+	lck->lck_brw_ncpus = ncpus;
+	lck->lck_brw_want_excl = FALSE;
+	lck->lck_brw_owner = THREAD_NULL;
+	lck->lck_brw_grp = grp;
+	lck_mtx_init(&lck->lck_brw_wmtx, grp, attr);
+
+	return (lck);
+}
+
+/*
+ * Routine:	lck_brw_free
+ */
+void
+lck_brw_free(
+	lck_brw_t	*lck,
+	lck_grp_t	*grp)
+{
+	if (lck->lck_brw_want_excl || lck_brw_readers(lck) != 0)
+		panic("lck_brw_free(): lock %p is held\n", lck);
+
+	lck_mtx_destroy(&lck->lck_brw_wmtx, grp);
+	kfree(lck->lck_brw_cpu_base, LCK_BRW_CPU_SIZE(lck->lck_brw_ncpus));
+	kfree(lck, sizeof(lck_brw_t));
+}
+
+/*
+ * Routine:	lck_brw_lock_shared
+ */
+void
+lck_brw_lock_shared(
+	lck_brw_t	*lck)
+{
+	for (;;) {
+		disable_preemption();
+		(void)hw_atomic_add(&lck_brw_cpu(lck)->lck_brw_readers, 1);
+		OSMemoryBarrier();
+		if (__probable(!lck->lck_brw_want_excl)) {
+			enable_preemption();
+			return;
+		}
+
+		/*
+		 * A writer is draining or holds the lock: back out so
+		 * that it can make progress, and wait for it to finish.
+		 */
+		(void)hw_atomic_sub(&lck_brw_cpu(lck)->lck_brw_readers, 1);
+		OSMemoryBarrier();
+		enable_preemption();
+		thread_wakeup(LCK_BRW_WRITER_EVENT(lck));
+
+		while (lck->lck_brw_want_excl) {
+			assert_wait(LCK_BRW_READER_EVENT(lck), THREAD_UNINT);
+			if (!lck->lck_brw_want_excl) {
+				clear_wait(current_thread(), THREAD_AWAKENED);
+				break;
+			}
+			thread_block(THREAD_CONTINUE_NULL);
+		}
+	}
+}
+
+/*
+ * Routine:	lck_brw_unlock_shared
+ */
+void
+lck_brw_unlock_shared(
+	lck_brw_t	*lck)
+{
+	disable_preemption();
+	(void)hw_atomic_sub(&lck_brw_cpu(lck)->lck_brw_readers, 1);
+	OSMemoryBarrier();
+	enable_preemption();
+
+	if (__improbable(lck->lck_brw_want_excl))
+		thread_wakeup(LCK_BRW_WRITER_EVENT(lck));
+}
+
+/*
+ * Routine:	lck_brw_lock_exclusive
+ */
+void
+lck_brw_lock_exclusive(
+	lck_brw_t	*lck)
+{
+	lck_mtx_lock(&lck->lck_brw_wmtx);
+
+	lck->lck_brw_want_excl = TRUE;
+	OSMemoryBarrier();
+
+	if (lck_brw_readers(lck) != 0) {
+		if (lck->lck_brw_grp->lck_grp_attr & LCK_GRP_ATTR_STAT)
+			lck->lck_brw_grp->lck_grp_stat.lck_grp_rw_stat.lck_grp_rw_wait_cnt++;
+
+		for (;;) {
+			assert_wait(LCK_BRW_WRITER_EVENT(lck), THREAD_UNINT);
+			if (lck_brw_readers(lck) == 0) {
+				clear_wait(current_thread(), THREAD_AWAKENED);
+				break;
+			}
+			thread_block(THREAD_CONTINUE_NULL);
+		}
+	}
+
+	lck->lck_brw_owner = current_thread();
+}
+
+/*
+ * Routine:	lck_brw_unlock_exclusive
+ */
+void
+lck_brw_unlock_exclusive(
+	lck_brw_t	*lck)
+{
+	if (lck->lck_brw_owner != current_thread())
+		panic("lck_brw_unlock_exclusive(): lock %p not owned\n", lck);
+
+	lck->lck_brw_owner = THREAD_NULL;
+	OSMemoryBarrier();
+	lck->lck_brw_want_excl = FALSE;
+	OSMemoryBarrier();
+	thread_wakeup(LCK_BRW_READER_EVENT(lck));
+
+	lck_mtx_unlock(&lck->lck_brw_wmtx);
+}
+
+/*
+ * Routine:	lck_brw_done
+ *
+ * Drops the lock in whichever mode the caller holds it.
+ */
+lck_rw_type_t
+lck_brw_done(
+	lck_brw_t	*lck)
+{
+	if (lck->lck_brw_owner == current_thread()) {
+		lck_brw_unlock_exclusive(lck);
+		return (LCK_RW_TYPE_EXCLUSIVE);
+	}
+	lck_brw_unlock_shared(lck);
+	return (LCK_RW_TYPE_SHARED);
+}
+
+/*
+ * Routine:	lck_brw_assert
+ *
+ * Like lck_rw_assert(), a shared assertion only checks that some
+ * thread holds the lock shared, not necessarily the caller.
+ */
+void
+lck_brw_assert(
+	lck_brw_t	*lck,
+	unsigned int	type)
+{
+	switch (type) {
+	case LCK_RW_ASSERT_SHARED:
+		if (lck_brw_readers(lck) != 0)
+			return;
+		break;
+	case LCK_RW_ASSERT_EXCLUSIVE:
+		if (lck->lck_brw_owner == current_thread())
+			return;
+		break;
+	case LCK_RW_ASSERT_HELD:
+		if (lck->lck_brw_owner == current_thread() ||
+		    lck_brw_readers(lck) != 0)
+			return;
+		break;
+	default:
+		break;
+	}
+
+	panic("lck_brw_assert(): lock %p not held (mode=%u)\n", lck, type);
+}
+
+#if DEVELOPMENT || DEBUG
+/*
+ * Lock microbenchmark support, driven from user space through the
+ * debug.lck_*_test_* sysctls (tools/tests/lck_mtx_contention and
+ * tools/tests/lck_brw_scaling).  All callers hammer the same locks in
+ * a statistics-enabled group so the contention statistics can be read
+ * back afterwards.
+ */
+static lck_grp_t	*lck_mtx_test_grp;
+static lck_mtx_t	*lck_mtx_test_mtx;
+static lck_rw_t		*lck_rw_test_rw;
+static lck_brw_t	*lck_brw_test_brw;
+
+static void
+lck_mtx_test_init(void)
+{
+	lck_grp_attr_t	*grp_attr;
+	lck_grp_t	*grp;
+
+	if (lck_mtx_test_mtx != NULL)
+		return;
+
+	grp_attr = lck_grp_attr_alloc_init();
+	lck_grp_attr_setstat(grp_attr);
+	grp = lck_grp_alloc_init("lck_mtx_test", grp_attr);
+	lck_grp_attr_free(grp_attr);
+
+	lck_mtx_lock(&lck_grp_lock);
+	if (lck_mtx_test_mtx == NULL) {
+		lck_mtx_test_grp = grp;
+		lck_rw_test_rw = lck_rw_alloc_init(grp, LCK_ATTR_NULL);
+		lck_brw_test_brw = lck_brw_alloc_init(grp, LCK_ATTR_NULL);
+		lck_mtx_test_mtx = lck_mtx_alloc_init(grp, LCK_ATTR_NULL);
+		grp = LCK_GRP_NULL;
+	}
+	lck_mtx_unlock(&lck_grp_lock);
+
+	if (grp != LCK_GRP_NULL)
+		lck_grp_free(grp);
+}
+
+/*
+ * Take the test mutex, hold it for hold_usecs without blocking, and drop it.
+ */
+void
+lck_mtx_test_lock_hold(
+	uint32_t	hold_usecs)
+{
+	lck_mtx_test_init();
+
+	lck_mtx_lock(lck_mtx_test_mtx);
+	if (hold_usecs != 0)
+		delay(hold_usecs);
+	lck_mtx_unlock(lck_mtx_test_mtx);
+}
+
+/*
+ * Take and drop one of the test reader/writer locks shared, iterations
+ * times in a row, to measure how read acquisition scales with the
+ * number of concurrent callers.
+ */
+void
+lck_rw_test_read(
+	boolean_t	big_reader,
+	uint32_t	iterations)
+{
+	lck_mtx_test_init();
+
+	if (big_reader) {
+		while (iterations-- > 0) {
+			lck_brw_lock_shared(lck_brw_test_brw);
+			lck_brw_unlock_shared(lck_brw_test_brw);
+		}
+	} else {
+		while (iterations-- > 0) {
+			lck_rw_lock_shared(lck_rw_test_rw);
+			lck_rw_unlock_shared(lck_rw_test_rw);
+		}
+	}
+}
+
+/*
+ * Take one of the test reader/writer locks exclusive once.
+ */
+void
+lck_rw_test_write(
+	boolean_t	big_reader)
+{
+	lck_mtx_test_init();
+
+	if (big_reader) {
+		lck_brw_lock_exclusive(lck_brw_test_brw);
+		lck_brw_unlock_exclusive(lck_brw_test_brw);
+	} else {
+		lck_rw_lock_exclusive(lck_rw_test_rw);
+		lck_rw_unlock_exclusive(lck_rw_test_rw);
+	}
+}
+
+/*
+ * Copy out the contention statistics of the test group, optionally
+ * clearing them for the next run.
+ */
+void
+lck_mtx_test_spin_stats(
+	lck_mtx_test_stats_t	*stats,
+	boolean_t		reset)
+{
+	lck_grp_mtx_spin_stat_t	*spin;
+	unsigned int		i;
+
+	lck_mtx_test_init();
+
+	spin = &lck_mtx_test_grp->lck_grp_stat.lck_grp_mtx_spin_stat;
+	stats->spin_cnt = spin->lck_grp_mtx_spin_cnt;
+	stats->spin_acquire_cnt = spin->lck_grp_mtx_spin_acquire_cnt;
+	stats->spin_block_cnt = spin->lck_grp_mtx_spin_block_cnt;
+	stats->direct_wait_cnt = lck_mtx_test_grp->lck_grp_stat.lck_grp_mtx_stat.lck_grp_mtx_held_cnt;
+	for (i = 0; i < LCK_GRP_MTX_SPIN_BUCKETS; i++)
+		stats->spin_hist[i] = spin->lck_grp_mtx_spin_hist[i];
+
+	if (reset) {
+		bzero(spin, sizeof(*spin));
+		lck_mtx_test_grp->lck_grp_stat.lck_grp_mtx_stat.lck_grp_mtx_held_cnt = 0;
+	}
+}
+#endif	/* DEVELOPMENT || DEBUG */
+
 kern_return_t
 host_lockgroup_info(
 	host_t					host,
@@ -95,10 +95,25 @@ typedef struct {
 	uint64_t			lck_grp_rw_wait_cum;
 } lck_grp_rw_stat_t;
 
+/*
+ * Adaptive spin histogram for contended mutexes.  Bucket 0 counts spins
+ * shorter than a microsecond, bucket n counts spins in [2^(n-1), 2^n) us;
+ * the last bucket absorbs everything longer.
+ */
+#define	LCK_GRP_MTX_SPIN_BUCKETS	16	/* == LCK_MTX_TEST_SPIN_BUCKETS */
+
+typedef struct {
+	uint64_t			lck_grp_mtx_spin_cnt;
+	uint64_t			lck_grp_mtx_spin_acquire_cnt;
+	uint64_t			lck_grp_mtx_spin_block_cnt;
+	uint64_t			lck_grp_mtx_spin_hist[LCK_GRP_MTX_SPIN_BUCKETS];
+} lck_grp_mtx_spin_stat_t;
+
 typedef	struct _lck_grp_stat_ {
 	lck_grp_spin_stat_t	lck_grp_spin_stat;
 	lck_grp_mtx_stat_t	lck_grp_mtx_stat;
 	lck_grp_rw_stat_t	lck_grp_rw_stat;
+	lck_grp_mtx_spin_stat_t	lck_grp_mtx_spin_stat;
 } lck_grp_stat_t;
 
 #define	LCK_GRP_MAX_NAME	64
@@ -174,6 +189,11 @@ extern	void			lck_grp_lckcnt_incr(
 extern	void			lck_grp_lckcnt_decr(
 									lck_grp_t		*grp,
 									lck_type_t		lck_type);
+
+extern	void			lck_grp_mtx_spin_record(
+									lck_grp_t		*grp,
+									uint64_t		spin_time,
+									boolean_t		acquired);
 #endif
 
 __BEGIN_DECLS
@@ -375,8 +395,42 @@ extern void				lck_mtx_unlockspin_wakeup(
 extern boolean_t		lck_mtx_ilk_unlock(
 									lck_mtx_t		*lck);
 
+extern boolean_t		lck_mtx_holder_running(
+									thread_t		holder);
+
 #endif
 
+#ifdef	XNU_KERNEL_PRIVATE
+#if DEVELOPMENT || DEBUG
+/* Layout shared with tools/tests/lck_mtx_contention */
+#define	LCK_MTX_TEST_SPIN_BUCKETS	16
+
+typedef struct {
+	uint64_t	spin_cnt;
+	uint64_t	spin_acquire_cnt;
+	uint64_t	spin_block_cnt;
+	uint64_t	direct_wait_cnt;
+	uint64_t	spin_hist[LCK_MTX_TEST_SPIN_BUCKETS];
+} lck_mtx_test_stats_t;
+
+__BEGIN_DECLS
+extern void				lck_mtx_test_lock_hold(
+									uint32_t		hold_usecs);
+
+extern void				lck_mtx_test_spin_stats(
+									lck_mtx_test_stats_t	*stats,
+									boolean_t		reset);
+
+extern void				lck_rw_test_read(
+									boolean_t		big_reader,
+									uint32_t		iterations);
+
+extern void				lck_rw_test_write(
+									boolean_t		big_reader);
+__END_DECLS
+#endif	/* DEVELOPMENT || DEBUG */
+#endif	/* XNU_KERNEL_PRIVATE */
+
 #define decl_lck_rw_data(class,name)     class lck_rw_t name;
 
 typedef unsigned int	 lck_rw_type_t;
@@ -480,4 +534,63 @@ extern boolean_t		lck_rw_try_lock_exclusive(
 
 __END_DECLS
 
+#ifdef	XNU_KERNEL_PRIVATE
+/*
+ * Big-reader locks: shared acquisition touches only a per-cpu counter,
+ * exclusive acquisition drains every processor.  Meant for read-mostly
+ * data; see osfmk/kern/locks.c.
+ */
+#ifdef	MACH_KERNEL_PRIVATE
+#define	LCK_BRW_CPU_ALIGN	64
+
+typedef struct {
+	volatile uint32_t	lck_brw_readers;
+	uint32_t		lck_brw_pad[(LCK_BRW_CPU_ALIGN / sizeof(uint32_t)) - 1];
+} __attribute__((aligned(LCK_BRW_CPU_ALIGN))) lck_brw_cpu_t;
+
+typedef struct _lck_brw_ {
+	volatile uint32_t	lck_brw_want_excl;	/* writer holds or is draining */
+	thread_t		lck_brw_owner;		/* exclusive holder */
+	unsigned int		lck_brw_ncpus;
+	lck_brw_cpu_t		*lck_brw_cpu;		/* per-cpu reader counts */
+	void			*lck_brw_cpu_base;	/* unaligned allocation */
+	lck_grp_t		*lck_brw_grp;
+	lck_mtx_t		lck_brw_wmtx;		/* serializes writers */
+} lck_brw_t;
+#else
+typedef struct __lck_brw__ lck_brw_t;
+#endif
+
+__BEGIN_DECLS
+
+extern lck_brw_t		*lck_brw_alloc_init(
+									lck_grp_t		*grp,
+									lck_attr_t		*attr);
+
+extern void				lck_brw_free(
+									lck_brw_t		*lck,
+									lck_grp_t		*grp);
+
+extern void				lck_brw_lock_shared(
+									lck_brw_t		*lck);
+
+extern void				lck_brw_unlock_shared(
+									lck_brw_t		*lck);
+
+extern void				lck_brw_lock_exclusive(
+									lck_brw_t		*lck);
+
+extern void				lck_brw_unlock_exclusive(
+									lck_brw_t		*lck);
+
+extern lck_rw_type_t	lck_brw_done(
+									lck_brw_t		*lck);
+
+extern void				lck_brw_assert(
+									lck_brw_t		*lck,
+									unsigned int	type);
+
+__END_DECLS
+#endif	/* XNU_KERNEL_PRIVATE */
+
 #endif /* _KERN_LOCKS_H_ */
@@ -168,6 +168,9 @@ thread_quantum_expire(
 	thread_quantum_init(thread);
 	thread->last_quantum_refill_time = processor->quantum_end;
 
+	processor->quantum_stretch = 0;
+	sched_tickless_stretch(processor, thread);
+
 	/* Reload precise timing global policy to thread-local policy */
 	thread->precise_user_kernel_time = use_precise_user_kernel_time(thread);
 
@@ -149,6 +149,7 @@ struct processor {
 
 	timer_call_data_t	quantum_timer;	/* timer for quantum expiration */
 	uint64_t			quantum_end;	/* time when current quantum ends */
+	uint32_t			quantum_stretch;/* normal quantum, if stretched while alone */
 	uint64_t			last_dispatch;	/* time of last dispatch */
 
 	uint64_t			deadline;		/* current deadline */
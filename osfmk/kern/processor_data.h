@@ -88,6 +88,14 @@ struct processor_data {
 
 	struct processor_sched_statistics sched_stats;
 	uint64_t        timer_call_ttd; /* current timer call time-to-deadline */
+
+	/* Epoch read-side state, see kern/epoch.c */
+	struct epoch_cpu {
+		volatile uint32_t		active;
+		uint32_t				nesting;
+		uint64_t				enter_time;
+		uintptr_t				enter_pc;
+	}						epoch;
 };
 
 typedef struct processor_data	processor_data_t;
@@ -303,8 +303,9 @@ extern uint32_t		sched_tick_interval;
 
 extern uint64_t		sched_one_second_interval;
 
-/* Periodic computation of various averages */
-extern void		compute_averages(void);
+/* Periodic computation of various averages, over the given number of ticks */
+extern void		compute_averages(
+					uint32_t		periods);
 
 extern void		compute_averunnable(
 					void			*nrun);
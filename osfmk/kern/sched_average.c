@@ -112,13 +112,35 @@ static struct sched_average {
 
 typedef struct sched_average	*sched_average_t;
 
+/*
+ *	Bound on the number of elapsed ticks folded in by
+ *	a single call; the averages have converged by then.
+ */
+#define SCHED_AVERAGE_MAX_PERIODS	512
+
+/*
+ *	compute_averages:
+ *
+ *	Fold one sample per scheduler tick that has elapsed since
+ *	the last call into the running averages.  All but the last
+ *	of those ticks must have been idle (the caller only skips
+ *	ticks while nothing else is runnable), so they are aged in
+ *	as idle samples, followed by the current load sample.
+ */
 void
-compute_averages(void)
+compute_averages(
+	uint32_t			periods)
 {
 	int					ncpus, nthreads, nshared;
-	uint32_t			factor_now, average_now, load_now = 0;
+	uint32_t			factor_now, factor_idle, average_now, load_now = 0;
+	uint32_t			n;
 	sched_average_t		avg;
 	uint64_t			abstime;
+
+	if (periods == 0)
+		periods = 1;
+	else if (periods > SCHED_AVERAGE_MAX_PERIODS)
+		periods = SCHED_AVERAGE_MAX_PERIODS;
 	
 	/*
 	 *	Retrieve counts, ignoring
@@ -133,12 +155,17 @@ compute_averages(void)
 	 *	those which ask about these things.
 	 */
 	average_now = nthreads * LOAD_SCALE;
+	factor_idle = ncpus * LOAD_SCALE;
 
 	if (nthreads > ncpus)
 		factor_now = (ncpus * LOAD_SCALE) / (nthreads + 1);
 	else
 		factor_now = (ncpus - nthreads) * LOAD_SCALE;
 
+	for (n = 1; n < periods; n++) {
+		sched_mach_factor =	((sched_mach_factor << 2) + factor_idle) / 5;
+		sched_load_average = (sched_load_average << 2) / 5;
+	}
 	sched_mach_factor =	((sched_mach_factor << 2) + factor_now) / 5;
 	sched_load_average = ((sched_load_average << 2) + average_now) / 5;
 
@@ -185,12 +212,17 @@ compute_averages(void)
 	{
 		register int		i;
 
-		for (i = 0; i < 3; i++) {
-			mach_factor[i] = ((mach_factor[i] * fract[i]) +
-						(factor_now * (LOAD_SCALE - fract[i]))) / LOAD_SCALE;
+		for (n = 1; n <= periods; n++) {
+			uint32_t	factor = (n < periods) ? factor_idle : factor_now;
+			uint32_t	average = (n < periods) ? 0 : average_now;
+
+			for (i = 0; i < 3; i++) {
+				mach_factor[i] = ((mach_factor[i] * fract[i]) +
+							(factor * (LOAD_SCALE - fract[i]))) / LOAD_SCALE;
 
-			avenrun[i] = ((avenrun[i] * fract[i]) +
-						(average_now * (LOAD_SCALE - fract[i]))) / LOAD_SCALE;
+				avenrun[i] = ((avenrun[i] * fract[i]) +
+							(average * (LOAD_SCALE - fract[i]))) / LOAD_SCALE;
+			}
 		}
 	}
 #endif /* CONFIG_SCHED_TRADITIONAL */
@@ -361,7 +361,7 @@ sched_fixedpriority_maintenance_continuation(void)
 	/*
 	 *  Compute various averages.
 	 */
-	compute_averages();
+	compute_averages(1);
 	
 	if (sched_fixedpriority_tick_deadline == 0)
 		sched_fixedpriority_tick_deadline = abstime;
@@ -291,7 +291,7 @@ sched_grrr_maintenance_continuation(void)
 	/*
 	 *  Compute various averages.
 	 */
-	compute_averages();
+	compute_averages(1);
 	
 	if (sched_grrr_tick_deadline == 0)
 		sched_grrr_tick_deadline = abstime;
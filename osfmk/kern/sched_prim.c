@@ -155,6 +155,21 @@ uint32_t	default_timeshare_constraint;
 uint32_t	max_rt_quantum;
 uint32_t	min_rt_quantum;
 
+/*
+ * Tickless operation: a timesharing thread that is alone on its
+ * processor has its quantum stretched to sched_tickless_quantum
+ * instead of taking a quantum interrupt every few milliseconds,
+ * and the scheduler tick backs off to once a second while nothing
+ * else is runnable.  Enabled with the sched_tickless boot-arg or
+ * kern.sched_tickless.
+ */
+int			sched_tickless = 0;
+uint32_t	sched_tickless_quantum;
+
+uint32_t	sched_tickless_stretched;	/* quanta stretched */
+uint32_t	sched_tickless_unstretched;	/* stretches cut short by new work */
+uint32_t	sched_tickless_ticks_skipped;	/* scheduler ticks not taken */
+
 #if defined(CONFIG_SCHED_TRADITIONAL)
 
 unsigned	sched_tick;
@@ -297,6 +312,12 @@ static uint64_t		sched_traditional_with_pset_runqueue_processor_runq_stats_count
 static void
 sched_traditional_init(void);
 
+static void
+sched_traditional_tick_kick_init(void);
+
+static void
+sched_traditional_tick_kick(void);
+
 static void
 sched_traditional_timebase_init(void);
 
@@ -578,6 +599,8 @@ sched_init(void)
 	
 	SCHED(pset_init)(&pset0);
 	SCHED(processor_init)(master_processor);
+
+	PE_parse_boot_argn("sched_tickless", &sched_tickless, sizeof (sched_tickless));
 }
 
 void
@@ -587,6 +610,8 @@ sched_timebase_init(void)
 	
 	clock_interval_to_absolutetime_interval(1, NSEC_PER_SEC, &abstime);
 	sched_one_second_interval = abstime;
+
+	sched_tickless_quantum = (abstime > UINT32_MAX) ? UINT32_MAX : (uint32_t)abstime;
 	
 	SCHED(timebase_init)();
 	sched_realtime_timebase_init();
@@ -616,6 +641,7 @@ sched_traditional_init(void)
 	load_shift_init();
 	preempt_pri_init();
 	sched_tick = 0;
+	sched_traditional_tick_kick_init();
 }
 
 static void
@@ -903,6 +929,11 @@ thread_unblock(
 		sched_run_incr();
 		if (thread->sched_mode == TH_MODE_TIMESHARE)
 			sched_share_incr();
+
+#if defined(CONFIG_SCHED_TRADITIONAL)
+		/* End a tickless backoff of the scheduler tick */
+		sched_traditional_tick_kick();
+#endif /* CONFIG_SCHED_TRADITIONAL */
 	}
 	else {
 		/*
@@ -1886,6 +1917,7 @@ thread_select_idle(
 	 *	Cancel the quantum timer while idling.
 	 */
 	timer_call_cancel(&processor->quantum_timer);
+	processor->quantum_stretch = 0;
 	processor->timeslice = 0;
 
 	(*thread->sched_call)(SCHED_CALL_BLOCK, thread);
@@ -1936,6 +1968,7 @@ thread_select_idle(
 
 		processor->quantum_end = processor->last_dispatch + thread->current_quantum;
 		timer_call_enter1(&processor->quantum_timer, thread, processor->quantum_end, TIMER_CALL_CRITICAL);
+		processor->quantum_stretch = 0;
 		processor->timeslice = 1;
 
 		thread->computation_epoch = processor->last_dispatch;
@@ -2359,6 +2392,16 @@ thread_dispatch(
 			else
 				thread->current_quantum = 0;
 
+			/*
+			 *	Do not carry a stretched quantum into
+			 *	a contended run.
+			 */
+			if (processor->quantum_stretch != 0) {
+				if (thread->current_quantum > processor->quantum_stretch)
+					thread->current_quantum = processor->quantum_stretch;
+				processor->quantum_stretch = 0;
+			}
+
 			if (thread->sched_mode == TH_MODE_REALTIME) {
 				/*
 				 *	Cancel the deadline if the thread has
@@ -2484,6 +2527,7 @@ thread_dispatch(
 		 */
 		processor->quantum_end = (processor->last_dispatch + self->current_quantum);
 		timer_call_enter1(&processor->quantum_timer, self, processor->quantum_end, TIMER_CALL_CRITICAL);
+		processor->quantum_stretch = 0;
 
 		processor->timeslice = 1;
 
@@ -2491,12 +2535,87 @@ thread_dispatch(
 	}
 	else {
 		timer_call_cancel(&processor->quantum_timer);
+		processor->quantum_stretch = 0;
 		processor->timeslice = 0;
 
 		thread_tell_urgency(THREAD_URGENCY_NONE, 0, 0);
 	}
 }
 
+/*
+ *	sched_tickless_stretch:
+ *
+ *	Called from thread_quantum_expire() after the thread's
+ *	quantum has been refilled.  If nothing else can run on
+ *	this processor, replace the refill with a stretched
+ *	quantum so that a lone thread is not interrupted every
+ *	quantum.  Realtime and fixed threads keep the normal
+ *	quantum, which also drives their fail-safe.
+ *
+ *	Called at splsched with the thread locked.
+ */
+void
+sched_tickless_stretch(
+	processor_t			processor,
+	thread_t			thread)
+{
+	processor_set_t		pset = processor->processor_set;
+
+	if (!sched_tickless || thread->sched_mode != TH_MODE_TIMESHARE)
+		return;
+
+	if (thread->current_quantum >= sched_tickless_quantum)
+		return;
+
+	/*
+	 *	Decide under the pset lock, so that processor_setrun()
+	 *	either sees the stretch or we see its enqueue.
+	 */
+	pset_lock(pset);
+
+	if (rt_runq.count == 0 && SCHED(processor_queue_empty)(processor)) {
+		processor->quantum_stretch = thread->current_quantum;
+		thread->current_quantum = sched_tickless_quantum;
+
+		(void)hw_atomic_add(&sched_tickless_stretched, 1);
+	}
+
+	pset_unlock(pset);
+}
+
+/*
+ *	sched_tickless_unstretch:
+ *
+ *	Work has arrived for a processor running a stretched
+ *	quantum; end the quantum no later than a normal one
+ *	from now.  Must be called on the processor itself.
+ *
+ *	Called at splsched.
+ */
+void
+sched_tickless_unstretch(
+	processor_t			processor)
+{
+	thread_t			thread = processor->active_thread;
+	uint64_t			end;
+
+	assert(processor == current_processor());
+
+	if (processor->quantum_stretch == 0)
+		return;
+
+	end = mach_absolute_time() + processor->quantum_stretch;
+	if (end < processor->quantum_end) {
+		thread->current_quantum -= (uint32_t)(processor->quantum_end - end);
+		processor->quantum_end = end;
+		timer_call_enter1(&processor->quantum_timer, thread, end, TIMER_CALL_CRITICAL);
+	}
+
+	processor->quantum_stretch = 0;
+
+	(void)hw_atomic_add(&sched_tickless_unstretched, 1);
+}
+
 #include <libkern/OSDebug.h>
 
 uint32_t	kdebug_thread_block = 0;
@@ -3144,6 +3263,19 @@ processor_setrun(
 				machine_signal_idle(processor);
 	}
 
+	/*
+	 *	A stretched quantum must be cut back now that the
+	 *	processor has company; the remote case is handled
+	 *	by ast_check().
+	 */
+	if (processor->quantum_stretch != 0) {
+		if (processor == current_processor())
+			sched_tickless_unstretch(processor);
+		else
+		if (processor->state == PROCESSOR_RUNNING)
+			cause_ast_check(processor);
+	}
+
 	pset_unlock(pset);
 }
 
@@ -4274,24 +4406,82 @@ sched_startup(void)
 #if defined(CONFIG_SCHED_TRADITIONAL)
 
 static uint64_t			sched_tick_deadline = 0;
+static uint64_t			sched_tick_last = 0;
+static boolean_t		sched_tick_backedoff = FALSE;	/* tick thread only */
+static volatile uint32_t	sched_tick_backoff = 0;		/* kickable backoff */
+static timer_call_data_t	sched_tick_kick_call;
+
+static void sched_traditional_tick_continue(void);
+
+static void
+sched_traditional_tick_kick_expire(
+	__unused timer_call_param_t	p0,
+	__unused timer_call_param_t	p1)
+{
+	thread_wakeup((event_t)sched_traditional_tick_continue);
+}
+
+static void
+sched_traditional_tick_kick_init(void)
+{
+	timer_call_setup(&sched_tick_kick_call, sched_traditional_tick_kick_expire, NULL);
+}
+
+/*
+ *	sched_traditional_tick_kick:
+ *
+ *	Called when a thread becomes runnable; if the scheduler
+ *	tick is backed off, get it running again right away so
+ *	that priority aging resumes with the load.  The wakeup is
+ *	delivered from a timer callout, since the caller holds
+ *	the lock of the thread being made runnable.
+ */
+static void
+sched_traditional_tick_kick(void)
+{
+	if (sched_tick_backoff != 0 &&
+	    hw_compare_and_store(1, 0, &sched_tick_backoff))
+		timer_call_enter(&sched_tick_kick_call, mach_absolute_time(), TIMER_CALL_CRITICAL);
+}
 
 /*
  *	sched_init_thread:
  *
  *	Perform periodic bookkeeping functions about ten
  *	times per second.
+ *
+ *	In tickless mode the period backs off to a second while
+ *	nothing else is runnable, and is cut short as soon as a
+ *	thread becomes runnable.  sched_tick is advanced by the
+ *	number of periods which actually elapsed, and the skipped
+ *	periods enter the load averages as idle samples.
  */
 static void
 sched_traditional_tick_continue(void)
 {
 	uint64_t			abstime = mach_absolute_time();
+	uint32_t			ticks = 1;
+	boolean_t			backedoff = sched_tick_backedoff;
+
+	sched_tick_backoff = 0;
+	sched_tick_backedoff = FALSE;
 
-	sched_tick++;
+	if (sched_tick_last != 0 && abstime > sched_tick_last) {
+		ticks = (uint32_t)((abstime - sched_tick_last + (sched_tick_interval / 2)) /
+														sched_tick_interval);
+		if (ticks == 0)
+			ticks = 1;
+	}
+	sched_tick_last = abstime;
+
+	sched_tick += ticks;
 
 	/*
-	 *  Compute various averages.
+	 *  Compute various averages.  Ticks missed while
+	 *  backed off were idle; a late tick otherwise
+	 *  counts as a single sample.
 	 */
-	compute_averages();
+	compute_averages(backedoff ? ticks : 1);
 
 	/*
 	 *  Scan the run queues for threads which
@@ -4299,13 +4489,27 @@ sched_traditional_tick_continue(void)
 	 */
 	thread_update_scan();
 
-	if (sched_tick_deadline == 0)
+	/* Restart the period if a backoff was cut short */
+	if (sched_tick_deadline == 0 || sched_tick_deadline > abstime)
 		sched_tick_deadline = abstime;
 	
 	clock_deadline_for_periodic_event(sched_tick_interval, abstime,
 														&sched_tick_deadline);
 
+	/*
+	 *  Only this thread is running; sleep for a second
+	 *  (the shortest period of the sched_average components),
+	 *  unless kicked by a thread becoming runnable.
+	 */
+	if (sched_tickless && sched_run_count <= 1) {
+		sched_tick_deadline += ((1 << SCHED_TICK_SHIFT) - 1) * (uint64_t)sched_tick_interval;
+		(void)hw_atomic_add(&sched_tickless_ticks_skipped, (1 << SCHED_TICK_SHIFT) - 1);
+		sched_tick_backedoff = TRUE;
+	}
+
 	assert_wait_deadline((event_t)sched_traditional_tick_continue, THREAD_UNINT, sched_tick_deadline);
+	if (sched_tick_backedoff)
+		sched_tick_backoff = 1;		/* after the wait is asserted */
 	thread_block((thread_continue_t)sched_traditional_tick_continue);
 	/*NOTREACHED*/
 }
@@ -330,6 +330,15 @@ extern void	thread_tell_urgency(
 extern void	active_rt_threads(
     					boolean_t	active);
 
+/* Stretch the quantum of a thread running alone (tickless mode) */
+extern void	sched_tickless_stretch(
+					processor_t		processor,
+					thread_t		thread);
+
+/* End a stretched quantum because work has arrived */
+extern void	sched_tickless_unstretch(
+					processor_t		processor);
+
 #endif /* MACH_KERNEL_PRIVATE */
 
 __BEGIN_DECLS
@@ -338,6 +347,12 @@ __BEGIN_DECLS
 
 extern boolean_t		assert_wait_possible(void);
 
+/* Tickless scheduling control and counters */
+extern int			sched_tickless;
+extern uint32_t			sched_tickless_stretched;
+extern uint32_t			sched_tickless_unstretched;
+extern uint32_t			sched_tickless_ticks_skipped;
+
 /*
  ****************** Only exported until BSD stops using ********************
  */
@@ -81,6 +81,7 @@
 #include <kern/misc_protos.h>
 #include <kern/clock.h>
 #include <kern/cpu_number.h>
+#include <kern/epoch.h>
 #include <kern/ledger.h>
 #include <kern/machine.h>
 #include <kern/processor.h>
@@ -296,6 +297,12 @@ kernel_bootstrap_thread(void)
 	 */
 	kernel_bootstrap_thread_kprintf("calling thread_call_initialize\n");
 	thread_call_initialize();
+
+	/*
+	 * Deferred reclamation, driven by a thread call.
+	 */
+	kernel_bootstrap_thread_kprintf("calling epoch_init\n");
+	epoch_init();
 	
 	/*
 	 * Remain on current processor as
@@ -53,7 +53,23 @@
 static zone_t			thread_call_zone;
 static struct wait_queue	daemon_wqueue;
 
+/*
+ * Each group has its own lock, which protects its queues, its thread
+ * accounting and the queue state (tc_call.queue, counts, refs) of every
+ * call belonging to it.  A call's group is fixed at allocation, so no
+ * operation on a call needs more than one group lock, and callouts of
+ * different importances never contend with each other.  Group locks
+ * are never held together; the daemon lock nests inside a group lock.
+ * The internal call storage is only used by the high priority group and
+ * is covered by its lock.
+ */
 struct thread_call_group {
+#if defined(__i386__) || defined(__x86_64__)
+	lck_mtx_t		tcg_lock;
+#else
+	lck_spin_t		tcg_lock;
+#endif
+
 	queue_head_t		pending_queue;
 	uint32_t		pending_count;
 
@@ -72,6 +88,8 @@ struct thread_call_group {
 
 	uint32_t		flags;
 	sched_call_t		sched_call;
+
+	struct thread_call_group_stats	stats;
 };
 
 typedef struct thread_call_group	*thread_call_group_t;
@@ -88,6 +106,7 @@ typedef struct thread_call_group	*thread_call_group_t;
 
 static struct thread_call_group	thread_call_groups[THREAD_CALL_GROUP_COUNT];
 static boolean_t		thread_call_daemon_awake;
+static boolean_t		thread_call_daemon_rescan;
 static thread_call_data_t	internal_call_storage[INTERNAL_CALL_COUNT];
 static queue_head_t		thread_call_internal_queue;
 static uint64_t 		thread_call_dealloc_interval_abs;
@@ -108,7 +127,10 @@ static void			thread_call_dealloc_timer(timer_call_param_t p0, timer_call_param_
 static void			thread_call_group_setup(thread_call_group_t group, thread_call_priority_t pri, uint32_t target_thread_count, boolean_t parallel);
 static void			sched_call_thread(int type, thread_t thread);
 static void			thread_call_start_deallocate_timer(thread_call_group_t group);
-static void			thread_call_wait_locked(thread_call_t call);
+static void			thread_call_wait_locked(thread_call_t call, thread_call_group_t group);
+static void			thread_call_run_one(thread_call_group_t group, boolean_t stolen);
+static boolean_t		thread_call_steal(thread_call_group_t group);
+static void			thread_call_set_pri(thread_t self, integer_t pri);
 
 #define qe(x)		((queue_entry_t)(x))
 #define TC(x)		((thread_call_t)(x))
@@ -119,35 +141,37 @@ lck_grp_t               thread_call_lck_grp;
 lck_attr_t              thread_call_lck_attr;
 lck_grp_attr_t          thread_call_lck_grp_attr;
 
-#if defined(__i386__) || defined(__x86_64__)
-lck_mtx_t		thread_call_lock_data;
-#else
-lck_spin_t		thread_call_lock_data;
-#endif
+lck_spin_t		thread_call_daemon_lock_data;
+
+
+#define thread_call_lock_spin(group)		\
+	lck_mtx_lock_spin_always(&(group)->tcg_lock)
 
+#define thread_call_unlock(group)		\
+	lck_mtx_unlock_always(&(group)->tcg_lock)
 
-#define thread_call_lock_spin()			\
-	lck_mtx_lock_spin_always(&thread_call_lock_data)
+#define thread_call_daemon_lock()		\
+	lck_spin_lock(&thread_call_daemon_lock_data)
 
-#define thread_call_unlock()			\
-	lck_mtx_unlock_always(&thread_call_lock_data)
+#define thread_call_daemon_unlock()		\
+	lck_spin_unlock(&thread_call_daemon_lock_data)
 
 
 static inline spl_t
-disable_ints_and_lock(void)
+disable_ints_and_lock(thread_call_group_t group)
 {
 	spl_t s;
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	return s;
 }
 
 static inline void 
-enable_ints_and_unlock(void)
+enable_ints_and_unlock(thread_call_group_t group)
 {
-	thread_call_unlock();
+	thread_call_unlock(group);
 	(void)spllo();
 }
 
@@ -238,6 +262,12 @@ thread_call_group_setup(
 		uint32_t			target_thread_count,
 		boolean_t			parallel)
 {
+#if defined(__i386__) || defined(__x86_64__)
+	lck_mtx_init(&group->tcg_lock, &thread_call_lck_grp, &thread_call_lck_attr);
+#else
+	lck_spin_init(&group->tcg_lock, &thread_call_lck_grp, &thread_call_lck_attr);
+#endif
+
 	queue_init(&group->pending_queue);
 	queue_init(&group->delayed_queue);
 
@@ -295,6 +325,7 @@ void
 thread_call_initialize(void)
 {
 	thread_call_t			call;
+	thread_call_group_t		group;
 	kern_return_t			result;
 	thread_t			thread;
 	int				i;
@@ -309,11 +340,7 @@ thread_call_initialize(void)
 	lck_grp_init(&thread_call_queues_lck_grp, "thread_call_queues", &thread_call_lck_grp_attr);
 	lck_grp_init(&thread_call_lck_grp, "thread_call", &thread_call_lck_grp_attr);
 
-#if defined(__i386__) || defined(__x86_64__)
-        lck_mtx_init(&thread_call_lock_data, &thread_call_lck_grp, &thread_call_lck_attr);
-#else
-        lck_spin_init(&thread_call_lock_data, &thread_call_lck_grp, &thread_call_lck_attr);
-#endif
+	lck_spin_init(&thread_call_daemon_lock_data, &thread_call_lck_grp, &thread_call_lck_attr);
 
 	nanotime_to_absolutetime(0, THREAD_CALL_DEALLOC_INTERVAL_NS, &thread_call_dealloc_interval_abs);
 	wait_queue_init(&daemon_wqueue, SYNC_POLICY_FIFO);
@@ -323,7 +350,8 @@ thread_call_initialize(void)
 	thread_call_group_setup(&thread_call_groups[THREAD_CALL_PRIORITY_KERNEL], THREAD_CALL_PRIORITY_KERNEL, 1, TRUE);
 	thread_call_group_setup(&thread_call_groups[THREAD_CALL_PRIORITY_HIGH], THREAD_CALL_PRIORITY_HIGH, THREAD_CALL_THREAD_MIN, FALSE);
 
-	disable_ints_and_lock();
+	group = &thread_call_groups[THREAD_CALL_PRIORITY_HIGH];
+	disable_ints_and_lock(group);
 
 	queue_init(&thread_call_internal_queue);
 	for (
@@ -336,7 +364,7 @@ thread_call_initialize(void)
 
 	thread_call_daemon_awake = TRUE;
 
-	enable_ints_and_unlock();
+	enable_ints_and_unlock(group);
 
 	result = kernel_thread_start_priority((thread_continue_t)thread_call_daemon, NULL, BASEPRI_PREEMPT + 1, &thread);
 	if (result != KERN_SUCCESS)
@@ -361,7 +389,7 @@ thread_call_setup(
  *
  *	Allocate an internal callout entry.
  *
- *	Called with thread_call_lock held.
+ *	Called with the high priority group lock held.
  */
 static __inline__ thread_call_t
 _internal_call_allocate(void)
@@ -382,7 +410,7 @@ _internal_call_allocate(void)
  *	Release an internal callout entry which
  *	is no longer pending (or delayed).
  *
- * 	Called with thread_call_lock held.
+ * 	Called with the high priority group lock held.
  */
 static __inline__ void
 _internal_call_release(
@@ -402,7 +430,7 @@ _internal_call_release(
  *	Returns TRUE if the entry was already
  *	on a queue.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static __inline__ boolean_t
 _pending_call_enqueue(
@@ -417,7 +445,12 @@ _pending_call_enqueue(
 		call->tc_submit_count++;
 	}
 
+	call->tc_enqueue_time = mach_absolute_time();
+
 	group->pending_count++;
+	group->stats.tcs_enqueued++;
+	if (group->pending_count > group->stats.tcs_pending_max)
+		group->stats.tcs_pending_max = group->pending_count;
 
 	thread_call_wake(group);
 
@@ -434,7 +467,7 @@ _pending_call_enqueue(
  *	Returns TRUE if the entry was already
  *	on a queue.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static __inline__ boolean_t
 _delayed_call_enqueue(
@@ -461,7 +494,7 @@ _delayed_call_enqueue(
  *
  *	Returns TRUE if the entry was on a queue.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static __inline__ boolean_t
 _call_dequeue(
@@ -487,7 +520,7 @@ _call_dequeue(
  *	Reset the timer so that it
  *	next expires when the entry is due.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static __inline__ void
 _set_delayed_call_timer(
@@ -506,7 +539,7 @@ _set_delayed_call_timer(
  *	Returns	TRUE if any matching entries
  *	were found.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static boolean_t
 _remove_from_pending_queue(
@@ -551,7 +584,7 @@ _remove_from_pending_queue(
  *	Returns	TRUE if any matching entries
  *	were found.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  */
 static boolean_t
 _remove_from_delayed_queue(
@@ -608,7 +641,7 @@ thread_call_func(
 	spl_t			s;
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	call = TC(queue_first(&group->pending_queue));
 
@@ -629,7 +662,7 @@ thread_call_func(
 		_pending_call_enqueue(call, group);
 	}
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 }
 
@@ -652,7 +685,7 @@ thread_call_func_delayed(
 	spl_t			s;
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	call = _internal_call_allocate();
 	call->tc_call.func	= func;
@@ -664,7 +697,7 @@ thread_call_func_delayed(
 	if (queue_first(&group->delayed_queue) == qe(call))
 		_set_delayed_call_timer(call, group);
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 }
 
@@ -686,11 +719,12 @@ thread_call_func_cancel(
 		thread_call_param_t		param,
 		boolean_t			cancel_all)
 {
-	boolean_t	result;
-	spl_t		s;
+	boolean_t		result;
+	thread_call_group_t	group = &thread_call_groups[THREAD_CALL_PRIORITY_HIGH];
+	spl_t			s;
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	if (cancel_all)
 		result = _remove_from_pending_queue(func, param, cancel_all) |
@@ -699,7 +733,7 @@ thread_call_func_cancel(
 		result = _remove_from_pending_queue(func, param, cancel_all) ||
 			_remove_from_delayed_queue(func, param, cancel_all);
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -759,14 +793,15 @@ boolean_t
 thread_call_free(
 		thread_call_t		call)
 {
-	spl_t	s;
-	int32_t refs;
+	thread_call_group_t	group = thread_call_get_group(call);
+	spl_t			s;
+	int32_t			refs;
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	if (call->tc_call.queue != NULL) {
-		thread_call_unlock();
+		thread_call_unlock(group);
 		splx(s);
 
 		return (FALSE);
@@ -777,7 +812,7 @@ thread_call_free(
 		panic("Refcount negative: %d\n", refs);
 	}	
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	if (refs == 0) {
@@ -806,7 +841,7 @@ thread_call_enter(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	if (call->tc_call.queue != &group->pending_queue) {
 		result = _pending_call_enqueue(call, group);
@@ -814,7 +849,7 @@ thread_call_enter(
 
 	call->tc_call.param1 = 0;
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -832,7 +867,7 @@ thread_call_enter1(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	if (call->tc_call.queue != &group->pending_queue) {
 		result = _pending_call_enqueue(call, group);
@@ -840,7 +875,7 @@ thread_call_enter1(
 
 	call->tc_call.param1 = param1;
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -867,7 +902,7 @@ thread_call_enter_delayed(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	result = _delayed_call_enqueue(call, group, deadline);
 
@@ -876,7 +911,7 @@ thread_call_enter_delayed(
 
 	call->tc_call.param1 = 0;
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -896,7 +931,7 @@ thread_call_enter1_delayed(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 	abstime =  mach_absolute_time();
 
 	result = _delayed_call_enqueue(call, group, deadline);
@@ -910,7 +945,7 @@ thread_call_enter1_delayed(
 #if CONFIG_DTRACE
 	DTRACE_TMR4(thread_callout__create, thread_call_func_t, call->tc_call.func, 0, (call->ttd >> 32), (unsigned) (call->ttd & 0xFFFFFFFF));
 #endif
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -935,11 +970,11 @@ thread_call_cancel(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	result = _call_dequeue(call, group);
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 #if CONFIG_DTRACE
 	DTRACE_TMR4(thread_callout__cancel, thread_call_func_t, call->tc_call.func, 0, (call->ttd >> 32), (unsigned) (call->ttd & 0xFFFFFFFF));
@@ -970,14 +1005,14 @@ thread_call_cancel_wait(
 	group = thread_call_get_group(call);
 
 	(void) splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	result = _call_dequeue(call, group);
 	if (result == FALSE) {
-		thread_call_wait_locked(call);
+		thread_call_wait_locked(call, group);
 	}
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	(void) spllo();
 
 	return result;
@@ -1006,7 +1041,7 @@ thread_call_is_delayed(
 	group = thread_call_get_group(call);
 
 	s = splsched();
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	if (call->tc_call.queue == &group->delayed_queue) {
 		if (deadline != NULL)
@@ -1014,7 +1049,7 @@ thread_call_is_delayed(
 		result = TRUE;
 	}
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 	splx(s);
 
 	return (result);
@@ -1030,7 +1065,7 @@ thread_call_is_delayed(
  *	the daemon thread in order to
  *	create additional call threads.
  *
- *	Called with thread_call_lock held.
+ *	Called with the group lock held.
  *
  *	For high-priority group, only does wakeup/creation if there are no threads
  *	running.
@@ -1051,11 +1086,18 @@ thread_call_wake(
 				timer_call_cancel(&group->dealloc_timer);
 				group->flags &= TCG_DEALLOC_ACTIVE;
 			}
-		} else {
-			if (!thread_call_daemon_awake && thread_call_group_should_add_thread(group)) {
+		} else if (thread_call_group_should_add_thread(group)) {
+			/*
+			 * If the daemon is already running it may have
+			 * passed this group; have it take another look.
+			 */
+			thread_call_daemon_lock();
+			if (!thread_call_daemon_awake) {
 				thread_call_daemon_awake = TRUE;
 				wait_queue_wakeup_one(&daemon_wqueue, NO_EVENT, THREAD_AWAKENED, -1);
-			}
+			} else
+				thread_call_daemon_rescan = TRUE;
+			thread_call_daemon_unlock();
 		}
 	}
 }
@@ -1075,7 +1117,7 @@ sched_call_thread(
 
 	group = &thread_call_groups[THREAD_CALL_PRIORITY_HIGH]; /* XXX */
 
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	switch (type) {
 
@@ -1090,7 +1132,7 @@ sched_call_thread(
 			break;
 	}
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 }
 
 /* 
@@ -1100,7 +1142,7 @@ sched_call_thread(
  * if the client has so requested.
  */
 static void
-thread_call_finish(thread_call_t call)
+thread_call_finish(thread_call_t call, thread_call_group_t group)
 {
 	boolean_t dowake = FALSE;
 
@@ -1113,12 +1155,12 @@ thread_call_finish(thread_call_t call)
 
 		/* 
 		 * Dropping lock here because the sched call for the 
-		 * high-pri group can take the big lock from under
+		 * high-pri group can take the group lock from under
 		 * a thread lock.
 		 */
-		thread_call_unlock();
+		thread_call_unlock(group);
 		thread_wakeup((event_t)call);
-		thread_call_lock_spin();
+		thread_call_lock_spin(group);
 	}
 
 	if (call->tc_refs == 0) {
@@ -1126,13 +1168,175 @@ thread_call_finish(thread_call_t call)
 			panic("Someone waiting on a thread call that is scheduled for free: %p\n", call->tc_call.func);
 		}
 
-		enable_ints_and_unlock();
+		enable_ints_and_unlock(group);
 
 		zfree(thread_call_zone, call);
 
-		(void)disable_ints_and_lock();
+		(void)disable_ints_and_lock(group);
+	}
+
+}
+
+/*
+ *	thread_call_run_one:
+ *
+ *	Dequeue the next pending call from the group and run it.
+ *	Calls are taken off the queue one at a time, right before
+ *	they run, so that whatever is still pending stays visible
+ *	to thread_call_group_should_add_thread() and cancellable,
+ *	and each call is finished (waking any waiters) as soon as
+ *	it returns.
+ *
+ *	Called with interrupts disabled and the group lock held;
+ *	returns the same way.
+ */
+static void
+thread_call_run_one(
+		thread_call_group_t		group,
+		boolean_t			stolen)
+{
+	thread_t			self = current_thread();
+	thread_call_t			call;
+	thread_call_func_t		func;
+	thread_call_param_t		param0, param1;
+	boolean_t			canwait;
+	uint64_t			now, latency;
+
+	call = TC(dequeue_head(&group->pending_queue));
+	group->pending_count--;
+
+	now = mach_absolute_time();
+	latency = (now > call->tc_enqueue_time) ? (now - call->tc_enqueue_time) : 0;
+	group->stats.tcs_latency_total += latency;
+	if (latency > group->stats.tcs_latency_max)
+		group->stats.tcs_latency_max = latency;
+
+	func = call->tc_call.func;
+	param0 = call->tc_call.param0;
+	param1 = call->tc_call.param1;
+
+	call->tc_call.queue = NULL;
+
+	_internal_call_release(call);
+
+	/*
+	 * Can only do wakeups for thread calls whose storage
+	 * we control.
+	 */
+	if ((call->tc_flags & THREAD_CALL_ALLOC) != 0) {
+		canwait = TRUE;
+		call->tc_refs++;	/* Delay free until we're done */
+	} else
+		canwait = FALSE;
+
+	group->stats.tcs_dispatched++;
+	if (stolen)
+		group->stats.tcs_stolen++;
+
+	enable_ints_and_unlock(group);
+
+	KERNEL_DEBUG_CONSTANT(
+			MACHDBG_CODE(DBG_MACH_SCHED,MACH_CALLOUT) | DBG_FUNC_NONE,
+			VM_KERNEL_UNSLIDE(func), param0, param1, 0, 0);
+
+	(*func)(param0, param1);
+
+	if (get_preemption_level() != 0) {
+		int pl = get_preemption_level();
+		panic("thread_call_thread: preemption_level %d, last callout %p(%p, %p)",
+				pl, (void *)VM_KERNEL_UNSLIDE(func), param0, param1);
 	}
 
+	(void)thread_funnel_set(self->funnel_lock, FALSE);		/* XXX */
+
+	(void) disable_ints_and_lock(group);
+
+	if (canwait) {
+		/* Frees if so desired */
+		thread_call_finish(call, group);
+	}
+}
+
+/*
+ *	thread_call_set_pri:
+ *
+ *	Give the calling worker the base priority of a group.
+ *
+ *	Called with interrupts disabled and no group lock held,
+ *	since the high-priority group's sched call takes its group
+ *	lock from under the thread lock.
+ */
+static void
+thread_call_set_pri(
+		thread_t			self,
+		integer_t			pri)
+{
+	thread_lock(self);
+	set_priority(self, pri);
+	thread_unlock(self);
+}
+
+/*
+ *	thread_call_steal:
+ *
+ *	Run a call from a less important parallel group which
+ *	has a backlog but no idle worker of its own, rather than
+ *	letting this worker go idle.  The high-priority group is
+ *	never a victim.  Returns TRUE if any work was done.
+ *
+ *	While it runs the stolen call the worker stands in for one
+ *	of the victim's: it is counted in the victim's active_count,
+ *	so the victim doesn't wake or create a thread for the work
+ *	it is doing, and it takes on the victim's sched call and
+ *	priority, so that blocking is accounted to the victim and
+ *	the call doesn't run any more urgently than it asked for.
+ *
+ *	Called with interrupts disabled and no group lock held.
+ */
+static boolean_t
+thread_call_steal(
+		thread_call_group_t		group)
+{
+	thread_t			self = current_thread();
+	thread_call_group_t		victim;
+	int				i;
+
+	for (i = (int)(group - thread_call_groups) + 1; i < THREAD_CALL_GROUP_COUNT; i++) {
+		victim = &thread_call_groups[i];
+
+		if (!group_isparallel(victim))
+			continue;
+
+		/* Unlocked peek; rechecked below */
+		if (victim->pending_count == 0 || victim->idle_count != 0)
+			continue;
+
+		thread_call_lock_spin(victim);
+
+		if (victim->pending_count == 0 || victim->idle_count != 0) {
+			thread_call_unlock(victim);
+			continue;
+		}
+
+		victim->active_count++;
+		thread_call_unlock(victim);
+
+		thread_sched_call(self, victim->sched_call);
+		thread_call_set_pri(self, victim->pri);
+
+		thread_call_lock_spin(victim);
+		if (victim->pending_count > 0)
+			thread_call_run_one(victim, TRUE);
+		victim->active_count--;
+		thread_call_unlock(victim);
+
+		thread_call_set_pri(self, group->pri);
+		thread_sched_call(self, group->sched_call);
+
+		return (TRUE);
+	}
+
+	return (FALSE);
 }
 
 /*
@@ -1144,7 +1348,6 @@ thread_call_thread(
 		wait_result_t			wres)
 {
 	thread_t	self = current_thread();
-	boolean_t	canwait;
 
 	if ((thread_get_tag_internal(self) & THREAD_TAG_CALLOUT) == 0)
 		(void)thread_set_tag_internal(self, THREAD_TAG_CALLOUT);
@@ -1160,58 +1363,25 @@ thread_call_thread(
 		panic("thread_terminate() returned?");
 	}
 
-	(void)disable_ints_and_lock();
+	(void)disable_ints_and_lock(group);
 
 	thread_sched_call(self, group->sched_call);
 
-	while (group->pending_count > 0) {
-		thread_call_t			call;
-		thread_call_func_t		func;
-		thread_call_param_t		param0, param1;
-
-		call = TC(dequeue_head(&group->pending_queue));
-		group->pending_count--;
-
-		func = call->tc_call.func;
-		param0 = call->tc_call.param0;
-		param1 = call->tc_call.param1;
-
-		call->tc_call.queue = NULL;
+	for (;;) {
+		while (group->pending_count > 0)
+			thread_call_run_one(group, FALSE);
 
-		_internal_call_release(call);
-
-		/*
-		 * Can only do wakeups for thread calls whose storage
-		 * we control.
-		 */
-		if ((call->tc_flags & THREAD_CALL_ALLOC) != 0) {
-			canwait = TRUE;
-			call->tc_refs++;	/* Delay free until we're done */
-		} else
-			canwait = FALSE;
-
-		enable_ints_and_unlock();
-
-		KERNEL_DEBUG_CONSTANT(
-				MACHDBG_CODE(DBG_MACH_SCHED,MACH_CALLOUT) | DBG_FUNC_NONE,
-				VM_KERNEL_UNSLIDE(func), param0, param1, 0, 0);
+		if (!group_isparallel(group))
+			break;
 
-		(*func)(param0, param1);
+		thread_call_unlock(group);
 
-		if (get_preemption_level() != 0) {
-			int pl = get_preemption_level();
-			panic("thread_call_thread: preemption_level %d, last callout %p(%p, %p)",
-					pl, (void *)VM_KERNEL_UNSLIDE(func), param0, param1);
+		if (!thread_call_steal(group)) {
+			thread_call_lock_spin(group);
+			break;
 		}
 
-		(void)thread_funnel_set(self->funnel_lock, FALSE);		/* XXX */
-
-		(void) disable_ints_and_lock();
-		
-		if (canwait) {
-			/* Frees if so desired */
-			thread_call_finish(call);
-		}
+		thread_call_lock_spin(group);
 	}
 
 	thread_sched_call(self, NULL);
@@ -1243,7 +1413,7 @@ thread_call_thread(
 			panic("kcall worker unable to assert wait?");
 		}   
 
-		enable_ints_and_unlock();
+		enable_ints_and_unlock(group);
 
 		thread_block_parameter((thread_continue_t)thread_call_thread, group);
 	} else {
@@ -1252,14 +1422,14 @@ thread_call_thread(
 
 			wait_queue_assert_wait(&group->idle_wqueue, NO_EVENT, THREAD_UNINT, 0); /* Interrupted means to exit */
 
-			enable_ints_and_unlock();
+			enable_ints_and_unlock(group);
 
 			thread_block_parameter((thread_continue_t)thread_call_thread, group);
 			/* NOTREACHED */
 		}
 	}
 
-	enable_ints_and_unlock();
+	enable_ints_and_unlock(group);
 
 	thread_terminate(self);
 	/* NOTREACHED */
@@ -1277,15 +1447,19 @@ thread_call_daemon_continue(__unused void *arg)
 	kern_return_t	kr;
 	thread_call_group_t group;
 
-	(void)disable_ints_and_lock();
+	(void) splsched();
 
+rescan:
 	/* Starting at zero happens to be high-priority first. */
 	for (i = 0; i < THREAD_CALL_GROUP_COUNT; i++) {
 		group = &thread_call_groups[i];
+
+		thread_call_lock_spin(group);
+
 		while (thread_call_group_should_add_thread(group)) {
 			group->active_count++;
 
-			enable_ints_and_unlock();
+			enable_ints_and_unlock(group);
 
 			kr = thread_call_thread_create(group);
 			if (kr != KERN_SUCCESS) {
@@ -1294,19 +1468,31 @@ thread_call_daemon_continue(__unused void *arg)
 				 * We can try again later.
 				 */
 				delay(10000); /* 10 ms */
-				(void)disable_ints_and_lock();
+				(void) splsched();
+				thread_call_daemon_lock();
+				thread_call_daemon_rescan = FALSE;
 				goto out;
 			}
 
-			(void)disable_ints_and_lock();
+			(void)disable_ints_and_lock(group);
 		}
+
+		thread_call_unlock(group);
+	}
+
+	thread_call_daemon_lock();
+	if (thread_call_daemon_rescan) {
+		thread_call_daemon_rescan = FALSE;
+		thread_call_daemon_unlock();
+		goto rescan;
 	}
 
 out:
 	thread_call_daemon_awake = FALSE;
 	wait_queue_assert_wait(&daemon_wqueue, NO_EVENT, THREAD_UNINT, 0);
 
-	enable_ints_and_unlock();
+	thread_call_daemon_unlock();
+	(void) spllo();
 
 	thread_block_parameter((thread_continue_t)thread_call_daemon_continue, NULL);
 	/* NOTREACHED */
@@ -1358,7 +1544,7 @@ thread_call_delayed_timer(
 	thread_call_group_t		group = p0;
 	uint64_t				timestamp;
 
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	timestamp = mach_absolute_time();
 
@@ -1377,7 +1563,7 @@ thread_call_delayed_timer(
 	if (!queue_end(&group->delayed_queue, qe(call)))
 		_set_delayed_call_timer(call, group);
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 }
 
 /*
@@ -1395,7 +1581,7 @@ thread_call_dealloc_timer(
 	kern_return_t res;
 	boolean_t terminated = FALSE;
 	
-	thread_call_lock_spin();
+	thread_call_lock_spin(group);
 
 	now = mach_absolute_time();
 	if (group->idle_count > 0) {
@@ -1428,7 +1614,7 @@ thread_call_dealloc_timer(
 		group->flags &= ~TCG_DEALLOC_ACTIVE;
 	}
 
-	thread_call_unlock();
+	thread_call_unlock(group);
 }
 
 /*
@@ -1438,7 +1624,7 @@ thread_call_dealloc_timer(
  * at the beginning of our wait.
  */
 static void
-thread_call_wait_locked(thread_call_t call)
+thread_call_wait_locked(thread_call_t call, thread_call_group_t group)
 {
 	uint64_t submit_count;
 	wait_result_t res;
@@ -1455,7 +1641,7 @@ thread_call_wait_locked(thread_call_t call)
 			panic("Unable to assert wait?");
 		}
 
-		thread_call_unlock();
+		thread_call_unlock(group);
 		(void) spllo();
 
 		res = thread_block(NULL);
@@ -1464,7 +1650,7 @@ thread_call_wait_locked(thread_call_t call)
 		}
 	
 		(void) splsched();
-		thread_call_lock_spin();
+		thread_call_lock_spin(group);
 	}
 }
 
@@ -1475,12 +1661,46 @@ thread_call_wait_locked(thread_call_t call)
 boolean_t
 thread_call_isactive(thread_call_t call) 
 {
+	thread_call_group_t group = thread_call_get_group(call);
 	boolean_t active;
 
-	disable_ints_and_lock();
+	disable_ints_and_lock(group);
 	active = (call->tc_submit_count > call->tc_finish_count);
-	enable_ints_and_unlock();
+	enable_ints_and_unlock(group);
 
 	return active;
 }
 
+/*
+ * Snapshot the per-group dispatch statistics for the
+ * kern.thread_call_stats sysctl.  Returns the number of
+ * entries filled in.
+ */
+int
+thread_call_get_stats(
+		struct thread_call_group_stats	*stats,
+		int				count)
+{
+	thread_call_group_t	group;
+	int			i;
+
+	if (count > THREAD_CALL_GROUP_COUNT)
+		count = THREAD_CALL_GROUP_COUNT;
+
+	for (i = 0; i < count; i++) {
+		group = &thread_call_groups[i];
+
+		disable_ints_and_lock(group);
+		stats[i] = group->stats;
+		stats[i].tcs_pending = group->pending_count;
+		stats[i].tcs_active = group->active_count;
+		stats[i].tcs_idle = group->idle_count;
+		enable_ints_and_unlock(group);
+
+		absolutetime_to_nanoseconds(stats[i].tcs_latency_total, &stats[i].tcs_latency_total);
+		absolutetime_to_nanoseconds(stats[i].tcs_latency_max, &stats[i].tcs_latency_max);
+	}
+
+	return (count);
+}
+
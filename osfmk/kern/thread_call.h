@@ -216,6 +216,37 @@ boolean_t		thread_call_isactive(
 						thread_call_t call);
 __END_DECLS
 
+#ifdef	XNU_KERNEL_PRIVATE
+
+/*
+ * Per-group dispatch statistics, in the order of thread_call_priority_t.
+ * Latencies are measured from the time a call becomes pending to the
+ * time a worker dequeues it, and are reported in nanoseconds.
+ */
+struct thread_call_group_stats {
+	uint64_t	tcs_enqueued;		/* calls made pending */
+	uint64_t	tcs_dispatched;		/* calls handed to a worker */
+	uint64_t	tcs_stolen;		/* calls run by another group's worker */
+	uint64_t	tcs_latency_total;
+	uint64_t	tcs_latency_max;
+	uint32_t	tcs_pending_max;
+	uint32_t	tcs_pending;		/* current snapshot */
+	uint32_t	tcs_active;
+	uint32_t	tcs_idle;
+};
+
+#define THREAD_CALL_GROUP_STATS_COUNT	4
+
+__BEGIN_DECLS
+
+extern int		thread_call_get_stats(
+					struct thread_call_group_stats	*stats,
+					int				count);
+
+__END_DECLS
+
+#endif	/* XNU_KERNEL_PRIVATE */
+
 #ifdef	MACH_KERNEL_PRIVATE
 
 #include <kern/call_entry.h>
@@ -230,6 +261,7 @@ struct thread_call {
 	int32_t				tc_refs;
 
 	uint64_t			ttd; /* Time to deadline at creation */
+	uint64_t			tc_enqueue_time; /* Last made pending */
 }; 
 
 #define THREAD_CALL_ALLOC		0x01
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Multi-threaded metadata benchmark for the buffer cache.
+ *
+ * For 1..N threads, each thread creates, stats and unlinks files in its
+ * own directory under the given path, which keeps the file system's
+ * metadata buffers (catalog, extents and journal blocks on HFS) moving
+ * through buf_getblk/buf_brelse.  Reports the aggregate operations per
+ * second, and the number of contended buffer cache shard lock
+ * acquisitions from kern.bufcache_shard_stats during the run.
+ *
+ * usage: bufcache_stress [-t max_threads] [-i iterations] [-d directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+#include <mach/mach_time.h>
+
+/* matches struct bufshard_stats in bsd/sys/buf_internal.h */
+struct bufshard_stats {
+	uint64_t	bss_acquired;
+	uint64_t	bss_contended;
+	uint64_t	bss_hold_total;
+	uint64_t	bss_hold_max;
+};
+#define MAX_SHARDS	64
+
+static int		iterations = 2000;
+static const char	*base_dir = ".";
+
+static void *
+worker(void *arg)
+{
+	char dir[1024], path[1100];
+	struct stat st;
+	int i, fd;
+
+	snprintf(dir, sizeof(dir), "%s/bufcache_stress.%d.%ld", base_dir, getpid(), (long)arg);
+	if (mkdir(dir, 0755) != 0) {
+		perror(dir);
+		exit(1);
+	}
+	for (i = 0; i < iterations; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+
+		if ((fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644)) < 0) {
+			perror(path);
+			exit(1);
+		}
+		fstat(fd, &st);
+		close(fd);
+		stat(path, &st);
+	}
+	for (i = 0; i < iterations; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+
+	return NULL;
+}
+
+static uint64_t
+contended(void)
+{
+	struct bufshard_stats stats[MAX_SHARDS];
+	size_t len = sizeof(stats);
+	uint64_t total = 0;
+	size_t i;
+
+	if (sysctlbyname("kern.bufcache_shard_stats", stats, &len, NULL, 0) != 0)
+		return 0;
+	for (i = 0; i < len / sizeof(stats[0]); i++)
+		total += stats[i].bss_contended;
+	return total;
+}
+
+static double
+run(int nthreads, uint64_t *ncontended)
+{
+	mach_timebase_info_data_t tb;
+	pthread_t threads[nthreads];
+	uint64_t start, elapsed_ns, c;
+	long i;
+
+	c = contended();
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	mach_timebase_info(&tb);
+	elapsed_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+	*ncontended = contended() - c;
+
+	/* create + fstat + stat + unlink per iteration */
+	return (double)nthreads * iterations * 4 * 1e9 / (double)elapsed_ns;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_threads = 0;
+	size_t len = sizeof(max_threads);
+	uint64_t ncontended;
+	double ops;
+	int ch, n;
+
+	sysctlbyname("hw.ncpu", &max_threads, &len, NULL, 0);
+
+	while ((ch = getopt(argc, argv, "t:i:d:")) != -1) {
+		switch (ch) {
+		case 't': max_threads = atoi(optarg); break;
+		case 'i': iterations = atoi(optarg); break;
+		case 'd': base_dir = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] [-i iterations] [-d directory]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	if (iterations < 1)
+		iterations = 1;
+
+	printf("%8s %16s %16s\n", "threads", "ops/s", "contended");
+	for (n = 1; n <= max_threads; n *= 2) {
+		ops = run(n, &ncontended);
+		printf("%8d %16.0f %16llu\n", n, ops, (unsigned long long)ncontended);
+	}
+	return 0;
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Correctness and speed harness for the Internet checksum kernels in
+ * bsd/netinet/cpu_in_cksum.c.
+ *
+ * os_cpu_in_cksum() and os_cpu_copy_in_cksum() are copied here verbatim
+ * from the kernel and checked against a byte-at-a-time RFC 1071 sum on
+ * random buffers of every length up to 4K and every source and
+ * destination alignment within a 64-bit word, with random initial sums;
+ * the mbuf walk is exercised by splitting each buffer at random points
+ * and combining the pieces the way cpu_in_cksum() does.  Then the
+ * 16-bit unrolled loop that inet_cksum() used before, the new summing
+ * kernel, bcopy() followed by a sum, and the fused copy and sum are
+ * timed on -n passes over buffers of each size from -s (default: a
+ * spread of packet sizes up to 64K).
+ *
+ * usage: cksum_bench [-n passes] [-s size]
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <mach/mach_time.h>
+
+typedef int boolean_t;
+#define	TRUE	1
+#define	FALSE	0
+#ifndef MIN
+#define	MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
+#define	MAXLEN	65536
+
+/* as in bsd/netinet/cpu_in_cksum.c */
+static __inline__ uint32_t
+in_cksum_fold64(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return ((uint32_t)sum);
+}
+
+static __inline__ uint32_t
+in_cksum_swap16(uint32_t sum)
+{
+	return (((sum & 0xff) << 8) | (sum >> 8));
+}
+
+static uint32_t
+os_cpu_in_cksum(const void *data, uint32_t len, uint32_t initial_sum)
+{
+	const uint8_t *p = data;
+	uint64_t partial = 0;
+	uint32_t sum;
+	boolean_t started_on_odd = FALSE;
+
+	if (((uintptr_t)p & 1) && len > 0) {
+		/* Align on word boundary */
+		started_on_odd = TRUE;
+#if BYTE_ORDER == LITTLE_ENDIAN
+		partial = *p << 8;
+#else
+		partial = *p;
+#endif
+		++p;
+		--len;
+	}
+	if (((uintptr_t)p & 2) && len >= 2) {
+		partial += *(const uint16_t *)(const void *)p;
+		p += 2;
+		len -= 2;
+	}
+	if (((uintptr_t)p & 4) && len >= 4) {
+		partial += *(const uint32_t *)(const void *)p;
+		p += 4;
+		len -= 4;
+	}
+#if defined(__x86_64__)
+	if (len >= 64) {
+		uint64_t acc = 0;
+
+		do {
+			__builtin_prefetch(p + 128);
+			__asm__ (
+			    "addq   0(%[p]), %[acc]\n\t"
+			    "adcq   8(%[p]), %[acc]\n\t"
+			    "adcq  16(%[p]), %[acc]\n\t"
+			    "adcq  24(%[p]), %[acc]\n\t"
+			    "adcq  32(%[p]), %[acc]\n\t"
+			    "adcq  40(%[p]), %[acc]\n\t"
+			    "adcq  48(%[p]), %[acc]\n\t"
+			    "adcq  56(%[p]), %[acc]\n\t"
+			    "adcq  $0, %[acc]"
+			    : [acc] "+r" (acc)
+			    : [p] "r" (p),
+			      "m" (*(const struct { uint8_t b[64]; } *)
+			      (const void *)p)
+			    : "cc");
+			p += 64;
+			len -= 64;
+		} while (len >= 64);
+		partial += (acc >> 32) + (acc & 0xffffffff);
+	}
+#else
+	if (len >= 64) {
+		uint64_t a = 0, b = 0;
+		const uint32_t *w;
+
+		do {
+			__builtin_prefetch(p + 64);
+			w = (const uint32_t *)(const void *)p;
+			a += w[0];  b += w[1];  a += w[2];  b += w[3];
+			a += w[4];  b += w[5];  a += w[6];  b += w[7];
+			a += w[8];  b += w[9];  a += w[10]; b += w[11];
+			a += w[12]; b += w[13]; a += w[14]; b += w[15];
+			p += 64;
+			len -= 64;
+		} while (len >= 64);
+		partial += a + b;
+	}
+#endif
+	/*
+	 * len is not updated below as the remaining tests
+	 * are using bit masks, which are not affected.
+	 */
+	if (len & 32) {
+		partial += *(const uint32_t *)(const void *)p;
+		partial += *(const uint32_t *)(const void *)(p + 4);
+		partial += *(const uint32_t *)(const void *)(p + 8);
+		partial += *(const uint32_t *)(const void *)(p + 12);
+		partial += *(const uint32_t *)(const void *)(p + 16);
+		partial += *(const uint32_t *)(const void *)(p + 20);
+		partial += *(const uint32_t *)(const void *)(p + 24);
+		partial += *(const uint32_t *)(const void *)(p + 28);
+		p += 32;
+	}
+	if (len & 16) {
+		partial += *(const uint32_t *)(const void *)p;
+		partial += *(const uint32_t *)(const void *)(p + 4);
+		partial += *(const uint32_t *)(const void *)(p + 8);
+		partial += *(const uint32_t *)(const void *)(p + 12);
+		p += 16;
+	}
+	if (len & 8) {
+		partial += *(const uint32_t *)(const void *)p;
+		partial += *(const uint32_t *)(const void *)(p + 4);
+		p += 8;
+	}
+	if (len & 4) {
+		partial += *(const uint32_t *)(const void *)p;
+		p += 4;
+	}
+	if (len & 2) {
+		partial += *(const uint16_t *)(const void *)p;
+		p += 2;
+	}
+	if (len & 1) {
+#if BYTE_ORDER == LITTLE_ENDIAN
+		partial += *p;
+#else
+		partial += *p << 8;
+#endif
+	}
+
+	sum = in_cksum_fold64(partial);
+	if (started_on_odd)
+		sum = in_cksum_swap16(sum);
+	return (in_cksum_fold64((uint64_t)sum + initial_sum));
+}
+
+static uint32_t
+os_cpu_copy_in_cksum(const void *src, void *dst, uint32_t len,
+    uint32_t initial_sum)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	uint64_t partial = 0;
+	uint32_t n, sum;
+
+#if defined(__x86_64__)
+	if (len >= 64) {
+		uint64_t acc = 0, t0, t1, t2, t3;
+
+		do {
+			__builtin_prefetch(s + 128);
+			__asm__ (
+			    "movq    0(%[s]), %[t0]\n\t"
+			    "movq    8(%[s]), %[t1]\n\t"
+			    "movq   16(%[s]), %[t2]\n\t"
+			    "movq   24(%[s]), %[t3]\n\t"
+			    "movq   %[t0],  0(%[d])\n\t"
+			    "movq   %[t1],  8(%[d])\n\t"
+			    "movq   %[t2], 16(%[d])\n\t"
+			    "movq   %[t3], 24(%[d])\n\t"
+			    "addq   %[t0], %[acc]\n\t"
+			    "adcq   %[t1], %[acc]\n\t"
+			    "adcq   %[t2], %[acc]\n\t"
+			    "adcq   %[t3], %[acc]\n\t"
+			    "movq   32(%[s]), %[t0]\n\t"
+			    "movq   40(%[s]), %[t1]\n\t"
+			    "movq   48(%[s]), %[t2]\n\t"
+			    "movq   56(%[s]), %[t3]\n\t"
+			    "movq   %[t0], 32(%[d])\n\t"
+			    "movq   %[t1], 40(%[d])\n\t"
+			    "movq   %[t2], 48(%[d])\n\t"
+			    "movq   %[t3], 56(%[d])\n\t"
+			    "adcq   %[t0], %[acc]\n\t"
+			    "adcq   %[t1], %[acc]\n\t"
+			    "adcq   %[t2], %[acc]\n\t"
+			    "adcq   %[t3], %[acc]\n\t"
+			    "adcq   $0, %[acc]"
+			    : [acc] "+r" (acc), [t0] "=&r" (t0), [t1] "=&r" (t1),
+			      [t2] "=&r" (t2), [t3] "=&r" (t3),
+			      "=m" (*(struct { uint8_t b[64]; } *)(void *)d)
+			    : [s] "r" (s), [d] "r" (d),
+			      "m" (*(const struct { uint8_t b[64]; } *)
+			      (const void *)s)
+			    : "cc");
+			s += 64;
+			d += 64;
+			len -= 64;
+		} while (len >= 64);
+		partial = (acc >> 32) + (acc & 0xffffffff);
+	}
+#else
+	if ((((uintptr_t)s | (uintptr_t)d) & 3) == 0 && len >= 32) {
+		const uint32_t *ws = (const uint32_t *)(const void *)s;
+		uint32_t *wd = (uint32_t *)(void *)d;
+		uint32_t w0, w1, w2, w3, w4, w5, w6, w7;
+		uint64_t a = 0, b = 0;
+
+		do {
+			__builtin_prefetch(ws + 16);
+			w0 = ws[0]; w1 = ws[1]; w2 = ws[2]; w3 = ws[3];
+			w4 = ws[4]; w5 = ws[5]; w6 = ws[6]; w7 = ws[7];
+			wd[0] = w0; wd[1] = w1; wd[2] = w2; wd[3] = w3;
+			wd[4] = w4; wd[5] = w5; wd[6] = w6; wd[7] = w7;
+			a += w0; b += w1; a += w2; b += w3;
+			a += w4; b += w5; a += w6; b += w7;
+			ws += 8;
+			wd += 8;
+			len -= 32;
+		} while (len >= 32);
+		partial = a + b;
+		s = (const uint8_t *)ws;
+		d = (uint8_t *)wd;
+	}
+#endif
+	/* every block below starts an even number of bytes in */
+	while (len > 0) {
+		n = MIN(len, 256);
+		bcopy(s, d, n);
+		partial += os_cpu_in_cksum(d, n, 0);
+		s += n;
+		d += n;
+		len -= n;
+	}
+
+	sum = in_cksum_fold64(partial);
+	return (in_cksum_fold64((uint64_t)sum + initial_sum));
+}
+
+/* RFC 1071, a byte at a time, in network order */
+static uint32_t
+ref_cksum(const uint8_t *p, uint32_t len, uint32_t sum)
+{
+	uint32_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	if (len & 1)
+		sum += p[i] << 8;
+	while (sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
+}
+
+/* the 16-bit unrolled loop inet_cksum() used, for a flat buffer */
+static uint32_t
+old_cksum(const void *data, int mlen)
+{
+	const uint16_t *w = data;
+	uint32_t sum = 0;
+
+	while ((mlen -= 32) >= 0) {
+		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+		sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
+		sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
+		sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+		w += 16;
+	}
+	mlen += 32;
+	while ((mlen -= 8) >= 0) {
+		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+		w += 4;
+	}
+	mlen += 8;
+	while ((mlen -= 2) >= 0)
+		sum += *w++;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
+}
+
+/* host order sum to network order, with 0xffff and 0 made equal */
+static uint32_t
+canon(uint32_t sum, boolean_t host)
+{
+	if (host)
+		sum = ntohs((uint16_t)sum);
+	return (sum == 0xffff ? 0 : sum);
+}
+
+static uint64_t
+now_ns(void)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+	return (mach_absolute_time() * tb.numer / tb.denom);
+}
+
+static void
+fail(const char *what, uint32_t len, int soff, int doff, uint32_t got,
+    uint32_t want)
+{
+	fprintf(stderr, "%s: len %u src+%d dst+%d: got %04x want %04x\n",
+	    what, len, soff, doff, got, want);
+	exit(1);
+}
+
+static void
+verify(uint8_t *src, uint8_t *dst)
+{
+	uint32_t len, init, want, got, cut, sum, off;
+	boolean_t odd;
+	int soff, doff, i;
+
+	for (i = 0; i < MAXLEN; i++)
+		src[i] = random();
+	for (len = 0; len <= 4096; len++) {
+		for (soff = 0; soff < 8; soff++) {
+			init = random() & 0xffff;
+			want = canon(ref_cksum(src + soff, len, init), FALSE);
+
+			got = os_cpu_in_cksum(src + soff, len,
+			    htons((uint16_t)init));
+			if (canon(got, TRUE) != want)
+				fail("os_cpu_in_cksum", len, soff, 0, got,
+				    want);
+
+			doff = random() & 7;
+			memset(dst, 0x5a, len + 16);
+			got = os_cpu_copy_in_cksum(src + soff, dst + doff, len,
+			    htons((uint16_t)init));
+			if (canon(got, TRUE) != want)
+				fail("os_cpu_copy_in_cksum", len, soff, doff,
+				    got, want);
+			if (memcmp(src + soff, dst + doff, len) != 0 ||
+			    (doff > 0 && dst[doff - 1] != 0x5a) ||
+			    dst[doff + len] != 0x5a)
+				fail("os_cpu_copy_in_cksum copy", len, soff,
+				    doff, 0, 0);
+
+			/* split into spans as cpu_in_cksum() walks mbufs */
+			sum = htons((uint16_t)init);
+			odd = FALSE;
+			for (off = 0; off < len; off += cut) {
+				cut = 1 + random() % (len - off);
+				got = os_cpu_in_cksum(src + soff + off, cut, 0);
+				if (odd)
+					got = in_cksum_swap16(got);
+				sum += got;
+				if (cut & 1)
+					odd = !odd;
+			}
+			sum = in_cksum_fold64(sum);
+			if (canon(sum, TRUE) != want)
+				fail("mbuf walk", len, soff, 0, sum, want);
+		}
+	}
+	/* long buffers, to catch overflow in the accumulators */
+	for (soff = 0; soff < 8; soff++) {
+		len = MAXLEN - soff - 8;
+		for (i = 0; i < MAXLEN; i++)
+			src[i] = (i & 1) ? 0xff : random();
+		want = canon(ref_cksum(src + soff, len, 0), FALSE);
+		got = os_cpu_in_cksum(src + soff, len, 0);
+		if (canon(got, TRUE) != want)
+			fail("os_cpu_in_cksum", len, soff, 0, got, want);
+		got = os_cpu_copy_in_cksum(src + soff, dst + soff, len, 0);
+		if (canon(got, TRUE) != want)
+			fail("os_cpu_copy_in_cksum", len, soff, soff, got,
+			    want);
+	}
+	printf("all kernels agree with RFC 1071 on lengths 0-4096, "
+	    "all alignments\n");
+}
+
+static void
+bench(uint8_t *src, uint8_t *dst, uint32_t size, uint32_t passes)
+{
+	uint64_t t0, t1, t2, t3, t4;
+	uint32_t i, n, nbuf, x = 0;
+
+	/* keep the working set the same for every size */
+	nbuf = MAXLEN / size;
+	n = passes * nbuf;
+#define	OFF(i)	(((i) % nbuf) * size)
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		x += old_cksum(src + OFF(i), size);
+	t1 = now_ns();
+	for (i = 0; i < n; i++)
+		x += os_cpu_in_cksum(src + OFF(i), size, 0);
+	t2 = now_ns();
+	for (i = 0; i < n; i++) {
+		bcopy(src + OFF(i), dst + OFF(i),
+		    size);
+		x += os_cpu_in_cksum(dst + OFF(i), size, 0);
+	}
+	t3 = now_ns();
+	for (i = 0; i < n; i++)
+		x += os_cpu_copy_in_cksum(src + OFF(i),
+		    dst + OFF(i), size, 0);
+	t4 = now_ns();
+
+#define	GBPS(t)	((double)n * size / (t))
+	printf("%6u  %8.2f  %8.2f  %8.2f  %8.2f  [%x]\n", size,
+	    GBPS(t1 - t0), GBPS(t2 - t1), GBPS(t3 - t2), GBPS(t4 - t3),
+	    x & 0xf);
+#undef GBPS
+#undef OFF
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const uint32_t sizes[] =
+	    { 20, 64, 256, 576, 1448, 1500, 4096, 9000, 16384, 65536 };
+	uint32_t passes = 2000, size = 0, i;
+	uint8_t *src, *dst;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: cksum_bench [-n passes] "
+			    "[-s size]\n");
+			return (1);
+		}
+	}
+	if (size > MAXLEN || (size & 1)) {
+		fprintf(stderr, "size must be even and at most %d\n", MAXLEN);
+		return (1);
+	}
+	/* room for the worst alignment and guard bytes past the end */
+	if ((src = malloc(MAXLEN + 64)) == NULL ||
+	    (dst = malloc(MAXLEN + 64)) == NULL)
+		abort();
+	srandom(1);
+	verify(src, dst);
+
+	printf("  size  GB/s: old sum  new sum  copy+sum    fused\n");
+	if (size != 0) {
+		bench(src, dst, size, passes);
+	} else {
+		for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+			bench(src, dst, sizes[i], passes);
+	}
+	return (0);
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Read throughput benchmark for decmpfs zlib ("Type4") compressed files.
+ *
+ * Builds a compressed file of -s megabytes on an HFS+ volume the same way
+ * the userspace compression tools do: the data is deflated in 64k chunks
+ * into the resource fork, the com.apple.decmpfs xattr is set and the file
+ * is marked UF_COMPRESSED.  Then, once for each worker thread count given
+ * with -t (set through vfs.generic.decmpfs.zlib_threads; 0 inflates inline),
+ * it purges the buffer cache and times a sequential read(2) of the whole
+ * file in -b kilobyte requests and a page-by-page walk of an mmap of it,
+ * which exercises the page-in path.  Chunk cache and read-ahead counters
+ * come from vfs.generic.decmpfs.zlib_stats.
+ *
+ * Run as root so the sysctls can be set and purge(8) can be run.
+ *
+ * usage: decmpfs_bench [-s megabytes] [-b kilobytes] [-p prefetch] [-t threads,threads,...] file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <sys/sysctl.h>
+#include <libkern/OSByteOrder.h>
+
+#include <mach/mach_time.h>
+
+/* matches struct decmpfs_zstats in bsd/kern/decmpfs.c */
+struct decmpfs_zstats {
+	int64_t		hits;
+	int64_t		misses;
+	int64_t		prefetched;
+	int64_t		prefetch_hits;
+	int64_t		parallel;
+	int64_t		waits;
+	int64_t		inflated_bytes;
+	int64_t		errors;
+};
+
+/* matches decmpfs_disk_header in bsd/sys/decmpfs.h */
+struct disk_header {
+	uint32_t	compression_magic;
+	uint32_t	compression_type;
+	uint64_t	uncompressed_size;
+} __attribute__((packed));
+
+#define CHUNK_SIZE	(64 * 1024)
+#define RSRC_DATA	0x100		/* offset of the resource data in the fork */
+#define DECMPFS_MAGIC	0x636d7066	/* cmpf */
+#define CMP_Type4	4
+
+static const char	*path;
+static volatile char	sink;
+
+static void
+fill(unsigned char *buf, size_t len, uint32_t seed)
+{
+	static const char words[] = "the quick brown fox jumps over the lazy dog 0123456789 ";
+	size_t i;
+
+	/* mostly text, with a sprinkling of noise so it doesn't compress too well */
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (seed >> 16) % 11 == 0 ? (unsigned char)(seed >> 8) : words[(i + (seed >> 24) % 3) % (sizeof(words) - 1)];
+	}
+}
+
+static void
+make_file(size_t size)
+{
+	unsigned char *chunk, *rsrc;
+	uint32_t nchunks, *table, i;
+	size_t rsrc_len, pos, cap;
+	struct disk_header hdr;
+	int fd;
+
+	nchunks = (uint32_t)((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	cap = RSRC_DATA + 8 + nchunks * 8 + nchunks * (size_t)compressBound(CHUNK_SIZE);
+	if ((rsrc = calloc(1, cap)) == NULL || (chunk = malloc(CHUNK_SIZE)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* resource fork header, then the resource length and the chunk table */
+	*(uint32_t *)rsrc = OSSwapHostToBigInt32(RSRC_DATA);
+	table = (uint32_t *)(rsrc + RSRC_DATA + 4);
+	table[0] = OSSwapHostToLittleInt32(nchunks);
+	pos = 4 + nchunks * 8;
+	for (i = 0; i < nchunks; i++) {
+		size_t len = size - (size_t)i * CHUNK_SIZE;
+		uLongf clen = compressBound(CHUNK_SIZE);
+
+		if (len > CHUNK_SIZE)
+			len = CHUNK_SIZE;
+		fill(chunk, len, i);
+		if (compress2(rsrc + RSRC_DATA + 4 + pos, &clen, chunk, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "compress2 failed\n");
+			exit(1);
+		}
+		table[1 + 2 * i] = OSSwapHostToLittleInt32((uint32_t)pos);
+		table[2 + 2 * i] = OSSwapHostToLittleInt32((uint32_t)clen);
+		pos += clen;
+	}
+	*(uint32_t *)(rsrc + RSRC_DATA) = OSSwapHostToBigInt32((uint32_t)pos);
+	rsrc_len = RSRC_DATA + 4 + pos;
+
+	unlink(path);
+	if ((fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	for (pos = 0; pos < rsrc_len; pos += 1024 * 1024) {
+		size_t len = rsrc_len - pos > 1024 * 1024 ? 1024 * 1024 : rsrc_len - pos;
+		if (fsetxattr(fd, XATTR_RESOURCEFORK_NAME, rsrc + pos, len, (uint32_t)pos, 0) != 0) {
+			perror(XATTR_RESOURCEFORK_NAME);
+			exit(1);
+		}
+	}
+	hdr.compression_magic = OSSwapHostToLittleInt32(DECMPFS_MAGIC);
+	hdr.compression_type = OSSwapHostToLittleInt32(CMP_Type4);
+	hdr.uncompressed_size = OSSwapHostToLittleInt64(size);
+	if (fsetxattr(fd, "com.apple.decmpfs", &hdr, sizeof(hdr), 0, 0) != 0) {
+		perror("com.apple.decmpfs");
+		exit(1);
+	}
+	if (fchflags(fd, UF_COMPRESSED) != 0) {
+		perror("fchflags");
+		exit(1);
+	}
+	close(fd);
+	free(chunk);
+	free(rsrc);
+	printf("%s: %zu bytes in %u chunks, %zu compressed\n", path, size, nchunks, rsrc_len);
+}
+
+static void
+get_stats(struct decmpfs_zstats *stats)
+{
+	size_t len = sizeof(*stats);
+
+	memset(stats, 0, sizeof(*stats));
+	sysctlbyname("vfs.generic.decmpfs.zlib_stats", stats, &len, NULL, 0);
+}
+
+static uint64_t
+elapsed_ns(uint64_t start)
+{
+	mach_timebase_info_data_t tb;
+
+	mach_timebase_info(&tb);
+	return (mach_absolute_time() - start) * tb.numer / tb.denom;
+}
+
+/* Returns the bytes read, and the elapsed time in *ns. */
+static size_t
+read_file(size_t bsize, uint64_t *ns)
+{
+	char *buf;
+	size_t total = 0;
+	ssize_t n;
+	uint64_t start;
+	int fd;
+
+	if ((buf = malloc(bsize)) == NULL || (fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	start = mach_absolute_time();
+	while ((n = read(fd, buf, bsize)) > 0)
+		total += n;
+	*ns = elapsed_ns(start);
+	if (n < 0)
+		perror("read");
+	close(fd);
+	free(buf);
+	return total;
+}
+
+/* Touches every page of a mapping of the file, returning its size and the elapsed time in *ns. */
+static size_t
+map_file(uint64_t *ns)
+{
+	volatile const char *p;
+	struct stat st;
+	size_t off, pgsz = (size_t)getpagesize();
+	uint64_t start;
+	char sum = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(1);
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	start = mach_absolute_time();
+	for (off = 0; off < (size_t)st.st_size; off += pgsz)
+		sum += p[off];
+	*ns = elapsed_ns(start);
+	sink = sum;
+	munmap((void *)(uintptr_t)p, (size_t)st.st_size);
+	close(fd);
+	return (size_t)st.st_size;
+}
+
+static void
+report(const char *how, uint32_t threads, size_t bytes, uint64_t ns, struct decmpfs_zstats *before, struct decmpfs_zstats *after)
+{
+	double secs = (double)ns / 1e9;
+
+	printf("%-5s %7u %10.3f %10.1f %8lld %8lld %8lld %8lld %8lld\n", how, threads, secs,
+	    (double)bytes / (1024.0 * 1024.0) / secs,
+	    (long long)(after->hits - before->hits),
+	    (long long)(after->misses - before->misses),
+	    (long long)(after->prefetch_hits - before->prefetch_hits),
+	    (long long)(after->parallel - before->parallel),
+	    (long long)(after->waits - before->waits));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct decmpfs_zstats before, after;
+	char *threads_list = strdup("0,1,2,4,8");
+	char *p;
+	size_t size = 0, bsize = 1024 * 1024, bytes;
+	uint32_t threads, prefetch;
+	uint64_t ns;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:p:s:t:")) != -1) {
+		switch (ch) {
+		case 'b': bsize = (size_t)atoi(optarg) * 1024; break;
+		case 'p':
+			prefetch = (uint32_t)atoi(optarg);
+			if (sysctlbyname("vfs.generic.decmpfs.zlib_prefetch", NULL, NULL, &prefetch, sizeof(prefetch)) != 0) {
+				perror("vfs.generic.decmpfs.zlib_prefetch");
+				return 1;
+			}
+			break;
+		case 's': size = (size_t)atoi(optarg) * 1024 * 1024; break;
+		case 't': threads_list = strdup(optarg); break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || bsize == 0)
+		goto usage;
+	path = argv[optind];
+
+	if (size > 0)
+		make_file(size);
+
+	printf("%-5s %7s %10s %10s %8s %8s %8s %8s %8s\n", "path", "threads", "secs", "MB/s", "hits", "misses", "ra hits", "parallel", "waits");
+	for (p = strtok(threads_list, ","); p != NULL; p = strtok(NULL, ",")) {
+		threads = (uint32_t)atoi(p);
+		if (sysctlbyname("vfs.generic.decmpfs.zlib_threads", NULL, NULL, &threads, sizeof(threads)) != 0) {
+			perror("vfs.generic.decmpfs.zlib_threads");
+			return 1;
+		}
+
+		system("/usr/sbin/purge");
+		get_stats(&before);
+		bytes = read_file(bsize, &ns);
+		get_stats(&after);
+		report("read", threads, bytes, ns, &before, &after);
+
+		system("/usr/sbin/purge");
+		get_stats(&before);
+		bytes = map_file(&ns);
+		get_stats(&after);
+		report("mmap", threads, bytes, ns, &before, &after);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-s megabytes] [-b kilobytes] [-p prefetch] [-t threads,threads,...] file\n", argv[0]);
+	return 1;
+}
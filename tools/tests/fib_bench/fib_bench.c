@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Lookup benchmark for the DIR-16-8-8 IPv4 forwarding table in
+ * bsd/net/route_fib.c.
+ *
+ * Loads a full BGP table, one "a.b.c.d/len" prefix per line (e.g. the
+ * output of "bgpdump -M" cut down to its prefix column), or, without -f,
+ * generates -r prefixes with the length distribution of the global table.
+ * The prefixes go into a one-bit-per-level binary trie, which chases a
+ * pointer per bit like the radix tree does, and into a copy of the
+ * kernel's multibit trie built with the same incremental insertion code.
+ * Both are checked to agree on every lookup, then -n random destinations
+ * are looked up in each and the rate is reported.  Finally every prefix
+ * is deleted again, in random order, checking the trie stays consistent.
+ *
+ * usage: fib_bench [-n lookups] [-r routes] [-f prefix-file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <mach/mach_time.h>
+
+/* as in bsd/net/route_fib.c */
+#define	RTFIB_L0_BITS	16
+#define	RTFIB_L0_SIZE	(1 << RTFIB_L0_BITS)
+#define	RTFIB_LN_BITS	8
+#define	RTFIB_LN_SIZE	(1 << RTFIB_LN_BITS)
+#define	RTFIB_CHILD	0x80000000U
+#define	RTFIB_MASK(l)	((l) == 0 ? 0 : (0xffffffffU << (32 - (l))))
+
+struct route {
+	uint32_t	prefix;
+	uint8_t		plen;
+};
+
+static struct route *routes;	/* index 0 is "no route" */
+static uint8_t *deleted;
+static uint32_t nroutes;
+
+static uint32_t *l0;
+static uint32_t **tbl;
+static uint32_t ntbl, tblcap;
+static uint32_t *tblfree;
+static uint32_t ntblfree;
+
+struct bnode {
+	struct bnode	*child[2];
+	uint32_t	 route;
+};
+static struct bnode *broot;
+
+static uint64_t
+now_ns(void)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+	return (mach_absolute_time() * tb.numer / tb.denom);
+}
+
+static uint32_t
+xrand(void)
+{
+	return (((uint32_t)random() << 16) ^ (uint32_t)random());
+}
+
+static void
+btrie_set(uint32_t prefix, uint8_t plen, uint32_t idx)
+{
+	struct bnode **np = &broot;
+	int i;
+
+	for (i = 0; ; i++) {
+		if (*np == NULL && (*np = calloc(1, sizeof (**np))) == NULL)
+			abort();
+		if (i == plen)
+			break;
+		np = &(*np)->child[(prefix >> (31 - i)) & 1];
+	}
+	(*np)->route = idx;
+}
+
+static uint32_t
+btrie_match(uint32_t a)
+{
+	struct bnode *n = broot;
+	uint32_t best = 0;
+	int i = 0;
+
+	while (n != NULL) {
+		if (n->route != 0)
+			best = n->route;
+		n = n->child[(a >> (31 - i++)) & 1];
+	}
+	return (best);
+}
+
+static uint32_t
+tbl_alloc(uint32_t leaf)
+{
+	uint32_t i, t;
+
+	if (ntblfree > 0) {
+		t = tblfree[--ntblfree];
+	} else {
+		if (ntbl == tblcap) {
+			tblcap = tblcap ? tblcap * 2 : 1024;
+			tbl = realloc(tbl, tblcap * sizeof (*tbl));
+			tblfree = realloc(tblfree, tblcap * sizeof (*tblfree));
+			if (tbl == NULL || tblfree == NULL)
+				abort();
+			if (ntbl == 0)
+				ntbl = 1;
+		}
+		t = ntbl++;
+	}
+	if ((tbl[t] = malloc(RTFIB_LN_SIZE * sizeof (uint32_t))) == NULL)
+		abort();
+	for (i = 0; i < RTFIB_LN_SIZE; i++)
+		tbl[t][i] = leaf;
+	return (t);
+}
+
+static void
+tbl_collapse(uint32_t *ent)
+{
+	uint32_t i, t = *ent & ~RTFIB_CHILD, *e = tbl[t];
+
+	for (i = 0; i < RTFIB_LN_SIZE; i++)
+		if ((e[i] & RTFIB_CHILD) || e[i] != e[0])
+			return;
+	*ent = e[0];
+	free(e);
+	tblfree[ntblfree++] = t;
+}
+
+static void
+fill(uint32_t *e, uint32_t n, uint8_t plen, uint32_t idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (e[i] & RTFIB_CHILD)
+			fill(tbl[e[i] & ~RTFIB_CHILD], RTFIB_LN_SIZE, plen, idx);
+		else if (e[i] == 0 || routes[e[i]].plen <= plen)
+			e[i] = idx;
+	}
+}
+
+static void
+replace(uint32_t *e, uint32_t n, uint32_t old, uint32_t new)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (e[i] & RTFIB_CHILD) {
+			replace(tbl[e[i] & ~RTFIB_CHILD], RTFIB_LN_SIZE,
+			    old, new);
+			tbl_collapse(&e[i]);
+		} else if (e[i] == old) {
+			e[i] = new;
+		}
+	}
+}
+
+static void
+update(uint32_t prefix, uint8_t plen, uint32_t old, uint32_t new)
+{
+	uint32_t *e = l0, *path[2], n, start;
+	int level, shift = 32 - RTFIB_L0_BITS, bits = RTFIB_L0_BITS;
+
+	for (level = 0; ; level++) {
+		if (plen <= 32 - shift) {
+			n = 1U << (32 - shift - plen);
+			start = ((prefix >> shift) & ((1U << bits) - 1)) &
+			    ~(n - 1);
+			if (old == 0)
+				fill(e + start, n, plen, new);
+			else
+				replace(e + start, n, old, new);
+			break;
+		}
+		path[level] = &e[(prefix >> shift) & ((1U << bits) - 1)];
+		if (!(*path[level] & RTFIB_CHILD)) {
+			if (old != 0)
+				return;
+			*path[level] = RTFIB_CHILD | tbl_alloc(*path[level]);
+		}
+		e = tbl[*path[level] & ~RTFIB_CHILD];
+		bits = RTFIB_LN_BITS;
+		shift -= RTFIB_LN_BITS;
+	}
+	if (old != 0)
+		while (level-- > 0)
+			tbl_collapse(path[level]);
+}
+
+static inline uint32_t
+fib_match(uint32_t a)
+{
+	uint32_t e = l0[a >> (32 - RTFIB_L0_BITS)];
+
+	if (e & RTFIB_CHILD) {
+		e = tbl[e & ~RTFIB_CHILD][(a >> RTFIB_LN_BITS) &
+		    (RTFIB_LN_SIZE - 1)];
+		if (e & RTFIB_CHILD)
+			e = tbl[e & ~RTFIB_CHILD][a & (RTFIB_LN_SIZE - 1)];
+	}
+	return (e);
+}
+
+static int
+route_cmp(const void *a, const void *b)
+{
+	const struct route *x = a, *y = b;
+
+	if (x->prefix != y->prefix)
+		return (x->prefix < y->prefix ? -1 : 1);
+	return ((int)x->plen - (int)y->plen);
+}
+
+/* rough shape of the global IPv4 table */
+static uint8_t
+random_plen(void)
+{
+	uint32_t r = random() % 1000;
+
+	if (r < 580)
+		return (24);
+	if (r < 700)
+		return (22 + (r & 1));
+	if (r < 900)
+		return (16 + r % 6);
+	return (8 + r % 8);
+}
+
+static void
+load_routes(const char *file, uint32_t want)
+{
+	char line[256], *slash;
+	struct in_addr in;
+	uint32_t i, j, cap = want + 1;
+	FILE *f = NULL;
+	int plen;
+
+	if (file != NULL && (f = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	routes = calloc(cap, sizeof (*routes));
+	nroutes = 1;
+	while (routes != NULL) {
+		if (f != NULL) {
+			if (fgets(line, sizeof (line), f) == NULL)
+				break;
+			if ((slash = strchr(line, '/')) == NULL)
+				continue;
+			*slash = '\0';
+			plen = atoi(slash + 1);
+			if (inet_aton(line, &in) == 0 || plen < 0 || plen > 32)
+				continue;
+			in.s_addr = ntohl(in.s_addr);
+		} else {
+			if (nroutes > want)
+				break;
+			plen = random_plen();
+			in.s_addr = xrand();
+		}
+		if (nroutes == cap)
+			routes = realloc(routes, (cap *= 2) * sizeof (*routes));
+		routes[nroutes].plen = plen;
+		routes[nroutes].prefix = in.s_addr & RTFIB_MASK(plen);
+		nroutes++;
+	}
+	if (f != NULL)
+		fclose(f);
+	if (routes == NULL)
+		abort();
+	/* drop duplicates */
+	qsort(routes + 1, nroutes - 1, sizeof (*routes), route_cmp);
+	for (i = j = 1; i < nroutes; i++)
+		if (j == 1 || route_cmp(&routes[i], &routes[j - 1]) != 0)
+			routes[j++] = routes[i];
+	nroutes = j;
+}
+
+static void
+verify(const char *when, uint32_t n)
+{
+	uint32_t i, a, x, y;
+
+	for (i = 0; i < n; i++) {
+		a = (i < nroutes) ? routes[i].prefix : xrand();
+		x = fib_match(a);
+		y = btrie_match(a);
+		/* both give the longest match; compare by prefix */
+		if ((x == 0) != (y == 0) || (x != 0 &&
+		    route_cmp(&routes[x], &routes[y]) != 0)) {
+			fprintf(stderr, "%s: mismatch for %08x: %u vs %u\n",
+			    when, a, x, y);
+			exit(1);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t nlookups = 10000000, want = 900000, i, j, t, *addrs, *order;
+	const char *file = NULL;
+	uint64_t t0, t1, t2, sum = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:f:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nlookups = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			want = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: fib_bench [-n lookups] "
+			    "[-r routes] [-f prefix-file]\n");
+			return (1);
+		}
+	}
+	srandom(1);
+	load_routes(file, want);
+	printf("%u prefixes\n", nroutes - 1);
+
+	if ((l0 = calloc(RTFIB_L0_SIZE, sizeof (*l0))) == NULL)
+		abort();
+	/* insert in random order, as route updates would arrive */
+	if ((order = malloc(nroutes * sizeof (*order))) == NULL)
+		abort();
+	for (i = 1; i < nroutes; i++)
+		order[i] = i;
+	for (i = nroutes - 1; i > 1; i--) {
+		j = 1 + xrand() % i;
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	t0 = now_ns();
+	for (i = 1; i < nroutes; i++)
+		update(routes[order[i]].prefix, routes[order[i]].plen, 0,
+		    order[i]);
+	t1 = now_ns();
+	for (i = 1; i < nroutes; i++)
+		btrie_set(routes[i].prefix, routes[i].plen, i);
+	printf("multibit trie: %u second level tables (%.1f MB), "
+	    "%.0f inserts/s\n", ntbl - 1 - ntblfree,
+	    (RTFIB_L0_SIZE + (double)(ntbl - 1 - ntblfree) * RTFIB_LN_SIZE) *
+	    4 / 1048576, (nroutes - 1) / ((t1 - t0) / 1e9));
+	verify("insert", nroutes + 1000000);
+
+	if ((addrs = malloc(nlookups * sizeof (*addrs))) == NULL)
+		abort();
+	for (i = 0; i < nlookups; i++)
+		addrs[i] = xrand();
+
+	t0 = now_ns();
+	for (i = 0; i < nlookups; i++)
+		sum += btrie_match(addrs[i]);
+	t1 = now_ns();
+	for (i = 0; i < nlookups; i++)
+		sum += fib_match(addrs[i]);
+	t2 = now_ns();
+	printf("binary trie   %8.2f Mlookups/s\n",
+	    nlookups / ((t1 - t0) / 1e3));
+	printf("multibit trie %8.2f Mlookups/s  (x%.1f)  [%llu]\n",
+	    nlookups / ((t2 - t1) / 1e3),
+	    (double)(t1 - t0) / (t2 - t1), (unsigned long long)sum);
+
+	/* delete in random order; the covering route takes over */
+	if ((deleted = calloc(nroutes, 1)) == NULL)
+		abort();
+	t0 = now_ns();
+	for (i = 1; i < nroutes; i++) {
+		struct route *key = &routes[order[i]], probe, *r;
+		uint32_t parent = 0;
+		int l;
+
+		for (l = key->plen - 1; l >= 0 && parent == 0; l--) {
+			probe.prefix = key->prefix & RTFIB_MASK(l);
+			probe.plen = l;
+			r = bsearch(&probe, routes + 1, nroutes - 1,
+			    sizeof (*routes), route_cmp);
+			if (r != NULL && !deleted[r - routes])
+				parent = r - routes;
+		}
+		update(key->prefix, key->plen, order[i], parent);
+		deleted[order[i]] = 1;
+		if (fib_match(key->prefix) == order[i]) {
+			fprintf(stderr, "delete: %08x/%u still matches %u\n",
+			    key->prefix, key->plen, fib_match(key->prefix));
+			return (1);
+		}
+	}
+	t1 = now_ns();
+	printf("deleted all, %.0f deletes/s, %u tables left\n",
+	    (nroutes - 1) / ((t1 - t0) / 1e9), ntbl - 1 - ntblfree);
+	return (0);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Bulk TCP send throughput and CPU cost per byte, with software TCP
+ * segmentation (net.link.generic.system.gso) off and then on.
+ *
+ * A sender thread writes -b byte buffers to a receiver for -t seconds.
+ * With -a the receiver is the discard service at that address; otherwise
+ * it is a thread in this process on 127.0.0.1, so the numbers include
+ * the receive side.  Reported are the throughput and the system CPU time
+ * spent per gigabyte, along with how many packets were segmented in
+ * software and into how many segments.  Toggling the sysctl needs root;
+ * otherwise only the current setting is measured.
+ *
+ * usage: gso_bench [-a address] [-b bufsize] [-t seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static struct sockaddr_in addr;
+static int bufsize = 128 * 1024;
+static int secs = 5;
+
+static uint64_t
+sysctl_quad(const char *name)
+{
+	uint64_t v = 0;
+	size_t len = sizeof (v);
+
+	if (sysctlbyname(name, &v, &len, NULL, 0) != 0)
+		return (0);
+	return (v);
+}
+
+static double
+tv2d(struct timeval tv)
+{
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static void *
+receiver(void *arg)
+{
+	int s = (int)(intptr_t)arg, c;
+	char *buf = malloc(bufsize);
+
+	while ((c = accept(s, NULL, NULL)) >= 0) {
+		while (read(c, buf, bufsize) > 0)
+			;
+		close(c);
+	}
+	return (NULL);
+}
+
+static void
+run(void)
+{
+	struct rusage r0, r1;
+	struct timeval t0, t1;
+	uint64_t bytes = 0, p0, s0;
+	double elapsed, sys;
+	char *buf;
+	ssize_t n;
+	int s;
+
+	if ((buf = calloc(1, bufsize)) == NULL ||
+	    (s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof (bufsize));
+	if (connect(s, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	p0 = sysctl_quad("net.link.generic.system.gso_packets");
+	s0 = sysctl_quad("net.link.generic.system.gso_segments");
+	getrusage(RUSAGE_SELF, &r0);
+	gettimeofday(&t0, NULL);
+	do {
+		if ((n = write(s, buf, bufsize)) < 0) {
+			perror("write");
+			exit(1);
+		}
+		bytes += n;
+		gettimeofday(&t1, NULL);
+	} while (t1.tv_sec - t0.tv_sec < secs);
+	getrusage(RUSAGE_SELF, &r1);
+	close(s);
+	free(buf);
+
+	elapsed = tv2d(t1) - tv2d(t0);
+	sys = tv2d(r1.ru_stime) - tv2d(r0.ru_stime);
+	printf("  %8.1f MB/s  %6.3f s system CPU per GB", bytes / elapsed / 1e6,
+	    sys / (bytes / 1e9));
+	p0 = sysctl_quad("net.link.generic.system.gso_packets") - p0;
+	s0 = sysctl_quad("net.link.generic.system.gso_segments") - s0;
+	if (p0 != 0)
+		printf("  (%llu packets -> %llu segments)",
+		    (unsigned long long)p0, (unsigned long long)s0);
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, s, i, on;
+	socklen_t len = sizeof (addr);
+	const char *host = NULL;
+	pthread_t t;
+
+	while ((ch = getopt(argc, argv, "a:b:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			host = optarg;
+			break;
+		case 'b':
+			bufsize = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: gso_bench [-a address] "
+			    "[-b bufsize] [-t seconds]\n");
+			return (1);
+		}
+	}
+	if (bufsize < 1 || secs < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return (1);
+	}
+
+	bzero(&addr, sizeof (addr));
+	addr.sin_len = sizeof (addr);
+	addr.sin_family = AF_INET;
+	if (host != NULL) {
+		addr.sin_addr.s_addr = inet_addr(host);
+		addr.sin_port = htons(9);
+	} else {
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    bind(s, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+		    listen(s, 4) < 0 ||
+		    getsockname(s, (struct sockaddr *)&addr, &len) < 0) {
+			perror("listen");
+			return (1);
+		}
+		pthread_create(&t, NULL, receiver, (void *)(intptr_t)s);
+	}
+
+	for (i = 0; i < 2; i++) {
+		on = i;
+		if (sysctlbyname("net.link.generic.system.gso", NULL, NULL,
+		    &on, sizeof (on)) != 0) {
+			if (i == 0)
+				continue;
+			printf("cannot set net.link.generic.system.gso, "
+			    "current setting:\n");
+		} else {
+			printf("gso %s:\n", on ? "on" : "off");
+		}
+		run();
+	}
+	return (0);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Reader scaling benchmark for lck_rw_t versus the per-cpu big-reader
+ * lck_brw_t.
+ *
+ * For 1..N threads, each thread takes the kernel test lock shared through
+ * debug.lck_rw_test_read / debug.lck_brw_test_read (DEVELOPMENT and DEBUG
+ * kernels only).  Reports the aggregate shared acquisitions per second for
+ * both lock types; with -w, a writer thread takes the lock exclusive every
+ * given number of microseconds while the readers run.
+ *
+ * usage: lck_brw_scaling [-t max_threads] [-i iterations] [-w writer_usecs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/sysctl.h>
+
+#include <mach/mach_time.h>
+
+static int		iterations = 100000;
+static int		batch = 1000;
+static int		writer_usecs;
+static const char	*read_oid;
+static const char	*write_oid;
+static volatile int	readers_done;
+
+static void *
+reader(__unused void *arg)
+{
+	int i;
+
+	for (i = 0; i < iterations; i += batch) {
+		if (sysctlbyname(read_oid, NULL, NULL, &batch, sizeof(batch)) != 0) {
+			perror(read_oid);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static void *
+writer(__unused void *arg)
+{
+	int one = 1;
+
+	while (!readers_done) {
+		if (sysctlbyname(write_oid, NULL, NULL, &one, sizeof(one)) != 0) {
+			perror(write_oid);
+			exit(1);
+		}
+		usleep(writer_usecs);
+	}
+	return NULL;
+}
+
+static double
+run(int nthreads, int big_reader)
+{
+	mach_timebase_info_data_t tb;
+	pthread_t threads[nthreads], wthread;
+	uint64_t start, elapsed_ns;
+	int i;
+
+	read_oid = big_reader ? "debug.lck_brw_test_read" : "debug.lck_rw_test_read";
+	write_oid = big_reader ? "debug.lck_brw_test_write" : "debug.lck_rw_test_write";
+	readers_done = 0;
+
+	if (writer_usecs != 0)
+		pthread_create(&wthread, NULL, writer, NULL);
+
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, reader, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	mach_timebase_info(&tb);
+	elapsed_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	readers_done = 1;
+	if (writer_usecs != 0)
+		pthread_join(wthread, NULL);
+
+	return (double)nthreads * iterations * 1e9 / (double)elapsed_ns;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_threads = 0;
+	size_t len = sizeof(max_threads);
+	int ch, n;
+
+	sysctlbyname("hw.ncpu", &max_threads, &len, NULL, 0);
+
+	while ((ch = getopt(argc, argv, "t:i:w:")) != -1) {
+		switch (ch) {
+		case 't': max_threads = atoi(optarg); break;
+		case 'i': iterations = atoi(optarg); break;
+		case 'w': writer_usecs = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] [-i iterations] [-w writer_usecs]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	if (iterations < batch)
+		iterations = batch;
+
+	printf("%8s %16s %16s\n", "threads", "lck_rw ops/s", "lck_brw ops/s");
+	for (n = 1; n <= max_threads; n *= 2)
+		printf("%8d %16.0f %16.0f\n", n, run(n, 0), run(n, 1));
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Kernel mutex contention microbenchmark.
+ *
+ * N threads repeatedly take a single kernel lck_mtx through the
+ * debug.lck_mtx_test_hold sysctl (DEVELOPMENT and DEBUG kernels only)
+ * and hold it for a short, fixed time.  Reports acquisitions per second
+ * and the adaptive spin histogram kept by the lock group.
+ *
+ * usage: lck_mtx_contention [-t threads] [-i iterations] [-h hold_usecs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/sysctl.h>
+
+#include <mach/mach_time.h>
+
+#define SPIN_BUCKETS	16
+
+/* Must match lck_mtx_test_stats_t in osfmk/kern/locks.h */
+struct lck_mtx_test_stats {
+	uint64_t	spin_cnt;
+	uint64_t	spin_acquire_cnt;
+	uint64_t	spin_block_cnt;
+	uint64_t	direct_wait_cnt;
+	uint64_t	spin_hist[SPIN_BUCKETS];
+};
+
+static int		iterations = 10000;
+static int		hold_usecs = 2;
+static pthread_mutex_t	start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	start_cond = PTHREAD_COND_INITIALIZER;
+static int		started;
+
+static void *
+contender(__unused void *arg)
+{
+	int i;
+
+	pthread_mutex_lock(&start_lock);
+	while (!started)
+		pthread_cond_wait(&start_cond, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+
+	for (i = 0; i < iterations; i++) {
+		if (sysctlbyname("debug.lck_mtx_test_hold", NULL, NULL,
+		    &hold_usecs, sizeof(hold_usecs)) != 0) {
+			perror("debug.lck_mtx_test_hold");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct lck_mtx_test_stats stats;
+	mach_timebase_info_data_t tb;
+	pthread_t *threads;
+	uint64_t start, elapsed_ns;
+	size_t len;
+	int nthreads = 4;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "t:i:h:")) != -1) {
+		switch (ch) {
+		case 't': nthreads = atoi(optarg); break;
+		case 'i': iterations = atoi(optarg); break;
+		case 'h': hold_usecs = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-i iterations] [-h hold_usecs]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nthreads < 1 || iterations < 1) {
+		fprintf(stderr, "threads and iterations must be positive\n");
+		return 1;
+	}
+
+	/* Writing anything resets the statistics. */
+	len = sizeof(stats);
+	if (sysctlbyname("debug.lck_mtx_test_stats", &stats, &len, &stats, sizeof(stats)) != 0) {
+		perror("debug.lck_mtx_test_stats (DEVELOPMENT kernel required)");
+		return 1;
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, contender, NULL);
+
+	pthread_mutex_lock(&start_lock);
+	start = mach_absolute_time();
+	started = 1;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	mach_timebase_info(&tb);
+	elapsed_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	len = sizeof(stats);
+	if (sysctlbyname("debug.lck_mtx_test_stats", &stats, &len, NULL, 0) != 0) {
+		perror("debug.lck_mtx_test_stats");
+		return 1;
+	}
+
+	printf("threads %d, hold %d us: %llu acquisitions in %llu ms, %.0f/s\n",
+	    nthreads, hold_usecs, (uint64_t)nthreads * iterations, elapsed_ns / 1000000,
+	    (double)nthreads * iterations * 1e9 / (double)elapsed_ns);
+	printf("spins %llu (acquired %llu, blocked %llu), no-spin waits %llu\n",
+	    stats.spin_cnt, stats.spin_acquire_cnt, stats.spin_block_cnt,
+	    stats.direct_wait_cnt);
+	for (i = 0; i < SPIN_BUCKETS; i++) {
+		if (stats.spin_hist[i] == 0)
+			continue;
+		if (i == 0)
+			printf("  <1 us     %llu\n", stats.spin_hist[i]);
+		else
+			printf("  <%-6u us %llu\n", 1U << i, stats.spin_hist[i]);
+	}
+	return 0;
+}
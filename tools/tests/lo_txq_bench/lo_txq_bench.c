@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+
+/*
+ * Aggregate TCP throughput of several concurrent streams over loopback,
+ * to compare a single lo0 transmit queue with several of them.
+ *
+ * -n streams are set up between 127.0.0.1:-p and ephemeral ports; each
+ * has a sender thread writing -b byte buffers for -t seconds and a
+ * receiver thread draining it.  Prints the aggregate and per-stream
+ * throughput.  lo0 only takes the multi-queue transmit path when booted
+ * with lo_txstart=1; compare lo_txqs=1 against lo_txqs=N (capped by
+ * net.link.generic.system.txq_max), and the flow hash against the CPU
+ * queue selection through net.link.generic.system.txq_select.
+ *
+ * usage: lo_txq_bench [-n streams] [-b bufsize] [-t seconds] [-p port]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <mach/mach_time.h>
+
+#define	MAXSTREAMS	64
+
+static volatile int stop;
+static int bufsize = 64 * 1024;
+static int snd[MAXSTREAMS], rcv[MAXSTREAMS];
+static unsigned long long received[MAXSTREAMS];
+
+static void *
+sender(void *arg)
+{
+	long id = (long)arg;
+	char *buf;
+	ssize_t n;
+
+	if ((buf = calloc(1, bufsize)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	while (!stop) {
+		if ((n = write(snd[id], buf, bufsize)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+	}
+	shutdown(snd[id], SHUT_WR);
+	free(buf);
+	return (NULL);
+}
+
+static void *
+receiver(void *arg)
+{
+	long id = (long)arg;
+	char *buf;
+	ssize_t n;
+
+	if ((buf = malloc(bufsize)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (;;) {
+		if ((n = read(rcv[id], buf, bufsize)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		if (n == 0)
+			break;
+		if (!stop)
+			received[id] += n;
+	}
+	free(buf);
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, nstreams = 4, secs = 10, port = 15556, s, on = 1;
+	pthread_t st[MAXSTREAMS], rt[MAXSTREAMS];
+	struct sockaddr_in addr;
+	mach_timebase_info_data_t tb;
+	uint64_t start, elapsed;
+	unsigned long long total = 0, min = ~0ULL, max = 0;
+	double nsec;
+	long i;
+
+	while ((ch = getopt(argc, argv, "n:b:t:p:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nstreams = atoi(optarg);
+			break;
+		case 'b':
+			bufsize = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: lo_txq_bench [-n streams] "
+			    "[-b bufsize] [-t seconds] [-p port]\n");
+			return (1);
+		}
+	}
+	if (nstreams < 1 || nstreams > MAXSTREAMS || bufsize < 1 || secs < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return (1);
+	}
+
+	bzero(&addr, sizeof (addr));
+	addr.sin_len = sizeof (addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) < 0 ||
+	    bind(s, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+	    listen(s, MAXSTREAMS) < 0) {
+		perror("listen");
+		return (1);
+	}
+	for (i = 0; i < nstreams; i++) {
+		if ((snd[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		    connect(snd[i], (struct sockaddr *)&addr,
+		    sizeof (addr)) < 0 ||
+		    (rcv[i] = accept(s, NULL, NULL)) < 0) {
+			perror("connect");
+			return (1);
+		}
+		setsockopt(snd[i], IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+	}
+	close(s);
+
+	(void) mach_timebase_info(&tb);
+	for (i = 0; i < nstreams; i++)
+		pthread_create(&rt[i], NULL, receiver, (void *)i);
+	start = mach_absolute_time();
+	for (i = 0; i < nstreams; i++)
+		pthread_create(&st[i], NULL, sender, (void *)i);
+	sleep(secs);
+	stop = 1;
+	elapsed = mach_absolute_time() - start;
+	for (i = 0; i < nstreams; i++)
+		pthread_join(st[i], NULL);
+	for (i = 0; i < nstreams; i++) {
+		pthread_join(rt[i], NULL);
+		close(snd[i]);
+		close(rcv[i]);
+	}
+
+	nsec = (double)elapsed * tb.numer / tb.denom;
+	for (i = 0; i < nstreams; i++)
+		total += received[i];
+	printf("%d streams, %d byte writes: %.1f Mbit/s\n", nstreams,
+	    bufsize, total * 8 * 1000.0 / nsec);
+	for (i = 0; i < nstreams; i++) {
+		if (received[i] < min)
+			min = received[i];
+		if (received[i] > max)
+			max = received[i];
+		printf("  stream %2ld: %.1f Mbit/s\n", i,
+		    received[i] * 8 * 1000.0 / nsec);
+	}
+	if (nstreams > 1)
+		printf("  min/max %.2f\n", max ? (double)min / max : 0.0);
+	return (0);
+}
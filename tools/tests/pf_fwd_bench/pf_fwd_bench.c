@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Packet rate benchmark for pf's sharded state table and fast path.
+ *
+ * For each thread count given with -t, every thread sends -n UDP datagrams
+ * of -b bytes over its own connected loopback socket pair, so each thread
+ * is one pf state and the flows spread over the state shards.  Every
+ * datagram crosses pf twice (out and in on lo0).  Each count is run with
+ * net.pf.fastpath on and then off, and the aggregate packet rate and the
+ * net.pf.fastpath_stats deltas are reported; with the fast path on, hits
+ * should account for nearly all packets once the states exist.
+ *
+ * pf must be enabled with a ruleset that keeps state on lo0, e.g.
+ *
+ *	pass quick on lo0 proto udp keep state
+ *
+ * and lo0 must not be listed in "set skip".  Run as root.
+ *
+ * usage: pf_fwd_bench [-n packets] [-b bytes] [-t threads,threads,...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mach/mach_time.h>
+
+/* matches struct pf_fastpath_stats in bsd/net/pf.c */
+struct pf_fastpath_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	ineligible;
+	uint64_t	bypass;
+};
+
+#define	MAX_THREADS	64
+
+static int npackets = 100000;
+static int pktsize = 64;
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cv = PTHREAD_COND_INITIALIZER;
+static int start_waiting, start_go;
+
+struct worker {
+	pthread_t	thread;
+	int		tx;
+	int		rx;
+	uint64_t	received;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pf_fwd_bench [-n packets] [-b bytes] "
+	    "[-t threads,threads,...]\n");
+	exit(1);
+}
+
+static void
+get_stats(struct pf_fastpath_stats *st)
+{
+	size_t len = sizeof (*st);
+
+	if (sysctlbyname("net.pf.fastpath_stats", st, &len, NULL, 0) != 0) {
+		perror("net.pf.fastpath_stats");
+		exit(1);
+	}
+}
+
+static void
+set_fastpath(int on)
+{
+	if (sysctlbyname("net.pf.fastpath", NULL, NULL, &on,
+	    sizeof (on)) != 0) {
+		perror("net.pf.fastpath");
+		exit(1);
+	}
+}
+
+static int
+udp_socket(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof (*sin);
+	int s, bufsize = 4 * 1024 * 1024;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	(void) setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof (bufsize));
+	memset(sin, 0, sizeof (*sin));
+	sin->sin_len = sizeof (*sin);
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)sin, sizeof (*sin)) != 0 ||
+	    getsockname(s, (struct sockaddr *)sin, &len) != 0) {
+		perror("bind");
+		exit(1);
+	}
+	return (s);
+}
+
+static void
+worker_setup(struct worker *w)
+{
+	struct sockaddr_in txa, rxa;
+	struct timeval tv = { 1, 0 };
+
+	w->tx = udp_socket(&txa);
+	w->rx = udp_socket(&rxa);
+	if (connect(w->tx, (struct sockaddr *)&rxa, sizeof (rxa)) != 0 ||
+	    connect(w->rx, (struct sockaddr *)&txa, sizeof (txa)) != 0) {
+		perror("connect");
+		exit(1);
+	}
+	(void) setsockopt(w->rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+}
+
+/* no pthread_barrier_t on this platform */
+static void
+start_wait(void)
+{
+	pthread_mutex_lock(&start_lock);
+	start_waiting--;
+	pthread_cond_broadcast(&start_cv);
+	while (!start_go)
+		pthread_cond_wait(&start_cv, &start_lock);
+	pthread_mutex_unlock(&start_lock);
+}
+
+static void
+start_release(void)
+{
+	pthread_mutex_lock(&start_lock);
+	while (start_waiting > 0)
+		pthread_cond_wait(&start_cv, &start_lock);
+	start_go = 1;
+	pthread_cond_broadcast(&start_cv);
+	pthread_mutex_unlock(&start_lock);
+}
+
+static void *
+worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char buf[65536];
+	int i;
+
+	w->received = 0;
+	start_wait();
+	for (i = 0; i < npackets; i++) {
+		if (send(w->tx, buf, pktsize, 0) < 0) {
+			if (errno == ENOBUFS)
+				continue;
+			perror("send");
+			break;
+		}
+		/* drain as we go so the receive buffer never overflows */
+		while (recv(w->rx, buf, sizeof (buf), MSG_DONTWAIT) > 0)
+			w->received++;
+	}
+	while (recv(w->rx, buf, sizeof (buf), 0) > 0)
+		w->received++;
+	return (NULL);
+}
+
+static void
+run(int nthreads, int fastpath)
+{
+	static mach_timebase_info_data_t tb;
+	struct worker workers[MAX_THREADS];
+	struct pf_fastpath_stats before, after;
+	uint64_t start, elapsed, received = 0;
+	double secs;
+	int i;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+
+	set_fastpath(fastpath);
+	for (i = 0; i < nthreads; i++)
+		worker_setup(&workers[i]);
+	start_waiting = nthreads;
+	start_go = 0;
+
+	get_stats(&before);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+		    &workers[i]);
+	start_release();
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		received += workers[i].received;
+	}
+	elapsed = mach_absolute_time() - start;
+	get_stats(&after);
+
+	/* the receive timeout at the end of each worker is not traffic */
+	secs = (double)elapsed * tb.numer / tb.denom / 1e9 - 1.0;
+	if (secs <= 0)
+		secs = 1e-3;
+
+	printf("%3d threads  fastpath %-3s  %10.0f pps  %5.1f%% delivered  "
+	    "hits %llu misses %llu ineligible %llu bypass %llu\n",
+	    nthreads, fastpath ? "on" : "off", received / secs,
+	    100.0 * received / ((double)nthreads * npackets),
+	    after.hits - before.hits, after.misses - before.misses,
+	    after.ineligible - before.ineligible,
+	    after.bypass - before.bypass);
+
+	for (i = 0; i < nthreads; i++) {
+		close(workers[i].tx);
+		close(workers[i].rx);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int threads[MAX_THREADS], nthreadcounts = 0, saved, i, ch;
+	size_t len = sizeof (saved);
+	char *p;
+
+	while ((ch = getopt(argc, argv, "n:b:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			npackets = atoi(optarg);
+			break;
+		case 'b':
+			pktsize = atoi(optarg);
+			break;
+		case 't':
+			for (p = strtok(optarg, ","); p != NULL &&
+			    nthreadcounts < MAX_THREADS; p = strtok(NULL, ","))
+				threads[nthreadcounts++] = atoi(p);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (npackets <= 0 || pktsize <= 0 || pktsize > 65000)
+		usage();
+	if (nthreadcounts == 0) {
+		threads[0] = 1;
+		threads[1] = 2;
+		threads[2] = 4;
+		threads[3] = 8;
+		nthreadcounts = 4;
+	}
+	for (i = 0; i < nthreadcounts; i++)
+		if (threads[i] < 1 || threads[i] > MAX_THREADS)
+			usage();
+
+	if (sysctlbyname("net.pf.fastpath", &saved, &len, NULL, 0) != 0) {
+		perror("net.pf.fastpath");
+		return (1);
+	}
+	for (i = 0; i < nthreadcounts; i++) {
+		run(threads[i], 1);
+		run(threads[i], 0);
+	}
+	set_fastpath(saved);
+	return (0);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Rule evaluation benchmark for compiled pf filter rulesets.
+ *
+ * For each ruleset size given with -r, loads a synthetic main ruleset of
+ * that many "block" rules which alternate direction and protocol and each
+ * name a different network and port, so that the skip steps never apply,
+ * followed by a final "pass ... no state" rule.  Then it times -n UDP
+ * datagrams sent over lo0; none of them match a block rule and, as no
+ * state is kept, every one is run through the whole ruleset twice (out
+ * and in).  Each size is measured with the ruleset evaluated linearly
+ * (net.pf.compile_min_rules=0) and compiled.
+ *
+ * pf must be enabled.  The main ruleset is replaced; the one in -f (by
+ * default /etc/pf.conf) is loaded again at the end.  Run as root.
+ *
+ * usage: pf_rules_bench [-n packets] [-f pf.conf] [-r rules,rules,...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mach/mach_time.h>
+
+#define	MAX_SIZES	32
+#define	BENCH_PORT	9	/* discard */
+
+static int npackets = 200000;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pf_rules_bench [-n packets] [-f pf.conf] "
+	    "[-r rules,rules,...]\n");
+	exit(1);
+}
+
+static void
+set_min_rules(int n)
+{
+	if (sysctlbyname("net.pf.compile_min_rules", NULL, NULL, &n,
+	    sizeof (n)) != 0) {
+		perror("net.pf.compile_min_rules");
+		exit(1);
+	}
+}
+
+static int
+pfctl_load(const char *path)
+{
+	char cmd[1024];
+
+	snprintf(cmd, sizeof (cmd), "/sbin/pfctl -q -f %s", path);
+	return (system(cmd));
+}
+
+static void
+load_ruleset(int nrules)
+{
+	char path[] = "/tmp/pf_rules_bench.XXXXXX";
+	FILE *f;
+	int fd, i;
+
+	if ((fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+		perror("mkstemp");
+		exit(1);
+	}
+	for (i = 0; i < nrules; i++)
+		fprintf(f, "block drop %s quick on lo0 proto %s "
+		    "from 10.%d.%d.0/24 to any port %d\n",
+		    (i & 1) ? "out" : "in", (i & 2) ? "udp" : "tcp",
+		    (i >> 8) & 0xff, i & 0xff, 1024 + (i % 60000));
+	fprintf(f, "pass quick on lo0 all no state\n");
+	fclose(f);
+	if (pfctl_load(path) != 0) {
+		fprintf(stderr, "pfctl failed to load %s\n", path);
+		unlink(path);
+		exit(1);
+	}
+	unlink(path);
+}
+
+static double
+run(int s, struct sockaddr_in *sin)
+{
+	static mach_timebase_info_data_t tb;
+	uint64_t start, elapsed;
+	char buf[64];
+	int i;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+
+	memset(buf, 0, sizeof (buf));
+	start = mach_absolute_time();
+	for (i = 0; i < npackets; i++)
+		(void) sendto(s, buf, sizeof (buf), 0,
+		    (struct sockaddr *)sin, sizeof (*sin));
+	elapsed = mach_absolute_time() - start;
+	return (npackets / ((double)elapsed * tb.numer / tb.denom / 1e9));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int sizes[MAX_SIZES], nsizes = 0, saved, i, s, ch;
+	const char *conf = "/etc/pf.conf";
+	size_t len = sizeof (saved);
+	struct sockaddr_in sin;
+	double linear, compiled;
+	char *p;
+
+	while ((ch = getopt(argc, argv, "n:f:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			npackets = atoi(optarg);
+			break;
+		case 'f':
+			conf = optarg;
+			break;
+		case 'r':
+			for (p = strtok(optarg, ","); p != NULL &&
+			    nsizes < MAX_SIZES; p = strtok(NULL, ","))
+				sizes[nsizes++] = atoi(p);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (npackets <= 0)
+		usage();
+	if (nsizes == 0) {
+		sizes[0] = 100;
+		sizes[1] = 1000;
+		sizes[2] = 10000;
+		nsizes = 3;
+	}
+
+	if (sysctlbyname("net.pf.compile_min_rules", &saved, &len,
+	    NULL, 0) != 0) {
+		perror("net.pf.compile_min_rules");
+		return (1);
+	}
+	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		perror("socket");
+		return (1);
+	}
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(BENCH_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < nsizes; i++) {
+		if (sizes[i] < 0)
+			usage();
+		/* the ruleset is compiled, or not, when it is loaded */
+		set_min_rules(0);
+		load_ruleset(sizes[i]);
+		linear = run(s, &sin);
+		set_min_rules(1);
+		load_ruleset(sizes[i]);
+		compiled = run(s, &sin);
+		printf("%6d rules  linear %10.0f pps  compiled %10.0f pps  "
+		    "(x%.1f)\n", sizes[i], linear, compiled,
+		    compiled / linear);
+	}
+
+	close(s);
+	set_min_rules(saved);
+	if (pfctl_load(conf) != 0)
+		fprintf(stderr, "pfctl failed to reload %s\n", conf);
+	return (0);
+}
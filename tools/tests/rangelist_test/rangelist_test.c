@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * User space unit test and benchmark for the HFS invalid range list
+ * (bsd/hfs/rangelist.c), built directly from the kernel source.
+ *
+ * The unit test applies random rl_add/rl_remove calls to both the
+ * range list and a flat model of the file, and after every step checks that the list is sorted,
+ * coalesced and matches the model, and that rl_scan returns the first
+ * overlapping range.
+ *
+ * The benchmark builds a sparse list of n ranges inserted out of order
+ * (as when a large file is written randomly), then times rl_scan
+ * lookups and rl_remove of every range.
+ *
+ * usage: rangelist_test [-s seed] [-i iterations] [-n ranges]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <mach/mach_time.h>
+
+#include <hfs/rangelist.h>
+
+#define MODEL_SIZE	512
+
+static unsigned char	model[MODEL_SIZE];
+static struct rl_head	list;
+
+static void
+model_set(off_t start, off_t end, unsigned char val)
+{
+	off_t i;
+
+	for (i = start; i <= end; i++)
+		model[i] = val;
+}
+
+static const char *
+ovname(enum rl_overlaptype t)
+{
+	static const char *names[] = { "none", "matching", "contains", "contained", "starts-before", "ends-after" };
+
+	return names[t];
+}
+
+static void
+fail(const char *what, int step)
+{
+	struct rl_entry *r;
+
+	fprintf(stderr, "FAIL at step %d: %s\n  list:", step, what);
+	for (r = rl_first(&list); r; r = rl_next(&list, r))
+		fprintf(stderr, " [%lld,%lld]", (long long)r->rl_start, (long long)r->rl_end);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/*
+ * Walk the list and the model in step; every maximal run of set
+ * offsets in the model must be exactly one entry in the list.
+ */
+static void
+check_list(int step)
+{
+	struct rl_entry *r = rl_first(&list);
+	off_t i = 0, start, end;
+
+	if ((r == NULL) != (rl_empty(&list) != 0))
+		fail("rl_empty disagrees with rl_first", step);
+
+	while (i < MODEL_SIZE) {
+		if (model[i] == 0) {
+			i++;
+			continue;
+		}
+		start = i;
+		while (i < MODEL_SIZE && model[i])
+			i++;
+		end = i - 1;
+
+		if (r == NULL)
+			fail("list is missing a range", step);
+		if (r->rl_start != start || r->rl_end != end)
+			fail("list range does not match model", step);
+		r = rl_next(&list, r);
+	}
+	if (r != NULL)
+		fail("list has an extra range", step);
+}
+
+static enum rl_overlaptype
+classify(struct rl_entry *r, off_t start, off_t end)
+{
+	if (r->rl_start == start && r->rl_end == end)
+		return RL_MATCHINGOVERLAP;
+	if (r->rl_start <= start && r->rl_end >= end)
+		return RL_OVERLAPCONTAINSRANGE;
+	if (start <= r->rl_start && end >= r->rl_end)
+		return RL_OVERLAPISCONTAINED;
+	if (r->rl_start < start)
+		return RL_OVERLAPSTARTSBEFORE;
+	return RL_OVERLAPENDSAFTER;
+}
+
+static void
+check_scan(int step, off_t start, off_t end)
+{
+	struct rl_entry *overlap;
+	enum rl_overlaptype t;
+	off_t i, first = -1;
+	char msg[128];
+
+	for (i = start; i <= end; i++) {
+		if (model[i]) {
+			first = i;
+			break;
+		}
+	}
+	t = rl_scan(&list, start, end, &overlap);
+
+	if (first < 0) {
+		if (t != RL_NOOVERLAP)
+			fail("rl_scan found an overlap in a clean range", step);
+		return;
+	}
+	if (t == RL_NOOVERLAP || overlap == NULL)
+		fail("rl_scan missed an overlap", step);
+	if (first < overlap->rl_start || first > overlap->rl_end)
+		fail("rl_scan did not return the first overlapping range", step);
+	if (t != classify(overlap, start, end)) {
+		snprintf(msg, sizeof(msg), "rl_scan [%lld,%lld] returned %s, expected %s",
+		    (long long)start, (long long)end, ovname(t), ovname(classify(overlap, start, end)));
+		fail(msg, step);
+	}
+}
+
+static void
+random_range(off_t *start, off_t *end)
+{
+	off_t len;
+
+	*start = random() % MODEL_SIZE;
+	len = (random() % 4) ? random() % 8 : random() % 64;
+	*end = *start + len;
+	if (*end >= MODEL_SIZE)
+		*end = MODEL_SIZE - 1;
+}
+
+static void
+unit_test(int iterations)
+{
+	off_t start, end;
+	int step;
+
+	rl_init(&list);
+	memset(model, 0, sizeof(model));
+
+	for (step = 0; step < iterations; step++) {
+		random_range(&start, &end);
+
+		if (random() % 3) {
+			rl_add(start, end, &list);
+			model_set(start, end, 1);
+		} else {
+			rl_remove(start, end, &list);
+			model_set(start, end, 0);
+		}
+		check_list(step);
+
+		random_range(&start, &end);
+		check_scan(step, start, end);
+	}
+	rl_remove(0, MODEL_SIZE - 1, &list);
+	if (!rl_empty(&list))
+		fail("list not empty after removing everything", step);
+
+	printf("unit test: %d steps passed\n", iterations);
+}
+
+static void
+shuffle(off_t *a, int n)
+{
+	off_t t;
+	int i, j;
+
+	for (i = n - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = a[i];
+		a[i] = a[j];
+		a[j] = t;
+	}
+}
+
+static void
+benchmark(int n)
+{
+	mach_timebase_info_data_t tb;
+	struct rl_entry *overlap;
+	uint64_t t0, t1, t2, t3;
+	off_t *offsets;
+	int i, hits = 0;
+
+	if ((offsets = malloc(n * sizeof(off_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	/* ranges of 4 blocks every 8 blocks, so nothing coalesces */
+	for (i = 0; i < n; i++)
+		offsets[i] = (off_t)i * 8 * 4096;
+	shuffle(offsets, n);
+
+	rl_init(&list);
+	mach_timebase_info(&tb);
+
+	t0 = mach_absolute_time();
+	for (i = 0; i < n; i++)
+		rl_add(offsets[i], offsets[i] + 4 * 4096 - 1, &list);
+	t1 = mach_absolute_time();
+	for (i = 0; i < n; i++) {
+		off_t off = (off_t)(random() % n) * 8 * 4096 + (random() % 8) * 4096;
+
+		if (rl_scan(&list, off, off + 4095, &overlap) != RL_NOOVERLAP)
+			hits++;
+	}
+	t2 = mach_absolute_time();
+	shuffle(offsets, n);
+	for (i = 0; i < n; i++)
+		rl_remove(offsets[i], offsets[i] + 4 * 4096 - 1, &list);
+	t3 = mach_absolute_time();
+
+	if (!rl_empty(&list)) {
+		fprintf(stderr, "FAIL: list not empty after benchmark\n");
+		exit(1);
+	}
+	printf("benchmark: %d ranges\n", n);
+	printf("  rl_add     %8.1f ns/op\n", (double)(t1 - t0) * tb.numer / tb.denom / n);
+	printf("  rl_scan    %8.1f ns/op (%d hits)\n", (double)(t2 - t1) * tb.numer / tb.denom / n, hits);
+	printf("  rl_remove  %8.1f ns/op\n", (double)(t3 - t2) * tb.numer / tb.denom / n);
+
+	free(offsets);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int seed = (unsigned int)getpid();
+	int iterations = 200000;
+	int n = 100000;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s:i:n:")) != -1) {
+		switch (ch) {
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s seed] [-i iterations] [-n ranges]\n", argv[0]);
+			exit(1);
+		}
+	}
+	printf("seed %u\n", seed);
+	srandom(seed);
+
+	unit_test(iterations);
+	if (n > 0)
+		benchmark(n);
+
+	return 0;
+}
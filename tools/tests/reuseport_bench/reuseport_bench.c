@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * TCP connection rate over loopback with several listeners sharing one
+ * port through SO_REUSEPORT.
+ *
+ * -l listener threads each bind their own socket to 127.0.0.1:-p and
+ * accept and close connections; -c client threads connect and close as
+ * fast as they can for -t seconds.  Prints the connection rate and how
+ * the connections were spread over the listeners; with
+ * net.inet.ip.reuseport_lb set they should be close to even, without it
+ * nearly all go to one listener.  With -l 1 it measures the plain
+ * connection rate, i.e. the cost of the PCB hash lookups.
+ *
+ * usage: reuseport_bench [-l listeners] [-c clients] [-t seconds] [-p port]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define	MAXTHREADS	256
+
+static struct sockaddr_in addr;
+static volatile int stop;
+static unsigned long accepted[MAXTHREADS];
+static unsigned long connected[MAXTHREADS];
+
+static void *
+listener(void *arg)
+{
+	long id = (long)arg;
+	int s, c, on = 1;
+	struct linger l = { 1, 0 };	/* reset, so no TIME_WAIT pile-up */
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0 ||
+	    bind(s, (struct sockaddr *)&addr, sizeof (addr)) < 0 ||
+	    listen(s, 1024) < 0) {
+		perror("listener");
+		exit(1);
+	}
+	while (!stop) {
+		if ((c = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+		setsockopt(c, SOL_SOCKET, SO_LINGER, &l, sizeof (l));
+		close(c);
+		accepted[id]++;
+	}
+	return (NULL);
+}
+
+static void *
+client(void *arg)
+{
+	long id = (long)arg;
+	struct linger l = { 1, 0 };
+	int s;
+
+	while (!stop) {
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			exit(1);
+		}
+		setsockopt(s, SOL_SOCKET, SO_LINGER, &l, sizeof (l));
+		if (connect(s, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+			connected[id]++;
+		close(s);
+	}
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, nlisten = 4, nclient = 4, secs = 10, port = 15555, s;
+	pthread_t lt[MAXTHREADS], ct[MAXTHREADS];
+	unsigned long total = 0, min = ~0UL, max = 0;
+	long i;
+
+	while ((ch = getopt(argc, argv, "l:c:t:p:")) != -1) {
+		switch (ch) {
+		case 'l':
+			nlisten = atoi(optarg);
+			break;
+		case 'c':
+			nclient = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: reuseport_bench [-l listeners] "
+			    "[-c clients] [-t seconds] [-p port]\n");
+			return (1);
+		}
+	}
+	if (nlisten < 1 || nlisten > MAXTHREADS ||
+	    nclient < 1 || nclient > MAXTHREADS || secs < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return (1);
+	}
+
+	bzero(&addr, sizeof (addr));
+	addr.sin_len = sizeof (addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < nlisten; i++)
+		pthread_create(&lt[i], NULL, listener, (void *)i);
+	sleep(1);	/* let every listener bind */
+	for (i = 0; i < nclient; i++)
+		pthread_create(&ct[i], NULL, client, (void *)i);
+	sleep(secs);
+	stop = 1;
+	for (i = 0; i < nclient; i++)
+		pthread_join(ct[i], NULL);
+
+	/* wake up the listeners still blocked in accept() */
+	for (i = 0; i < nlisten * 4; i++) {
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) >= 0) {
+			(void) connect(s, (struct sockaddr *)&addr,
+			    sizeof (addr));
+			close(s);
+		}
+	}
+	for (i = 0; i < nclient; i++)
+		total += connected[i];
+	printf("%d listeners, %d clients: %.0f connections/s\n",
+	    nlisten, nclient, (double)total / secs);
+	for (i = 0; i < nlisten; i++) {
+		if (accepted[i] < min)
+			min = accepted[i];
+		if (accepted[i] > max)
+			max = accepted[i];
+		printf("  listener %2ld: %lu\n", i, accepted[i]);
+	}
+	if (nlisten > 1)
+		printf("  min/max %.2f\n", max ? (double)min / max : 0.0);
+	return (0);
+}
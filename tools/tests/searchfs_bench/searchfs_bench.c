@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Catalog scan benchmark for searchfs(2) on HFS.
+ *
+ * Optionally populates the volume with a synthetic catalog (-n files,
+ * spread over directories of 1000), then times a full-catalog partial
+ * name search once for each read-ahead setting given with -r, by setting
+ * vfs.generic.hfs.search_runs (0 is the sequential scanner).  Reports the
+ * elapsed time, the catalog bytes scanned per second and the time the scan
+ * spent waiting for read-ahead, from vfs.generic.hfs.scan_stats.
+ *
+ * A synthetic catalog image can be made with:
+ *	hdiutil create -size 8g -type SPARSE -fs HFS+J -volname scan /tmp/scan
+ *	hdiutil attach /tmp/scan.sparseimage
+ *	sudo searchfs_bench -n 2000000 /Volumes/scan
+ * Later runs can drop -n to reuse the catalog.  Run as root so the sysctl
+ * can be set, and purge(8) between runs for a cold cache.
+ *
+ * usage: searchfs_bench [-n files] [-r runs,runs,...] [-s name] volume
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/attr.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+
+#include <mach/mach_time.h>
+
+/* matches struct hfs_scan_stats in bsd/hfs/hfscommon/headers/BTreeScanner.h */
+struct hfs_scan_stats {
+	int64_t		hss_scans;
+	int64_t		hss_parallel_scans;
+	int64_t		hss_reads;
+	int64_t		hss_read_bytes;
+	int64_t		hss_read_time;
+	int64_t		hss_leaf_nodes;
+	int64_t		hss_stalls;
+	int64_t		hss_stall_time;
+	int64_t		hss_discarded;
+};
+
+struct packed_name {
+	uint32_t	size;
+	attrreference_t	ref;
+	char		name[256];
+} __attribute__((packed));
+
+#define FILES_PER_DIR	1000
+#define MAX_MATCHES	1024
+
+static const char	*volume;
+static const char	*pattern = "f0000042";
+
+static void
+populate(int nfiles)
+{
+	char path[1024];
+	int i, fd;
+
+	for (i = 0; i < nfiles; i++) {
+		if (i % FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "%s/d%05d", volume, i / FILES_PER_DIR);
+			if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+				perror(path);
+				exit(1);
+			}
+		}
+		snprintf(path, sizeof(path), "%s/d%05d/f%08d", volume, i / FILES_PER_DIR, i);
+		if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0) {
+			perror(path);
+			exit(1);
+		}
+		close(fd);
+	}
+	sync();
+}
+
+static void
+get_stats(struct hfs_scan_stats *stats)
+{
+	size_t len = sizeof(*stats);
+
+	memset(stats, 0, sizeof(*stats));
+	sysctlbyname("vfs.generic.hfs.scan_stats", stats, &len, NULL, 0);
+}
+
+/* Returns the number of matches, and the elapsed time in *elapsed_ns. */
+static unsigned long
+search(uint64_t *elapsed_ns)
+{
+	static char results[64 * 1024];
+	struct fssearchblock sb;
+	struct attrlist retattrs;
+	struct packed_name params1, params2;
+	struct searchstate state;
+	mach_timebase_info_data_t tb;
+	unsigned long nmatches, total = 0;
+	unsigned int options;
+	uint64_t start;
+	int err;
+
+	memset(&retattrs, 0, sizeof(retattrs));
+	retattrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+	retattrs.commonattr = ATTR_CMN_NAME;
+
+	memset(&params1, 0, sizeof(params1));
+	strlcpy(params1.name, pattern, sizeof(params1.name));
+	params1.ref.attr_dataoffset = sizeof(attrreference_t);
+	params1.ref.attr_length = (uint32_t)strlen(params1.name) + 1;
+	params1.size = sizeof(uint32_t) + sizeof(attrreference_t) + params1.ref.attr_length;
+	params2 = params1;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.returnattrs = &retattrs;
+	sb.returnbuffer = results;
+	sb.returnbuffersize = sizeof(results);
+	sb.maxmatches = MAX_MATCHES;
+	sb.timelimit.tv_sec = 1;
+	sb.searchparams1 = &params1;
+	sb.sizeofsearchparams1 = params1.size;
+	sb.searchparams2 = &params2;
+	sb.sizeofsearchparams2 = params2.size;
+	sb.searchattrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+	sb.searchattrs.commonattr = ATTR_CMN_NAME;
+
+	options = SRCHFS_START | SRCHFS_MATCHPARTIALNAMES | SRCHFS_MATCHFILES | SRCHFS_MATCHDIRS;
+	start = mach_absolute_time();
+	do {
+		nmatches = 0;
+		err = searchfs(volume, &sb, &nmatches, 0x08000103, options, &state);
+		if (err != 0 && errno != EAGAIN) {
+			perror("searchfs");
+			exit(1);
+		}
+		total += nmatches;
+		options &= ~SRCHFS_START;
+	} while (err != 0);
+	mach_timebase_info(&tb);
+	*elapsed_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	return total;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct hfs_scan_stats before, after;
+	char *runs_list = strdup("0,1,2,4,8");
+	char *p;
+	uint64_t elapsed_ns;
+	unsigned long nmatches;
+	uint32_t runs;
+	double secs;
+	int nfiles = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (ch) {
+		case 'n': nfiles = atoi(optarg); break;
+		case 'r': runs_list = strdup(optarg); break;
+		case 's': pattern = optarg; break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	volume = argv[optind];
+
+	if (nfiles > 0)
+		populate(nfiles);
+
+	printf("%6s %10s %10s %12s %12s %10s\n", "runs", "matches", "secs", "MB/s", "leaf nodes", "stall ms");
+	for (p = strtok(runs_list, ","); p != NULL; p = strtok(NULL, ",")) {
+		runs = (uint32_t)atoi(p);
+		if (sysctlbyname("vfs.generic.hfs.search_runs", NULL, NULL, &runs, sizeof(runs)) != 0) {
+			perror("vfs.generic.hfs.search_runs");
+			return 1;
+		}
+		get_stats(&before);
+		nmatches = search(&elapsed_ns);
+		get_stats(&after);
+
+		secs = (double)elapsed_ns / 1e9;
+		printf("%6u %10lu %10.3f %12.1f %12lld %10.1f\n", runs, nmatches, secs,
+		    (double)(after.hss_read_bytes - before.hss_read_bytes) / (1024.0 * 1024.0) / secs,
+		    (long long)(after.hss_leaf_nodes - before.hss_leaf_nodes),
+		    (double)(after.hss_stall_time - before.hss_stall_time) / 1e6);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n files] [-r runs,runs,...] [-s name] volume\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2012 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+
+/*
+ * Measures sendto(2) throughput of an unconnected UDP socket that cycles
+ * through many destinations, the pattern of a DNS server, with the
+ * per-destination route cache (net.inet.udp.rtcache) off and then on.
+ *
+ * Datagrams go to -d consecutive addresses starting at -a, port 9
+ * (discard).  The default, 127.0.0.2 onwards, stays on the loopback
+ * interface; point -a at a directly connected subnet to exercise a real
+ * driver.  Toggling the sysctl needs root; otherwise only the current
+ * setting is measured.  The cache hit rate comes from
+ * net.inet.udp.rtcache_{hits,misses,stale}.
+ *
+ * usage: udp_sendto_bench [-a first-address] [-d destinations] [-n datagrams] [-s size]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mach/mach_time.h>
+
+static uint64_t
+now_ns(void)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0)
+		mach_timebase_info(&tb);
+	return (mach_absolute_time() * tb.numer / tb.denom);
+}
+
+static uint64_t
+sysctl_quad(const char *name)
+{
+	uint64_t v = 0;
+	size_t len = sizeof (v);
+
+	if (sysctlbyname(name, &v, &len, NULL, 0) != 0)
+		return (0);
+	return (v);
+}
+
+static void
+run(int s, uint32_t first, int ndst, int n, char *buf, int size)
+{
+	struct sockaddr_in sin;
+	uint64_t t0, t1, h0, m0, s0, h, m, st;
+	int i, err = 0;
+
+	bzero(&sin, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);
+
+	h0 = sysctl_quad("net.inet.udp.rtcache_hits");
+	m0 = sysctl_quad("net.inet.udp.rtcache_misses");
+	s0 = sysctl_quad("net.inet.udp.rtcache_stale");
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		sin.sin_addr.s_addr = htonl(first + (i % ndst));
+		if (sendto(s, buf, size, 0, (struct sockaddr *)&sin,
+		    sizeof (sin)) < 0) {
+			if (errno != ENOBUFS) {
+				perror("sendto");
+				exit(1);
+			}
+			err++;
+		}
+	}
+	t1 = now_ns();
+	h = sysctl_quad("net.inet.udp.rtcache_hits") - h0;
+	m = sysctl_quad("net.inet.udp.rtcache_misses") - m0;
+	st = sysctl_quad("net.inet.udp.rtcache_stale") - s0;
+
+	printf("  %8.0f datagrams/s  %6.2f us/sendto  (%d ENOBUFS)\n",
+	    n / ((t1 - t0) / 1e9), (t1 - t0) / 1e3 / n, err);
+	if (h + m + st != 0)
+		printf("  cache: %llu hits, %llu misses, %llu stale "
+		    "(%.1f%% hit rate)\n", (unsigned long long)h,
+		    (unsigned long long)m, (unsigned long long)st,
+		    100.0 * h / (h + m + st));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int s, ch, ndst = 8, n = 1000000, size = 64, on, i;
+	struct sockaddr_in sin;
+	uint32_t first;
+	char *buf;
+
+	first = ntohl(inet_addr("127.0.0.2"));
+	while ((ch = getopt(argc, argv, "a:d:n:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			first = ntohl(inet_addr(optarg));
+			break;
+		case 'd':
+			ndst = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: udp_sendto_bench "
+			    "[-a first-address] [-d destinations] "
+			    "[-n datagrams] [-s size]\n");
+			return (1);
+		}
+	}
+	if (ndst < 1 || n < 1 || size < 0) {
+		fprintf(stderr, "bad arguments\n");
+		return (1);
+	}
+	if ((buf = calloc(1, size + 1)) == NULL ||
+	    (s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return (1);
+	}
+	/* bind a local port so sendto takes the unconnected fast path */
+	bzero(&sin, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	if (bind(s, (struct sockaddr *)&sin, sizeof (sin)) < 0) {
+		perror("bind");
+		return (1);
+	}
+	printf("%d datagrams of %d bytes to %d destinations\n", n, size, ndst);
+
+	for (i = 0; i < 2; i++) {
+		on = i;
+		if (sysctlbyname("net.inet.udp.rtcache", NULL, NULL,
+		    &on, sizeof (on)) != 0) {
+			if (i == 0)
+				continue;
+			printf("cannot set net.inet.udp.rtcache, "
+			    "current setting:\n");
+		} else {
+			printf("rtcache %s:\n", on ? "on" : "off");
+		}
+		run(s, first, ndst, n, buf, size);
+	}
+	return (0);
+}
@@ -104,7 +104,7 @@ struct test_entry   g_tests[] =
 	{1, &mkfifo_test, NULL, "mkfifo, read, write"},
 	{1, &quotactl_test, NULL, "quotactl"},
 	{1, &limit_tests, NULL, "getrlimit, setrlimit"},
-	{1, &directory_tests, NULL, "getattrlist, getdirentriesattr, setattrlist"},
+	{1, &directory_tests, NULL, "getattrlist, getattrlistbulk, getdirentriesattr, setattrlist"},
 #if !TARGET_OS_EMBEDDED
 	{1, &getdirentries_test, NULL, "getdirentries"},
 	{1, &exchangedata_test, NULL, "exchangedata"},
@@ -4297,6 +4297,42 @@ int directory_tests( void * the_argp )
 		printf( "getdirentriesattr failed to find test file. \n" );
 		goto test_failed_exit;
 	}
+
+#ifdef SYS_getattrlistbulk
+	/* validate getattrlistbulk finds the same file with the same attributes */
+	lseek( my_fd, 0, SEEK_SET );
+	found_it = 0;
+	for ( ;; ) {
+		char *			my_ptr;
+		test_attr_buf *	my_recp;
+
+		my_err = syscall( SYS_getattrlistbulk, my_fd, &my_attrlist, my_bufp, (1024 * 5), (uint64_t)0 );
+		if ( my_err < 0 ) {
+			printf( "getattrlistbulk call failed.  got errno %d - %s. \n", errno, strerror( errno ) );
+			goto test_failed_exit;
+		}
+		if ( my_err == 0 )
+			break;
+
+		my_ptr = my_bufp;
+		for ( i = 0; i < my_err; i++ ) {
+			my_recp = (test_attr_buf *) my_ptr;
+			if ( my_recp->obj_id.fid_objno == my_obj_id.fid_objno &&
+				 my_recp->obj_id.fid_generation == my_obj_id.fid_generation ) {
+				found_it = 1;
+				if ( my_recp->obj_type != VREG || my_recp->backup_time.tv_sec != my_new_backup_time.tv_sec ) {
+					printf( "getattrlistbulk returned incorrect data for test file. \n" );
+					goto test_failed_exit;
+				}
+			}
+			my_ptr += my_recp->length;
+		}
+	}
+	if ( found_it == 0 ) {
+		printf( "getattrlistbulk failed to find test file. \n" );
+		goto test_failed_exit;
+	}
+#endif
 	
 	my_err = 0;
 	goto test_passed_exit;